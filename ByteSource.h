@@ -10,8 +10,12 @@
 
 #include <wdt/Protocol.h>
 #include <wdt/util/CommonImpl.h>
+#include <wdt/util/PathArena.h>
 
+#include <functional>
+#include <memory>
 #include <string>
+#include <vector>
 
 namespace facebook {
 namespace wdt {
@@ -25,10 +29,50 @@ struct SourceMetaData {
   SourceMetaData(const SourceMetaData &that) = delete;
   SourceMetaData &operator=(const SourceMetaData &that) = delete;
 
-  /// full filepath
-  std::string fullPath;
-  /// relative pathname
-  std::string relPath;
+  /// @return   path relative to the root directory
+  std::string getRelPath() const {
+    if (relPath_) {
+      return *relPath_;
+    }
+    return pathArena_ ? pathArena_->getRelPath(pathId_) : std::string();
+  }
+
+  /// @return   path the file is read from
+  std::string getFullPath() const {
+    if (fullPath_) {
+      return *fullPath_;
+    }
+    return pathArena_ ? pathArena_->getFullPath(pathId_) : std::string();
+  }
+
+  /**
+   * Sets the paths of a file, with the relative path interned in an arena
+   * which must outlive the metadata. The full path is only kept if it is not
+   * the root of the arena followed by the relative path, e.g. for a symlink
+   */
+  void setPaths(PathArena &arena, const std::string &relPath,
+                const std::string &fullPath) {
+    pathArena_ = &arena;
+    pathId_ = arena.add(relPath);
+    relPath_.reset();
+    fullPath_.reset();
+    const std::string &rootDir = arena.getRootDir();
+    const bool derived =
+        fullPath.size() == rootDir.size() + relPath.size() &&
+        fullPath.compare(0, rootDir.size(), rootDir) == 0 &&
+        fullPath.compare(rootDir.size(), std::string::npos, relPath) == 0;
+    if (!derived) {
+      fullPath_ = std::make_unique<std::string>(fullPath);
+    }
+  }
+
+  /// sets the paths of a file, kept in the metadata
+  void setPaths(const std::string &relPath, const std::string &fullPath) {
+    pathArena_ = nullptr;
+    relPath_ = std::make_unique<std::string>(relPath);
+    fullPath_ = std::make_unique<std::string>(fullPath);
+  }
+
   /**
    * Sequence number associated with the file. Sequence number
    * represents the order in which files were first added to the queue.
@@ -50,15 +94,67 @@ struct SourceMetaData {
   int fd{-1};
   /// If true, fd was opened by wdt and must be closed after transfer finish
   bool needToClose{false};
+  /**
+   * Key used to read sources in disk order, physical offset of the file or
+   * inode number if unknown. -1 if disk ordering is disabled
+   */
+  int64_t diskOrderKey{-1};
+  /// region of the disk the file lives in, used to split regions across
+  /// threads. -1 if disk ordering is disabled
+  int64_t diskRegion{-1};
+  /// device (st_dev) the file lives on, -1 if readers per device are not
+  /// limited
+  int64_t deviceId{-1};
+  /// index of the device in the queue, -1 if not tracked
+  int32_t deviceIndex{-1};
+  /// data ranges of a sparse file, only those are sent. Empty if the whole
+  /// file is sent
+  std::vector<Interval> dataExtents;
+  /// SHA-256 of the content, only set for the files hashed to find duplicates
+  std::string contentHash;
+  /// seq-id of the file with the same content sent instead of this one, 0 if
+  /// the data of this file is sent
+  int64_t duplicateOfSeqId{0};
+  /**
+   * If true, the data is read from a stream of unknown size (pipe, socket)
+   * and copied to the spool file fd as it is read. The size is then 0, the
+   * receiver finds it from the blocks written
+   */
+  bool isStream{false};
+  /// priority class of the file, the files of higher classes are sent first
+  int priority{0};
+
+ private:
+  /// arena holding the relative path, nullptr if relPath_ holds it
+  const PathArena *pathArena_{nullptr};
+  int64_t pathId_{-1};
+  /// paths not derived from the arena, nullptr otherwise
+  std::unique_ptr<std::string> relPath_;
+  std::unique_ptr<std::string> fullPath_;
 };
 
+class ByteSource;
+
+/**
+ * Creates the source of a block of a file discovered, so that applications
+ * can read the data of the files from elsewhere than the local filesystem
+ * (object stores, custom block devices...)
+ *
+ * @param metadata    file of the block, owned by the queue
+ * @param size        size of the block
+ * @param offset      offset of the block in the file
+ */
+typedef std::function<std::unique_ptr<ByteSource>(
+    SourceMetaData *metadata, int64_t size, int64_t offset)>
+    ByteSourceFactory;
+
 class ByteSource {
  public:
   virtual ~ByteSource() {
   }
 
   /// @return identifier for the source
-  virtual const std::string &getIdentifier() const = 0;
+  virtual std::string getIdentifier() const = 0;
 
   /// @return number of bytes in this source
   virtual int64_t getSize() const = 0;
@@ -91,6 +187,87 @@ class ByteSource {
    */
   virtual char *read(int64_t &size) = 0;
 
+  /**
+   * Sets the buffer the following calls to read() fill. By default data is
+   * read into the buffer of the thread context the source was opened with.
+   * This is reset by open().
+   *
+   * @param buffer    buffer to read into, nullptr for the thread buffer
+   */
+  virtual void setReadBuffer(const Buffer *buffer) = 0;
+
+  /**
+   * Sets the thread context the following reads are accounted in, for reads
+   * done by another thread than the one which opened the source. This is
+   * reset by open().
+   *
+   * @param threadCtx   context of the reading thread, nullptr for the one
+   *                    the source was opened with
+   */
+  virtual void setReadThreadCtx(ThreadCtx * /* threadCtx */) {
+  }
+
+  /**
+   * Gives direct access to the underlying file, for callers able to send the
+   * data without reading it into user space (sendfile). The next unread byte
+   * is at file offset getOffset() plus the number of bytes read so far. Bytes
+   * consumed that way have to be reported through markRead().
+   *
+   * @return      file descriptor, or -1 if the data can only be obtained
+   *              through read()
+   */
+  virtual int getZeroCopyFd() = 0;
+
+  /// Marks numBytes as read, for data consumed without calling read()
+  virtual void markRead(int64_t numBytes) = 0;
+
+  /**
+   * @return    whether the data can be read through submitRead() and
+   *            waitForRead(), with many reads in flight. Used by the read
+   *            ahead pipeline of the sender threads (read_ahead_buffers),
+   *            read() is used otherwise
+   */
+  virtual bool supportsAsyncReads() const {
+    return false;
+  }
+
+  /**
+   * Starts reading the next bytes of the source, following the ones of the
+   * reads already submitted. Must not block on the data.
+   *
+   * @param buffer      memory to read into, not reused till the read is
+   *                    returned by waitForRead()
+   * @param capacity    max number of bytes to read
+   *
+   * @return            number of bytes the read is for, 0 if all the bytes
+   *                    are already submitted, -1 on error
+   */
+  virtual int64_t submitRead(char * /* buffer */, int64_t /* capacity */) {
+    return -1;
+  }
+
+  /**
+   * Waits for the oldest read submitted and not returned yet. finished() is
+   * true once all of them are returned, hasError() on failure.
+   *
+   * @param size    set to the number of bytes read
+   *
+   * @return        buffer of the read, nullptr on error
+   */
+  virtual char *waitForRead(int64_t &size) {
+    size = 0;
+    return nullptr;
+  }
+
+  /**
+   * Hint that the source is going to be read soon, given by the queue for
+   * the next source of a thread. Sources backed by remote storage can start
+   * fetching their data. Called from any thread, maybe more than once, and
+   * maybe before open(). Does nothing by default.
+   */
+  virtual void prefetch() {
+  }
+
   /// Advances ByteSource offset by numBytes
   virtual void advanceOffset(int64_t numBytes) = 0;
 
@@ -78,7 +78,8 @@ namespace wdt {
   X(ALREADY_EXISTS)             /** Create attempt for existing id */          \
   X(GLOBAL_CHECKPOINT_ABORT)    /** Abort due to global checkpoint */          \
   X(INVALID_REQUEST) /** Request for creation of wdt object invalid */         \
-  X(SENDER_START_TIMED_OUT) /** Sender start timed out */
+  X(SENDER_START_TIMED_OUT) /** Sender start timed out */                      \
+  X(NO_SPACE)               /** Not enough space on the destination */
 
 enum ErrorCode {
 #define X(A) A,
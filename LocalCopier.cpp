@@ -0,0 +1,483 @@
+/**
+ * Copyright (c) 2014-present, Facebook, Inc.
+ * All rights reserved.
+ *
+ * This source code is licensed under the BSD-style license found in the
+ * LICENSE file in the root directory of this source tree. An additional grant
+ * of patent rights can be found in the PATENTS file in the same directory.
+ */
+#include <wdt/LocalCopier.h>
+
+#include <wdt/Throttler.h>
+
+#include <folly/Memory.h>
+#include <stdlib.h>
+#include <unistd.h>
+
+namespace facebook {
+namespace wdt {
+
+/**
+ * @return    absolute path of a directory, symlinks resolved, which does not
+ *            need to exist: only the part of it which exists is resolved
+ */
+static std::string getRealPath(std::string path) {
+  std::string missing;
+  while (!path.empty()) {
+    char *resolved = ::realpath(path.c_str(), nullptr);
+    if (resolved != nullptr) {
+      std::string realPath(resolved);
+      free(resolved);
+      return realPath + missing;
+    }
+    const size_t slash = path.find_last_of('/');
+    const std::string last =
+        (slash == std::string::npos ? path : path.substr(slash + 1));
+    if (!last.empty()) {
+      missing = "/" + last + missing;
+    }
+    if (slash == std::string::npos) {
+      path = ".";
+    } else {
+      path = (slash == 0 ? "/" : path.substr(0, slash));
+    }
+  }
+  return missing;
+}
+
+LocalCopier::LocalCopier(const WdtTransferRequest &transferRequest,
+                         const std::string &destDirectory)
+    : destDirectory_(destDirectory) {
+  WLOG(INFO) << "WDT local copier " << Protocol::getFullVersion();
+  transferRequest_ = transferRequest;
+  progressReportIntervalMillis_ = options_.progress_report_interval_millis;
+}
+
+ErrorCode LocalCopier::validateTransferRequest() {
+  ErrorCode code = transferRequest_.errorCode;
+  if (code == OK &&
+      (transferRequest_.directory.empty() || destDirectory_.empty())) {
+    WLOG(ERROR) << "Local copy needs a source and a destination directory";
+    code = INVALID_REQUEST;
+  }
+  if (code == OK) {
+    // the copies would be found again by the discovery
+    const std::string srcPath = getRealPath(transferRequest_.directory);
+    const std::string destPath = getRealPath(destDirectory_);
+    if (destPath == srcPath || destPath.compare(0, srcPath.size() + 1,
+                                                srcPath + "/") == 0) {
+      WLOG(ERROR) << "Local copy destination " << destPath
+                  << " is in its source " << srcPath;
+      code = INVALID_REQUEST;
+    }
+  }
+  transferRequest_.errorCode = code;
+  return code;
+}
+
+const WdtTransferRequest &LocalCopier::init() {
+  if (validateTransferRequest() != OK) {
+    WLOG(ERROR) << "Couldn't validate the local copy of "
+                << transferRequest_.directory << " to " << destDirectory_;
+  }
+  return transferRequest_;
+}
+
+LocalCopier::~LocalCopier() {
+  if (getTransferStatus() == ONGOING) {
+    WLOG(WARNING) << "Local copier being deleted. Forcefully aborting the copy";
+    abort(ABORTED_BY_APPLICATION);
+  }
+  finish();
+}
+
+const std::string &LocalCopier::getDestDirectory() const {
+  return destDirectory_;
+}
+
+ErrorCode LocalCopier::transferAsync() {
+  {
+    std::lock_guard<std::mutex> lock(mutex_);
+    if (transferStatus_ != NOT_STARTED) {
+      WLOG(ERROR) << "duplicate start() call detected " << transferStatus_;
+      return ALREADY_EXISTS;
+    }
+  }
+  if (transferRequest_.errorCode != OK) {
+    return transferRequest_.errorCode;
+  }
+  const int numThreads = std::max(1, options_.num_ports);
+  // the fds of a thread would be the same for a file and its copy
+  options_.fd_cache_size = 0;
+
+  dirQueue_ = std::make_unique<DirectorySourceQueue>(
+      options_, transferRequest_.directory, &abortCheckerCallback_);
+  dirQueue_->setIncludePattern(options_.include_regex);
+  dirQueue_->setExcludePattern(options_.exclude_regex);
+  dirQueue_->setPruneDirPattern(options_.prune_dir_regex);
+  dirQueue_->setFollowSymlinks(options_.follow_symlinks);
+  dirQueue_->setBlockSizeMbytes(options_.block_size_mbytes);
+  dirQueue_->setNumClientThreads(numThreads);
+  int numQueueShards = options_.source_queue_shards > 0
+                           ? options_.source_queue_shards
+                           : numThreads;
+  if (options_.max_readers_per_device > 0) {
+    // devices get shards of their own
+    numQueueShards = std::max<int>(numQueueShards, numThreads);
+  }
+  dirQueue_->setNumQueueShards(numQueueShards);
+  dirQueue_->setMaxReadersPerDevice(options_.max_readers_per_device);
+  dirQueue_->setOpenFilesDuringDiscovery(options_.open_files_during_discovery);
+  dirQueue_->setDirectReads(options_.odirect_reads);
+  dirQueue_->setDiskOrderReads(options_.disk_order_reads);
+  dirQueue_->setAdaptiveBlockSize(options_.adaptive_block_size);
+  dirQueue_->setSparseFiles(options_.sparse_files);
+  dirQueue_->setNumDiscoveryThreads(options_.num_discovery_threads);
+  if (!transferRequest_.fileInfo.empty() ||
+      transferRequest_.disableDirectoryTraversal) {
+    dirQueue_->setFileInfo(transferRequest_.fileInfo);
+  }
+  transferLogManager_ =
+      std::make_unique<TransferLogManager>(options_, destDirectory_);
+  fileCreator_ = std::make_unique<FileCreator>(
+      destDirectory_, numThreads, *transferLogManager_, options_.skip_writes);
+
+  if (!progressReporter_) {
+    WVLOG(1) << "No progress reporter provided, making a default one";
+    progressReporter_ = std::make_unique<ProgressReporter>(transferRequest_);
+  }
+  const bool progressReportEnabled = progressReportIntervalMillis_ > 0;
+  if (throttler_) {
+    WLOG(INFO) << "Skipping throttler setup. External throttler set."
+               << "Throttler details : " << *throttler_;
+  } else {
+    configureThrottler();
+  }
+  if (throttler_) {
+    throttler_->startTransfer();
+  }
+  WLOG(INFO) << "Copying " << transferRequest_.directory << " to "
+             << destDirectory_ << " with " << numThreads << " threads";
+  startTime_ = Clock::now();
+  {
+    // published to getMetrics()
+    std::lock_guard<std::mutex> lock(mutex_);
+    threadStats_ = std::vector<TransferStats>(numThreads);
+    for (int i = 0; i < numThreads; i++) {
+      threadCtxs_.emplace_back(std::make_unique<ThreadCtx>(options_, true, i));
+    }
+    numActiveThreads_ = numThreads;
+    transferStatus_ = ONGOING;
+  }
+  dirThread_ = dirQueue_->buildQueueAsynchronously();
+  for (int i = 0; i < numThreads; i++) {
+    copyThreads_.emplace_back(&LocalCopier::copyLoop, this, i);
+  }
+  if (progressReportEnabled) {
+    progressReporter_->start();
+    progressReporterThread_ = std::thread(&LocalCopier::reportProgress, this);
+  }
+  return OK;
+}
+
+std::unique_ptr<TransferReport> LocalCopier::transfer() {
+  transferAsync();
+  return finish();
+}
+
+void LocalCopier::copyLoop(int threadIndex) {
+  ThreadCtx &threadCtx = *threadCtxs_[threadIndex];
+  TransferStats &threadStats = threadStats_[threadIndex];
+  while (true) {
+    const ErrorCode abortCode = getCurAbortCode();
+    if (abortCode != OK) {
+      WLOG(ERROR) << "Thread " << threadIndex << " aborting copy "
+                  << errorCodeToStr(abortCode);
+      threadStats.setLocalErrorCode(ABORT);
+      break;
+    }
+    ErrorCode transferStatus;
+    std::unique_ptr<ByteSource> source =
+        dirQueue_->getNextSource(&threadCtx, transferStatus);
+    if (!source) {
+      break;
+    }
+    TransferStats stats = copyBlock(threadCtx, *source);
+    threadStats += stats;
+    source->addTransferStats(stats);
+    source->close();
+    std::lock_guard<std::mutex> lock(sourceStatsMutex_);
+    if (stats.getLocalErrorCode() != OK) {
+      failedSourceStats_.add(source->getMetaData().seqId,
+                             source->getTransferStats());
+    } else if (options_.full_reporting) {
+      copiedSourceStats_.add(source->getMetaData().seqId,
+                             source->getTransferStats());
+    }
+  }
+  std::lock_guard<std::mutex> lock(mutex_);
+  if (--numActiveThreads_ == 0) {
+    endTime_ = Clock::now();
+    WLOG(INFO) << "Last thread finished "
+               << durationSeconds(endTime_ - startTime_) << " for local copy";
+    transferStatus_ = FINISHED;
+    if (throttler_) {
+      throttler_->endTransfer();
+    }
+  }
+}
+
+TransferStats LocalCopier::copyBlock(ThreadCtx &threadCtx,
+                                     ByteSource &source) {
+  const SourceMetaData &metadata = source.getMetaData();
+  BlockDetails blockDetails;
+  blockDetails.fileName = metadata.getRelPath();
+  blockDetails.seqId = metadata.seqId;
+  blockDetails.fileSize = metadata.size;
+  blockDetails.offset = source.getOffset();
+  blockDetails.dataSize = source.getSize();
+  blockDetails.sparseFile = !metadata.dataExtents.empty();
+  TransferStats stats;
+  if (options_.skip_writes) {
+    stats.addDataBytes(blockDetails.dataSize);
+    stats.addEffectiveBytes(0, blockDetails.dataSize);
+    stats.incrNumBlocks();
+    return stats;
+  }
+  const int destFd = fileCreator_->openForBlocks(threadCtx, &blockDetails);
+  if (destFd < 0) {
+    WLOG(ERROR) << "Unable to open " << blockDetails.fileName << " in "
+                << destDirectory_;
+    stats.setLocalErrorCode(FILE_WRITE_ERROR);
+    stats.incrFailedAttempts();
+    return stats;
+  }
+  if (throttler_) {
+    throttler_->limit(threadCtx, blockDetails.dataSize);
+  }
+  const int srcFd = source.getZeroCopyFd();
+  bool copied;
+  {
+    PerfStatCollector statCollector(threadCtx, PerfStatReport::FILE_WRITE);
+    if (srcFd >= 0) {
+      copied = FileCreator::copyFileRange(srcFd, destFd, blockDetails.offset,
+                                          blockDetails.dataSize);
+    } else {
+      copied = copyThroughBuffer(source, destFd);
+    }
+  }
+  if (!copied) {
+    WPLOG(ERROR) << "Unable to copy " << blockDetails.dataSize << " bytes at "
+                 << blockDetails.offset << " of " << blockDetails.fileName;
+  } else if (srcFd >= 0) {
+    source.markRead(blockDetails.dataSize);
+  }
+  if (copied && options_.fsync) {
+    PerfStatCollector statCollector(threadCtx, PerfStatReport::FSYNC_STATS);
+    if (::fsync(destFd) != 0) {
+      WPLOG(ERROR) << "fsync failed for " << blockDetails.fileName;
+      copied = false;
+    }
+  }
+  {
+    PerfStatCollector statCollector(threadCtx, PerfStatReport::FILE_CLOSE);
+    if (::close(destFd) != 0) {
+      WPLOG(ERROR) << "close failed for " << blockDetails.fileName;
+      copied = false;
+    }
+  }
+  if (!copied) {
+    stats.setLocalErrorCode(source.hasError() ? BYTE_SOURCE_READ_ERROR
+                                              : FILE_WRITE_ERROR);
+    stats.incrFailedAttempts();
+    return stats;
+  }
+  stats.addDataBytes(blockDetails.dataSize);
+  stats.addEffectiveBytes(0, blockDetails.dataSize);
+  stats.incrNumBlocks();
+  return stats;
+}
+
+bool LocalCopier::copyThroughBuffer(ByteSource &source, int destFd) {
+  int64_t offset = source.getOffset();
+  while (!source.finished()) {
+    int64_t size;
+    const char *data = source.read(size);
+    if (data == nullptr || source.hasError()) {
+      return false;
+    }
+    for (int64_t written = 0; written < size;) {
+      const ssize_t numWritten =
+          ::pwrite(destFd, data + written, size - written, offset + written);
+      if (numWritten <= 0) {
+        return false;
+      }
+      written += numWritten;
+    }
+    offset += size;
+  }
+  return true;
+}
+
+TransferStats LocalCopier::getGlobalTransferStats() const {
+  TransferStats globalStats;
+  for (const auto &stats : threadStats_) {
+    globalStats += stats;
+  }
+  return globalStats;
+}
+
+std::unique_ptr<TransferReport> LocalCopier::getTransferReport() {
+  int64_t totalFileSize = 0;
+  int64_t fileCount = 0;
+  bool fileDiscoveryFinished = false;
+  if (dirQueue_ != nullptr) {
+    totalFileSize = dirQueue_->getTotalSize();
+    fileCount = dirQueue_->getCount();
+    fileDiscoveryFinished = dirQueue_->fileDiscoveryFinished();
+  }
+  double totalTime = durationSeconds(Clock::now() - startTime_);
+  std::unique_ptr<TransferReport> transferReport =
+      std::make_unique<TransferReport>(getGlobalTransferStats(), totalTime,
+                                       totalFileSize, fileCount,
+                                       fileDiscoveryFinished);
+  if (getTransferStatus() == NOT_STARTED &&
+      transferReport->getSummary().getErrorCode() == OK) {
+    WLOG(INFO) << "Copy not started, setting the error code to ERROR";
+    transferReport->setErrorCode(ERROR);
+  }
+  return transferReport;
+}
+
+TransferMetrics LocalCopier::getMetrics() {
+  std::lock_guard<std::mutex> lock(mutex_);
+  if (transferStatus_ == THREADS_JOINED) {
+    return finalMetrics_;
+  }
+  TransferMetrics metrics;
+  if (transferStatus_ == NOT_STARTED) {
+    return metrics;
+  }
+  metrics.setTransfer(getGlobalTransferStats(), transferStatus_ == ONGOING,
+                      durationSeconds(Clock::now() - startTime_));
+  metrics.queuedSources = dirQueue_->getNumQueuedSources();
+  metrics.queuedBytes = dirQueue_->getNumQueuedBytes();
+  return metrics;
+}
+
+std::unique_ptr<TransferReport> LocalCopier::finish() {
+  std::unique_lock<std::mutex> instanceLock(instanceManagementMutex_);
+  const TransferStatus status = getTransferStatus();
+  if (status == NOT_STARTED) {
+    WLOG(WARNING) << "Even though copy has not started, finish is called";
+    return getTransferReport();
+  }
+  if (status == THREADS_JOINED) {
+    WVLOG(1) << "Threads have already been joined. Returning the"
+             << " existing transfer report";
+    return getTransferReport();
+  }
+  for (auto &copyThread : copyThreads_) {
+    copyThread.join();
+  }
+  dirThread_.join();
+  WDT_CHECK(numActiveThreads_ == 0);
+  setTransferStatus(THREADS_JOINED);
+  if (progressReporterThread_.joinable()) {
+    progressReporterThread_.join();
+  }
+  const int64_t previouslyCopiedBytes = 0;
+  std::vector<TransferStats> threadStats(std::make_move_iterator(
+      threadStats_.begin()), std::make_move_iterator(threadStats_.end()));
+  // sources which could not be opened or were left in the queue
+  failedSourceStats_.merge(dirQueue_->getFailedSourceStats());
+  const double totalTime = durationSeconds(endTime_ - startTime_);
+  std::unique_ptr<TransferReport> transferReport =
+      std::make_unique<TransferReport>(
+          copiedSourceStats_, failedSourceStats_, threadStats,
+          dirQueue_->getFailedDirectories(), totalTime,
+          dirQueue_->getTotalSize(), dirQueue_->getCount(),
+          previouslyCopiedBytes, dirQueue_->fileDiscoveryFinished());
+  {
+    std::lock_guard<std::mutex> lock(mutex_);
+    finalMetrics_.setTransfer(transferReport->getSummary(), false, totalTime);
+  }
+  if (progressReportIntervalMillis_ > 0) {
+    progressReporter_->end(transferReport);
+  }
+  logPerfStats();
+  WLOG(INFO) << "Total local copy time = " << totalTime << " seconds ("
+             << dirQueue_->getDirectoryTime() << " dirTime)"
+             << ". Transfer summary : " << *transferReport << "\n"
+             << WDT_LOG_PREFIX << "Total local copy throughput = "
+             << transferReport->getThroughputMBps() << " Mbytes/sec";
+  return transferReport;
+}
+
+void LocalCopier::reportProgress() {
+  WDT_CHECK(progressReportIntervalMillis_ > 0);
+  int throughputUpdateIntervalMillis =
+      options_.throughput_update_interval_millis;
+  WDT_CHECK(throughputUpdateIntervalMillis >= 0);
+  int throughputUpdateInterval =
+      throughputUpdateIntervalMillis / progressReportIntervalMillis_;
+
+  int64_t lastEffectiveBytes = 0;
+  std::chrono::time_point<Clock> lastUpdateTime = Clock::now();
+  int intervalsSinceLastUpdate = 0;
+  double currentThroughput = 0;
+
+  auto waitingTime = std::chrono::milliseconds(progressReportIntervalMillis_);
+  WLOG(INFO) << "Progress reporter tracking every "
+             << progressReportIntervalMillis_ << " ms";
+  // updated in place for every interval, see TransferReport::
+  // startProgressUpdate
+  auto transferReport =
+      std::make_unique<TransferReport>(TransferStats(), 0, 0, 0, false);
+  while (true) {
+    {
+      std::unique_lock<std::mutex> lock(mutex_);
+      conditionFinished_.wait_for(lock, waitingTime);
+      if (transferStatus_ == THREADS_JOINED) {
+        break;
+      }
+    }
+    transferReport->startProgressUpdate(
+        durationSeconds(Clock::now() - startTime_), dirQueue_->getTotalSize(),
+        dirQueue_->getCount(), dirQueue_->fileDiscoveryFinished());
+    for (const auto &stats : threadStats_) {
+      transferReport->addTransferStats(stats);
+    }
+    intervalsSinceLastUpdate++;
+    if (intervalsSinceLastUpdate >= throughputUpdateInterval) {
+      auto curTime = Clock::now();
+      int64_t curEffectiveBytes =
+          transferReport->getSummary().getEffectiveDataBytes();
+      double time = durationSeconds(curTime - lastUpdateTime);
+      currentThroughput = (curEffectiveBytes - lastEffectiveBytes) / time;
+      lastEffectiveBytes = curEffectiveBytes;
+      lastUpdateTime = curTime;
+      intervalsSinceLastUpdate = 0;
+    }
+    transferReport->setCurrentThroughput(currentThroughput);
+
+    progressReporter_->progress(transferReport);
+    if (reportPerfSignal_.notified()) {
+      logPerfStats();
+    }
+  }
+}
+
+void LocalCopier::logPerfStats() const {
+  if (!options_.enable_perf_stat_collection) {
+    return;
+  }
+  PerfStatReport report(options_);
+  for (const auto &threadCtx : threadCtxs_) {
+    report += threadCtx->getPerfReport();
+  }
+  report += dirQueue_->getPerfReport();
+  WLOG(INFO) << report;
+}
+}
+}  // namespace facebook::wdt
@@ -0,0 +1,138 @@
+/**
+ * Copyright (c) 2014-present, Facebook, Inc.
+ * All rights reserved.
+ *
+ * This source code is licensed under the BSD-style license found in the
+ * LICENSE file in the root directory of this source tree. An additional grant
+ * of patent rights can be found in the PATENTS file in the same directory.
+ */
+#pragma once
+
+#include <wdt/WdtBase.h>
+#include <wdt/util/DirectorySourceQueue.h>
+#include <wdt/util/FileCreator.h>
+#include <wdt/util/TransferLogManager.h>
+#include <chrono>
+#include <memory>
+#include <thread>
+#include <vector>
+
+namespace facebook {
+namespace wdt {
+
+/**
+ * Copies a directory into another directory of the same host, without
+ * sockets. The files are discovered by a DirectorySourceQueue like for the
+ * sender, and created and allocated by a FileCreator like for the receiver.
+ * Parallel threads then copy the blocks inside the kernel, as reflinks where
+ * the filesystem supports them. An instance copies only once. This class is
+ * not thread safe.
+ */
+class LocalCopier : public WdtBase {
+ public:
+  /**
+   * @param transferRequest   request whose directory (or file info) is the
+   *                          source of the copy
+   * @param destDirectory     directory the files are copied into
+   */
+  LocalCopier(const WdtTransferRequest &transferRequest,
+              const std::string &destDirectory);
+
+  /// Setup before start (@see WdtBase.h)
+  const WdtTransferRequest &init() override;
+
+  /// Aborts the copy if it has not finished, and waits for the threads
+  ~LocalCopier() override;
+
+  /// Starts the discovery and the copying threads, call finish() to wait
+  ErrorCode transferAsync() override;
+
+  /**
+   * Joins the threads spawned by transferAsync(). Can be called multiple
+   * times
+   *
+   * @return    transfer report
+   */
+  std::unique_ptr<TransferReport> finish() override;
+
+  /// Blocking version of transferAsync() followed by finish()
+  std::unique_ptr<TransferReport> transfer();
+
+  /// @see WdtBase::getMetrics
+  TransferMetrics getMetrics() override;
+
+  /// @return   directory the files are copied into
+  const std::string &getDestDirectory() const;
+
+  /// @return    minimal transfer report using the stats of the threads
+  std::unique_ptr<TransferReport> getTransferReport();
+
+ private:
+  /// Validates the source and destination directories
+  ErrorCode validateTransferRequest() override;
+
+  /// main loop of a copying thread, till the queue is empty
+  void copyLoop(int threadIndex);
+
+  /**
+   * Copies a block to the same offset of the destination file, creating and
+   * allocating the file for its first block
+   *
+   * @param threadCtx   context of the calling thread
+   * @param source      block to copy
+   *
+   * @return            stats of the copy
+   */
+  TransferStats copyBlock(ThreadCtx &threadCtx, ByteSource &source);
+
+  /**
+   * Copies a block through the buffer of the thread, for the sources whose
+   * file descriptor can not be used directly (O_DIRECT reads)
+   *
+   * @return    whether the whole block was written
+   */
+  bool copyThroughBuffer(ByteSource &source, int destFd);
+
+  /// Get the sum of all the thread stats
+  TransferStats getGlobalTransferStats() const;
+
+  /// Periodically sends the progress to the progress reporter
+  void reportProgress();
+
+  void logPerfStats() const override;
+
+  /// directory the files are copied into
+  const std::string destDirectory_;
+  /// finds the files of the source directory
+  std::unique_ptr<DirectorySourceQueue> dirQueue_;
+  /// never opened, the copy does not log for download resumption
+  std::unique_ptr<TransferLogManager> transferLogManager_;
+  /// creates and allocates the destination files
+  std::unique_ptr<FileCreator> fileCreator_;
+  /// context of each copying thread
+  std::vector<std::unique_ptr<ThreadCtx>> threadCtxs_;
+  /// stats of each copying thread
+  std::vector<TransferStats> threadStats_;
+  /// stats of the sources copied, only kept with full_reporting
+  SourceStatsTable copiedSourceStats_;
+  /// stats of the sources which failed to copy
+  SourceStatsTable failedSourceStats_;
+  /// protects copiedSourceStats_ and failedSourceStats_
+  std::mutex sourceStatsMutex_;
+  /// number of copying threads still running
+  int numActiveThreads_{0};
+  /// interval between progress reports, 0 for none
+  int progressReportIntervalMillis_;
+  /// Thread that is running the discovery of files using the dirQueue_
+  std::thread dirThread_;
+  /// threads copying the blocks
+  std::vector<std::thread> copyThreads_;
+  /// thread calling reportProgress()
+  std::thread progressReporterThread_;
+  /// Time at which the copy was started
+  std::chrono::time_point<Clock> startTime_;
+  /// Time at which the last copying thread finished
+  std::chrono::time_point<Clock> endTime_;
+};
+}
+}  // namespace facebook::wdt
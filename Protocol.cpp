@@ -12,6 +12,8 @@
 #include <wdt/WdtOptions.h>
 #include <wdt/util/SerializationUtil.h>
 
+#include <string.h>
+
 namespace facebook {
 namespace wdt {
 
@@ -34,6 +36,17 @@ const int Protocol::DELETE_CMD_VERSION = 26;
 const int Protocol::VARINT_CHANGE = 27;
 const int Protocol::HEART_BEAT_VERSION = 29;
 const int Protocol::PERIODIC_ENCRYPTION_IV_CHANGE_VERSION = 30;
+const int Protocol::FILE_BATCH_VERSION = 31;
+const int Protocol::SPARSE_FILE_VERSION = 32;
+const int Protocol::RECEIVER_RATE_VERSION = 33;
+const int Protocol::DELTA_RESUMPTION_VERSION = 34;
+const int Protocol::STREAMED_FILE_CHUNKS_VERSION = 35;
+const int Protocol::COMPACT_FILE_CHUNKS_VERSION = 36;
+const int Protocol::MANIFEST_VERSION = 37;
+const int Protocol::COMPRESSION_VERSION = 38;
+const int Protocol::DEDUP_VERSION = 39;
+const int Protocol::CHECKSUM_TYPE_VERSION = 40;
+const int Protocol::KTLS_VERSION = 41;
 
 /* All methods of Protocol class are static (functions) */
 
@@ -94,6 +107,16 @@ void FileChunksInfo::mergeChunks() {
   chunks_ = mergedChunks;
 }
 
+bool FileChunksInfo::appendBlockHashes(const FileChunksInfo &fileChunksInfo) {
+  if (fileChunksInfo.blockHashSize_ != blockHashSize_ ||
+      fileChunksInfo.firstHashedBlock_ !=
+          firstHashedBlock_ + getNumBlockHashes()) {
+    return false;
+  }
+  blockHashes_.append(fileChunksInfo.blockHashes_);
+  return true;
+}
+
 std::vector<Interval> FileChunksInfo::getRemainingChunks(int64_t curFileSize) {
   std::vector<Interval> remainingChunks;
   int64_t curStart = 0;
@@ -151,14 +174,31 @@ bool Protocol::encodeHeader(int senderProtocolVersion, char *dest, int64_t &off,
             encodeVarI64C(dest, umax, off, blockDetails.fileSize);
   if (ok && senderProtocolVersion >= HEADER_FLAG_AND_PREV_SEQ_ID_VERSION) {
     uint8_t flags = blockDetails.allocationStatus;
+    if (senderProtocolVersion >= SPARSE_FILE_VERSION &&
+        blockDetails.sparseFile) {
+      flags |= (1 << 3);
+    }
+    if (senderProtocolVersion >= COMPRESSION_VERSION &&
+        blockDetails.compressed) {
+      flags |= (1 << 4);
+    }
+    const bool duplicate = senderProtocolVersion >= DEDUP_VERSION &&
+                           blockDetails.duplicateOfSeqId > 0;
+    if (duplicate) {
+      flags |= (1 << 5);
+    }
     if (off >= max) {
       ok = false;
     } else {
       dest[off++] = static_cast<char>(flags);
-      if (flags == EXISTS_TOO_SMALL || flags == EXISTS_TOO_LARGE) {
+      if (blockDetails.allocationStatus == EXISTS_TOO_SMALL ||
+          blockDetails.allocationStatus == EXISTS_TOO_LARGE) {
         // prev seq-id is only used in case the size is less on the sender side
         ok = encodeVarI64C(dest, umax, off, blockDetails.prevSeqId);
       }
+      if (ok && duplicate) {
+        ok = encodeVarI64C(dest, umax, off, blockDetails.duplicateOfSeqId);
+      }
     }
   }
   if (!ok) {
@@ -188,11 +228,21 @@ bool Protocol::decodeHeader(int receiverProtocolVersion, char *src,
     uint8_t flags = br.front();
     // first 3 bits are used to represent allocation status
     blockDetails.allocationStatus = (FileAllocationStatus)(flags & 7);
+    if (receiverProtocolVersion >= SPARSE_FILE_VERSION) {
+      blockDetails.sparseFile = flags & (1 << 3);
+    }
+    if (receiverProtocolVersion >= COMPRESSION_VERSION) {
+      blockDetails.compressed = flags & (1 << 4);
+    }
     br.pop_front();
     if (blockDetails.allocationStatus == EXISTS_TOO_SMALL ||
         blockDetails.allocationStatus == EXISTS_TOO_LARGE) {
       ok = decodeInt64C(br, blockDetails.prevSeqId);
     }
+    if (ok && receiverProtocolVersion >= DEDUP_VERSION && (flags & (1 << 5))) {
+      ok = decodeInt64C(br, blockDetails.duplicateOfSeqId) &&
+           blockDetails.duplicateOfSeqId > 0;
+    }
   }
   off += offset(br, obr);
   return ok;
@@ -366,63 +416,249 @@ bool Protocol::decodeChunkInfo(ByteRange &br, Interval &chunk) {
   return decodeInt64C(br, chunk.start_) && decodeInt64C(br, chunk.end_);
 }
 
-bool Protocol::encodeFileChunksInfo(char *dest, int64_t &off, int64_t max,
-                                    const FileChunksInfo &fileChunksInfo) {
-  bool ok = encodeVarI64C(dest, max, off, fileChunksInfo.getSeqId()) &&
-            encodeString(dest, max, off, fileChunksInfo.getFileName()) &&
-            encodeVarI64C(dest, max, off, fileChunksInfo.getFileSize()) &&
-            encodeVarI64C(dest, max, off, fileChunksInfo.getChunks().size());
-  if (!ok) {
+namespace {
+/// encodes str as the length of the prefix it shares with prev, nullptr for
+/// none, followed by the rest of it
+bool encodeSharedPrefixString(char *dest, int64_t max, int64_t &off,
+                              const string &str, const string *prev) {
+  int64_t prefixLen = 0;
+  if (prev) {
+    const int64_t maxPrefixLen = std::min(str.size(), prev->size());
+    while (prefixLen < maxPrefixLen && str[prefixLen] == (*prev)[prefixLen]) {
+      ++prefixLen;
+    }
+  }
+  const int64_t suffixLen = str.size() - prefixLen;
+  bool ok = encodeVarI64C(dest, max, off, prefixLen) &&
+            encodeVarI64C(dest, max, off, suffixLen);
+  if (!ok || off + suffixLen > max) {
     return false;
   }
-  for (const auto &chunk : fileChunksInfo.getChunks()) {
-    if (!encodeChunkInfo(dest, off, max, chunk)) {
-      return false;
-    }
+  memcpy(dest + off, str.data() + prefixLen, suffixLen);
+  off += suffixLen;
+  return true;
+}
+
+/// decodes what encodeSharedPrefixString encoded relative to prev
+bool decodeSharedPrefixString(ByteRange &br, string &str, const string *prev) {
+  int64_t prefixLen, suffixLen;
+  if (!decodeInt64C(br, prefixLen) || !decodeInt64C(br, suffixLen)) {
+    return false;
+  }
+  const int64_t prevLen = prev ? prev->size() : 0;
+  if (prefixLen > prevLen || suffixLen > (int64_t)br.size()) {
+    WLOG(ERROR) << "Bogus shared prefix string decoded " << prefixLen << " "
+                << suffixLen << " " << prevLen;
+    return false;
+  }
+  str.clear();
+  str.reserve(prefixLen + suffixLen);
+  if (prefixLen > 0) {
+    str.assign(*prev, 0, prefixLen);
   }
+  str.append(reinterpret_cast<const char *>(br.start()), suffixLen);
+  br.advance(suffixLen);
   return true;
 }
 
-bool Protocol::decodeFileChunksInfo(ByteRange &br,
-                                    FileChunksInfo &fileChunksInfo) {
-  int64_t seqId, fileSize, numChunks;
+/// encodes the seq-id, name, size and chunks of fileChunksInfo relative to
+/// prev, nullptr for the first entry of a buffer
+bool encodeCompactFileChunks(char *dest, int64_t &off, int64_t max,
+                             const FileChunksInfo &fileChunksInfo,
+                             const FileChunksInfo *prev) {
+  const int64_t prevSeqId = prev ? prev->getSeqId() : 0;
+  bool ok =
+      encodeVarI64(dest, max, off, fileChunksInfo.getSeqId() - prevSeqId) &&
+      encodeSharedPrefixString(dest, max, off, fileChunksInfo.getFileName(),
+                               prev ? &prev->getFileName() : nullptr);
+  if (!ok) {
+    return false;
+  }
+  const int64_t fileSize = fileChunksInfo.getFileSize();
+  const std::vector<Interval> &chunks = fileChunksInfo.getChunks();
+  ok = encodeVarI64C(dest, max, off, fileSize) &&
+       encodeVarI64C(dest, max, off, chunks.size());
+  // runs of missing and received bytes, the last run being the missing bytes
+  // after the last chunk, so that a complete file takes 2 bytes
+  int64_t prevEnd = 0;
+  for (size_t i = 0; ok && i < chunks.size(); i++) {
+    const Interval &chunk = chunks[i];
+    const int64_t lastRun = (i + 1 == chunks.size())
+                                ? fileSize - chunk.end_
+                                : chunk.end_ - chunk.start_;
+    ok = encodeVarI64(dest, max, off, chunk.start_ - prevEnd) &&
+         encodeVarI64(dest, max, off, lastRun);
+    prevEnd = chunk.end_;
+  }
+  return ok;
+}
+
+/// decodes what encodeCompactFileChunks encoded relative to prev
+bool decodeCompactFileChunks(ByteRange &br, FileChunksInfo &fileChunksInfo,
+                             const FileChunksInfo *prev) {
+  int64_t seqIdDelta;
   string fileName;
-  bool ok = decodeInt64C(br, seqId) && decodeString(br, fileName) &&
-            decodeInt64C(br, fileSize) && decodeInt64C(br, numChunks);
+  bool ok = decodeInt64(br, seqIdDelta) &&
+            decodeSharedPrefixString(br, fileName,
+                                     prev ? &prev->getFileName() : nullptr);
   if (!ok) {
     return false;
   }
-  fileChunksInfo.setSeqId(seqId);
+  // unsigned to wrap around instead of overflowing on bogus input
+  const uint64_t prevSeqId = prev ? prev->getSeqId() : 0;
+  fileChunksInfo.setSeqId((int64_t)(prevSeqId + (uint64_t)seqIdDelta));
   fileChunksInfo.setFileName(fileName);
-  fileChunksInfo.setFileSize(fileSize);
-  if (numChunks < 0) {
-    WLOG(ERROR) << "Negative number of chunks decoded " << numChunks;
+  int64_t fileSize, numChunks;
+  if (!decodeInt64C(br, fileSize) || !decodeInt64C(br, numChunks)) {
     return false;
   }
+  fileChunksInfo.setFileSize(fileSize);
+  int64_t prevEnd = 0;
   for (int64_t i = 0; i < numChunks; i++) {
-    Interval chunk;
-    if (!decodeChunkInfo(br, chunk)) {
+    int64_t missingRun, run;
+    if (!decodeInt64(br, missingRun) || !decodeInt64(br, run)) {
+      return false;
+    }
+    const int64_t start = (int64_t)((uint64_t)prevEnd + (uint64_t)missingRun);
+    const int64_t end = (i + 1 == numChunks)
+                            ? (int64_t)((uint64_t)fileSize - (uint64_t)run)
+                            : (int64_t)((uint64_t)start + (uint64_t)run);
+    if (start < 0 || end < start) {
+      WLOG(ERROR) << "Bogus chunk decoded " << start << " " << end;
       return false;
     }
-    fileChunksInfo.addChunk(chunk);
+    fileChunksInfo.addChunk(Interval(start, end));
+    prevEnd = end;
+  }
+  return true;
+}
+}
+
+bool Protocol::encodeFileChunksInfo(int protocolVersion, char *dest,
+                                    int64_t &off, int64_t max,
+                                    const FileChunksInfo &fileChunksInfo,
+                                    const FileChunksInfo *prev) {
+  bool ok;
+  if (protocolVersion >= COMPACT_FILE_CHUNKS_VERSION) {
+    ok = encodeCompactFileChunks(dest, off, max, fileChunksInfo, prev);
+  } else {
+    ok = encodeVarI64C(dest, max, off, fileChunksInfo.getSeqId()) &&
+         encodeString(dest, max, off, fileChunksInfo.getFileName()) &&
+         encodeVarI64C(dest, max, off, fileChunksInfo.getFileSize()) &&
+         encodeVarI64C(dest, max, off, fileChunksInfo.getChunks().size());
+    for (const auto &chunk : fileChunksInfo.getChunks()) {
+      if (!ok) {
+        break;
+      }
+      ok = encodeChunkInfo(dest, off, max, chunk);
+    }
+  }
+  if (!ok) {
+    return false;
+  }
+  if (protocolVersion < DELTA_RESUMPTION_VERSION) {
+    return true;
+  }
+  const string &hashes = fileChunksInfo.getBlockHashes();
+  ok = encodeVarI64C(dest, max, off, fileChunksInfo.getBlockHashSize());
+  if (!ok || fileChunksInfo.getBlockHashSize() == 0) {
+    return ok;
+  }
+  ok = encodeVarI64C(dest, max, off, fileChunksInfo.getFirstHashedBlock()) &&
+       encodeVarI64C(dest, max, off, fileChunksInfo.getNumBlockHashes());
+  if (!ok || off + (int64_t)hashes.size() > max) {
+    return false;
+  }
+  memcpy(dest + off, hashes.data(), hashes.size());
+  off += hashes.size();
+  return true;
+}
+
+bool Protocol::decodeFileChunksInfo(int protocolVersion, ByteRange &br,
+                                    FileChunksInfo &fileChunksInfo,
+                                    const FileChunksInfo *prev) {
+  if (protocolVersion >= COMPACT_FILE_CHUNKS_VERSION) {
+    if (!decodeCompactFileChunks(br, fileChunksInfo, prev)) {
+      return false;
+    }
+  } else {
+    int64_t seqId, fileSize, numChunks;
+    string fileName;
+    bool ok = decodeInt64C(br, seqId) && decodeString(br, fileName) &&
+              decodeInt64C(br, fileSize) && decodeInt64C(br, numChunks);
+    if (!ok) {
+      return false;
+    }
+    fileChunksInfo.setSeqId(seqId);
+    fileChunksInfo.setFileName(fileName);
+    fileChunksInfo.setFileSize(fileSize);
+    if (numChunks < 0) {
+      WLOG(ERROR) << "Negative number of chunks decoded " << numChunks;
+      return false;
+    }
+    for (int64_t i = 0; i < numChunks; i++) {
+      Interval chunk;
+      if (!decodeChunkInfo(br, chunk)) {
+        return false;
+      }
+      fileChunksInfo.addChunk(chunk);
+    }
+  }
+  if (protocolVersion < DELTA_RESUMPTION_VERSION) {
+    return true;
   }
+  int64_t blockSize, firstBlock, numHashes;
+  if (!decodeInt64C(br, blockSize)) {
+    return false;
+  }
+  if (blockSize == 0) {
+    return true;
+  }
+  bool ok = decodeInt64C(br, firstBlock) && decodeInt64C(br, numHashes);
+  if (!ok) {
+    return false;
+  }
+  if (blockSize < 0 || firstBlock < 0 || numHashes < 0 ||
+      numHashes > (int64_t)br.size() / FileChunksInfo::kBlockHashLen) {
+    WLOG(ERROR) << "Bogus block hashes decoded " << blockSize << " "
+                << firstBlock << " " << numHashes;
+    return false;
+  }
+  const int64_t hashesLen = numHashes * FileChunksInfo::kBlockHashLen;
+  fileChunksInfo.setBlockHashes(
+      blockSize, firstBlock,
+      string(reinterpret_cast<const char *>(br.start()), hashesLen));
+  br.advance(hashesLen);
   return true;
 }
 
-int64_t Protocol::maxEncodeLen(const FileChunksInfo &fileChunkInfo) {
-  return 10 + 2 + fileChunkInfo.getFileName().size() + 10 + 10 +
-         fileChunkInfo.getChunks().size() * kMaxChunkEncodeLen;
+int64_t Protocol::maxEncodeLen(int protocolVersion,
+                               const FileChunksInfo &fileChunkInfo) {
+  int64_t length = 10 + 2 + fileChunkInfo.getFileName().size() + 10 + 10 +
+                   fileChunkInfo.getChunks().size() * kMaxChunkEncodeLen;
+  if (protocolVersion >= DELTA_RESUMPTION_VERSION) {
+    length += 3 * 10 + fileChunkInfo.getBlockHashes().size();
+  }
+  if (protocolVersion >= COMPACT_FILE_CHUNKS_VERSION) {
+    // length of the shared prefix
+    length += 10;
+  }
+  return length;
 }
 
 int64_t Protocol::encodeFileChunksInfoList(
-    char *dest, int64_t &off, int64_t bufSize, int64_t startIndex,
+    int protocolVersion, char *dest, int64_t &off, int64_t bufSize,
+    int64_t startIndex,
     const std::vector<FileChunksInfo> &fileChunksInfoList) {
   int64_t oldOffset = off;
   int64_t numEncoded = 0;
   const int64_t numFileChunks = fileChunksInfoList.size();
+  // entries are coded relative to the previous one of the same buffer, so
+  // that each buffer decodes on its own
+  const FileChunksInfo *prev = nullptr;
   for (int64_t i = startIndex; i < numFileChunks; i++) {
     const FileChunksInfo &fileChunksInfo = fileChunksInfoList[i];
-    int64_t maxLength = maxEncodeLen(fileChunksInfo);
+    int64_t maxLength = maxEncodeLen(protocolVersion, fileChunksInfo);
     if (maxLength + oldOffset > bufSize) {
       WLOG(WARNING) << "Chunk info for " << fileChunksInfo.getFileName()
                     << " can not be encoded in a buffer of size " << bufSize
@@ -432,20 +668,26 @@ int64_t Protocol::encodeFileChunksInfoList(
     if (maxLength + off >= bufSize) {
       break;
     }
-    encodeFileChunksInfo(dest, off, bufSize, fileChunksInfo);
+    encodeFileChunksInfo(protocolVersion, dest, off, bufSize, fileChunksInfo,
+                         prev);
+    prev = &fileChunksInfo;
     numEncoded++;
   }
   return numEncoded;
 }
 
 bool Protocol::decodeFileChunksInfoList(
-    char *src, int64_t &off, int64_t dataSize,
+    int protocolVersion, char *src, int64_t &off, int64_t dataSize,
     std::vector<FileChunksInfo> &fileChunksInfoList) {
   ByteRange br = makeByteRange(src, dataSize, off);
   const ByteRange obr = br;
+  const size_t firstIndex = fileChunksInfoList.size();
   while (!br.empty()) {
     FileChunksInfo fileChunkInfo;
-    if (!decodeFileChunksInfo(br, fileChunkInfo)) {
+    const FileChunksInfo *prev = fileChunksInfoList.size() > firstIndex
+                                     ? &fileChunksInfoList.back()
+                                     : nullptr;
+    if (!decodeFileChunksInfo(protocolVersion, br, fileChunkInfo, prev)) {
       return false;
     }
     fileChunksInfoList.emplace_back(std::move(fileChunkInfo));
@@ -454,6 +696,78 @@ bool Protocol::decodeFileChunksInfoList(
   return true;
 }
 
+int64_t Protocol::maxManifestEntryLen(const BlockDetails &entry) {
+  // seq-id, shared prefix and suffix lengths, name, file size, flags and
+  // prev seq-id
+  return 10 + 2 * 10 + entry.fileName.size() + 10 + 1 + 10;
+}
+
+bool Protocol::encodeManifest(char *dest, int64_t &off, int64_t max,
+                              const std::vector<BlockDetails> &entries) {
+  const BlockDetails *prev = nullptr;
+  for (const BlockDetails &entry : entries) {
+    const int64_t prevSeqId = prev ? prev->seqId : 0;
+    bool ok = encodeVarI64(dest, max, off, entry.seqId - prevSeqId) &&
+              encodeSharedPrefixString(dest, max, off, entry.fileName,
+                                       prev ? &prev->fileName : nullptr) &&
+              encodeVarI64C(dest, max, off, entry.fileSize);
+    if (!ok || off >= max) {
+      WLOG(ERROR) << "Failed to encode manifest, ran out of space, " << off
+                  << " " << max;
+      return false;
+    }
+    uint8_t flags = entry.allocationStatus;
+    if (entry.sparseFile) {
+      flags |= (1 << 3);
+    }
+    dest[off++] = static_cast<char>(flags);
+    if (entry.allocationStatus == EXISTS_TOO_SMALL ||
+        entry.allocationStatus == EXISTS_TOO_LARGE) {
+      if (!encodeVarI64C(dest, max, off, entry.prevSeqId)) {
+        return false;
+      }
+    }
+    prev = &entry;
+  }
+  return true;
+}
+
+bool Protocol::decodeManifest(char *src, int64_t &off, int64_t dataSize,
+                              std::vector<BlockDetails> &entries) {
+  ByteRange br = makeByteRange(src, dataSize, off);
+  const ByteRange obr = br;
+  const size_t firstIndex = entries.size();
+  while (!br.empty()) {
+    const BlockDetails *prev =
+        entries.size() > firstIndex ? &entries.back() : nullptr;
+    BlockDetails entry;
+    int64_t seqIdDelta;
+    bool ok = decodeInt64(br, seqIdDelta) &&
+              decodeSharedPrefixString(br, entry.fileName,
+                                       prev ? &prev->fileName : nullptr) &&
+              decodeInt64C(br, entry.fileSize);
+    if (!ok || br.empty()) {
+      WLOG(ERROR) << "Unable to decode manifest entry " << entries.size();
+      return false;
+    }
+    const uint64_t prevSeqId = prev ? prev->seqId : 0;
+    entry.seqId = (int64_t)(prevSeqId + (uint64_t)seqIdDelta);
+    const uint8_t flags = br.front();
+    br.pop_front();
+    entry.allocationStatus = (FileAllocationStatus)(flags & 7);
+    entry.sparseFile = flags & (1 << 3);
+    if (entry.allocationStatus == EXISTS_TOO_SMALL ||
+        entry.allocationStatus == EXISTS_TOO_LARGE) {
+      if (!decodeInt64C(br, entry.prevSeqId)) {
+        return false;
+      }
+    }
+    entries.emplace_back(std::move(entry));
+  }
+  off += offset(br, obr);
+  return true;
+}
+
 bool Protocol::encodeSettings(int senderProtocolVersion, char *dest,
                               int64_t &off, int64_t max,
                               const Settings &settings) {
@@ -475,11 +789,26 @@ bool Protocol::encodeSettings(int senderProtocolVersion, char *dest,
     if (settings.enableHeartBeat) {
       flags |= (1 << 3);
     }
+    if (senderProtocolVersion >= DEDUP_VERSION && settings.dedupFiles) {
+      flags |= (1 << 4);
+    }
     if (off >= max) {
       return false;
     }
     dest[off++] = flags;
   }
+  if (ok && senderProtocolVersion >= COMPRESSION_VERSION) {
+    if (off >= max) {
+      return false;
+    }
+    dest[off++] = static_cast<char>(settings.compressionType);
+  }
+  if (ok && senderProtocolVersion >= CHECKSUM_TYPE_VERSION) {
+    if (off >= max) {
+      return false;
+    }
+    dest[off++] = static_cast<char>(settings.checksumType);
+  }
   return ok;
 }
 
@@ -517,6 +846,35 @@ bool Protocol::decodeSettings(int protocolVersion, char *src, int64_t &off,
     settings.sendFileChunks = flags & (1 << 1);
     settings.blockModeDisabled = flags & (1 << 2);
     settings.enableHeartBeat = flags & (1 << 3);
+    settings.dedupFiles =
+        protocolVersion >= DEDUP_VERSION && (flags & (1 << 4));
+    br.pop_front();
+  }
+  settings.compressionType = COMP_NONE;
+  if (ok && protocolVersion >= COMPRESSION_VERSION) {
+    if (br.empty()) {
+      return false;
+    }
+    const uint8_t compressionType = br.front();
+    if (compressionType >= NUM_COMP_TYPES) {
+      WLOG(ERROR) << "Unknown compression type in settings "
+                  << (int)compressionType;
+      return false;
+    }
+    settings.compressionType = static_cast<CompressionType>(compressionType);
+    br.pop_front();
+  }
+  settings.checksumType = CHECKSUM_CRC32C;
+  if (ok && protocolVersion >= CHECKSUM_TYPE_VERSION) {
+    if (br.empty()) {
+      return false;
+    }
+    const uint8_t checksumType = br.front();
+    if (checksumType >= NUM_CHECKSUM_TYPES) {
+      WLOG(ERROR) << "Unknown checksum type in settings " << (int)checksumType;
+      return false;
+    }
+    settings.checksumType = static_cast<ChecksumType>(checksumType);
     br.pop_front();
   }
   off += offset(br, obr);
@@ -549,16 +907,30 @@ bool Protocol::decodeEncryptionSettings(char *src, int64_t &off, int64_t max,
   return ok;
 }
 
+bool Protocol::encodeRate(char *dest, int64_t &off, int64_t max,
+                          int64_t rateBytesPerSec) {
+  return encodeInt64FixedLength(dest, max, off, rateBytesPerSec);
+}
+
+bool Protocol::decodeRate(char *src, int64_t &off, int64_t max,
+                          int64_t &rateBytesPerSec) {
+  ByteRange br = makeByteRange(src, max, off);
+  const ByteRange obr = br;
+  bool ok = decodeInt64FixedLength(br, rateBytesPerSec);
+  off += offset(br, obr);
+  return ok;
+}
+
 bool Protocol::encodeFooter(char *dest, int64_t &off, int64_t max,
-                            int32_t checksum) {
+                            int64_t checksum) {
   return encodeVarI64(dest, max, off, checksum);
 }
 
 bool Protocol::decodeFooter(char *src, int64_t &off, int64_t max,
-                            int32_t &checksum) {
+                            int64_t &checksum) {
   ByteRange br = makeByteRange(src, max, off);
   const ByteRange obr = br;
-  bool ok = decodeInt32(br, checksum);
+  bool ok = decodeInt64(br, checksum);
   off += offset(br, obr);
   return ok;
 }
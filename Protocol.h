@@ -9,11 +9,14 @@
 #pragma once
 
 #include <wdt/ErrorCodes.h>
+#include <wdt/util/BlockChecksum.h>
+#include <wdt/util/BlockCompressor.h>
 #include <wdt/util/EncryptionUtils.h>
 
 #include <folly/Range.h>
 #include <limits.h>
 #include <stddef.h>
+#include <limits>
 #include <string>
 #include <vector>
 
@@ -38,8 +41,8 @@ struct Checkpoint {
   /// number of complete blocks received
   int64_t numBlocks{0};
   /// Next three fields are only set if a block is received partially
-  /// seq-id of the partially received block (and we don't use encryption
-  /// which doesn't allow using partial blocks as they can't be authenticated)
+  /// seq-id of the partially received block (with encryption, only the bytes
+  /// covered by a verified tag count as received)
   int64_t lastBlockSeqId{0};  // was -1 in 1.26
   /// block offset of the partially received block
   int64_t lastBlockOffset{0};
@@ -126,6 +129,9 @@ class FileChunksInfo {
       : seqId_(seqId), fileName_(fileName), fileSize_(fileSize) {
   }
 
+  /// length of a block hash, a SHA-256 digest
+  static constexpr int64_t kBlockHashLen = 32;
+
   /// @return   file-name
   const std::string &getFileName() const {
     return fileName_;
@@ -172,11 +178,59 @@ class FileChunksInfo {
   /// @return   list of chunks which are not part of the chunks-list
   std::vector<Interval> getRemainingChunks(int64_t curFileSize);
 
+  /// @param chunks   chunks replacing the current ones
+  void setChunks(std::vector<Interval> chunks) {
+    chunks_ = std::move(chunks);
+  }
+
+  /// @return   size of the blocks hashed, 0 if the file has no block hashes
+  int64_t getBlockHashSize() const {
+    return blockHashSize_;
+  }
+
+  /// @return   index of the block of the first hash
+  int64_t getFirstHashedBlock() const {
+    return firstHashedBlock_;
+  }
+
+  /// @return   hashes of consecutive blocks, kBlockHashLen bytes each
+  const std::string &getBlockHashes() const {
+    return blockHashes_;
+  }
+
+  /// @return   number of blocks hashed
+  int64_t getNumBlockHashes() const {
+    return blockHashes_.size() / kBlockHashLen;
+  }
+
+  /**
+   * @param blockSize     size of the blocks hashed, 0 to clear the hashes
+   * @param firstBlock    index of the block of the first hash
+   * @param hashes        hashes of consecutive blocks
+   */
+  void setBlockHashes(int64_t blockSize, int64_t firstBlock,
+                      std::string hashes) {
+    blockHashSize_ = blockSize;
+    firstHashedBlock_ = firstBlock;
+    blockHashes_ = std::move(hashes);
+  }
+
+  /**
+   * Appends the hashes of another entry of the same file, which has to start
+   * at the block following the last hashed one
+   *
+   * @return    false if the hashes do not follow the current ones
+   */
+  bool appendBlockHashes(const FileChunksInfo &fileChunksInfo);
+
   bool operator==(const FileChunksInfo &fileChunksInfo) const {
     return this->seqId_ == fileChunksInfo.seqId_ &&
            this->fileName_ == fileChunksInfo.fileName_ &&
            this->chunks_ == fileChunksInfo.chunks_ &&
-           this->fileSize_ == fileChunksInfo.fileSize_;
+           this->fileSize_ == fileChunksInfo.fileSize_ &&
+           this->blockHashSize_ == fileChunksInfo.blockHashSize_ &&
+           this->firstHashedBlock_ == fileChunksInfo.firstHashedBlock_ &&
+           this->blockHashes_ == fileChunksInfo.blockHashes_;
   }
 
   friend std::ostream &operator<<(std::ostream &os,
@@ -191,6 +245,12 @@ class FileChunksInfo {
   int64_t fileSize_{0};
   /// list of chunk info
   std::vector<Interval> chunks_;
+  /// size of the blocks hashed for delta resumption, 0 if none
+  int64_t blockHashSize_{0};
+  /// index of the block of the first hash
+  int64_t firstHashedBlock_{0};
+  /// hashes of the blocks of the file as found by the receiver
+  std::string blockHashes_;
 };
 
 /// enum representing file allocation status at the receiver side
@@ -218,6 +278,20 @@ struct BlockDetails {
   FileAllocationStatus allocationStatus{NOT_EXISTS};
   /// seq-id of previous transfer, only valid if there is a size mismatch
   int64_t prevSeqId{0};
+  /// whether only the data extents of the file are sent, in which case the
+  /// receiver must not preallocate the file
+  bool sparseFile{false};
+  /// whether the data of the block is sent as compressed frames, dataSize
+  /// still being its uncompressed size
+  bool compressed{false};
+  /// seq-id of a file of the transfer with the same content, no data is sent
+  /// and the receiver copies that file instead. 0 if not a duplicate
+  int64_t duplicateOfSeqId{0};
+  /// type of the checksum of the data of the block, NUM_CHECKSUM_TYPES if the
+  /// block has none. Not encoded, set by the receiver for the transfer log
+  ChecksumType checksumType{NUM_CHECKSUM_TYPES};
+  /// checksum of the data of the block, see BlockChecksum::getValue()
+  int64_t checksum{0};
 };
 
 /// structure representing settings cmd
@@ -236,6 +310,13 @@ struct Settings {
   bool blockModeDisabled{false};
   /// whether heart-beat is enabled
   bool enableHeartBeat{false};
+  /// compression of the blocks sent with their compressed flag
+  CompressionType compressionType{COMP_NONE};
+  /// whether files identical to another file of the transfer are sent as
+  /// duplicates of that file
+  bool dedupFiles{false};
+  /// algorithm of the checksum footers, if checksum is enabled
+  ChecksumType checksumType{CHECKSUM_CRC32C};
 };
 
 class Protocol {
@@ -272,6 +353,34 @@ class Protocol {
   static const int HEART_BEAT_VERSION;
   /// version from which wdt started to change encryption iv periodically
   static const int PERIODIC_ENCRYPTION_IV_CHANGE_VERSION;
+  /// version from which small files can be sent batched in one cmd
+  static const int FILE_BATCH_VERSION;
+  /// version from which the holes of sparse files are not sent
+  static const int SPARSE_FILE_VERSION;
+  /// version from which the receiver can advertise the rate it can sustain
+  static const int RECEIVER_RATE_VERSION;
+  /// version from which file chunks carry the hashes of the receiver blocks
+  static const int DELTA_RESUMPTION_VERSION;
+  /// version from which the file chunks can be streamed while the receiver
+  /// is still discovering them
+  static const int STREAMED_FILE_CHUNKS_VERSION;
+  /// version from which each file chunks entry is coded relative to the
+  /// previous one of its buffer
+  static const int COMPACT_FILE_CHUNKS_VERSION;
+  /// version from which the sender can send the manifest of the files it is
+  /// going to send, ahead of their data
+  static const int MANIFEST_VERSION;
+  /// version from which the data of blocks can be sent compressed
+  static const int COMPRESSION_VERSION;
+  /// version from which a file identical to another file of the transfer can
+  /// be sent as a duplicate of it, without its data
+  static const int DEDUP_VERSION;
+  /// version from which the checksum algorithm is sent in the settings, and
+  /// the footers can carry 64 bits checksums
+  static const int CHECKSUM_TYPE_VERSION;
+  /// version from which the encryption settings can announce that the rest
+  /// of the stream is made of kernel tls records (kKtlsTagInterval)
+  static const int KTLS_VERSION;
 
   /// Both version, magic number and command byte
   enum CMD_MAGIC {
@@ -293,6 +402,9 @@ class Protocol {
                // 0x01 to be a separate cmd
     ENCRYPTION_CMD = 0x65,  // (e)ncryption
     HEART_BEAT_CMD = 0x48,  // (H)eart-beat
+    FILE_BATCH_CMD = 0x42,  // (B)atch of files
+    RATE_CMD = 0x52,        // target (R)ate of the receiver
+    MANIFEST_CMD = 0x4D,    // (M)anifest of files to come
   };
 
   // TODO: move the rest of those definitions closer to where they need to be
@@ -302,8 +414,23 @@ class Protocol {
   static constexpr int64_t kMaxTransferIdLength = 1024;
   /// 1 byte for cmd, 2 bytes for file-name length, Max size of filename, 4
   /// variants(seq-id, data-size, offset, file-size), 1 byte for flag, 10 bytes
-  /// prev seq-id
-  static constexpr int64_t kMaxHeader = 1 + 2 + PATH_MAX + 4 * 10 + 1 + 10;
+  /// prev seq-id, 10 bytes seq-id of the original of a duplicate
+  static constexpr int64_t kMaxHeader =
+      1 + 2 + PATH_MAX + 4 * 10 + 1 + 10 + 10;
+  /// 1 byte for cmd, 1 byte for status, 4 bytes for the length of the rest of
+  /// the file batch cmd, which is a sequence of file header + data
+  static constexpr int64_t kFileBatchPrefixLen = 1 + 1 + sizeof(int32_t);
+  /// max size of a file batch cmd, the receiver needs to hold it in its buffer
+  static constexpr int64_t kMaxFileBatchLen = 256 * 1024;
+  /// 1 byte for cmd, 4 bytes for the length of the rest of the manifest cmd
+  static constexpr int64_t kManifestPrefixLen = 1 + sizeof(int32_t);
+  /// max size of a manifest cmd, the receiver needs to hold it in its buffer
+  static constexpr int64_t kMaxManifestLen = 64 * 1024;
+  /// 4 bytes for the uncompressed length of a frame of a compressed block,
+  /// and 4 bytes for its length on the wire, the same if sent uncompressed
+  static constexpr int64_t kCompressionFrameHeaderLen = 2 * sizeof(int32_t);
+  /// max uncompressed length of a frame, the receiver needs to hold one
+  static constexpr int64_t kMaxCompressionFrameLen = 256 * 1024;
   /// min number of bytes that must be send to unblock receiver
   static constexpr int64_t kMinBufLength = 256;
   /// max size of done command encoding(1 byte for cmd, 1 for status, 10 for
@@ -311,13 +438,25 @@ class Protocol {
   static constexpr int64_t kMaxDone = 2 + 2 * 10;
   /// max length of the size cmd encoding
   static constexpr int64_t kMaxSize = 1 + 10;
-  /// max size of settings command encoding
-  static constexpr int64_t kMaxSettings = 1 + 3 * 10 + kMaxTransferIdLength + 1;
+  /// max size of settings command encoding, (1 byte for flags, 1 byte for
+  /// the compression type and 1 byte for the checksum type at the end)
+  static constexpr int64_t kMaxSettings =
+      1 + 3 * 10 + kMaxTransferIdLength + 1 + 1 + 1;
   /// max length of the footer cmd encoding, 10 byte for checksum
   static constexpr int64_t kMaxFooter = 1 + 10;
+  /// length of the rate cmd, 1 byte for cmd and 8 bytes for the rate, so that
+  /// the sender can tell it apart from the heart-beats without decoding
+  static constexpr int64_t kRateCmdLen = 1 + sizeof(int64_t);
   /// max size of chunks cmd(4 bytes for buffer size and 4 bytes for number of
   /// files)
   static constexpr int64_t kChunksCmdLen = 2 * sizeof(int64_t);
+  /// number of files sent in the chunks cmd when the list is streamed. The
+  /// pages then continue till one of length kChunksStreamEnd, and pages of
+  /// length 0 only keep the connection alive
+  static constexpr int64_t kStreamedNumFiles =
+      std::numeric_limits<int64_t>::max();
+  /// length of the page ending a streamed file chunks list
+  static constexpr int32_t kChunksStreamEnd = -1;
   /// max size of chunkInfo encoding length
   static constexpr int64_t kMaxChunkEncodeLen = 20;
   /// abort cmd length(4 bytes for protocol, 1 byte for error-code and 8 bytes
@@ -329,6 +468,10 @@ class Protocol {
   /// encryption type, rest for initialization vector and tag interval)
   static constexpr int64_t kEncryptionCmdLen =
       1 + 1 + 1 + kAESBlockSize + sizeof(int32_t);
+  /// tag interval sent in the encryption cmd when the rest of the stream is
+  /// made of kernel tls records, only from KTLS_VERSION. Older peers reject
+  /// negative intervals
+  static constexpr int32_t kKtlsTagInterval = -1;
 
   static_assert(kMinBufLength <= kMaxHeader && kMaxSettings <= kMaxHeader,
                 "Minimum buffer size is kMaxHeader. Header and Settings cmd "
@@ -440,17 +583,30 @@ class Protocol {
   static bool decodeSize(char *src, int64_t &off, int64_t max,
                          int64_t &totalNumBytes);
 
-  /// encodes checksum or tag into dest+off
+  /// encodes the target rate of the receiver in bytes/sec, 0 for no limit,
+  /// into dest+off
+  /// moves the off into dest pointer, not going past max
+  /// @return false if there isn't enough room to encode
+  static bool encodeRate(char *dest, int64_t &off, int64_t max,
+                         int64_t rateBytesPerSec);
+
+  /// decodes from src+off and consumes/moves off but not past max
+  /// sets rateBytesPerSec
+  /// @return false if there isn't enough data in src+off to src+max
+  static bool decodeRate(char *src, int64_t &off, int64_t max,
+                         int64_t &rateBytesPerSec);
+
+  /// encodes checksum or tag into dest+off, see BlockChecksum::getValue()
   /// moves the off into dest pointer, not going past max
   /// @return false if there isn't enough room to encode
   static bool encodeFooter(char *dest, int64_t &off, int64_t max,
-                           int32_t checksum);
+                           int64_t checksum);
 
   /// decodes from src+off and consumes/moves off but not past max
   /// sets checksum or tag
   /// @return false if there isn't enough data in src+off to src+max
   static bool decodeFooter(char *src, int64_t &off, int64_t max,
-                           int32_t &checksum);
+                           int64_t &checksum);
 
   /// encodes protocolVersion, errCode and checkpoint into dest+off
   /// moves the off into dest pointer
@@ -486,37 +642,73 @@ class Protocol {
 
   /// encodes fileChunksInfo into dest+off
   /// moves the off into dest pointer
-  static bool encodeFileChunksInfo(char *dest, int64_t &off, int64_t max,
-                                   const FileChunksInfo &fileChunksInfo);
+  /// from COMPACT_FILE_CHUNKS_VERSION, the name is coded as the length of the
+  /// prefix shared with prev and the rest of it, the seq-id as the difference
+  /// with the one of prev, and the chunks as the lengths of the runs of
+  /// missing and received bytes. prev is nullptr for the first entry of a
+  /// buffer
+  static bool encodeFileChunksInfo(int protocolVersion, char *dest,
+                                   int64_t &off, int64_t max,
+                                   const FileChunksInfo &fileChunksInfo,
+                                   const FileChunksInfo *prev = nullptr);
 
   /// decodes from src+off and consumes/moves off
   /// sets fileChunksInfo
+  /// prev must be the entry fileChunksInfo was encoded against
   /// @return false if there isn't enough data in src+off to src+max
-  static bool decodeFileChunksInfo(folly::ByteRange &br,
-                                   FileChunksInfo &fileChunksInfo);
+  static bool decodeFileChunksInfo(int protocolVersion, folly::ByteRange &br,
+                                   FileChunksInfo &fileChunksInfo,
+                                   const FileChunksInfo *prev = nullptr);
 
   /**
    * returns maximum number of bytes to encode a given FileChunksInfo
    *
+   * @param protocolVersion  protocol version in use
    * @param fileChunkInfo    FileChunksInfo to encode
    *
    * @return                 max number of bytes to encode
    */
-  static int64_t maxEncodeLen(const FileChunksInfo &fileChunkInfo);
+  static int64_t maxEncodeLen(int protocolVersion,
+                              const FileChunksInfo &fileChunkInfo);
 
   /// encodes fileChunksInfo into dest+off
   /// moves the off into dest pointer
   /// returns number of fileChunks encoded
   static int64_t encodeFileChunksInfoList(
-      char *dest, int64_t &off, int64_t bufSize, int64_t startIndex,
+      int protocolVersion, char *dest, int64_t &off, int64_t bufSize,
+      int64_t startIndex,
       const std::vector<FileChunksInfo> &fileChunksInfoList);
 
   /// decodes from src+off and consumes/moves off
   /// sets fileChunksInfoList
   /// @return false if there isn't enough data in src+off to src+max
   static bool decodeFileChunksInfoList(
-      char *src, int64_t &off, int64_t dataSize,
+      int protocolVersion, char *src, int64_t &off, int64_t dataSize,
       std::vector<FileChunksInfo> &fileChunksInfoList);
+
+  /// @return   max number of bytes to encode entry in a manifest cmd
+  static int64_t maxManifestEntryLen(const BlockDetails &entry);
+
+  /**
+   * Encodes the files of a manifest cmd into dest+off, each relative to the
+   * previous one. Only the seq-id, name, size, allocation status, prev seq-id
+   * and sparse flag of the entries are sent.
+   *
+   * @param dest      buffer to encode into
+   * @param off       offset in dest, moved past the entries
+   * @param max       size of dest
+   * @param entries   files to encode
+   *
+   * @return          false if dest is too small
+   */
+  static bool encodeManifest(char *dest, int64_t &off, int64_t max,
+                             const std::vector<BlockDetails> &entries);
+
+  /// decodes the whole manifest from src+off to src+dataSize, appending the
+  /// files to entries
+  /// @return false if the manifest is malformed
+  static bool decodeManifest(char *src, int64_t &off, int64_t dataSize,
+                             std::vector<BlockDetails> &entries);
 };
 }
 }  // namespace facebook::wdt
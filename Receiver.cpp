@@ -7,7 +7,11 @@
  * of patent rights can be found in the PATENTS file in the same directory.
  */
 #include <wdt/Receiver.h>
+#include <wdt/util/DeltaResumption.h>
 #include <wdt/util/EncryptionUtils.h>
+#include <wdt/util/FileWriter.h>
+#include <wdt/util/LatencyHistograms.h>
+#include <wdt/util/TransferTracer.h>
 #include <wdt/util/ServerSocket.h>
 
 #include <folly/lang/Bits.h>
@@ -19,11 +23,84 @@
 #include <sys/stat.h>
 #include <sys/types.h>
 #include <unistd.h>
+#include <atomic>
 #include <thread>
 
 namespace facebook {
 namespace wdt {
 
+namespace {
+/// aborts the completion of the file chunks with the receiver, or once it is
+/// not needed anymore
+class FileChunksAbortChecker : public IAbortChecker {
+ public:
+  FileChunksAbortChecker(IAbortChecker const *receiverChecker,
+                         const std::atomic<bool> &stop)
+      : receiverChecker_(receiverChecker), stop_(stop) {
+  }
+
+  bool shouldAbort() const override {
+    return stop_.load() || receiverChecker_->shouldAbort();
+  }
+
+ private:
+  IAbortChecker const *receiverChecker_;
+  const std::atomic<bool> &stop_;
+};
+
+/// aborts the forwarding with the receiver
+class ForwarderAbortChecker : public IAbortChecker {
+ public:
+  explicit ForwarderAbortChecker(IAbortChecker const *receiverChecker)
+      : receiverChecker_(receiverChecker) {
+  }
+
+  bool shouldAbort() const override {
+    return receiverChecker_->shouldAbort();
+  }
+
+ private:
+  IAbortChecker const *receiverChecker_;
+};
+}
+
+class Receiver::ProgressTrackerTask : public RuntimeTask {
+ public:
+  explicit ProgressTrackerTask(Receiver &receiver) : receiver_(receiver) {
+  }
+
+  /// @return   state of the tracker, initialized before the task starts
+  ProgressTrackerState &getState() {
+    return state_;
+  }
+
+  bool runSlice(Wait &wait) override {
+    if (receiver_.getTransferStatus() == THREADS_JOINED) {
+      return true;
+    }
+    const auto interval = std::chrono::milliseconds(
+        receiver_.options_.progress_report_interval_millis);
+    if (!started_) {
+      started_ = true;
+      nextReport_ = Clock::now() + interval;
+    } else if (Clock::now() >= nextReport_) {
+      receiver_.reportProgress(state_);
+      nextReport_ = Clock::now() + interval;
+    }
+    // the runtime also wakes up timer waits early
+    wait.timeoutMillis =
+        std::max<int64_t>(0, durationMillis(nextReport_ - Clock::now())) + 1;
+    return false;
+  }
+
+ private:
+  Receiver &receiver_;
+  ProgressTrackerState state_;
+  bool started_{false};
+  /// time of the next report
+  Clock::time_point nextReport_;
+};
+
 void Receiver::addCheckpoint(Checkpoint checkpoint) {
   WLOG(INFO) << "Adding global checkpoint " << checkpoint.port << " "
              << checkpoint.numBlocks << " "
@@ -51,24 +128,223 @@ Receiver::Receiver(int port, int numSockets, const std::string &destDir)
 
 void Receiver::traverseDestinationDir(
     std::vector<FileChunksInfo> &fileChunksInfo) {
-  DirectorySourceQueue dirQueue(options_, getDirectory(),
-                                &abortCheckerCallback_);
-  dirQueue.buildQueueSynchronously();
-  auto &discoveredFilesInfo = dirQueue.getDiscoveredFilesMetaData();
-  for (auto &fileInfo : discoveredFilesInfo) {
-    if (fileInfo->relPath == kWdtLogName ||
-        fileInfo->relPath == kWdtBuggyLogName) {
+  FileChunksAbortChecker abortChecker(&abortCheckerCallback_, stopFileChunks_);
+  DirectorySourceQueue dirQueue(options_, getDirectory(), &abortChecker);
+  dirQueue.setNumDiscoveryThreads(options_.num_discovery_threads);
+  dirQueue.setDiscoveryCallback([&](const SourceMetaData &fileInfo) {
+    std::string relPath = fileInfo.getRelPath();
+    if (relPath == kWdtLogName || relPath == kWdtBuggyLogName ||
+        relPath == kWdtCompactedLogName) {
       // do not include wdt log files
-      WVLOG(1) << "Removing " << fileInfo->relPath
-               << " from the list of existing files";
-      continue;
+      WVLOG(1) << "Removing " << relPath << " from the list of existing files";
+      return;
     }
-    FileChunksInfo chunkInfo(fileInfo->seqId, fileInfo->relPath,
-                             fileInfo->size);
-    chunkInfo.addChunk(Interval(0, fileInfo->size));
-    fileChunksInfo.emplace_back(std::move(chunkInfo));
+    FileChunksInfo chunkInfo(fileInfo.seqId, relPath, fileInfo.size);
+    chunkInfo.addChunk(Interval(0, fileInfo.size));
+    {
+      std::lock_guard<std::mutex> lock(fileChunksMutex_);
+      fileChunksInfo.emplace_back(std::move(chunkInfo));
+    }
+    fileChunksCond_.notify_all();
+  });
+  dirQueue.buildQueueSynchronously();
+}
+
+void Receiver::prepareFileChunksInfo() {
+  const int64_t blockSize = options_.delta_resumption_block_kbytes * 1024;
+  // with delta resumption, the entries are only complete once hashed
+  std::vector<FileChunksInfo> fileChunksInfo;
+  if (blockSize > 0) {
+    std::lock_guard<std::mutex> lock(fileChunksMutex_);
+    fileChunksInfo.swap(fileChunksInfo_);
   }
-  return;
+  const auto startTime = Clock::now();
+  if (options_.resume_using_dir_tree) {
+    traverseDestinationDir(blockSize > 0 ? fileChunksInfo : fileChunksInfo_);
+  }
+  if (blockSize > 0) {
+    FileChunksAbortChecker abortChecker(&abortCheckerCallback_,
+                                        stopFileChunks_);
+    DeltaResumption::hashReceivedFiles(getDirectory(), blockSize,
+                                       options_.getDeltaReadOptions(),
+                                       &abortChecker, fileChunksInfo);
+  }
+  {
+    std::lock_guard<std::mutex> lock(fileChunksMutex_);
+    if (blockSize > 0) {
+      fileChunksInfo_ = std::move(fileChunksInfo);
+    }
+    if (stopFileChunks_) {
+      // partial and not needed anymore
+      fileChunksInfo_.clear();
+    }
+    fileChunksInfoComplete_ = true;
+    WLOG(INFO) << "File chunks of " << fileChunksInfo_.size()
+               << " files prepared in "
+               << durationSeconds(Clock::now() - startTime) << " seconds";
+  }
+  fileChunksCond_.notify_all();
+  forwardPreviousChunks();
+}
+
+void Receiver::stopFileChunksThread() {
+  if (!fileChunksThread_.joinable()) {
+    return;
+  }
+  stopFileChunks_ = true;
+  fileChunksThread_.join();
+}
+
+ErrorCode Receiver::startForwarders() {
+  if (options_.skip_writes) {
+    WLOG(ERROR) << "Can not forward the blocks which are not written";
+    return INVALID_REQUEST;
+  }
+  WdtOptions forwarderOptions;
+  forwarderOptions.copyInto(options_);
+  // the blocks are only known as they are received
+  forwarderOptions.two_phases = false;
+  forwarderOptions.discovery_index_path.clear();
+  auto abortChecker =
+      std::make_shared<ForwarderAbortChecker>(&abortCheckerCallback_);
+  std::vector<std::unique_ptr<Sender>> forwarders;
+  for (const WdtTransferRequest &forwardRequest : forwardRequests_) {
+    WdtTransferRequest request(forwardRequest);
+    request.directory = getDirectory();
+    auto forwarder = std::make_unique<Sender>(request);
+    forwarder->setWdtOptions(forwarderOptions);
+    // this receiver reports the progress
+    forwarder->setProgressReportIntervalMillis(0);
+    forwarder->setAbortChecker(abortChecker);
+    forwarder->setFed();
+    ErrorCode code = forwarder->init().errorCode;
+    if (code == OK) {
+      code = forwarder->transferAsync();
+    }
+    if (code != OK) {
+      WLOG(ERROR) << "Unable to forward to " << forwarder->getDestination()
+                  << " " << errorCodeToStr(code);
+      return code;
+    }
+    WLOG(INFO) << "Forwarding the blocks received to "
+               << forwarder->getDestination();
+    forwarders.push_back(std::move(forwarder));
+  }
+  if (fileCreator_) {
+    fileCreator_->setDuplicateCopiedCallback(
+        [this](const BlockDetails &duplicate) {
+          // the next receivers get the whole copy
+          BlockDetails block = duplicate;
+          block.offset = 0;
+          block.dataSize = duplicate.fileSize;
+          block.duplicateOfSeqId = 0;
+          for (auto &forwarder : forwarders_) {
+            forwarder->feedBlock(block);
+          }
+        });
+  }
+  {
+    // read by the thread preparing the chunks
+    std::lock_guard<std::mutex> lock(fileChunksMutex_);
+    forwarders_ = std::move(forwarders);
+  }
+  forwardPreviousChunks();
+  return OK;
+}
+
+void Receiver::forwardPreviousChunks() {
+  std::lock_guard<std::mutex> lock(fileChunksMutex_);
+  if (forwarders_.empty() || !fileChunksInfoComplete_ ||
+      previousChunksForwarded_) {
+    return;
+  }
+  previousChunksForwarded_ = true;
+  int64_t numChunks = 0;
+  for (const FileChunksInfo &fileChunksInfo : fileChunksInfo_) {
+    for (const Interval &chunk : fileChunksInfo.getChunks()) {
+      BlockDetails block;
+      block.fileName = fileChunksInfo.getFileName();
+      block.fileSize = fileChunksInfo.getFileSize();
+      block.offset = chunk.start_;
+      block.dataSize = chunk.size();
+      for (auto &forwarder : forwarders_) {
+        forwarder->feedBlock(block);
+      }
+      numChunks++;
+    }
+  }
+  WLOG_IF(INFO, numChunks > 0) << "Forwarding " << numChunks
+                               << " chunks received by previous transfers";
+}
+
+void Receiver::forwardBlock(const BlockDetails &blockDetails) {
+  // duplicates are forwarded once copied
+  if (blockDetails.allocationStatus == TO_BE_DELETED ||
+      blockDetails.duplicateOfSeqId > 0) {
+    return;
+  }
+  if (streamOutput_ && blockDetails.fileName == streamOutput_->getRelPath()) {
+    streamOutput_->addBlock(blockDetails.offset, blockDetails.dataSize);
+  }
+  for (auto &forwarder : forwarders_) {
+    forwarder->feedBlock(blockDetails);
+  }
+}
+
+void Receiver::finishForwarders(TransferReport &report) {
+  const ErrorCode localCode = report.getSummary().getErrorCode();
+  if (localCode != OK) {
+    WLOG(ERROR) << "Aborting the forwarding, transfer failed with "
+                << errorCodeToStr(localCode);
+  }
+  // the forwarders finish sending in parallel
+  for (auto &forwarder : forwarders_) {
+    if (localCode != OK) {
+      forwarder->abort(ABORTED_BY_APPLICATION);
+    }
+    forwarder->endFeed();
+  }
+  ErrorCode forwardCode = OK;
+  for (auto &forwarder : forwarders_) {
+    std::unique_ptr<TransferReport> forwardReport = forwarder->finish();
+    const ErrorCode code = forwardReport->getSummary().getErrorCode();
+    if (code != OK && localCode == OK) {
+      WLOG(ERROR) << "Forwarding to " << forwarder->getDestination()
+                  << " failed " << errorCodeToStr(code);
+      if (forwardCode == OK) {
+        forwardCode = code;
+      }
+    }
+  }
+  if (forwardCode != OK) {
+    report.setErrorCode(forwardCode);
+  }
+}
+
+bool Receiver::waitForFileChunksInfo(int timeoutMillis) {
+  std::unique_lock<std::mutex> lock(fileChunksMutex_);
+  return fileChunksCond_.wait_for(lock,
+                                  std::chrono::milliseconds(timeoutMillis),
+                                  [&] { return fileChunksInfoComplete_; });
+}
+
+int64_t Receiver::encodeFileChunksInfo(int protocolVersion, char *dest,
+                                       int64_t &off, int64_t max,
+                                       int64_t startIndex, int timeoutMillis,
+                                       bool &complete) {
+  // entries to wait for before sending a page which is not the last one
+  const int64_t kMinPageEntries = 1024;
+  std::unique_lock<std::mutex> lock(fileChunksMutex_);
+  fileChunksCond_.wait_for(
+      lock, std::chrono::milliseconds(timeoutMillis), [&] {
+        return fileChunksInfoComplete_ ||
+               (int64_t)fileChunksInfo_.size() - startIndex >= kMinPageEntries;
+      });
+  const int64_t numEncoded = Protocol::encodeFileChunksInfoList(
+      protocolVersion, dest, off, max, startIndex, fileChunksInfo_);
+  complete = fileChunksInfoComplete_ &&
+             startIndex + numEncoded == (int64_t)fileChunksInfo_.size();
+  return numEncoded;
 }
 
 void Receiver::startNewGlobalSession(const std::string &peerIp) {
@@ -80,10 +356,16 @@ void Receiver::startNewGlobalSession(const std::string &peerIp) {
     throttler_->startTransfer();
   }
   startTime_ = Clock::now();
+  resetFirstByteTime();
+  if (durabilityQueue_) {
+    durabilityQueue_->reset();
+  }
   if (options_.enable_download_resumption) {
     transferLogManager_->startThread();
     bool verifySuccessful = transferLogManager_->verifySenderIp(peerIp);
     if (!verifySuccessful) {
+      stopFileChunks_ = true;
+      std::lock_guard<std::mutex> lock(fileChunksMutex_);
       fileChunksInfo_.clear();
     }
   }
@@ -97,6 +379,10 @@ bool Receiver::hasNewTransferStarted() const {
 }
 
 void Receiver::endCurGlobalSession() {
+  if (durabilityQueue_) {
+    // files of failed threads may still be syncing
+    durabilityQueue_->drain(-1);
+  }
   setTransferStatus(FINISHED);
   if (!hasNewTransferStarted_) {
     WLOG(WARNING) << "WDT transfer did not start, no need to end session";
@@ -130,8 +416,28 @@ const WdtTransferRequest &Receiver::init() {
   negotiateProtocol();
   auto numThreads = transferRequest_.ports.size();
   // This creates the destination directory (which is needed for transferLogMgr)
-  fileCreator_.reset(new FileCreator(
-      getDirectory(), numThreads, *transferLogManager_, options_.skip_writes));
+  fileCreator_.reset(new FileCreator(getDirectory(), numThreads,
+                                     *transferLogManager_, options_.skip_writes,
+                                     options_.manifest_prepare_threads));
+  if (options_.disk_writer_threads > 0 && !options_.skip_writes &&
+      !diskWriterPool_) {
+    diskWriterPool_ = std::make_unique<DiskWriterPool>(
+        options_.disk_writer_threads, options_.buffer_size,
+        options_.disk_writer_memory_mb * kMbToB,
+        options_.max_writers_per_device);
+  }
+  if (options_.background_sync && !options_.skip_writes && !durabilityQueue_) {
+    durabilityQueue_ =
+        std::make_unique<DurabilityQueue>(options_, *transferLogManager_);
+  }
+  if (options_.adaptive_write_behind && options_.disk_sync_interval_mb >= 0 &&
+      !options_.skip_writes && !writeBehind_) {
+    writeBehind_ = std::make_unique<WriteBehindController>(options_);
+  }
+  if (options_.receiver_backpressure && !backpressureMonitor_) {
+    backpressureMonitor_ = std::make_unique<BackpressureMonitor>(
+        options_, diskWriterPool_.get());
+  }
 
   transferRequest_.downloadResumptionEnabled =
       options_.enable_download_resumption;
@@ -154,9 +460,16 @@ const WdtTransferRequest &Receiver::init() {
     }
     ErrorCode code = transferLogManager_->parseAndMatch(
         recoveryId_, getTransferConfig(), fileChunksInfo_);
-    if (code == OK && options_.resume_using_dir_tree) {
+    if (options_.resume_using_dir_tree) {
       WDT_CHECK(fileChunksInfo_.empty());
-      traverseDestinationDir(fileChunksInfo_);
+    }
+    if (code == OK && (options_.resume_using_dir_tree ||
+                       options_.delta_resumption_block_kbytes > 0)) {
+      // the scan and hashing of the destination can take long, the chunks
+      // are streamed to senders as they are prepared
+      WDT_CHECK(!fileChunksThread_.joinable());
+      fileChunksInfoComplete_ = false;
+      fileChunksThread_ = std::thread(&Receiver::prepareFileChunksInfo, this);
     }
   }
 
@@ -195,18 +508,28 @@ const WdtTransferRequest &Receiver::init() {
     setAcceptMode(ACCEPT_FOREVER);
   }
   threadsController_ = new ThreadsController(numThreads);
+  threadAffinity_ = std::make_unique<ThreadAffinity>(options_);
   threadsController_->setNumFunnels(ReceiverThread::NUM_FUNNELS);
   threadsController_->setNumBarriers(ReceiverThread::NUM_BARRIERS);
   threadsController_->setNumConditions(ReceiverThread::NUM_CONDITIONS);
   // TODO: take transferRequest directly !
   receiverThreads_ = threadsController_->makeThreads<Receiver, ReceiverThread>(
       this, transferRequest_.ports.size(), transferRequest_.ports);
-  size_t numSuccessfulInitThreads = 0;
-  for (auto &receiverThread : receiverThreads_) {
-    ErrorCode code = receiverThread->init();
-    if (code == OK) {
-      ++numSuccessfulInitThreads;
-    }
+  // the ports are bound concurrently, each one may retry
+  std::atomic<size_t> numSuccessfulInitThreads{0};
+  std::vector<std::thread> initThreads;
+  for (size_t i = 1; i < receiverThreads_.size(); ++i) {
+    initThreads.emplace_back([this, i, &numSuccessfulInitThreads] {
+      if (receiverThreads_[i]->init() == OK) {
+        ++numSuccessfulInitThreads;
+      }
+    });
+  }
+  if (!receiverThreads_.empty() && receiverThreads_[0]->init() == OK) {
+    ++numSuccessfulInitThreads;
+  }
+  for (auto &initThread : initThreads) {
+    initThread.join();
   }
   WLOG(INFO) << "Registered " << numSuccessfulInitThreads
              << " successful sockets";
@@ -247,6 +570,18 @@ std::unique_ptr<FileCreator> &Receiver::getFileCreator() {
   return fileCreator_;
 }
 
+DiskWriterPool *Receiver::getDiskWriterPool() {
+  return diskWriterPool_.get();
+}
+
+DurabilityQueue *Receiver::getDurabilityQueue() {
+  return durabilityQueue_.get();
+}
+
+BackpressureMonitor *Receiver::getBackpressureMonitor() {
+  return backpressureMonitor_.get();
+}
+
 void Receiver::setRecoveryId(const std::string &recoveryId) {
   recoveryId_ = recoveryId;
   WLOG(INFO) << "recovery id " << recoveryId_;
@@ -257,6 +592,41 @@ void Receiver::setAcceptMode(const AcceptMode acceptMode) {
   acceptMode_ = acceptMode;
 }
 
+void Receiver::setRuntime(std::shared_ptr<ReceiverRuntime> runtime,
+                          const std::string &group) {
+  std::lock_guard<std::mutex> lock(mutex_);
+  runtime_ = std::move(runtime);
+  runtimeGroup_ = group;
+}
+
+void Receiver::addForwardRequest(const WdtTransferRequest &forwardRequest) {
+  forwardRequests_.push_back(forwardRequest);
+}
+
+void Receiver::setStreamOutput(const std::string &relPath, int outputFd) {
+  streamOutputPath_ = relPath;
+  streamOutputFd_ = outputFd;
+}
+
+void Receiver::setWriterFactory(WriterFactory writerFactory) {
+  writerFactory_ = std::move(writerFactory);
+}
+
+bool Receiver::hasWriterFactory() const {
+  return static_cast<bool>(writerFactory_);
+}
+
+std::unique_ptr<Writer> Receiver::createWriter(
+    ThreadCtx &threadCtx, BlockDetails const *blockDetails, bool asyncWrites) {
+  if (writerFactory_) {
+    return writerFactory_(threadCtx, blockDetails);
+  }
+  return std::make_unique<FileWriter>(
+      threadCtx, blockDetails, fileCreator_.get(),
+      asyncWrites ? diskWriterPool_.get() : nullptr, durabilityQueue_.get(),
+      writeBehind_.get());
+}
+
 Receiver::AcceptMode Receiver::getAcceptMode() {
   std::lock_guard<std::mutex> lock(mutex_);
   return acceptMode_;
@@ -270,6 +640,7 @@ Receiver::~Receiver() {
     abort(ABORTED_BY_APPLICATION);
   }
   finish();
+  stopFileChunksThread();
 }
 
 const std::vector<FileChunksInfo> &Receiver::getFileChunksInfo() const {
@@ -308,15 +679,44 @@ std::unique_ptr<TransferReport> Receiver::finish() {
   for (auto &receiverThread : receiverThreads_) {
     receiverThread->finish();
   }
+  stopFileChunksThread();
 
   setTransferStatus(THREADS_JOINED);
 
-  if (isJoinable_) {
+  if (progressTrackerTask_) {
+    // the task sees the threads joined once woken up
+    runtime_->wakeTimerWaits();
+    runtime_->waitForEnd(progressTrackerTask_.get());
+    progressTrackerTask_.reset();
+  } else if (isJoinable_) {
     // Make sure to join the progress thread.
     progressTrackerThread_.join();
   }
   std::unique_ptr<TransferReport> report = getTransferReport();
+  threadTimeBreakdowns_.clear();
+  for (auto &receiverThread : receiverThreads_) {
+    threadTimeBreakdowns_.push_back(receiverThread->getTimeBreakdown());
+  }
+  report->setTimeBreakdowns(threadTimeBreakdowns_, false);
+  report->setTimeToFirstByte(getTimeToFirstByte(startTime_));
+  if (streamOutput_) {
+    // all the blocks are written
+    const ErrorCode streamCode = streamOutput_->finish();
+    if (streamCode != OK && report->getSummary().getErrorCode() == OK) {
+      WLOG(ERROR) << "Copy of " << streamOutputPath_ << " to the output failed "
+                  << errorCodeToStr(streamCode);
+      report->setErrorCode(streamCode);
+    }
+  }
+  if (!forwarders_.empty()) {
+    finishForwarders(*report);
+  }
   auto &summary = report->getSummary();
+  {
+    std::lock_guard<std::mutex> lock(mutex_);
+    finalMetrics_.setTransfer(summary, false,
+                              durationSeconds(Clock::now() - startTime_));
+  }
   bool transferSuccess = (report->getSummary().getErrorCode() == OK);
   fixAndCloseTransferLog(transferSuccess);
   auto totalSenderBytes = summary.getTotalSenderBytes();
@@ -326,6 +726,9 @@ std::unique_ptr<TransferReport> Receiver::finish() {
     progressReporter_->end(report);
   }
   logPerfStats();
+  if (!options_.trace_file.empty()) {
+    TransferTracer::get().dump(options_.trace_file);
+  }
 
   WLOG(WARNING) << "WDT receiver's transfer has been finished";
   WLOG(INFO) << *report;
@@ -362,6 +765,10 @@ ErrorCode Receiver::transferAsync() {
 ErrorCode Receiver::runForever() {
   WDT_CHECK(!options_.enable_download_resumption)
       << "Transfer resumption not supported in long running mode";
+  WDT_CHECK(forwardRequests_.empty())
+      << "Forwarding to another receiver not supported in long running mode";
+  WDT_CHECK(streamOutputPath_.empty())
+      << "Stream output not supported in long running mode";
 
   // Enforce the full reporting to be false in the daemon mode.
   // These statistics are expensive, and useless as they will never
@@ -375,7 +782,44 @@ ErrorCode Receiver::runForever() {
   return ERROR;
 }
 
+TransferMetrics Receiver::getMetrics() {
+  std::lock_guard<std::mutex> lock(mutex_);
+  if (transferStatus_ == THREADS_JOINED) {
+    return finalMetrics_;
+  }
+  TransferMetrics metrics;
+  if (transferStatus_ == NOT_STARTED) {
+    return metrics;
+  }
+  TransferStats globalStats;
+  for (const auto &receiverThread : receiverThreads_) {
+    globalStats += receiverThread->getTransferStats();
+  }
+  metrics.setTransfer(globalStats, transferStatus_ == ONGOING,
+                      durationSeconds(Clock::now() - startTime_));
+  return metrics;
+}
+
 void Receiver::progressTracker() {
+  ProgressTrackerState state;
+  if (!startProgressTracker(state)) {
+    return;
+  }
+  auto waitingTime =
+      std::chrono::milliseconds(options_.progress_report_interval_millis);
+  while (true) {
+    {
+      std::unique_lock<std::mutex> lock(mutex_);
+      conditionFinished_.wait_for(lock, waitingTime);
+      if (transferStatus_ == THREADS_JOINED) {
+        break;
+      }
+    }
+    reportProgress(state);
+  }
+}
+
+bool Receiver::startProgressTracker(ProgressTrackerState &state) {
   // Progress tracker will check for progress after the time specified
   // in milliseconds.
   int progressReportIntervalMillis = options_.progress_report_interval_millis;
@@ -383,59 +827,52 @@ void Receiver::progressTracker() {
       options_.throughput_update_interval_millis;
   if (progressReportIntervalMillis <= 0 || throughputUpdateIntervalMillis < 0 ||
       !isJoinable_) {
-    return;
+    return false;
   }
-  int throughputUpdateInterval =
+  state.throughputUpdateInterval =
       throughputUpdateIntervalMillis / progressReportIntervalMillis;
-
-  int64_t lastEffectiveBytes = 0;
-  std::chrono::time_point<Clock> lastUpdateTime = Clock::now();
-  int intervalsSinceLastUpdate = 0;
-  double currentThroughput = 0;
+  state.lastUpdateTime = Clock::now();
+  state.transferReport =
+      std::make_unique<TransferReport>(TransferStats(), 0, -1, 0, true);
   WLOG(INFO) << "Progress reporter updating every "
              << progressReportIntervalMillis << " ms";
-  auto waitingTime = std::chrono::milliseconds(progressReportIntervalMillis);
-  int64_t totalSenderBytes = -1;
-  while (true) {
-    {
-      std::unique_lock<std::mutex> lock(mutex_);
-      conditionFinished_.wait_for(lock, waitingTime);
-      if (transferStatus_ == THREADS_JOINED) {
-        break;
-      }
-    }
-    double totalTime = durationSeconds(Clock::now() - startTime_);
-    TransferStats globalStats;
-    for (const auto &receiverThread : receiverThreads_) {
-      globalStats += receiverThread->getTransferStats();
-    }
-    totalSenderBytes = globalStats.getTotalSenderBytes();
-    // Note: totalSenderBytes may not be valid yet if sender has not
-    // completed file discovery.  But that's ok, report whatever progress
-    // we can.
-    auto transferReport = std::make_unique<TransferReport>(
-        std::move(globalStats), totalTime, totalSenderBytes, 0, true);
-    intervalsSinceLastUpdate++;
-    if (intervalsSinceLastUpdate >= throughputUpdateInterval) {
-      auto curTime = Clock::now();
-      int64_t curEffectiveBytes =
-          transferReport->getSummary().getEffectiveDataBytes();
-      double time = durationSeconds(curTime - lastUpdateTime);
-      currentThroughput = (curEffectiveBytes - lastEffectiveBytes) / time;
-      lastEffectiveBytes = curEffectiveBytes;
-      lastUpdateTime = curTime;
-      intervalsSinceLastUpdate = 0;
-    }
-    transferReport->setCurrentThroughput(currentThroughput);
+  return true;
+}
 
-    progressReporter_->progress(transferReport);
-    if (reportPerfSignal_.notified()) {
-      logPerfStats();
-    }
+void Receiver::reportProgress(ProgressTrackerState &state) {
+  auto &transferReport = state.transferReport;
+  double totalTime = durationSeconds(Clock::now() - startTime_);
+  transferReport->startProgressUpdate(totalTime, -1, 0, true);
+  for (const auto &receiverThread : receiverThreads_) {
+    transferReport->addTransferStats(receiverThread->getTransferStats());
+  }
+  // Note: totalSenderBytes may not be valid yet if sender has not
+  // completed file discovery.  But that's ok, report whatever progress
+  // we can.
+  transferReport->setTotalFileSize(
+      transferReport->getSummary().getTotalSenderBytes());
+  state.intervalsSinceLastUpdate++;
+  if (state.intervalsSinceLastUpdate >= state.throughputUpdateInterval) {
+    auto curTime = Clock::now();
+    int64_t curEffectiveBytes =
+        transferReport->getSummary().getEffectiveDataBytes();
+    double time = durationSeconds(curTime - state.lastUpdateTime);
+    state.currentThroughput =
+        (curEffectiveBytes - state.lastEffectiveBytes) / time;
+    state.lastEffectiveBytes = curEffectiveBytes;
+    state.lastUpdateTime = curTime;
+    state.intervalsSinceLastUpdate = 0;
+  }
+  transferReport->setCurrentThroughput(state.currentThroughput);
+
+  progressReporter_->progress(transferReport);
+  if (reportPerfSignal_.notified()) {
+    logPerfStats();
   }
 }
 
 void Receiver::logPerfStats() const {
+  logThreadBottlenecks(false);
   if (!options_.enable_perf_stat_collection) {
     return;
   }
@@ -451,6 +888,11 @@ ErrorCode Receiver::start() {
   WDT_CHECK_EQ(getTransferStatus(), NOT_STARTED)
       << "There is already a transfer running on this instance of receiver";
   startTime_ = Clock::now();
+  resetFirstByteTime();
+  LatencyHistograms::get().start(options_.latency_histogram_window_millis);
+  if (!options_.trace_file.empty()) {
+    TransferTracer::get().start(options_.trace_buffer_events);
+  }
   WLOG(INFO) << "Starting (receiving) server on ports [ "
              << transferRequest_.ports << "] Target dir : " << getDirectory();
   // TODO do the init stuff here
@@ -459,6 +901,33 @@ ErrorCode Receiver::start() {
   } else {
     WLOG(INFO) << "Throttler set externally. Throttler : " << *throttler_;
   }
+  if (writerFactory_ &&
+      (!forwardRequests_.empty() || !streamOutputPath_.empty() ||
+       options_.enable_download_resumption)) {
+    WLOG(ERROR) << "Forwarding, stream output and download resumption need "
+                << "the files written to the destination directory";
+    return INVALID_REQUEST;
+  }
+  if (!forwardRequests_.empty()) {
+    ErrorCode code = startForwarders();
+    if (code != OK) {
+      return code;
+    }
+  }
+  if (!streamOutputPath_.empty()) {
+    if (options_.skip_writes) {
+      WLOG(ERROR) << "Can not copy " << streamOutputPath_ << " to the output "
+                  << "without writing it";
+      return INVALID_REQUEST;
+    }
+    std::string fullPath = getDirectory();
+    if (!fullPath.empty() && fullPath.back() != '/') {
+      fullPath.push_back('/');
+    }
+    streamOutput_ = std::make_unique<StreamOutput>(
+        streamOutputPath_, fullPath + streamOutputPath_, streamOutputFd_);
+    streamOutput_->start();
+  }
   setTransferStatus(ONGOING);
   while (true) {
     for (auto &receiverThread : receiverThreads_) {
@@ -483,8 +952,16 @@ ErrorCode Receiver::start() {
     if (progressReporter_) {
       progressReporter_->start();
     }
-    std::thread trackerThread(&Receiver::progressTracker, this);
-    progressTrackerThread_ = std::move(trackerThread);
+    if (runtime_) {
+      auto task = std::make_unique<ProgressTrackerTask>(*this);
+      if (startProgressTracker(task->getState())) {
+        progressTrackerTask_ = std::move(task);
+        runtime_->start(progressTrackerTask_.get(), runtimeGroup_);
+      }
+    } else {
+      std::thread trackerThread(&Receiver::progressTracker, this);
+      progressTrackerThread_ = std::move(trackerThread);
+    }
   }
   return OK;
 }
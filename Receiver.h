@@ -9,12 +9,22 @@
 #pragma once
 
 #include <wdt/ReceiverThread.h>
+#include <wdt/Sender.h>
 #include <wdt/WdtBase.h>
+#include <wdt/Writer.h>
+#include <wdt/util/BackpressureMonitor.h>
+#include <wdt/util/DiskWriterPool.h>
+#include <wdt/util/DurabilityQueue.h>
 #include <wdt/util/FileCreator.h>
+#include <wdt/util/ReceiverRuntime.h>
 #include <wdt/util/ServerSocket.h>
+#include <wdt/util/StreamOutput.h>
 #include <wdt/util/TransferLogManager.h>
+#include <wdt/util/WriteBehindController.h>
 #include <chrono>
+#include <condition_variable>
 #include <memory>
+#include <mutex>
 #include <string>
 #include <thread>
 
@@ -62,6 +72,10 @@ class Receiver : public WdtBase {
    */
   ErrorCode transferAsync() override;
 
+  /// @see WdtBase::getMetrics, only covers the current transfer of a long
+  ///      running receiver
+  TransferMetrics getMetrics() override;
+
   /// @param recoveryId   unique-id used to verify transfer log
   void setRecoveryId(const std::string &recoveryId);
 
@@ -78,6 +92,56 @@ class Receiver : public WdtBase {
   /// @param acceptMode   acceptMode to use
   void setAcceptMode(AcceptMode acceptMode);
 
+  /**
+   * Runs the ports of the receiver on a runtime shared with other receivers
+   * instead of a thread per port, and so does its progress tracker. Has to be
+   * set before the transfer starts.
+   *
+   * @param runtime       runtime to use, nullptr for a thread per port
+   * @param group         group of the tasks of the receiver in the runtime
+   *                      (@see ReceiverRuntime::setGroupLimit)
+   */
+  void setRuntime(std::shared_ptr<ReceiverRuntime> runtime,
+                  const std::string &group = "");
+
+  /**
+   * Chains this receiver to another one: each block received is forwarded to
+   * the receiver of forwardRequest once written, by a sender reading it back
+   * from the destination directory. With several receivers added, each block
+   * is forwarded to all of them, so that receivers form a distribution tree
+   * in which each host sends to a few others. The transfer only succeeds once
+   * the next receivers have all the files. Has to be called before the
+   * transfer starts, not supported in long running mode.
+   *
+   * @param forwardRequest    request of a next receiver, its directory is
+   *                          replaced by the destination directory
+   */
+  void addForwardRequest(const WdtTransferRequest &forwardRequest);
+
+  /**
+   * Copies a file streamed by the sender (e.g. its stdin) to an output fd in
+   * order, as its blocks are written, so that it can be piped to another
+   * program. The file is still written to the destination directory. Has to
+   * be called before the transfer starts, not supported in long running mode.
+   *
+   * @param relPath     relative path of the file
+   * @param outputFd    fd the file is copied to, e.g. stdout, not closed
+   */
+  void setStreamOutput(const std::string &relPath, int outputFd);
+
+  /**
+   * Replaces the writing of the blocks to the destination directory by
+   * writers of the factory, e.g. a MemoryWriter receiving the blocks in the
+   * memory of the application, a CallbackWriter or a ShmRing for another
+   * process. After a connection error, a part of a block can be written
+   * again. The files are never read back, so forwarding, stream output,
+   * download resumption and dedup by the sender are not supported with it.
+   * Has to be called before the transfer starts.
+   *
+   * @param writerFactory   creates the writer of each block received
+   */
+  void setWriterFactory(WriterFactory writerFactory);
+
   /**
    * Destructor for the receiver. The destructor automatically cancels
    * any incomplete transfers that are going on. 'Incomplete transfer' is a
@@ -91,30 +155,143 @@ class Receiver : public WdtBase {
   friend class ReceiverThread;
 
   /**
-   * Traverses root directory and returns discovered file information
+   * Traverses root directory and returns discovered file information. The
+   * entries are added under fileChunksMutex_ as they are discovered
    *
    * @param fileChunksInfo     discovered file info
    */
   void traverseDestinationDir(std::vector<FileChunksInfo> &fileChunksInfo);
 
-  /// Get the transferred file chunks info
+  /**
+   * Completes fileChunksInfo_ in the background: scans the destination
+   * directory if resuming using the directory tree, and hashes the blocks of
+   * the files for delta resumption
+   */
+  void prepareFileChunksInfo();
+
+  /// stops and joins the thread completing fileChunksInfo_, if any
+  void stopFileChunksThread();
+
+  /// starts the senders forwarding the blocks to the next receivers
+  ErrorCode startForwarders();
+
+  /**
+   * Forwards the chunks of fileChunksInfo_ once complete, as the next
+   * receivers may not have them. Only done once
+   */
+  void forwardPreviousChunks();
+
+  /**
+   * Queues a block written for the next receivers of the chain and the
+   * stream output, if any. Called by the receiver threads
+   */
+  void forwardBlock(const BlockDetails &blockDetails);
+
+  /**
+   * Ends the feed of the forwarders, or aborts them if the transfer failed,
+   * and waits for them. Their first error is reported if the transfer
+   * succeeded
+   */
+  void finishForwarders(TransferReport &report);
+
+  /**
+   * Waits for fileChunksInfo_ to be complete
+   *
+   * @param timeoutMillis   max time to wait
+   *
+   * @return                whether it is complete
+   */
+  bool waitForFileChunksInfo(int timeoutMillis);
+
+  /**
+   * Encodes the next page of file chunks, while they may still be discovered.
+   * Waits, up to timeoutMillis, for the list to be complete or to have enough
+   * new entries to be worth a page
+   *
+   * @param protocolVersion   protocol version of the connection
+   * @param dest              buffer to encode into
+   * @param off               offset in dest, advanced past the encoding
+   * @param max               size of dest
+   * @param startIndex        index of the first entry to encode
+   * @param timeoutMillis     max time to wait for new entries
+   * @param complete          set to whether all the entries are encoded
+   *
+   * @return                  number of entries encoded
+   */
+  int64_t encodeFileChunksInfo(int protocolVersion, char *dest, int64_t &off,
+                               int64_t max, int64_t startIndex,
+                               int timeoutMillis, bool &complete);
+
+  /// Get the transferred file chunks info, only valid once it is complete
   const std::vector<FileChunksInfo> &getFileChunksInfo() const;
 
   /// Get file creator, used by receiver threads
   std::unique_ptr<FileCreator> &getFileCreator();
 
+  /// @return   pool writing file data, nullptr if disabled
+  DiskWriterPool *getDiskWriterPool();
+
+  /// @return   queue syncing and closing files, nullptr if disabled
+  DurabilityQueue *getDurabilityQueue();
+
+  /// @return   whether the blocks go to the writers of a factory instead of
+  ///           the destination directory
+  bool hasWriterFactory() const;
+
+  /**
+   * Creates the writer of a block, a FileWriter except if a writer factory
+   * is set
+   *
+   * @param threadCtx       context of the receiver thread
+   * @param blockDetails    header of the block
+   * @param asyncWrites     whether the writes can be handed off to the disk
+   *                        writer pool
+   */
+  std::unique_ptr<Writer> createWriter(ThreadCtx &threadCtx,
+                                       BlockDetails const *blockDetails,
+                                       bool asyncWrites);
+
+  /// @return   monitor of the disks, nullptr if backpressure is disabled
+  BackpressureMonitor *getBackpressureMonitor();
+
   /// Get the ref to transfer log manager
   TransferLogManager &getTransferLogManager();
 
   /// Responsible for basic setup and starting threads
   ErrorCode start();
 
+  /// state of the progress tracker, kept between its reports
+  struct ProgressTrackerState {
+    /// number of reports between two throughput updates
+    int throughputUpdateInterval{0};
+    int64_t lastEffectiveBytes{0};
+    Clock::time_point lastUpdateTime;
+    int intervalsSinceLastUpdate{0};
+    double currentThroughput{0};
+    /// updated in place for every interval, see
+    /// TransferReport::startProgressUpdate
+    std::unique_ptr<TransferReport> transferReport;
+  };
+
+  /// runs the progress tracker on the runtime, instead of its own thread
+  class ProgressTrackerTask;
+
   /**
    * Periodically calculates current transfer report and send it to progress
    * reporter. This only works in the single transfer mode.
    */
   void progressTracker();
 
+  /**
+   * Initializes the state of the progress tracker
+   *
+   * @return    false if the progress is not tracked
+   */
+  bool startProgressTracker(ProgressTrackerState &state);
+
+  /// sends the current transfer report to the progress reporter
+  void reportProgress(ProgressTrackerState &state);
+
   /**
    * Adds a checkpoint to the global checkpoint list
    * @param checkpoint    checkpoint to be added
@@ -156,18 +333,42 @@ class Receiver : public WdtBase {
   /// The thread that is responsible for calling running the progress tracker
   std::thread progressTrackerThread_;
 
+  /// progress tracker running on the runtime instead of its thread, if any
+  std::unique_ptr<ProgressTrackerTask> progressTrackerTask_;
+
   /// Flag based on which threads finish processing on receiving a done
   bool isJoinable_{false};
 
   /// Responsible for writing files on the disk
   std::unique_ptr<FileCreator> fileCreator_{nullptr};
 
+  /// Writer threads receiver threads hand file data off to, if enabled
+  std::unique_ptr<DiskWriterPool> diskWriterPool_{nullptr};
+
+  /// Syncs and closes the files received, if background_sync is set
+  std::unique_ptr<DurabilityQueue> durabilityQueue_{nullptr};
+
+  /// Starts the writeback of the files received, if adaptive_write_behind is
+  /// set
+  std::unique_ptr<WriteBehindController> writeBehind_{nullptr};
+
+  /// Derives the rate advertised to the sender, if receiver_backpressure is
+  /// set
+  std::unique_ptr<BackpressureMonitor> backpressureMonitor_{nullptr};
+
   /**
    * Unique-id used to verify transfer log. This value must be same for
    * transfers across resumption
    */
   std::string recoveryId_;
 
+  /// Runtime running the receiver threads, nullptr if they have their own.
+  /// Declared before the threads, which use it till they are destroyed
+  std::shared_ptr<ReceiverRuntime> runtime_{nullptr};
+
+  /// group of the tasks of this receiver in runtime_
+  std::string runtimeGroup_;
+
   /**
    * The instance of the receiver threads are stored in this vector.
    * This will not be destroyed until this object is destroyed, hence
@@ -188,6 +389,43 @@ class Receiver : public WdtBase {
   /// already transferred file chunks
   std::vector<FileChunksInfo> fileChunksInfo_;
 
+  /// protects fileChunksInfo_ while it is completed in the background
+  std::mutex fileChunksMutex_;
+
+  /// notified when entries are added to fileChunksInfo_ or it is complete
+  std::condition_variable fileChunksCond_;
+
+  /// whether fileChunksInfo_ has all its entries
+  bool fileChunksInfoComplete_{true};
+
+  /// set to stop completing fileChunksInfo_, whose entries are then dropped
+  std::atomic<bool> stopFileChunks_{false};
+
+  /// thread running prepareFileChunksInfo()
+  std::thread fileChunksThread_;
+
+  /// requests of the next receivers of the chain
+  std::vector<WdtTransferRequest> forwardRequests_;
+
+  /// senders forwarding the blocks to the next receivers, set under
+  /// fileChunksMutex_
+  std::vector<std::unique_ptr<Sender>> forwarders_;
+
+  /// whether the chunks of fileChunksInfo_ were forwarded
+  bool previousChunksForwarded_{false};
+
+  /// relative path of the file copied to streamOutputFd_, empty if none
+  std::string streamOutputPath_;
+
+  /// fd the stream output is copied to
+  int streamOutputFd_{-1};
+
+  /// creates the writers of the blocks if set, instead of FileWriter
+  WriterFactory writerFactory_;
+
+  /// copies the file streamOutputPath_ in order once written
+  std::unique_ptr<StreamOutput> streamOutput_;
+
   /// Marks when a new transfer has started
   std::atomic<bool> hasNewTransferStarted_{false};
 
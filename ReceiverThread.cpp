@@ -8,12 +8,12 @@
  */
 #include <wdt/ReceiverThread.h>
 #include <folly/lang/Bits.h>
-#include <folly/hash/Checksum.h>
 #include <folly/Conv.h>
 #include <folly/Memory.h>
 #include <folly/ScopeGuard.h>
 #include <folly/String.h>
-#include <wdt/util/FileWriter.h>
+#include <wdt/util/TransferTracer.h>
+#include <poll.h>
 
 namespace facebook {
 namespace wdt {
@@ -89,6 +89,8 @@ const ReceiverThread::StateFunction ReceiverThread::stateMap_[] = {
     &ReceiverThread::processSettingsCmd,
     &ReceiverThread::processDoneCmd,
     &ReceiverThread::processSizeCmd,
+    &ReceiverThread::processFileBatchCmd,
+    &ReceiverThread::processManifestCmd,
     &ReceiverThread::sendFileChunks,
     &ReceiverThread::sendGlobalCheckpoint,
     &ReceiverThread::sendDoneCmd,
@@ -96,13 +98,38 @@ const ReceiverThread::StateFunction ReceiverThread::stateMap_[] = {
     &ReceiverThread::waitForFinishOrNewCheckpoint,
     &ReceiverThread::finishWithError};
 
+/// names of the states in the trace
+static const char *kReceiverStateNames[] = {"LISTEN",
+                                            "ACCEPT_FIRST_CONNECTION",
+                                            "ACCEPT_WITH_TIMEOUT",
+                                            "SEND_LOCAL_CHECKPOINT",
+                                            "READ_NEXT_CMD",
+                                            "PROCESS_FILE_CMD",
+                                            "PROCESS_SETTINGS_CMD",
+                                            "PROCESS_DONE_CMD",
+                                            "PROCESS_SIZE_CMD",
+                                            "PROCESS_FILE_BATCH_CMD",
+                                            "PROCESS_MANIFEST_CMD",
+                                            "SEND_FILE_CHUNKS",
+                                            "SEND_GLOBAL_CHECKPOINTS",
+                                            "SEND_DONE_CMD",
+                                            "SEND_ABORT_CMD",
+                                            "WAIT_FOR_FINISH_OR_NEW_CHECKPOINT",
+                                            "FINISH_WITH_ERROR"};
+static_assert(sizeof(kReceiverStateNames) / sizeof(kReceiverStateNames[0]) ==
+                  END,
+              "Mismatch between number of receiver states and their names");
+
 ReceiverThread::ReceiverThread(Receiver *wdtParent, int threadIndex,
                                int32_t port, ThreadsController *controller)
     : WdtThread(wdtParent->options_, threadIndex, port,
-                wdtParent->getProtocolVersion(), controller),
+                wdtParent->getProtocolVersion(), controller,
+                wdtParent->threadAffinity_.get()),
       wdtParent_(wdtParent) {
   controller_->registerThread(threadIndex_);
   threadCtx_->setAbortChecker(&wdtParent_->abortCheckerCallback_);
+  // chosen again with the settings of the sender
+  chooseReceiveLoop();
 }
 
 /**LISTEN STATE***/
@@ -124,7 +151,7 @@ ReceiverState ReceiverThread::listen() {
     }
     WTLOG(INFO) << "Sleeping after failed attempt " << retry;
     /* sleep override */
-    usleep(options_.sleep_millis * 1000);
+    usleep(getRetrySleepMillis(options_, retry) * 1000);
   }
   // one more/last try (stays true if it worked above)
   if (socket_->listen() != OK) {
@@ -137,12 +164,13 @@ ReceiverState ReceiverThread::listen() {
 
 /***ACCEPT_FIRST_CONNECTION***/
 ReceiverState ReceiverThread::acceptFirstConnection() {
-  WTVLOG(1) << "entered ACCEPT_FIRST_CONNECTION state";
-
-  reset();
-  socket_->closeNoCheck();
+  if (!waiting_) {
+    WTVLOG(1) << "entered ACCEPT_FIRST_CONNECTION state";
+    reset();
+    socket_->closeNoCheck();
+    acceptAttempts_ = 0;
+  }
   auto timeout = options_.accept_timeout_millis;
-  int acceptAttempts = 0;
   while (true) {
     // Move to timeout state if some other thread was successful
     // in getting a connection
@@ -151,8 +179,8 @@ ReceiverState ReceiverThread::acceptFirstConnection() {
     }
     switch (wdtParent_->getAcceptMode()) {
       case Receiver::AcceptMode::ACCEPT_WITH_RETRIES: {
-        if (acceptAttempts >= options_.max_accept_retries) {
-          WTLOG(ERROR) << "Unable to accept after " << acceptAttempts
+        if (acceptAttempts_ >= options_.max_accept_retries) {
+          WTLOG(ERROR) << "Unable to accept after " << acceptAttempts_
                        << " attempts";
           threadStats_.setLocalErrorCode(CONN_ERROR);
           return FINISH_WITH_ERROR;
@@ -165,45 +193,57 @@ ReceiverState ReceiverThread::acceptFirstConnection() {
       }
       case Receiver::AcceptMode::STOP_ACCEPTING: {
         WTLOG(ERROR) << "Receiver is asked to stop accepting, attempts : "
-                     << acceptAttempts;
+                     << acceptAttempts_;
         threadStats_.setLocalErrorCode(CONN_ERROR);
         return FINISH_WITH_ERROR;
       }
     }
     if (wdtParent_->getCurAbortCode() != OK) {
       WTLOG(ERROR) << "Thread marked to abort while trying to accept "
-                   << "first connection. Num attempts " << acceptAttempts;
+                   << "first connection. Num attempts " << acceptAttempts_;
       threadStats_.setLocalErrorCode(ABORT);
       return FINISH_WITH_ERROR;
     }
-    ErrorCode code =
-        socket_->acceptNextConnection(timeout, curConnectionVerified_);
+    ErrorCode code = CONN_ERROR;
+    switch (waitForConnection(timeout)) {
+      case WAIT_PARKED:
+        return ACCEPT_FIRST_CONNECTION;
+      case WAIT_READY:
+        code = socket_->acceptNextConnection(timeout, curConnectionVerified_);
+        break;
+      case WAIT_TIMED_OUT:
+        break;
+    }
     if (code == OK) {
       break;
     }
-    ++acceptAttempts;
+    ++acceptAttempts_;
   }
   // Make the parent start new global session. This is executed
   // only by the first thread that calls this function
   controller_->executeAtStart(
       [&]() { wdtParent_->startNewGlobalSession(socket_->getPeerIp()); });
+  connectedTime_ = Clock::now();
   return READ_NEXT_CMD;
 }
 
 /***ACCEPT_WITH_TIMEOUT STATE***/
 ReceiverState ReceiverThread::acceptWithTimeout() {
-  WTLOG(INFO) << "entered ACCEPT_WITH_TIMEOUT state";
-
-  // check socket status
-  ErrorCode socketErrCode = socket_->getNonRetryableErrCode();
-  if (socketErrCode != OK) {
-    WTLOG(ERROR) << "Socket has non-retryable error "
-                 << errorCodeToStr(socketErrCode);
-    threadStats_.setLocalErrorCode(socketErrCode);
-    return END;
+  if (!waiting_) {
+    WTLOG(INFO) << "entered ACCEPT_WITH_TIMEOUT state";
+
+    // check socket status
+    ErrorCode socketErrCode = socket_->getNonRetryableErrCode();
+    if (socketErrCode != OK) {
+      WTLOG(ERROR) << "Socket has non-retryable error "
+                   << errorCodeToStr(socketErrCode);
+      threadStats_.setLocalErrorCode(socketErrCode);
+      return END;
+    }
+    socket_->closeNoCheck();
+    blocksWaitingVerification_.clear();
+    acceptingLate_ = false;
   }
-  socket_->closeNoCheck();
-  blocksWaitingVerification_.clear();
 
   auto timeout = options_.accept_window_millis;
   if (senderReadTimeout_ > 0) {
@@ -211,8 +251,42 @@ ReceiverState ReceiverThread::acceptWithTimeout() {
     timeout = std::max(senderReadTimeout_, senderWriteTimeout_) +
               kTimeoutBufferMillis;
   }
-  ErrorCode code =
-      socket_->acceptNextConnection(timeout, curConnectionVerified_);
+  ErrorCode code = CONN_ERROR;
+  if (!acceptingLate_) {
+    switch (waitForConnection(timeout)) {
+      case WAIT_PARKED:
+        return ACCEPT_WITH_TIMEOUT;
+      case WAIT_READY:
+        code = socket_->acceptNextConnection(timeout, curConnectionVerified_);
+        break;
+      case WAIT_TIMED_OUT:
+        break;
+    }
+    if (code != OK && senderReadTimeout_ <= 0) {
+      // Not connected yet in this session: the sender may be scaling its
+      // connections up later, keep accepting while other threads transfer.
+      // Marked INIT meanwhile, so that threads done with the transfer do not
+      // wait for this one
+      controller_->markState(threadIndex_, INIT);
+      acceptingLate_ = true;
+    }
+  }
+  if (acceptingLate_) {
+    while (code != OK && controller_->hasThreads(threadIndex_, RUNNING) &&
+           wdtParent_->getCurAbortCode() == OK) {
+      const int lateTimeout = options_.accept_timeout_millis;
+      const WaitResult result = waitForConnection(lateTimeout);
+      if (result == WAIT_PARKED) {
+        return ACCEPT_WITH_TIMEOUT;
+      }
+      if (result == WAIT_READY) {
+        code =
+            socket_->acceptNextConnection(lateTimeout, curConnectionVerified_);
+      }
+    }
+    acceptingLate_ = false;
+    controller_->markState(threadIndex_, RUNNING);
+  }
   curConnectionVerified_ = false;
   if (code != OK) {
     WTLOG(ERROR) << "accept() failed with error " << errorCodeToStr(code)
@@ -256,10 +330,25 @@ ReceiverState ReceiverThread::sendLocalCheckpoint() {
 
 /***READ_NEXT_CMD***/
 ReceiverState ReceiverThread::readNextCmd() {
-  WTVLOG(1) << "entered READ_NEXT_CMD state";
+  if (!waiting_) {
+    WTVLOG(1) << "entered READ_NEXT_CMD state";
+  }
   oldOffset_ = off_;
+  if (numRead_ < Protocol::kMinBufLength) {
+    // parks till the sender sends its next cmd if running on a runtime
+    switch (waitForSocketReadable(options_.read_timeout_millis)) {
+      case WAIT_PARKED:
+        return READ_NEXT_CMD;
+      case WAIT_TIMED_OUT:
+        WTLOG(ERROR) << "timed out waiting for the next cmd " << numRead_;
+        threadStats_.setLocalErrorCode(SOCKET_READ_ERROR);
+        return ACCEPT_WITH_TIMEOUT;
+      case WAIT_READY:
+        break;
+    }
+  }
   // TODO: we shouldn't have off_ here and buffer/size inside buffer.
-  numRead_ = readAtLeast(*socket_, buf_ + off_, bufSize_ - off_,
+  numRead_ = readAtLeast(*socket_, buf_ + off_, getMaxCmdRead(),
                          Protocol::kMinBufLength, numRead_);
   if (numRead_ < Protocol::kMinBufLength) {
     WTLOG(ERROR) << "socket read failure " << Protocol::kMinBufLength << " "
@@ -280,6 +369,14 @@ ReceiverState ReceiverThread::readNextCmd() {
   if (cmd == Protocol::SIZE_CMD) {
     return PROCESS_SIZE_CMD;
   }
+  if (cmd == Protocol::FILE_BATCH_CMD &&
+      threadProtocolVersion_ >= Protocol::FILE_BATCH_VERSION) {
+    return PROCESS_FILE_BATCH_CMD;
+  }
+  if (cmd == Protocol::MANIFEST_CMD &&
+      threadProtocolVersion_ >= Protocol::MANIFEST_VERSION) {
+    return PROCESS_MANIFEST_CMD;
+  }
   WTLOG(ERROR) << "received an unknown cmd " << cmd;
   threadStats_.setLocalErrorCode(PROTOCOL_ERROR);
   return FINISH_WITH_ERROR;
@@ -324,6 +421,9 @@ ReceiverState ReceiverThread::processSettingsCmd() {
       Protocol::PERIODIC_ENCRYPTION_IV_CHANGE_VERSION) {
     socket_->disableIvChange();
   }
+  if (threadProtocolVersion_ < Protocol::KTLS_VERSION) {
+    socket_->disableKtls();
+  }
 
   success = Protocol::decodeSettings(
       threadProtocolVersion_, buf_, off_,
@@ -348,7 +448,43 @@ ReceiverState ReceiverThread::processSettingsCmd() {
   if (!enableHeartBeat_) {
     WTLOG(INFO) << "Disabling heart-beat as sender does not support it";
   }
+  dedupFiles_ = settings.dedupFiles;
+  if (dedupFiles_ && wdtParent_->hasWriterFactory()) {
+    // duplicates are copied from their originals in the destination directory
+    WTLOG(ERROR) << "Sender dedups files, not supported with a writer factory";
+    threadStats_.setLocalErrorCode(INVALID_REQUEST);
+    return SEND_ABORT_CMD;
+  }
+  compressionType_ = settings.compressionType;
+  if (!isCompressionTypeSupported(compressionType_)) {
+    WTLOG(ERROR) << "Sender compresses with "
+                 << compressionTypeToStr(compressionType_)
+                 << " which is not supported by this build";
+    threadStats_.setLocalErrorCode(VERSION_INCOMPATIBLE);
+    return SEND_ABORT_CMD;
+  }
+  if (compressionType_ != COMP_NONE &&
+      (!compressor_ || compressor_->getType() != compressionType_)) {
+    compressor_ = std::make_unique<BlockCompressor>(
+        compressionType_, options_.compression_level,
+        options_.compression_min_savings_percent);
+  }
+  if (settings.enableChecksum) {
+    if (!isChecksumTypeSupported(settings.checksumType)) {
+      WTLOG(ERROR) << "Sender checksums with "
+                   << checksumTypeToStr(settings.checksumType)
+                   << " which is not supported by this build";
+      threadStats_.setLocalErrorCode(VERSION_INCOMPATIBLE);
+      return SEND_ABORT_CMD;
+    }
+    if (!checksummer_ || checksummer_->getType() != settings.checksumType) {
+      checksummer_ = std::make_unique<BlockChecksum>(settings.checksumType);
+    }
+  }
   curConnectionVerified_ = true;
+  advertisedRate_ = 0;
+  newAdvertisedRate_ = 0;
+  socket_->autoSizeBuffers();
 
   // determine footer type
   if (settings.enableChecksum) {
@@ -356,6 +492,7 @@ ReceiverState ReceiverThread::processSettingsCmd() {
   } else {
     footerType_ = NO_FOOTER;
   }
+  chooseReceiveLoop();
 
   if (settings.sendFileChunks) {
     // We only move to SEND_FILE_CHUNKS state, if download resumption is enabled
@@ -372,24 +509,51 @@ void ReceiverThread::sendHeartBeat() {
   if (!enableHeartBeat_) {
     return;
   }
+  // the rate cmd and the heart-beat go out in a single write, the sender
+  // reads both as heart-beats
+  char buf[Protocol::kRateCmdLen + 1];
+  int64_t off = encodeTargetRate(buf);
   const auto now = Clock::now();
   const int timeSinceLastHeartBeatMs = durationMillis(now - lastHeartBeatTime_);
   const int heartBeatIntervalMs = (senderReadTimeout_ / kWaitTimeoutFactor);
-  if (timeSinceLastHeartBeatMs <= heartBeatIntervalMs) {
+  if (off == 0 && timeSinceLastHeartBeatMs <= heartBeatIntervalMs) {
     return;
   }
+  if (timeSinceLastHeartBeatMs > heartBeatIntervalMs) {
+    // time to send a heart beat
+    buf[off++] = Protocol::HEART_BEAT_CMD;
+  }
   lastHeartBeatTime_ = now;
-  // time to send a heart beat
-  char buf = Protocol::HEART_BEAT_CMD;
-  const int written = socket_->write(&buf, 1);
-  if (written != 1) {
+  const int written = socket_->write(buf, off);
+  if (written != off) {
     WTLOG(WARNING) << "Failed to send heart-beat " << written;
+    return;
+  }
+  if (newAdvertisedRate_ != advertisedRate_) {
+    WTVLOG(1) << "Advertised target rate " << newAdvertisedRate_;
+    advertisedRate_ = newAdvertisedRate_;
+  }
+}
+
+int64_t ReceiverThread::encodeTargetRate(char *buf) {
+  BackpressureMonitor *backpressureMonitor =
+      wdtParent_->getBackpressureMonitor();
+  if (!backpressureMonitor ||
+      threadProtocolVersion_ < Protocol::RECEIVER_RATE_VERSION) {
+    return 0;
+  }
+  newAdvertisedRate_ = backpressureMonitor->getTargetRate();
+  if (newAdvertisedRate_ == advertisedRate_) {
+    return 0;
   }
+  int64_t off = 0;
+  buf[off++] = Protocol::RATE_CMD;
+  Protocol::encodeRate(buf, off, Protocol::kRateCmdLen, newAdvertisedRate_);
+  return off;
 }
 
 /***PROCESS_FILE_CMD***/
-ReceiverState ReceiverThread::processFileCmd() {
-  WTVLOG(1) << "entered PROCESS_FILE_CMD state";
+void ReceiverThread::startReceivingBlocks() {
   // following block needs to be executed for the first file cmd. There is no
   // harm in executing it more than once. number of blocks equal to 0 is a good
   // approximation for first file cmd. Did not want to introduce another boolean
@@ -404,6 +568,31 @@ ReceiverState ReceiverThread::processFileCmd() {
     }
   }
   checkpoint_.resetLastBlockDetails();
+}
+
+void ReceiverThread::chooseReceiveLoop() {
+  const bool checksum = (footerType_ == CHECKSUM_FOOTER);
+  const bool throttled = (wdtParent_->getThrottler() != nullptr);
+  if (checksum) {
+    processFileCmdFn_ =
+        throttled ? &ReceiverThread::processFileCmdImpl<true, true>
+                  : &ReceiverThread::processFileCmdImpl<true, false>;
+  } else {
+    processFileCmdFn_ =
+        throttled ? &ReceiverThread::processFileCmdImpl<false, true>
+                  : &ReceiverThread::processFileCmdImpl<false, false>;
+  }
+}
+
+ReceiverState ReceiverThread::processFileCmd() {
+  return (this->*processFileCmdFn_)();
+}
+
+template <bool kChecksum, bool kThrottled>
+ReceiverState ReceiverThread::processFileCmdImpl() {
+  WTVLOG(1) << "entered PROCESS_FILE_CMD state";
+  startReceivingBlocks();
+  wdtParent_->markFirstByte();
   BlockDetails blockDetails;
   auto guard = folly::makeGuard([&] {
     if (threadStats_.getLocalErrorCode() != OK) {
@@ -430,9 +619,13 @@ ReceiverState ReceiverThread::processFileCmd() {
   sendHeartBeat();
 
   if (headerLen > numRead_) {
-    int64_t end = oldOffset_ + numRead_;
-    numRead_ =
-        readAtLeast(*socket_, buf_ + end, bufSize_ - end, headerLen, numRead_);
+    // with vectored_receive, the data is received in the write buffers
+    int64_t maxRead = bufSize_ - oldOffset_;
+    if (options_.vectored_receive && curConnectionVerified_) {
+      maxRead = std::min<int64_t>(maxRead, headerLen);
+    }
+    numRead_ = readAtLeast(*socket_, buf_ + oldOffset_, maxRead, headerLen,
+                           numRead_);
   }
   if (numRead_ < headerLen) {
     WTLOG(ERROR) << "Unable to read full header " << headerLen << " "
@@ -472,52 +665,116 @@ ReceiverState ReceiverThread::processFileCmd() {
     threadStats_.setLocalErrorCode(PROTOCOL_ERROR);
     return FINISH_WITH_ERROR;
   }
+  if (blockDetails.compressed && compressionType_ == COMP_NONE) {
+    WTLOG(ERROR) << "Compressed block " << blockDetails.fileName
+                 << " while compression is not used";
+    threadStats_.setLocalErrorCode(PROTOCOL_ERROR);
+    return FINISH_WITH_ERROR;
+  }
+  if (!checkDuplicateHeader(blockDetails)) {
+    threadStats_.setLocalErrorCode(PROTOCOL_ERROR);
+    return FINISH_WITH_ERROR;
+  }
 
   // received a well formed file cmd, apply the pending checkpoint update
   checkpointIndex_ = pendingCheckpointIndex_;
   WTVLOG(1) << "Read id:" << blockDetails.fileName
             << " size:" << blockDetails.dataSize << " ooff:" << oldOffset_
             << " off_: " << off_ << " numRead_: " << numRead_;
-  auto &fileCreator = wdtParent_->getFileCreator();
-  FileWriter writer(*threadCtx_, &blockDetails, fileCreator.get());
+  if (dedupFiles_) {
+    addForDuplicates(blockDetails);
+  }
+  std::unique_ptr<Writer> writer =
+      wdtParent_->createWriter(*threadCtx_, &blockDetails, true);
   const auto encryptionType = socket_->getEncryptionType();
+  // position of the first data byte of the block in the socket stream, the
+  // data already in buf_ was read before
+  const int64_t blockDataStart =
+      socket_->getNumRead() - (numRead_ + oldOffset_ - off_);
   auto writtenGuard = folly::makeGuard([&] {
-    if (!encryptionTypeToTagLen(encryptionType) && footerType_ == NO_FOOTER) {
+    if (kChecksum) {
+      // the checksum is only known for the whole block
+      return;
+    }
+    int64_t validBytes;
+    if (!encryptionTypeToTagLen(encryptionType) ||
+        socket_->isKtlsReadEnabled()) {
       // if encryption doesn't have tag verification and checksum verification
       // is disabled, we can consider bytes received before connection break as
-      // valid
-      checkpoint_.setLastBlockDetails(blockDetails.seqId, blockDetails.offset,
-                                      writer.getTotalWritten());
-      threadStats_.addEffectiveBytes(headerBytes, writer.getTotalWritten());
+      // valid. Only bytes actually written to the file count
+      writer->waitForWrites();
+      validBytes = writer->getTotalCompleted();
+    } else {
+      // with tag verification, the bytes up to the last verified tag are
+      // authenticated. A tag verified after the start of this block also
+      // verified all the blocks before it. Which data the verified bytes of
+      // a compressed block decompress to is not known
+      if (blockDetails.compressed) {
+        return;
+      }
+      const int64_t verifiedBytes =
+          socket_->getNumVerifiedRead() - blockDataStart;
+      if (verifiedBytes <= 0) {
+        return;
+      }
+      writer->waitForWrites();
+      validBytes = std::min(verifiedBytes, writer->getTotalCompleted());
+      if (validBytes <= 0) {
+        return;
+      }
+      WTVLOG(1) << "Keeping " << validBytes << " verified bytes of block "
+                << blockDetails.seqId << " " << blockDetails.fileName;
     }
+    checkpoint_.setLastBlockDetails(blockDetails.seqId, blockDetails.offset,
+                                    validBytes);
+    threadStats_.addEffectiveBytes(headerBytes, validBytes);
+    // the sender only sends the rest of the block again
+    BlockDetails receivedPart = blockDetails;
+    receivedPart.dataSize = validBytes;
+    wdtParent_->forwardBlock(receivedPart);
   });
 
   sendHeartBeat();
 
-  // writer.open() deletes files if status == TO_BE_DELETED
+  // writer->open() deletes files if status == TO_BE_DELETED
   // therefore if !(!delete_extra_files && status == TO_BE_DELETED)
-  // we should skip writer.open() call altogether
-  if (options_.delete_extra_files ||
-      blockDetails.allocationStatus != TO_BE_DELETED) {
-    if (writer.open() != OK) {
+  // we should skip writer->open() call altogether
+  // a duplicate is created once the transfer is done
+  if ((options_.delete_extra_files ||
+       blockDetails.allocationStatus != TO_BE_DELETED) &&
+      blockDetails.duplicateOfSeqId == 0) {
+    if (writer->open() != OK) {
       threadStats_.setLocalErrorCode(FILE_WRITE_ERROR);
       return SEND_ABORT_CMD;
     }
   }
+  // the checksum of the written data is computed by the disk writer threads
+  // when the writer can, instead of between the socket reads. The one of a
+  // compressed block is over the received frames
+  const bool offloadedChecksum =
+      kChecksum && !blockDetails.compressed &&
+      writer->offloadChecksum(checksummer_->getType());
 
-  int32_t checksum = 0;
   int64_t remainingData = numRead_ + oldOffset_ - off_;
   int64_t toWrite = remainingData;
   WDT_CHECK(remainingData >= 0);
-  if (remainingData >= blockDetails.dataSize) {
+  if (blockDetails.compressed) {
+    // the frames are decoded by the loop below, from the data already read
+    toWrite = 0;
+  } else if (remainingData >= blockDetails.dataSize) {
     toWrite = blockDetails.dataSize;
   }
   threadStats_.addDataBytes(toWrite);
-  if (footerType_ == CHECKSUM_FOOTER) {
-    checksum = folly::crc32c((const uint8_t *)(buf_ + off_), toWrite, checksum);
+  if (kChecksum) {
+    checksummer_->reset();
+    if (!offloadedChecksum) {
+      checksummer_->update(buf_ + off_, toWrite);
+    }
   }
-  auto throttler = wdtParent_->getThrottler();
-  if (throttler) {
+  // the throttler outlives the transfer, no need to hold a reference
+  Throttler *const throttler =
+      kThrottled ? wdtParent_->getThrottler().get() : nullptr;
+  if (kThrottled) {
     // We might be reading more than we require for this file but
     // throttling should make sense for any additional bytes received
     // on the network
@@ -527,17 +784,26 @@ ReceiverState ReceiverThread::processFileCmd() {
   sendHeartBeat();
 
   ErrorCode code = ERROR;
+  BackpressureMonitor *backpressureMonitor =
+      wdtParent_->getBackpressureMonitor();
+  TimeBreakdown &timeBreakdown = threadCtx_->getTimeBreakdown();
   if (toWrite > 0) {
-    code = writer.write(buf_ + off_, toWrite);
+    const auto writeStartTime = Clock::now();
+    code = writer->write(buf_ + off_, toWrite);
     if (code != OK) {
       threadStats_.setLocalErrorCode(code);
       return SEND_ABORT_CMD;
     }
+    const int64_t writeMicros = durationMicros(Clock::now() - writeStartTime);
+    timeBreakdown.add(TimeBreakdown::DISK, writeMicros);
+    if (backpressureMonitor) {
+      backpressureMonitor->recordWrite(toWrite, writeMicros);
+    }
   }
   off_ += toWrite;
   remainingData -= toWrite;
   // also means no leftOver so it's ok we use buf_ from start
-  while (writer.getTotalWritten() < blockDetails.dataSize) {
+  while (writer->getTotalWritten() < blockDetails.dataSize) {
     if (wdtParent_->getCurAbortCode() != OK) {
       WTLOG(ERROR) << "Thread marked for abort while processing "
                    << blockDetails.fileName << " " << blockDetails.seqId
@@ -548,47 +814,105 @@ ReceiverState ReceiverThread::processFileCmd() {
 
     sendHeartBeat();
 
-    int64_t nres = readAtMost(*socket_, buf_, bufSize_,
-                              blockDetails.dataSize - writer.getTotalWritten());
+    if (blockDetails.compressed) {
+      code = receiveCompressedFrame(*writer, blockDetails, remainingData);
+      if (code == SOCKET_READ_ERROR) {
+        break;
+      }
+      if (code != OK) {
+        threadStats_.setLocalErrorCode(code);
+        return (code == PROTOCOL_ERROR ? FINISH_WITH_ERROR : SEND_ABORT_CMD);
+      }
+      continue;
+    }
+
+    // with asynchronous writes, data is received directly in a buffer of the
+    // writer, while the previous chunks are being written. For O_DIRECT, it
+    // is received in the aligned staging buffer
+    char *readBuf = buf_;
+    int64_t readBufSize = bufSize_;
+    // time blocked waiting for the disks, in getWriteBuffer() and write()
+    int64_t blockedMicros = 0;
+    if (writer->hasWriteBuffers()) {
+      const auto bufferStartTime = Clock::now();
+      readBuf = writer->getWriteBuffer(readBufSize);
+      blockedMicros = durationMicros(Clock::now() - bufferStartTime);
+      if (readBuf == nullptr) {
+        WTLOG(ERROR) << "failed to write to " << blockDetails.fileName;
+        threadStats_.setLocalErrorCode(FILE_WRITE_ERROR);
+        return SEND_ABORT_CMD;
+      }
+    }
+    const int64_t remainingBlock =
+        blockDetails.dataSize - writer->getTotalWritten();
+    const auto readStartTime = Clock::now();
+    int64_t nres;
+    if (options_.vectored_receive && readBuf != buf_ &&
+        remainingBlock <= readBufSize) {
+      // last chunk of the block, the start of the next cmd is received in
+      // the cmd buffer by the same read
+      nres = socket_->readv(readBuf, remainingBlock, buf_,
+                            Protocol::kMinBufLength);
+      if (nres > remainingBlock) {
+        WDT_CHECK_EQ(0, remainingData);
+        off_ = 0;
+        remainingData = nres - remainingBlock;
+        nres = remainingBlock;
+      }
+    } else {
+      nres = readAtMost(*socket_, readBuf, readBufSize, remainingBlock);
+    }
+    timeBreakdown.add(TimeBreakdown::NETWORK,
+                      durationMicros(Clock::now() - readStartTime));
     if (nres <= 0) {
       break;
     }
-    if (throttler) {
+    if (kThrottled) {
       // We only know how much we have read after we are done calling
       // readAtMost. Call throttler with the bytes read off_ the wire.
       throttler->limit(*threadCtx_, nres);
     }
     threadStats_.addDataBytes(nres);
-    if (footerType_ == CHECKSUM_FOOTER) {
-      checksum = folly::crc32c((const uint8_t *)buf_, nres, checksum);
+    if (kChecksum && !offloadedChecksum) {
+      checksummer_->update(readBuf, nres);
     }
 
     sendHeartBeat();
+    sampleTcpInfo(socket_.get(), false);
 
-    code = writer.write(buf_, nres);
+    const auto writeStartTime = Clock::now();
+    code = writer->write(readBuf, nres);
     if (code != OK) {
       WTLOG(ERROR) << "failed to write to " << blockDetails.fileName;
       threadStats_.setLocalErrorCode(code);
       return SEND_ABORT_CMD;
     }
+    blockedMicros += durationMicros(Clock::now() - writeStartTime);
+    timeBreakdown.add(TimeBreakdown::DISK, blockedMicros);
+    if (backpressureMonitor) {
+      backpressureMonitor->recordWrite(nres, blockedMicros);
+    }
   }
 
   // Sync the writer to disk and close it. We need to check for error code each
   // time, otherwise we would move forward with corrupted files.
-  const ErrorCode syncCode = writer.sync();
+  const auto syncStartTime = Clock::now();
+  const ErrorCode syncCode = writer->sync();
+  timeBreakdown.add(TimeBreakdown::DISK,
+                    durationMicros(Clock::now() - syncStartTime));
   if (syncCode != OK) {
     WTLOG(ERROR) << "could not sync " << blockDetails.fileName << " to disk";
     threadStats_.setLocalErrorCode(syncCode);
     return SEND_ABORT_CMD;
   }
-  const ErrorCode closeCode = writer.close();
+  const ErrorCode closeCode = writer->close();
   if (closeCode != OK) {
     WTLOG(ERROR) << "could not close " << blockDetails.fileName;
     threadStats_.setLocalErrorCode(closeCode);
     return SEND_ABORT_CMD;
   }
 
-  if (writer.getTotalWritten() != blockDetails.dataSize) {
+  if (writer->getTotalWritten() != blockDetails.dataSize) {
     // This can only happen if there are transmission errors
     // Write errors to disk are already taken care of above
     WTLOG(ERROR) << "could not read entire content for "
@@ -600,6 +924,339 @@ ReceiverState ReceiverThread::processFileCmd() {
   WVLOG(2) << "completed " << blockDetails.fileName << " off: " << off_
            << " numRead: " << numRead_;
   // Transfer of the file is complete here, mark the bytes effective
+  int64_t checksum = 0;
+  if (kChecksum) {
+    // sync() waited for all the writes, and their checksums
+    checksum = offloadedChecksum ? writer->getChecksum()
+                                 : checksummer_->getValue();
+    blockDetails.checksumType = checksummer_->getType();
+    blockDetails.checksum = checksum;
+  }
+  return finishBlocks(remainingData, checksum, &blockDetails, 1);
+}
+
+bool ReceiverThread::readCompressedBytes(char *dest, int64_t size,
+                                        int64_t &remainingData) {
+  const int64_t fromBuf = std::min(size, remainingData);
+  memcpy(dest, buf_ + off_, fromBuf);
+  off_ += fromBuf;
+  remainingData -= fromBuf;
+  if (fromBuf == size) {
+    return true;
+  }
+  const int64_t toRead = size - fromBuf;
+  return readAtLeast(*socket_, dest + fromBuf, toRead, toRead, 0) == toRead;
+}
+
+ErrorCode ReceiverThread::receiveCompressedFrame(
+    Writer &writer, const BlockDetails &blockDetails,
+    int64_t &remainingData) {
+  TimeBreakdown &timeBreakdown = threadCtx_->getTimeBreakdown();
+  const auto readStartTime = Clock::now();
+  char frameHeader[Protocol::kCompressionFrameHeaderLen];
+  if (!readCompressedBytes(frameHeader, Protocol::kCompressionFrameHeaderLen,
+                           remainingData)) {
+    WTLOG(ERROR) << "Unable to read frame header of " << blockDetails.fileName;
+    return SOCKET_READ_ERROR;
+  }
+  const int64_t rawLen =
+      folly::Endian::little(folly::loadUnaligned<int32_t>(frameHeader));
+  const int64_t wireLen = folly::Endian::little(
+      folly::loadUnaligned<int32_t>(frameHeader + sizeof(int32_t)));
+  const int64_t remainingBlock =
+      blockDetails.dataSize - writer.getTotalWritten();
+  if (rawLen <= 0 || rawLen > remainingBlock ||
+      rawLen > Protocol::kMaxCompressionFrameLen || wireLen <= 0 ||
+      wireLen > rawLen) {
+    WTLOG(ERROR) << "Invalid compressed frame " << rawLen << " " << wireLen
+                 << ", " << remainingBlock << " bytes left in "
+                 << blockDetails.fileName;
+    return PROTOCOL_ERROR;
+  }
+  // frames which did not get smaller are sent uncompressed
+  const bool compressed = (wireLen < rawLen);
+  decompressedFrame_.resize(Protocol::kMaxCompressionFrameLen);
+  char *rawData = decompressedFrame_.data();
+  char *wireData = rawData;
+  if (compressed) {
+    compressedFrame_.resize(Protocol::kMaxCompressionFrameLen);
+    wireData = compressedFrame_.data();
+  }
+  if (!readCompressedBytes(wireData, wireLen, remainingData)) {
+    WTLOG(ERROR) << "Unable to read frame of " << blockDetails.fileName;
+    return SOCKET_READ_ERROR;
+  }
+  timeBreakdown.add(TimeBreakdown::NETWORK,
+                    durationMicros(Clock::now() - readStartTime));
+  const int64_t frameBytes = Protocol::kCompressionFrameHeaderLen + wireLen;
+  auto throttler = wdtParent_->getThrottler();
+  if (throttler) {
+    throttler->limit(*threadCtx_, frameBytes);
+  }
+  if (compressed &&
+      !compressor_->decompressFrame(wireData, wireLen, rawData, rawLen)) {
+    WTLOG(ERROR) << "Unable to decompress frame of " << blockDetails.fileName
+                 << ", " << wireLen << " bytes to " << rawLen;
+    return PROTOCOL_ERROR;
+  }
+  threadStats_.addDataBytes(rawLen);
+  threadStats_.addCompressedBytes(rawLen, frameBytes);
+  if (footerType_ == CHECKSUM_FOOTER) {
+    checksummer_->update(rawData, rawLen);
+  }
+
+  sendHeartBeat();
+
+  const auto writeStartTime = Clock::now();
+  const ErrorCode code = writer.write(rawData, rawLen);
+  if (code != OK) {
+    WTLOG(ERROR) << "failed to write to " << blockDetails.fileName;
+    return code;
+  }
+  const int64_t writeMicros = durationMicros(Clock::now() - writeStartTime);
+  timeBreakdown.add(TimeBreakdown::DISK, writeMicros);
+  BackpressureMonitor *backpressureMonitor =
+      wdtParent_->getBackpressureMonitor();
+  if (backpressureMonitor) {
+    backpressureMonitor->recordWrite(rawLen, writeMicros);
+  }
+  return OK;
+}
+
+ReceiverState ReceiverThread::processFileBatchCmd() {
+  WTVLOG(1) << "entered PROCESS_FILE_BATCH_CMD state";
+  startReceivingBlocks();
+  auto guard = folly::makeGuard([&] {
+    if (threadStats_.getLocalErrorCode() != OK) {
+      threadStats_.incrFailedAttempts();
+    }
+  });
+
+  ErrorCode transferStatus = (ErrorCode)buf_[off_++];
+  if (transferStatus != OK) {
+    WTVLOG(1) << "sender entered into error state "
+              << errorCodeToStr(transferStatus);
+  }
+  int32_t batchLen = folly::loadUnaligned<int32_t>(buf_ + off_);
+  batchLen = folly::Endian::little(batchLen);
+  off_ += sizeof(int32_t);
+  const int64_t cmdLen = Protocol::kFileBatchPrefixLen + batchLen;
+  if (batchLen <= 0 || cmdLen > bufSize_) {
+    WTLOG(ERROR) << "Invalid file batch length " << batchLen
+                 << ", buffer size " << bufSize_;
+    threadStats_.setLocalErrorCode(PROTOCOL_ERROR);
+    return FINISH_WITH_ERROR;
+  }
+
+  sendHeartBeat();
+
+  if (oldOffset_ + cmdLen > bufSize_) {
+    // the whole cmd has to fit in the buffer
+    memmove(buf_, buf_ + oldOffset_, numRead_);
+    off_ -= oldOffset_;
+    oldOffset_ = 0;
+  }
+  if (numRead_ < cmdLen) {
+    numRead_ = readAtLeast(*socket_, buf_ + oldOffset_, bufSize_ - oldOffset_,
+                           cmdLen, numRead_);
+    if (numRead_ < cmdLen) {
+      WTLOG(ERROR) << "Unable to read full file batch " << cmdLen << " "
+                   << numRead_;
+      threadStats_.setLocalErrorCode(SOCKET_READ_ERROR);
+      return ACCEPT_WITH_TIMEOUT;
+    }
+  }
+  wdtParent_->markFirstByte();
+  auto throttler = wdtParent_->getThrottler();
+  if (throttler) {
+    throttler->limit(*threadCtx_, cmdLen);
+  }
+
+  // decode all the headers first so that nothing is written for a bad cmd
+  const int64_t cmdEnd = oldOffset_ + cmdLen;
+  std::vector<BlockDetails> blocks;
+  std::vector<int64_t> dataOffsets;
+  int64_t headerBytes = Protocol::kFileBatchPrefixLen;
+  int64_t dataBytes = 0;
+  while (off_ < cmdEnd) {
+    BlockDetails blockDetails;
+    const int64_t headerStart = off_;
+    if (!Protocol::decodeHeader(threadProtocolVersion_, buf_, off_, cmdEnd,
+                                blockDetails) ||
+        blockDetails.dataSize < 0 || blockDetails.dataSize > cmdEnd - off_) {
+      WTLOG(ERROR) << "Error decoding file batch header at " << headerStart
+                   << " batch end " << cmdEnd;
+      threadStats_.setLocalErrorCode(PROTOCOL_ERROR);
+      return FINISH_WITH_ERROR;
+    }
+    if (blockDetails.allocationStatus == TO_BE_DELETED &&
+        (blockDetails.fileSize != 0 || blockDetails.dataSize != 0)) {
+      WTLOG(ERROR) << "Invalid file header, file to be deleted, but "
+                      "file-size/block-size not zero "
+                   << blockDetails.fileName;
+      threadStats_.setLocalErrorCode(PROTOCOL_ERROR);
+      return FINISH_WITH_ERROR;
+    }
+    if (!checkDuplicateHeader(blockDetails)) {
+      threadStats_.setLocalErrorCode(PROTOCOL_ERROR);
+      return FINISH_WITH_ERROR;
+    }
+    headerBytes += off_ - headerStart;
+    dataBytes += blockDetails.dataSize;
+    dataOffsets.push_back(off_);
+    off_ += blockDetails.dataSize;
+    blocks.emplace_back(std::move(blockDetails));
+  }
+  threadStats_.addHeaderBytes(headerBytes);
+  threadStats_.addEffectiveBytes(headerBytes, 0);
+  threadStats_.addDataBytes(dataBytes);
+
+  // received a well formed file batch cmd, apply the pending checkpoint update
+  checkpointIndex_ = pendingCheckpointIndex_;
+  WTVLOG(1) << "Read batch of " << blocks.size() << " files, " << cmdLen
+            << " bytes";
+  // the footer has the combined checksums of the files, in order
+  int64_t checksum = 0;
+  BackpressureMonitor *backpressureMonitor =
+      wdtParent_->getBackpressureMonitor();
+  for (size_t i = 0; i < blocks.size(); i++) {
+    BlockDetails &blockDetails = blocks[i];
+    char *data = buf_ + dataOffsets[i];
+    if (footerType_ == CHECKSUM_FOOTER) {
+      checksummer_->reset();
+      checksummer_->update(data, blockDetails.dataSize);
+      blockDetails.checksumType = checksummer_->getType();
+      blockDetails.checksum = checksummer_->getValue();
+      checksum = BlockChecksum::combine(blockDetails.checksumType, checksum,
+                                        blockDetails.checksum,
+                                        blockDetails.dataSize);
+    }
+    if (dedupFiles_) {
+      addForDuplicates(blockDetails);
+    }
+    if ((!options_.delete_extra_files &&
+         blockDetails.allocationStatus == TO_BE_DELETED) ||
+        blockDetails.duplicateOfSeqId > 0) {
+      continue;
+    }
+    std::unique_ptr<Writer> writer =
+        wdtParent_->createWriter(*threadCtx_, &blockDetails, false);
+    if (writer->open() != OK) {
+      threadStats_.setLocalErrorCode(FILE_WRITE_ERROR);
+      return SEND_ABORT_CMD;
+    }
+    if (blockDetails.dataSize > 0) {
+      const auto writeStartTime = Clock::now();
+      ErrorCode code = writer->write(data, blockDetails.dataSize);
+      if (code != OK) {
+        WTLOG(ERROR) << "failed to write to " << blockDetails.fileName;
+        threadStats_.setLocalErrorCode(code);
+        return SEND_ABORT_CMD;
+      }
+      if (backpressureMonitor) {
+        backpressureMonitor->recordWrite(
+            blockDetails.dataSize,
+            durationMicros(Clock::now() - writeStartTime));
+      }
+    }
+    const ErrorCode syncCode = writer->sync();
+    if (syncCode != OK) {
+      WTLOG(ERROR) << "could not sync " << blockDetails.fileName << " to disk";
+      threadStats_.setLocalErrorCode(syncCode);
+      return SEND_ABORT_CMD;
+    }
+    const ErrorCode closeCode = writer->close();
+    if (closeCode != OK) {
+      WTLOG(ERROR) << "could not close " << blockDetails.fileName;
+      threadStats_.setLocalErrorCode(closeCode);
+      return SEND_ABORT_CMD;
+    }
+  }
+  WDT_CHECK_EQ(off_, cmdEnd);
+  return finishBlocks(numRead_ - cmdLen, checksum, blocks.data(),
+                      blocks.size());
+}
+
+bool ReceiverThread::checkDuplicateHeader(const BlockDetails &blockDetails) {
+  if (blockDetails.duplicateOfSeqId == 0) {
+    return true;
+  }
+  if (!dedupFiles_ || blockDetails.dataSize != 0 ||
+      blockDetails.allocationStatus != NOT_EXISTS ||
+      blockDetails.duplicateOfSeqId == blockDetails.seqId) {
+    WTLOG(ERROR) << "Invalid duplicate " << blockDetails.fileName
+                 << " of seq-id " << blockDetails.duplicateOfSeqId
+                 << ", block-size " << blockDetails.dataSize
+                 << ", deduplication " << dedupFiles_;
+    return false;
+  }
+  return true;
+}
+
+void ReceiverThread::addForDuplicates(const BlockDetails &blockDetails) {
+  auto &fileCreator = wdtParent_->getFileCreator();
+  if (blockDetails.duplicateOfSeqId > 0) {
+    fileCreator->addDuplicate(blockDetails);
+  } else if (blockDetails.offset == 0 &&
+             blockDetails.allocationStatus == NOT_EXISTS) {
+    // only a file sent in full can be the original of a duplicate
+    fileCreator->addReceivedFile(blockDetails.seqId, blockDetails.fileName);
+  }
+}
+
+ReceiverState ReceiverThread::processManifestCmd() {
+  WTVLOG(1) << "entered PROCESS_MANIFEST_CMD state";
+  int32_t manifestLen = folly::loadUnaligned<int32_t>(buf_ + off_);
+  manifestLen = folly::Endian::little(manifestLen);
+  off_ += sizeof(int32_t);
+  const int64_t cmdLen = Protocol::kManifestPrefixLen + manifestLen;
+  if (manifestLen <= 0 || cmdLen > bufSize_) {
+    WTLOG(ERROR) << "Invalid manifest length " << manifestLen
+                 << ", buffer size " << bufSize_;
+    threadStats_.setLocalErrorCode(PROTOCOL_ERROR);
+    return FINISH_WITH_ERROR;
+  }
+  if (oldOffset_ + cmdLen > bufSize_) {
+    // the whole cmd has to fit in the buffer
+    memmove(buf_, buf_ + oldOffset_, numRead_);
+    off_ -= oldOffset_;
+    oldOffset_ = 0;
+  }
+  if (numRead_ < cmdLen) {
+    numRead_ = readAtLeast(*socket_, buf_ + oldOffset_, bufSize_ - oldOffset_,
+                           cmdLen, numRead_);
+    if (numRead_ < cmdLen) {
+      WTLOG(ERROR) << "Unable to read full manifest " << cmdLen << " "
+                   << numRead_;
+      threadStats_.setLocalErrorCode(SOCKET_READ_ERROR);
+      return ACCEPT_WITH_TIMEOUT;
+    }
+  }
+  const int64_t cmdEnd = oldOffset_ + cmdLen;
+  std::vector<BlockDetails> entries;
+  if (!Protocol::decodeManifest(buf_, off_, cmdEnd, entries)) {
+    WTLOG(ERROR) << "Unable to decode manifest of length " << manifestLen;
+    threadStats_.setLocalErrorCode(PROTOCOL_ERROR);
+    return FINISH_WITH_ERROR;
+  }
+  WDT_CHECK_EQ(off_, cmdEnd);
+  threadStats_.addHeaderBytes(cmdLen);
+  WTVLOG(1) << "Read manifest of " << entries.size() << " files";
+  wdtParent_->getFileCreator()->prepareFiles(options_, entries);
+  numRead_ -= cmdLen;
+  if (numRead_ == 0) {
+    off_ = 0;
+  } else if (numRead_ < Protocol::kMaxHeader && off_ > bufSize_ / 2) {
+    memmove(buf_, buf_ + off_, numRead_);
+    off_ = 0;
+  }
+  return READ_NEXT_CMD;
+}
+
+ReceiverState ReceiverThread::finishBlocks(int64_t remainingData,
+                                           int64_t checksum,
+                                           const BlockDetails *blocks,
+                                           size_t numBlocks) {
   WDT_CHECK(remainingData >= 0) << "Negative remainingData " << remainingData;
   if (remainingData > 0) {
     // if we need to read more anyway, let's move the data
@@ -624,7 +1281,7 @@ ReceiverState ReceiverThread::processFileCmd() {
     sendHeartBeat();
     // have to read footer cmd
     oldOffset_ = off_;
-    numRead_ = readAtLeast(*socket_, buf_ + off_, bufSize_ - off_,
+    numRead_ = readAtLeast(*socket_, buf_ + off_, getMaxCmdRead(),
                            Protocol::kMinBufLength, numRead_);
     if (numRead_ < Protocol::kMinBufLength) {
       WTLOG(ERROR) << "socket read failure " << Protocol::kMinBufLength << " "
@@ -638,7 +1295,7 @@ ReceiverState ReceiverThread::processFileCmd() {
       threadStats_.setLocalErrorCode(PROTOCOL_ERROR);
       return FINISH_WITH_ERROR;
     }
-    int32_t receivedChecksum;
+    int64_t receivedChecksum;
     bool ok = Protocol::decodeFooter(
         buf_, off_, oldOffset_ + Protocol::kMaxFooter, receivedChecksum);
     if (!ok) {
@@ -649,29 +1306,49 @@ ReceiverState ReceiverThread::processFileCmd() {
     if (checksum != receivedChecksum) {
       WTLOG(ERROR) << "Checksum mismatch " << checksum << " "
                    << receivedChecksum << " port " << socket_->getPort()
-                   << " file " << blockDetails.fileName;
+                   << " file " << blocks[0].fileName << " num blocks "
+                   << numBlocks;
       threadStats_.setLocalErrorCode(CHECKSUM_MISMATCH);
       return ACCEPT_WITH_TIMEOUT;
     }
-    markBlockVerified(blockDetails);
+    for (size_t i = 0; i < numBlocks; i++) {
+      markBlockVerified(blocks[i]);
+    }
     int64_t msgLen = off_ - oldOffset_;
     numRead_ -= msgLen;
   } else {
     WDT_CHECK(footerType_ == NO_FOOTER);
-    if (encryptionTypeToTagLen(encryptionType)) {
-      blocksWaitingVerification_.emplace_back(blockDetails);
-    } else {
-      markBlockVerified(blockDetails);
+    // kernel tls only returns data of verified records
+    const bool waitForTag =
+        encryptionTypeToTagLen(socket_->getEncryptionType()) != 0 &&
+        !socket_->isKtlsReadEnabled();
+    for (size_t i = 0; i < numBlocks; i++) {
+      if (waitForTag) {
+        blocksWaitingVerification_.emplace_back(blocks[i]);
+      } else {
+        markBlockVerified(blocks[i]);
+      }
     }
   }
   return READ_NEXT_CMD;
 }
 
+int64_t ReceiverThread::getMaxCmdRead() const {
+  const int64_t room = bufSize_ - off_;
+  // the settings cmd can be larger than kMinBufLength
+  if (!options_.vectored_receive || !curConnectionVerified_) {
+    return room;
+  }
+  return std::min(room, std::max(numRead_, Protocol::kMinBufLength));
+}
+
 void ReceiverThread::markBlockVerified(const BlockDetails &blockDetails) {
   threadStats_.addEffectiveBytes(0, blockDetails.dataSize);
   threadStats_.incrNumBlocks();
   checkpoint_.incrNumBlocks();
-  if (!options_.isLogBasedResumption()) {
+  wdtParent_->forwardBlock(blockDetails);
+  if (!options_.isLogBasedResumption() || blockDetails.duplicateOfSeqId > 0) {
+    // duplicates are logged once copied
     return;
   }
   TransferLogManager &transferLogManager = wdtParent_->getTransferLogManager();
@@ -679,8 +1356,16 @@ void ReceiverThread::markBlockVerified(const BlockDetails &blockDetails) {
     transferLogManager.addFileInvalidationEntry(blockDetails.seqId);
     return;
   }
+  DurabilityQueue *durabilityQueue = wdtParent_->getDurabilityQueue();
+  if (durabilityQueue != nullptr) {
+    // logged once the block is durable
+    durabilityQueue->markVerified(blockDetails);
+    return;
+  }
   transferLogManager.addBlockWriteEntry(blockDetails.seqId, blockDetails.offset,
-                                        blockDetails.dataSize);
+                                        blockDetails.dataSize,
+                                        blockDetails.checksumType,
+                                        blockDetails.checksum);
 }
 
 void ReceiverThread::markReceivedBlocksVerified() {
@@ -731,6 +1416,15 @@ ReceiverState ReceiverThread::processSizeCmd() {
   }
   WVLOG(1) << "Number of bytes to receive " << totalSenderBytes;
   threadStats_.setTotalSenderBytes(totalSenderBytes);
+  if (options_.check_free_space) {
+    // every thread gets the size, the check is only made once
+    const ErrorCode code = wdtParent_->getFileCreator()->checkFreeSpace(
+        options_, totalSenderBytes);
+    if (code != OK) {
+      threadStats_.setLocalErrorCode(code);
+      return SEND_ABORT_CMD;
+    }
+  }
   auto msgLen = off_ - oldOffset_;
   numRead_ -= msgLen;
   return READ_NEXT_CMD;
@@ -770,10 +1464,31 @@ ReceiverState ReceiverThread::sendFileChunks() {
         break;
       }
       case FUNNEL_START: {
+        // older senders need the number of entries upfront
+        const bool streamed = threadProtocolVersion_ >=
+                                  Protocol::STREAMED_FILE_CHUNKS_VERSION &&
+                              !wdtParent_->waitForFileChunksInfo(0);
+        while (!streamed &&
+               !wdtParent_->waitForFileChunksInfo(waitingTimeMillis)) {
+          if (wdtParent_->getCurAbortCode() != OK) {
+            threadStats_.setLocalErrorCode(ABORT);
+            execFunnel->notifyFail();
+            return FINISH_WITH_ERROR;
+          }
+          buf_[0] = Protocol::WAIT_CMD;
+          if (socket_->write(buf_, 1) != 1) {
+            WTLOG(ERROR) << "socket write error while preparing file chunks";
+            threadStats_.setLocalErrorCode(SOCKET_WRITE_ERROR);
+            execFunnel->notifyFail();
+            return ACCEPT_WITH_TIMEOUT;
+          }
+          threadStats_.addHeaderBytes(1);
+        }
         int64_t off = 0;
         buf_[off++] = Protocol::CHUNKS_CMD;
         const auto &fileChunksInfo = wdtParent_->getFileChunksInfo();
-        const int64_t numParsedChunksInfo = fileChunksInfo.size();
+        const int64_t numParsedChunksInfo =
+            streamed ? Protocol::kStreamedNumFiles : fileChunksInfo.size();
         Protocol::encodeChunksCmd(buf_, off, /* size of buf_ */ bufSize_,
                                   /* param to send */ bufSize_,
                                   numParsedChunksInfo);
@@ -792,10 +1507,24 @@ ReceiverState ReceiverThread::sendFileChunks() {
         // single
         // chunk can not fit in the buffer, it is ignored. Format of encoding :
         // <data-size><chunk1><chunk2>...
-        while (numEntriesWritten < numParsedChunksInfo) {
+        bool complete = !streamed;
+        while (streamed ? !complete
+                        : numEntriesWritten < numParsedChunksInfo) {
+          if (wdtParent_->getCurAbortCode() != OK) {
+            threadStats_.setLocalErrorCode(ABORT);
+            execFunnel->notifyFail();
+            return FINISH_WITH_ERROR;
+          }
           off = sizeof(int32_t);
-          int64_t numEntriesEncoded = Protocol::encodeFileChunksInfoList(
-              buf_, off, bufSize_, numEntriesWritten, fileChunksInfo);
+          // while streamed, a page is sent at least every waitingTimeMillis,
+          // possibly empty, so that the sender does not time out
+          int64_t numEntriesEncoded =
+              streamed ? wdtParent_->encodeFileChunksInfo(
+                             threadProtocolVersion_, buf_, off, bufSize_,
+                             numEntriesWritten, waitingTimeMillis, complete)
+                       : Protocol::encodeFileChunksInfoList(
+                             threadProtocolVersion_, buf_, off, bufSize_,
+                             numEntriesWritten, fileChunksInfo);
           int32_t dataSize = folly::Endian::little(off - sizeof(int32_t));
           folly::storeUnaligned<int32_t>(buf_, dataSize);
           written = socket_->write(buf_, off);
@@ -803,17 +1532,30 @@ ReceiverState ReceiverThread::sendFileChunks() {
             threadStats_.addHeaderBytes(written);
           }
           if (written != off) {
+            complete = false;
             break;
           }
           numEntriesWritten += numEntriesEncoded;
         }
-        if (numEntriesWritten != numParsedChunksInfo) {
+        if (streamed && complete) {
+          folly::storeUnaligned<int32_t>(
+              buf_, folly::Endian::little(Protocol::kChunksStreamEnd));
+          written = socket_->write(buf_, sizeof(int32_t));
+          if (written > 0) {
+            threadStats_.addHeaderBytes(written);
+          }
+          complete = (written == sizeof(int32_t));
+        }
+        if (streamed ? !complete : numEntriesWritten != numParsedChunksInfo) {
           WTLOG(ERROR) << "Could not write all the file chunks "
                        << numParsedChunksInfo << " " << numEntriesWritten;
           threadStats_.setLocalErrorCode(SOCKET_WRITE_ERROR);
           execFunnel->notifyFail();
           return ACCEPT_WITH_TIMEOUT;
         }
+        if (streamed) {
+          WTLOG(INFO) << "Streamed " << numEntriesWritten << " file chunks";
+        }
         // try to read ack
         int64_t toRead = 1;
         int64_t numRead = socket_->read(buf_, toRead);
@@ -879,6 +1621,42 @@ ReceiverState ReceiverThread::sendAbortCmd() {
 
 ReceiverState ReceiverThread::sendDoneCmd() {
   WTVLOG(1) << "entered SEND_DONE_CMD state";
+  const int timeoutMillis = senderReadTimeout_ / kWaitTimeoutFactor;
+  auto &fileCreator = wdtParent_->getFileCreator();
+  // every block is received, the duplicates can be copied from their originals
+  while (!fileCreator->copyDuplicates(options_, timeoutMillis)) {
+    buf_[0] = Protocol::WAIT_CMD;
+    if (socket_->write(buf_, 1) != 1) {
+      WTPLOG(ERROR) << "unable to write WAIT";
+      threadStats_.setLocalErrorCode(SOCKET_WRITE_ERROR);
+      return ACCEPT_WITH_TIMEOUT;
+    }
+    threadStats_.addHeaderBytes(1);
+  }
+  if (fileCreator->hasFailedDuplicates()) {
+    WTLOG(ERROR) << "unable to copy the duplicate files received";
+    threadStats_.setLocalErrorCode(FILE_WRITE_ERROR);
+    return FINISH_WITH_ERROR;
+  }
+  DurabilityQueue *durabilityQueue = wdtParent_->getDurabilityQueue();
+  if (durabilityQueue != nullptr) {
+    // DONE is sent only once every file received is durable
+    while (!durabilityQueue->drain(timeoutMillis)) {
+      // send WAIT cmd to keep sender thread alive
+      buf_[0] = Protocol::WAIT_CMD;
+      if (socket_->write(buf_, 1) != 1) {
+        WTPLOG(ERROR) << "unable to write WAIT";
+        threadStats_.setLocalErrorCode(SOCKET_WRITE_ERROR);
+        return ACCEPT_WITH_TIMEOUT;
+      }
+      threadStats_.addHeaderBytes(1);
+    }
+    if (durabilityQueue->hasFailed()) {
+      WTLOG(ERROR) << "unable to sync the files received";
+      threadStats_.setLocalErrorCode(FILE_WRITE_ERROR);
+      return FINISH_WITH_ERROR;
+    }
+  }
   buf_[0] = Protocol::DONE_CMD;
   if (socket_->write(buf_, 1) != 1) {
     WTPLOG(ERROR) << "unable to send DONE " << threadIndex_;
@@ -924,10 +1702,18 @@ ReceiverState ReceiverThread::finishWithError() {
   auto guard = cv->acquire();
   wdtParent_->addCheckpoint(checkpoint_);
   controller_->markState(threadIndex_, FINISHED);
-  guard.notifyOne();
+  notifyWaitingThreads(guard);
   return END;
 }
 
+void ReceiverThread::notifyWaitingThreads(ConditionGuardImpl &guard) {
+  guard.notifyOne();
+  if (runtime_ != nullptr) {
+    // threads parked on the runtime don't wait on the condition
+    runtime_->wakeTimerWaits();
+  }
+}
+
 ReceiverState ReceiverThread::checkForFinishOrNewCheckpoints() {
   auto checkpoints = wdtParent_->getNewCheckpoints(checkpointIndex_);
   if (!checkpoints.empty()) {
@@ -944,19 +1730,35 @@ ReceiverState ReceiverThread::checkForFinishOrNewCheckpoints() {
 }
 
 ReceiverState ReceiverThread::waitForFinishOrNewCheckpoint() {
-  WTLOG(INFO) << "entered WAIT_FOR_FINISH_OR_NEW_CHECKPOINT state";
-  // should only be called if the are no errors
-  WDT_CHECK(threadStats_.getLocalErrorCode() == OK);
+  if (!waiting_) {
+    WTLOG(INFO) << "entered WAIT_FOR_FINISH_OR_NEW_CHECKPOINT state";
+    // should only be called if the are no errors
+    WDT_CHECK(threadStats_.getLocalErrorCode() == OK);
+    controller_->markState(threadIndex_, WAITING);
+  }
   auto cv = controller_->getCondition(WAIT_FOR_FINISH_OR_CHECKPOINT_CV);
   int timeoutMillis = senderReadTimeout_ / kWaitTimeoutFactor;
-  controller_->markState(threadIndex_, WAITING);
   while (true) {
     WDT_CHECK(senderReadTimeout_ > 0);  // must have received settings
-    {
+    if (runtime_ != nullptr) {
+      {
+        auto guard = cv->acquire();
+        auto state = checkForFinishOrNewCheckpoints();
+        if (state != WAIT_FOR_FINISH_OR_NEW_CHECKPOINT) {
+          notifyWaitingThreads(guard);
+          return state;
+        }
+      }
+      // parked without waiting on the condition, the other threads are
+      // checked again at every slice of the wait
+      if (waitForReadable({}, timeoutMillis) == WAIT_PARKED) {
+        return WAIT_FOR_FINISH_OR_NEW_CHECKPOINT;
+      }
+    } else {
       auto guard = cv->acquire();
       auto state = checkForFinishOrNewCheckpoints();
       if (state != WAIT_FOR_FINISH_OR_NEW_CHECKPOINT) {
-        guard.notifyOne();
+        notifyWaitingThreads(guard);
         return state;
       }
       {
@@ -966,7 +1768,7 @@ ReceiverState ReceiverThread::waitForFinishOrNewCheckpoint() {
       }
       state = checkForFinishOrNewCheckpoints();
       if (state != WAIT_FOR_FINISH_OR_NEW_CHECKPOINT) {
-        guard.notifyOne();
+        notifyWaitingThreads(guard);
         return state;
       }
     }
@@ -982,13 +1784,59 @@ ReceiverState ReceiverThread::waitForFinishOrNewCheckpoint() {
   }
 }
 
-void ReceiverThread::start() {
-  if (buf_ == nullptr) {
-    WTLOG(ERROR) << "Unable to allocate buffer";
-    threadStats_.setLocalErrorCode(MEMORY_ALLOCATION_ERROR);
-    return;
+ReceiverThread::WaitResult ReceiverThread::waitForReadable(
+    const std::vector<int> &fds, int timeoutMillis) {
+  if (runtime_ == nullptr) {
+    return WAIT_READY;
   }
-  ReceiverState state = LISTEN;
+  const auto now = Clock::now();
+  if (!waiting_) {
+    waiting_ = true;
+    waitDeadline_ = now + std::chrono::milliseconds(timeoutMillis);
+  }
+  std::vector<struct pollfd> pollFds;
+  for (int fd : fds) {
+    pollFds.push_back({fd, POLLIN, 0});
+  }
+  if (!pollFds.empty() && poll(pollFds.data(), pollFds.size(), 0) > 0) {
+    waiting_ = false;
+    return WAIT_READY;
+  }
+  if (now >= waitDeadline_) {
+    waiting_ = false;
+    return WAIT_TIMED_OUT;
+  }
+  int sliceMillis = durationMillis(waitDeadline_ - now) + 1;
+  if (options_.abort_check_interval_millis > 0) {
+    sliceMillis = std::min(sliceMillis, options_.abort_check_interval_millis);
+  }
+  wait_.fds = fds;
+  wait_.timeoutMillis = sliceMillis;
+  waitRequested_ = true;
+  return WAIT_PARKED;
+}
+
+ReceiverThread::WaitResult ReceiverThread::waitForConnection(
+    int timeoutMillis) {
+  const std::vector<int> &fds = socket_->getListeningFds();
+  if (fds.empty()) {
+    // accept listens again
+    return WAIT_READY;
+  }
+  return waitForReadable(fds, timeoutMillis);
+}
+
+ReceiverThread::WaitResult ReceiverThread::waitForSocketReadable(
+    int timeoutMillis) {
+  if (runtime_ != nullptr && socket_->isReadable()) {
+    // data the transport already received does not wake up its poll fd
+    waiting_ = false;
+    return WAIT_READY;
+  }
+  return waitForReadable({socket_->getPollFd()}, timeoutMillis);
+}
+
+bool ReceiverThread::runStates() {
   while (true) {
     ErrorCode abortCode = wdtParent_->getCurAbortCode();
     if (abortCode != OK) {
@@ -997,15 +1845,87 @@ void ReceiverThread::start() {
       threadStats_.setLocalErrorCode(ABORT);
       break;
     }
-    if (state == END) {
+    if (state_ == END) {
       break;
     }
-    state = (this->*stateMap_[state])();
+    {
+      TraceSpan span(kReceiverStateNames[state_]);
+      state_ = (this->*stateMap_[state_])();
+    }
+    if (waitRequested_) {
+      waitRequested_ = false;
+      return false;
+    }
+    waiting_ = false;
+  }
+  return true;
+}
+
+void ReceiverThread::start() {
+  state_ = LISTEN;
+  waiting_ = false;
+  if (TransferTracer::get().isEnabled()) {
+    TransferTracer::get().setThreadName("receiver thread " +
+                                        std::to_string(threadIndex_));
+  }
+  Wait wait;
+  // without runtime the states never wait, so this runs till the end
+  runSlice(wait);
+}
+
+void ReceiverThread::startThread() {
+  runtime_ = wdtParent_->runtime_.get();
+  if (runtime_ == nullptr) {
+    WdtThread::startThread();
+    return;
+  }
+  WDT_CHECK(!startedOnRuntime_) << "Receiver thread already running "
+                                << threadIndex_ << " " << getPort();
+  WDT_CHECK_EQ(controller_->getState(threadIndex_), RUNNING);
+  state_ = LISTEN;
+  waiting_ = false;
+  startedOnRuntime_ = true;
+  runtime_->start(this, wdtParent_->runtimeGroup_);
+}
+
+ErrorCode ReceiverThread::finish() {
+  if (!startedOnRuntime_) {
+    return WdtThread::finish();
+  }
+  runtime_->waitForEnd(this);
+  startedOnRuntime_ = false;
+  return OK;
+}
+
+bool ReceiverThread::runSlice(Wait &wait) {
+  if (buf_ == nullptr) {
+    WTLOG(ERROR) << "Unable to allocate buffer";
+    threadStats_.setLocalErrorCode(MEMORY_ALLOCATION_ERROR);
+    return true;
+  }
+  if (!runStates()) {
+    wait = std::move(wait_);
+    wait_ = Wait();
+    return false;
+  }
+  endRun();
+  return true;
+}
+
+void ReceiverThread::endRun() {
+  FdCache *fdCache = threadCtx_->getFdCache();
+  if (fdCache != nullptr) {
+    fdCache->clear();
   }
   controller_->deRegisterThread(threadIndex_);
   controller_->executeAtEnd([&]() { wdtParent_->endCurGlobalSession(); });
   WDT_CHECK(socket_.get());
   threadStats_.setEncryptionType(socket_->getEncryptionType());
+  sampleTcpInfo(socket_.get(), true);
+  if (connectedTime_ != Clock::time_point()) {
+    threadCtx_->getTimeBreakdown().setTotalMicros(
+        durationMicros(Clock::now() - connectedTime_));
+  }
   WTLOG(INFO) << threadStats_;
 }
 
@@ -1047,9 +1967,21 @@ void ReceiverThread::reset() {
   checkpoints_.clear();
   newCheckpoints_.clear();
   checkpoint_ = Checkpoint(socket_->getPort());
+  connectedTime_ = Clock::time_point();
+  threadCtx_->getTimeBreakdown() = TimeBreakdown();
+  // seqIds are only valid within a session
+  FdCache *fdCache = threadCtx_->getFdCache();
+  if (fdCache != nullptr) {
+    fdCache->clear();
+  }
 }
 
 ReceiverThread::~ReceiverThread() {
+  if (startedOnRuntime_) {
+    WTLOG(INFO) << "Receiver thread still running on the runtime while "
+                << "being destructed";
+    finish();
+  }
 }
 }
 }
@@ -10,12 +10,16 @@
 #include <wdt/Receiver.h>
 #include <wdt/WdtBase.h>
 #include <wdt/WdtThread.h>
+#include <wdt/util/BlockChecksum.h>
+#include <wdt/util/BlockCompressor.h>
+#include <wdt/util/ReceiverRuntime.h>
 #include <wdt/util/ServerSocket.h>
 
 namespace facebook {
 namespace wdt {
 
 class Receiver;
+class Writer;
 /**
  * Wdt receiver has logic to maintain the consistency of the
  * transfers through connection errors. All threads are run by the logic
@@ -32,6 +36,8 @@ enum ReceiverState {
   PROCESS_SETTINGS_CMD,
   PROCESS_DONE_CMD,
   PROCESS_SIZE_CMD,
+  PROCESS_FILE_BATCH_CMD,
+  PROCESS_MANIFEST_CMD,
   SEND_FILE_CHUNKS,
   SEND_GLOBAL_CHECKPOINTS,
   SEND_DONE_CMD,
@@ -47,7 +53,7 @@ enum ReceiverState {
  * receive data from the wdt sender. All the receiver threads
  * share modules like threads controller, throttler etc
  */
-class ReceiverThread : public WdtThread {
+class ReceiverThread : public WdtThread, public RuntimeTask {
  public:
   /// Identifiers for the funnels that this thread will use
   enum RECEIVER_FUNNELS { SEND_FILE_CHUNKS_FUNNEL, NUM_FUNNELS };
@@ -85,6 +91,16 @@ class ReceiverThread : public WdtThread {
   /// Get the port this receiver thread is listening on
   int32_t getPort() const override;
 
+  /// Runs the state machine on the runtime of the receiver if it has one,
+  /// else on a thread of its own
+  void startThread() override;
+
+  /// Waits for the state machine to end
+  ErrorCode finish() override;
+
+  /// Runs the state machine till it ends or has to wait (@see RuntimeTask)
+  bool runSlice(Wait &wait) override;
+
  private:
   /// Overloaded operator for printing thread info
   friend std::ostream &operator<<(std::ostream &os,
@@ -158,6 +174,8 @@ class ReceiverThread : public WdtThread {
    *               PROCESS_DONE_CMD,
    *               PROCESS_SETTINGS_CMD,
    *               PROCESS_SIZE_CMD,
+   *               PROCESS_FILE_BATCH_CMD,
+   *               PROCESS_MANIFEST_CMD,
    *               ACCEPT_WITH_TIMEOUT(in case of read failure),
    *               FINISH_WITH_ERROR(in case of protocol errors)
    */
@@ -171,6 +189,43 @@ class ReceiverThread : public WdtThread {
    *               ACCEPT_WITH_TIMEOUT(socket read failure)
    */
   ReceiverState processFileCmd();
+
+  /**
+   * processFileCmd() specialized on the features of the transfer checked for
+   * every chunk, so that the transfers without them don't branch on them.
+   * Chosen by chooseReceiveLoop()
+   *
+   * @tparam kChecksum    whether the blocks come with a checksum footer
+   * @tparam kThrottled   whether the transfer has a throttler
+   */
+  template <bool kChecksum, bool kThrottled>
+  ReceiverState processFileCmdImpl();
+
+  /// picks the specialization of processFileCmd() for the footer type and
+  /// throttler of the transfer, once the settings are received
+  void chooseReceiveLoop();
+
+  /// specialization of processFileCmd() used by the thread
+  StateFunction processFileCmdFn_{nullptr};
+  /**
+   * Processes a file batch cmd, carrying the headers and data of many small
+   * blocks. The whole cmd is read in the buffer before writing the files.
+   * Previous states : READ_NEXT_CMD
+   * Next states : READ_NEXT_CMD(success),
+   *               FINISH_WITH_ERROR(protocol error),
+   *               ACCEPT_WITH_TIMEOUT(socket read failure),
+   *               SEND_ABORT_CMD(write failure)
+   */
+  ReceiverState processFileBatchCmd();
+  /**
+   * Processes a manifest cmd, listing files the sender is going to send.
+   * They are handed to the file creator to be prepared in the background.
+   * Previous states : READ_NEXT_CMD
+   * Next states : READ_NEXT_CMD(success),
+   *               FINISH_WITH_ERROR(protocol error),
+   *               ACCEPT_WITH_TIMEOUT(socket read failure)
+   */
+  ReceiverState processManifestCmd();
   /**
    * Processes settings cmd. Settings has a connection settings,
    * protocol version, transfer id, etc. For more info check Protocol.h
@@ -246,6 +301,10 @@ class ReceiverThread : public WdtThread {
    */
   ReceiverState checkForFinishOrNewCheckpoints();
 
+  /// notifies the threads waiting for the transfer to finish, guard is held on
+  /// WAIT_FOR_FINISH_OR_CHECKPOINT_CV
+  void notifyWaitingThreads(ConditionGuardImpl &guard);
+
   /**
    * Waits for transfer to finish or new checkpoints. This state first
    * increments waitingThreadCount_. Then, it
@@ -269,6 +328,67 @@ class ReceiverThread : public WdtThread {
    */
   ReceiverState finishWithError();
 
+  /// setup done at the start of every file or file batch cmd
+  void startReceivingBlocks();
+
+  /**
+   * Receives the next frame of a compressed block and writes its
+   * decompressed data
+   *
+   * @param writer          writer of the block
+   * @param blockDetails    details of the block
+   * @param remainingData   number of bytes read past the frames already
+   *                        received, at off_ in buf_
+   *
+   * @return                SOCKET_READ_ERROR if the frame could not be read,
+   *                        PROTOCOL_ERROR if it is invalid, or the status of
+   *                        the write
+   */
+  ErrorCode receiveCompressedFrame(Writer &writer,
+                                   const BlockDetails &blockDetails,
+                                   int64_t &remainingData);
+
+  /**
+   * Reads bytes of a compressed block, starting with those already in buf_,
+   * and never reading past them from the socket
+   *
+   * @return    whether all the bytes could be read
+   */
+  bool readCompressedBytes(char *dest, int64_t size, int64_t &remainingData);
+
+  /// @return   false if the block is a duplicate which can not be valid
+  bool checkDuplicateHeader(const BlockDetails &blockDetails);
+
+  /**
+   * Records a block for the duplicate files, the duplicates themselves and
+   * the names of the files they can be a copy of
+   */
+  void addForDuplicates(const BlockDetails &blockDetails);
+
+  /**
+   * Common end of file and file batch cmds, once the data has been consumed
+   * up to off_: makes room for the next cmd, reads and verifies the footer if
+   * any, and marks the blocks received
+   *
+   * @param remainingData   number of bytes read past the end of the cmd
+   * @param checksum        checksum of the data of the blocks, the combined
+   *                        checksums of the blocks for a batch
+   * @param blocks          blocks received
+   * @param numBlocks       number of blocks
+   *
+   * @return                next state
+   */
+  ReceiverState finishBlocks(int64_t remainingData, int64_t checksum,
+                             const BlockDetails *blocks, size_t numBlocks);
+
+  /**
+   * @return    max number of bytes a cmd read can put in the buffer at off_.
+   *            With vectored_receive, reads past the cmd are bounded so that
+   *            file data is received directly in the buffers it is written
+   *            from.
+   */
+  int64_t getMaxCmdRead() const;
+
   /// marks a block a verified
   void markBlockVerified(const BlockDetails &blockDetails);
 
@@ -279,12 +399,89 @@ class ReceiverThread : public WdtThread {
   /// another heart-beat, and if yes, sends a heart-beat
   void sendHeartBeat();
 
+  /**
+   * Encodes the rate cmd of the target rate of the backpressure monitor if it
+   * changed since it was last advertised
+   *
+   * @param buf   buffer of at least Protocol::kRateCmdLen bytes
+   *
+   * @return      length of the encoded cmd, 0 if there is nothing to send
+   */
+  int64_t encodeTargetRate(char *buf);
+
   /// Mapping from receiver states to state functions
   static const StateFunction stateMap_[];
 
   /// Main entry point for the thread, starts the state machine
   void start() override;
 
+  /**
+   * Runs states from state_ till END or abort
+   *
+   * @return    false if a state asked to wait for the runtime, it is run
+   *            again on the next call
+   */
+  bool runStates();
+
+  /// cleanup once the state machine has ended
+  void endRun();
+
+  /// result of waitForReadable()
+  enum WaitResult {
+    WAIT_READY,      // an fd is readable, or not running on a runtime
+    WAIT_PARKED,     // the state has to return itself to wait for the runtime
+    WAIT_TIMED_OUT,  // nothing became readable within the timeout
+  };
+
+  /**
+   * Lets a state wait, without holding a thread of the runtime, for one of
+   * the fds to be readable. The state returns itself while parked and calls
+   * this again when it is run next, with the same arguments, till the result
+   * is not WAIT_PARKED. The wait is sliced at the abort check interval so
+   * that aborts and changes of the other threads are seen.
+   *
+   * @param fds             fds to wait for, empty to only wait for time
+   * @param timeoutMillis   timeout of the wait
+   */
+  WaitResult waitForReadable(const std::vector<int> &fds, int timeoutMillis);
+
+  /// waitForReadable() on the listening fds of the socket
+  WaitResult waitForConnection(int timeoutMillis);
+
+  /// waitForReadable() on the connection of the socket
+  WaitResult waitForSocketReadable(int timeoutMillis);
+
+  /// runtime the state machine runs on, nullptr if on its own thread
+  ReceiverRuntime *runtime_{nullptr};
+
+  /// whether the state machine was started on runtime_ and not finished
+  bool startedOnRuntime_{false};
+
+  /// current state, kept across the slices run on the runtime
+  ReceiverState state_{LISTEN};
+
+  /// whether state_ is parked in waitForReadable()
+  bool waiting_{false};
+
+  /// end of the current wait of waitForReadable()
+  Clock::time_point waitDeadline_;
+
+  /// when the first connection of the session was accepted, the start of the
+  /// time of the thread in its time breakdown
+  Clock::time_point connectedTime_;
+
+  /// set by waitForReadable() when the state has to be parked
+  bool waitRequested_{false};
+
+  /// what the parked state waits for
+  Wait wait_;
+
+  /// accept attempts of ACCEPT_FIRST_CONNECTION
+  int acceptAttempts_{0};
+
+  /// whether ACCEPT_WITH_TIMEOUT keeps accepting while other threads transfer
+  bool acceptingLate_{false};
+
   /**
    * Server socket object that provides functionality such as listen()
    * accept, read, write on the socket
@@ -329,11 +526,34 @@ class ReceiverThread : public WdtThread {
   /// the server socket
   bool curConnectionVerified_{false};
 
+  /// target rate last advertised to the sender on the current connection
+  int64_t advertisedRate_{0};
+
+  /// target rate encoded by the last encodeTargetRate()
+  int64_t newAdvertisedRate_{0};
+
   /// Checkpoints that have not been sent back to the sender
   std::vector<Checkpoint> newCheckpoints_;
 
   /// list of received blocks which have not yet been verified
   std::vector<BlockDetails> blocksWaitingVerification_;
+
+  /// compression of the blocks sent on the current connection
+  CompressionType compressionType_{COMP_NONE};
+
+  /// whether the sender of the current connection sends duplicates
+  bool dedupFiles_{false};
+
+  /// decompressor of the thread, for compressionType_
+  std::unique_ptr<BlockCompressor> compressor_{nullptr};
+
+  /// frame of a compressed block being received, and its decompressed data
+  std::vector<char> compressedFrame_;
+  std::vector<char> decompressedFrame_;
+
+  /// checksum of the block being received, of the type the sender of the
+  /// current connection uses
+  std::unique_ptr<BlockChecksum> checksummer_{nullptr};
 };
 }
 }
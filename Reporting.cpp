@@ -15,93 +15,267 @@
 #include <iomanip>
 #include <iostream>
 #include <set>
+#include <thread>
 
 namespace facebook {
 namespace wdt {
 
 const static int64_t kMaxEntriesToPrint = 10;
+/// below this share of timed time, a thread is not classified
+const static double kMinTimedShare = 0.1;
+
+TransferStats::Snapshot TransferStats::getSnapshot() const {
+  Snapshot snapshot;
+  while (true) {
+    // no update of several counters must have been in progress, or started
+    // while the counters were read
+    const int64_t ended = updatesEnded_.load(std::memory_order_acquire);
+    const int64_t started = updatesStarted_.load(std::memory_order_acquire);
+    if (started != ended) {
+      std::this_thread::yield();
+      continue;
+    }
+    snapshot.headerBytes = load(headerBytes_);
+    snapshot.dataBytes = load(dataBytes_);
+    snapshot.effectiveHeaderBytes = load(effectiveHeaderBytes_);
+    snapshot.effectiveDataBytes = load(effectiveDataBytes_);
+    snapshot.numFiles = load(numFiles_);
+    snapshot.numBlocks = load(numBlocks_);
+    snapshot.failedAttempts = load(failedAttempts_);
+    snapshot.numBlocksSend = load(numBlocksSend_);
+    snapshot.totalSenderBytes = load(totalSenderBytes_);
+    snapshot.localErrCode = load(localErrCode_);
+    snapshot.remoteErrCode = load(remoteErrCode_);
+    snapshot.encryptionType = load(encryptionType_);
+    snapshot.compressionRawBytes = load(compressionRawBytes_);
+    snapshot.compressionWireBytes = load(compressionWireBytes_);
+    snapshot.zeroCopyWrites = load(zeroCopyWrites_);
+    snapshot.zeroCopyCopiedWrites = load(zeroCopyCopiedWrites_);
+    snapshot.tcpInfo.numConnections = load(tcpNumConnections_);
+    snapshot.tcpInfo.rttMicros = load(tcpRttMicrosSum_);
+    snapshot.tcpInfo.cwndBytes = load(tcpCwndBytes_);
+    snapshot.tcpInfo.totalRetransmits = load(tcpTotalRetransmits_);
+    snapshot.tcpInfo.deliveryRateBytesPerSec = load(tcpDeliveryRate_);
+    snapshot.tcpInfo.pacingRateBytesPerSec = load(tcpPacingRate_);
+    std::atomic_thread_fence(std::memory_order_acquire);
+    if (updatesStarted_.load(std::memory_order_relaxed) == started) {
+      return snapshot;
+    }
+  }
+}
+
+void TransferStats::setSnapshot(const Snapshot& snapshot) {
+  store(headerBytes_, snapshot.headerBytes);
+  store(dataBytes_, snapshot.dataBytes);
+  store(effectiveHeaderBytes_, snapshot.effectiveHeaderBytes);
+  store(effectiveDataBytes_, snapshot.effectiveDataBytes);
+  store(numFiles_, snapshot.numFiles);
+  store(numBlocks_, snapshot.numBlocks);
+  store(failedAttempts_, snapshot.failedAttempts);
+  store(numBlocksSend_, snapshot.numBlocksSend);
+  store(totalSenderBytes_, snapshot.totalSenderBytes);
+  store(localErrCode_, snapshot.localErrCode);
+  store(remoteErrCode_, snapshot.remoteErrCode);
+  store(encryptionType_, snapshot.encryptionType);
+  store(compressionRawBytes_, snapshot.compressionRawBytes);
+  store(compressionWireBytes_, snapshot.compressionWireBytes);
+  store(zeroCopyWrites_, snapshot.zeroCopyWrites);
+  store(zeroCopyCopiedWrites_, snapshot.zeroCopyCopiedWrites);
+  store(tcpNumConnections_, snapshot.tcpInfo.numConnections);
+  store(tcpRttMicrosSum_, snapshot.tcpInfo.rttMicros);
+  store(tcpCwndBytes_, snapshot.tcpInfo.cwndBytes);
+  store(tcpTotalRetransmits_, snapshot.tcpInfo.totalRetransmits);
+  store(tcpDeliveryRate_, snapshot.tcpInfo.deliveryRateBytesPerSec);
+  store(tcpPacingRate_, snapshot.tcpInfo.pacingRateBytesPerSec);
+}
+
+TcpInfoSample TransferStats::getTcpInfo() const {
+  TcpInfoSample tcpInfo = getSnapshot().tcpInfo;
+  if (tcpInfo.numConnections > 1) {
+    tcpInfo.rttMicros /= tcpInfo.numConnections;
+  }
+  return tcpInfo;
+}
+
+TransferStats::TransferStats(TransferStats&& stats) {
+  *this = std::move(stats);
+}
+
+TransferStats& TransferStats::operator=(TransferStats&& stats) {
+  if (this != &stats) {
+    setSnapshot(stats.getSnapshot());
+    id_ = std::move(stats.id_);
+  }
+  return *this;
+}
+
+void TransferStats::clear() {
+  static const TransferStats kEmptyStats;
+  setSnapshot(kEmptyStats.getSnapshot());
+}
 
 TransferStats& TransferStats::operator+=(const TransferStats& stats) {
-  folly::RWSpinLock::WriteHolder writeLock(mutex_.get());
-  folly::RWSpinLock::ReadHolder readLock(stats.mutex_.get());
-  headerBytes_ += stats.headerBytes_;
-  dataBytes_ += stats.dataBytes_;
-  effectiveHeaderBytes_ += stats.effectiveHeaderBytes_;
-  effectiveDataBytes_ += stats.effectiveDataBytes_;
-  numFiles_ += stats.numFiles_;
-  numBlocks_ += stats.numBlocks_;
-  failedAttempts_ += stats.failedAttempts_;
-  if (numBlocksSend_ == -1) {
-    numBlocksSend_ = stats.numBlocksSend_;
-  } else if (stats.numBlocksSend_ != -1 &&
-             numBlocksSend_ != stats.numBlocksSend_) {
-    WLOG_IF(ERROR, localErrCode_ == OK) << "Mismatch in the numBlocksSend "
-                                        << numBlocksSend_ << " "
-                                        << stats.numBlocksSend_;
-    localErrCode_ = ERROR;
-  }
-  if (totalSenderBytes_ == -1) {
-    totalSenderBytes_ = stats.totalSenderBytes_;
-  } else if (stats.totalSenderBytes_ != -1 &&
-             totalSenderBytes_ != stats.totalSenderBytes_) {
-    WLOG_IF(ERROR, localErrCode_ == OK) << "Mismatch in the total sender bytes "
-                                        << totalSenderBytes_ << " "
-                                        << stats.totalSenderBytes_;
-    localErrCode_ = ERROR;
-  }
-  localErrCode_ = getMoreInterestingError(localErrCode_, stats.localErrCode_);
-  WVLOG(2) << "Local ErrorCode now " << localErrCode_ << " from "
-           << stats.localErrCode_;
-  remoteErrCode_ =
-      getMoreInterestingError(remoteErrCode_, stats.remoteErrCode_);
-  if (stats.localErrCode_ == OK && stats.remoteErrCode_ == OK) {
+  const Snapshot other = stats.getSnapshot();
+  startUpdate();
+  add(headerBytes_, other.headerBytes);
+  add(dataBytes_, other.dataBytes);
+  add(effectiveHeaderBytes_, other.effectiveHeaderBytes);
+  add(effectiveDataBytes_, other.effectiveDataBytes);
+  add(numFiles_, other.numFiles);
+  add(numBlocks_, other.numBlocks);
+  add(failedAttempts_, other.failedAttempts);
+  add(tcpNumConnections_, other.tcpInfo.numConnections);
+  add(tcpRttMicrosSum_, other.tcpInfo.rttMicros);
+  add(tcpCwndBytes_, other.tcpInfo.cwndBytes);
+  add(tcpTotalRetransmits_, other.tcpInfo.totalRetransmits);
+  add(tcpDeliveryRate_, other.tcpInfo.deliveryRateBytesPerSec);
+  add(tcpPacingRate_, other.tcpInfo.pacingRateBytesPerSec);
+  add(compressionRawBytes_, other.compressionRawBytes);
+  add(compressionWireBytes_, other.compressionWireBytes);
+  add(zeroCopyWrites_, other.zeroCopyWrites);
+  add(zeroCopyCopiedWrites_, other.zeroCopyCopiedWrites);
+  ErrorCode localErrCode = load(localErrCode_);
+  const int64_t numBlocksSend = load(numBlocksSend_);
+  if (numBlocksSend == -1) {
+    store(numBlocksSend_, other.numBlocksSend);
+  } else if (other.numBlocksSend != -1 &&
+             numBlocksSend != other.numBlocksSend) {
+    WLOG_IF(ERROR, localErrCode == OK) << "Mismatch in the numBlocksSend "
+                                       << numBlocksSend << " "
+                                       << other.numBlocksSend;
+    localErrCode = ERROR;
+  }
+  const int64_t totalSenderBytes = load(totalSenderBytes_);
+  if (totalSenderBytes == -1) {
+    store(totalSenderBytes_, other.totalSenderBytes);
+  } else if (other.totalSenderBytes != -1 &&
+             totalSenderBytes != other.totalSenderBytes) {
+    WLOG_IF(ERROR, localErrCode == OK) << "Mismatch in the total sender bytes "
+                                       << totalSenderBytes << " "
+                                       << other.totalSenderBytes;
+    localErrCode = ERROR;
+  }
+  localErrCode = getMoreInterestingError(localErrCode, other.localErrCode);
+  store(localErrCode_, localErrCode);
+  WVLOG(2) << "Local ErrorCode now " << localErrCode << " from "
+           << other.localErrCode;
+  store(remoteErrCode_,
+        getMoreInterestingError(load(remoteErrCode_), other.remoteErrCode));
+  if (other.localErrCode == OK && other.remoteErrCode == OK) {
     // encryption type valid only if error code is OK
     // TODO: verify whether all successful threads have same encryption types
-    encryptionType_ = stats.encryptionType_;
+    store(encryptionType_, other.encryptionType);
   }
+  endUpdate();
   return *this;
 }
 
-std::ostream& operator<<(std::ostream& os, const TransferStats& stats) {
-  folly::RWSpinLock::ReadHolder lock(stats.mutex_.get());
+std::ostream& operator<<(std::ostream& os, const TransferStats& transferStats) {
+  const TransferStats::Snapshot stats = transferStats.getSnapshot();
   double headerOverhead = 100;
   double failureOverhead = 100;
 
-  if (stats.effectiveDataBytes_ > 0) {
-    headerOverhead = 100.0 * stats.headerBytes_ / stats.effectiveDataBytes_;
-    failureOverhead = 100.0 * (stats.dataBytes_ - stats.effectiveDataBytes_) /
-                      stats.effectiveDataBytes_;
+  if (stats.effectiveDataBytes > 0) {
+    headerOverhead = 100.0 * stats.headerBytes / stats.effectiveDataBytes;
+    failureOverhead = 100.0 * (stats.dataBytes - stats.effectiveDataBytes) /
+                      stats.effectiveDataBytes;
   }
 
-  if (stats.localErrCode_ == OK && stats.remoteErrCode_ == OK) {
+  if (stats.localErrCode == OK && stats.remoteErrCode == OK) {
     os << "Transfer status = OK.";
-  } else if (stats.localErrCode_ == stats.remoteErrCode_) {
-    os << "Transfer status = " << errorCodeToStr(stats.localErrCode_) << ".";
+  } else if (stats.localErrCode == stats.remoteErrCode) {
+    os << "Transfer status = " << errorCodeToStr(stats.localErrCode) << ".";
   } else {
-    os << "Transfer status (local) = " << errorCodeToStr(stats.localErrCode_)
-       << ", (remote) = " << errorCodeToStr(stats.remoteErrCode_) << ".";
+    os << "Transfer status (local) = " << errorCodeToStr(stats.localErrCode)
+       << ", (remote) = " << errorCodeToStr(stats.remoteErrCode) << ".";
   }
 
-  if (stats.numFiles_ > 0) {
-    os << " Number of files transferred = " << stats.numFiles_ << ".";
+  if (stats.numFiles > 0) {
+    os << " Number of files transferred = " << stats.numFiles << ".";
   } else {
-    os << " Number of blocks transferred = " << stats.numBlocks_ << ".";
+    os << " Number of blocks transferred = " << stats.numBlocks << ".";
   }
-  os << " Data Mbytes = " << stats.effectiveDataBytes_ / kMbToB
-     << ". Header Kbytes = " << stats.headerBytes_ / 1024. << " ("
+  os << " Data Mbytes = " << stats.effectiveDataBytes / kMbToB
+     << ". Header Kbytes = " << stats.headerBytes / 1024. << " ("
      << headerOverhead << "% overhead)"
-     << ". Total bytes = " << (stats.dataBytes_ + stats.headerBytes_)
+     << ". Total bytes = " << (stats.dataBytes + stats.headerBytes)
      << ". Wasted bytes due to failure = "
-     << (stats.dataBytes_ - stats.effectiveDataBytes_) << " ("
+     << (stats.dataBytes - stats.effectiveDataBytes) << " ("
      << failureOverhead << "% overhead)"
-     << ". Encryption type = " << encryptionTypeToStr(stats.encryptionType_)
+     << ". Encryption type = " << encryptionTypeToStr(stats.encryptionType)
      << ".";
+  if (stats.compressionRawBytes > 0) {
+    os << " Compressed Mbytes = " << stats.compressionRawBytes / kMbToB
+       << " sent as " << stats.compressionWireBytes / kMbToB << " ("
+       << 100.0 * stats.compressionWireBytes / stats.compressionRawBytes
+       << "%).";
+  }
+  if (stats.zeroCopyWrites + stats.zeroCopyCopiedWrites > 0) {
+    os << " Zero copy writes = " << stats.zeroCopyWrites << " ("
+       << stats.zeroCopyCopiedWrites << " copied by the kernel).";
+  }
+  const TcpInfoSample& tcpInfo = stats.tcpInfo;
+  if (tcpInfo.numConnections > 0) {
+    os << " TCP rtt = "
+       << tcpInfo.rttMicros / tcpInfo.numConnections / kMicroToMilli
+       << " ms, cwnd Kbytes = " << tcpInfo.cwndBytes / kKbToB
+       << ", retransmits = " << tcpInfo.totalRetransmits
+       << ", delivery rate Mbytes/sec = "
+       << tcpInfo.deliveryRateBytesPerSec / kMbToB
+       << ", pacing rate Mbytes/sec = "
+       << tcpInfo.pacingRateBytesPerSec / kMbToB << ".";
+  }
   return os;
 }
 
+int64_t SourceStatsTable::getRow(int64_t seqId, const std::string& id) {
+  if (seqId >= 0) {
+    auto it = rowBySeqId_.emplace(seqId, ids_.size()).first;
+    if (it->second < (int64_t)ids_.size()) {
+      return it->second;
+    }
+  }
+  ids_.push_back(id);
+  seqIds_.push_back(seqId);
+  dataBytes_.push_back(0);
+  effectiveDataBytes_.push_back(0);
+  headerBytes_.push_back(0);
+  effectiveHeaderBytes_.push_back(0);
+  numBlocks_.push_back(0);
+  failedAttempts_.push_back(0);
+  errorCodes_.push_back(OK);
+  return ids_.size() - 1;
+}
+
+void SourceStatsTable::add(int64_t seqId, const TransferStats& stats) {
+  const int64_t row = getRow(seqId, stats.getId());
+  dataBytes_[row] += stats.getDataBytes();
+  effectiveDataBytes_[row] += stats.getEffectiveDataBytes();
+  headerBytes_[row] += stats.getHeaderBytes();
+  effectiveHeaderBytes_[row] += stats.getEffectiveHeaderBytes();
+  numBlocks_[row] += stats.getNumBlocks();
+  failedAttempts_[row] += stats.getFailedAttempts();
+  errorCodes_[row] =
+      getMoreInterestingError(getErrorCode(row), stats.getErrorCode());
+}
+
+void SourceStatsTable::merge(const SourceStatsTable& other) {
+  for (int64_t i = 0; i < other.size(); i++) {
+    const int64_t row = getRow(other.seqIds_[i], other.ids_[i]);
+    dataBytes_[row] += other.dataBytes_[i];
+    effectiveDataBytes_[row] += other.effectiveDataBytes_[i];
+    headerBytes_[row] += other.headerBytes_[i];
+    effectiveHeaderBytes_[row] += other.effectiveHeaderBytes_[i];
+    numBlocks_[row] += other.numBlocks_[i];
+    failedAttempts_[row] += other.failedAttempts_[i];
+    errorCodes_[row] =
+        getMoreInterestingError(getErrorCode(row), other.getErrorCode(i));
+  }
+}
+
 TransferReport::TransferReport(
-    std::vector<TransferStats>& transferredSourceStats,
-    std::vector<TransferStats>& failedSourceStats,
+    SourceStatsTable& transferredSourceStats,
+    SourceStatsTable& failedSourceStats,
     std::vector<TransferStats>& threadStats,
     std::vector<std::string>& failedDirectories, double totalTime,
     int64_t totalFileSize, int64_t numDiscoveredFiles,
@@ -134,10 +308,10 @@ TransferReport::TransferReport(
     summaryErrorCode =
         getMoreInterestingError(summaryErrorCode, BYTE_SOURCE_READ_ERROR);
   }
-  for (const auto& sourceStat : failedSourceStats_) {
+  for (int64_t i = 0; i < failedSourceStats_.size(); i++) {
     possiblyOk = false;
-    summaryErrorCode =
-        getMoreInterestingError(summaryErrorCode, sourceStat.getErrorCode());
+    summaryErrorCode = getMoreInterestingError(
+        summaryErrorCode, failedSourceStats_.getErrorCode(i));
   }
   // Check that all bytes have been sent.
   if (summary_.getEffectiveDataBytes() != totalFileSize_) {
@@ -159,8 +333,8 @@ TransferReport::TransferReport(
   setErrorCode(summaryErrorCode);
 
   std::set<std::string> failedFilesSet;
-  for (auto& stats : failedSourceStats_) {
-    failedFilesSet.insert(stats.getId());
+  for (int64_t i = 0; i < failedSourceStats_.size(); i++) {
+    failedFilesSet.insert(failedSourceStats_.getId(i));
   }
   int64_t numTransferredFiles = numDiscoveredFiles - failedFilesSet.size();
   summary_.setNumFiles(numTransferredFiles);
@@ -190,6 +364,18 @@ TransferReport::TransferReport(const std::vector<TransferStats>& threadStats,
   }
 }
 
+void TransferReport::startProgressUpdate(double totalTime,
+                                         int64_t totalFileSize,
+                                         int64_t numDiscoveredFiles,
+                                         bool fileDiscoveryFinished) {
+  previousEffectiveDataBytes_ = summary_.getEffectiveDataBytes();
+  summary_.clear();
+  totalTime_ = totalTime;
+  totalFileSize_ = totalFileSize;
+  numDiscoveredFiles_ = numDiscoveredFiles;
+  fileDiscoveryFinished_ = fileDiscoveryFinished;
+}
+
 TransferReport::TransferReport(TransferStats&& globalStats)
     : summary_(std::move(globalStats)) {
   const int64_t numBlocksSend = summary_.getNumBlocksSend();
@@ -223,6 +409,124 @@ TransferReport::TransferReport(TransferStats&& globalStats)
   summary_.setLocalErrorCode(summaryErrorCode);
 }
 
+void TransferMetrics::setTransfer(const TransferStats& stats, bool ongoing,
+                                  double elapsedSeconds) {
+  numOngoing = ongoing ? 1 : 0;
+  numFailed = (stats.getErrorCode() != OK) ? 1 : 0;
+  dataBytes = stats.getDataBytes();
+  effectiveDataBytes = stats.getEffectiveDataBytes();
+  numFiles = stats.getNumFiles();
+  failedAttempts = stats.getFailedAttempts();
+  throughputMBps = 0;
+  if (ongoing && elapsedSeconds > 0) {
+    throughputMBps = effectiveDataBytes / elapsedSeconds / kMbToB;
+  }
+}
+
+TransferMetrics& TransferMetrics::operator+=(const TransferMetrics& metrics) {
+  numOngoing += metrics.numOngoing;
+  numFailed += metrics.numFailed;
+  dataBytes += metrics.dataBytes;
+  effectiveDataBytes += metrics.effectiveDataBytes;
+  numFiles += metrics.numFiles;
+  failedAttempts += metrics.failedAttempts;
+  queuedSources += metrics.queuedSources;
+  queuedBytes += metrics.queuedBytes;
+  throughputMBps += metrics.throughputMBps;
+  return *this;
+}
+
+const char* bottleneckToStr(Bottleneck bottleneck) {
+  switch (bottleneck) {
+    case UNKNOWN_BOTTLENECK:
+      return "unknown";
+    case DISK_READ_BOUND:
+      return "disk-read-bound";
+    case NETWORK_BOUND:
+      return "network-bound";
+    case RECEIVER_DISK_BOUND:
+      return "receiver-disk-bound";
+    case CPU_CRYPTO_BOUND:
+      return "cpu/crypto-bound";
+    case THROTTLED:
+      return "throttled";
+  }
+  return "unknown";
+}
+
+Bottleneck TimeBreakdown::classify(bool sender) const {
+  const int64_t disk = micros_[DISK];
+  const int64_t crypto = micros_[CRYPTO];
+  // inline crypto is timed within the socket calls
+  const int64_t network = std::max<int64_t>(0, micros_[NETWORK] - crypto);
+  const int64_t throttle = micros_[THROTTLE];
+  const int64_t timed = disk + network + crypto + throttle;
+  if (timed <= 0 || timed < totalMicros_ * kMinTimedShare) {
+    return UNKNOWN_BOTTLENECK;
+  }
+  if (throttle >= std::max({disk, network, crypto})) {
+    return THROTTLED;
+  }
+  if (crypto >= std::max(disk, network)) {
+    return CPU_CRYPTO_BOUND;
+  }
+  if (disk >= network) {
+    return sender ? DISK_READ_BOUND : RECEIVER_DISK_BOUND;
+  }
+  if (sender && numPeerLimitedWrites_ > numCwndLimitedWrites_) {
+    // the receiver window, not the network, held back the writes
+    return RECEIVER_DISK_BOUND;
+  }
+  return NETWORK_BOUND;
+}
+
+TimeBreakdown& TimeBreakdown::operator+=(const TimeBreakdown& breakdown) {
+  for (int i = 0; i < NUM_CATEGORIES; i++) {
+    micros_[i] += breakdown.micros_[i];
+  }
+  totalMicros_ += breakdown.totalMicros_;
+  numCwndLimitedWrites_ += breakdown.numCwndLimitedWrites_;
+  numPeerLimitedWrites_ += breakdown.numPeerLimitedWrites_;
+  return *this;
+}
+
+std::ostream& operator<<(std::ostream& os, const TimeBreakdown& breakdown) {
+  static const char* kCategoryNames[] = {"disk", "network", "crypto",
+                                         "throttle"};
+  static_assert(sizeof(kCategoryNames) / sizeof(kCategoryNames[0]) ==
+                    TimeBreakdown::NUM_CATEGORIES,
+                "Mismatch between number of categories and their names");
+  const double totalMicros = breakdown.totalMicros_;
+  for (int i = 0; i < TimeBreakdown::NUM_CATEGORIES; i++) {
+    int64_t micros = breakdown.micros_[i];
+    if (i == TimeBreakdown::NETWORK) {
+      micros = std::max<int64_t>(
+          0, micros - breakdown.micros_[TimeBreakdown::CRYPTO]);
+    }
+    os << (i == 0 ? "" : " ") << kCategoryNames[i] << " ";
+    if (totalMicros > 0) {
+      os << (int64_t)(100 * micros / totalMicros + 0.5) << "%";
+    } else {
+      os << micros / kMicroToMilli << " ms";
+    }
+  }
+  os << ", blocked writes limited by the network "
+     << breakdown.numCwndLimitedWrites_ << " by the receiver "
+     << breakdown.numPeerLimitedWrites_;
+  return os;
+}
+
+void TransferReport::setTimeBreakdowns(
+    const std::vector<TimeBreakdown>& threadBreakdowns, bool sender) {
+  timeBreakdown_ = TimeBreakdown();
+  threadBottlenecks_.clear();
+  for (const auto& breakdown : threadBreakdowns) {
+    timeBreakdown_ += breakdown;
+    threadBottlenecks_.push_back(breakdown.classify(sender));
+  }
+  bottleneck_ = timeBreakdown_.classify(sender);
+}
+
 std::ostream& operator<<(std::ostream& os, const TransferReport& report) {
   os << report.getSummary();
   os << " Previously sent bytes : " << report.getPreviouslySentBytes() << ".";
@@ -232,8 +536,9 @@ std::ostream& operator<<(std::ostream& os, const TransferReport& report) {
     } else {
       os << "\n" << WDT_LOG_PREFIX << "Failed files :\n" << WDT_LOG_PREFIX;
       std::set<std::string> failedFilesSet;
-      for (auto& stats : report.getFailedSourceStats()) {
-        failedFilesSet.insert(stats.getId());
+      const SourceStatsTable& failedSourceStats = report.getFailedSourceStats();
+      for (int64_t i = 0; i < failedSourceStats.size(); i++) {
+        failedFilesSet.insert(failedSourceStats.getId(i));
       }
       int64_t numFailedFiles = failedFilesSet.size();
       int64_t numOfFilesToPrint =
@@ -266,6 +571,19 @@ std::ostream& operator<<(std::ostream& os, const TransferReport& report) {
          << " directories)";
     }
   }
+  if (report.timeToFirstByte_ >= 0) {
+    os << " Time to first byte : " << report.timeToFirstByte_ << " sec.";
+  }
+  for (const auto& pathStats : report.pathStats_) {
+    os << "\n" << WDT_LOG_PREFIX << "Path " << pathStats.getId() << " : "
+       << report.getPathThroughputMBps(pathStats) << " Mbytes/sec";
+  }
+  if (!report.threadBottlenecks_.empty()) {
+    os << "\n"
+       << WDT_LOG_PREFIX << "Bottleneck : "
+       << bottleneckToStr(report.bottleneck_) << " ("
+       << report.timeBreakdown_ << ")";
+  }
   return os;
 }
 
@@ -411,6 +729,23 @@ void PerfStatReport::addPerfStat(StatType statType, int64_t timeInMicros) {
   sumMicros_[statType] += timeInMicros;
 }
 
+void PerfStatReport::addHugePageBuffer(int64_t numBytes,
+                                       int64_t numHugePageBytes) {
+  folly::RWSpinLock::WriteHolder writeLock(mutex_);
+  hugePageRequestedBytes_ += numBytes;
+  hugePageBytes_ += numHugePageBytes;
+}
+
+int64_t PerfStatReport::getHugePageRequestedBytes() const {
+  folly::RWSpinLock::ReadHolder readLock(mutex_);
+  return hugePageRequestedBytes_;
+}
+
+int64_t PerfStatReport::getHugePageBytes() const {
+  folly::RWSpinLock::ReadHolder readLock(mutex_);
+  return hugePageBytes_;
+}
+
 PerfStatReport& PerfStatReport::operator+=(const PerfStatReport& statReport) {
   folly::RWSpinLock::WriteHolder writeLock(mutex_);
   folly::RWSpinLock::ReadHolder readLock(statReport.mutex_);
@@ -428,6 +763,8 @@ PerfStatReport& PerfStatReport::operator+=(const PerfStatReport& statReport) {
     count_[i] += statReport.count_[i];
     sumMicros_[i] += statReport.sumMicros_[i];
   }
+  hugePageRequestedBytes_ += statReport.hugePageRequestedBytes_;
+  hugePageBytes_ += statReport.hugePageBytes_;
   return *this;
 }
 
@@ -435,6 +772,11 @@ std::ostream& operator<<(std::ostream& os, const PerfStatReport& statReport) {
   folly::RWSpinLock::ReadHolder readLock(statReport.mutex_);
 
   os << "***** PERF STATS *****\n" << WDT_LOG_PREFIX;
+  if (statReport.hugePageRequestedBytes_ > 0) {
+    os << "Huge pages : " << statReport.hugePageBytes_ << " bytes of the "
+       << statReport.hugePageRequestedBytes_ << " bytes of buffers asked\n"
+       << WDT_LOG_PREFIX;
+  }
   for (int i = 0; i < PerfStatReport::kNumTypes_; i++) {
     if (statReport.count_[i] == 0) {
       continue;
@@ -15,6 +15,7 @@
 #include <wdt/util/EncryptionUtils.h>
 
 #include <algorithm>
+#include <atomic>
 #include <chrono>
 #include <iterator>
 #include <limits>
@@ -27,6 +28,7 @@
 namespace facebook {
 namespace wdt {
 
+const double kKbToB = 1024;
 const double kMbToB = 1024 * 1024;
 const double kMicroToMilli = 1000;
 const double kMicroToSec = 1000 * 1000;
@@ -55,115 +57,226 @@ std::ostream &operator<<(std::ostream &os, const std::vector<T> &v) {
   return os;
 }
 
+/// TCP_INFO of the connections of a thread, sampled periodically
+struct TcpInfoSample {
+  /// number of connections sampled, 0 if none. The samples of several
+  /// connections are added, except the round trip time which is averaged
+  int64_t numConnections{0};
+  /// smoothed round trip time in microseconds
+  int64_t rttMicros{0};
+  /// congestion window in bytes
+  int64_t cwndBytes{0};
+  /// number of segments retransmitted over the life of the connection
+  int64_t totalRetransmits{0};
+  /// recent delivery rate in bytes per second, 0 if unknown to the kernel
+  int64_t deliveryRateBytesPerSec{0};
+  /// pacing rate in bytes per second, 0 if unknown or not paced
+  int64_t pacingRateBytesPerSec{0};
+};
+
 // TODO rename to ThreadResult
 /// class representing statistics related to file transfer
 class TransferStats {
  private:
   /// number of header bytes transferred
-  int64_t headerBytes_ = 0;
+  std::atomic<int64_t> headerBytes_{0};
   /// number of data bytes transferred
-  int64_t dataBytes_ = 0;
+  std::atomic<int64_t> dataBytes_{0};
 
   /// number of header bytes transferred as part of successful file transfer
-  int64_t effectiveHeaderBytes_ = 0;
+  std::atomic<int64_t> effectiveHeaderBytes_{0};
   /// number of data bytes transferred as part of successful file transfer
-  int64_t effectiveDataBytes_ = 0;
+  std::atomic<int64_t> effectiveDataBytes_{0};
 
   /// number of files successfully transferred
-  int64_t numFiles_ = 0;
+  std::atomic<int64_t> numFiles_{0};
 
   /// number of blocks successfully transferred
-  int64_t numBlocks_ = 0;
+  std::atomic<int64_t> numBlocks_{0};
 
   /// number of failed transfers
-  int64_t failedAttempts_ = 0;
+  std::atomic<int64_t> failedAttempts_{0};
 
   /// Total number of blocks sent by sender
-  int64_t numBlocksSend_{-1};
+  std::atomic<int64_t> numBlocksSend_{-1};
 
   /// Total number of bytes sent by sender
-  int64_t totalSenderBytes_{-1};
+  std::atomic<int64_t> totalSenderBytes_{-1};
 
   /// status of the transfer
-  ErrorCode localErrCode_ = OK;
+  std::atomic<ErrorCode> localErrCode_{OK};
 
   /// status of the remote
-  ErrorCode remoteErrCode_ = OK;
+  std::atomic<ErrorCode> remoteErrCode_{OK};
+
+  /// encryption type used
+  std::atomic<EncryptionType> encryptionType_{ENC_NONE};
+
+  /// data bytes of the compressed blocks, before compression
+  std::atomic<int64_t> compressionRawBytes_{0};
+  /// bytes the data of the compressed blocks took on the wire, including the
+  /// frame headers
+  std::atomic<int64_t> compressionWireBytes_{0};
+
+  /// MSG_ZEROCOPY writes the kernel sent without copying the data
+  std::atomic<int64_t> zeroCopyWrites_{0};
+  /// MSG_ZEROCOPY writes the kernel ended up copying
+  std::atomic<int64_t> zeroCopyCopiedWrites_{0};
+
+  /// last TCP_INFO sample, summed over the connections in a summary
+  std::atomic<int64_t> tcpNumConnections_{0};
+  std::atomic<int64_t> tcpRttMicrosSum_{0};
+  std::atomic<int64_t> tcpCwndBytes_{0};
+  std::atomic<int64_t> tcpTotalRetransmits_{0};
+  std::atomic<int64_t> tcpDeliveryRate_{0};
+  std::atomic<int64_t> tcpPacingRate_{0};
+
+  /**
+   * Number of updates of several counters started and ended. Those updates
+   * are made between the two increments, so that readers taking a snapshot
+   * can tell they saw all of an update or none of it (a seqlock which does
+   * not need the writers to be exclusive)
+   */
+  std::atomic<int64_t> updatesStarted_{0};
+  std::atomic<int64_t> updatesEnded_{0};
 
-  /// id of the owner object
+  /// id of the owner object, set before the stats are shared
   std::string id_;
 
-  /// encryption type used
-  EncryptionType encryptionType_{ENC_NONE};
+  /// values of the counters at one point in time
+  struct Snapshot {
+    int64_t headerBytes;
+    int64_t dataBytes;
+    int64_t effectiveHeaderBytes;
+    int64_t effectiveDataBytes;
+    int64_t numFiles;
+    int64_t numBlocks;
+    int64_t failedAttempts;
+    int64_t numBlocksSend;
+    int64_t totalSenderBytes;
+    ErrorCode localErrCode;
+    ErrorCode remoteErrCode;
+    EncryptionType encryptionType;
+    int64_t compressionRawBytes;
+    int64_t compressionWireBytes;
+    int64_t zeroCopyWrites;
+    int64_t zeroCopyCopiedWrites;
+    /// round trip time summed over the connections, not averaged
+    TcpInfoSample tcpInfo;
+  };
 
-  /// mutex to support synchronized access
-  std::unique_ptr<folly::RWSpinLock> mutex_{nullptr};
+  /// @return   counters consistent with respect to the updates of several of
+  ///           them, without blocking the writers
+  Snapshot getSnapshot() const;
+
+  /// sets all the counters, only called while the stats are not shared
+  void setSnapshot(const Snapshot &snapshot);
+
+  template <typename T>
+  static T load(const std::atomic<T> &value) {
+    return value.load(std::memory_order_relaxed);
+  }
+
+  template <typename T>
+  static void store(std::atomic<T> &value, T newValue) {
+    value.store(newValue, std::memory_order_relaxed);
+  }
+
+  /// adds to a counter which can be updated by several threads
+  static void add(std::atomic<int64_t> &counter, int64_t count) {
+    counter.fetch_add(count, std::memory_order_relaxed);
+  }
+
+  /**
+   * Adds to a counter only updated by the thread owning the stats. Readers
+   * only ever see the old or the new value, and the writer does not pay for
+   * an atomic read-modify-write
+   */
+  static void addOwned(std::atomic<int64_t> &counter, int64_t count) {
+    counter.store(counter.load(std::memory_order_relaxed) + count,
+                  std::memory_order_relaxed);
+  }
+
+  void startUpdate() {
+    updatesStarted_.fetch_add(1, std::memory_order_relaxed);
+    // the counters can't be seen updated before the start of the update
+    std::atomic_thread_fence(std::memory_order_release);
+  }
+
+  void endUpdate() {
+    updatesEnded_.fetch_add(1, std::memory_order_release);
+  }
 
  public:
   // making the object noncopyable
   TransferStats(const TransferStats &stats) = delete;
   TransferStats &operator=(const TransferStats &stats) = delete;
-  TransferStats(TransferStats &&stats) = default;
-  TransferStats &operator=(TransferStats &&stats) = default;
+  TransferStats(TransferStats &&stats);
+  TransferStats &operator=(TransferStats &&stats);
 
-  explicit TransferStats(bool isLocked = false) {
-    if (isLocked) {
-      mutex_ = std::make_unique<folly::RWSpinLock>();
-    }
+  /**
+   * Stats can be read by other threads while they are updated, e.g. by the
+   * progress reporter, without any lock: counters are relaxed atomics, and
+   * readers of several of them use a snapshot.
+   */
+  TransferStats() {
   }
 
-  explicit TransferStats(const std::string &id, bool isLocked = false)
-      : TransferStats(isLocked) {
-    id_ = id;
+  explicit TransferStats(const std::string &id) : id_(id) {
   }
 
+  /// only called by the thread owning the stats
   void reset() {
-    folly::RWSpinLock::WriteHolder lock(mutex_.get());
-    headerBytes_ = dataBytes_ = 0;
-    effectiveHeaderBytes_ = effectiveDataBytes_ = 0;
-    numFiles_ = numBlocks_ = 0;
-    failedAttempts_ = 0;
-    localErrCode_ = remoteErrCode_ = OK;
+    startUpdate();
+    store<int64_t>(headerBytes_, 0);
+    store<int64_t>(dataBytes_, 0);
+    store<int64_t>(effectiveHeaderBytes_, 0);
+    store<int64_t>(effectiveDataBytes_, 0);
+    store<int64_t>(numFiles_, 0);
+    store<int64_t>(numBlocks_, 0);
+    store<int64_t>(failedAttempts_, 0);
+    store(localErrCode_, OK);
+    store(remoteErrCode_, OK);
+    store<int64_t>(tcpNumConnections_, 0);
+    store<int64_t>(tcpRttMicrosSum_, 0);
+    store<int64_t>(tcpCwndBytes_, 0);
+    store<int64_t>(tcpTotalRetransmits_, 0);
+    store<int64_t>(tcpDeliveryRate_, 0);
+    store<int64_t>(tcpPacingRate_, 0);
+    store<int64_t>(compressionRawBytes_, 0);
+    store<int64_t>(compressionWireBytes_, 0);
+    store<int64_t>(zeroCopyWrites_, 0);
+    store<int64_t>(zeroCopyCopiedWrites_, 0);
+    endUpdate();
   }
 
+  /// resets all the counters, including the totals of the sender, to the
+  /// values of new stats. Only called while the stats are not shared
+  void clear();
+
   /// @return the number of blocks sent by sender
   int64_t getNumBlocksSend() const {
-    folly::RWSpinLock::ReadHolder lock(mutex_.get());
-    return numBlocksSend_;
+    return load(numBlocksSend_);
   }
 
   /// @return the total sender bytes
   int64_t getTotalSenderBytes() const {
-    folly::RWSpinLock::ReadHolder lock(mutex_.get());
-    return totalSenderBytes_;
+    return load(totalSenderBytes_);
   }
 
   /// @return number of header bytes transferred
   int64_t getHeaderBytes() const {
-    folly::RWSpinLock::ReadHolder lock(mutex_.get());
-    return headerBytes_;
+    return load(headerBytes_);
   }
 
   /// @return number of data bytes transferred
   int64_t getDataBytes() const {
-    folly::RWSpinLock::ReadHolder lock(mutex_.get());
-    return dataBytes_;
+    return load(dataBytes_);
   }
 
-  /**
-   * @param needLocking     specifies whether we need to lock or not. this is
-   *                        for performance improvement. in sender, we do not
-   *                        need locking for this call, even though the other
-   *                        calls have to be locked
-   *
-   * @return                number of total bytes transferred
-   */
-  int64_t getTotalBytes(bool needLocking = true) const {
-    if (needLocking) {
-      folly::RWSpinLock::ReadHolder lock(mutex_.get());
-      return headerBytes_ + dataBytes_;
-    }
-    return headerBytes_ + dataBytes_;
+  /// @return                number of total bytes transferred
+  int64_t getTotalBytes() const {
+    return load(headerBytes_) + load(dataBytes_);
   }
 
   /**
@@ -171,8 +284,7 @@ class TransferStats {
    *            transfer
    */
   int64_t getEffectiveHeaderBytes() const {
-    folly::RWSpinLock::ReadHolder lock(mutex_.get());
-    return effectiveHeaderBytes_;
+    return load(effectiveHeaderBytes_);
   }
 
   /**
@@ -180,8 +292,7 @@ class TransferStats {
    *            transfer
    */
   int64_t getEffectiveDataBytes() const {
-    folly::RWSpinLock::ReadHolder lock(mutex_.get());
-    return effectiveDataBytes_;
+    return load(effectiveDataBytes_);
   }
 
   /**
@@ -189,114 +300,142 @@ class TransferStats {
    *            transfer
    */
   int64_t getEffectiveTotalBytes() const {
-    folly::RWSpinLock::ReadHolder lock(mutex_.get());
-    return effectiveHeaderBytes_ + effectiveDataBytes_;
+    const Snapshot snapshot = getSnapshot();
+    return snapshot.effectiveHeaderBytes + snapshot.effectiveDataBytes;
   }
 
   /// @return number of files successfully transferred
   int64_t getNumFiles() const {
-    folly::RWSpinLock::ReadHolder lock(mutex_.get());
-    return numFiles_;
+    return load(numFiles_);
   }
 
   /// @return number of blocks successfully transferred
   int64_t getNumBlocks() const {
-    folly::RWSpinLock::ReadHolder lock(mutex_.get());
-    return numBlocks_;
+    return load(numBlocks_);
   }
 
   /// @return number of failed transfers
   int64_t getFailedAttempts() const {
-    folly::RWSpinLock::ReadHolder lock(mutex_.get());
-    return failedAttempts_;
+    return load(failedAttempts_);
   }
 
   /// @return error code based on combinator of local and remote error
   ErrorCode getErrorCode() const {
-    folly::RWSpinLock::ReadHolder lock(mutex_.get());
-    return getMoreInterestingError(localErrCode_, remoteErrCode_);
+    return getMoreInterestingError(load(localErrCode_), load(remoteErrCode_));
   }
 
   /// @return status of the transfer on this side
   ErrorCode getLocalErrorCode() const {
-    folly::RWSpinLock::ReadHolder lock(mutex_.get());
-    return localErrCode_;
+    return load(localErrCode_);
   }
 
   /// @return status of the transfer on the remote end
   ErrorCode getRemoteErrorCode() const {
-    folly::RWSpinLock::ReadHolder lock(mutex_.get());
-    return remoteErrCode_;
+    return load(remoteErrCode_);
   }
 
   const std::string &getId() const {
-    folly::RWSpinLock::ReadHolder lock(mutex_.get());
     return id_;
   }
 
-  /// @param number of additional data bytes transferred
+  /// @param number of additional data bytes transferred, only called by the
+  ///        thread owning the stats
   void addDataBytes(int64_t count) {
-    folly::RWSpinLock::WriteHolder lock(mutex_.get());
-    dataBytes_ += count;
+    addOwned(dataBytes_, count);
   }
 
-  /// @param number of additional header bytes transferred
+  /// @param number of additional header bytes transferred, only called by the
+  ///        thread owning the stats
   void addHeaderBytes(int64_t count) {
-    folly::RWSpinLock::WriteHolder lock(mutex_.get());
-    headerBytes_ += count;
+    addOwned(headerBytes_, count);
+  }
+
+  /**
+   * @param rawBytes    data bytes of a compressed block, only called by the
+   *                    thread owning the stats
+   * @param wireBytes   bytes they took on the wire
+   */
+  void addCompressedBytes(int64_t rawBytes, int64_t wireBytes) {
+    startUpdate();
+    addOwned(compressionRawBytes_, rawBytes);
+    addOwned(compressionWireBytes_, wireBytes);
+    endUpdate();
+  }
+
+  /// @return   data bytes of the compressed blocks, before compression
+  int64_t getCompressionRawBytes() const {
+    return load(compressionRawBytes_);
+  }
+
+  /// @return   bytes the data of the compressed blocks took on the wire
+  int64_t getCompressionWireBytes() const {
+    return load(compressionWireBytes_);
+  }
+
+  /**
+   * @param numZeroCopy   MSG_ZEROCOPY writes of a connection sent without
+   *                      copying, only called by the thread owning the stats
+   * @param numCopied     the ones the kernel ended up copying
+   */
+  void addZeroCopyWrites(int64_t numZeroCopy, int64_t numCopied) {
+    startUpdate();
+    addOwned(zeroCopyWrites_, numZeroCopy);
+    addOwned(zeroCopyCopiedWrites_, numCopied);
+    endUpdate();
+  }
+
+  /// @return   MSG_ZEROCOPY writes sent without copying
+  int64_t getZeroCopyWrites() const {
+    return load(zeroCopyWrites_);
+  }
+
+  /// @return   MSG_ZEROCOPY writes the kernel ended up copying
+  int64_t getZeroCopyCopiedWrites() const {
+    return load(zeroCopyCopiedWrites_);
   }
 
   /// @param set num blocks send
   void setNumBlocksSend(int64_t numBlocksSend) {
-    folly::RWSpinLock::WriteHolder lock(mutex_.get());
-    numBlocksSend_ = numBlocksSend;
+    store(numBlocksSend_, numBlocksSend);
   }
 
   /// @param set total sender bytes
   void setTotalSenderBytes(int64_t totalSenderBytes) {
-    folly::RWSpinLock::WriteHolder lock(mutex_.get());
-    totalSenderBytes_ = totalSenderBytes;
+    store(totalSenderBytes_, totalSenderBytes);
   }
 
   /// one more file transfer failed
   void incrFailedAttempts() {
-    folly::RWSpinLock::WriteHolder lock(mutex_.get());
-    failedAttempts_++;
+    add(failedAttempts_, 1);
   }
 
   /// @param status of the transfer
   void setLocalErrorCode(ErrorCode errCode) {
-    folly::RWSpinLock::WriteHolder lock(mutex_.get());
-    localErrCode_ = errCode;
+    store(localErrCode_, errCode);
   }
 
   /// @param status of the transfer on the remote end
   void setRemoteErrorCode(ErrorCode remoteErrCode) {
-    folly::RWSpinLock::WriteHolder lock(mutex_.get());
-    remoteErrCode_ = remoteErrCode;
+    store(remoteErrCode_, remoteErrCode);
   }
 
-  /// @param id of the corresponding entity
+  /// @param id of the corresponding entity, set before the stats are shared
   void setId(const std::string &id) {
-    folly::RWSpinLock::WriteHolder lock(mutex_.get());
     id_ = id;
   }
 
   /// @param numFiles number of files successfully send
   void setNumFiles(int64_t numFiles) {
-    folly::RWSpinLock::WriteHolder lock(mutex_.get());
-    numFiles_ = numFiles;
+    store(numFiles_, numFiles);
   }
 
   /// one more block successfully transferred
   void incrNumBlocks() {
-    folly::RWSpinLock::WriteHolder lock(mutex_.get());
-    numBlocks_++;
+    add(numBlocks_, 1);
   }
 
   void decrNumBlocks() {
-    folly::RWSpinLock::WriteHolder lock(mutex_.get());
-    numBlocks_--;
+    add(numBlocks_, -1);
   }
 
   /**
@@ -306,32 +445,223 @@ class TransferStats {
    *                    transfer
    */
   void addEffectiveBytes(int64_t headerBytes, int64_t dataBytes) {
-    folly::RWSpinLock::WriteHolder lock(mutex_.get());
-    effectiveHeaderBytes_ += headerBytes;
-    effectiveDataBytes_ += dataBytes;
+    startUpdate();
+    add(effectiveHeaderBytes_, headerBytes);
+    add(effectiveDataBytes_, dataBytes);
+    endUpdate();
   }
 
   void subtractEffectiveBytes(int64_t headerBytes, int64_t dataBytes) {
-    folly::RWSpinLock::WriteHolder lock(mutex_.get());
-    effectiveHeaderBytes_ -= headerBytes;
-    effectiveDataBytes_ -= dataBytes;
+    startUpdate();
+    add(effectiveHeaderBytes_, -headerBytes);
+    add(effectiveDataBytes_, -dataBytes);
+    endUpdate();
   }
 
   void setEncryptionType(EncryptionType encryptionType) {
-    folly::RWSpinLock::WriteHolder lock(mutex_.get());
-    encryptionType_ = encryptionType;
+    store(encryptionType_, encryptionType);
   }
 
   EncryptionType getEncryptionType() const {
-    folly::RWSpinLock::ReadHolder lock(mutex_.get());
-    return encryptionType_;
+    return load(encryptionType_);
+  }
+
+  /// @param sample   latest TCP_INFO of the connection of the thread owning
+  ///                 the stats, replacing the previous one
+  void setTcpInfo(const TcpInfoSample &sample) {
+    startUpdate();
+    store<int64_t>(tcpNumConnections_, 1);
+    store(tcpRttMicrosSum_, sample.rttMicros);
+    store(tcpCwndBytes_, sample.cwndBytes);
+    store(tcpTotalRetransmits_, sample.totalRetransmits);
+    store(tcpDeliveryRate_, sample.deliveryRateBytesPerSec);
+    store(tcpPacingRate_, sample.pacingRateBytesPerSec);
+    endUpdate();
   }
 
+  /// @return   last TCP_INFO sample, of all the connections for a summary
+  TcpInfoSample getTcpInfo() const;
+
   TransferStats &operator+=(const TransferStats &stats);
 
   friend std::ostream &operator<<(std::ostream &os, const TransferStats &stats);
 };
 
+/**
+ * Stats of the sources of a transfer kept for its report, in columns with one
+ * row per file: the stats of all the blocks of a file go to the row of its
+ * seq-id. Only the fields the report uses are kept, which takes a fraction
+ * of the memory of a TransferStats per block when millions of files are
+ * reported with full_reporting. Not thread safe.
+ */
+class SourceStatsTable {
+ public:
+  /**
+   * Adds the stats of a block to the row of its file
+   *
+   * @param seqId   seq-id of the file, < 0 if unknown: the stats get a row of
+   *                their own
+   * @param stats   stats of the block, with the name of the file as id
+   */
+  void add(int64_t seqId, const TransferStats &stats);
+
+  /// adds the rows of another table
+  void merge(const SourceStatsTable &other);
+
+  /// @return   number of rows
+  int64_t size() const {
+    return ids_.size();
+  }
+
+  bool empty() const {
+    return ids_.empty();
+  }
+
+  /// @return   name of the file of a row
+  const std::string &getId(int64_t row) const {
+    return ids_[row];
+  }
+
+  int64_t getSeqId(int64_t row) const {
+    return seqIds_[row];
+  }
+
+  int64_t getDataBytes(int64_t row) const {
+    return dataBytes_[row];
+  }
+
+  int64_t getEffectiveDataBytes(int64_t row) const {
+    return effectiveDataBytes_[row];
+  }
+
+  int64_t getHeaderBytes(int64_t row) const {
+    return headerBytes_[row];
+  }
+
+  int64_t getEffectiveHeaderBytes(int64_t row) const {
+    return effectiveHeaderBytes_[row];
+  }
+
+  int64_t getNumBlocks(int64_t row) const {
+    return numBlocks_[row];
+  }
+
+  int64_t getFailedAttempts(int64_t row) const {
+    return failedAttempts_[row];
+  }
+
+  /// @return   most interesting error of the blocks of a row
+  ErrorCode getErrorCode(int64_t row) const {
+    return (ErrorCode)errorCodes_[row];
+  }
+
+ private:
+  /// @return   row of a seq-id, added if needed
+  int64_t getRow(int64_t seqId, const std::string &id);
+
+  std::vector<std::string> ids_;
+  std::vector<int64_t> seqIds_;
+  std::vector<int64_t> dataBytes_;
+  std::vector<int64_t> effectiveDataBytes_;
+  std::vector<int64_t> headerBytes_;
+  std::vector<int64_t> effectiveHeaderBytes_;
+  std::vector<int32_t> numBlocks_;
+  std::vector<int32_t> failedAttempts_;
+  std::vector<uint8_t> errorCodes_;
+  /// row of each seq-id with one, a map as the failed table is sparse
+  std::unordered_map<int64_t, int64_t> rowBySeqId_;
+};
+
+/// what limited the throughput of a transfer, or of one of its threads
+enum Bottleneck {
+  /// too little of the time was spent in the timed parts of the data path
+  UNKNOWN_BOTTLENECK,
+  /// reading the source files
+  DISK_READ_BOUND,
+  /// the network. For a receiver, also the sender not sending faster
+  NETWORK_BOUND,
+  /// the receiver, writing to its disks, not draining the connections
+  RECEIVER_DISK_BOUND,
+  /// encryption or decryption
+  CPU_CRYPTO_BOUND,
+  /// the throttler
+  THROTTLED
+};
+
+/// @return   name of a bottleneck, like "network-bound"
+const char *bottleneckToStr(Bottleneck bottleneck);
+
+/**
+ * Time a thread spent in each part of its data path, accumulated by the
+ * thread itself over the transfer and used to tell what limited it. Only the
+ * disk, socket and throttler calls of the data path made by the thread are
+ * timed, so this is always on
+ */
+class TimeBreakdown {
+ public:
+  enum Category {
+    /// reading the source files, or writing the received data
+    DISK,
+    /// writing to or reading from the sockets, inline crypto included
+    NETWORK,
+    /// encryption or decryption done inline by the thread
+    CRYPTO,
+    /// sleeping in the throttler
+    THROTTLE,
+    NUM_CATEGORIES
+  };
+
+  /// adds time spent in a category
+  void add(Category category, int64_t micros) {
+    micros_[category] += micros;
+  }
+
+  int64_t getMicros(Category category) const {
+    return micros_[category];
+  }
+
+  /// @param totalMicros  time the thread spent transferring
+  void setTotalMicros(int64_t totalMicros) {
+    totalMicros_ = totalMicros;
+  }
+
+  int64_t getTotalMicros() const {
+    return totalMicros_;
+  }
+
+  /**
+   * Records what held back a sender write that blocked
+   *
+   * @param cwndLimited   whether the congestion window was full, the network
+   *                      being the limit
+   * @param peerLimited   whether data was waiting in the send queue with
+   *                      room in the congestion window, the receiver not
+   *                      reading fast enough being the limit
+   */
+  void addBlockedWrite(bool cwndLimited, bool peerLimited) {
+    numCwndLimitedWrites_ += cwndLimited;
+    numPeerLimitedWrites_ += peerLimited;
+  }
+
+  /**
+   * @param sender    whether the time is of a sender
+   *
+   * @return          what most of the time was spent on
+   */
+  Bottleneck classify(bool sender) const;
+
+  TimeBreakdown &operator+=(const TimeBreakdown &breakdown);
+
+  friend std::ostream &operator<<(std::ostream &os,
+                                  const TimeBreakdown &breakdown);
+
+ private:
+  int64_t micros_[NUM_CATEGORIES] = {0};
+  int64_t totalMicros_{0};
+  int64_t numCwndLimitedWrites_{0};
+  int64_t numPeerLimitedWrites_{0};
+};
+
 /**
  * Class representing entire client transfer report.
  * Unit are mebibyte (MiB), ie 1048576 bytes which we call "Mbytes"
@@ -344,8 +674,8 @@ class TransferReport {
    * This constructor moves all the stat objects to member variables. This is
    * only called at the end of transfer by the sender
    */
-  TransferReport(std::vector<TransferStats> &transferredSourceStats,
-                 std::vector<TransferStats> &failedSourceStats,
+  TransferReport(SourceStatsTable &transferredSourceStats,
+                 SourceStatsTable &failedSourceStats,
                  std::vector<TransferStats> &threadStats,
                  std::vector<std::string> &failedDirectories, double totalTime,
                  int64_t totalFileSize, int64_t numDiscoveredFiles,
@@ -375,12 +705,13 @@ class TransferReport {
   double getTotalTime() const {
     return totalTime_;
   }
-  /// @return   stats for successfully transferred sources
-  const std::vector<TransferStats> &getTransferredSourceStats() const {
+  /// @return   stats for successfully transferred sources, only kept with
+  ///           full_reporting
+  const SourceStatsTable &getTransferredSourceStats() const {
     return transferredSourceStats_;
   }
   /// @return   stats for failed sources
-  const std::vector<TransferStats> &getFailedSourceStats() const {
+  const SourceStatsTable &getFailedSourceStats() const {
     return failedSourceStats_;
   }
   /// @return   stats for threads
@@ -401,6 +732,21 @@ class TransferReport {
   void addTransferStats(const TransferStats &stats) {
     summary_ += stats;
   }
+
+  /**
+   * Starts the next update of a report reused by a progress reporter thread
+   * for all its intervals, so that progress reporting does not allocate. The
+   * summary is cleared, for the caller to add the current stats of its
+   * threads with addTransferStats
+   */
+  void startProgressUpdate(double totalTime, int64_t totalFileSize,
+                           int64_t numDiscoveredFiles,
+                           bool fileDiscoveryFinished);
+  /// @return   effective data bytes transferred since the previous progress
+  ///           update of the report
+  int64_t getEffectiveDataBytesDelta() const {
+    return summary_.getEffectiveDataBytes() - previousEffectiveDataBytes_;
+  }
   /// @param currentThroughput  current throughput
   void setCurrentThroughput(double currentThroughput) {
     currentThroughput_ = currentThroughput;
@@ -424,21 +770,69 @@ class TransferReport {
   int64_t getPreviouslySentBytes() const {
     return previouslySentBytes_;
   }
+  /// @return   stats summed per network path, empty with a single path
+  const std::vector<TransferStats> &getPathStats() const {
+    return pathStats_;
+  }
+  void setPathStats(std::vector<TransferStats> &&pathStats) {
+    pathStats_ = std::move(pathStats);
+  }
+  /**
+   * Classifies the transfer and each of its threads from the time breakdowns
+   * of the threads
+   *
+   * @param threadBreakdowns  time breakdown of each thread
+   * @param sender            whether the threads are sender threads
+   */
+  void setTimeBreakdowns(const std::vector<TimeBreakdown> &threadBreakdowns,
+                         bool sender);
+  /// @return   what limited the transfer
+  Bottleneck getBottleneck() const {
+    return bottleneck_;
+  }
+  /// @return   what limited each thread, empty if not classified
+  const std::vector<Bottleneck> &getThreadBottlenecks() const {
+    return threadBottlenecks_;
+  }
+  /// @return   time breakdown summed over the threads
+  const TimeBreakdown &getTimeBreakdown() const {
+    return timeBreakdown_;
+  }
+  /// @return   seconds from the start of the transfer to its first block
+  ///           byte on the wire, -1 if no block went through
+  double getTimeToFirstByte() const {
+    return timeToFirstByte_;
+  }
+  void setTimeToFirstByte(double timeToFirstByte) {
+    timeToFirstByte_ = timeToFirstByte;
+  }
+  /// @return   throughput of a network path in Mbytes/sec
+  double getPathThroughputMBps(const TransferStats &pathStats) const {
+    return pathStats.getEffectiveTotalBytes() / totalTime_ / kMbToB;
+  }
   friend std::ostream &operator<<(std::ostream &os,
                                   const TransferReport &report);
 
  private:
   TransferStats summary_;
   /// stats for successfully transferred sources
-  std::vector<TransferStats> transferredSourceStats_;
+  SourceStatsTable transferredSourceStats_;
   /// stats for failed sources
-  std::vector<TransferStats> failedSourceStats_;
+  SourceStatsTable failedSourceStats_;
   /// stats for client threads
   std::vector<TransferStats> threadStats_;
   /// directories which could not be opened
   std::vector<std::string> failedDirectories_;
+  /// stats per network path, with id "local address->receiver address"
+  std::vector<TransferStats> pathStats_;
+  /// time breakdown summed over the threads
+  TimeBreakdown timeBreakdown_;
+  Bottleneck bottleneck_{UNKNOWN_BOTTLENECK};
+  std::vector<Bottleneck> threadBottlenecks_;
   /// total transfer time
   double totalTime_{0};
+  /// seconds until the first block byte, -1 if none
+  double timeToFirstByte_{-1};
   /// sum of all the file sizes
   int64_t totalFileSize_{0};
   /// recent throughput in bytes/sec
@@ -447,10 +841,44 @@ class TransferReport {
   int64_t numDiscoveredFiles_{0};
   /// Number of bytes sent in previous transfers
   int64_t previouslySentBytes_{0};
+  /// effective data bytes of the summary at the previous progress update
+  int64_t previousEffectiveDataBytes_{0};
   /// Is file discovery finished?
   bool fileDiscoveryFinished_{false};
 };
 
+/**
+ * Live metrics of a transfer for monitoring, cheap to get from any thread
+ * while it runs. Metrics of several transfers add up
+ */
+struct TransferMetrics {
+  /// number of transfers whose threads are running
+  int32_t numOngoing{0};
+  /// number of transfers with an error
+  int32_t numFailed{0};
+  int64_t dataBytes{0};
+  int64_t effectiveDataBytes{0};
+  int64_t numFiles{0};
+  int64_t failedAttempts{0};
+  /// sources discovered but not sent yet, sender only
+  int64_t queuedSources{0};
+  int64_t queuedBytes{0};
+  /// average effective throughput of the ongoing transfers in Mbytes/sec
+  double throughputMBps{0};
+
+  /**
+   * Sets the counts of a transfer from its stats
+   *
+   * @param stats           summary of the stats of the transfer threads
+   * @param ongoing         whether the threads of the transfer are running
+   * @param elapsedSeconds  time since the start of the transfer
+   */
+  void setTransfer(const TransferStats &stats, bool ongoing,
+                   double elapsedSeconds);
+
+  TransferMetrics &operator+=(const TransferMetrics &metrics);
+};
+
 /**
  * This class represents interface and default implementation of progress
  * reporting
@@ -470,7 +898,9 @@ class ProgressReporter {
    * This method gets called repeatedly with interval defined by
    * progress_report_interval. If stdout is a terminal, then it displays
    * transfer progress in stdout. Example output [===>    ] 30% 5.00 Mbytes/sec.
-   * Else, it prints progress details in stdout.
+   * Else, it prints progress details in stdout. The same report is passed
+   * for all the intervals of a transfer, updated in place, with
+   * getEffectiveDataBytesDelta() giving the bytes since the previous call.
    *
    * @param report                current transfer report
    */
@@ -555,6 +985,25 @@ class PerfStatReport {
    */
   void addPerfStat(StatType statType, int64_t timeInMicros);
 
+  /**
+   * Records a buffer asked on huge pages (@see buffer_huge_pages)
+   *
+   * @param numBytes          size of the buffer
+   * @param numHugePageBytes  bytes of the buffer actually on huge pages
+   */
+  void addHugePageBuffer(int64_t numBytes, int64_t numHugePageBytes);
+
+  /// @return   bytes of the buffers asked on huge pages
+  int64_t getHugePageRequestedBytes() const;
+
+  /// @return   bytes of the buffers actually on huge pages
+  int64_t getHugePageBytes() const;
+
+  /// @return   description of a stat type
+  static const std::string &getStatTypeDescription(StatType statType) {
+    return statTypeDescription_[statType];
+  }
+
   friend std::ostream &operator<<(std::ostream &os,
                                   const PerfStatReport &statReport);
   PerfStatReport &operator+=(const PerfStatReport &statReport);
@@ -573,6 +1022,10 @@ class PerfStatReport {
   int64_t count_[kNumTypes_] = {0};
   /// sum of all records for different stat types
   int64_t sumMicros_[kNumTypes_] = {0};
+  /// bytes of the buffers asked on huge pages
+  int64_t hugePageRequestedBytes_{0};
+  /// bytes of the buffers obtained on huge pages
+  int64_t hugePageBytes_{0};
   /// network timeout in milliseconds
   int networkTimeoutMillis_;
   /// mutex to support synchronized access
@@ -12,6 +12,9 @@
 #include <wdt/Throttler.h>
 
 #include <wdt/util/ClientSocket.h>
+#include <wdt/util/LatencyHistograms.h>
+#include <wdt/util/SenderJournal.h>
+#include <wdt/util/TransferTracer.h>
 
 #include <folly/lang/Bits.h>
 #include <folly/hash/Checksum.h>
@@ -23,6 +26,43 @@
 namespace facebook {
 namespace wdt {
 
+class Sender::ProgressReporterTask : public RuntimeTask {
+ public:
+  explicit ProgressReporterTask(Sender &sender) : sender_(sender) {
+  }
+
+  /// @return   state of the reporter, initialized before the task starts
+  ProgressReporterState &getState() {
+    return state_;
+  }
+
+  bool runSlice(Wait &wait) override {
+    if (sender_.getTransferStatus() == THREADS_JOINED) {
+      return true;
+    }
+    const auto interval =
+        std::chrono::milliseconds(sender_.progressReportIntervalMillis_);
+    if (!started_) {
+      started_ = true;
+      nextReport_ = Clock::now() + interval;
+    } else if (Clock::now() >= nextReport_) {
+      sender_.sendProgressReport(state_);
+      nextReport_ = Clock::now() + interval;
+    }
+    // the runtime also wakes up timer waits early
+    wait.timeoutMillis =
+        std::max<int64_t>(0, durationMillis(nextReport_ - Clock::now())) + 1;
+    return false;
+  }
+
+ private:
+  Sender &sender_;
+  ProgressReporterState state_;
+  bool started_{false};
+  /// time of the next report
+  Clock::time_point nextReport_;
+};
+
 void Sender::endCurTransfer() {
   endTime_ = Clock::now();
   WLOG(INFO) << "Last thread finished "
@@ -34,6 +74,21 @@ void Sender::endCurTransfer() {
   }
 }
 
+void Sender::setReceiverTargetRate(int64_t rateBytesPerSec) {
+  if (receiverTargetRate_.exchange(rateBytesPerSec) == rateBytesPerSec) {
+    // already applied by another thread
+    return;
+  }
+  WLOG(INFO) << "Receiver advertised a target rate of "
+             << rateBytesPerSec / kMbToB << " Mbytes/sec";
+  // the peak rate is auto configured from the average one
+  double avgRatePerSec = (rateBytesPerSec > 0 ? rateBytesPerSec : -1);
+  double peakRatePerSec = (rateBytesPerSec > 0 ? 0 : -1);
+  double bucketLimit = 0;
+  receiverRateThrottler_->setThrottlerRates(avgRatePerSec, peakRatePerSec,
+                                            bucketLimit);
+}
+
 void Sender::startNewTransfer() {
   if (throttler_) {
     throttler_->startTransfer();
@@ -91,9 +146,19 @@ Sender::~Sender() {
     WLOG(WARNING) << "Sender being deleted. Forcefully aborting the transfer";
     abort(ABORTED_BY_APPLICATION);
   }
+  if (fed_) {
+    // the queue would otherwise wait forever for the end of the feed
+    endFeed();
+  }
   finish();
 }
 
+void Sender::setRuntime(std::shared_ptr<ReceiverRuntime> runtime,
+                        const std::string &group) {
+  runtime_ = std::move(runtime);
+  runtimeGroup_ = group;
+}
+
 void Sender::setProgressReportIntervalMillis(
     const int progressReportIntervalMillis) {
   progressReportIntervalMillis_ = progressReportIntervalMillis;
@@ -168,6 +233,40 @@ Clock::time_point Sender::getEndTime() {
   return endTime_;
 }
 
+void Sender::updateProgressReport(TransferReport &transferReport) {
+  int64_t totalFileSize = 0;
+  int64_t fileCount = 0;
+  bool fileDiscoveryFinished = false;
+  if (dirQueue_ != nullptr) {
+    totalFileSize = dirQueue_->getTotalSize();
+    fileCount = dirQueue_->getCount();
+    fileDiscoveryFinished = dirQueue_->fileDiscoveryFinished();
+  }
+  double totalTime = durationSeconds(Clock::now() - startTime_);
+  transferReport.startProgressUpdate(totalTime, totalFileSize, fileCount,
+                                     fileDiscoveryFinished);
+  for (const auto &thread : senderThreads_) {
+    transferReport.addTransferStats(thread->getTransferStats());
+  }
+}
+
+TransferMetrics Sender::getMetrics() {
+  std::lock_guard<std::mutex> lock(mutex_);
+  if (transferStatus_ == THREADS_JOINED) {
+    return finalMetrics_;
+  }
+  TransferMetrics metrics;
+  // the queue is made before the threads
+  if (transferStatus_ == NOT_STARTED || senderThreads_.empty()) {
+    return metrics;
+  }
+  metrics.setTransfer(getGlobalTransferStats(), transferStatus_ == ONGOING,
+                      durationSeconds(Clock::now() - startTime_));
+  metrics.queuedSources = dirQueue_->getNumQueuedSources();
+  metrics.queuedBytes = dirQueue_->getNumQueuedBytes();
+  return metrics;
+}
+
 TransferStats Sender::getGlobalTransferStats() const {
   TransferStats globalStats;
   for (const auto &thread : senderThreads_) {
@@ -201,7 +300,12 @@ std::unique_ptr<TransferReport> Sender::finish() {
   }
   WDT_CHECK(numActiveThreads_ == 0);
   setTransferStatus(THREADS_JOINED);
-  if (progressReportEnabled) {
+  if (progressReporterTask_) {
+    // the task sees the threads joined once woken up
+    runtime_->wakeTimerWaits();
+    runtime_->waitForEnd(progressReporterTask_.get());
+    progressReporterTask_.reset();
+  } else if (progressReportEnabled) {
     progressReporterThread_.join();
   }
   std::vector<TransferStats> threadStats;
@@ -220,7 +324,7 @@ std::unique_ptr<TransferReport> Sender::finish() {
     }
   }
 
-  std::vector<TransferStats> transferredSourceStats;
+  SourceStatsTable transferredSourceStats;
   for (auto port : transferRequest_.ports) {
     auto &transferHistory =
         transferHistoryController_->getTransferHistory(port);
@@ -230,10 +334,7 @@ std::unique_ptr<TransferReport> Sender::finish() {
       transferHistory.returnUnackedSourcesToQueue();
     }
     if (options_.full_reporting) {
-      std::vector<TransferStats> stats = transferHistory.popAckedSourceStats();
-      transferredSourceStats.insert(transferredSourceStats.end(),
-                                    std::make_move_iterator(stats.begin()),
-                                    std::make_move_iterator(stats.end()));
+      transferHistory.popAckedSourceStats(transferredSourceStats);
     }
   }
   if (options_.full_reporting) {
@@ -242,6 +343,7 @@ std::unique_ptr<TransferReport> Sender::finish() {
   }
   int64_t totalFileSize = dirQueue_->getTotalSize();
   double totalTime = durationSeconds(endTime_ - startTime_);
+  std::vector<TransferStats> pathStats = getPathStats(threadStats);
   std::unique_ptr<TransferReport> transferReport =
       std::make_unique<TransferReport>(
           transferredSourceStats, dirQueue_->getFailedSourceStats(),
@@ -249,11 +351,37 @@ std::unique_ptr<TransferReport> Sender::finish() {
           totalFileSize, dirQueue_->getCount(),
           dirQueue_->getPreviouslySentBytes(),
           dirQueue_->fileDiscoveryFinished());
+  transferReport->setPathStats(std::move(pathStats));
+  transferReport->setTimeToFirstByte(getTimeToFirstByte(startTime_));
+  threadTimeBreakdowns_.clear();
+  for (auto &senderThread : senderThreads_) {
+    threadTimeBreakdowns_.push_back(senderThread->getTimeBreakdown());
+  }
+  transferReport->setTimeBreakdowns(threadTimeBreakdowns_, true);
+  {
+    std::lock_guard<std::mutex> lock(mutex_);
+    finalMetrics_.setTransfer(transferReport->getSummary(), false, totalTime);
+  }
 
   if (progressReportEnabled) {
     progressReporter_->end(transferReport);
   }
+  if (!options_.discovery_index_path.empty() &&
+      transferReport->getSummary().getErrorCode() == OK &&
+      dirQueue_->fileDiscoveryFinished()) {
+    dirQueue_->saveDiscoveryIndex();
+  }
+  if (journal_ && transferReport->getSummary().getErrorCode() == OK) {
+    journal_->remove();
+  }
   logPerfStats();
+  const std::string prefetchSummary = dirQueue_->getPrefetchSummary();
+  if (!prefetchSummary.empty()) {
+    WLOG(INFO) << prefetchSummary;
+  }
+  if (!options_.trace_file.empty()) {
+    TransferTracer::get().dump(options_.trace_file);
+  }
 
   double directoryTime;
   directoryTime = dirQueue_->getDirectoryTime();
@@ -277,6 +405,27 @@ std::unique_ptr<TransferReport> Sender::transfer() {
   return finish();
 }
 
+bool Sender::setupJournal(bool keepAckedFiles) {
+  // the journal is only valid for the exact same discovery
+  const std::string signature =
+      transferRequest_.directory + '\0' + options_.include_regex + '\0' +
+      options_.exclude_regex + '\0' + options_.prune_dir_regex + '\0' +
+      (options_.follow_symlinks ? "follow" : "nofollow");
+  journal_ =
+      std::make_unique<SenderJournal>(options_.sender_journal_path, signature);
+  if (journal_->open()) {
+    // with extra file deletion, the files not queued would be deleted from
+    // the receiver
+    dirQueue_->setFileInfo(
+        journal_->getRemainingFiles(!keepAckedFiles, options_.odirect_reads));
+    return true;
+  }
+  dirQueue_->setDiscoveryCallback([this](const SourceMetaData &metadata) {
+    journal_->addDiscoveredFile(metadata.getRelPath(), metadata.size);
+  });
+  return false;
+}
+
 ErrorCode Sender::start() {
   {
     std::lock_guard<std::mutex> lock(mutex_);
@@ -293,28 +442,76 @@ ErrorCode Sender::start() {
   WVLOG(3) << "Configuring the  directory queue";
   dirQueue_->setIncludePattern(options_.include_regex);
   dirQueue_->setExcludePattern(options_.exclude_regex);
+  dirQueue_->setFilePriorities(options_.file_priorities);
   dirQueue_->setPruneDirPattern(options_.prune_dir_regex);
   dirQueue_->setFollowSymlinks(options_.follow_symlinks);
   dirQueue_->setBlockSizeMbytes(options_.block_size_mbytes);
   dirQueue_->setNumClientThreads(transferRequest_.ports.size());
+  int numQueueShards = options_.source_queue_shards > 0
+                           ? options_.source_queue_shards
+                           : transferRequest_.ports.size();
+  if (options_.max_readers_per_device > 0) {
+    // devices get shards of their own
+    numQueueShards =
+        std::max<int>(numQueueShards, transferRequest_.ports.size());
+  }
+  dirQueue_->setNumQueueShards(numQueueShards);
+  dirQueue_->setMaxReadersPerDevice(options_.max_readers_per_device);
   dirQueue_->setOpenFilesDuringDiscovery(options_.open_files_during_discovery);
   dirQueue_->setDirectReads(options_.odirect_reads);
-  if (!transferRequest_.fileInfo.empty() ||
-      transferRequest_.disableDirectoryTraversal) {
+  dirQueue_->setDeltaReadOptions(options_.getDeltaReadOptions());
+  dirQueue_->setPrefetchBytes(options_.prefetch_mbytes * kMbToB);
+  dirQueue_->setDiskOrderReads(options_.disk_order_reads);
+  dirQueue_->setAdaptiveBlockSize(options_.adaptive_block_size);
+  dirQueue_->setStealSegmentSize(options_.steal_segment_mbytes * kMbToB);
+  dirQueue_->setSparseFiles(options_.sparse_files);
+  dirQueue_->setStreamSpoolDir(options_.stream_spool_dir);
+  dirQueue_->setStreamSpoolMaxBytes(options_.stream_spool_max_mbytes * kMbToB);
+  dirQueue_->setManifestEnabled(options_.stream_manifest);
+  if (options_.dedup_files) {
+    if (getProtocolVersion() >= Protocol::DEDUP_VERSION) {
+      dirQueue_->setDedupFiles(true, options_.dedup_min_file_kbytes * 1024);
+    } else {
+      WLOG(WARNING) << "Not deduplicating files, protocol version "
+                    << getProtocolVersion();
+    }
+  }
+  dirQueue_->setNumDiscoveryThreads(options_.num_discovery_threads);
+  dirQueue_->setDiscoveryIndexPath(options_.discovery_index_path);
+  dirQueue_->setByteSourceFactory(byteSourceFactory_);
+  dirQueue_->setPriorityClassCallback(priorityCallback_);
+  if (runtime_) {
+    // the sender threads parked waiting for sources poll the queue
+    std::shared_ptr<ReceiverRuntime> runtime = runtime_;
+    dirQueue_->setWakeUpCallback([runtime] { runtime->wakeTimerWaits(); });
+  }
+  downloadResumptionEnabled_ = (transferRequest_.downloadResumptionEnabled ||
+                                options_.enable_download_resumption);
+  bool deleteExtraFiles = (transferRequest_.downloadResumptionEnabled ||
+                           options_.delete_extra_files);
+  bool journalLoaded = false;
+  if (fed_) {
+    dirQueue_->setFed();
+  } else if (!transferRequest_.fileInfo.empty() ||
+             transferRequest_.disableDirectoryTraversal) {
     dirQueue_->setFileInfo(transferRequest_.fileInfo);
+  } else if (!options_.sender_journal_path.empty()) {
+    journalLoaded =
+        setupJournal(downloadResumptionEnabled_ && deleteExtraFiles);
   }
-  transferHistoryController_ =
-      std::make_unique<TransferHistoryController>(*dirQueue_);
+  transferHistoryController_ = std::make_unique<TransferHistoryController>(
+      *dirQueue_, journal_.get(), options_.full_reporting);
 
   checkAndUpdateBufferSize();
   const bool twoPhases = options_.two_phases;
   WLOG(INFO) << "Client (sending) to " << getDestination() << ", Using ports [ "
              << transferRequest_.ports << "]";
   startTime_ = Clock::now();
-  downloadResumptionEnabled_ = (transferRequest_.downloadResumptionEnabled ||
-                                options_.enable_download_resumption);
-  bool deleteExtraFiles = (transferRequest_.downloadResumptionEnabled ||
-                           options_.delete_extra_files);
+  resetFirstByteTime();
+  LatencyHistograms::get().start(options_.latency_histogram_window_millis);
+  if (!options_.trace_file.empty()) {
+    TransferTracer::get().start(options_.trace_buffer_events);
+  }
   if (!progressReporter_) {
     WVLOG(1) << "No progress reporter provided, making a default one";
     progressReporter_ = std::make_unique<ProgressReporter>(transferRequest_);
@@ -327,13 +524,35 @@ ErrorCode Sender::start() {
   } else {
     configureThrottler();
   }
+  if (!receiverRateThrottler_) {
+    // no limit till the receiver advertises one, the threads don't go
+    // through it till then unless there is a parent
+    hasBaseThrottler_ = (throttler_ != nullptr);
+    ThrottlerOptions throttlerOptions = options_.getThrottlerOptions();
+    throttlerOptions.avg_rate_per_sec = -1;
+    throttlerOptions.max_rate_per_sec = -1;
+    throttlerOptions.throttler_bucket_limit = 0;
+    receiverRateThrottler_ =
+        Throttler::makeThrottler(throttlerOptions, throttler_);
+    throttler_ = receiverRateThrottler_;
+  }
+  setupNetworkPaths();
+  if (options_.auto_scale_connections && transferRequest_.ports.size() > 1) {
+    connectionScaler_ = std::make_unique<ConnectionScaler>(
+        options_, transferRequest_.ports.size());
+  }
   threadsController_ = new ThreadsController(transferRequest_.ports.size());
+  threadAffinity_ = std::make_unique<ThreadAffinity>(options_);
   threadsController_->setNumBarriers(SenderThread::NUM_BARRIERS);
   threadsController_->setNumFunnels(SenderThread::NUM_FUNNELS);
   threadsController_->setNumConditions(SenderThread::NUM_CONDITIONS);
   // TODO: fix this ! use transferRequest! (and dup from Receiver)
-  senderThreads_ = threadsController_->makeThreads<Sender, SenderThread>(
-      this, transferRequest_.ports.size(), transferRequest_.ports);
+  {
+    // published to getMetrics()
+    std::lock_guard<std::mutex> lock(mutex_);
+    senderThreads_ = threadsController_->makeThreads<Sender, SenderThread>(
+        this, transferRequest_.ports.size(), transferRequest_.ports);
+  }
   if (downloadResumptionEnabled_ && deleteExtraFiles) {
     if (getProtocolVersion() >= Protocol::DELETE_CMD_VERSION) {
       dirQueue_->enableFileDeletion();
@@ -343,8 +562,17 @@ ErrorCode Sender::start() {
                     << getProtocolVersion();
     }
   }
-  dirThread_ = dirQueue_->buildQueueAsynchronously();
-  if (twoPhases) {
+  if (journal_ && !journalLoaded) {
+    // the snapshot is only written once the whole tree was discovered
+    dirThread_ = std::thread([this] {
+      if (dirQueue_->buildQueueSynchronously()) {
+        journal_->saveSnapshot();
+      }
+    });
+  } else {
+    dirThread_ = dirQueue_->buildQueueAsynchronously();
+  }
+  if (twoPhases && !fed_) {
     dirThread_.join();
   }
   for (auto &senderThread : senderThreads_) {
@@ -352,15 +580,66 @@ ErrorCode Sender::start() {
   }
   if (progressReportEnabled) {
     progressReporter_->start();
-    std::thread reporterThread(&Sender::reportProgress, this);
-    progressReporterThread_ = std::move(reporterThread);
+    if (runtime_) {
+      progressReporterTask_ = std::make_unique<ProgressReporterTask>(*this);
+      startProgressReporter(progressReporterTask_->getState());
+      runtime_->start(progressReporterTask_.get(), runtimeGroup_);
+    } else {
+      std::thread reporterThread(&Sender::reportProgress, this);
+      progressReporterThread_ = std::move(reporterThread);
+    }
   }
   return OK;
 }
 
+void Sender::setupNetworkPaths() {
+  std::vector<std::string> receiverAddresses{getDestination()};
+  receiverAddresses.insert(receiverAddresses.end(),
+                           transferRequest_.receiverAddresses.begin(),
+                           transferRequest_.receiverAddresses.end());
+  std::vector<std::string> localAddresses = transferRequest_.localAddresses;
+  if (localAddresses.empty()) {
+    localAddresses.emplace_back("");
+  }
+  const size_t numPaths =
+      std::max(receiverAddresses.size(), localAddresses.size());
+  networkPaths_.clear();
+  for (size_t i = 0; i < numPaths; i++) {
+    NetworkPath path;
+    path.localAddress = localAddresses[i % localAddresses.size()];
+    path.receiverAddress = receiverAddresses[i % receiverAddresses.size()];
+    networkPaths_.emplace_back(std::move(path));
+  }
+  if (numPaths > 1) {
+    WLOG(INFO) << "Spreading connections across " << numPaths
+               << " network paths";
+  }
+}
+
+const Sender::NetworkPath &Sender::getNetworkPath(int threadIndex) const {
+  return networkPaths_[threadIndex % networkPaths_.size()];
+}
+
+std::vector<TransferStats> Sender::getPathStats(
+    const std::vector<TransferStats> &threadStats) const {
+  std::vector<TransferStats> pathStats;
+  if (networkPaths_.size() <= 1) {
+    return pathStats;
+  }
+  for (const auto &path : networkPaths_) {
+    const std::string local =
+        (path.localAddress.empty() ? "default" : path.localAddress);
+    pathStats.emplace_back(local + "->" + path.receiverAddress);
+  }
+  for (size_t i = 0; i < threadStats.size(); i++) {
+    pathStats[i % networkPaths_.size()] += threadStats[i];
+  }
+  return pathStats;
+}
+
 void Sender::validateTransferStats(
-    const std::vector<TransferStats> &transferredSourceStats,
-    const std::vector<TransferStats> &failedSourceStats) {
+    const SourceStatsTable &transferredSourceStats,
+    const SourceStatsTable &failedSourceStats) {
   int64_t sourceFailedAttempts = 0;
   int64_t sourceDataBytes = 0;
   int64_t sourceEffectiveDataBytes = 0;
@@ -371,17 +650,14 @@ void Sender::validateTransferStats(
   int64_t threadEffectiveDataBytes = 0;
   int64_t threadNumBlocks = 0;
 
-  for (const auto &stat : transferredSourceStats) {
-    sourceFailedAttempts += stat.getFailedAttempts();
-    sourceDataBytes += stat.getDataBytes();
-    sourceEffectiveDataBytes += stat.getEffectiveDataBytes();
-    sourceNumBlocks += stat.getNumBlocks();
-  }
-  for (const auto &stat : failedSourceStats) {
-    sourceFailedAttempts += stat.getFailedAttempts();
-    sourceDataBytes += stat.getDataBytes();
-    sourceEffectiveDataBytes += stat.getEffectiveDataBytes();
-    sourceNumBlocks += stat.getNumBlocks();
+  for (const SourceStatsTable *table :
+       {&transferredSourceStats, &failedSourceStats}) {
+    for (int64_t i = 0; i < table->size(); i++) {
+      sourceFailedAttempts += table->getFailedAttempts(i);
+      sourceDataBytes += table->getDataBytes(i);
+      sourceEffectiveDataBytes += table->getEffectiveDataBytes(i);
+      sourceNumBlocks += table->getNumBlocks(i);
+    }
   }
   for (const auto &senderThread : senderThreads_) {
     const auto &stat = senderThread->getTransferStats();
@@ -401,22 +677,34 @@ void Sender::setSocketCreator(Sender::ISocketCreator *socketCreator) {
   socketCreator_ = socketCreator;
 }
 
-void Sender::reportProgress() {
-  WDT_CHECK(progressReportIntervalMillis_ > 0);
-  int throughputUpdateIntervalMillis =
-      options_.throughput_update_interval_millis;
-  WDT_CHECK(throughputUpdateIntervalMillis >= 0);
-  int throughputUpdateInterval =
-      throughputUpdateIntervalMillis / progressReportIntervalMillis_;
+void Sender::setFed() {
+  fed_ = true;
+}
+
+void Sender::feedBlock(const BlockDetails &block) {
+  WDT_CHECK(dirQueue_ != nullptr) << "Block fed before the transfer started";
+  dirQueue_->feedBlock(block);
+}
+
+void Sender::endFeed() {
+  if (dirQueue_ != nullptr) {
+    dirQueue_->endFeed();
+  }
+}
 
-  int64_t lastEffectiveBytes = 0;
-  std::chrono::time_point<Clock> lastUpdateTime = Clock::now();
-  int intervalsSinceLastUpdate = 0;
-  double currentThroughput = 0;
+void Sender::setByteSourceFactory(ByteSourceFactory byteSourceFactory) {
+  byteSourceFactory_ = std::move(byteSourceFactory);
+}
 
+void Sender::setPriorityClassCallback(
+    std::function<void(int)> priorityCallback) {
+  priorityCallback_ = std::move(priorityCallback);
+}
+
+void Sender::reportProgress() {
+  ProgressReporterState state;
+  startProgressReporter(state);
   auto waitingTime = std::chrono::milliseconds(progressReportIntervalMillis_);
-  WLOG(INFO) << "Progress reporter tracking every "
-             << progressReportIntervalMillis_ << " ms";
   while (true) {
     {
       std::unique_lock<std::mutex> lock(mutex_);
@@ -425,29 +713,51 @@ void Sender::reportProgress() {
         break;
       }
     }
+    sendProgressReport(state);
+  }
+}
 
-    std::unique_ptr<TransferReport> transferReport = getTransferReport();
-    intervalsSinceLastUpdate++;
-    if (intervalsSinceLastUpdate >= throughputUpdateInterval) {
-      auto curTime = Clock::now();
-      int64_t curEffectiveBytes =
-          transferReport->getSummary().getEffectiveDataBytes();
-      double time = durationSeconds(curTime - lastUpdateTime);
-      currentThroughput = (curEffectiveBytes - lastEffectiveBytes) / time;
-      lastEffectiveBytes = curEffectiveBytes;
-      lastUpdateTime = curTime;
-      intervalsSinceLastUpdate = 0;
-    }
-    transferReport->setCurrentThroughput(currentThroughput);
+void Sender::startProgressReporter(ProgressReporterState &state) {
+  WDT_CHECK(progressReportIntervalMillis_ > 0);
+  int throughputUpdateIntervalMillis =
+      options_.throughput_update_interval_millis;
+  WDT_CHECK(throughputUpdateIntervalMillis >= 0);
+  state.throughputUpdateInterval =
+      throughputUpdateIntervalMillis / progressReportIntervalMillis_;
+  state.lastUpdateTime = Clock::now();
+  // updated in place for every interval, see TransferReport::
+  // startProgressUpdate
+  state.transferReport =
+      std::make_unique<TransferReport>(TransferStats(), 0, 0, 0, false);
+  WLOG(INFO) << "Progress reporter tracking every "
+             << progressReportIntervalMillis_ << " ms";
+}
 
-    progressReporter_->progress(transferReport);
-    if (reportPerfSignal_.notified()) {
-      logPerfStats();
-    }
+void Sender::sendProgressReport(ProgressReporterState &state) {
+  auto &transferReport = state.transferReport;
+  updateProgressReport(*transferReport);
+  state.intervalsSinceLastUpdate++;
+  if (state.intervalsSinceLastUpdate >= state.throughputUpdateInterval) {
+    auto curTime = Clock::now();
+    int64_t curEffectiveBytes =
+        transferReport->getSummary().getEffectiveDataBytes();
+    double time = durationSeconds(curTime - state.lastUpdateTime);
+    state.currentThroughput =
+        (curEffectiveBytes - state.lastEffectiveBytes) / time;
+    state.lastEffectiveBytes = curEffectiveBytes;
+    state.lastUpdateTime = curTime;
+    state.intervalsSinceLastUpdate = 0;
+  }
+  transferReport->setCurrentThroughput(state.currentThroughput);
+
+  progressReporter_->progress(transferReport);
+  if (reportPerfSignal_.notified()) {
+    logPerfStats();
   }
 }
 
 void Sender::logPerfStats() const {
+  logThreadBottlenecks(true);
   if (!options_.enable_perf_stat_collection) {
     return;
   }
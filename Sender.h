@@ -10,6 +10,9 @@
 
 #include <wdt/WdtBase.h>
 #include <wdt/util/ClientSocket.h>
+#include <wdt/util/ConnectionScaler.h>
+#include <wdt/util/ReceiverRuntime.h>
+#include <atomic>
 #include <chrono>
 #include <iostream>
 #include <memory>
@@ -17,6 +20,7 @@
 namespace facebook {
 namespace wdt {
 
+class SenderJournal;
 class SenderThread;
 class TransferHistoryController;
 
@@ -63,6 +67,9 @@ class Sender : public WdtBase {
    */
   ErrorCode transferAsync() override;
 
+  /// @see WdtBase::getMetrics
+  TransferMetrics getMetrics() override;
+
   /**
    * A blocking call which will initiate a transfer based on
    * the configuration and return back the stats for the transfer
@@ -89,6 +96,13 @@ class Sender : public WdtBase {
   /// @return    minimal transfer report using transfer stats of the thread
   std::unique_ptr<TransferReport> getTransferReport();
 
+  /// Local and receiver addresses the connections of a thread go through
+  struct NetworkPath {
+    /// empty to let the routing pick it
+    std::string localAddress;
+    std::string receiverAddress;
+  };
+
   /// Interface to make socket
   class ISocketCreator {
    public:
@@ -107,6 +121,61 @@ class Sender : public WdtBase {
    */
   void setSocketCreator(ISocketCreator *socketCreator);
 
+  /**
+   * Has the blocks to send fed by feedBlock() instead of discovered in the
+   * directory of the request, till endFeed() is called. Used by a receiver
+   * forwarding what it receives. Must be called before transferAsync()
+   */
+  void setFed();
+
+  /**
+   * Queues a range of a file of the directory, written since the start of
+   * the transfer. Thread safe.
+   *
+   * @see DirectorySourceQueue::feedBlock
+   */
+  void feedBlock(const BlockDetails &block);
+
+  /// Ends the feed, the transfer finishes once the blocks fed are sent
+  void endFeed();
+
+  /**
+   * Reads the files from elsewhere than the local directory: the sources of
+   * their blocks are created by byteSourceFactory. The files are best given
+   * with their sizes in the file info of the request, so that discovery does
+   * not stat them. Sources supporting asynchronous reads get many reads in
+   * flight with read_ahead_buffers. Must be called before transferAsync()
+   *
+   * @param byteSourceFactory   creates the source of a block
+   */
+  void setByteSourceFactory(ByteSourceFactory byteSourceFactory);
+
+  /**
+   * Sets a function called with each priority class once all its files have
+   * been acked by the receiver, so that consumers of the files of a class can
+   * start before the end of the transfer. The classes come from the priority of the file info
+   * of the request and the file_priorities option. Called from the sender
+   * threads, must not call back into the sender. Must be called before
+   * transferAsync()
+   *
+   * @param priorityCallback    called with the priority of each class
+   */
+  void setPriorityClassCallback(std::function<void(int)> priorityCallback);
+
+  /**
+   * Runs the ports of the sender on a runtime shared with other senders
+   * instead of a thread per port, and so does its progress reporter. The
+   * sockets are then used and deleted from any thread of the runtime, which
+   * the sockets of the socket creator must allow. Must be called before
+   * transferAsync()
+   *
+   * @param runtime       runtime to use, nullptr for a thread per port
+   * @param group         group of the tasks of the sender in the runtime
+   *                      (@see ReceiverRuntime::setGroupLimit)
+   */
+  void setRuntime(std::shared_ptr<ReceiverRuntime> runtime,
+                  const std::string &group = "");
+
  private:
   friend class SenderThread;
   friend class QueueAbortChecker;
@@ -117,6 +186,23 @@ class Sender : public WdtBase {
   /// Get the sum of all the thread transfer stats
   TransferStats getGlobalTransferStats() const;
 
+  /// Updates in place the report of the progress reporter thread
+  void updateProgressReport(TransferReport &transferReport);
+
+  /**
+   * Spreads the connections across the local and receiver addresses of the
+   * request, pairing them in order: with as many local addresses as receiver
+   * addresses, each NIC talks to one receiver NIC
+   */
+  void setupNetworkPaths();
+
+  /// @return   path the connections of a thread go through
+  const NetworkPath &getNetworkPath(int threadIndex) const;
+
+  /// @return   thread stats summed per network path, empty with a single path
+  std::vector<TransferStats> getPathStats(
+      const std::vector<TransferStats> &threadStats) const;
+
   /// Returns true if file chunks need to be read
   bool isSendFileChunks() const;
 
@@ -152,14 +238,42 @@ class Sender : public WdtBase {
    */
   ErrorCode start();
 
+  /**
+   * Opens the journal at sender_journal_path. If it holds the files of a
+   * previous run, the queue is given them instead of discovering the
+   * directory, else the files discovered are recorded in it
+   *
+   * @param keepAckedFiles    whether the files fully acked by the previous
+   *                          run are to be queued all the same
+   *
+   * @return                  true if the files of a previous run were loaded
+   */
+  bool setupJournal(bool keepAckedFiles);
+
   /**
    * @param transferredSourceStats      Stats for the successfully transmitted
    *                                    sources
    * @param failedSourceStats           Stats for the failed sources
    */
   void validateTransferStats(
-      const std::vector<TransferStats> &transferredSourceStats,
-      const std::vector<TransferStats> &failedSourceStats);
+      const SourceStatsTable &transferredSourceStats,
+      const SourceStatsTable &failedSourceStats);
+
+  /// state of the progress reporter, kept across its reports
+  struct ProgressReporterState {
+    /// number of reports between two throughput updates
+    int throughputUpdateInterval{0};
+    int64_t lastEffectiveBytes{0};
+    Clock::time_point lastUpdateTime;
+    int intervalsSinceLastUpdate{0};
+    double currentThroughput{0};
+    /// updated in place for every interval, see
+    /// TransferReport::startProgressUpdate
+    std::unique_ptr<TransferReport> transferReport;
+  };
+
+  /// runs the progress reporter on the runtime, instead of its own thread
+  class ProgressReporterTask;
 
   /**
    * Responsible for doing a periodic check.
@@ -169,6 +283,12 @@ class Sender : public WdtBase {
    */
   void reportProgress();
 
+  /// Initializes the state of the progress reporter
+  void startProgressReporter(ProgressReporterState &state);
+
+  /// sends the current transfer report to the progress reporter
+  void sendProgressReport(ProgressReporterState &state);
+
   void logPerfStats() const override;
 
   /// Pointer to DirectorySourceQueue which reads the srcDir and the files
@@ -183,12 +303,25 @@ class Sender : public WdtBase {
   bool downloadResumptionEnabled_{false};
   /// Flags representing whether file chunks have been received or not
   bool fileChunksReceived_{false};
+  /// Whether the blocks are fed instead of discovered
+  bool fed_{false};
+  /// creates the sources of the blocks, empty to read the local files
+  ByteSourceFactory byteSourceFactory_;
+  /// called with each priority class sent, can be empty
+  std::function<void(int)> priorityCallback_;
   /// Thread that is running the discovery of files using the dirQueue_
   std::thread dirThread_;
+  /// Runtime running the sender threads, nullptr if they have their own.
+  /// Declared before the threads, which use it till they are destroyed
+  std::shared_ptr<ReceiverRuntime> runtime_{nullptr};
+  /// group of the tasks of this sender in runtime_
+  std::string runtimeGroup_;
   /// Threads which are responsible for transfer of the sources
   std::vector<std::unique_ptr<WdtThread>> senderThreads_;
   /// Thread responsible for doing the progress checks. Uses reportProgress()
   std::thread progressReporterThread_;
+  /// Progress reporter running on runtime_ instead of its own thread
+  std::unique_ptr<ProgressReporterTask> progressReporterTask_;
 
   /// Returns the protocol negotiation status of the parent sender
   ProtoNegotiationStatus getNegotiationStatus();
@@ -202,6 +335,24 @@ class Sender : public WdtBase {
   /// Initializing the new transfer
   void startNewTransfer();
 
+  /**
+   * Applies the rate advertised by the receiver, called by sender threads
+   *
+   * @param rateBytesPerSec   rate not to exceed, 0 for no limit
+   */
+  void setReceiverTargetRate(int64_t rateBytesPerSec);
+
+  /**
+   * @return    whether the threads have to go through the throttler, i.e. a
+   *            throttler was set or configured or the receiver advertised a
+   *            rate. The receiver rate throttler alone, with no rate, does
+   *            not count
+   */
+  bool isThrottling() const {
+    return hasBaseThrottler_ ||
+           receiverTargetRate_.load(std::memory_order_relaxed) > 0;
+  }
+
   /// Returns vector of negotiated protocols set by sender threads
   std::vector<int> getNegotiatedProtocols() const;
 
@@ -216,8 +367,29 @@ class Sender : public WdtBase {
   /// Time at which the transfer finished
   std::chrono::time_point<Clock> endTime_;
 
+  /// Journal of the discovered files and acked blocks, nullptr if disabled.
+  /// Declared before the histories recording in it
+  std::unique_ptr<SenderJournal> journal_;
+
   /// Transfer history controller for the sender threads
   std::unique_ptr<TransferHistoryController> transferHistoryController_;
+
+  /// Network paths the threads are spread across
+  std::vector<NetworkPath> networkPaths_;
+
+  /// Decides which threads use their connection, nullptr unless
+  /// auto_scale_connections is set
+  std::unique_ptr<ConnectionScaler> connectionScaler_;
+
+  /// Child of the throttler set or configured, following the rate advertised
+  /// by the receiver. It is the throttler the threads use
+  std::shared_ptr<Throttler> receiverRateThrottler_{nullptr};
+
+  /// Rate last advertised by the receiver, 0 for no limit
+  std::atomic<int64_t> receiverTargetRate_{0};
+
+  /// Whether a throttler was set or configured, above receiverRateThrottler_
+  bool hasBaseThrottler_{false};
 };
 }
 }  // namespace facebook::wdt
@@ -8,13 +8,15 @@
  */
 #include <wdt/SenderThread.h>
 #include <folly/lang/Bits.h>
-#include <folly/hash/Checksum.h>
 #include <folly/Conv.h>
 #include <folly/Memory.h>
+#include <folly/ScopeGuard.h>
 #include <folly/String.h>
+#include <poll.h>
 #include <sys/stat.h>
 #include <wdt/Sender.h>
 #include <wdt/util/ClientSocket.h>
+#include <wdt/util/TransferTracer.h>
 
 namespace facebook {
 namespace wdt {
@@ -29,16 +31,27 @@ const SenderThread::StateFunction SenderThread::stateMap_[] = {
     &SenderThread::connect,         &SenderThread::readLocalCheckPoint,
     &SenderThread::sendSettings,    &SenderThread::sendBlocks,
     &SenderThread::sendDoneCmd,     &SenderThread::sendSizeCmd,
-    &SenderThread::checkForAbort,   &SenderThread::readFileChunks,
-    &SenderThread::readReceiverCmd, &SenderThread::processDoneCmd,
-    &SenderThread::processWaitCmd,  &SenderThread::processErrCmd,
-    &SenderThread::processAbortCmd, &SenderThread::processVersionMismatch};
-
-std::unique_ptr<ClientSocket> SenderThread::connectToReceiver(
-    const int port, IAbortChecker const * /*abortChecker*/,
-    ErrorCode &errCode) {
-  auto startTime = Clock::now();
-  int connectAttempts = 0;
+    &SenderThread::sendManifestCmd, &SenderThread::checkForAbort,
+    &SenderThread::readFileChunks,  &SenderThread::readReceiverCmd,
+    &SenderThread::processDoneCmd,  &SenderThread::processWaitCmd,
+    &SenderThread::processErrCmd,   &SenderThread::processAbortCmd,
+    &SenderThread::processVersionMismatch};
+
+/// names of the states in the trace
+static const char *kSenderStateNames[] = {
+    "CONNECT",           "READ_LOCAL_CHECKPOINT",   "SEND_SETTINGS",
+    "SEND_BLOCKS",       "SEND_DONE_CMD",           "SEND_SIZE_CMD",
+    "SEND_MANIFEST_CMD", "CHECK_FOR_ABORT",         "READ_FILE_CHUNKS",
+    "READ_RECEIVER_CMD", "PROCESS_DONE_CMD",        "PROCESS_WAIT_CMD",
+    "PROCESS_ERR_CMD",   "PROCESS_ABORT_CMD",       "PROCESS_VERSION_MISMATCH"};
+static_assert(sizeof(kSenderStateNames) / sizeof(kSenderStateNames[0]) == END,
+              "Mismatch between number of sender states and their names");
+
+/// data writes taking longer than this are looked at to tell whether the
+/// network or the receiver held them back
+static const int64_t kBlockedWriteMicros = 1000;
+
+std::unique_ptr<ClientSocket> SenderThread::makeSocket(const int port) {
   std::unique_ptr<ClientSocket> socket;
   const EncryptionParams &encryptionData =
       wdtParent_->transferRequest_.encryptionData;
@@ -49,77 +62,123 @@ std::unique_ptr<ClientSocket> SenderThread::connectToReceiver(
                    << threadProtocolVersion_;
     ivChangeInterval = 0;
   }
+  const Sender::NetworkPath &path = wdtParent_->getNetworkPath(threadIndex_);
   if (!wdtParent_->socketCreator_) {
     // socket creator not set, creating ClientSocket
-    socket = std::make_unique<ClientSocket>(*threadCtx_,
-                                            wdtParent_->getDestination(), port,
-                                            encryptionData, ivChangeInterval);
+    socket = std::make_unique<ClientSocket>(*threadCtx_, path.receiverAddress,
+                                            port, encryptionData,
+                                            ivChangeInterval);
   } else {
     socket = wdtParent_->socketCreator_->makeSocket(
-        *threadCtx_, wdtParent_->getDestination(), port, encryptionData,
+        *threadCtx_, path.receiverAddress, port, encryptionData,
         ivChangeInterval);
   }
-  double retryInterval = options_.sleep_millis;
+  if (threadProtocolVersion_ < Protocol::KTLS_VERSION) {
+    socket->disableKtls();
+  }
+  socket->setLocalAddress(path.localAddress);
+  return socket;
+}
+
+bool SenderThread::connectToReceiver(ErrorCode &errCode) {
   int maxRetries = options_.max_retries;
   if (maxRetries < 1) {
-    WTLOG(ERROR) << "Invalid max_retries " << maxRetries << " using 1 instead";
+    if (connectAttempts_ == 0) {
+      WTLOG(ERROR) << "Invalid max_retries " << maxRetries
+                   << " using 1 instead";
+    }
     maxRetries = 1;
   }
-  for (int i = 1; i <= maxRetries; ++i) {
-    ++connectAttempts;
-    errCode = socket->connect();
-    if (errCode == OK) {
+  if (connectAttempts_ == 0) {
+    connectStartTime_ = Clock::now();
+  }
+  errCode = OK;
+  while (true) {
+    if (connectAttempts_ > 0) {
+      // sleep between attempts but not after the last
+      if (!waiting_) {
+        WTVLOG(1) << "Sleeping after failed attempt " << connectAttempts_;
+      }
+      if (sleepFor(getRetrySleepMillis(options_, connectAttempts_)) ==
+          WAIT_PARKED) {
+        return false;
+      }
+    }
+    ++connectAttempts_;
+    errCode = socket_->connect();
+    if (errCode == OK || errCode == CONN_ERROR) {
       break;
-    } else if (errCode == CONN_ERROR) {
-      return nullptr;
     }
     if (getThreadAbortCode() != OK) {
       errCode = ABORT;
-      return nullptr;
+      break;
     }
-    if (i != maxRetries) {
-      // sleep between attempts but not after the last
-      WTVLOG(1) << "Sleeping after failed attempt " << i;
-      /* sleep override */ usleep(retryInterval * 1000);
+    if (connectAttempts_ >= maxRetries) {
+      break;
     }
   }
-  double elapsedSecsConn = durationSeconds(Clock::now() - startTime);
+  const int connectAttempts = connectAttempts_;
+  connectAttempts_ = 0;
+  if (errCode == CONN_ERROR || errCode == ABORT) {
+    return true;
+  }
+  const Sender::NetworkPath &path = wdtParent_->getNetworkPath(threadIndex_);
+  double elapsedSecsConn = durationSeconds(Clock::now() - connectStartTime_);
   if (errCode != OK) {
-    WTLOG(ERROR) << "Unable to connect to " << wdtParent_->getDestination()
-                 << " " << port << " despite " << connectAttempts
+    WTLOG(ERROR) << "Unable to connect to " << path.receiverAddress
+                 << " " << port_ << " despite " << connectAttempts
                  << " retries in " << elapsedSecsConn << " seconds.";
     errCode = CONN_ERROR;
-    return nullptr;
+    return true;
   }
   ((connectAttempts > 1) ? WTLOG(WARNING) : WTLOG(INFO))
       << "Connection took " << connectAttempts << " attempt(s) and "
-      << elapsedSecsConn << " seconds. port " << port;
-  return socket;
+      << elapsedSecsConn << " seconds. port " << port_;
+  return true;
 }
 
 SenderState SenderThread::connect() {
-  WTVLOG(1) << "entered CONNECT state";
-  if (socket_) {
-    ErrorCode socketErrCode = socket_->getNonRetryableErrCode();
-    if (socketErrCode != OK) {
-      WTLOG(ERROR) << "Socket has non-retryable error "
-                   << errorCodeToStr(socketErrCode);
-      threadStats_.setLocalErrorCode(socketErrCode);
+  if (!waiting_ && connectAttempts_ == 0) {
+    WTVLOG(1) << "entered CONNECT state";
+    // the cork goes away with the connection
+    settingsCorked_ = false;
+    if (socket_) {
+      ErrorCode socketErrCode = socket_->getNonRetryableErrCode();
+      if (socketErrCode != OK) {
+        WTLOG(ERROR) << "Socket has non-retryable error "
+                     << errorCodeToStr(socketErrCode);
+        threadStats_.setLocalErrorCode(socketErrCode);
+        return END;
+      }
+      socket_->closeNoCheck();
+    }
+    if (numReconnectWithoutProgress_ >= options_.max_transfer_retries) {
+      WTLOG(ERROR) << "Sender thread reconnected "
+                   << numReconnectWithoutProgress_
+                   << " times without making any progress, giving up. port: "
+                   << socket_->getPort();
+      threadStats_.setLocalErrorCode(NO_PROGRESS);
       return END;
     }
-    socket_->closeNoCheck();
   }
-  if (numReconnectWithoutProgress_ >= options_.max_transfer_retries) {
-    WTLOG(ERROR) << "Sender thread reconnected " << numReconnectWithoutProgress_
-                 << " times without making any progress, giving up. port: "
-                 << socket_->getPort();
-    threadStats_.setLocalErrorCode(NO_PROGRESS);
-    return END;
+  if (connectAttempts_ == 0) {
+    if (numReconnectWithoutProgress_ > 0 &&
+        sleepFor(getRetrySleepMillis(options_, numReconnectWithoutProgress_)) ==
+            WAIT_PARKED) {
+      // the link keeps failing, back off before trying it again
+      return CONNECT;
+    }
+    // TODO cleanup more but for now avoid having 2 socket object live per port
+    resetSocket();
+    socket_ = makeSocket(port_);
   }
   ErrorCode code;
-  // TODO cleanup more but for now avoid having 2 socket object live per port
-  socket_ = nullptr;
-  socket_ = connectToReceiver(port_, threadCtx_->getAbortChecker(), code);
+  if (!connectToReceiver(code)) {
+    return CONNECT;
+  }
+  if (code != OK) {
+    resetSocket();
+  }
   if (code == ABORT) {
     threadStats_.setLocalErrorCode(ABORT);
     if (getThreadAbortCode() == VERSION_MISMATCH) {
@@ -132,8 +191,16 @@ SenderState SenderThread::connect() {
     return END;
   }
   auto nextState = SEND_SETTINGS;
+  readCheckpointAfterSettings_ = false;
   if (threadStats_.getLocalErrorCode() != OK) {
-    nextState = READ_LOCAL_CHECKPOINT;
+    // the settings don't depend on the checkpoint: with fast reconnect they
+    // are sent first, so that the receiver is ready for the next blocks by
+    // the time the checkpoint is read
+    if (options_.fast_reconnect) {
+      readCheckpointAfterSettings_ = true;
+    } else {
+      nextState = READ_LOCAL_CHECKPOINT;
+    }
   }
   // resetting the status of thread
   reset();
@@ -194,6 +261,10 @@ SenderState SenderThread::readLocalCheckPoint() {
   } else {
     numReconnectWithoutProgress_ = 0;
   }
+  if (readCheckpointAfterSettings_) {
+    readCheckpointAfterSettings_ = false;
+    return stateAfterCheckpoint_;
+  }
   return SEND_SETTINGS;
 }
 
@@ -223,9 +294,57 @@ SenderState SenderThread::sendSettings() {
   settings.sendFileChunks = sendFileChunks;
   settings.blockModeDisabled = (options_.block_size_mbytes <= 0);
   settings.enableHeartBeat = enableHeartBeat_;
+  compressionType_ = parseCompressionType(options_.compression);
+  if (compressionType_ != COMP_NONE) {
+    if (!isCompressionTypeSupported(compressionType_)) {
+      WTLOG(WARNING) << "Compression " << options_.compression
+                     << " is not supported by this build, disabling it";
+      compressionType_ = COMP_NONE;
+    } else if (threadProtocolVersion_ < Protocol::COMPRESSION_VERSION) {
+      WTLOG(INFO) << "Disabling compression because of the receiver version "
+                  << threadProtocolVersion_;
+      compressionType_ = COMP_NONE;
+    } else if (!compressor_) {
+      compressor_ = std::make_unique<BlockCompressor>(
+          compressionType_, options_.compression_level,
+          options_.compression_min_savings_percent);
+    }
+  }
+  settings.compressionType = compressionType_;
+  checksumType_ = parseChecksumType(options_.checksum_type);
+  if (checksumType_ != CHECKSUM_CRC32C) {
+    if (!isChecksumTypeSupported(checksumType_)) {
+      WTLOG(WARNING) << "Checksum " << options_.checksum_type
+                     << " is not supported by this build, using crc32c";
+      checksumType_ = CHECKSUM_CRC32C;
+    } else if (threadProtocolVersion_ < Protocol::CHECKSUM_TYPE_VERSION) {
+      WTLOG(INFO) << "Using crc32c checksums because of the receiver version "
+                  << threadProtocolVersion_;
+      checksumType_ = CHECKSUM_CRC32C;
+    }
+  }
+  if (!checksummer_ || checksummer_->getType() != checksumType_) {
+    checksummer_ = std::make_unique<BlockChecksum>(checksumType_);
+  }
+  settings.checksumType = checksumType_;
+  settings.dedupFiles = dirQueue_->isDedupEnabled();
+  if (settings.dedupFiles && threadProtocolVersion_ < Protocol::DEDUP_VERSION) {
+    // the duplicates already queued have no data to send
+    WTLOG(ERROR) << "Files queued as duplicates, but the receiver version "
+                 << threadProtocolVersion_ << " can not copy them";
+    threadStats_.setLocalErrorCode(VERSION_INCOMPATIBLE);
+    return END;
+  }
   Protocol::encodeSettings(threadProtocolVersion_, buf_, off,
                            Protocol::kMaxSettings, settings);
+  // tcp has an rtt sample from its handshake, the local checkpoint may only
+  // be read after the settings
+  socket_->autoSizeBuffers();
   int64_t toWrite = sendFileChunks ? Protocol::kMinBufLength : off;
+  // nothing is read back before the first block, the settings can wait for
+  // it in the kernel
+  settingsCorked_ = options_.piggyback_settings && !sendFileChunks &&
+                    !readCheckpointAfterSettings_ && socket_->setCork(true);
   int64_t written = socket_->write(buf_, toWrite);
   if (written != toWrite) {
     WTLOG(ERROR) << "Socket write failure " << written << " " << toWrite;
@@ -233,7 +352,13 @@ SenderState SenderThread::sendSettings() {
     return CONNECT;
   }
   threadStats_.addHeaderBytes(toWrite);
-  return (sendFileChunks ? READ_FILE_CHUNKS : SEND_BLOCKS);
+  chooseSendLoop();
+  const SenderState nextState = sendFileChunks ? READ_FILE_CHUNKS : SEND_BLOCKS;
+  if (readCheckpointAfterSettings_) {
+    stateAfterCheckpoint_ = nextState;
+    return READ_LOCAL_CHECKPOINT;
+  }
+  return nextState;
 }
 
 const int kHeartBeatReadTimeFactor = 10;
@@ -243,71 +368,482 @@ ErrorCode SenderThread::readHeartBeats() {
     return OK;
   }
   const auto now = Clock::now();
+  // called for every buffer, the socket is looked at most once per interval
+  if (now < nextHeartBeatCheckTime_) {
+    return OK;
+  }
   const int timeSinceLastHeartBeatMs = durationMillis(now - lastHeartBeatTime_);
   const int heartBeatIntervalMs =
       (options_.read_timeout_millis * kHeartBeatReadTimeFactor);
-  if (timeSinceLastHeartBeatMs <= heartBeatIntervalMs) {
+  // target rates of the receiver are looked for more often, only when there
+  // is something to read
+  const bool lookForRates =
+      threadProtocolVersion_ >= Protocol::RECEIVER_RATE_VERSION;
+  const int checkIntervalMs =
+      lookForRates ? std::min(heartBeatIntervalMs,
+                              options_.backpressure_interval_millis)
+                   : heartBeatIntervalMs;
+  nextHeartBeatCheckTime_ = now + std::chrono::milliseconds(checkIntervalMs);
+  const bool earlyRead = (timeSinceLastHeartBeatMs <= heartBeatIntervalMs);
+  if (earlyRead && (!lookForRates || !socket_->isReadable())) {
     return OK;
   }
   lastHeartBeatTime_ = now;
-  // time to read heart-beats
-  const int numRead = socket_->read(buf_, bufSize_,
-                                    /* don't try to read all the data */ false);
+  if (!waitForZeroCopyWrites(buf_, bufSize_)) {
+    return SOCKET_WRITE_ERROR;
+  }
+  // time to read heart-beats, all the ones buffered since the last read come
+  // in one read
+  int numRead = socket_->read(buf_, bufSize_,
+                              /* don't try to read all the data */ false);
   if (numRead <= 0) {
     WTLOG(ERROR) << "Failed to read heart-beat " << numRead;
     return SOCKET_READ_ERROR;
   }
+  int numHeartBeats = 0;
   for (int i = 0; i < numRead; i++) {
     const char receivedCmd = buf_[i];
-    if (receivedCmd != Protocol::HEART_BEAT_CMD) {
+    if (receivedCmd == Protocol::HEART_BEAT_CMD) {
+      numHeartBeats++;
+      continue;
+    }
+    if (receivedCmd != Protocol::RATE_CMD ||
+        threadProtocolVersion_ < Protocol::RECEIVER_RATE_VERSION) {
       WTLOG(ERROR) << "Received " << receivedCmd
                    << " instead of heart-beat cmd";
       return PROTOCOL_ERROR;
     }
+    const int cmdEnd = i + Protocol::kRateCmdLen;
+    if (cmdEnd > numRead) {
+      // the receiver writes the cmd at once, the rest of it is on its way
+      const int toRead = cmdEnd - numRead;
+      if (cmdEnd > bufSize_ || socket_->read(buf_ + numRead, toRead) != toRead) {
+        WTLOG(ERROR) << "Failed to read rate cmd";
+        return SOCKET_READ_ERROR;
+      }
+      numRead = cmdEnd;
+    }
+    ErrorCode code = processTargetRate(buf_ + i + 1);
+    if (code != OK) {
+      return code;
+    }
+    i = cmdEnd - 1;
   }
-  if (!isTty_) {
-    WTLOG(INFO) << "Received " << numRead << " heart-beats";
+  if (!isTty_ && !earlyRead) {
+    WTLOG(INFO) << "Received " << numHeartBeats << " heart-beats";
   }
   return OK;
 }
 
+ErrorCode SenderThread::processTargetRate(char *buf) {
+  int64_t off = 0;
+  int64_t rateBytesPerSec;
+  if (!Protocol::decodeRate(buf, off, Protocol::kRateCmdLen - 1,
+                            rateBytesPerSec) ||
+      rateBytesPerSec < 0) {
+    WTLOG(ERROR) << "Unable to decode rate cmd";
+    return PROTOCOL_ERROR;
+  }
+  wdtParent_->setReceiverTargetRate(rateBytesPerSec);
+  return OK;
+}
+
 SenderState SenderThread::sendBlocks() {
-  WTVLOG(1) << "entered SEND_BLOCKS state";
-  ThreadTransferHistory &transferHistory = getTransferHistory();
+  if (!waiting_) {
+    WTVLOG(1) << "entered SEND_BLOCKS state";
+  }
   if (threadProtocolVersion_ >= Protocol::RECEIVER_PROGRESS_REPORT_VERSION &&
       !totalSizeSent_ && dirQueue_->fileDiscoveryFinished()) {
     return SEND_SIZE_CMD;
   }
-  ErrorCode transferStatus;
-  std::unique_ptr<ByteSource> source =
-      dirQueue_->getNextSource(threadCtx_.get(), transferStatus);
-  if (!source) {
-    // try to read any buffered heart-beats
+  if (threadProtocolVersion_ >= Protocol::MANIFEST_VERSION &&
+      dirQueue_->hasManifestEntries()) {
+    return SEND_MANIFEST_CMD;
+  }
+  // the number of blocks sent with the done cmd must be final
+  if (connectionScaler_ && !nextSource_ && dirQueue_->fileDiscoveryFinished() &&
+      connectionScaler_->shouldRetire(threadIndex_)) {
+    dirQueue_->returnInFlightSource(threadCtx_.get());
     readHeartBeats();
-
     return SEND_DONE_CMD;
   }
-  WDT_CHECK(!source->hasError());
+  ErrorCode transferStatus;
+  std::unique_ptr<ByteSource> source;
+  if (nextSource_) {
+    // already in the read ahead pipeline
+    source = std::move(nextSource_);
+    transferStatus = nextSourceStatus_;
+  } else {
+    // the segments left of the block of this thread come first
+    source = dirQueue_->getNextInFlightSource(threadCtx_.get(), transferStatus);
+    if (!source && runtime_ != nullptr) {
+      source = dirQueue_->tryGetNextSource(threadCtx_.get(), transferStatus);
+    }
+    if (!source && runtime_ != nullptr &&
+        (!dirQueue_->waitForSources(0) ||
+         dirQueue_->getNumQueuedSources() > 0)) {
+      // parked till the discovery catches up or a device is released,
+      // instead of blocking in getNextSource()
+      const bool keepReceiverWaiting =
+          (dirQueue_->isFed() || dirQueue_->isStreaming()) &&
+          threadProtocolVersion_ >= Protocol::RECEIVER_PROGRESS_REPORT_VERSION;
+      const int timeoutMillis =
+          keepReceiverWaiting
+              ? options_.read_timeout_millis / 2
+              : std::max(1, options_.abort_check_interval_millis);
+      const WaitResult result = waitForReadable({}, timeoutMillis);
+      if (result == WAIT_TIMED_OUT && keepReceiverWaiting) {
+        return SEND_SIZE_CMD;
+      }
+      return SEND_BLOCKS;
+    }
+    waiting_ = false;
+    if (!source) {
+      if ((dirQueue_->isFed() || dirQueue_->isStreaming()) &&
+          threadProtocolVersion_ >=
+              Protocol::RECEIVER_PROGRESS_REPORT_VERSION &&
+          !dirQueue_->waitForSources(options_.read_timeout_millis / 2)) {
+        // nothing fed or streamed for a while, the size cmd keeps the
+        // receiver waiting
+        return SEND_SIZE_CMD;
+      }
+      source = dirQueue_->getNextSource(threadCtx_.get(), transferStatus);
+    }
+    if (!source) {
+      // the end of the blocks still sent by slower threads
+      source = dirQueue_->stealInFlightSource(threadCtx_.get(), transferStatus);
+    }
+    if (!source) {
+      if (connectionScaler_) {
+        connectionScaler_->finish();
+      }
+      // try to read any buffered heart-beats
+      readHeartBeats();
+
+      return SEND_DONE_CMD;
+    }
+    WDT_CHECK(!source->hasError());
+    if (fileBatchLen_ > 0 &&
+        threadProtocolVersion_ >= Protocol::FILE_BATCH_VERSION &&
+        source->getSize() <= options_.small_file_max_bytes) {
+      return sendFileBatch(std::move(source), transferStatus);
+    }
+    if (readAheadPipeline_) {
+      readAheadPipeline_->addSource(source.get());
+    }
+  }
   TransferStats transferStats = sendOneByteSource(source, transferStatus);
+  if (!finishSource(source, transferStats)) {
+    return END;
+  }
+  if (transferStats.getLocalErrorCode() != OK) {
+    return CHECK_FOR_ABORT;
+  }
+  yieldToOtherPorts();
+  return SEND_BLOCKS;
+}
+
+bool SenderThread::finishSource(std::unique_ptr<ByteSource> &source,
+                                const TransferStats &transferStats) {
   threadStats_ += transferStats;
   source->addTransferStats(transferStats);
   source->close();
-  if (!transferHistory.addSource(source)) {
+  if (!getTransferHistory().addSource(source)) {
     // global checkpoint received for this thread. no point in
     // continuing
     WTLOG(ERROR) << "global checkpoint received. Stopping";
     threadStats_.setLocalErrorCode(CONN_ERROR);
-    return END;
+    return false;
   }
-  if (transferStats.getLocalErrorCode() != OK) {
+  if (connectionScaler_ && transferStats.getLocalErrorCode() == OK) {
+    reportToScaler();
+  }
+  return true;
+}
+
+void SenderThread::recordZeroCopyWrite(const char *buffer) {
+  const int64_t mark = socket_->getZeroCopyWriteMark();
+  if (socket_->isZeroCopyWriteComplete(mark)) {
+    return;
+  }
+  for (auto &zeroCopyBuffer : zeroCopyBuffers_) {
+    if (zeroCopyBuffer.data == buffer) {
+      zeroCopyBuffer.mark = mark;
+      return;
+    }
+  }
+  zeroCopyBuffers_.push_back({buffer, mark});
+}
+
+bool SenderThread::waitForZeroCopyWrites(const char *buffer, int64_t size) {
+  for (auto it = zeroCopyBuffers_.begin(); it != zeroCopyBuffers_.end();) {
+    if (it->data < buffer || it->data >= buffer + size) {
+      ++it;
+      continue;
+    }
+    if (!socket_->waitForZeroCopyCompletions(it->mark)) {
+      return false;
+    }
+    it = zeroCopyBuffers_.erase(it);
+  }
+  return true;
+}
+
+bool SenderThread::releaseHeldChunks(size_t maxHeld) {
+  while (!heldChunks_.empty()) {
+    const ZeroCopyBuffer &oldest = heldChunks_.front();
+    if (heldChunks_.size() > maxHeld) {
+      if (!socket_->waitForZeroCopyCompletions(oldest.mark)) {
+        return false;
+      }
+    } else if (!socket_->isZeroCopyWriteComplete(oldest.mark)) {
+      // the newer chunks were sent after this one
+      break;
+    }
+    readAheadPipeline_->releaseBuffer(oldest.data);
+    heldChunks_.pop_front();
+  }
+  return true;
+}
+
+void SenderThread::resetSocket() {
+  if (socket_) {
+    threadStats_.addZeroCopyWrites(socket_->getNumZeroCopyWrites(),
+                                   socket_->getNumZeroCopyCopiedWrites());
+  }
+  // resets the connection if zero copy writes are still pending
+  socket_ = nullptr;
+  zeroCopyBuffers_.clear();
+  if (readAheadPipeline_) {
+    for (const auto &held : heldChunks_) {
+      readAheadPipeline_->releaseBuffer(held.data);
+    }
+  }
+  heldChunks_.clear();
+}
+
+void SenderThread::reportToScaler() {
+  const auto now = Clock::now();
+  if (now < nextScalerReportTime_) {
+    return;
+  }
+  nextScalerReportTime_ =
+      now + std::chrono::milliseconds(options_.auto_scale_interval_millis / 4);
+  connectionScaler_->reportProgress(threadIndex_,
+                                    threadStats_.getEffectiveTotalBytes(),
+                                    socket_->getRttMicros(), now);
+}
+
+BlockDetails SenderThread::getBlockDetails(const ByteSource &source) {
+  const SourceMetaData &metadata = source.getMetaData();
+  BlockDetails blockDetails;
+  blockDetails.fileName = metadata.getRelPath();
+  blockDetails.seqId = metadata.seqId;
+  blockDetails.fileSize = metadata.size;
+  blockDetails.offset = source.getOffset();
+  blockDetails.dataSize = source.getSize();
+  blockDetails.allocationStatus = metadata.allocationStatus;
+  blockDetails.prevSeqId = metadata.prevSeqId;
+  blockDetails.sparseFile = !metadata.dataExtents.empty();
+  blockDetails.duplicateOfSeqId = metadata.duplicateOfSeqId;
+  return blockDetails;
+}
+
+SenderState SenderThread::sendFileBatch(std::unique_ptr<ByteSource> firstSource,
+                                        ErrorCode transferStatus) {
+  // the files are read into the thread buffer, the previous batch or block
+  // may still be sent from the buffers
+  if (!waitForZeroCopyWrites(fileBatchBuf_.data(), fileBatchBuf_.size()) ||
+      !waitForZeroCopyWrites(buf_, bufSize_)) {
+    WTLOG(ERROR) << "Zero copy write failure. fd = " << socket_->getFd();
+    TransferStats stats;
+    stats.setLocalErrorCode(SOCKET_WRITE_ERROR);
+    stats.incrFailedAttempts();
+    if (!finishSource(firstSource, stats)) {
+      return END;
+    }
+    return CHECK_FOR_ABORT;
+  }
+  if ((int64_t)fileBatchBuf_.size() < fileBatchLen_) {
+    fileBatchBuf_.resize(fileBatchLen_);
+  }
+  char *batchBuf = fileBatchBuf_.data();
+  int64_t off = 0;
+  batchBuf[off++] = Protocol::FILE_BATCH_CMD;
+  batchBuf[off++] = transferStatus;
+  char *batchLenPtr = batchBuf + off;
+  off += sizeof(int32_t);
+  std::vector<std::unique_ptr<ByteSource>> sources;
+  std::vector<TransferStats> sourcesStats;
+  ErrorCode errCode = OK;
+  // the footer has the combined checksums of the files, in order
+  int64_t checksum = 0;
+  std::unique_ptr<ByteSource> source = std::move(firstSource);
+  while (source) {
+    TransferStats stats;
+    const int64_t headerStart = (sources.empty() ? 0 : off);
+    const BlockDetails blockDetails = getBlockDetails(*source);
+    sources.emplace_back(std::move(source));
+    if (!Protocol::encodeHeader(wdtParent_->getProtocolVersion(), batchBuf, off,
+                                fileBatchLen_, blockDetails)) {
+      errCode = ERROR;
+      break;
+    }
+    const int64_t dataStart = off;
+    ByteSource *curSource = sources.back().get();
+    while (!curSource->finished()) {
+      int64_t size;
+      char *buffer = curSource->read(size);
+      if (curSource->hasError() || off + size > fileBatchLen_) {
+        WTLOG(ERROR) << "Failed reading file " << curSource->getIdentifier()
+                     << " for batch";
+        errCode = BYTE_SOURCE_READ_ERROR;
+        break;
+      }
+      memcpy(batchBuf + off, buffer, size);
+      off += size;
+    }
+    if (errCode != OK) {
+      break;
+    }
+    if (off - dataStart != blockDetails.dataSize) {
+      WTLOG(ERROR) << "UGH " << curSource->getIdentifier() << " "
+                   << blockDetails.dataSize << " " << (off - dataStart);
+      errCode = BYTE_SOURCE_READ_ERROR;
+      break;
+    }
+    if (footerType_ == CHECKSUM_FOOTER) {
+      checksummer_->reset();
+      checksummer_->update(batchBuf + dataStart, blockDetails.dataSize);
+      checksum = BlockChecksum::combine(checksumType_, checksum,
+                                        checksummer_->getValue(),
+                                        blockDetails.dataSize);
+    }
+    stats.addHeaderBytes(dataStart - headerStart);
+    stats.addDataBytes(blockDetails.dataSize);
+    sourcesStats.emplace_back(std::move(stats));
+    // leave room for the longest possible header of the next source
+    const int64_t maxNextSize =
+        std::min<int64_t>(options_.small_file_max_bytes,
+                          fileBatchLen_ - off - Protocol::kMaxHeader);
+    if (maxNextSize >= 0) {
+      source = dirQueue_->getNextSmallSource(threadCtx_.get(), maxNextSize);
+    }
+  }
+  if (errCode == OK) {
+    readHeartBeats();
+    int32_t littleEndianLen = folly::Endian::little(
+        (int32_t)(off - Protocol::kFileBatchPrefixLen));
+    folly::storeUnaligned<int32_t>(batchLenPtr, littleEndianLen);
+    if (wdtParent_->getThrottler()) {
+      wdtParent_->getThrottler()->limit(*threadCtx_, off);
+    }
+    const int64_t written = socket_->write(batchBuf, off, /* retry */ true);
+    recordZeroCopyWrite(batchBuf);
+    if (written > 0) {
+      wdtParent_->markFirstByte();
+    }
+    if (written != off) {
+      WTLOG(ERROR) << "Write error/mismatch " << written << " " << off
+                   << " for batch of " << sources.size()
+                   << " files. fd = " << socket_->getFd();
+      errCode = SOCKET_WRITE_ERROR;
+    } else if (getThreadAbortCode() != OK) {
+      WTLOG(ERROR) << "Transfer aborted during file batch transfer "
+                   << socket_->getPort();
+      errCode = ABORT;
+    }
+  }
+  if (errCode == OK && footerType_ != NO_FOOTER) {
+    char footerBuf[Protocol::kMaxFooter];
+    int64_t footerOff = 0;
+    footerBuf[footerOff++] = Protocol::FOOTER_CMD;
+    Protocol::encodeFooter(footerBuf, footerOff, Protocol::kMaxFooter,
+                           checksum);
+    const int64_t written = socket_->write(footerBuf, footerOff);
+    if (written != footerOff) {
+      WTLOG(ERROR) << "Write mismatch " << written << " " << footerOff;
+      errCode = SOCKET_WRITE_ERROR;
+    } else {
+      sourcesStats.back().addHeaderBytes(footerOff);
+    }
+  }
+  WTVLOG(1) << "Sent batch of " << sources.size() << " files, " << off
+            << " bytes, status " << errorCodeToStr(errCode);
+  for (size_t i = 0; i < sources.size(); i++) {
+    TransferStats stats;
+    if (errCode == OK) {
+      stats = std::move(sourcesStats[i]);
+      stats.setLocalErrorCode(OK);
+      stats.incrNumBlocks();
+      stats.addEffectiveBytes(stats.getHeaderBytes(), stats.getDataBytes());
+    } else {
+      stats.setLocalErrorCode(errCode);
+      stats.incrFailedAttempts();
+    }
+    if (!finishSource(sources[i], stats)) {
+      return END;
+    }
+  }
+  if (errCode != OK) {
     return CHECK_FOR_ABORT;
   }
+  yieldToOtherPorts();
   return SEND_BLOCKS;
 }
 
+void SenderThread::chooseSendLoop() {
+  const bool checksum = (footerType_ == CHECKSUM_FOOTER);
+  const bool throttled = wdtParent_->isThrottling();
+  sendLoopThrottled_ = throttled;
+  if (checksum) {
+    sendOneByteSourceFn_ =
+        throttled ? &SenderThread::sendOneByteSourceImpl<true, true>
+                  : &SenderThread::sendOneByteSourceImpl<true, false>;
+  } else {
+    sendOneByteSourceFn_ =
+        throttled ? &SenderThread::sendOneByteSourceImpl<false, true>
+                  : &SenderThread::sendOneByteSourceImpl<false, false>;
+  }
+}
+
 TransferStats SenderThread::sendOneByteSource(
     const std::unique_ptr<ByteSource> &source, ErrorCode transferStatus) {
+  if (wdtParent_->isThrottling() != sendLoopThrottled_) {
+    chooseSendLoop();
+  }
+  return (this->*sendOneByteSourceFn_)(source, transferStatus);
+}
+
+template <bool kChecksum, bool kThrottled>
+TransferStats SenderThread::sendOneByteSourceImpl(
+    const std::unique_ptr<ByteSource> &source, ErrorCode transferStatus) {
+  TraceSpan span("send block");
   TransferStats stats;
+  // the throttler outlives the transfer, no need to hold a reference per chunk
+  Throttler *const throttler =
+      kThrottled ? wdtParent_->getThrottler().get() : nullptr;
+  const bool pipelined = (readAheadPipeline_ != nullptr);
+  // the peer may have turned encryption off, never the other way around
+  const bool plainWrites = (socket_->getEncryptionType() == ENC_NONE ||
+                            socket_->isKtlsWriteEnabled());
+  const int zeroCopyFd = (zeroCopySend_ && !pipelined && plainWrites)
+                             ? source->getZeroCopyFd()
+                             : -1;
+  // on any failure nothing should be read anymore from the pipeline
+  auto cancelGuard = folly::makeGuard([&] {
+    if (pipelined) {
+      readAheadPipeline_->cancel();
+    }
+  });
+  TimeBreakdown &timeBreakdown = threadCtx_->getTimeBreakdown();
+  auto addTime = [&](TimeBreakdown::Category category,
+                     Clock::time_point startTime) {
+    const int64_t micros = durationMicros(Clock::now() - startTime);
+    timeBreakdown.add(category, micros);
+    return micros;
+  };
+  bool nextSourceRequested = false;
   char headerBuf[Protocol::kMaxHeader];
   int64_t off = 0;
   headerBuf[off++] = Protocol::FILE_CMD;
@@ -317,52 +853,145 @@ TransferStats SenderThread::sendOneByteSource(
   const int64_t expectedSize = source->getSize();
   int64_t actualSize = 0;
   const SourceMetaData &metadata = source->getMetaData();
-  BlockDetails blockDetails;
-  blockDetails.fileName = metadata.relPath;
-  blockDetails.seqId = metadata.seqId;
-  blockDetails.fileSize = metadata.size;
-  blockDetails.offset = source->getOffset();
-  blockDetails.dataSize = expectedSize;
-  blockDetails.allocationStatus = metadata.allocationStatus;
-  blockDetails.prevSeqId = metadata.prevSeqId;
+  BlockDetails blockDetails = getBlockDetails(*source);
+  // sendfile bypasses the buffers the data would be compressed from
+  BlockCompressor *compressor =
+      (compressionType_ != COMP_NONE && zeroCopyFd < 0) ? compressor_.get()
+                                                         : nullptr;
+  blockDetails.compressed =
+      (compressor && expectedSize > 0 && compressor->shouldCompressBlock());
   Protocol::encodeHeader(wdtParent_->getProtocolVersion(), headerBuf, off,
                          Protocol::kMaxHeader, blockDetails);
   int16_t littleEndianOff = folly::Endian::little((int16_t)off);
   folly::storeUnaligned<int16_t>(headerLenPtr, littleEndianOff);
-  int64_t written = socket_->write(headerBuf, off);
-  if (written != off) {
-    WTPLOG(ERROR) << "Write error/mismatch " << written << " " << off
-                  << ". fd = " << socket_->getFd()
-                  << ". file = " << metadata.relPath
-                  << ". port = " << socket_->getPort();
-    stats.setLocalErrorCode(SOCKET_WRITE_ERROR);
-    stats.incrFailedAttempts();
-    return stats;
-  }
-
-  stats.addHeaderBytes(written);
-  int64_t byteSourceHeaderBytes = written;
+  // the header is sent along with the first chunk of data, and the footer
+  // along with the last one, in a single writev
+  const int64_t headerLen = off;
+  bool headerSent = false;
+  char footerBuf[Protocol::kMaxFooter];
+  int64_t footerLen = 0;
+  auto encodeFooter = [&]() {
+    if (kChecksum) {
+      footerLen = 0;
+      footerBuf[footerLen++] = Protocol::FOOTER_CMD;
+      Protocol::encodeFooter(footerBuf, footerLen, Protocol::kMaxFooter,
+                             checksummer_->getValue());
+    }
+  };
+  auto sendHeader = [&](char *data, int64_t size) {
+    struct iovec iov[3];
+    iov[0].iov_base = headerBuf;
+    iov[0].iov_len = headerLen;
+    iov[1].iov_base = data;
+    iov[1].iov_len = size;
+    iov[2].iov_base = footerBuf;
+    iov[2].iov_len = footerLen;
+    const int64_t toWrite = headerLen + size + footerLen;
+    const int64_t written = socket_->writev(iov, 3, /* retry writes */ true);
+    headerSent = true;
+    if (written != toWrite) {
+      WTPLOG(ERROR) << "Write error/mismatch " << written << " " << toWrite
+                    << ". fd = " << socket_->getFd()
+                    << ". file = " << metadata.getRelPath()
+                    << ". port = " << socket_->getPort();
+      return false;
+    }
+    stats.addHeaderBytes(headerLen + footerLen);
+    wdtParent_->markFirstByte();
+    WTVLOG(3) << "Sent " << headerLen << " on " << socket_->getFd() << " : "
+              << folly::humanify(std::string(headerBuf, headerLen));
+    return true;
+  };
+  int64_t written = 0;
+  // data bytes written, less than actualSize when the block is compressed
+  int64_t wireDataSize = 0;
+  int64_t byteSourceHeaderBytes = headerLen;
   int64_t throttlerInstanceBytes = byteSourceHeaderBytes;
   int64_t totalThrottlerBytes = 0;
-  WTVLOG(3) << "Sent " << written << " on " << socket_->getFd() << " : "
-            << folly::humanify(std::string(headerBuf, off));
-  int32_t checksum = 0;
-  while (!source->finished()) {
+  if (kChecksum) {
+    checksummer_->reset();
+  }
+  // MSG_ZEROCOPY and sendfile are only used by write() and sendFile()
+  const bool dataWithHeader = (zeroCopyFd < 0 && !options_.zero_copy_writes);
+  // chunks still sent from while the next ones are read, at least one buffer
+  // is left to the pipeline reader
+  const size_t maxHeldChunks =
+      pipelined ? threadCtx_->getNumBuffers() - 2 : 0;
+  while (pipelined || !source->finished()) {
     // TODO: handle protocol errors from readHeartBeats
     readHeartBeats();
 
     int64_t size;
-    char *buffer = source->read(size);
-    if (source->hasError()) {
-      WTLOG(ERROR) << "Failed reading file " << source->getIdentifier()
-                   << " for fd " << socket_->getFd();
-      break;
+    char *buffer = nullptr;
+    if (zeroCopyFd < 0 &&
+        !(pipelined ? releaseHeldChunks(maxHeldChunks)
+                    : waitForZeroCopyWrites(buf_, bufSize_))) {
+      // the buffer is about to be read into
+      WTLOG(ERROR) << "Zero copy write failure. fd = " << socket_->getFd()
+                   << ". file = " << metadata.getRelPath();
+      stats.setLocalErrorCode(SOCKET_WRITE_ERROR);
+      stats.incrFailedAttempts();
+      return stats;
     }
-    WDT_CHECK(buffer && size > 0);
-    if (footerType_ == CHECKSUM_FOOTER) {
-      checksum = folly::crc32c((const uint8_t *)buffer, size, checksum);
+    if (zeroCopyFd >= 0) {
+      // data goes directly from the file to the socket
+      size = std::min<int64_t>(expectedSize - actualSize, options_.buffer_size);
+    } else if (pipelined) {
+      const Clock::time_point readStartTime = Clock::now();
+      buffer = readAheadPipeline_->read(source.get(), size);
+      addTime(TimeBreakdown::DISK, readStartTime);
+      if (buffer == nullptr) {
+        // source has left the pipeline, it can be looked at again
+        if (source->hasError()) {
+          WTLOG(ERROR) << "Failed reading file " << source->getIdentifier()
+                       << " for fd " << socket_->getFd();
+        }
+        break;
+      }
+      if (!nextSourceRequested && !nextSource_ &&
+          readAheadPipeline_->isIdle()) {
+        // start reading the next source while the end of this one is sent.
+        // Never waits, if no source can be read right now the next one is
+        // waited for at the start of SEND_BLOCKS
+        nextSourceRequested = true;
+        nextSource_ =
+            dirQueue_->tryGetNextSource(threadCtx_.get(), nextSourceStatus_);
+        if (nextSource_) {
+          readAheadPipeline_->addSource(nextSource_.get());
+        }
+      }
+    } else {
+      const Clock::time_point readStartTime = Clock::now();
+      buffer = source->read(size);
+      addTime(TimeBreakdown::DISK, readStartTime);
+      if (source->hasError()) {
+        WTLOG(ERROR) << "Failed reading file " << source->getIdentifier()
+                     << " for fd " << socket_->getFd();
+        break;
+      }
     }
-    if (wdtParent_->getThrottler()) {
+    WDT_CHECK((buffer || zeroCopyFd >= 0) && size > 0);
+    if (kChecksum) {
+      checksummer_->update(buffer, size);
+    }
+    // what goes on the wire for this chunk, the checksum is of the raw data
+    char *wireData = buffer;
+    int64_t wireSize = size;
+    if (blockDetails.compressed) {
+      if (!waitForZeroCopyWrites(compressedBuf_.data(), compressedBuf_.size())) {
+        WTLOG(ERROR) << "Zero copy write failure. fd = " << socket_->getFd()
+                     << ". file = " << metadata.getRelPath();
+        stats.setLocalErrorCode(SOCKET_WRITE_ERROR);
+        stats.incrFailedAttempts();
+        return stats;
+      }
+      wireSize = encodeCompressedFrames(buffer, size);
+      wireData = compressedBuf_.data();
+      stats.addCompressedBytes(size, wireSize);
+    } else if (compressor) {
+      compressor->skipUncompressed(size);
+    }
+    if (kThrottled) {
       /**
        * If throttling is enabled we call limit(deltaBytes) which
        * used both the methods of throttling peak and average.
@@ -372,12 +1001,48 @@ TransferStats SenderThread::sendOneByteSource(
        * included. In the next iterations throttler is only called
        * with the bytes being written.
        */
-      throttlerInstanceBytes += size;
-      wdtParent_->getThrottler()->limit(*threadCtx_, throttlerInstanceBytes);
+      throttlerInstanceBytes += wireSize;
+      throttler->limit(*threadCtx_, throttlerInstanceBytes);
       totalThrottlerBytes += throttlerInstanceBytes;
       throttlerInstanceBytes = 0;
     }
-    written = socket_->write(buffer, size, /* retry writes */ true);
+    const Clock::time_point writeStartTime = Clock::now();
+    bool dataSent = false;
+    if (!headerSent) {
+      if (dataWithHeader && actualSize + size == expectedSize) {
+        encodeFooter();
+      }
+      if (!sendHeader(dataWithHeader ? wireData : nullptr,
+                      dataWithHeader ? wireSize : 0)) {
+        stats.setLocalErrorCode(SOCKET_WRITE_ERROR);
+        stats.incrFailedAttempts();
+        return stats;
+      }
+      dataSent = dataWithHeader;
+    }
+    if (dataSent) {
+      written = wireSize;
+    } else if (zeroCopyFd >= 0) {
+      written = socket_->sendFile(zeroCopyFd, source->getOffset() + actualSize,
+                                  size);
+      if (written == size) {
+        source->markRead(written);
+      }
+    } else {
+      written = socket_->write(wireData, wireSize, /* retry writes */ true);
+      const int64_t mark = socket_->getZeroCopyWriteMark();
+      if (wireData != buffer || !pipelined) {
+        recordZeroCopyWrite(wireData);
+      } else if (!socket_->isZeroCopyWriteComplete(mark)) {
+        // the pipeline must not read into the chunk till it is sent
+        heldChunks_.push_back({readAheadPipeline_->holdBuffer(), mark});
+      }
+    }
+    if (addTime(TimeBreakdown::NETWORK, writeStartTime) >=
+        kBlockedWriteMicros) {
+      socket_->recordBlockedWrite();
+    }
+    sampleTcpInfo(socket_.get(), false);
     if (getThreadAbortCode() != OK) {
       WTLOG(ERROR) << "Transfer aborted during block transfer "
                    << socket_->getPort() << " " << source->getIdentifier();
@@ -385,17 +1050,35 @@ TransferStats SenderThread::sendOneByteSource(
       stats.incrFailedAttempts();
       return stats;
     }
-    if (written != size) {
-      WTLOG(ERROR) << "Write error " << written << " (" << size << ")"
+    if (written != wireSize) {
+      WTLOG(ERROR) << "Write error " << written << " (" << wireSize << ")"
                    << ". fd = " << socket_->getFd()
-                   << ". file = " << metadata.relPath
+                   << ". file = " << metadata.getRelPath()
                    << ". port = " << socket_->getPort();
       stats.setLocalErrorCode(SOCKET_WRITE_ERROR);
       stats.incrFailedAttempts();
       return stats;
     }
-    stats.addDataBytes(written);
-    actualSize += written;
+    stats.addDataBytes(size);
+    actualSize += size;
+    wireDataSize += wireSize;
+  }
+  if (!headerSent && actualSize == expectedSize) {
+    // no data, the header goes alone
+    encodeFooter();
+    if (!sendHeader(nullptr, 0)) {
+      stats.setLocalErrorCode(SOCKET_WRITE_ERROR);
+      stats.incrFailedAttempts();
+      return stats;
+    }
+  }
+  if (!waitForZeroCopyWrites(buf_, bufSize_)) {
+    // the thread buffer is also used outside of this method
+    WTLOG(ERROR) << "Zero copy write failure. fd = " << socket_->getFd()
+                 << ". file = " << metadata.getRelPath();
+    stats.setLocalErrorCode(SOCKET_WRITE_ERROR);
+    stats.incrFailedAttempts();
+    return stats;
   }
   if (actualSize != expectedSize) {
     // Can only happen if sender thread can not read complete source byte
@@ -403,8 +1086,8 @@ TransferStats SenderThread::sendOneByteSource(
     WTLOG(ERROR) << "UGH " << source->getIdentifier() << " " << expectedSize
                  << " " << actualSize;
     struct stat fileStat;
-    if (stat(metadata.fullPath.c_str(), &fileStat) != 0) {
-      WTPLOG(ERROR) << "stat failed on path " << metadata.fullPath;
+    if (stat(metadata.getFullPath().c_str(), &fileStat) != 0) {
+      WTPLOG(ERROR) << "stat failed on path " << metadata.getFullPath();
     } else {
       WTLOG(WARNING) << "file " << source->getIdentifier() << " previous size "
                      << metadata.size << " current size " << fileStat.st_size;
@@ -413,16 +1096,15 @@ TransferStats SenderThread::sendOneByteSource(
     stats.incrFailedAttempts();
     return stats;
   }
-  if (wdtParent_->getThrottler() && actualSize > 0) {
-    WDT_CHECK(totalThrottlerBytes == actualSize + byteSourceHeaderBytes)
-        << totalThrottlerBytes << " " << (actualSize + totalThrottlerBytes);
+  if (kThrottled && actualSize > 0) {
+    WDT_CHECK(totalThrottlerBytes == wireDataSize + byteSourceHeaderBytes)
+        << totalThrottlerBytes << " " << (wireDataSize + byteSourceHeaderBytes);
   }
-  if (footerType_ != NO_FOOTER) {
-    off = 0;
-    headerBuf[off++] = Protocol::FOOTER_CMD;
-    Protocol::encodeFooter(headerBuf, off, Protocol::kMaxFooter, checksum);
-    int toWrite = off;
-    written = socket_->write(headerBuf, toWrite);
+  if (kChecksum && footerLen == 0) {
+    // not sent along with the last chunk
+    encodeFooter();
+    int toWrite = footerLen;
+    written = socket_->write(footerBuf, toWrite);
     if (written != toWrite) {
       WTLOG(ERROR) << "Write mismatch " << written << " " << toWrite;
       stats.setLocalErrorCode(SOCKET_WRITE_ERROR);
@@ -431,17 +1113,62 @@ TransferStats SenderThread::sendOneByteSource(
     }
     stats.addHeaderBytes(toWrite);
   }
+  cancelGuard.dismiss();
   stats.setLocalErrorCode(OK);
   stats.incrNumBlocks();
   stats.addEffectiveBytes(stats.getHeaderBytes(), stats.getDataBytes());
   return stats;
 }
 
+int64_t SenderThread::encodeCompressedFrames(const char *data, int64_t size) {
+  // copied, std::min takes a reference and the constants have no definition
+  const int64_t maxFrameLen = Protocol::kMaxCompressionFrameLen;
+  const int64_t frameHeaderLen = Protocol::kCompressionFrameHeaderLen;
+  const int64_t numFrames = (size + maxFrameLen - 1) / maxFrameLen;
+  // frames are only sent compressed when they got smaller
+  const int64_t maxLen = size + numFrames * frameHeaderLen;
+  if ((int64_t)compressedBuf_.size() < maxLen) {
+    compressedBuf_.resize(maxLen);
+  }
+  char *dest = compressedBuf_.data();
+  int64_t off = 0;
+  for (int64_t start = 0; start < size; start += maxFrameLen) {
+    const int64_t rawLen = std::min(maxFrameLen, size - start);
+    int64_t wireLen = 0;
+    const char *compressed =
+        compressor_->compressFrame(data + start, rawLen, wireLen);
+    if (compressed == nullptr) {
+      compressed = data + start;
+      wireLen = rawLen;
+    }
+    folly::storeUnaligned<int32_t>(dest + off,
+                                   folly::Endian::little((int32_t)rawLen));
+    folly::storeUnaligned<int32_t>(dest + off + sizeof(int32_t),
+                                   folly::Endian::little((int32_t)wireLen));
+    off += frameHeaderLen;
+    memcpy(dest + off, compressed, wireLen);
+    off += wireLen;
+  }
+  return off;
+}
+
+void SenderThread::returnNextSource() {
+  if (!nextSource_) {
+    return;
+  }
+  WTVLOG(1) << "Returning read ahead source " << nextSource_->getIdentifier();
+  readAheadPipeline_->cancel();
+  nextSource_->close();
+  dirQueue_->returnToQueue(nextSource_);
+  nextSource_ = nullptr;
+}
+
 SenderState SenderThread::sendSizeCmd() {
   WTVLOG(1) << "entered SEND_SIZE_CMD state";
   int64_t off = 0;
   buf_[off++] = Protocol::SIZE_CMD;
-
+  // the size of a fed queue is only final once the feed ended
+  const bool finalSize = dirQueue_->fileDiscoveryFinished();
   Protocol::encodeSize(buf_, off, Protocol::kMaxSize,
                        dirQueue_->getTotalSize());
   int64_t written = socket_->write(buf_, off);
@@ -451,16 +1178,52 @@ SenderState SenderThread::sendSizeCmd() {
     return CHECK_FOR_ABORT;
   }
   threadStats_.addHeaderBytes(off);
-  totalSizeSent_ = true;
+  totalSizeSent_ = finalSize;
+  return SEND_BLOCKS;
+}
+
+SenderState SenderThread::sendManifestCmd() {
+  WTVLOG(1) << "entered SEND_MANIFEST_CMD state";
+  // copied, std::min takes a reference and kMaxManifestLen has no definition
+  const int64_t maxManifestLen = Protocol::kMaxManifestLen;
+  const int64_t maxLen = std::min<int64_t>(bufSize_, maxManifestLen);
+  std::vector<BlockDetails> entries;
+  dirQueue_->getManifestEntries(maxLen - Protocol::kManifestPrefixLen,
+                                entries);
+  if (entries.empty()) {
+    // taken by another thread
+    return SEND_BLOCKS;
+  }
+  int64_t off = 0;
+  buf_[off++] = Protocol::MANIFEST_CMD;
+  off += sizeof(int32_t);
+  WDT_CHECK(Protocol::encodeManifest(buf_, off, maxLen, entries));
+  int32_t littleEndianLen = folly::Endian::little(
+      (int32_t)(off - Protocol::kManifestPrefixLen));
+  folly::storeUnaligned<int32_t>(buf_ + 1, littleEndianLen);
+  int64_t written = socket_->write(buf_, off);
+  recordZeroCopyWrite(buf_);
+  if (written != off) {
+    WTLOG(ERROR) << "Socket write error " << off << " " << written;
+    threadStats_.setLocalErrorCode(SOCKET_WRITE_ERROR);
+    return CHECK_FOR_ABORT;
+  }
+  threadStats_.addHeaderBytes(off);
+  WTVLOG(1) << "Sent manifest of " << entries.size() << " files, " << off
+            << " bytes";
   return SEND_BLOCKS;
 }
 
 SenderState SenderThread::sendDoneCmd() {
   WTVLOG(1) << "entered SEND_DONE_CMD state";
+  if (!waitForZeroCopyWrites(buf_, bufSize_)) {
+    threadStats_.setLocalErrorCode(SOCKET_WRITE_ERROR);
+    return CHECK_FOR_ABORT;
+  }
 
   int64_t off = 0;
   buf_[off++] = Protocol::DONE_CMD;
-  auto pair = dirQueue_->getNumBlocksAndStatus();
+  auto pair = dirQueue_->getFinalNumBlocksAndStatus();
   int64_t numBlocksDiscovered = pair.first;
   ErrorCode transferStatus = pair.second;
   buf_[off++] = transferStatus;
@@ -496,7 +1259,20 @@ SenderState SenderThread::checkForAbort() {
 }
 
 SenderState SenderThread::readFileChunks() {
-  WTLOG(INFO) << "entered READ_FILE_CHUNKS state ";
+  if (!waiting_) {
+    WTLOG(INFO) << "entered READ_FILE_CHUNKS state ";
+  }
+  // parks till the receiver sends the chunks if running on a runtime
+  switch (waitForSocketReadable(options_.read_timeout_millis)) {
+    case WAIT_PARKED:
+      return READ_FILE_CHUNKS;
+    case WAIT_TIMED_OUT:
+      WTLOG(ERROR) << "timed out waiting for the file chunks";
+      threadStats_.setLocalErrorCode(SOCKET_READ_ERROR);
+      return CHECK_FOR_ABORT;
+    case WAIT_READY:
+      break;
+  }
   int64_t numRead = socket_->read(buf_, 1);
   if (numRead != 1) {
     WTLOG(ERROR) << "Socket read error 1 " << numRead;
@@ -547,9 +1323,15 @@ SenderState SenderThread::readFileChunks() {
   int64_t off = 0;
   int64_t bufSize, numFiles;
   Protocol::decodeChunksCmd(buf_, off, bufSize_, bufSize, numFiles);
-  WTLOG(INFO) << "File chunk list has " << numFiles
+  // a receiver still discovering its files streams them till an end marker
+  const bool streamed =
+      threadProtocolVersion_ >= Protocol::STREAMED_FILE_CHUNKS_VERSION &&
+      numFiles == Protocol::kStreamedNumFiles;
+  WTLOG(INFO) << "File chunk list has "
+              << (streamed ? std::string("streamed")
+                           : folly::to<std::string>(numFiles))
               << " entries and is broken in buffers of length " << bufSize;
-  if (bufSize < 0 || numFiles < 0) {
+  if (bufSize < 0 || (numFiles < 0 && !streamed)) {
     WLOG(ERROR) << "Decoded bogus size for file chunks list bufSize = "
                 << bufSize << " num files " << numFiles;
     threadStats_.setLocalErrorCode(PROTOCOL_ERROR);
@@ -559,7 +1341,7 @@ SenderState SenderThread::readFileChunks() {
   std::vector<FileChunksInfo> fileChunksInfoList;
   while (true) {
     int64_t numFileChunks = fileChunksInfoList.size();
-    if (numFileChunks > numFiles) {
+    if (!streamed && numFileChunks > numFiles) {
       // We should never be able to read more file chunks than mentioned in the
       // chunks cmd. Chunks cmd has buffer size used to transfer chunks and also
       // number of chunks. This chunks are read and parsed and added to
@@ -571,7 +1353,7 @@ SenderState SenderThread::readFileChunks() {
       threadStats_.setLocalErrorCode(PROTOCOL_ERROR);
       return END;
     }
-    if (numFileChunks == numFiles) {
+    if (!streamed && numFileChunks == numFiles) {
       break;
     }
     toRead = sizeof(int32_t);
@@ -581,8 +1363,20 @@ SenderState SenderThread::readFileChunks() {
       threadStats_.setLocalErrorCode(SOCKET_READ_ERROR);
       return CHECK_FOR_ABORT;
     }
-    toRead = folly::loadUnaligned<int32_t>(buf_);
-    toRead = folly::Endian::little(toRead);
+    toRead = folly::Endian::little(folly::loadUnaligned<int32_t>(buf_));
+    if (streamed && toRead == Protocol::kChunksStreamEnd) {
+      WTLOG(INFO) << "Received " << numFileChunks << " streamed file chunks";
+      break;
+    }
+    if (toRead < 0 || toRead > bufSize) {
+      WTLOG(ERROR) << "Bogus file chunks buffer length " << toRead;
+      threadStats_.setLocalErrorCode(PROTOCOL_ERROR);
+      return END;
+    }
+    if (toRead == 0) {
+      // keep alive while the receiver discovers more files
+      continue;
+    }
     numRead = socket_->read(chunkBuffer.get(), toRead);
     if (numRead != toRead) {
       WTLOG(ERROR) << "Socket read error " << toRead << " " << numRead;
@@ -593,7 +1387,8 @@ SenderState SenderThread::readFileChunks() {
     off = 0;
     // decode function below adds decoded file chunks to fileChunksInfoList
     bool success = Protocol::decodeFileChunksInfoList(
-        chunkBuffer.get(), off, toRead, fileChunksInfoList);
+        threadProtocolVersion_, chunkBuffer.get(), off, toRead,
+        fileChunksInfoList);
     if (!success) {
       WTLOG(ERROR) << "Unable to decode file chunks list";
       threadStats_.setLocalErrorCode(PROTOCOL_ERROR);
@@ -675,8 +1470,15 @@ ErrorCode SenderThread::readNextReceiverCmd() {
 }
 
 SenderState SenderThread::readReceiverCmd() {
-  WTVLOG(1) << "entered READ_RECEIVER_CMD state";
-
+  if (!waiting_) {
+    WTVLOG(1) << "entered READ_RECEIVER_CMD state";
+  }
+  // parks till the receiver sends its next cmd if running on a runtime. Once
+  // timed out, the read and its check of the unacked bytes block as without
+  // runtime
+  if (waitForSocketReadable(options_.read_timeout_millis) == WAIT_PARKED) {
+    return READ_RECEIVER_CMD;
+  }
   ErrorCode errCode = readNextReceiverCmd();
   if (errCode != OK) {
     threadStats_.setLocalErrorCode(errCode);
@@ -709,6 +1511,21 @@ SenderState SenderThread::readReceiverCmd() {
   if (cmd == Protocol::HEART_BEAT_CMD) {
     return READ_RECEIVER_CMD;
   }
+  if (cmd == Protocol::RATE_CMD &&
+      threadProtocolVersion_ >= Protocol::RECEIVER_RATE_VERSION) {
+    const int toRead = Protocol::kRateCmdLen - 1;
+    if (socket_->read(buf_ + 1, toRead) != toRead) {
+      WTLOG(ERROR) << "Failed to read rate cmd " << port_;
+      threadStats_.setLocalErrorCode(SOCKET_READ_ERROR);
+      return CONNECT;
+    }
+    errCode = processTargetRate(buf_ + 1);
+    if (errCode != OK) {
+      threadStats_.setLocalErrorCode(errCode);
+      return END;
+    }
+    return READ_RECEIVER_CMD;
+  }
   WTLOG(ERROR) << "Read unexpected receiver cmd " << cmd << " port " << port_;
   threadStats_.setLocalErrorCode(PROTOCOL_ERROR);
   return END;
@@ -859,21 +1676,37 @@ SenderState SenderThread::processAbortCmd() {
 }
 
 SenderState SenderThread::processVersionMismatch() {
-  WTLOG(INFO) << "entered PROCESS_VERSION_MISMATCH state ";
-  WDT_CHECK(threadStats_.getLocalErrorCode() == ABORT);
-  auto negotiationStatus = wdtParent_->getNegotiationStatus();
-  WDT_CHECK_NE(negotiationStatus, V_MISMATCH_FAILED)
-      << "Thread should have ended in case of version mismatch";
-  if (negotiationStatus == V_MISMATCH_RESOLVED) {
-    WTLOG(WARNING) << "Protocol version already negotiated, but "
-                      "transfer still aborted due to version mismatch";
-    return END;
-  }
-  WDT_CHECK_EQ(negotiationStatus, V_MISMATCH_WAIT);
-  // Need a barrier here to make sure all the negotiated protocol versions
-  // have been collected
   auto barrier = controller_->getBarrier(VERSION_MISMATCH_BARRIER);
-  barrier->execute();
+  if (!versionBarrierHit_) {
+    WTLOG(INFO) << "entered PROCESS_VERSION_MISMATCH state ";
+    WDT_CHECK(threadStats_.getLocalErrorCode() == ABORT);
+    auto negotiationStatus = wdtParent_->getNegotiationStatus();
+    WDT_CHECK_NE(negotiationStatus, V_MISMATCH_FAILED)
+        << "Thread should have ended in case of version mismatch";
+    if (negotiationStatus == V_MISMATCH_RESOLVED) {
+      WTLOG(WARNING) << "Protocol version already negotiated, but "
+                        "transfer still aborted due to version mismatch";
+      return END;
+    }
+    WDT_CHECK_EQ(negotiationStatus, V_MISMATCH_WAIT);
+    // Need a barrier here to make sure all the negotiated protocol versions
+    // have been collected
+    if (runtime_ == nullptr) {
+      barrier->execute();
+    } else {
+      barrier->hit();
+      versionBarrierHit_ = true;
+    }
+  }
+  if (versionBarrierHit_) {
+    if (!barrier->isComplete()) {
+      // parked, the other threads may need the runtime threads to reach the
+      // barrier
+      sleepFor(std::max(1, options_.abort_check_interval_millis));
+      return PROCESS_VERSION_MISMATCH;
+    }
+    versionBarrierHit_ = false;
+  }
   WTVLOG(1) << "cleared the protocol version barrier";
   auto execFunnel = controller_->getFunnel(VERSION_MISMATCH_FUNNEL);
   while (true) {
@@ -918,7 +1751,7 @@ SenderState SenderThread::processVersionMismatch() {
         break;
       }
       case FUNNEL_END: {
-        negotiationStatus = wdtParent_->getNegotiationStatus();
+        auto negotiationStatus = wdtParent_->getNegotiationStatus();
         WDT_CHECK_NE(negotiationStatus, V_MISMATCH_WAIT);
         if (negotiationStatus == V_MISMATCH_FAILED) {
           return END;
@@ -944,37 +1777,164 @@ void SenderThread::setFooterType() {
 }
 
 void SenderThread::start() {
-  Clock::time_point startTime = Clock::now();
+  if (TransferTracer::get().isEnabled()) {
+    TransferTracer::get().setThreadName("sender thread " +
+                                        std::to_string(threadIndex_));
+  }
+  if (!beginRun()) {
+    return;
+  }
+  // without runtime the states never wait, so this runs till the end
+  runStates();
+  endRun();
+}
 
+bool SenderThread::beginRun() {
+  runStartTime_ = Clock::now();
   if (buf_ == nullptr) {
     WTLOG(ERROR) << "Unable to allocate buffer";
     threadStats_.setLocalErrorCode(MEMORY_ALLOCATION_ERROR);
-    return;
+    return false;
   }
 
   setFooterType();
+  chooseSendLoop();
+
+  zeroCopySend_ = options_.zero_copy_send && footerType_ != CHECKSUM_FOOTER &&
+                  (!wdtParent_->transferRequest_.encryptionData.isSet() ||
+                   options_.ktls);
+  if (zeroCopySend_ && !WdtSocket::isSendFileSupported()) {
+    WTLOG(WARNING) << "sendfile is not supported, not using zero copy send";
+    zeroCopySend_ = false;
+  }
+  if (zeroCopySend_ && (options_.rdma_transport || options_.shm_transport)) {
+    // sendfile writes to the tcp connection
+    WTLOG(WARNING) << "rdma/shm transport, not using zero copy send";
+    zeroCopySend_ = false;
+  }
+
+  // copied, std::min takes a reference and kMaxFileBatchLen has no definition
+  const int64_t maxFileBatchLen = Protocol::kMaxFileBatchLen;
+  fileBatchLen_ =
+      std::min<int64_t>(options_.small_file_batch_bytes, maxFileBatchLen);
+  if (fileBatchLen_ > 0 &&
+      fileBatchLen_ < Protocol::kFileBatchPrefixLen + Protocol::kMaxHeader +
+                          options_.small_file_max_bytes) {
+    WTLOG(WARNING) << "small_file_batch_bytes " << fileBatchLen_
+                   << " too small for files of " << options_.small_file_max_bytes
+                   << " bytes, not batching small files";
+    fileBatchLen_ = 0;
+  }
+
+  if (options_.read_ahead_buffers > 0 && !readAheadPipeline_ &&
+      !zeroCopySend_) {
+    if (options_.read_ahead_buffers < 2) {
+      WTLOG(WARNING) << "read_ahead_buffers " << options_.read_ahead_buffers
+                     << " is less than 2, not using read ahead";
+    } else if (threadCtx_->getNumBuffers() == 1 &&
+               !threadCtx_->addBuffers(options_.read_ahead_buffers)) {
+      WTLOG(ERROR) << "Unable to allocate read ahead buffers";
+      threadStats_.setLocalErrorCode(MEMORY_ALLOCATION_ERROR);
+      return false;
+    } else {
+      readAheadPipeline_ = std::make_unique<ReadAheadPipeline>(*threadCtx_);
+    }
+  }
 
   controller_->executeAtStart([&]() { wdtParent_->startNewTransfer(); });
-  SenderState state = CONNECT;
+  state_ = CONNECT;
+  waiting_ = false;
+  versionBarrierHit_ = false;
+  connectAttempts_ = 0;
+  waitingForTurn_ = (connectionScaler_ != nullptr);
+  return true;
+}
 
-  while (state != END) {
+bool SenderThread::runStates() {
+  if (waitingForTurn_) {
+    // parked till the scaler needs this connection
+    while (getThreadAbortCode() == OK) {
+      if (runtime_ == nullptr) {
+        if (connectionScaler_->waitForTurn(
+                threadIndex_, options_.abort_check_interval_millis)) {
+          break;
+        }
+        continue;
+      }
+      if (connectionScaler_->waitForTurn(threadIndex_, 0)) {
+        break;
+      }
+      if (sleepFor(std::max(1, options_.abort_check_interval_millis)) ==
+          WAIT_PARKED) {
+        waitRequested_ = false;
+        return false;
+      }
+    }
+    waiting_ = false;
+    waitingForTurn_ = false;
+    if (!connectionScaler_->isActive(threadIndex_)) {
+      WTLOG(INFO) << "Connection not needed, not connecting";
+      state_ = END;
+    }
+  }
+
+  while (state_ != END) {
     ErrorCode abortCode = getThreadAbortCode();
     if (abortCode != OK) {
-      WTLOG(ERROR) << "Transfer aborted " << errorCodeToStr(abortCode);
-      threadStats_.setLocalErrorCode(ABORT);
+      if (state_ != PROCESS_VERSION_MISMATCH ||
+          abortCode != VERSION_MISMATCH) {
+        WTLOG(ERROR) << "Transfer aborted " << errorCodeToStr(abortCode);
+        threadStats_.setLocalErrorCode(ABORT);
+        // a parked state is abandoned
+        waiting_ = false;
+        connectAttempts_ = 0;
+      }
       if (abortCode == VERSION_MISMATCH) {
-        state = PROCESS_VERSION_MISMATCH;
+        state_ = PROCESS_VERSION_MISMATCH;
       } else {
         break;
       }
     }
-    state = (this->*stateMap_[state])();
+    {
+      TraceSpan span(kSenderStateNames[state_]);
+      const SenderState prevState = state_;
+      state_ = (this->*stateMap_[state_])();
+      if (settingsCorked_ && prevState != SEND_SETTINGS && socket_) {
+        // the settings went out with the first block, or there is none
+        socket_->setCork(false);
+        settingsCorked_ = false;
+      }
+    }
+    if (state_ != SEND_BLOCKS && state_ != SEND_SIZE_CMD) {
+      returnNextSource();
+    }
+    if (waitRequested_) {
+      waitRequested_ = false;
+      return false;
+    }
+    waiting_ = false;
+  }
+  return true;
+}
+
+void SenderThread::endRun() {
+  returnNextSource();
+  dirQueue_->returnInFlightSource(threadCtx_.get());
+  readAheadPipeline_ = nullptr;
+  FdCache *fdCache = threadCtx_->getFdCache();
+  if (fdCache != nullptr) {
+    fdCache->clear();
   }
 
   EncryptionType encryptionType =
       (socket_ ? socket_->getEncryptionType() : ENC_NONE);
   threadStats_.setEncryptionType(encryptionType);
-  double totalTime = durationSeconds(Clock::now() - startTime);
+  sampleTcpInfo(socket_.get(), true);
+  // Important to delete the socket before the thread dies for sub class
+  // of clientsocket which have thread local data
+  resetSocket();
+  double totalTime = durationSeconds(Clock::now() - runStartTime_);
+  threadCtx_->getTimeBreakdown().setTotalMicros(totalTime * kMicroToSec);
   WTLOG(INFO) << "Port " << port_ << " done. " << threadStats_
               << " Total throughput = "
               << threadStats_.getEffectiveTotalBytes() / totalTime / kMbToB
@@ -982,13 +1942,114 @@ void SenderThread::start() {
 
   ThreadTransferHistory &transferHistory = getTransferHistory();
   transferHistory.markNotInUse();
+  if (connectionScaler_) {
+    connectionScaler_->threadDone(threadIndex_);
+  }
   controller_->deRegisterThread(threadIndex_);
   controller_->executeAtEnd([&]() { wdtParent_->endCurTransfer(); });
-  // Important to delete the socket before the thread dies for sub class
-  // of clientsocket which have thread local data
-  socket_ = nullptr;
+}
+
+void SenderThread::startThread() {
+  runtime_ = wdtParent_->runtime_.get();
+  if (runtime_ == nullptr) {
+    WdtThread::startThread();
+    return;
+  }
+  WDT_CHECK(!startedOnRuntime_) << "Sender thread already running "
+                                << threadIndex_ << " " << getPort();
+  WDT_CHECK_EQ(controller_->getState(threadIndex_), RUNNING);
+  startedOnRuntime_ = true;
+  runStarted_ = false;
+  runtime_->start(this, wdtParent_->runtimeGroup_);
+}
+
+ErrorCode SenderThread::finish() {
+  if (!startedOnRuntime_) {
+    return WdtThread::finish();
+  }
+  runtime_->waitForEnd(this);
+  startedOnRuntime_ = false;
+  return OK;
+}
 
-  return;
+bool SenderThread::runSlice(Wait &wait) {
+  if (!runStarted_) {
+    runStarted_ = true;
+    if (!beginRun()) {
+      return true;
+    }
+  }
+  if (!runStates()) {
+    wait = std::move(wait_);
+    wait_ = Wait();
+    return false;
+  }
+  endRun();
+  return true;
+}
+
+SenderThread::WaitResult SenderThread::waitForReadable(
+    const std::vector<int> &fds, int timeoutMillis) {
+  if (runtime_ == nullptr) {
+    return WAIT_READY;
+  }
+  const auto now = Clock::now();
+  if (!waiting_) {
+    waiting_ = true;
+    waitDeadline_ = now + std::chrono::milliseconds(timeoutMillis);
+  }
+  std::vector<struct pollfd> pollFds;
+  for (int fd : fds) {
+    pollFds.push_back({fd, POLLIN, 0});
+  }
+  if (!pollFds.empty() && poll(pollFds.data(), pollFds.size(), 0) > 0) {
+    waiting_ = false;
+    return WAIT_READY;
+  }
+  if (now >= waitDeadline_) {
+    waiting_ = false;
+    return WAIT_TIMED_OUT;
+  }
+  int sliceMillis = durationMillis(waitDeadline_ - now) + 1;
+  if (options_.abort_check_interval_millis > 0) {
+    sliceMillis = std::min(sliceMillis, options_.abort_check_interval_millis);
+  }
+  wait_.fds = fds;
+  wait_.timeoutMillis = sliceMillis;
+  waitRequested_ = true;
+  return WAIT_PARKED;
+}
+
+SenderThread::WaitResult SenderThread::waitForSocketReadable(
+    int timeoutMillis) {
+  if (runtime_ != nullptr && socket_->isReadable()) {
+    // data the transport already received does not wake up its poll fd
+    waiting_ = false;
+    return WAIT_READY;
+  }
+  return waitForReadable({socket_->getPollFd()}, timeoutMillis);
+}
+
+SenderThread::WaitResult SenderThread::sleepFor(int64_t millis) {
+  if (runtime_ == nullptr) {
+    /* sleep override */ usleep(millis * 1000);
+    return WAIT_TIMED_OUT;
+  }
+  return waitForReadable({}, millis);
+}
+
+void SenderThread::yieldToOtherPorts() {
+  if (runtime_ == nullptr || !socket_) {
+    return;
+  }
+  wait_ = Wait();
+  struct pollfd pollFd = {socket_->getPollFd(), POLLOUT, 0};
+  if (pollFd.fd >= 0 && poll(&pollFd, 1, 0) == 0) {
+    // writing the next source would block the runtime thread
+    wait_.writeFds.push_back(pollFd.fd);
+    wait_.timeoutMillis = std::max(1, options_.abort_check_interval_millis);
+  }
+  waitRequested_ = true;
 }
 
 int SenderThread::getPort() const {
@@ -1008,6 +2069,14 @@ void SenderThread::reset() {
   threadStats_.setLocalErrorCode(OK);
 }
 
+SenderThread::~SenderThread() {
+  if (startedOnRuntime_) {
+    WTLOG(INFO) << "Sender thread still running on the runtime while being "
+                << "destructed";
+    finish();
+  }
+}
+
 ErrorCode SenderThread::getThreadAbortCode() {
   ErrorCode globalAbortCode = wdtParent_->getCurAbortCode();
   if (globalAbortCode != OK) {
@@ -10,8 +10,13 @@
 #include <folly/Conv.h>
 #include <wdt/Sender.h>
 #include <wdt/WdtThread.h>
+#include <wdt/util/BlockChecksum.h>
+#include <wdt/util/BlockCompressor.h>
 #include <wdt/util/ClientSocket.h>
+#include <wdt/util/ReadAheadPipeline.h>
+#include <wdt/util/ReceiverRuntime.h>
 #include <wdt/util/ThreadTransferHistory.h>
+#include <deque>
 #include <thread>
 
 namespace facebook {
@@ -27,6 +32,7 @@ enum SenderState {
   SEND_BLOCKS,
   SEND_DONE_CMD,
   SEND_SIZE_CMD,
+  SEND_MANIFEST_CMD,
   CHECK_FOR_ABORT,
   READ_FILE_CHUNKS,
   READ_RECEIVER_CMD,
@@ -45,7 +51,7 @@ enum SenderState {
  * All the sender threads share bunch of modules like directory queue,
  * throttler, threads controller etc
  */
-class SenderThread : public WdtThread {
+class SenderThread : public WdtThread, public RuntimeTask {
  public:
   /// Identifers for the barriers used in the thread
   enum SENDER_BARRIERS { VERSION_MISMATCH_BARRIER, NUM_BARRIERS };
@@ -76,10 +82,12 @@ class SenderThread : public WdtThread {
   SenderThread(Sender *sender, int threadIndex, int32_t port,
                ThreadsController *threadsController)
       : WdtThread(sender->options_, threadIndex, port,
-                  sender->getProtocolVersion(), threadsController),
+                  sender->getProtocolVersion(), threadsController,
+                  sender->threadAffinity_.get()),
         wdtParent_(sender),
         dirQueue_(sender->dirQueue_.get()),
-        transferHistoryController_(sender->transferHistoryController_.get()) {
+        transferHistoryController_(sender->transferHistoryController_.get()),
+        connectionScaler_(sender->connectionScaler_.get()) {
     controller_->registerThread(threadIndex_);
     transferHistoryController_->addThreadHistory(port_, threadStats_);
     threadAbortChecker_ = std::make_unique<SocketAbortChecker>(this);
@@ -106,9 +114,18 @@ class SenderThread : public WdtThread {
   /// receive of global checkpoint
   ErrorCode getThreadAbortCode();
 
+  /// Runs the state machine on the runtime of the sender if it has one, else
+  /// on a thread of its own
+  void startThread() override;
+
+  /// Waits for the state machine to end
+  ErrorCode finish() override;
+
+  /// Runs the state machine till it ends or has to wait (@see RuntimeTask)
+  bool runSlice(Wait &wait) override;
+
   /// Destructor of the sender thread
-  ~SenderThread() override {
-  }
+  ~SenderThread() override;
 
  private:
   /// Overloaded operator for printing thread info
@@ -124,6 +141,102 @@ class SenderThread : public WdtThread {
   /// The main entry point of the thread
   void start() override;
 
+  /**
+   * Sets up the thread for the transfer, before the first state
+   *
+   * @return    false if the thread can't run, it ends right away
+   */
+  bool beginRun();
+
+  /**
+   * Runs states from state_ till END
+   *
+   * @return    false if a state asked to wait for the runtime, it is run
+   *            again on the next call
+   */
+  bool runStates();
+
+  /// cleanup once the state machine has ended
+  void endRun();
+
+  /// result of waitForReadable()
+  enum WaitResult {
+    WAIT_READY,      // an fd is readable, or not running on a runtime
+    WAIT_PARKED,     // the state has to return itself to wait for the runtime
+    WAIT_TIMED_OUT,  // nothing became readable within the timeout
+  };
+
+  /**
+   * Lets a state wait, without holding a thread of the runtime, for one of
+   * the fds to be readable. The state returns itself while parked and calls
+   * this again when it is run next, with the same arguments, till the result
+   * is not WAIT_PARKED. The wait is sliced at the abort check interval so
+   * that aborts and changes of the other threads are seen.
+   *
+   * @param fds             fds to wait for, empty to only wait for time
+   * @param timeoutMillis   timeout of the wait
+   */
+  WaitResult waitForReadable(const std::vector<int> &fds, int timeoutMillis);
+
+  /// waitForReadable() on the connection of the socket
+  WaitResult waitForSocketReadable(int timeoutMillis);
+
+  /**
+   * Sleeps, or parks the state for that long on the runtime
+   *
+   * @return    WAIT_PARKED, or WAIT_TIMED_OUT once the time has passed
+   */
+  WaitResult sleepFor(int64_t millis);
+
+  /**
+   * Ends the slice of the runtime between two sources, so that the other
+   * ports run. Parks till the socket is writable if its buffer is full. No-op
+   * if not on a runtime
+   */
+  void yieldToOtherPorts();
+
+  /// runtime the state machine runs on, nullptr if on its own thread
+  ReceiverRuntime *runtime_{nullptr};
+
+  /// whether the state machine was started on runtime_ and not finished
+  bool startedOnRuntime_{false};
+
+  /// whether the first slice on the runtime set up the thread
+  bool runStarted_{false};
+
+  /// current state, kept across the slices run on the runtime
+  SenderState state_{CONNECT};
+
+  /// whether the thread waits for the connection scaler to need it before
+  /// connecting
+  bool waitingForTurn_{false};
+
+  /// whether state_ is parked in waitForReadable()
+  bool waiting_{false};
+
+  /// whether PROCESS_VERSION_MISMATCH hit the barrier and waits for it to
+  /// clear, on the runtime
+  bool versionBarrierHit_{false};
+
+  /// end of the current wait of waitForReadable()
+  Clock::time_point waitDeadline_;
+
+  /// set by waitForReadable() when the state has to be parked
+  bool waitRequested_{false};
+
+  /// what the parked state waits for
+  Wait wait_;
+
+  /// when the state machine started
+  Clock::time_point runStartTime_;
+
+  /// attempts of connectToReceiver() on the current socket, 0 before the
+  /// first
+  int connectAttempts_{0};
+
+  /// when the first attempt of connectToReceiver() was made
+  Clock::time_point connectStartTime_;
+
   /// Get the local transfer history
   ThreadTransferHistory &getTransferHistory() {
     return transferHistoryController_->getTransferHistory(port_);
@@ -133,7 +246,8 @@ class SenderThread : public WdtThread {
    * tries to connect to the receiver
    * Previous states : Almost all states(in case of network errors, all states
    *                   move to this state)
-   * Next states : SEND_SETTINGS(if there is no previous error)
+   * Next states : SEND_SETTINGS(if there is no previous error or with
+   *               fast_reconnect)
    *               READ_LOCAL_CHECKPOINT(if there is previous error)
    *               END(failed)
    */
@@ -142,11 +256,13 @@ class SenderThread : public WdtThread {
    * tries to read local checkpoint and return unacked sources to queue. If the
    * checkpoint value is -1, then we know previous attempt to send DONE had
    * failed. So, we move to READ_RECEIVER_CMD state.
-   * Previous states : CONNECT
+   * Previous states : CONNECT,
+   *                   SEND_SETTINGS(fast reconnect)
    * Next states : CONNECT(read failure),
    *               END(protocol error or global checkpoint found),
    *               READ_RECEIVER_CMD(if checkpoint is -1),
-   *               SEND_SETTINGS(success)
+   *               SEND_SETTINGS(success),
+   *               SEND_BLOCKS/READ_FILE_CHUNKS(success, fast reconnect)
    */
   SenderState readLocalCheckPoint();
   /**
@@ -154,6 +270,7 @@ class SenderThread : public WdtThread {
    * Previous states : READ_LOCAL_CHECKPOINT,
    *                   CONNECT
    * Next states : SEND_BLOCKS(success),
+   *               READ_LOCAL_CHECKPOINT(success, fast reconnect),
    *               CONNECT(failure)
    */
   SenderState sendSettings();
@@ -184,6 +301,14 @@ class SenderThread : public WdtThread {
    *               SEND_BLOCKS(success)
    */
   SenderState sendSizeCmd();
+  /**
+   * sends the files queued since the last manifest cmd of any thread, so that
+   * the receiver prepares them before their blocks arrive
+   * Previous states : SEND_BLOCKS
+   * Next states : CHECK_FOR_ABORT(failure),
+   *               SEND_BLOCKS(success)
+   */
+  SenderState sendManifestCmd();
   /**
    * checks to see if the receiver has sent ABORT or not
    * Previous states : SEND_BLOCKS,
@@ -270,18 +395,131 @@ class SenderThread : public WdtThread {
    */
   ErrorCode readAndVerifySpuriousCheckpoint();
 
-  /// General utility used by sender threads to connect to receiver
-  std::unique_ptr<ClientSocket> connectToReceiver(
-      int port, IAbortChecker const *abortChecker, ErrorCode &errCode);
+  /// Creates the socket of a connection to the receiver, not connected yet
+  std::unique_ptr<ClientSocket> makeSocket(int port);
+
+  /**
+   * Connects socket_ to the receiver, with max_retries attempts and a sleep
+   * between them. On a runtime the sleeps park CONNECT, which calls this
+   * again when run next
+   *
+   * @param errCode   set once connected or failed: OK, CONN_ERROR or ABORT
+   *
+   * @return          false if parked
+   */
+  bool connectToReceiver(ErrorCode &errCode);
 
   /// Method responsible for sending one source to the destination
   TransferStats sendOneByteSource(const std::unique_ptr<ByteSource> &source,
                                   ErrorCode transferStatus);
 
+  /**
+   * sendOneByteSource() specialized on the features of the transfer checked
+   * for every chunk, so that the transfers without them don't branch on
+   * them. Chosen by chooseSendLoop()
+   *
+   * @tparam kChecksum    whether the blocks are sent with a checksum footer
+   * @tparam kThrottled   whether the transfer is throttled
+   */
+  template <bool kChecksum, bool kThrottled>
+  TransferStats sendOneByteSourceImpl(
+      const std::unique_ptr<ByteSource> &source, ErrorCode transferStatus);
+
+  /// picks the specialization of sendOneByteSource() for the footer type and
+  /// throttling of the transfer, once they are known. Picked again whenever
+  /// the receiver starts or stops advertising a rate
+  void chooseSendLoop();
+
+  typedef TransferStats (SenderThread::*SendFunction)(
+      const std::unique_ptr<ByteSource> &source, ErrorCode transferStatus);
+
+  /// specialization of sendOneByteSource() used by the thread
+  SendFunction sendOneByteSourceFn_{nullptr};
+
+  /// whether sendOneByteSourceFn_ is a throttled specialization
+  bool sendLoopThrottled_{false};
+
+  /**
+   * Sends the given small source along with as many other small sources from
+   * the queue as fit in one file batch cmd.
+   * Previous states : SEND_BLOCKS
+   * Next states : SEND_BLOCKS(success),
+   *               END(global checkpoint received),
+   *               CHECK_FOR_ABORT(failure)
+   */
+  SenderState sendFileBatch(std::unique_ptr<ByteSource> firstSource,
+                            ErrorCode transferStatus);
+
+  /**
+   * Accounts for a source once it has been sent (or failed to be), and adds it
+   * to the transfer history
+   *
+   * @return    false if a global checkpoint was received for the thread
+   */
+  bool finishSource(std::unique_ptr<ByteSource> &source,
+                    const TransferStats &transferStats);
+
+  /**
+   * Splits a chunk of the data of a compressed block into frames, compressed
+   * when worth it, in compressedBuf_
+   *
+   * @param data    chunk to send
+   * @param size    length of the chunk
+   *
+   * @return        length of the frames
+   */
+  int64_t encodeCompressedFrames(const char *data, int64_t size);
+
+  /// @return   block details of the header sent for the source
+  static BlockDetails getBlockDetails(const ByteSource &source);
+
+  /// returns the source read ahead, if any, back to the queue
+  void returnNextSource();
+
+  /// reports the progress of the connection to the scaler, at most a few
+  /// times per scaling interval
+  void reportToScaler();
+
+  /**
+   * Records that the last socket write was made from a buffer, so that it is
+   * not modified before its zero copy writes are complete
+   */
+  void recordZeroCopyWrite(const char *buffer);
+
+  /**
+   * Waits for the zero copy writes made from [buffer, buffer + size), before
+   * it is modified
+   *
+   * @return    false in case of error or abort
+   */
+  bool waitForZeroCopyWrites(const char *buffer, int64_t size);
+
+  /**
+   * Gives back to the read ahead pipeline the held chunks whose zero copy
+   * writes are complete, waiting for the oldest ones if more than maxHeld
+   * are held
+   *
+   * @return    false in case of error or abort
+   */
+  bool releaseHeldChunks(size_t maxHeld);
+
+  /**
+   * Destroys the socket, after adding its zero copy write counters to the
+   * thread stats. Its pending zero copy writes are not waited for anymore
+   */
+  void resetSocket();
+
   /// checks to see if heart-beat is enabled, and if it is time to read
   /// heart-beats, and if yes, reads heart-beats
   ErrorCode readHeartBeats();
 
+  /**
+   * Decodes the rate of a rate cmd and applies it
+   *
+   * @param buf   encoded rate, following the cmd byte
+   */
+  ErrorCode processTargetRate(char *buf);
+
   /// mapping from sender states to state functions
   static const StateFunction stateMap_[];
 
@@ -302,6 +540,17 @@ class SenderThread : public WdtThread {
   /// number of consecutive reconnects without any progress
   int numReconnectWithoutProgress_{0};
 
+  /// whether the local checkpoint is read after sending the settings, on
+  /// fast reconnects
+  bool readCheckpointAfterSettings_{false};
+
+  /// state after reading the local checkpoint sent for after the settings
+  SenderState stateAfterCheckpoint_{SEND_BLOCKS};
+
+  /// whether the socket is corked for the settings to go out with the first
+  /// block
+  bool settingsCorked_{false};
+
   /// Point to the directory queue of parent sender
   DirectorySourceQueue *dirQueue_;
 
@@ -310,6 +559,63 @@ class SenderThread : public WdtThread {
 
   /// Thread history controller shared across all threads
   TransferHistoryController *transferHistoryController_;
+
+  /// Connection scaler shared across all threads, nullptr if not auto scaling
+  ConnectionScaler *connectionScaler_;
+
+  /// Time after which the next progress is reported to the scaler
+  Clock::time_point nextScalerReportTime_;
+
+  /// Time after which the socket is looked at again for heart-beats
+  Clock::time_point nextHeartBeatCheckTime_;
+
+  /// Background reader overlapping disk reads with socket writes, nullptr if
+  /// read ahead is disabled
+  std::unique_ptr<ReadAheadPipeline> readAheadPipeline_{nullptr};
+
+  /// Source read ahead by the pipeline, to be sent next
+  std::unique_ptr<ByteSource> nextSource_{nullptr};
+
+  /// Queue status returned along with nextSource_
+  ErrorCode nextSourceStatus_{OK};
+
+  /// whether file data is sent using sendfile instead of read + write
+  bool zeroCopySend_{false};
+
+  /// buffer with zero copy writes possibly in flight
+  struct ZeroCopyBuffer {
+    const char *data;
+    /// socket write mark after the last write made from the buffer
+    int64_t mark;
+  };
+
+  /// buffers outside of the pipeline with zero copy writes in flight
+  std::vector<ZeroCopyBuffer> zeroCopyBuffers_;
+
+  /// chunks held by the pipeline till their zero copy writes complete, oldest
+  /// first
+  std::deque<ZeroCopyBuffer> heldChunks_;
+
+  /// max length of a file batch cmd, 0 if small files are not batched
+  int64_t fileBatchLen_{0};
+
+  /// buffer the file batch cmds are built into
+  std::vector<char> fileBatchBuf_;
+
+  /// compression of the blocks on the current connection
+  CompressionType compressionType_{COMP_NONE};
+
+  /// compressor of the thread, created once compression is first used
+  std::unique_ptr<BlockCompressor> compressor_{nullptr};
+
+  /// buffer the frames of the compressed blocks are built into
+  std::vector<char> compressedBuf_;
+
+  /// algorithm of the checksum footers on the current connection
+  ChecksumType checksumType_{CHECKSUM_CRC32C};
+
+  /// checksum of the block being sent, of checksumType_
+  std::unique_ptr<BlockChecksum> checksummer_{nullptr};
 };
 }
 }
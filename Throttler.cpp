@@ -15,19 +15,25 @@ namespace wdt {
 
 // Constants for different calculations
 const int64_t kMillisecsPerSec = 1000;
+const double kNanosPerSec = 1e9;
 const double kPeakMultiplier = 1.2;
 const int kBucketMultiplier = 2;
 const double kTimeMultiplier = 0.25;
 
+/// generations are unique across the throttlers, so that a credit leased from
+/// a throttler is never taken for one of another throttler
+static std::atomic<int64_t> nextGeneration{1};
+
 std::shared_ptr<Throttler> Throttler::makeThrottler(
-    const ThrottlerOptions& options) {
+    const ThrottlerOptions& options, std::shared_ptr<Throttler> parent) {
   double avgRatePerSec = options.avg_rate_per_sec;
   double peakRatePerSec = options.max_rate_per_sec;
   double bucketLimit = options.throttler_bucket_limit;
   int64_t singleRequestLimit = options.single_request_limit;
-  Throttler* throttler =
-      new Throttler(avgRatePerSec, peakRatePerSec, bucketLimit,
-                    singleRequestLimit, options.throttler_log_time_millis);
+  Throttler* throttler = new Throttler(
+      avgRatePerSec, peakRatePerSec, bucketLimit, singleRequestLimit,
+      options.throttler_log_time_millis, options.lease_size);
+  throttler->parent_ = std::move(parent);
   return std::shared_ptr<Throttler>(throttler);
 }
 
@@ -48,32 +54,33 @@ void Throttler::configureOptions(double& avgRatePerSec, double& peakRatePerSec,
 
 Throttler::Throttler(double avgRatePerSec, double peakRatePerSec,
                      double bucketLimit, int64_t singleRequestLimit,
-                     int64_t throttlerLogTimeMillis)
+                     int64_t throttlerLogTimeMillis, int64_t leaseSize)
     : avgRatePerSec_(avgRatePerSec) {
   bucketRatePerSec_ = peakRatePerSec;
-  tokenBucketLimit_ = kTimeMultiplier * kBucketMultiplier * bucketRatePerSec_;
+  tokenBucketLimit_ = kTimeMultiplier * kBucketMultiplier * peakRatePerSec;
   /* We keep the number of tokens generated as zero initially
    * It could be argued that we keep this filled when we created the
    * bucket. However the startTime is passed in this case and the hope is
    * that we will have enough number of tokens by the time we send the data
    */
-  tokenBucket_ = 0;
+  resetState();
   if (bucketLimit > 0) {
     tokenBucketLimit_ = bucketLimit;
   }
   if (avgRatePerSec > 0) {
-    WLOG(INFO) << "Average rate " << avgRatePerSec_;
+    WLOG(INFO) << "Average rate " << avgRatePerSec;
   } else {
     WLOG(INFO) << "No average rate specified";
   }
-  if (bucketRatePerSec_ > 0) {
-    WLOG(INFO) << "Peak rate " << bucketRatePerSec_ << ".  Bucket limit "
-               << tokenBucketLimit_;
+  if (peakRatePerSec > 0) {
+    WLOG(INFO) << "Peak rate " << peakRatePerSec << ".  Bucket limit "
+               << tokenBucketLimit_.load();
   } else {
     WLOG(INFO) << "No peak rate specified";
   }
   WDT_CHECK_GT(singleRequestLimit, 0);
   singleRequestLimit_ = singleRequestLimit;
+  leaseSize_ = leaseSize;
   throttlerLogTimeMillis_ = throttlerLogTimeMillis;
 }
 
@@ -102,7 +109,21 @@ void Throttler::setThrottlerRates(const ThrottlerOptions& options) {
   setThrottlerRates(avgRatePerSec, peakRatePerSec, bucketLimit);
 }
 
+void Throttler::setAvgRatePerSec(double avgRatePerSec) {
+  folly::SpinLockGuard lock(throttlerMutex_);
+  resetState();
+  WVLOG(1) << "Updating the average rate to " << avgRatePerSec;
+  const double peakRatePerSec = kPeakMultiplier * avgRatePerSec;
+  avgRatePerSec_ = avgRatePerSec;
+  bucketRatePerSec_ = peakRatePerSec;
+  tokenBucketLimit_ = kTimeMultiplier * kBucketMultiplier * peakRatePerSec;
+}
+
 void Throttler::limit(ThreadCtx& threadCtx, int64_t deltaProgress) {
+  if (leaseSize_ > 0) {
+    limitWithLease(threadCtx, deltaProgress);
+    return;
+  }
   limitInternal(&threadCtx, deltaProgress);
 }
 
@@ -110,6 +131,26 @@ void Throttler::limit(int64_t deltaProgress) {
   limitInternal(nullptr, deltaProgress);
 }
 
+void Throttler::limitWithLease(ThreadCtx& threadCtx, int64_t deltaProgress) {
+  ThreadCtx::ThrottlerCredit& credit = threadCtx.getThrottlerCredit();
+  const int64_t generation = generation_.load();
+  if (credit.generation != generation) {
+    // leased from another throttler or before a reset, the rates it was
+    // paid at don't apply anymore
+    credit.generation = generation;
+    credit.tokens = 0;
+  }
+  if (credit.tokens >= deltaProgress) {
+    credit.tokens -= deltaProgress;
+    return;
+  }
+  // the lease is paid upfront, the thread sleeps for all of it now
+  const int64_t missing = deltaProgress - credit.tokens;
+  const int64_t toLease = (missing + leaseSize_ - 1) / leaseSize_ * leaseSize_;
+  limitInternal(&threadCtx, toLease);
+  credit.tokens += toLease - deltaProgress;
+}
+
 void Throttler::limitInternal(ThreadCtx* threadCtx, int64_t deltaProgress) {
   const int kLogInterval = 100;
   int64_t numThrottled = 0;
@@ -125,6 +166,10 @@ void Throttler::limitInternal(ThreadCtx* threadCtx, int64_t deltaProgress) {
                  << deltaProgress << ", num-throttled: " << numThrottled;
     }
   }
+  if (parent_) {
+    // the siblings share the rates of the parent
+    parent_->limitInternal(threadCtx, deltaProgress);
+  }
 }
 
 void Throttler::limitSingleRequest(ThreadCtx* threadCtx,
@@ -132,7 +177,7 @@ void Throttler::limitSingleRequest(ThreadCtx* threadCtx,
   WDT_CHECK_LE(deltaProgress, singleRequestLimit_);
   std::chrono::time_point<Clock> now = Clock::now();
   double sleepTimeSeconds = calculateSleep(deltaProgress, now);
-  if (throttlerLogTimeMillis_ > 0) {
+  if (throttlerLogTimeMillis_.load() > 0) {
     printPeriodicLogs(now, deltaProgress);
   }
   if (sleepTimeSeconds <= 0) {
@@ -142,8 +187,14 @@ void Throttler::limitSingleRequest(ThreadCtx* threadCtx,
     sleep(sleepTimeSeconds);
     return;
   }
-  PerfStatCollector statCollector(*threadCtx, PerfStatReport::THROTTLER_SLEEP);
-  sleep(sleepTimeSeconds);
+  const Clock::time_point sleepStartTime = Clock::now();
+  {
+    PerfStatCollector statCollector(
+        *threadCtx, PerfStatReport::THROTTLER_SLEEP, THROTTLE_SLEEP);
+    sleep(sleepTimeSeconds);
+  }
+  threadCtx->getTimeBreakdown().add(
+      TimeBreakdown::THROTTLE, durationMicros(Clock::now() - sleepStartTime));
 }
 
 void Throttler::sleep(double sleepTimeSecs) const {
@@ -151,41 +202,58 @@ void Throttler::sleep(double sleepTimeSecs) const {
   std::this_thread::sleep_for(std::chrono::duration<double>(sleepTimeSecs));
 }
 
+int64_t Throttler::toNanos(const Clock::time_point& time) {
+  return std::chrono::duration_cast<std::chrono::nanoseconds>(
+             time.time_since_epoch())
+      .count();
+}
+
 double Throttler::calculateSleep(double deltaProgress,
                                  const Clock::time_point& now) {
-  folly::SpinLockGuard lock(throttlerMutex_);
-  if (refCount_ <= 0) {
+  if (refCount_.load() <= 0) {
     WLOG(ERROR) << "Using the throttler without registering the transfer";
     return -1;
   }
-  progress_ += deltaProgress;
-  double avgThrottlerSleep = averageThrottler(now);
+  const int64_t nowNanos = toNanos(now);
+  const int64_t delta = (int64_t)deltaProgress;
+  const double progress = progress_.fetch_add(delta) + delta;
+  double avgThrottlerSleep = averageThrottler(nowNanos, progress);
   const bool willSleep = (avgThrottlerSleep > 0);
   if (willSleep) {
     return avgThrottlerSleep;
   }
-  // we still hold the lock if peak throttler can come into effect
-  if ((bucketRatePerSec_ > 0) && (tokenBucketLimit_ > 0)) {
-    std::chrono::duration<double> elapsedDuration = now - lastFillTime_;
-    lastFillTime_ = now;
-    double elapsedSeconds = elapsedDuration.count();
-    tokenBucket_ += elapsedSeconds * bucketRatePerSec_;
-    if (tokenBucket_ > tokenBucketLimit_) {
-      tokenBucket_ = tokenBucketLimit_;
-    }
-    tokenBucket_ -= deltaProgress;
-    if (tokenBucket_ < 0) {
-      /*
-       * If we have negative number of tokens lets sleep
-       * This way we will have positive number of tokens next time
-       */
-      double peakThrottlerSleep = -1.0 * tokenBucket_ / bucketRatePerSec_;
-      WVLOG(2) << "Peak throttler wants to sleep " << peakThrottlerSleep
-               << " seconds";
-      return peakThrottlerSleep;
-    }
+  return limitByTokenBucket(nowNanos, deltaProgress);
+}
+
+double Throttler::limitByTokenBucket(int64_t nowNanos, double deltaProgress) {
+  const double bucketRatePerSec = bucketRatePerSec_.load();
+  const double tokenBucketLimit = tokenBucketLimit_.load();
+  if (bucketRatePerSec <= 0 || tokenBucketLimit <= 0) {
+    return -1;
   }
-  return -1;
+  // the bucket is full if it was empty longer than this ago
+  const int64_t fillNanos =
+      (int64_t)(tokenBucketLimit / bucketRatePerSec * kNanosPerSec);
+  const int64_t costNanos =
+      (int64_t)(deltaProgress / bucketRatePerSec * kNanosPerSec);
+  int64_t emptyTimeNanos = bucketEmptyTimeNanos_.load();
+  int64_t newEmptyTimeNanos;
+  do {
+    newEmptyTimeNanos =
+        std::max(emptyTimeNanos, nowNanos - fillNanos) + costNanos;
+  } while (!bucketEmptyTimeNanos_.compare_exchange_weak(emptyTimeNanos,
+                                                        newEmptyTimeNanos));
+  if (newEmptyTimeNanos <= nowNanos) {
+    return -1;
+  }
+  /*
+   * If we have negative number of tokens lets sleep
+   * This way we will have positive number of tokens next time
+   */
+  double peakThrottlerSleep = (newEmptyTimeNanos - nowNanos) / kNanosPerSec;
+  WVLOG(2) << "Peak throttler wants to sleep " << peakThrottlerSleep
+           << " seconds";
+  return peakThrottlerSleep;
 }
 
 void Throttler::printPeriodicLogs(const Clock::time_point& now,
@@ -194,41 +262,41 @@ void Throttler::printPeriodicLogs(const Clock::time_point& now,
    * This is the part where throttler prints out the progress
    * made periodically.
    */
-  std::chrono::duration<double> elapsedLogDuration;
-  folly::SpinLockGuard lock(throttlerMutex_);
-  instantProgress_ += deltaProgress;
-  elapsedLogDuration = now - lastLogTime_;
-  double elapsedLogSeconds = elapsedLogDuration.count();
-  if (elapsedLogSeconds * kMillisecsPerSec >= throttlerLogTimeMillis_) {
-    double instantRatePerSec = 0;
-    instantRatePerSec = instantProgress_ / elapsedLogSeconds;
-    instantProgress_ = 0;
-    lastLogTime_ = now;
-    std::chrono::duration<double> elapsedAvgDuration = now - startTime_;
-    double elapsedAvgSeconds = elapsedAvgDuration.count();
-    double avgRatePerSec = progress_ / elapsedAvgSeconds;
-    WLOG(INFO) << "Throttler:Transfer_Rates::"
-               << " " << elapsedAvgSeconds << " " << avgRatePerSec << " "
-               << instantRatePerSec << " " << deltaProgress;
+  const int64_t nowNanos = toNanos(now);
+  instantProgress_.fetch_add((int64_t)deltaProgress);
+  int64_t lastLogTimeNanos = lastLogTimeNanos_.load();
+  double elapsedLogSeconds = (nowNanos - lastLogTimeNanos) / kNanosPerSec;
+  if (elapsedLogSeconds * kMillisecsPerSec < throttlerLogTimeMillis_.load()) {
+    return;
   }
+  // only the thread moving the log time forward logs
+  if (!lastLogTimeNanos_.compare_exchange_strong(lastLogTimeNanos, nowNanos)) {
+    return;
+  }
+  double instantRatePerSec = instantProgress_.exchange(0) / elapsedLogSeconds;
+  double elapsedAvgSeconds = (nowNanos - startTimeNanos_.load()) / kNanosPerSec;
+  double avgRatePerSec = progress_.load() / elapsedAvgSeconds;
+  WLOG(INFO) << "Throttler:Transfer_Rates::"
+             << " " << elapsedAvgSeconds << " " << avgRatePerSec << " "
+             << instantRatePerSec << " " << deltaProgress;
 }
 
-double Throttler::averageThrottler(const Clock::time_point& now) {
-  std::chrono::duration<double> elapsedDuration = now - startTime_;
-  double elapsedSeconds = elapsedDuration.count();
-  if (avgRatePerSec_ <= 0) {
+double Throttler::averageThrottler(int64_t nowNanos, double progress) {
+  double elapsedSeconds = (nowNanos - startTimeNanos_.load()) / kNanosPerSec;
+  const double avgRatePerSec = avgRatePerSec_.load();
+  if (avgRatePerSec <= 0) {
     WVLOG(2) << "There is no avg rate limit";
     return -1;
   }
-  const double allowedProgress = avgRatePerSec_ * elapsedSeconds;
-  if (progress_ > allowedProgress) {
-    double idealTime = progress_ / avgRatePerSec_;
+  const double allowedProgress = avgRatePerSec * elapsedSeconds;
+  if (progress > allowedProgress) {
+    double idealTime = progress / avgRatePerSec;
     const double sleepTimeSeconds = idealTime - elapsedSeconds;
     WVLOG(1) << "Throttler : Elapsed " << elapsedSeconds
-             << " seconds. Made progress " << progress_ << " in "
+             << " seconds. Made progress " << progress << " in "
              << elapsedSeconds
              << " seconds, maximum allowed progress for this duration is "
-             << allowedProgress << ". Mean Rate allowed is " << avgRatePerSec_
+             << allowedProgress << ". Mean Rate allowed is " << avgRatePerSec
              << " . Sleeping for " << sleepTimeSeconds << " seconds";
     return sleepTimeSeconds;
   }
@@ -241,58 +309,72 @@ void Throttler::startTransfer() {
     resetState();
   }
   refCount_++;
+  if (parent_) {
+    parent_->startTransfer();
+  }
 }
 
 void Throttler::resetState() {
-  startTime_ = Clock::now();
-  lastFillTime_ = startTime_;
-  lastLogTime_ = startTime_;
+  const int64_t nowNanos = toNanos(Clock::now());
+  startTimeNanos_ = nowNanos;
+  // the bucket starts empty, so that new rates don't begin with a burst of
+  // the tokens filled at the old ones, and the sleep still owed is kept
+  if (bucketEmptyTimeNanos_.load() < nowNanos) {
+    bucketEmptyTimeNanos_ = nowNanos;
+  }
+  lastLogTimeNanos_ = nowNanos;
   instantProgress_ = 0;
   progress_ = 0;
-  tokenBucket_ = 0;
+  generation_ = nextGeneration++;
 }
 
 void Throttler::endTransfer() {
   folly::SpinLockGuard lock(throttlerMutex_);
   WDT_CHECK(refCount_ > 0);
   refCount_--;
+  if (parent_) {
+    parent_->endTransfer();
+  }
+}
+
+std::shared_ptr<Throttler> Throttler::getParent() const {
+  return parent_;
+}
+
+int64_t Throttler::getNumTransfers() const {
+  return refCount_.load();
 }
 
 double Throttler::getProgress() {
-  folly::SpinLockGuard lock(throttlerMutex_);
-  return progress_;
+  return progress_.load();
 }
 
 double Throttler::getAvgRatePerSec() {
-  folly::SpinLockGuard lock(throttlerMutex_);
-  return avgRatePerSec_;
+  return avgRatePerSec_.load();
 }
 
 double Throttler::getPeakRatePerSec() {
-  folly::SpinLockGuard lock(throttlerMutex_);
-  return bucketRatePerSec_;
+  return bucketRatePerSec_.load();
 }
 
 double Throttler::getBucketLimit() {
-  folly::SpinLockGuard lock(throttlerMutex_);
-  return tokenBucketLimit_;
+  return tokenBucketLimit_.load();
 }
 
 int64_t Throttler::getThrottlerLogTimeMillis() {
-  folly::SpinLockGuard lock(throttlerMutex_);
-  return throttlerLogTimeMillis_;
+  return throttlerLogTimeMillis_.load();
 }
 
 void Throttler::setThrottlerLogTimeMillis(int64_t throttlerLogTimeMillis) {
-  folly::SpinLockGuard lock(throttlerMutex_);
   throttlerLogTimeMillis_ = throttlerLogTimeMillis;
 }
 
 std::ostream& operator<<(std::ostream& stream, const Throttler& throttler) {
-  stream << "avgRate: " << throttler.avgRatePerSec_
-         << ", peakRate: " << throttler.bucketRatePerSec_
-         << ", bucketLimit: " << throttler.tokenBucketLimit_
-         << ", throttlerLogTimeMillis: " << throttler.throttlerLogTimeMillis_;
+  stream << "avgRate: " << throttler.avgRatePerSec_.load()
+         << ", peakRate: " << throttler.bucketRatePerSec_.load()
+         << ", bucketLimit: " << throttler.tokenBucketLimit_.load()
+         << ", throttlerLogTimeMillis: "
+         << throttler.throttlerLogTimeMillis_.load();
   return stream;
 }
 }
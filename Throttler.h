@@ -10,6 +10,7 @@
 #include <folly/SpinLock.h>
 #include <glog/logging.h>
 #include <wdt/util/CommonImpl.h>
+#include <atomic>
 #include <thread>
 namespace facebook {
 namespace wdt {
@@ -49,6 +50,14 @@ struct ThrottlerOptions {
    * starve other threads asking for small amount of resource.
    */
   int64_t single_request_limit{1};
+
+  /**
+   * Tokens a thread leases from the throttler at a time when it calls limit()
+   * with its thread context. The following calls of the thread consume the
+   * lease without touching the shared state. Specify <= 0 to throttle every
+   * call.
+   */
+  int64_t lease_size{0};
 };
 
 /**
@@ -62,12 +71,24 @@ struct ThrottlerOptions {
  * token bucket algorithm.
  * Token Bucket algorithm can be found on
  * http://en.wikipedia.org/wiki/Token_bucket
+ * The state updated on every call lives in atomics, the bucket being kept as
+ * the time at which it is empty, so that concurrent threads never wait for
+ * each other. The lock only serializes rate changes and transfer registration.
+ * A throttler can have a parent, shared with its siblings: the tokens taken
+ * from it are then also taken from the parent, so that the siblings together
+ * respect the parent rates and the share an idle sibling leaves is used by the
+ * active ones.
  */
 class Throttler {
  public:
-  /// Utility method that makes throttler using options.
+  /**
+   * Utility method that makes throttler using options.
+   * @param parent                    throttler every call is also throttled
+   *                                  by, nullptr for none
+   */
   static std::shared_ptr<Throttler> makeThrottler(
-      const ThrottlerOptions& options);
+      const ThrottlerOptions& options,
+      std::shared_ptr<Throttler> parent = nullptr);
 
   /**
    * Calls calculateSleep which is a thread safe method. Finds out the
@@ -77,7 +98,8 @@ class Throttler {
   virtual void limit(ThreadCtx& threadCtx, int64_t deltaProgress);
 
   /**
-   * Same as the other limit, but without reporting for sleep duration
+   * Same as the other limit, but without reporting for sleep duration and
+   * without credit leases
    */
   virtual void limit(int64_t deltaProgress);
 
@@ -102,16 +124,29 @@ class Throttler {
   /// Utility method that set throttler rate using options
   void setThrottlerRates(const ThrottlerOptions& options);
 
+  /**
+   * Sets the average rate, the peak rate and the bucket limit being auto
+   * configured from it. Logs only at verbose levels, meant for rates updated
+   * often (@see BandwidthScheduler)
+   */
+  void setAvgRatePerSec(double avgRatePerSec);
+
   virtual ~Throttler() {
   }
 
   /// Anyone who is using the throttler should call this method to maintain
-  /// the refCount_ and startTime_ correctly
+  /// the refCount_ and startTime_ correctly. Registers with the parent too
   void startTransfer();
 
   /// Method to de-register the transfer and decrement the refCount_
   void endTransfer();
 
+  /// @return   parent throttler, nullptr if none
+  std::shared_ptr<Throttler> getParent() const;
+
+  /// @return   number of transfers registered with startTransfer()
+  int64_t getNumTransfers() const;
+
   /// Get the average rate per sec
   double getAvgRatePerSec();
 
@@ -149,9 +184,12 @@ class Throttler {
    *                                  throttled, that requested gets broken down
    *                                  and it is treated as multiple throttle
    *                                  calls.
+   * @param leaseSize                 Tokens leased by a thread at a time,
+   *                                  <= 0 to disable leases
    */
   Throttler(double avgRatePerSec, double peakRatePerSec, double bucketLimit,
-            int64_t singleRequestLimit, int64_t throttlerLogTimeMillis = 0);
+            int64_t singleRequestLimit, int64_t throttlerLogTimeMillis = 0,
+            int64_t leaseSize = 0);
 
   /**
    * Sometimes the options passed to throttler might not make sense so this
@@ -165,9 +203,19 @@ class Throttler {
    * (e.g. number of tokens processed) till now. If the total progress
    * till now is over the allowed average progress then it returns the
    * time to sleep for the calling thread
-   * @param now                       Pass in the current time stamp
+   * @param nowNanos                  Pass in the current time stamp
+   * @param progress                  Total progress including this call
    */
-  double averageThrottler(const Clock::time_point& now);
+  double averageThrottler(int64_t nowNanos, double progress);
+
+  /**
+   * Takes deltaProgress tokens from the token bucket
+   * @return                          time to sleep, <= 0 for none
+   */
+  double limitByTokenBucket(int64_t nowNanos, double deltaProgress);
+
+  /// Throttles deltaProgress out of the credit leased by the thread
+  void limitWithLease(ThreadCtx& threadCtx, int64_t deltaProgress);
 
   void limitInternal(ThreadCtx* threadCtx, int64_t deltaProgress);
 
@@ -185,39 +233,51 @@ class Throttler {
    * @param sleepTimeSeconds   Duration of sleep caused by limit()
    */
   void printPeriodicLogs(const Clock::time_point& now, double deltaProgress);
+
+  /// @return   time point in nanoseconds, as kept in the atomics
+  static int64_t toNanos(const Clock::time_point& time);
+
   /// Records the time the throttler was started
-  Clock::time_point startTime_;
+  std::atomic<int64_t> startTimeNanos_{0};
 
   /**
    * Throttler logs the average and instantaneous progress
    * periodically (check FLAGS_peak_log_time_ms). lastLogTime_ is
    * the last time this log was written
    */
-  Clock::time_point lastLogTime_;
+  std::atomic<int64_t> lastLogTimeNanos_{0};
   /// Instant progress in the time stats were logged last time
-  double instantProgress_{0};
+  std::atomic<int64_t> instantProgress_{0};
   // Records the total progress in tokens till now
-  double progress_{0};
-  /// Last time the token bucket was filled
-  std::chrono::time_point<std::chrono::high_resolution_clock> lastFillTime_;
+  std::atomic<int64_t> progress_{0};
+  /**
+   * Time at which the token bucket is (or was) empty. The bucket holds the
+   * tokens filled since then, up to tokenBucketLimit_, and an empty time in
+   * the future is a debt to sleep off
+   */
+  std::atomic<int64_t> bucketEmptyTimeNanos_{0};
+  /// Changed when the state is reset, invalidating the leased credits
+  std::atomic<int64_t> generation_{0};
 
  protected:
-  /// Number of tokens in the bucket
-  int64_t tokenBucket_;
-  /// Controls the access across threads
+  /// Serializes rate changes and transfer registration
   folly::SpinLock throttlerMutex_;
   /// Number of users of this throttler
-  int64_t refCount_{0};
+  std::atomic<int64_t> refCount_{0};
   /// The average rate expected
-  double avgRatePerSec_;
+  std::atomic<double> avgRatePerSec_;
   /// Limit on the max number of tokens
-  double tokenBucketLimit_;
+  std::atomic<double> tokenBucketLimit_;
   /// Rate at which bucket is filled
-  double bucketRatePerSec_;
+  std::atomic<double> bucketRatePerSec_;
   /// Max number of tokens that can be requested in a single call
   int64_t singleRequestLimit_;
+  /// Tokens leased by a thread at a time, <= 0 if leases are disabled
+  int64_t leaseSize_{0};
   /// Interval between every print of throttler logs
-  int64_t throttlerLogTimeMillis_;
+  std::atomic<int64_t> throttlerLogTimeMillis_;
+  /// Throttler shared with the siblings, set at creation
+  std::shared_ptr<Throttler> parent_{nullptr};
 };
 }
 }  // facebook::wdt
@@ -48,6 +48,10 @@ ErrorCode Wdt::printWdtOptions(std::ostream &out) {
   return OK;
 }
 
+LatencyPercentiles Wdt::getWdtLatencyPercentiles(LatencyPhase phase) {
+  return LatencyHistograms::get().getPercentiles(phase);
+}
+
 Wdt::Wdt() {
   WdtFlags::initializeFromFlags(options_);
   resourceController_ = std::make_unique<WdtResourceController>(options_);
@@ -128,6 +132,26 @@ ErrorCode Wdt::wdtSend(const WdtTransferRequest &req,
   return errCode;
 }
 
+ErrorCode Wdt::wdtCopyLocal(const WdtTransferRequest &req,
+                            const std::string &destDirectory,
+                            std::shared_ptr<IAbortChecker> abortChecker) {
+  if (req.errorCode != OK) {
+    WLOG(ERROR) << "Transfer request error " << errorCodeToStr(req.errorCode);
+    return req.errorCode;
+  }
+  LocalCopier copier(req, destDirectory);
+  copier.setWdtOptions(options_);
+  wdtSetAbortSocketCreatorAndReporter(&copier, req, abortChecker);
+  ErrorCode errCode = copier.init().errorCode;
+  if (errCode != OK) {
+    return errCode;
+  }
+  errCode = copier.transfer()->getSummary().getErrorCode();
+  WLOG(INFO) << "wdtCopyLocal of " << req.directory << " to " << destDirectory
+             << " ended with " << errorCodeToStr(errCode);
+  return errCode;
+}
+
 ErrorCode Wdt::wdtReceiveStart(const std::string &wdtNamespace,
                                WdtTransferRequest &req,
                                const std::string &identifier,
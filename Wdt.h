@@ -8,6 +8,7 @@
  */
 #pragma once
 
+#include <wdt/LocalCopier.h>
 #include <wdt/Receiver.h>
 #include <wdt/Sender.h>
 // For Options
@@ -18,6 +19,7 @@
 #include <wdt/WdtBase.h>
 #include <wdt/WdtResourceController.h>
 #include <wdt/util/EncryptionUtils.h>
+#include <wdt/util/LatencyHistograms.h>
 #include <ostream>
 
 namespace facebook {
@@ -80,6 +82,15 @@ class Wdt {
 
   virtual ErrorCode releaseWdtSender(const WdtTransferRequest &wdtRequest);
 
+  /**
+   * Copies the directory (or the files) of the request into another
+   * directory of the same host, inside the kernel and without sockets.
+   * Blocks till the copy is done.
+   */
+  virtual ErrorCode wdtCopyLocal(
+      const WdtTransferRequest &wdtRequest, const std::string &destDirectory,
+      std::shared_ptr<IAbortChecker> abortChecker = nullptr);
+
   /**
    * Receive data. It creates a receiver on specified namespace/identifier and
    * initialize it.
@@ -98,6 +109,13 @@ class Wdt {
 
   virtual ErrorCode printWdtOptions(std::ostream &out);
 
+  /**
+   * @return  latency percentiles of an operation of the hot paths over the
+   *          last complete window of latency_histogram_window_millis, can be
+   *          called during transfers
+   */
+  LatencyPercentiles getWdtLatencyPercentiles(LatencyPhase phase);
+
   WdtResourceController *getWdtResourceController() {
     return resourceController_.get();
   }
@@ -121,9 +139,6 @@ class Wdt {
 
   WdtOptions options_;
 
-  /// responsible for initializing openssl
-  WdtCryptoIntializer cryptoInitializer_;
-
   // TODO: share resource controller across apps
   /// wdt resource controller
   std::unique_ptr<WdtResourceController> resourceController_;
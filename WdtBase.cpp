@@ -8,6 +8,7 @@
  */
 #include <wdt/WdtBase.h>
 #include <wdt/WdtTransferRequest.h>
+#include <algorithm>
 #include <random>
 using namespace std;
 
@@ -70,13 +71,24 @@ void WdtBase::setProgressReporter(
 
 void WdtBase::setThrottler(std::shared_ptr<Throttler> throttler) {
   WVLOG(2) << "Setting an external throttler";
+  std::lock_guard<std::mutex> lock(rateSchedulerMutex_);
   throttler_ = throttler;
+  startRateSchedulerLocked();
 }
 
 std::shared_ptr<Throttler> WdtBase::getThrottler() const {
   return throttler_;
 }
 
+double WdtBase::getTimeToFirstByte(Clock::time_point startTime) const {
+  const int64_t ticks = firstByteTicks_.load();
+  if (ticks == 0) {
+    return -1;
+  }
+  const Clock::time_point firstByteTime{Clock::duration(ticks)};
+  return std::max(0.0, durationSeconds(firstByteTime - startTime));
+}
+
 void WdtBase::setTransferId(const std::string& transferId) {
   transferRequest_.transferId = transferId;
   WLOG(INFO) << "Setting transfer id " << transferId;
@@ -175,15 +187,55 @@ bool WdtBase::hasStarted() {
   return (status != NOT_STARTED);
 }
 
+void WdtBase::logThreadBottlenecks(bool sender) const {
+  for (size_t i = 0; i < threadTimeBreakdowns_.size(); i++) {
+    const TimeBreakdown &breakdown = threadTimeBreakdowns_[i];
+    WLOG(INFO) << "Thread " << i << " "
+               << bottleneckToStr(breakdown.classify(sender)) << " ("
+               << breakdown << ")";
+  }
+}
+
 void WdtBase::configureThrottler() {
   WDT_CHECK(!throttler_);
   WVLOG(1) << "Configuring throttler options";
+  std::lock_guard<std::mutex> lock(rateSchedulerMutex_);
   throttler_ = Throttler::makeThrottler(options_.getThrottlerOptions());
   if (throttler_) {
     WLOG(INFO) << "Enabling throttling " << *throttler_;
   } else {
     WLOG(INFO) << "Throttling not enabled";
   }
+  startRateSchedulerLocked();
+}
+
+ErrorCode WdtBase::setThrottlerRates(const ThrottlerOptions& rates) {
+  std::lock_guard<std::mutex> lock(rateSchedulerMutex_);
+  if (!rateScheduler_) {
+    WLOG(ERROR) << "Can't change the rates, the throttler is not configured";
+    return ERROR;
+  }
+  rateScheduler_->setRates(rates);
+  return OK;
+}
+
+void WdtBase::setRateSchedule(const RateSchedule& schedule) {
+  std::lock_guard<std::mutex> lock(rateSchedulerMutex_);
+  rateSchedule_ = std::make_unique<RateSchedule>(schedule);
+  if (rateScheduler_) {
+    rateScheduler_->setSchedule(*rateSchedule_);
+  }
+}
+
+void WdtBase::startRateSchedulerLocked() {
+  if (!throttler_) {
+    rateScheduler_.reset();
+    return;
+  }
+  rateScheduler_ = std::make_unique<RateScheduler>(throttler_);
+  if (rateSchedule_) {
+    rateScheduler_->setSchedule(*rateSchedule_);
+  }
 }
 
 string WdtBase::generateTransferId() {
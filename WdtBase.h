@@ -18,7 +18,9 @@
 #include <wdt/WdtThread.h>
 #include <wdt/util/DirectorySourceQueue.h>
 #include <wdt/util/EncryptionUtils.h>
+#include <wdt/util/RateScheduler.h>
 #include <wdt/util/ThreadsController.h>
+#include <atomic>
 #include <memory>
 #include <string>
 #include <unordered_map>
@@ -85,6 +87,18 @@ class WdtBase {
   /// Set throttler externally. Should be set before any transfer calls
   void setThrottler(std::shared_ptr<Throttler> throttler);
 
+  /**
+   * Changes the rates of the throttler of a running transfer, till the next
+   * window of its rate schedule if it has one. Can be called from any thread
+   *
+   * @return    OK, ERROR if the throttler is not configured yet
+   */
+  ErrorCode setThrottlerRates(const ThrottlerOptions& rates);
+
+  /// Sets the schedule of the rates of the transfer, applied once its
+  /// throttler is configured. Can be called from any thread
+  void setRateSchedule(const RateSchedule& schedule);
+
   /// Sets the transferId for this transfer
   void setTransferId(const std::string& transferId);
 
@@ -107,6 +121,10 @@ class WdtBase {
   /// returns with the status
   virtual ErrorCode transferAsync() = 0;
 
+  /// @return   live metrics of the transfer, can be called from any thread.
+  ///           Once the threads are joined, the metrics of the final report
+  virtual TransferMetrics getMetrics() = 0;
+
   /// Basic setup for throttler using options
   void configureThrottler();
 
@@ -116,6 +134,17 @@ class WdtBase {
   /// Get the throttler
   std::shared_ptr<Throttler> getThrottler() const;
 
+  /// Records that a block byte of the transfer went on the wire, only the
+  /// first call after resetFirstByteTime() counts. Called by the threads
+  void markFirstByte() {
+    if (firstByteTicks_.load(std::memory_order_relaxed) != 0) {
+      return;
+    }
+    int64_t expected = 0;
+    firstByteTicks_.compare_exchange_strong(
+        expected, Clock::now().time_since_epoch().count());
+  }
+
   /// @return   Root directory
   const std::string& getDirectory() const;
 
@@ -164,14 +193,37 @@ class WdtBase {
   void negotiateProtocol();
 
   /// Dumps performance statistics if enable_perf_stat_collection is true.
+  /// The bottleneck of each thread is logged once the transfer is finished
   virtual void logPerfStats() const = 0;
 
+  /**
+   * Logs what limited each thread of the finished transfer
+   *
+   * @param sender    whether the threads are sender threads
+   */
+  void logThreadBottlenecks(bool sender) const;
+
   /// Input/output transfer request
   WdtTransferRequest transferRequest_;
 
   /// Global throttler across all threads
   std::shared_ptr<Throttler> throttler_;
 
+  /// Applies the rate schedule and the live rates to the throttler
+  /// configured or set, which throttler_ may wrap later. Guarded by
+  /// rateSchedulerMutex_
+  std::unique_ptr<RateScheduler> rateScheduler_;
+
+  /// Schedule of the rates, nullptr if none
+  std::unique_ptr<RateSchedule> rateSchedule_;
+
+  /// Mutex for throttler_ changes and the rate schedule
+  std::mutex rateSchedulerMutex_;
+
+  /// makes the rate scheduler of throttler_ and applies the schedule, if
+  /// any. Has to be called with rateSchedulerMutex_ held
+  void startRateSchedulerLocked();
+
   /// Holds the instance of the progress reporter default or customized
   std::unique_ptr<ProgressReporter> progressReporter_;
 
@@ -181,6 +233,29 @@ class WdtBase {
   /// current transfer status
   TransferStatus transferStatus_{NOT_STARTED};
 
+  /// metrics of the final report, returned by getMetrics() once the threads
+  /// are joined. Guarded by mutex_
+  TransferMetrics finalMetrics_;
+
+  /// time breakdowns of the threads, set by finish() once they are joined
+  std::vector<TimeBreakdown> threadTimeBreakdowns_;
+
+  /// forgets the first byte of the previous transfer
+  void resetFirstByteTime() {
+    firstByteTicks_ = 0;
+  }
+
+  /**
+   * @param startTime   start of the transfer
+   *
+   * @return            seconds from startTime to the first block byte, -1 if
+   *                    none went through yet
+   */
+  double getTimeToFirstByte(Clock::time_point startTime) const;
+
+  /// clock ticks of the first block byte, 0 if none yet
+  std::atomic<int64_t> firstByteTicks_{0};
+
   /// Mutex which is shared between the parent thread, transferring threads and
   /// progress reporter thread
   std::mutex mutex_;
@@ -195,6 +270,9 @@ class WdtBase {
   /// Controller for wdt threads shared between base and threads
   ThreadsController* threadsController_{nullptr};
 
+  /// Placement of the wdt threads, shared between base and threads
+  std::unique_ptr<ThreadAffinity> threadAffinity_{nullptr};
+
   /// Dump perf stats if notified
   ReportPerfSignalSubscriber reportPerfSignal_;
 
@@ -10,18 +10,28 @@
 #include <fcntl.h>
 
 #define WDT_VERSION_MAJOR 1
-#define WDT_VERSION_MINOR 30
+#define WDT_VERSION_MINOR 41
 #define WDT_VERSION_BUILD 1704260
 // Add -fbcode to version str
-#define WDT_VERSION_STR "1.30.1704260-fbcode"
+#define WDT_VERSION_STR "1.41.1704260-fbcode"
 // Tie minor and proto version
 #define WDT_PROTOCOL_VERSION WDT_VERSION_MINOR
 
 #define HAS_POSIX_FALLOCATE 1
+#define HAS_FALLOCATE 1
 #define HAS_SYNC_FILE_RANGE 1
 #define HAS_POSIX_MEMALIGN 1
 #define HAS_POSIX_FADVISE 1
+#define HAS_SCHED_SETAFFINITY 1
+#define HAS_SYNCFS 1
 
 #define WDT_SUPPORTS_ODIRECT 1
 #define WDT_HAS_SOCKIOS_H 1
+#define WDT_HAS_IO_URING 1
+#define WDT_HAS_FIEMAP 1
+#define WDT_HAS_MEMPOLICY 1
+#define WDT_HAS_KTLS 1
+#define WDT_HAS_LZ4 1
+#define WDT_HAS_ZSTD 1
+#define WDT_HAS_XXHASH 1
 // Again do not add new defines here without editing WdtConfig.h.in ...
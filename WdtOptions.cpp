@@ -9,6 +9,7 @@
 #include <wdt/WdtOptions.h>
 #include <glog/logging.h>
 #include <wdt/Throttler.h>
+#include <wdt/util/DeltaResumption.h>
 
 namespace facebook {
 namespace wdt {
@@ -35,6 +36,19 @@ const char* WdtOptions::DISK_OPTION_TYPE = "disk";
 void WdtOptions::modifyOptions(
     const std::string& optionType,
     const std::set<std::string>& userSpecifiedOptions) {
+  if (verify) {
+    std::string msg("(verify)");
+    CHANGE_IF_NOT_SPECIFIED(enable_download_resumption, userSpecifiedOptions,
+                            true, msg)
+    CHANGE_IF_NOT_SPECIFIED(resume_using_dir_tree, userSpecifiedOptions, true,
+                            msg)
+    CHANGE_IF_NOT_SPECIFIED(disable_preallocation, userSpecifiedOptions, true,
+                            msg)
+    CHANGE_IF_NOT_SPECIFIED(delta_resumption_block_kbytes,
+                            userSpecifiedOptions, 1024, msg)
+    CHANGE_IF_NOT_SPECIFIED(delta_resumption_threads, userSpecifiedOptions,
+                            16, msg)
+  }
   if (optionType == DISK_OPTION_TYPE) {
     std::string msg("(disk option type)");
     CHANGE_IF_NOT_SPECIFIED(num_ports, userSpecifiedOptions, 3, msg)
@@ -74,6 +88,15 @@ bool WdtOptions::isDirectoryTreeBasedResumption() const {
   return enable_download_resumption && resume_using_dir_tree;
 }
 
+DeltaReadOptions WdtOptions::getDeltaReadOptions() const {
+  DeltaReadOptions readOptions;
+  readOptions.numThreads =
+      delta_resumption_threads > 0 ? delta_resumption_threads : num_ports;
+  readOptions.directReads = odirect_reads;
+  readOptions.dropCache = !skip_fadvise;
+  return readOptions;
+}
+
 ThrottlerOptions WdtOptions::getThrottlerOptions() const {
   ThrottlerOptions throttlerOptions;
   throttlerOptions.avg_rate_per_sec = avg_mbytes_per_sec * kMbToB;
@@ -82,6 +105,23 @@ ThrottlerOptions WdtOptions::getThrottlerOptions() const {
   throttlerOptions.throttler_log_time_millis = throttler_log_time_millis;
   // Expected request size equal to buffer size
   throttlerOptions.single_request_limit = buffer_size;
+  throttlerOptions.lease_size = throttler_lease_size;
+  return throttlerOptions;
+}
+
+ThrottlerOptions WdtOptions::getNamespaceThrottlerOptions() const {
+  ThrottlerOptions throttlerOptions = getThrottlerOptions();
+  throttlerOptions.avg_rate_per_sec = namespace_avg_mbytes_per_sec * kMbToB;
+  throttlerOptions.max_rate_per_sec = namespace_max_mbytes_per_sec * kMbToB;
+  throttlerOptions.throttler_bucket_limit = 0;
+  return throttlerOptions;
+}
+
+ThrottlerOptions WdtOptions::getTransferThrottlerOptions() const {
+  ThrottlerOptions throttlerOptions = getThrottlerOptions();
+  throttlerOptions.avg_rate_per_sec = transfer_avg_mbytes_per_sec * kMbToB;
+  throttlerOptions.max_rate_per_sec = transfer_max_mbytes_per_sec * kMbToB;
+  throttlerOptions.throttler_bucket_limit = 0;
   return throttlerOptions;
 }
 
@@ -17,6 +17,7 @@
 namespace facebook {
 namespace wdt {
 struct ThrottlerOptions;
+struct DeltaReadOptions;
 
 /**
  * A singleton class managing different options for WDT.
@@ -122,6 +123,12 @@ class WdtOptions {
    * failure
    */
   int32_t sleep_millis{50};
+  /**
+   * Max time in ms to sleep between attempts. The sleep starts at
+   * sleep_millis and doubles after each failed attempt up to this, with
+   * random jitter. A fixed sleep_millis if not above it
+   */
+  int32_t max_sleep_millis{500};
 
   /**
    * Specify the backlog to start the server socket with. Look
@@ -156,6 +163,12 @@ class WdtOptions {
    * be logged
    */
   int64_t throttler_log_time_millis{0};
+  /**
+   * Bytes a thread leases from the throttler at a time, the following
+   * sends and receives of the thread use the lease without going through the
+   * shared throttler state. Specify <= 0 to throttle every buffer.
+   */
+  int64_t throttler_lease_size{256 * 1024};
   /**
    * Regex for the files to be included in discovery
    */
@@ -168,6 +181,13 @@ class WdtOptions {
    * Regex for the directories that shouldn't be explored
    */
   std::string prune_dir_regex{""};
+  /**
+   * Comma separated glob=priority pairs, a file whose relative path matches a
+   * glob (first match) belongs to that priority class. The files of higher
+   * classes are sent first by all the threads. Files of the file info of the
+   * request with a priority keep it
+   */
+  std::string file_priorities{""};
 
   /**
    * Maximum number of times sender thread reconnects without making any
@@ -175,6 +195,20 @@ class WdtOptions {
    */
   int max_transfer_retries{3};
 
+  /**
+   * If true, a sender thread reconnecting after an error sends its settings
+   * right away and reads the local checkpoint of the receiver while they are
+   * on their way, instead of waiting for the checkpoint first
+   */
+  bool fast_reconnect{true};
+
+  /**
+   * If true, the settings of a sender thread are held back by the kernel and
+   * go out in the same tcp segments as the start of its first block, instead
+   * of taking packets of their own before any data flows
+   */
+  bool piggyback_settings{true};
+
   /**
    * True if full reporting is enabled. False otherwise
    */
@@ -238,6 +272,25 @@ class WdtOptions {
    */
   double disk_sync_interval_mb{0.5};
 
+  /**
+   * If true, the receiver starts the writeback of the received data from a
+   * background thread shared by all the files, with a flush window sized
+   * from the observed writeback latency and the dirty page pressure of the
+   * system, instead of every disk_sync_interval_mb. Ignored if
+   * disk_sync_interval_mb is negative
+   */
+  bool adaptive_write_behind{false};
+
+  /**
+   * Writeback time of a flush window the adaptive write behind aims for
+   */
+  int write_behind_target_millis{100};
+
+  /**
+   * Largest flush window of the adaptive write behind, in mb
+   */
+  int write_behind_max_window_mb{64};
+
   /**
    * If true, each file is fsync'ed after its last block is
    * received.
@@ -246,6 +299,14 @@ class WdtOptions {
    */
   bool fsync{true};
 
+  /**
+   * If true, receiver threads hand the files they finished writing off to a
+   * background thread, which syncs them in batches and closes them. Blocks
+   * are added to the transfer log once durable, and DONE is sent only once
+   * every file is.
+   */
+  bool background_sync{false};
+
   /**
    * Intervals in millis after which progress reporter updates current
    * throughput
@@ -257,16 +318,72 @@ class WdtOptions {
    */
   bool enable_checksum{false};
 
+  /**
+   * Algorithm of the checksums, crc32c or xxh3. xxh3 is only used if the
+   * receiver protocol version supports it, and the receiver must be built
+   * with it. The checksums of the blocks are also recorded in the transfer
+   * log, which gives the checksum of each file received in full
+   */
+  std::string checksum_type{"crc32c"};
+
   /**
    * If true, perf stats are collected and reported at the end of transfer
    */
   bool enable_perf_stat_collection{false};
 
+  /**
+   * Window in milliseconds of the latency histograms of the hot path
+   * operations (disk read and write, encryption, socket read and write,
+   * throttler sleep, fsync and file creation), readable during the transfer
+   * with Wdt::getWdtLatencyPercentiles. The first transfer of the process
+   * sets the window. 0 to not record the latencies
+   */
+  int latency_histogram_window_millis{10000};
+
+  /**
+   * If not empty, the timeline of the transfer (states of the threads, block
+   * sends, disk and socket operations, throttler sleeps) is traced and written
+   * to this file in the Chrome trace-event format when the transfer finishes
+   */
+  std::string trace_file{""};
+
+  /**
+   * Number of spans kept per thread when tracing, the oldest ones are
+   * overwritten. The first traced transfer of the process sets it
+   */
+  int trace_buffer_events{65536};
+
   /**
    * Interval in milliseconds after which transfer log is written to disk
    */
   int transfer_log_write_interval_ms{100};
 
+  /**
+   * If true, the transfer log is appended to a preallocated memory mapped
+   * region, the receiver threads stage their entries without locking and the
+   * writer thread commits each batch with a single msync
+   */
+  bool transfer_log_mmap{false};
+
+  /**
+   * Bytes by which the memory mapped transfer log is grown at a time
+   */
+  int64_t transfer_log_preallocation_size{4 * 1024 * 1024};
+
+  /**
+   * Number of threads checking the files of the transfer log while it is
+   * parsed for a resumption. The stat of each file created dominates the
+   * parsing of logs with many files.
+   */
+  int transfer_log_parse_threads{8};
+
+  /**
+   * Interval in milliseconds at which the writer thread checks whether to
+   * compact the transfer log while the transfer runs. The log is compacted
+   * once it has doubled since the last compaction. 0 disables it.
+   */
+  int transfer_log_compaction_interval_ms{0};
+
   /**
    * If true, compact transfer log if transfer finishes successfully
    */
@@ -307,11 +424,220 @@ class WdtOptions {
    */
   int namespace_receiver_limit{1};
 
+  /**
+   * Average rate in mbytes/sec shared by all the transfers of a namespace of
+   * the resource controller, on top of the global avg_mbytes_per_sec. Specify
+   * as <= 0 for no namespace limit
+   */
+  double namespace_avg_mbytes_per_sec{-1};
+
+  /**
+   * Peak rate in mbytes/sec shared by all the transfers of a namespace of
+   * the resource controller. Specify as <= 0 for no namespace peak limit
+   */
+  double namespace_max_mbytes_per_sec{-1};
+
+  /**
+   * Average rate in mbytes/sec of each transfer created by the resource
+   * controller, within the limits of its namespace. Specify as <= 0 for no
+   * per transfer limit
+   */
+  double transfer_avg_mbytes_per_sec{-1};
+
+  /**
+   * Peak rate in mbytes/sec of each transfer created by the resource
+   * controller. Specify as <= 0 for no per transfer peak limit
+   */
+  double transfer_max_mbytes_per_sec{-1};
+
+  /**
+   * If > 0, interval in milliseconds at which the resource controller shares
+   * the global average rate (avg_mbytes_per_sec) between the active transfers
+   * by weight: namespaces by their weight, then the transfers of a namespace
+   * by theirs (1 by default, @see WdtResourceController::setTransferWeight).
+   * The rate a transfer doesn't use goes to the others. 0 lets the transfers
+   * take the global rate first come first served
+   */
+  int fair_share_interval_millis{0};
+
+  /**
+   * If > 0, the receivers created by the resource controller run their ports
+   * on a shared pool of that many threads, parking idle connections on epoll,
+   * instead of a thread per port
+   */
+  int receiver_runtime_threads{0};
+
+  /**
+   * If > 0, the senders created by the resource controller run their ports
+   * on a shared pool of that many threads, parking the connections waiting
+   * for the receiver on epoll, instead of a thread per port
+   */
+  int sender_runtime_threads{0};
+
+  /**
+   * Max number of threads the transfers of a namespace of the resource
+   * controller run on, 0 to disable the limit. A transfer with threads of
+   * its own counts one per port and is refused with QUOTA_EXCEEDED past the
+   * limit. The transfers on the shared runtimes (receiver_runtime_threads,
+   * sender_runtime_threads) have no threads of their own, at most that many
+   * of the threads of a runtime run the transfers of a namespace at once,
+   * and the others run the other namespaces meanwhile.
+   */
+  int namespace_thread_limit{0};
+
+  /**
+   * Max number of ports the process keeps listening on once their receivers
+   * are done, for the next receivers to reuse, 0 to close them
+   */
+  int listen_socket_pool_size{0};
+
+  /**
+   * Max memory in mbytes of the buffers of the transfers of the process, 0
+   * to disable the buffer pool. If set, the threads take their buffers from a
+   * process wide pool which keeps them for the next transfers once theirs are
+   * done, and the resource controller refuses with QUOTA_EXCEEDED the
+   * transfers whose buffers (buffer_size per port) would exceed the cap
+   */
+  int buffer_pool_max_mbytes{0};
+
+  /**
+   * Allocate the buffers of the threads on huge pages: explicit ones if the
+   * buffer size is a multiple of 2MB and some are reserved, transparent ones
+   * otherwise. buffer_size has to be a multiple of 2MB for the buffers to be
+   * backed by huge pages, the perf stats report how many bytes actually are
+   */
+  bool buffer_huge_pages{false};
+
   /**
    * Read files in O_DIRECT
    */
   bool odirect_reads{false};
 
+  /**
+   * Receiver writes files in O_DIRECT, for blocks aligned to the disk block
+   * size. Falls back to buffered writes if the filesystem refuses O_DIRECT.
+   */
+  bool odirect_writes{false};
+
+  /**
+   * If > 0, the sender prefetches the next blocks of the queue into the page
+   * cache with fadvise, keeping at most that many mbytes prefetched and not
+   * read yet. Ignored for odirect_reads
+   */
+  int64_t prefetch_mbytes{0};
+
+  /**
+   * If true, sender reads files using io_uring, keeping up to
+   * io_uring_queue_depth reads in flight per thread. Falls back to pread if
+   * io_uring is not supported by the kernel.
+   */
+  bool io_uring_reads{false};
+
+  /**
+   * Number of io_uring requests in flight per thread. The thread buffer is
+   * split evenly between them, so buffer_size should be scaled accordingly.
+   */
+  int io_uring_queue_depth{4};
+
+  /**
+   * If true, receiver writes blocks larger than buffer_size using io_uring,
+   * receiving the next chunks while the previous ones are written. Falls back
+   * to blocking writes if io_uring is not supported by the kernel.
+   */
+  bool io_uring_writes{false};
+
+  /**
+   * Number of extra buffers each receiver thread writes from when
+   * io_uring_writes is set, at most io_uring_queue_depth are in flight
+   */
+  int io_uring_write_buffers{4};
+
+  /**
+   * Number of threads the receiver hands file data off to for writing, so
+   * that sockets keep being read while the disks catch up. They also verify
+   * the crc32c checksums of the blocks large enough to be handed off. 0
+   * disables it, data is then written by the thread receiving it.
+   */
+  int disk_writer_threads{0};
+
+  /**
+   * Max memory used for the data waiting to be written by the disk writer
+   * threads. Receiver threads stop reading their sockets when it is hit.
+   */
+  int disk_writer_memory_mb{256};
+
+  /**
+   * If > 0, at most that many disk writer threads write to one destination
+   * device at a time, the others write the data of other devices. Only used
+   * with disk_writer_threads.
+   */
+  int max_writers_per_device{0};
+
+  /**
+   * If true, the receiver advertises to the sender the rate its disks can
+   * sustain when they fall behind, instead of stalling its sockets. Senders
+   * always follow the rates advertised.
+   */
+  bool receiver_backpressure{false};
+
+  /**
+   * Interval at which the receiver updates the rate it advertises, and at
+   * which the sender looks for it
+   */
+  int backpressure_interval_millis{500};
+
+  /**
+   * Average time receiver threads can be blocked in a disk write before the
+   * disks are considered to fall behind
+   */
+  int backpressure_max_write_latency_millis{50};
+
+  /**
+   * If true, receiver reads of cmds stop shortly after the cmd, so that file
+   * data is received directly in the write buffers (asynchronous writes or
+   * O_DIRECT staging) instead of the cmd buffer. The last chunk of a block
+   * and the start of the next cmd are received with a single readv.
+   */
+  bool vectored_receive{false};
+
+  /**
+   * Max number of fds each thread keeps open, so that the next blocks of a
+   * file sent or received by the same thread don't reopen it. 0 disables it.
+   */
+  int fd_cache_size{0};
+
+  /**
+   * Number of extra buffers each sender thread uses to read the next chunks,
+   * from a background thread, while the current one is written to the socket.
+   * 0 disables the read ahead, otherwise it should be at least 2.
+   */
+  int read_ahead_buffers{0};
+
+  /**
+   * If true, sender uses sendfile to send file data straight from the page
+   * cache when the transfer is neither checksummed nor encrypted in user
+   * space (see ktls). Read ahead is not used in that case.
+   */
+  bool zero_copy_send{false};
+
+  /**
+   * If true, large socket writes use MSG_ZEROCOPY on linux, so that the
+   * kernel sends the data from the user buffers without copying it. A buffer
+   * is only reused once the data is acked, so this works best with large
+   * buffer_size and read_ahead_buffers.
+   */
+  bool zero_copy_writes{false};
+
+  /**
+   * Max size of a cmd batching many small files together, 0 disables
+   * batching. Must not exceed the receiver buffer_size, capped to
+   * Protocol::kMaxFileBatchLen.
+   */
+  int small_file_batch_bytes{0};
+
+  /// Blocks of at most this size are batched when small_file_batch_bytes > 0
+  int small_file_max_bytes{4 * 1024};
+
   /**
    * If true, files are not pre-allocated using posix_fallocate.
    * This flag should not be used directly by wdt code. It should be accessed
@@ -319,6 +645,44 @@ class WdtOptions {
    */
   bool disable_preallocation{false};
 
+  /**
+   * If true, receiver only sets the size of new files before writing them,
+   * the space is allocated by a background thread. Receiver threads then
+   * don't stall on fallocate, neither for the first block of a file nor
+   * while waiting for another thread to allocate it.
+   */
+  bool background_allocation{false};
+
+  /**
+   * If true, the sender sends the name, size and seq-id of the files as soon
+   * as they are discovered, ahead of their data. The receiver then creates
+   * their directory and allocates them in the background.
+   */
+  bool stream_manifest{false};
+
+  /// Number of receiver threads preparing the files announced by the sender
+  /// manifest, 0 to ignore the manifest
+  int manifest_prepare_threads{4};
+
+  /**
+   * If > 0, each preparing thread takes consecutive files of the manifest
+   * till they add up to that many mbytes and allocates them back to back, so
+   * that their extents stay contiguous instead of being interleaved with the
+   * files of the other threads.
+   */
+  int manifest_prepare_batch_mb{0};
+
+  /**
+   * If true, the receiver checks that the destination has room for the total
+   * size announced by the sender, and aborts the transfer with NO_SPACE if it
+   * hasn't, instead of failing with a write error once the disk is full.
+   */
+  bool check_free_space{false};
+
+  /// Space in mbytes that the transfer must leave free on the destination,
+  /// when check_free_space is set
+  int free_space_margin_mb{0};
+
   /**
    * If true, destination directory tree is trusted during resumption. So, only
    * the remaining portion of the files are transferred. This is only supported
@@ -326,6 +690,29 @@ class WdtOptions {
    */
   bool resume_using_dir_tree{false};
 
+  /**
+   * If > 0, resumption compares the files block by block: the receiver sends a
+   * hash of each of its blocks of that many kbytes and the sender only sends
+   * the blocks whose content differs, so that files modified in place or
+   * appended to only cost their changed blocks. 0 disables it.
+   */
+  int64_t delta_resumption_block_kbytes{0};
+
+  /**
+   * Number of threads hashing the blocks for delta resumption, on the
+   * receiver and on the sender. 0 uses num_ports threads. The blocks are read
+   * with odirect_reads and dropped from the page cache unless skip_fadvise
+   */
+  int delta_resumption_threads{0};
+
+  /**
+   * Verification mode, to run once a transfer is done: both sides hash the
+   * blocks of their files in parallel, only the hashes are sent and the
+   * blocks which differ are sent again. Sets up directory tree based
+   * resumption with delta resumption, for the options not specified
+   */
+  bool verify{false};
+
   /**
    * If > 0 will open up to that number of files during discovery
    * if 0 will not open any file during discovery
@@ -334,6 +721,107 @@ class WdtOptions {
    */
   int open_files_during_discovery{0};
 
+  /**
+   * Number of threads exploring the source directory tree. With more than one
+   * thread, directories are explored in parallel with work stealing, which
+   * helps for large trees on high latency filesystems. Also used by the
+   * receiver to scan the destination directory for resume_using_dir_tree.
+   */
+  int num_discovery_threads{1};
+
+  /**
+   * If not empty, path of the sender discovery index. After a successful send,
+   * size, mtime and inode of all the files are saved there. The next send of
+   * the same directory skips the files which did not change, so it must only
+   * be used when the destination keeps the files of the previous send.
+   */
+  std::string discovery_index_path{""};
+
+  /**
+   * If set, sender journal of the files discovered and of the blocks acked by
+   * the receiver. A sender restarted with the same journal skips the
+   * discovery and the files fully acked by the previous run, the source tree
+   * must not change in between. The journal is removed once the transfer
+   * succeeds.
+   */
+  std::string sender_journal_path{""};
+
+  /**
+   * Number of shards of the sender source queue, each with its own lock. 0
+   * uses one shard per port. Ordering of the sources is only approximate with
+   * more than one shard.
+   */
+  int source_queue_shards{1};
+
+  /**
+   * If true, the sender reads files in the order of their location on disk
+   * (FIEMAP, or inode number when not available) instead of by decreasing
+   * size. Helps on rotational disks. Each file is opened once during
+   * discovery to find its location.
+   */
+  bool disk_order_reads{false};
+
+  /**
+   * If > 0, the sender tags each file with the device it lives on and at most
+   * that many threads read from one device at a time, each thread going to
+   * the device with the fewest readers, so that sources spread over several
+   * disks are read from all of them. The source queue then has at least one
+   * shard per port, the sources of a device going to one shard. 0 disables
+   * it.
+   */
+  int max_readers_per_device{0};
+
+  /**
+   * If true and block mode is enabled, block sizes are picked (between 1 and
+   * 256 Mbytes) from the total size discovered and the number of ports, and
+   * the last blocks are split so that all the threads finish together.
+   */
+  bool adaptive_block_size{false};
+
+  /**
+   * If > 0, blocks of at least twice this size are sent in segments of this
+   * size (each one a block of its own on the wire), and a sender thread left
+   * with nothing to send steals the second half of the segments not sent yet
+   * of the block of another thread. This keeps one slow connection from
+   * holding the end of the transfer. Only for the files read by wdt
+   */
+  int64_t steal_segment_mbytes{0};
+
+  /**
+   * If true, holes of sparse files are found using SEEK_DATA/SEEK_HOLE and
+   * only the data is sent. Receivers supporting it do not preallocate those
+   * files, so that the holes are recreated.
+   */
+  bool sparse_files{false};
+
+  /**
+   * Directory of the spool files of the sources read as streams of unknown
+   * size (pipes, sockets). The data read is kept there till the end of the
+   * transfer, so that its blocks can be sent again.
+   */
+  std::string stream_spool_dir{"/tmp"};
+
+  /**
+   * Max size of the data of the spool files not acknowledged by the receiver
+   * yet, a stream fails past it. The data acknowledged is freed from the spool
+   * files. 0 for no limit
+   */
+  int64_t stream_spool_max_mbytes{0};
+
+  /**
+   * Cpus the sender and receiver threads are pinned to, in the sysfs cpulist
+   * format (e.g. "0-7,16-23"), their buffers are allocated on the numa node of
+   * those cpus. "auto" uses the cpus of the numa node of numa_interface.
+   * Threads are not pinned if empty.
+   */
+  std::string thread_cpu_list{""};
+
+  /**
+   * Network interface whose numa node is used when thread_cpu_list is "auto".
+   * If empty, the first interface attached to a numa node is used.
+   */
+  std::string numa_interface{""};
+
   /**
    * If true, wdt can overwrite existing files
    */
@@ -357,6 +845,57 @@ class WdtOptions {
    */
   int encryption_tag_interval_bytes{4 * 1024 * 1024};
 
+  /**
+   * If true and the encryption type is aes128gcm, the crypto of the data
+   * written is done by the kernel (kernel tls), which also lets zero copy
+   * send work with encryption. Falls back to user space encryption when the
+   * kernel has no tls support. The peer needs kernel tls to read the data,
+   * whatever its own setting
+   */
+  bool ktls{false};
+
+  /**
+   * If true, the user space encryption and decryption of each connection run
+   * on a crypto worker thread, chunk by chunk, overlapping with the socket io
+   * of the connection. The cipher stream, tags and iv changes are unchanged
+   */
+  bool encryption_pipeline{false};
+
+  /**
+   * Size of the chunks handed to the crypto worker. Smaller buffers are
+   * processed inline
+   */
+  int encryption_pipeline_chunk_kbytes{64};
+
+  /**
+   * Compression of the block data by the sender: none, lz4 or zstd. Only
+   * used if the receiver protocol version supports it, and the receiver must
+   * be built with the same library. Compression is turned off while the data
+   * does not compress well, see compression_min_savings_percent
+   */
+  std::string compression{"none"};
+
+  /// Compression level for zstd, acceleration for lz4 (higher is faster)
+  int compression_level{1};
+
+  /**
+   * Percentage of the size of the data compression must save for a thread
+   * to keep compressing. Below it, the thread sends the data uncompressed and
+   * only tries again on a sample from time to time
+   */
+  int compression_min_savings_percent{10};
+
+  /**
+   * If true, the sender hashes the files of the same size (SHA-256) and sends
+   * a file identical to one already queued as a duplicate of it, without its
+   * data. The receiver copies the original once the transfer is done, with a
+   * reflink where the filesystem supports it
+   */
+  bool dedup_files{false};
+
+  /// Files smaller than this are always sent, not worth hashing
+  int64_t dedup_min_file_kbytes{64};
+
   /**
    * send buffer size for Sender. If < = 0, buffer size is not set
    */
@@ -367,6 +906,100 @@ class WdtOptions {
    */
   int receive_buffer_size{0};
 
+  /**
+   * tcp congestion control algorithm of the sockets used in transfers, e.g
+   * bbr for long-haul links. If empty, the kernel default is used
+   */
+  std::string tcp_congestion_control{""};
+
+  /**
+   * If true, the data the sender writes goes over rdma (verbs) instead of
+   * tcp, written by the sender straight into buffers of the receiver. The
+   * tcp connection is still used to setup the rdma connection and for the
+   * replies of the receiver. Must be set on both sides; a side whose build or
+   * host has no rdma makes both fallback to tcp
+   */
+  bool rdma_transport{false};
+
+  /// rdma device to use, e.g mlx5_0. If empty, the first one found
+  std::string rdma_device{""};
+
+  /// index of the gid of the rdma port, used with RoCE
+  int rdma_gid_index{0};
+
+  /**
+   * Size of the rdma buffer of each connection, the sender writes at most
+   * this many bytes not yet read by the receiver
+   */
+  int64_t rdma_buffer_mbytes{8};
+
+  /**
+   * If true, the data the sender writes goes through a ring in shared memory
+   * when the receiver is on the same host, tcp still carrying the setup and
+   * the replies. Must be set on both sides, falls back to tcp across hosts.
+   * Ignored if rdma_transport is set
+   */
+  bool shm_transport{false};
+
+  /**
+   * Directory the receiver creates its shm rings in (e.g. a /dev/shm shared
+   * by containers). If empty, the rings are memfds the sender opens through
+   * /proc, which requires seeing the processes of the receiver
+   */
+  std::string shm_transport_dir{""};
+
+  /// Size of the shm ring of each connection
+  int64_t shm_buffer_mbytes{8};
+
+  /**
+   * If true, the send and receive buffers of each connection are grown after
+   * the settings exchange to the bandwidth delay product of the measured rtt
+   * and auto_buffer_target_mbytes_per_sec. A buffer is only set when that
+   * size exceeds the autotuned one and fits under net.core.wmem_max or
+   * rmem_max. Explicitly set send_buffer_size and receive_buffer_size take
+   * precedence
+   */
+  bool auto_buffer_size{false};
+
+  /**
+   * Target rate of each connection used to size the buffers when
+   * auto_buffer_size is set
+   */
+  double auto_buffer_target_mbytes_per_sec{200};
+
+  /**
+   * Max buffer size set by auto_buffer_size. If <= 0, only the kernel limits
+   * apply
+   */
+  int64_t auto_buffer_max_size{64 * 1024 * 1024};
+
+  /**
+   * Interval at which each thread samples TCP_INFO of its connection (rtt,
+   * cwnd, retransmits, delivery and pacing rates) into its stats. 0 to not
+   * sample
+   */
+  int32_t tcp_info_sample_interval_millis{1000};
+
+  /**
+   * If true, sender starts with auto_scale_min_connections connections and
+   * adds or retires connections during the transfer, using the measured
+   * throughput and tcp rtt. The ports advertised by the receiver are the max.
+   */
+  bool auto_scale_connections{false};
+
+  /// Number of connections an auto scaled transfer starts with, and min number
+  /// of connections it keeps
+  int auto_scale_min_connections{2};
+
+  /// Interval between two auto scaling decisions
+  int auto_scale_interval_millis{2000};
+
+  /**
+   * Connections with a smaller average rtt are considered local: instead of
+   * adding connections, connections are retired while throughput holds
+   */
+  int auto_scale_lan_rtt_micros{2000};
+
   /**
    * If true, extra files on the receiver side is deleted during resumption
    */
@@ -419,6 +1052,21 @@ class WdtOptions {
    */
   ThrottlerOptions getThrottlerOptions() const;
 
+  /**
+   * @return    how the blocks are read for delta resumption
+   */
+  DeltaReadOptions getDeltaReadOptions() const;
+
+  /**
+   * @return    options of the throttler shared by the transfers of a namespace
+   */
+  ThrottlerOptions getNamespaceThrottlerOptions() const;
+
+  /**
+   * @return    options of the throttler of a single transfer of a namespace
+   */
+  ThrottlerOptions getTransferThrottlerOptions() const;
+
   // NOTE: any option added here should also be added to util/WdtFlags.cpp.inc
 
   /**
@@ -8,26 +8,198 @@
  */
 #include <wdt/WdtResourceController.h>
 
+#include <iomanip>
+#include <sstream>
+
 using namespace std;
 const int64_t kDelTimeToSleepMillis = 100;
 
 namespace facebook {
 namespace wdt {
 
+namespace {
+/// a metric of the transfers of a namespace, one sample per direction
+struct TransferMetricType {
+  const char *name;
+  const char *help;
+  double (*get)(const TransferMetrics &metrics);
+};
+
+const TransferMetricType kTransferMetricTypes[] = {
+    {"wdt_ongoing_transfers", "Transfers whose threads are running",
+     [](const TransferMetrics &m) -> double { return m.numOngoing; }},
+    {"wdt_failed_transfers", "Transfers not released yet with an error",
+     [](const TransferMetrics &m) -> double { return m.numFailed; }},
+    {"wdt_data_bytes", "Data bytes transferred",
+     [](const TransferMetrics &m) -> double { return m.dataBytes; }},
+    {"wdt_effective_data_bytes", "Data bytes of the blocks acknowledged",
+     [](const TransferMetrics &m) -> double { return m.effectiveDataBytes; }},
+    {"wdt_files", "Files transferred",
+     [](const TransferMetrics &m) -> double { return m.numFiles; }},
+    {"wdt_failed_attempts", "Failed attempts to transfer a source",
+     [](const TransferMetrics &m) -> double { return m.failedAttempts; }},
+    {"wdt_throughput_mbytes_per_second",
+     "Average effective throughput of the ongoing transfers",
+     [](const TransferMetrics &m) -> double { return m.throughputMBps; }},
+};
+
+/// @return   value escaped for a label of the Prometheus text format
+string escapePrometheusLabel(const string &value) {
+  string escaped;
+  for (char c : value) {
+    if (c == '\\' || c == '"') {
+      escaped.push_back('\\');
+      escaped.push_back(c);
+    } else if (c == '\n') {
+      escaped.append("\\n");
+    } else {
+      escaped.push_back(c);
+    }
+  }
+  return escaped;
+}
+
+/// @return   value as a json string, with the quotes
+string toJsonString(const string &value) {
+  std::ostringstream os;
+  os << '"';
+  for (char c : value) {
+    if (c == '\\' || c == '"') {
+      os << '\\' << c;
+    } else if ((unsigned char)c < 0x20) {
+      os << "\\u" << std::hex << std::setw(4) << std::setfill('0') << (int)c
+         << std::dec;
+    } else {
+      os << c;
+    }
+  }
+  os << '"';
+  return os.str();
+}
+
+void printGauge(std::ostream &os, const char *name, const char *help) {
+  os << "# HELP " << name << " " << help << "\n";
+  os << "# TYPE " << name << " gauge\n";
+}
+
+void printTransferMetricsJson(std::ostream &os,
+                              const TransferMetrics &metrics) {
+  os << "{\"numOngoing\":" << metrics.numOngoing
+     << ",\"numFailed\":" << metrics.numFailed
+     << ",\"dataBytes\":" << metrics.dataBytes
+     << ",\"effectiveDataBytes\":" << metrics.effectiveDataBytes
+     << ",\"numFiles\":" << metrics.numFiles
+     << ",\"failedAttempts\":" << metrics.failedAttempts
+     << ",\"queuedSources\":" << metrics.queuedSources
+     << ",\"queuedBytes\":" << metrics.queuedBytes
+     << ",\"throughputMBps\":" << metrics.throughputMBps << "}";
+}
+}
+
+string WdtMetrics::toPrometheus() const {
+  std::ostringstream os;
+  os << std::setprecision(15);
+  printGauge(os, "wdt_transfers", "Transfers not released yet");
+  for (const auto &ns : namespaces) {
+    const string label = escapePrometheusLabel(ns.wdtNamespace);
+    os << "wdt_transfers{namespace=\"" << label << "\",direction=\"send\"} "
+       << ns.numSenders << "\n";
+    os << "wdt_transfers{namespace=\"" << label
+       << "\",direction=\"receive\"} " << ns.numReceivers << "\n";
+  }
+  for (const auto &type : kTransferMetricTypes) {
+    printGauge(os, type.name, type.help);
+    for (const auto &ns : namespaces) {
+      const string label = escapePrometheusLabel(ns.wdtNamespace);
+      os << type.name << "{namespace=\"" << label << "\",direction=\"send\"} "
+         << type.get(ns.sent) << "\n";
+      os << type.name << "{namespace=\"" << label
+         << "\",direction=\"receive\"} " << type.get(ns.received) << "\n";
+    }
+  }
+  printGauge(os, "wdt_queued_sources", "Sources discovered not sent yet");
+  for (const auto &ns : namespaces) {
+    os << "wdt_queued_sources{namespace=\""
+       << escapePrometheusLabel(ns.wdtNamespace) << "\"} "
+       << ns.sent.queuedSources << "\n";
+  }
+  printGauge(os, "wdt_queued_bytes", "Bytes of the sources not sent yet");
+  for (const auto &ns : namespaces) {
+    os << "wdt_queued_bytes{namespace=\""
+       << escapePrometheusLabel(ns.wdtNamespace) << "\"} "
+       << ns.sent.queuedBytes << "\n";
+  }
+  // the samples without a namespace are the ones of the global throttler
+  printGauge(os, "wdt_throttler_avg_rate_bytes_per_second",
+             "Average rate of the throttler");
+  os << "wdt_throttler_avg_rate_bytes_per_second " << throttlerAvgRatePerSec
+     << "\n";
+  for (const auto &ns : namespaces) {
+    os << "wdt_throttler_avg_rate_bytes_per_second{namespace=\""
+       << escapePrometheusLabel(ns.wdtNamespace) << "\"} "
+       << ns.throttlerAvgRatePerSec << "\n";
+  }
+  printGauge(os, "wdt_throttler_peak_rate_bytes_per_second",
+             "Peak rate of the throttler");
+  os << "wdt_throttler_peak_rate_bytes_per_second " << throttlerPeakRatePerSec
+     << "\n";
+  for (const auto &ns : namespaces) {
+    os << "wdt_throttler_peak_rate_bytes_per_second{namespace=\""
+       << escapePrometheusLabel(ns.wdtNamespace) << "\"} "
+       << ns.throttlerPeakRatePerSec << "\n";
+  }
+  return os.str();
+}
+
+string WdtMetrics::toJson() const {
+  std::ostringstream os;
+  os << std::setprecision(15);
+  os << "{\"throttlerAvgRatePerSec\":" << throttlerAvgRatePerSec
+     << ",\"throttlerPeakRatePerSec\":" << throttlerPeakRatePerSec
+     << ",\"namespaces\":[";
+  for (size_t i = 0; i < namespaces.size(); i++) {
+    const NamespaceMetrics &ns = namespaces[i];
+    if (i > 0) {
+      os << ",";
+    }
+    os << "{\"namespace\":" << toJsonString(ns.wdtNamespace)
+       << ",\"numSenders\":" << ns.numSenders
+       << ",\"numReceivers\":" << ns.numReceivers
+       << ",\"throttlerAvgRatePerSec\":" << ns.throttlerAvgRatePerSec
+       << ",\"throttlerPeakRatePerSec\":" << ns.throttlerPeakRatePerSec
+       << ",\"sent\":";
+    printTransferMetricsJson(os, ns.sent);
+    os << ",\"received\":";
+    printTransferMetricsJson(os, ns.received);
+    os << "}";
+  }
+  os << "]}";
+  return os.str();
+}
+
 const char *const WdtResourceController::kGlobalNamespace("Global");
 
+bool WdtControllerBase::addWithinLimit(std::atomic<int64_t> &count,
+                                       int64_t max, int64_t delta) {
+  int64_t current = count.load();
+  do {
+    if (max > 0 && delta > 0 && current + delta > max) {
+      return false;
+    }
+  } while (!count.compare_exchange_weak(current, current + delta));
+  return true;
+}
+
 void WdtControllerBase::updateMaxReceiversLimit(int64_t maxNumReceivers) {
-  GuardLock lock(controllerMutex_);
   maxNumReceivers_ = maxNumReceivers;
   WLOG(INFO) << "Updated max number of receivers for " << controllerName_
-             << " to " << maxNumReceivers_;
+             << " to " << maxNumReceivers;
 }
 
 void WdtControllerBase::updateMaxSendersLimit(int64_t maxNumSenders) {
-  GuardLock lock(controllerMutex_);
   maxNumSenders_ = maxNumSenders;
   WLOG(INFO) << "Updated max number of senders for " << controllerName_
-             << " to " << maxNumSenders_;
+             << " to " << maxNumSenders;
 }
 
 WdtControllerBase::WdtControllerBase(const string &controllerName) {
@@ -40,13 +212,260 @@ WdtNamespaceController::WdtNamespaceController(
   auto &options = parent_->getOptions();
   updateMaxSendersLimit(options.namespace_sender_limit);
   updateMaxReceiversLimit(options.namespace_receiver_limit);
+  updateMaxThreadsLimit(options.namespace_thread_limit);
+  throttler_ = Throttler::makeThrottler(options.getNamespaceThrottlerOptions(),
+                                        parent_->getWdtThrottler());
+  rateScheduler_ = std::make_unique<RateScheduler>(throttler_);
+}
+
+void WdtNamespaceController::updateMaxThreadsLimit(int64_t maxNumThreads) {
+  maxNumThreads_ = maxNumThreads;
+  // the transfers of the namespace are the tasks of its group
+  for (auto runtime :
+       {parent_->getReceiverRuntime(), parent_->getSenderRuntime()}) {
+    if (runtime) {
+      runtime->setGroupLimit(controllerName_, static_cast<int>(maxNumThreads));
+    }
+  }
+  WLOG(INFO) << "Updated max number of threads for " << controllerName_
+             << " to " << maxNumThreads;
+}
+
+bool WdtNamespaceController::reserveBuffers(
+    const WdtTransferRequest &request, TransferResources &resources) const {
+  const auto &options = parent_->getOptions();
+  if (options.buffer_pool_max_mbytes <= 0) {
+    return true;
+  }
+  const int64_t numBytes = request.ports.size() * options.buffer_size;
+  resources.bufferReservation = BufferPool::get().reserve(
+      numBytes, options.buffer_pool_max_mbytes * kMbToB);
+  if (!resources.bufferReservation) {
+    WLOG(WARNING) << "Exceeded the memory of the buffers for "
+                  << controllerName_ << " requested " << numBytes;
+    return false;
+  }
+  return true;
+}
+
+bool WdtNamespaceController::hasThreadQuota(int64_t numThreads) const {
+  const int64_t numUsed = numThreads_;
+  const int64_t maxNumThreads = maxNumThreads_;
+  if (maxNumThreads > 0 && numThreads > 0 &&
+      numUsed + numThreads > maxNumThreads) {
+    WLOG(WARNING) << "Exceeded number of threads for " << controllerName_
+                  << " Max number of threads " << maxNumThreads << " used "
+                  << numUsed << " requested " << numThreads;
+    return false;
+  }
+  return true;
+}
+
+bool WdtNamespaceController::acquireQuota(const WdtTransferRequest &request,
+                                          const char *kind,
+                                          std::atomic<int64_t> &numTransfers,
+                                          int64_t maxNumTransfers,
+                                          TransferResources &resources) {
+  if (!addWithinLimit(numTransfers, maxNumTransfers, 1)) {
+    WLOG(WARNING) << "Exceeded number of " << kind << " for "
+                  << controllerName_ << " Max number of " << kind << " "
+                  << maxNumTransfers;
+    return false;
+  }
+  if (!addWithinLimit(numThreads_, maxNumThreads_, resources.numThreads)) {
+    WLOG(WARNING) << "Exceeded number of threads for " << controllerName_
+                  << " Max number of threads " << maxNumThreads_
+                  << " requested " << resources.numThreads;
+    --numTransfers;
+    return false;
+  }
+  if (!reserveBuffers(request, resources)) {
+    numThreads_ -= resources.numThreads;
+    --numTransfers;
+    return false;
+  }
+  return true;
+}
+
+template <typename T>
+ErrorCode WdtNamespaceController::addTransfer(
+    TransferMap<T> &transfers, std::atomic<int64_t> &numTransfers,
+    const std::string &identifier, TransferEntry<T> &entry) {
+  std::shared_ptr<T> existing;
+  transfers.update(identifier, [&](typename TransferMap<T>::Map &map) {
+    auto it = map.find(identifier);
+    if (it != map.end()) {
+      existing = it->second.transfer;
+      return;
+    }
+    const std::shared_ptr<T> transfer = entry.transfer;
+    map.emplace(identifier, std::move(entry));
+    entry.transfer = transfer;
+  });
+  if (existing) {
+    // created concurrently with the same identifier, the resources of entry
+    // are given back by the caller, with no lock held
+    numThreads_ -= entry.resources.numThreads;
+    --numTransfers;
+    entry.transfer = std::move(existing);
+    return ALREADY_EXISTS;
+  }
+  return OK;
+}
+
+template <typename T>
+std::shared_ptr<T> WdtNamespaceController::findTransfer(
+    const TransferMap<T> &transfers, const std::string &identifier) const {
+  std::shared_ptr<T> transfer;
+  transfers.find(identifier, [&transfer](const TransferEntry<T> &entry) {
+    transfer = entry.transfer;
+  });
+  return transfer;
+}
+
+template <typename T>
+std::shared_ptr<T> WdtNamespaceController::removeTransfer(
+    TransferMap<T> &transfers, std::atomic<int64_t> &numTransfers,
+    const std::string &identifier) {
+  TransferEntry<T> entry;
+  transfers.update(identifier, [&](typename TransferMap<T>::Map &map) {
+    auto it = map.find(identifier);
+    if (it != map.end()) {
+      entry = std::move(it->second);
+      map.erase(it);
+    }
+  });
+  if (entry.transfer) {
+    numThreads_ -= entry.resources.numThreads;
+    --numTransfers;
+  }
+  return entry.transfer;
+}
+
+template <typename T>
+int64_t WdtNamespaceController::removeAllTransfers(
+    TransferMap<T> &transfers, std::atomic<int64_t> &numTransfers) {
+  // the transfers are deleted once the shards are unlocked
+  vector<typename TransferMap<T>::Map> removed;
+  int64_t numRemoved = 0;
+  transfers.updateEachShard([&](typename TransferMap<T>::Map &map) {
+    for (const auto &it : map) {
+      numThreads_ -= it.second.resources.numThreads;
+    }
+    numRemoved += map.size();
+    removed.emplace_back();
+    removed.back().swap(map);
+  });
+  numTransfers -= numRemoved;
+  return numRemoved;
+}
+
+template <typename T>
+std::vector<std::string> WdtNamespaceController::removeStaleTransfers(
+    TransferMap<T> &transfers, std::atomic<int64_t> &numTransfers) {
+  vector<pair<string, std::shared_ptr<T>>> candidates;
+  transfers.forEach([&candidates](const string &identifier,
+                                  const TransferEntry<T> &entry) {
+    candidates.emplace_back(identifier, entry.transfer);
+  });
+  vector<string> erasedIds;
+  for (const auto &candidate : candidates) {
+    if (!candidate.second->isStale()) {
+      continue;
+    }
+    TransferEntry<T> entry;
+    transfers.update(candidate.first, [&](typename TransferMap<T>::Map &map) {
+      auto it = map.find(candidate.first);
+      // it may have been released and created again since
+      if (it != map.end() && it->second.transfer == candidate.second) {
+        entry = std::move(it->second);
+        map.erase(it);
+      }
+    });
+    if (entry.transfer) {
+      numThreads_ -= entry.resources.numThreads;
+      --numTransfers;
+      erasedIds.push_back(candidate.first);
+    }
+  }
+  return erasedIds;
+}
+
+template <typename T>
+std::vector<std::shared_ptr<T>> WdtNamespaceController::getTransfers(
+    const TransferMap<T> &transfers) const {
+  vector<std::shared_ptr<T>> result;
+  transfers.forEach(
+      [&result](const string & /* unused */, const TransferEntry<T> &entry) {
+        result.push_back(entry.transfer);
+      });
+  return result;
+}
+
+std::shared_ptr<Throttler> WdtNamespaceController::getThrottler() const {
+  return throttler_;
+}
+
+void WdtNamespaceController::updateThrottlerRates(
+    const ThrottlerOptions &throttlerOptions) {
+  rateScheduler_->setRates(throttlerOptions);
+}
+
+void WdtNamespaceController::setRateSchedule(const RateSchedule &schedule) {
+  rateScheduler_->setSchedule(schedule);
+}
+
+std::shared_ptr<Throttler> WdtNamespaceController::makeTransferThrottler(
+    TransferResources &resources) const {
+  const ThrottlerOptions throttlerOptions =
+      parent_->getOptions().getTransferThrottlerOptions();
+  auto scheduler = parent_->getBandwidthScheduler();
+  if (!scheduler && throttlerOptions.avg_rate_per_sec <= 0 &&
+      throttlerOptions.max_rate_per_sec <= 0) {
+    return throttler_;
+  }
+  auto throttler = Throttler::makeThrottler(throttlerOptions, throttler_);
+  if (scheduler) {
+    // the share of the transfer is set on a throttler of its own
+    resources.bandwidthShare =
+        scheduler->addTransfer(throttler, controllerName_);
+  }
+  return throttler;
+}
+
+ErrorCode WdtNamespaceController::setTransferWeight(
+    const std::string &identifier, double weight) {
+  if (!parent_->getBandwidthScheduler()) {
+    WLOG(ERROR) << "Transfer weights need fair_share_interval_millis";
+    return ERROR;
+  }
+  bool found = false;
+  auto setWeight = [weight, &found](const TransferResources &resources) {
+    if (resources.bandwidthShare) {
+      resources.bandwidthShare->setWeight(weight);
+      found = true;
+    }
+  };
+  sendersMap_.find(identifier, [&setWeight](const TransferEntry<Sender> &e) {
+    setWeight(e.resources);
+  });
+  receiversMap_.find(identifier,
+                     [&setWeight](const TransferEntry<Receiver> &e) {
+                       setWeight(e.resources);
+                     });
+  if (!found) {
+    WLOG(ERROR) << "Couldn't find transfer " << identifier << " for "
+                << controllerName_;
+    return NOT_FOUND;
+  }
+  return OK;
 }
 
 bool WdtNamespaceController::hasReceiverQuota() const {
-  GuardLock lock(controllerMutex_);
-  if (numReceivers_ >= maxNumReceivers_ && maxNumReceivers_ > 0) {
+  const int64_t maxNumReceivers = maxNumReceivers_;
+  if (numReceivers_ >= maxNumReceivers && maxNumReceivers > 0) {
     WLOG(WARNING) << "Exceeded number of receivers for " << controllerName_
-                  << " Max number of receivers " << maxNumReceivers_;
+                  << " Max number of receivers " << maxNumReceivers;
     return false;
   }
   return true;
@@ -55,35 +474,40 @@ bool WdtNamespaceController::hasReceiverQuota() const {
 ErrorCode WdtNamespaceController::createReceiver(
     const WdtTransferRequest &request, const string &identifier,
     ReceiverPtr &receiver) {
-  receiver = nullptr;
-  {
-    GuardLock lock(controllerMutex_);
-    // Check for already existing
-    auto it = receiversMap_.find(identifier);
-    if (it != receiversMap_.end()) {
-      WLOG(ERROR) << "Receiver already created for transfer " << identifier;
-      // Return it so the old one can potentially be aborted
-      receiver = it->second;
-      return ALREADY_EXISTS;
-    }
-    // Check for quotas
-    if (!hasReceiverQuota()) {
-      return QUOTA_EXCEEDED;
-    }
-    receiver = make_shared<Receiver>(request);
-    receiver->setThrottler(parent_->getWdtThrottler());
-    receiver->setWdtOptions(parent_->getOptions());
-    receiversMap_[identifier] = receiver;
-    ++numReceivers_;
+  // Check for already existing
+  receiver = findTransfer(receiversMap_, identifier);
+  if (receiver) {
+    WLOG(ERROR) << "Receiver already created for transfer " << identifier;
+    // Return it so the old one can potentially be aborted
+    return ALREADY_EXISTS;
   }
-  return OK;
+  // Check for quotas
+  auto runtime = parent_->getReceiverRuntime();
+  TransferEntry<Receiver> entry;
+  // on the runtime, the ports of the receiver have no threads of their own
+  entry.resources.numThreads = runtime ? 0 : request.ports.size();
+  if (!acquireQuota(request, "receivers", numReceivers_, maxNumReceivers_,
+                    entry.resources)) {
+    return QUOTA_EXCEEDED;
+  }
+  entry.transfer = make_shared<Receiver>(request);
+  entry.transfer->setThrottler(makeTransferThrottler(entry.resources));
+  entry.transfer->setRuntime(runtime, controllerName_);
+  entry.transfer->setWdtOptions(parent_->getOptions());
+  const ErrorCode code =
+      addTransfer(receiversMap_, numReceivers_, identifier, entry);
+  if (code != OK) {
+    WLOG(ERROR) << "Receiver already created for transfer " << identifier;
+  }
+  receiver = entry.transfer;
+  return code;
 }
 
 bool WdtNamespaceController::hasSenderQuota() const {
-  GuardLock lock(controllerMutex_);
-  if (numSenders_ >= maxNumSenders_ && maxNumSenders_ > 0) {
+  const int64_t maxNumSenders = maxNumSenders_;
+  if (numSenders_ >= maxNumSenders && maxNumSenders > 0) {
     WLOG(WARNING) << "Exceeded number of senders for " << controllerName_
-                  << " Max number of senders " << maxNumSenders_;
+                  << " Max number of senders " << maxNumSenders;
     return false;
   }
   return true;
@@ -92,44 +516,43 @@ bool WdtNamespaceController::hasSenderQuota() const {
 ErrorCode WdtNamespaceController::createSender(
     const WdtTransferRequest &request, const string &identifier,
     SenderPtr &sender) {
-  sender = nullptr;
-  {
-    GuardLock lock(controllerMutex_);
-    // Check for already existing
-    auto it = sendersMap_.find(identifier);
-    if (it != sendersMap_.end()) {
-      WLOG(ERROR) << "Sender already created for transfer " << identifier;
-      // Return it so the old one can potentially be aborted
-      sender = it->second;
-      return ALREADY_EXISTS;
-    }
-    /// Check for quotas
-    if (!hasSenderQuota()) {
-      return QUOTA_EXCEEDED;
-    }
-    sender = make_shared<Sender>(request);
-    sender->setThrottler(parent_->getWdtThrottler());
-    sender->setWdtOptions(parent_->getOptions());
-    sendersMap_[identifier] = sender;
-    ++numSenders_;
+  // Check for already existing
+  sender = findTransfer(sendersMap_, identifier);
+  if (sender) {
+    WLOG(ERROR) << "Sender already created for transfer " << identifier;
+    // Return it so the old one can potentially be aborted
+    return ALREADY_EXISTS;
   }
-  return OK;
+  /// Check for quotas
+  auto runtime = parent_->getSenderRuntime();
+  TransferEntry<Sender> entry;
+  // on the runtime, the ports of the sender have no threads of their own
+  entry.resources.numThreads = runtime ? 0 : request.ports.size();
+  if (!acquireQuota(request, "senders", numSenders_, maxNumSenders_,
+                    entry.resources)) {
+    return QUOTA_EXCEEDED;
+  }
+  entry.transfer = make_shared<Sender>(request);
+  entry.transfer->setThrottler(makeTransferThrottler(entry.resources));
+  entry.transfer->setRuntime(runtime, controllerName_);
+  entry.transfer->setWdtOptions(parent_->getOptions());
+  const ErrorCode code =
+      addTransfer(sendersMap_, numSenders_, identifier, entry);
+  if (code != OK) {
+    WLOG(ERROR) << "Sender already created for transfer " << identifier;
+  }
+  sender = entry.transfer;
+  return code;
 }
 
 ErrorCode WdtNamespaceController::releaseReceiver(
     const std::string &identifier) {
-  ReceiverPtr receiver = nullptr;
-  {
-    GuardLock lock(controllerMutex_);
-    auto it = receiversMap_.find(identifier);
-    if (it == receiversMap_.end()) {
-      WLOG(ERROR) << "Couldn't find receiver to release with id " << identifier
-                  << " for " << controllerName_;
-      return NOT_FOUND;
-    }
-    receiver = std::move(it->second);
-    receiversMap_.erase(it);
-    --numReceivers_;
+  ReceiverPtr receiver =
+      removeTransfer(receiversMap_, numReceivers_, identifier);
+  if (!receiver) {
+    WLOG(ERROR) << "Couldn't find receiver to release with id " << identifier
+                << " for " << controllerName_;
+    return NOT_FOUND;
   }
   // receiver will be deleted and logs printed by the destructor
   // if no other thread has the shared pointer, that is...
@@ -138,144 +561,95 @@ ErrorCode WdtNamespaceController::releaseReceiver(
 }
 
 ErrorCode WdtNamespaceController::releaseSender(const std::string &identifier) {
-  SenderPtr sender = nullptr;
-  {
-    GuardLock lock(controllerMutex_);
-    auto it = sendersMap_.find(identifier);
-    if (it == sendersMap_.end()) {
-      WLOG(ERROR) << "Couldn't find sender to release with id " << identifier
-                  << " for " << controllerName_;
-      return NOT_FOUND;
-    }
-    sender = std::move(it->second);
-    sendersMap_.erase(it);
-    --numSenders_;
+  SenderPtr sender = removeTransfer(sendersMap_, numSenders_, identifier);
+  if (!sender) {
+    WLOG(ERROR) << "Couldn't find sender to release with id " << identifier
+                << " for " << controllerName_;
+    return NOT_FOUND;
   }
   WLOG(INFO) << "Released the sender with id " << sender->getTransferId();
   return OK;
 }
 
 int64_t WdtNamespaceController::releaseAllSenders() {
-  vector<SenderPtr> senders;
-  {
-    GuardLock lock(controllerMutex_);
-    for (auto &senderPair : sendersMap_) {
-      senders.push_back(std::move(senderPair.second));
-    }
-    sendersMap_.clear();
-    numSenders_ = 0;
-  }
-  int numSenders = senders.size();
+  int64_t numSenders = removeAllTransfers(sendersMap_, numSenders_);
   WVLOG(1) << "Number of senders released " << numSenders;
   return numSenders;
 }
 
 vector<string> WdtNamespaceController::releaseStaleSenders() {
-  vector<SenderPtr> senders;
-  vector<string> erasedIds;
-  {
-    GuardLock lock(controllerMutex_);
-    for (auto it = sendersMap_.begin(); it != sendersMap_.end();) {
-      auto sender = it->second;
-      string identifier = it->first;
-      if (sender->isStale()) {
-        it = sendersMap_.erase(it);
-        erasedIds.push_back(identifier);
-        senders.push_back(std::move(sender));
-        --numSenders_;
-        continue;
-      }
-      it++;
-    }
-  }
-  WLOG(INFO) << "Cleared " << senders.size() << " stale senders";
+  vector<string> erasedIds = removeStaleTransfers(sendersMap_, numSenders_);
+  WLOG(INFO) << "Cleared " << erasedIds.size() << " stale senders";
   return erasedIds;
 }
 
 int64_t WdtNamespaceController::releaseAllReceivers() {
-  vector<ReceiverPtr> receivers;
-  {
-    GuardLock lock(controllerMutex_);
-    for (auto &receiverPair : receiversMap_) {
-      receivers.push_back(std::move(receiverPair.second));
-    }
-    receiversMap_.clear();
-    numReceivers_ = 0;
-  }
-  int numReceivers = receivers.size();
+  int64_t numReceivers = removeAllTransfers(receiversMap_, numReceivers_);
   WVLOG(1) << "Number of receivers released " << numReceivers;
   return numReceivers;
 }
 
 vector<string> WdtNamespaceController::releaseStaleReceivers() {
-  vector<ReceiverPtr> receivers;
-  vector<string> erasedIds;
-  {
-    GuardLock lock(controllerMutex_);
-    for (auto it = receiversMap_.begin(); it != receiversMap_.end();) {
-      auto receiver = it->second;
-      string identifier = it->first;
-      if (receiver->isStale()) {
-        it = receiversMap_.erase(it);
-        erasedIds.push_back(identifier);
-        receivers.push_back(std::move(receiver));
-        --numReceivers_;
-        continue;
-      }
-      it++;
-    }
-  }
-  WLOG(INFO) << "Cleared " << receivers.size() << "stale receivers";
+  vector<string> erasedIds =
+      removeStaleTransfers(receiversMap_, numReceivers_);
+  WLOG(INFO) << "Cleared " << erasedIds.size() << " stale receivers";
   return erasedIds;
 }
 
 SenderPtr WdtNamespaceController::getSender(const string &identifier) const {
-  GuardLock lock(controllerMutex_);
-  auto it = sendersMap_.find(identifier);
-  if (it == sendersMap_.end()) {
+  SenderPtr sender = findTransfer(sendersMap_, identifier);
+  if (!sender) {
     WLOG(ERROR) << "Couldn't find sender transfer-id " << identifier << " for "
                 << controllerName_;
-    return nullptr;
   }
-  return it->second;
+  return sender;
 }
 
 ReceiverPtr WdtNamespaceController::getReceiver(
     const string &identifier) const {
-  GuardLock lock(controllerMutex_);
-  auto it = receiversMap_.find(identifier);
-  if (it == receiversMap_.end()) {
+  ReceiverPtr receiver = findTransfer(receiversMap_, identifier);
+  if (!receiver) {
     WLOG(ERROR) << "Couldn't find receiver transfer-id " << identifier
                 << " for " << controllerName_;
-    return nullptr;
   }
-  return it->second;
+  return receiver;
 }
 
 vector<SenderPtr> WdtNamespaceController::getSenders() const {
-  vector<SenderPtr> senders;
-  GuardLock lock(controllerMutex_);
-  for (const auto &senderPair : sendersMap_) {
-    senders.push_back(senderPair.second);
-  }
-  return senders;
+  return getTransfers(sendersMap_);
 }
 
 vector<ReceiverPtr> WdtNamespaceController::getReceivers() const {
-  vector<ReceiverPtr> receivers;
-  GuardLock lock(controllerMutex_);
-  for (const auto &receiverPair : receiversMap_) {
-    receivers.push_back(receiverPair.second);
+  return getTransfers(receiversMap_);
+}
+
+NamespaceMetrics WdtNamespaceController::getMetrics() const {
+  NamespaceMetrics metrics;
+  metrics.wdtNamespace = controllerName_;
+  // the transfers are not locked with the controller
+  const vector<SenderPtr> senders = getSenders();
+  const vector<ReceiverPtr> receivers = getReceivers();
+  metrics.numSenders = senders.size();
+  metrics.numReceivers = receivers.size();
+  for (const auto &sender : senders) {
+    metrics.sent += sender->getMetrics();
+  }
+  for (const auto &receiver : receivers) {
+    metrics.received += receiver->getMetrics();
   }
-  return receivers;
+  if (throttler_) {
+    metrics.throttlerAvgRatePerSec = throttler_->getAvgRatePerSec();
+    metrics.throttlerPeakRatePerSec = throttler_->getPeakRatePerSec();
+  }
+  return metrics;
 }
 
 vector<string> WdtNamespaceController::getSendersIds() const {
   vector<string> senderIds;
-  GuardLock lock(controllerMutex_);
-  for (const auto &senderPair : sendersMap_) {
-    senderIds.push_back(senderPair.first);
-  }
+  sendersMap_.forEach([&senderIds](const string &identifier,
+                                   const TransferEntry<Sender> & /* unused */) {
+    senderIds.push_back(identifier);
+  });
   return senderIds;
 }
 
@@ -288,6 +662,31 @@ WdtResourceController::WdtResourceController(const WdtOptions &options)
   updateMaxSendersLimit(options.global_sender_limit);
   updateMaxReceiversLimit(options.global_receiver_limit);
   throttler_ = Throttler::makeThrottler(options.getThrottlerOptions());
+  rateScheduler_ = std::make_unique<RateScheduler>(throttler_);
+  if (options.fair_share_interval_millis > 0) {
+    bandwidthScheduler_ = std::make_shared<BandwidthScheduler>(
+        throttler_, options.fair_share_interval_millis);
+  }
+  if (options.receiver_runtime_threads > 0) {
+    auto runtime =
+        std::make_shared<ReceiverRuntime>(options.receiver_runtime_threads);
+    if (runtime->isValid()) {
+      receiverRuntime_ = std::move(runtime);
+    } else {
+      WLOG(ERROR) << "Unable to create the receiver runtime, receivers will "
+                  << "use a thread per port";
+    }
+  }
+  if (options.sender_runtime_threads > 0) {
+    auto runtime =
+        std::make_shared<ReceiverRuntime>(options.sender_runtime_threads);
+    if (runtime->isValid()) {
+      senderRuntime_ = std::move(runtime);
+    } else {
+      WLOG(ERROR) << "Unable to create the sender runtime, senders will use "
+                  << "a thread per port";
+    }
+  }
 }
 
 WdtResourceController::WdtResourceController()
@@ -302,14 +701,19 @@ WdtResourceController *WdtResourceController::get() {
 void WdtResourceController::shutdown() {
   WLOG(INFO) << "Shutting down the controller (" << numSenders_ << " senders "
              << numReceivers_ << " receivers)";
-  GuardLock lock(controllerMutex_);
-  for (auto &namespaceController : namespaceMap_) {
-    NamespaceControllerPtr controller = namespaceController.second;
+  vector<NamespaceControllerPtr> controllers;
+  namespaceMap_.updateEachShard(
+      [&controllers](unordered_map<string, NamespaceControllerPtr> &map) {
+        for (auto &namespacePair : map) {
+          WVLOG(1) << "Clearing out controller for " << namespacePair.first;
+          controllers.push_back(std::move(namespacePair.second));
+        }
+        map.clear();
+      });
+  for (auto &controller : controllers) {
     numSenders_ -= controller->releaseAllSenders();
     numReceivers_ -= controller->releaseAllReceivers();
-    WVLOG(1) << "Cleared out controller for " << namespaceController.first;
   }
-  namespaceMap_.clear();
   WDT_CHECK_EQ(numReceivers_, 0);
   WDT_CHECK_EQ(numSenders_, 0);
   WVLOG(1) << "Shutdown the wdt resource controller";
@@ -319,10 +723,26 @@ WdtResourceController::~WdtResourceController() {
   shutdown();
 }
 
+WdtMetrics WdtResourceController::getMetrics() const {
+  WdtMetrics metrics;
+  vector<NamespaceControllerPtr> controllers;
+  namespaceMap_.forEach([&controllers](const string & /* unused */,
+                                       const NamespaceControllerPtr &c) {
+    controllers.push_back(c);
+  });
+  for (const auto &controller : controllers) {
+    metrics.namespaces.push_back(controller->getMetrics());
+  }
+  if (throttler_) {
+    metrics.throttlerAvgRatePerSec = throttler_->getAvgRatePerSec();
+    metrics.throttlerPeakRatePerSec = throttler_->getPeakRatePerSec();
+  }
+  return metrics;
+}
+
 ErrorCode WdtResourceController::getCounts(int32_t &numNamespaces,
                                            int32_t &numSenders,
                                            int32_t &numReceivers) {
-  GuardLock lock(controllerMutex_);
   numSenders = numSenders_;
   numReceivers = numReceivers_;
   numNamespaces = namespaceMap_.size();
@@ -337,7 +757,6 @@ bool WdtResourceController::hasSenderQuota(
 
 bool WdtResourceController::hasSenderQuotaInternal(
     const std::shared_ptr<WdtNamespaceController> &controller) const {
-  GuardLock lock(controllerMutex_);
   if ((numSenders_ >= maxNumSenders_) && (maxNumSenders_ > 0)) {
     WLOG(WARNING) << "Exceeded quota on max senders. "
                   << "Max num senders " << maxNumSenders_ << " and we have "
@@ -355,32 +774,29 @@ ErrorCode WdtResourceController::createSender(
     const WdtTransferRequest &wdtOperationRequest, SenderPtr &sender) {
   NamespaceControllerPtr controller = nullptr;
   sender = nullptr;
-  {
-    GuardLock lock(controllerMutex_);
-    controller = getNamespaceController(wdtNamespace);
-    if (!controller) {
-      if (strictRegistration_) {
-        WLOG(WARNING) << "Couldn't find controller for " << wdtNamespace;
-        return NOT_FOUND;
-      } else {
-        WLOG(INFO) << "First time "
-                   << (wdtNamespace.empty() ? "(default)" : wdtNamespace)
-                   << " is seen, creating.";
-        controller = createNamespaceController(wdtNamespace);
-      }
-    }
-    if (!hasSenderQuotaInternal(controller)) {
-      WLOG(ERROR) << "No quota for more sender.";
-      return QUOTA_EXCEEDED;
+  controller = getNamespaceController(wdtNamespace);
+  if (!controller) {
+    if (strictRegistration_) {
+      WLOG(WARNING) << "Couldn't find controller for " << wdtNamespace;
+      return NOT_FOUND;
+    } else {
+      WLOG(INFO) << "First time "
+                 << (wdtNamespace.empty() ? "(default)" : wdtNamespace)
+                 << " is seen, creating.";
+      controller = createNamespaceController(wdtNamespace);
     }
-    ++numSenders_;
+  }
+  // the quotas of the namespace are checked as the sender is created
+  if (!addWithinLimit(numSenders_, maxNumSenders_, 1)) {
+    WLOG(ERROR) << "No quota for more sender. Max num senders "
+                << maxNumSenders_;
+    return QUOTA_EXCEEDED;
   }
   // TODO: not thread safe reading from options_
   throttler_->setThrottlerRates(options_.getThrottlerOptions());
   ErrorCode code =
       controller->createSender(wdtOperationRequest, identifier, sender);
   if (code != OK) {
-    GuardLock lock(controllerMutex_);
     --numSenders_;
     WLOG(ERROR) << "Failed in creating sender for " << wdtNamespace << " "
                 << errorCodeToStr(code);
@@ -399,7 +815,6 @@ bool WdtResourceController::hasReceiverQuota(
 
 bool WdtResourceController::hasReceiverQuotaInternal(
     const std::shared_ptr<WdtNamespaceController> &controller) const {
-  GuardLock lock(controllerMutex_);
   if ((numReceivers_ >= maxNumReceivers_) && (maxNumReceivers_ > 0)) {
     WLOG(WARNING) << "Exceeded quota on max receivers. "
                   << "Max num receivers " << maxNumReceivers_ << " and we have "
@@ -417,30 +832,27 @@ ErrorCode WdtResourceController::createReceiver(
     const WdtTransferRequest &wdtOperationRequest, ReceiverPtr &receiver) {
   NamespaceControllerPtr controller = nullptr;
   receiver = nullptr;
-  {
-    GuardLock lock(controllerMutex_);
-    controller = getNamespaceController(wdtNamespace);
-    if (!controller) {
-      if (strictRegistration_) {
-        WLOG(WARNING) << "Couldn't find controller for " << wdtNamespace;
-        return NOT_FOUND;
-      } else {
-        WLOG(INFO) << "First time " << wdtNamespace << " is seen, creating.";
-        controller = createNamespaceController(wdtNamespace);
-      }
-    }
-    if (!hasReceiverQuotaInternal(controller)) {
-      WLOG(ERROR) << "No quota for more receiver.";
-      return QUOTA_EXCEEDED;
+  controller = getNamespaceController(wdtNamespace);
+  if (!controller) {
+    if (strictRegistration_) {
+      WLOG(WARNING) << "Couldn't find controller for " << wdtNamespace;
+      return NOT_FOUND;
+    } else {
+      WLOG(INFO) << "First time " << wdtNamespace << " is seen, creating.";
+      controller = createNamespaceController(wdtNamespace);
     }
-    ++numReceivers_;
+  }
+  // the quotas of the namespace are checked as the receiver is created
+  if (!addWithinLimit(numReceivers_, maxNumReceivers_, 1)) {
+    WLOG(ERROR) << "No quota for more receiver. Max num receivers "
+                << maxNumReceivers_;
+    return QUOTA_EXCEEDED;
   }
   // TODO: not thread safe reading from options_
   throttler_->setThrottlerRates(options_.getThrottlerOptions());
   ErrorCode code =
       controller->createReceiver(wdtOperationRequest, identifier, receiver);
   if (code != OK) {
-    GuardLock lock(controllerMutex_);
     --numReceivers_;
     WLOG(ERROR) << "Failed in creating receiver for " << wdtNamespace << " "
                 << errorCodeToStr(code);
@@ -462,7 +874,6 @@ ErrorCode WdtResourceController::releaseSender(const std::string &wdtNamespace,
     }
   }
   if (controller->releaseSender(identifier) == OK) {
-    GuardLock lock(controllerMutex_);
     --numSenders_;
     return OK;
   }
@@ -483,7 +894,6 @@ ErrorCode WdtResourceController::releaseAllSenders(
   }
   int64_t numSenders = controller->releaseAllSenders();
   if (numSenders > 0) {
-    GuardLock lock(controllerMutex_);
     numSenders_ -= numSenders;
   }
   return OK;
@@ -500,7 +910,6 @@ ErrorCode WdtResourceController::releaseReceiver(
     }
   }
   if (controller->releaseReceiver(identifier) == OK) {
-    GuardLock lock(controllerMutex_);
     --numReceivers_;
     return OK;
   }
@@ -522,7 +931,6 @@ ErrorCode WdtResourceController::releaseAllReceivers(
   }
   int64_t numReceivers = controller->releaseAllReceivers();
   if (numReceivers > 0) {
-    GuardLock lock(controllerMutex_);
     numReceivers_ -= numReceivers;
   }
   return OK;
@@ -560,7 +968,6 @@ ErrorCode WdtResourceController::releaseStaleSenders(
   }
   erasedIds = controller->releaseStaleSenders();
   if (erasedIds.size() > 0) {
-    GuardLock lock(controllerMutex_);
     numSenders_ -= erasedIds.size();
   }
   return OK;
@@ -610,7 +1017,6 @@ ErrorCode WdtResourceController::releaseStaleReceivers(
   }
   erasedIds = controller->releaseStaleReceivers();
   if (erasedIds.size() > 0) {
-    GuardLock lock(controllerMutex_);
     numReceivers_ -= erasedIds.size();
   }
   return OK;
@@ -619,15 +1025,19 @@ ErrorCode WdtResourceController::releaseStaleReceivers(
 WdtResourceController::NamespaceControllerPtr
 WdtResourceController::createNamespaceController(
     const std::string &wdtNamespace) {
-  auto namespaceController =
-      make_shared<WdtNamespaceController>(wdtNamespace, this);
-  namespaceMap_[wdtNamespace] = namespaceController;
-  return namespaceController;
+  using Map = unordered_map<string, NamespaceControllerPtr>;
+  return namespaceMap_.update(wdtNamespace, [this, &wdtNamespace](Map &map) {
+    // may have been created since it was looked up
+    NamespaceControllerPtr &controller = map[wdtNamespace];
+    if (!controller) {
+      controller = make_shared<WdtNamespaceController>(wdtNamespace, this);
+    }
+    return controller;
+  });
 }
 
 ErrorCode WdtResourceController::registerWdtNamespace(
     const std::string &wdtNamespace) {
-  GuardLock lock(controllerMutex_);
   if (getNamespaceController(wdtNamespace)) {
     WLOG(INFO) << "Found existing controller for " << wdtNamespace;
     return OK;
@@ -639,25 +1049,24 @@ ErrorCode WdtResourceController::registerWdtNamespace(
 ErrorCode WdtResourceController::deRegisterWdtNamespace(
     const std::string &wdtNamespace) {
   NamespaceControllerPtr controller;
-  {
-    GuardLock lock(controllerMutex_);
-    auto it = namespaceMap_.find(wdtNamespace);
-    if (it != namespaceMap_.end()) {
-      controller = std::move(it->second);
-    } else {
-      WLOG(ERROR) << "Couldn't find the namespace " << wdtNamespace;
-      return ERROR;
-    }
-    namespaceMap_.erase(it);
+  namespaceMap_.update(
+      wdtNamespace,
+      [&](unordered_map<string, NamespaceControllerPtr> &map) {
+        auto it = map.find(wdtNamespace);
+        if (it != map.end()) {
+          controller = std::move(it->second);
+          map.erase(it);
+        }
+      });
+  if (!controller) {
+    WLOG(ERROR) << "Couldn't find the namespace " << wdtNamespace;
+    return ERROR;
   }
   int numSenders = controller->releaseAllSenders();
   int numReceivers = controller->releaseAllReceivers();
 
-  {
-    GuardLock lock(controllerMutex_);
-    numSenders_ -= numSenders;
-    numReceivers_ -= numReceivers;
-  }
+  numSenders_ -= numSenders;
+  numReceivers_ -= numReceivers;
 
   while (controller.use_count() > 1) {
     /* sleep override */
@@ -684,10 +1093,83 @@ void WdtResourceController::updateMaxSendersLimit(
   }
 }
 
+void WdtResourceController::updateMaxThreadsLimit(
+    const std::string &wdtNamespace, int64_t maxNumThreads) {
+  auto controller = getNamespaceController(wdtNamespace);
+  if (controller) {
+    controller->updateMaxThreadsLimit(maxNumThreads);
+  }
+}
+
+void WdtResourceController::updateThrottlerRates(
+    const std::string &wdtNamespace, const ThrottlerOptions &throttlerOptions) {
+  auto controller = getNamespaceController(wdtNamespace);
+  if (controller) {
+    controller->updateThrottlerRates(throttlerOptions);
+  }
+}
+
+ErrorCode WdtResourceController::setRateSchedule(
+    const std::string &wdtNamespace, const RateSchedule &schedule) {
+  auto controller = getNamespaceController(wdtNamespace);
+  if (!controller) {
+    WLOG(ERROR) << "Couldn't find controller for " << wdtNamespace;
+    return NOT_FOUND;
+  }
+  controller->setRateSchedule(schedule);
+  return OK;
+}
+
+void WdtResourceController::updateGlobalThrottlerRates(
+    const ThrottlerOptions &throttlerOptions) {
+  rateScheduler_->setRates(throttlerOptions);
+}
+
+void WdtResourceController::setGlobalRateSchedule(
+    const RateSchedule &schedule) {
+  rateScheduler_->setSchedule(schedule);
+}
+
+ErrorCode WdtResourceController::setNamespaceWeight(
+    const std::string &wdtNamespace, double weight) {
+  if (!bandwidthScheduler_) {
+    WLOG(ERROR) << "Namespace weights need fair_share_interval_millis";
+    return ERROR;
+  }
+  bandwidthScheduler_->setGroupWeight(wdtNamespace, weight);
+  return OK;
+}
+
+ErrorCode WdtResourceController::setTransferWeight(
+    const std::string &wdtNamespace, const std::string &identifier,
+    double weight) {
+  auto controller = getNamespaceController(wdtNamespace);
+  if (!controller) {
+    WLOG(ERROR) << "Couldn't find controller for " << wdtNamespace;
+    return NOT_FOUND;
+  }
+  return controller->setTransferWeight(identifier, weight);
+}
+
 std::shared_ptr<Throttler> WdtResourceController::getWdtThrottler() const {
   return throttler_;
 }
 
+std::shared_ptr<ReceiverRuntime> WdtResourceController::getReceiverRuntime()
+    const {
+  return receiverRuntime_;
+}
+
+std::shared_ptr<ReceiverRuntime> WdtResourceController::getSenderRuntime()
+    const {
+  return senderRuntime_;
+}
+
+std::shared_ptr<BandwidthScheduler>
+WdtResourceController::getBandwidthScheduler() const {
+  return bandwidthScheduler_;
+}
+
 const WdtOptions &WdtResourceController::getOptions() const {
   return options_;
 }
@@ -696,12 +1178,12 @@ const WdtOptions &WdtResourceController::getOptions() const {
 shared_ptr<WdtNamespaceController>
 WdtResourceController::getNamespaceController(
     const string &wdtNamespace) const {
-  GuardLock lock(controllerMutex_);
-  auto it = namespaceMap_.find(wdtNamespace);
-  if (it != namespaceMap_.end()) {
-    return it->second;
-  }
-  return nullptr;
+  NamespaceControllerPtr controller;
+  namespaceMap_.find(wdtNamespace,
+                     [&controller](const NamespaceControllerPtr &c) {
+                       controller = c;
+                     });
+  return controller;
 }
 
 void WdtResourceController::requireRegistration(bool strict) {
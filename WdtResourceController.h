@@ -10,6 +10,11 @@
 #include <wdt/ErrorCodes.h>
 #include <wdt/Receiver.h>
 #include <wdt/Sender.h>
+#include <wdt/util/BandwidthScheduler.h>
+#include <wdt/util/BufferPool.h>
+#include <wdt/util/RateScheduler.h>
+#include <wdt/util/ShardedMap.h>
+#include <atomic>
 #include <unordered_map>
 #include <vector>
 
@@ -19,6 +24,39 @@ namespace wdt {
 typedef std::shared_ptr<Receiver> ReceiverPtr;
 typedef std::shared_ptr<Sender> SenderPtr;
 
+/// metrics of the senders and receivers of a namespace
+struct NamespaceMetrics {
+  std::string wdtNamespace;
+  int32_t numSenders{0};
+  int32_t numReceivers{0};
+  /// summed over the senders
+  TransferMetrics sent;
+  /// summed over the receivers
+  TransferMetrics received;
+  /// rates of the throttler shared by the transfers of the namespace
+  double throttlerAvgRatePerSec{0};
+  double throttlerPeakRatePerSec{0};
+};
+
+/**
+ * Metrics of all the transfers of a resource controller, pulled for
+ * monitoring (@see WdtResourceController::getMetrics). The byte counts are
+ * the ones of the transfers not released yet, they go down when a transfer
+ * is released
+ */
+struct WdtMetrics {
+  std::vector<NamespaceMetrics> namespaces;
+  /// rates of the global throttler
+  double throttlerAvgRatePerSec{0};
+  double throttlerPeakRatePerSec{0};
+
+  /// @return   the metrics in the Prometheus text exposition format
+  std::string toPrometheus() const;
+
+  /// @return   the metrics as a json object
+  std::string toJson() const;
+};
+
 /**
  * Base class for both wdt global and namespace controller
  */
@@ -38,21 +76,30 @@ class WdtControllerBase {
   virtual void updateMaxSendersLimit(int64_t maxNumSenders);
 
  protected:
-  using GuardLock = std::unique_lock<std::recursive_mutex>;
+  /**
+   * Adds delta to count unless it would exceed max, atomically so that the
+   * quotas don't need a lock
+   *
+   * @param count   count to add to
+   * @param max     max of the count, no limit if <= 0
+   * @param delta   added to count, always added if <= 0
+   *
+   * @return        whether delta was added
+   */
+  static bool addWithinLimit(std::atomic<int64_t> &count, int64_t max,
+                             int64_t delta);
+
   /// Number of active receivers
-  int64_t numReceivers_{0};
+  std::atomic<int64_t> numReceivers_{0};
 
   /// Number of active senders
-  int64_t numSenders_{0};
+  std::atomic<int64_t> numSenders_{0};
 
   /// Maximum number of senders allowed for this namespace
-  int64_t maxNumSenders_{0};
+  std::atomic<int64_t> maxNumSenders_{0};
 
   /// Maximum number of receivers allowed for this namespace
-  int64_t maxNumReceivers_{0};
-
-  /// Mutex that protects all the private members of this class
-  mutable std::recursive_mutex controllerMutex_;
+  std::atomic<int64_t> maxNumReceivers_{0};
 
   /// Name of the resource controller
   std::string controllerName_;
@@ -73,6 +120,13 @@ class WdtNamespaceController : public WdtControllerBase {
   /// Is free to create sender.
   bool hasSenderQuota() const;
 
+  /// @return   whether a transfer with numThreads threads of its own can be
+  ///           created without exceeding the thread limit
+  bool hasThreadQuota(int64_t numThreads) const;
+
+  /// Update max threads limit (@see namespace_thread_limit)
+  void updateMaxThreadsLimit(int64_t maxNumThreads);
+
   /// Add a receiver for this namespace with identifier
   ErrorCode createReceiver(const WdtTransferRequest &request,
                            const std::string &identifier,
@@ -97,6 +151,20 @@ class WdtNamespaceController : public WdtControllerBase {
   /// Releases all receivers in this namespace
   int64_t releaseAllReceivers();
 
+  /// @return   throttler shared by the transfers of this namespace
+  std::shared_ptr<Throttler> getThrottler() const;
+
+  /// Update the rates shared by the transfers of this namespace, till the
+  /// next window of its rate schedule if it has one
+  void updateThrottlerRates(const ThrottlerOptions &throttlerOptions);
+
+  /// Sets the schedule of the rates shared by the transfers of this namespace
+  void setRateSchedule(const RateSchedule &schedule);
+
+  /// Sets the weight of the sender and receiver with identifier within the
+  /// namespace (@see fair_share_interval_millis)
+  ErrorCode setTransferWeight(const std::string &identifier, double weight);
+
   /**
    * Get the sender you created by the createSender API
    * using the same identifier you mentioned before
@@ -118,23 +186,153 @@ class WdtNamespaceController : public WdtControllerBase {
   // Get all senders ids
   std::vector<std::string> getSendersIds() const;
 
-  /// Clear the senders that are not active anymore
+  /// Clear the senders that are not active anymore, a shard of the senders
+  /// at a time
   std::vector<std::string> releaseStaleSenders();
 
-  /// Clear the receivers that are not active anymore
+  /// Clear the receivers that are not active anymore, a shard of the
+  /// receivers at a time
   std::vector<std::string> releaseStaleReceivers();
 
+  /// @return   metrics of the senders and receivers of this namespace
+  NamespaceMetrics getMetrics() const;
+
   /// Destructor, clears the senders and receivers
   ~WdtNamespaceController() override;
 
  private:
+  /// resources accounted for a transfer of the namespace
+  struct TransferResources {
+    /// number of threads of its own
+    int64_t numThreads{0};
+    /// memory of its buffers reserved in the buffer pool, if capped
+    std::unique_ptr<BufferPool::Reservation> bufferReservation;
+    /// share of the global rate, if fair sharing is enabled
+    std::unique_ptr<BandwidthScheduler::Registration> bandwidthShare;
+  };
+
+  /// a sender or receiver of the namespace with its resources
+  template <typename T>
+  struct TransferEntry {
+    std::shared_ptr<T> transfer;
+    TransferResources resources;
+  };
+
+  template <typename T>
+  using TransferMap = ShardedMap<TransferEntry<T>>;
+
   /// Map of receivers associated with identifier
-  std::unordered_map<std::string, ReceiverPtr> receiversMap_;
+  TransferMap<Receiver> receiversMap_;
 
   /// Map of senders associated with identifier
-  std::unordered_map<std::string, SenderPtr> sendersMap_;
+  TransferMap<Sender> sendersMap_;
+
+  /// Maximum number of threads of the transfers, 0 for no limit
+  std::atomic<int64_t> maxNumThreads_{0};
+
+  /// Number of threads of their own of the transfers
+  std::atomic<int64_t> numThreads_{0};
 
-  /// Throttler for this namespace
+  /**
+   * Accounts a new transfer in the quotas of the namespace
+   *
+   * @param request         request of the transfer
+   * @param kind            "senders" or "receivers", for the logs
+   * @param numTransfers    number of transfers of its kind, incremented
+   * @param maxNumTransfers max number of transfers of its kind
+   * @param resources       resources of the transfer, the buffers are
+   *                        reserved in it
+   *
+   * @return                false if a quota is exceeded, nothing is
+   *                        accounted then
+   */
+  bool acquireQuota(const WdtTransferRequest &request, const char *kind,
+                    std::atomic<int64_t> &numTransfers,
+                    int64_t maxNumTransfers, TransferResources &resources);
+
+  /**
+   * Adds a transfer made by createSender or createReceiver to its map
+   *
+   * @param transfers       map of its kind
+   * @param numTransfers    number of transfers of its kind, decremented if
+   *                        the transfer isn't added
+   * @param identifier      identifier of the transfer
+   * @param entry           transfer with the resources acquired for it, set
+   *                        to the transfer already added with identifier if
+   *                        any
+   *
+   * @return                OK or ALREADY_EXISTS
+   */
+  template <typename T>
+  ErrorCode addTransfer(TransferMap<T> &transfers,
+                        std::atomic<int64_t> &numTransfers,
+                        const std::string &identifier,
+                        TransferEntry<T> &entry);
+
+  /// @return   transfer with identifier, nullptr if none
+  template <typename T>
+  std::shared_ptr<T> findTransfer(const TransferMap<T> &transfers,
+                                  const std::string &identifier) const;
+
+  /// Removes the transfer with identifier and gives back its resources
+  template <typename T>
+  std::shared_ptr<T> removeTransfer(TransferMap<T> &transfers,
+                                    std::atomic<int64_t> &numTransfers,
+                                    const std::string &identifier);
+
+  /// @return   number of transfers removed from transfers
+  template <typename T>
+  int64_t removeAllTransfers(TransferMap<T> &transfers,
+                             std::atomic<int64_t> &numTransfers);
+
+  /**
+   * Removes the stale transfers a shard at a time. Whether a transfer is
+   * stale is checked with no lock held, so that the transfers of the
+   * namespace can be created and looked up during the scan
+   *
+   * @return    identifiers of the transfers removed
+   */
+  template <typename T>
+  std::vector<std::string> removeStaleTransfers(
+      TransferMap<T> &transfers, std::atomic<int64_t> &numTransfers);
+
+  /// @return   all the transfers of transfers
+  template <typename T>
+  std::vector<std::shared_ptr<T>> getTransfers(
+      const TransferMap<T> &transfers) const;
+
+  /**
+   * Reserves the memory of the buffers of a transfer if buffer_pool_max_mbytes
+   * is set
+   *
+   * @param request       request of the transfer, a buffer per port
+   * @param resources     set to the reservation
+   *
+   * @return              false if the memory left is not enough
+   */
+  bool reserveBuffers(const WdtTransferRequest &request,
+                      TransferResources &resources) const;
+
+  /**
+   * Throttler for this namespace, child of the global one. A transfer throttles
+   * with it, or with a child of its own if per transfer rates are set or the
+   * global rate is shared fairly
+   */
+  std::shared_ptr<Throttler> throttler_;
+
+  /// Applies the rate schedule and the rate updates to throttler_
+  std::unique_ptr<RateScheduler> rateScheduler_;
+
+  /**
+   * @param resources   set to the share of the global rate of the transfer,
+   *                    if fair sharing is enabled
+   *
+   * @return            throttler for a new transfer of this namespace
+   */
+  std::shared_ptr<Throttler> makeTransferThrottler(
+      TransferResources &resources) const;
+
+  /// Resource controller this namespace belongs to
   const WdtResourceController *const parent_;
 };
 
@@ -196,6 +394,44 @@ class WdtResourceController : public WdtControllerBase {
   void updateMaxSendersLimit(const std::string &wdtNamespace,
                              int64_t maxNumSenders);
 
+  /// Update max threads limit of namespace (@see namespace_thread_limit)
+  void updateMaxThreadsLimit(const std::string &wdtNamespace,
+                             int64_t maxNumThreads);
+
+  /// Update the rates shared by the transfers of a namespace
+  void updateThrottlerRates(const std::string &wdtNamespace,
+                            const ThrottlerOptions &throttlerOptions);
+
+  /// Sets the schedule of the rates shared by the transfers of a namespace
+  ErrorCode setRateSchedule(const std::string &wdtNamespace,
+                            const RateSchedule &schedule);
+
+  /// Update the rates of the global throttler, till the next window of the
+  /// global rate schedule if there is one
+  void updateGlobalThrottlerRates(const ThrottlerOptions &throttlerOptions);
+
+  /// Sets the schedule of the rates of the global throttler, e.g. lower
+  /// rates during business hours
+  void setGlobalRateSchedule(const RateSchedule &schedule);
+
+  /**
+   * Sets the weight of a namespace in the sharing of the global rate, 1 by
+   * default (@see fair_share_interval_millis)
+   *
+   * @return    ERROR if fair sharing is not enabled
+   */
+  ErrorCode setNamespaceWeight(const std::string &wdtNamespace, double weight);
+
+  /**
+   * Sets the weight of a transfer in the sharing of the rate of its
+   * namespace, 1 by default (@see fair_share_interval_millis)
+   *
+   * @return    NOT_FOUND if there is no such transfer, ERROR if fair sharing
+   *            is not enabled
+   */
+  ErrorCode setTransferWeight(const std::string &wdtNamespace,
+                              const std::string &identifier, double weight);
+
   /// Release all senders in the specified namespace
   ErrorCode releaseAllSenders(const std::string &wdtNamespace);
 
@@ -251,6 +487,10 @@ class WdtResourceController : public WdtControllerBase {
   ErrorCode getCounts(int32_t &numNamespaces, int32_t &numSenders,
                       int32_t &numReceivers);
 
+  /// @return   live metrics of the transfers of all the namespaces, can be
+  ///           called from any thread
+  WdtMetrics getMetrics() const;
+
   /**
    * getter for throttler.
    * setThrottlerRates to this throttler may not take effect. Instead, update
@@ -265,6 +505,18 @@ class WdtResourceController : public WdtControllerBase {
    */
   std::shared_ptr<Throttler> getWdtThrottler() const;
 
+  /// @return   runtime shared by the receivers, nullptr if they use a thread
+  ///           per port (@see receiver_runtime_threads)
+  std::shared_ptr<ReceiverRuntime> getReceiverRuntime() const;
+
+  /// @return   runtime shared by the senders, nullptr if they use a thread
+  ///           per port (@see sender_runtime_threads)
+  std::shared_ptr<ReceiverRuntime> getSenderRuntime() const;
+
+  /// @return   scheduler sharing the global rate between the transfers,
+  ///           nullptr if fair sharing is disabled
+  std::shared_ptr<BandwidthScheduler> getBandwidthScheduler() const;
+
   const WdtOptions &getOptions() const;
 
  protected:
@@ -274,13 +526,23 @@ class WdtResourceController : public WdtControllerBase {
       const std::string &wdtNamespace) const;
 
  private:
+  /// @return   controller of the namespace, created if there is none yet
   NamespaceControllerPtr createNamespaceController(const std::string &name);
-  /// Map containing the resource controller per namespace
-  std::unordered_map<std::string, NamespaceControllerPtr> namespaceMap_;
+  /// Map containing the resource controller per namespace, sharded so that
+  /// the transfers of different namespaces don't wait for each other
+  ShardedMap<NamespaceControllerPtr> namespaceMap_;
   /// Whether namespace need to be created explictly
-  bool strictRegistration_{false};
+  std::atomic<bool> strictRegistration_{false};
   /// Throttler for all the namespaces
   std::shared_ptr<Throttler> throttler_{nullptr};
+  /// Applies the global rate schedule and the rate updates to throttler_
+  std::unique_ptr<RateScheduler> rateScheduler_;
+  /// Runtime for the receivers of all the namespaces, if enabled
+  std::shared_ptr<ReceiverRuntime> receiverRuntime_{nullptr};
+  /// Runtime for the senders of all the namespaces, if enabled
+  std::shared_ptr<ReceiverRuntime> senderRuntime_{nullptr};
+  /// Scheduler of the rates of the transfers, if fair sharing is enabled
+  std::shared_ptr<BandwidthScheduler> bandwidthScheduler_{nullptr};
   const WdtOptions &options_;
   /// Internal method for checking hasSenderQuota & hasReceiverQuota
   bool hasSenderQuotaInternal(const std::shared_ptr<WdtNamespaceController>
@@ -8,6 +8,9 @@
  */
 #include <wdt/WdtThread.h>
 
+#include <algorithm>
+#include <random>
+
 using namespace std;
 
 namespace facebook {
@@ -21,6 +24,43 @@ const PerfStatReport &WdtThread::getPerfReport() const {
   return threadCtx_->getPerfReport();
 }
 
+const TimeBreakdown &WdtThread::getTimeBreakdown() const {
+  return threadCtx_->getTimeBreakdown();
+}
+
+void WdtThread::sampleTcpInfo(const WdtSocket *socket, bool force) {
+  const int32_t intervalMillis = options_.tcp_info_sample_interval_millis;
+  if (socket == nullptr || socket->getFd() < 0 || intervalMillis <= 0) {
+    return;
+  }
+  const Clock::time_point now = Clock::now();
+  if (!force && durationMillis(now - lastTcpInfoSampleTime_) < intervalMillis) {
+    return;
+  }
+  lastTcpInfoSampleTime_ = now;
+  TcpInfoSample sample;
+  if (socket->getTcpInfo(sample)) {
+    threadStats_.setTcpInfo(sample);
+  }
+}
+
+int64_t WdtThread::getRetrySleepMillis(const WdtOptions &options,
+                                       int attempt) {
+  const int64_t baseMillis = std::max<int64_t>(options.sleep_millis, 0);
+  const int64_t maxMillis = options.max_sleep_millis;
+  if (maxMillis <= baseMillis) {
+    return baseMillis;
+  }
+  int64_t sleepMillis = std::max<int64_t>(baseMillis, 1);
+  for (int i = 1; i < attempt && sleepMillis < maxMillis; i++) {
+    sleepMillis *= 2;
+  }
+  sleepMillis = std::min(sleepMillis, maxMillis);
+  static thread_local std::minstd_rand generator(std::random_device{}());
+  std::uniform_int_distribution<int64_t> jitter(0, sleepMillis / 2);
+  return sleepMillis - sleepMillis / 2 + jitter(generator);
+}
+
 const TransferStats &WdtThread::getTransferStats() const {
   return threadStats_;
 }
@@ -33,7 +73,14 @@ void WdtThread::startThread() {
   auto state = controller_->getState(threadIndex_);
   // Check the state should be running here
   WDT_CHECK_EQ(state, RUNNING);
-  threadPtr_.reset(new std::thread(&WdtThread::start, this));
+  threadPtr_.reset(new std::thread(&WdtThread::run, this));
+}
+
+void WdtThread::run() {
+  if (threadAffinity_ != nullptr) {
+    threadAffinity_->pinCurrentThread();
+  }
+  start();
 }
 
 ErrorCode WdtThread::finish() {
@@ -11,6 +11,7 @@
 #include <wdt/ErrorCodes.h>
 #include <wdt/Protocol.h>
 #include <wdt/util/CommonImpl.h>
+#include <wdt/util/ThreadAffinity.h>
 #include <wdt/util/ThreadsController.h>
 #include <wdt/util/WdtSocket.h>
 #include <memory>
@@ -26,13 +27,17 @@ class WdtThread {
  public:
   /// Constructor for wdt thread
   WdtThread(const WdtOptions &options, int threadIndex, int port,
-            int protocolVersion, ThreadsController *controller)
+            int protocolVersion, ThreadsController *controller,
+            const ThreadAffinity *threadAffinity)
       : options_(options),
         port_(port),
-        threadProtocolVersion_(protocolVersion) {
+        threadProtocolVersion_(protocolVersion),
+        threadAffinity_(threadAffinity) {
     controller_ = controller;
+    const int numaNode =
+        threadAffinity_ != nullptr ? threadAffinity_->getNumaNode() : -1;
     threadCtx_ = std::make_unique<ThreadCtx>(
-        options, /* allocate buffer */ true, threadIndex);
+        options, /* allocate buffer */ true, threadIndex, numaNode);
     const Buffer *buffer = threadCtx_->getBuffer();
     WDT_CHECK(buffer);
     buf_ = buffer->getData();
@@ -41,11 +46,14 @@ class WdtThread {
     lastHeartBeatTime_ = Clock::now();
   }
   /// Starts a thread which runs the wdt functionality
-  void startThread();
+  virtual void startThread();
 
   /// Get the perf stats of the transfer for this thread
   const PerfStatReport &getPerfReport() const;
 
+  /// @return   time breakdown of the thread, complete once it is done
+  const TimeBreakdown &getTimeBreakdown() const;
+
   /// Initializes the wdt thread before starting
   virtual ErrorCode init() = 0;
 
@@ -71,10 +79,25 @@ class WdtThread {
 
   virtual ~WdtThread();
 
+  /**
+   * Time to sleep before the next attempt, after failed ones: exponential
+   * backoff from sleep_millis up to max_sleep_millis. Half of it is random,
+   * so that the threads failing together don't all retry at the same time
+   *
+   * @param options   options of the transfer
+   * @param attempt   number of attempts failed in a row, from 1
+   *
+   * @return          milliseconds to sleep
+   */
+  static int64_t getRetrySleepMillis(const WdtOptions &options, int attempt);
+
  protected:
   /// The main entry point of the thread
   virtual void start() = 0;
 
+  /// pins the thread to its cpus and calls start()
+  void run();
+
   std::unique_ptr<ThreadCtx> threadCtx_{nullptr};
 
   /// buffer pointer. this points to the buffer in threadCtx_
@@ -100,6 +123,18 @@ class WdtThread {
 
   Clock::time_point lastHeartBeatTime_;
 
+  /**
+   * Samples TCP_INFO of the connection into threadStats_, at most every
+   * tcp_info_sample_interval_millis unless forced
+   *
+   * @param socket    connection of the thread, nothing done if nullptr
+   * @param force     whether to sample regardless of the last sample time
+   */
+  void sampleTcpInfo(const WdtSocket *socket, bool force);
+
+  /// time of the last TCP_INFO sample
+  Clock::time_point lastTcpInfoSampleTime_;
+
   /// possible footer types
   enum FooterType {
     NO_FOOTER,
@@ -108,14 +143,26 @@ class WdtThread {
 
   FooterType footerType_{NO_FOOTER};
 
-  /// Transfer stats for this thread
-  TransferStats threadStats_{true};
+  /// size of the padding keeping threadStats_ off the cache lines of the
+  /// other members and objects
+  static constexpr int kCacheLineSize = 64;
+
+  char statsPaddingBefore_[kCacheLineSize];
+
+  /// Transfer stats for this thread, written for each buffer by this thread
+  /// and read by the progress reporter
+  TransferStats threadStats_;
+
+  char statsPaddingAfter_[kCacheLineSize];
 
   /// Thread controller for all the sender threads
   ThreadsController *controller_{nullptr};
 
   /// Pointer to the std::thread executing the transfer
   std::unique_ptr<std::thread> threadPtr_{nullptr};
+
+  /// Placement of the thread, owned by the parent, nullptr if none
+  const ThreadAffinity *threadAffinity_{nullptr};
 };
 }
 }
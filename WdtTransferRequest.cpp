@@ -284,6 +284,8 @@ const string WdtTransferRequest::NAMESPACE_PARAM{"ns"};
 const string WdtTransferRequest::DEST_IDENTIFIER_PARAM{"dstid"};
 const string WdtTransferRequest::DOWNLOAD_RESUMPTION_PARAM{"dr"};
 const string WdtTransferRequest::IV_CHANGE_INTERVAL_PARAM{"iv_change_int"};
+const string WdtTransferRequest::RECEIVER_ADDRESSES_PARAM{"raddrs"};
+const string WdtTransferRequest::LOCAL_ADDRESSES_PARAM{"laddrs"};
 
 WdtTransferRequest::WdtTransferRequest(int startPort, int numPorts,
                                        const string& directory) {
@@ -353,6 +355,10 @@ WdtTransferRequest::WdtTransferRequest(const string& uriString) {
     }
   }
 
+  receiverAddresses =
+      parseAddressList(wdtUri.getQueryParam(RECEIVER_ADDRESSES_PARAM));
+  localAddresses = parseAddressList(wdtUri.getQueryParam(LOCAL_ADDRESSES_PARAM));
+
   string portsStr(wdtUri.getQueryParam(PORTS_PARAM));
   StringPiece portsList(portsStr);  // pointers into portsStr
   do {
@@ -436,6 +442,14 @@ string WdtTransferRequest::generateUrlInternal(bool genFull,
     wdtUri.setQueryParam(DOWNLOAD_RESUMPTION_PARAM,
                          folly::to<string>(downloadResumptionEnabled));
   }
+  if (!receiverAddresses.empty()) {
+    wdtUri.setQueryParam(RECEIVER_ADDRESSES_PARAM,
+                         serializeAddressList(receiverAddresses));
+  }
+  if (!localAddresses.empty()) {
+    wdtUri.setQueryParam(LOCAL_ADDRESSES_PARAM,
+                         serializeAddressList(localAddresses));
+  }
   serializePorts(wdtUri);
   if (genFull) {
     wdtUri.setQueryParam(DIRECTORY_PARAM, directory);
@@ -484,6 +498,30 @@ string WdtTransferRequest::getSerializedPortsList() const {
   return portsList;
 }
 
+vector<string> WdtTransferRequest::parseAddressList(const string& list) {
+  vector<string> addresses;
+  StringPiece remaining(list);
+  while (!remaining.empty()) {
+    StringPiece address = remaining.split_step(',');
+    if (!address.empty()) {
+      addresses.push_back(address.str());
+    }
+  }
+  return addresses;
+}
+
+string WdtTransferRequest::serializeAddressList(
+    const vector<string>& addresses) {
+  string list;
+  for (size_t i = 0; i < addresses.size(); i++) {
+    if (i != 0) {
+      list += ",";
+    }
+    list += addresses[i];
+  }
+  return list;
+}
+
 bool WdtTransferRequest::operator==(const WdtTransferRequest& that) const {
   bool result = (transferId == that.transferId) &&
                 (protocolVersion == that.protocolVersion) &&
@@ -491,7 +529,9 @@ bool WdtTransferRequest::operator==(const WdtTransferRequest& that) const {
                 (ports == that.ports) &&
                 (encryptionData == that.encryptionData) &&
                 (destIdentifier == that.destIdentifier) &&
-                (wdtNamespace == that.wdtNamespace);
+                (wdtNamespace == that.wdtNamespace) &&
+                (receiverAddresses == that.receiverAddresses) &&
+                (localAddresses == that.localAddresses);
   // No need to check the file info, simply checking whether two objects
   // are same with respect to the wdt settings
   return result;
@@ -35,6 +35,9 @@ struct WdtFileInfo {
   /// Whether read should be done using o_direct. If fd is set, this flag will
   /// be set automatically to match the fd open mode
   bool directReads{false};
+  /// Priority class of the file, the files of higher classes are sent first.
+  /// 0 lets the file_priorities option decide
+  int priority{0};
   /// Constructor for file info with name, size and odirect request
   WdtFileInfo(const std::string& name, int64_t size, bool directReads);
   /**
@@ -43,6 +46,9 @@ struct WdtFileInfo {
    * by fd flags.
    * Attempt to disambiguate the 2 constructors by having the fd first
    * and string last in this one.
+   * With a size of -1 and an fd which is not a regular file (pipe, socket,
+   * stdin...), the fd is read as a stream till its end, and its blocks are
+   * sent by all the sender threads as they are read.
    */
   WdtFileInfo(int fd, int64_t size, const std::string& name);
   /// Verify that we can align for reading in O_DIRECT and
@@ -186,6 +192,14 @@ struct WdtTransferRequest {
   /// Number of GBytes after iv is changed
   int64_t ivChangeInterval{0};
 
+  /// Other addresses of the receiver (e.g one per NIC). Sender connections
+  /// are spread across hostName and these
+  std::vector<std::string> receiverAddresses;
+
+  /// Local addresses the sender binds its connections to, connections are
+  /// spread across them. Empty to use the default route
+  std::vector<std::string> localAddresses;
+
   /// Any error associated with this transfer request upon processing
   ErrorCode errorCode{OK};
 
@@ -239,11 +253,20 @@ struct WdtTransferRequest {
   const static std::string DEST_IDENTIFIER_PARAM;
   const static std::string DOWNLOAD_RESUMPTION_PARAM;
   const static std::string IV_CHANGE_INTERVAL_PARAM;
+  const static std::string RECEIVER_ADDRESSES_PARAM;
+  const static std::string LOCAL_ADDRESSES_PARAM;
 
   /// Get ports vector from startPort and numPorts
   static std::vector<int32_t> genPortsVector(int32_t startPort,
                                              int32_t numPorts);
 
+  /// Splits a comma separated list of addresses
+  static std::vector<std::string> parseAddressList(const std::string& list);
+
+  /// @return   comma separated list of the addresses
+  static std::string serializeAddressList(
+      const std::vector<std::string>& addresses);
+
  private:
   /**
    * Serialize this structure into a url string containing all fields
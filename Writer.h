@@ -9,11 +9,20 @@
 #pragma once
 
 #include <wdt/ErrorCodes.h>
+#include <wdt/util/BlockChecksum.h>
+
+#include <functional>
+#include <memory>
 
 namespace facebook {
 namespace wdt {
+
+class ThreadCtx;
+struct BlockDetails;
+
 /**
- * Interface to write received data
+ * Interface to write received data. One writer is created for each block
+ * received, by default a FileWriter writing it to the destination directory.
  */
 class Writer {
  public:
@@ -40,11 +49,73 @@ class Writer {
   /// @return   total number of bytes written
   virtual int64_t getTotalWritten() = 0;
 
+  /// @return   whether getWriteBuffer() can be used
+  virtual bool hasWriteBuffers() const {
+    return false;
+  }
+
+  /**
+   * Returns a buffer data can be received into and then passed to write(),
+   * so that it is not copied
+   *
+   * @param size    set to the size of the buffer
+   *
+   * @return        buffer to use, nullptr on error
+   */
+  virtual char *getWriteBuffer(int64_t &size) {
+    size = 0;
+    return nullptr;
+  }
+
+  /**
+   * Waits for the writes still in flight, if writes are asynchronous
+   *
+   * @return    false if any of the writes failed
+   */
+  virtual bool waitForWrites() {
+    return true;
+  }
+
+  /// @return   number of bytes whose write is complete
+  virtual int64_t getTotalCompleted() {
+    return getTotalWritten();
+  }
+
+  /**
+   * Has the checksum of the data passed to write() computed along with the
+   * writes, off the calling thread. Called before the first write
+   *
+   * @param type    type of the checksum
+   *
+   * @return        false if the writer can't, the caller computes it then
+   */
+  virtual bool offloadChecksum(ChecksumType /* type */) {
+    return false;
+  }
+
+  /// @return   checksum of the data written, once waitForWrites() returned,
+  ///           if offloadChecksum() returned true
+  virtual int64_t getChecksum() {
+    return 0;
+  }
+
   /// sync data to disk
   virtual ErrorCode sync() = 0;
 
   /// close the writer
   virtual ErrorCode close() = 0;
 };
+
+/**
+ * Creates the writer of a block received, replacing the FileWriter (see
+ * Receiver::setWriterFactory). Called by the receiver threads concurrently.
+ *
+ * @param threadCtx       context of the receiver thread
+ * @param blockDetails    header of the block, valid till the writer is
+ *                        destroyed
+ */
+typedef std::function<std::unique_ptr<Writer>(ThreadCtx &threadCtx,
+                                              BlockDetails const *blockDetails)>
+    WriterFactory;
 }
 }
@@ -0,0 +1,197 @@
+/**
+ * Copyright (c) 2014-present, Facebook, Inc.
+ * All rights reserved.
+ *
+ * This source code is licensed under the BSD-style license found in the
+ * LICENSE file in the root directory of this source tree. An additional grant
+ * of patent rights can be found in the PATENTS file in the same directory.
+ */
+#include "BenchResults.h"
+
+#include <sys/utsname.h>
+#include <time.h>
+#include <unistd.h>
+#include <cmath>
+#include <cstdio>
+#include <fstream>
+#include <iostream>
+#include <sstream>
+#include <thread>
+
+#include <gflags/gflags.h>
+#include <glog/logging.h>
+
+#include <wdt/WdtConfig.h>
+
+DEFINE_string(bench_json_output, "",
+              "File the results are appended to as json lines of the common "
+              "benchmark schema, - for stdout, empty to disable");
+DEFINE_string(bench_label, "",
+              "Label of the run stored with the results, e.g. the build");
+
+namespace facebook {
+namespace wdt {
+
+const char *const kBenchSchema = "wdt_bench_v1";
+
+BenchResults::Result &BenchResults::Result::param(const std::string &name,
+                                                  const std::string &value) {
+  params_.emplace_back(name, value);
+  return *this;
+}
+
+BenchResults::Result &BenchResults::Result::metric(const std::string &name,
+                                                   double value,
+                                                   const std::string &unit,
+                                                   Better better) {
+  metrics_.push_back(Metric{name, value, unit, better});
+  return *this;
+}
+
+BenchResults::BenchResults(const std::string &benchmark)
+    : benchmark_(benchmark) {
+}
+
+BenchResults::~BenchResults() {
+  write();
+}
+
+BenchResults::Result &BenchResults::add(const std::string &caseName) {
+  results_.emplace_back(caseName);
+  return results_.back();
+}
+
+std::string BenchResults::quote(const std::string &str) {
+  std::string quoted("\"");
+  for (char c : str) {
+    switch (c) {
+      case '"':
+        quoted.append("\\\"");
+        break;
+      case '\\':
+        quoted.append("\\\\");
+        break;
+      case '\n':
+        quoted.append("\\n");
+        break;
+      case '\t':
+        quoted.append("\\t");
+        break;
+      default:
+        if ((unsigned char)c < 0x20) {
+          char escaped[8];
+          snprintf(escaped, sizeof(escaped), "\\u%04x", c);
+          quoted.append(escaped);
+        } else {
+          quoted.push_back(c);
+        }
+    }
+  }
+  quoted.push_back('"');
+  return quoted;
+}
+
+/// @return   value of the first "key : value" line of a /proc file
+static std::string readProcValue(const std::string &path,
+                                 const std::string &key) {
+  std::ifstream file(path);
+  std::string line;
+  while (std::getline(file, line)) {
+    if (line.compare(0, key.size(), key) != 0) {
+      continue;
+    }
+    const size_t colon = line.find(':');
+    if (colon == std::string::npos) {
+      continue;
+    }
+    const size_t start = line.find_first_not_of(" \t", colon + 1);
+    return start == std::string::npos ? "" : line.substr(start);
+  }
+  return "";
+}
+
+std::string BenchResults::getEnvironmentJson() {
+  char host[256] = {0};
+  gethostname(host, sizeof(host) - 1);
+  struct utsname name;
+  std::string kernel;
+  std::string machine;
+  if (uname(&name) == 0) {
+    kernel = name.release;
+    machine = name.machine;
+  }
+  char timestamp[32] = {0};
+  const time_t now = time(nullptr);
+  struct tm utcTime;
+  gmtime_r(&now, &utcTime);
+  strftime(timestamp, sizeof(timestamp), "%Y-%m-%dT%H:%M:%SZ", &utcTime);
+#ifdef NDEBUG
+  const char *build = "opt";
+#else
+  const char *build = "dbg";
+#endif
+  std::ostringstream env;
+  env << "{\"host\":" << quote(host) << ",\"kernel\":" << quote(kernel)
+      << ",\"machine\":" << quote(machine) << ",\"cpu_model\":"
+      << quote(readProcValue("/proc/cpuinfo", "model name"))
+      << ",\"num_cpus\":" << std::thread::hardware_concurrency()
+      << ",\"mem_total\":"
+      << quote(readProcValue("/proc/meminfo", "MemTotal"))
+      << ",\"wdt_version\":" << quote(WDT_VERSION_STR)
+      << ",\"compiler\":" << quote(__VERSION__) << ",\"build\":\"" << build
+      << "\",\"label\":" << quote(FLAGS_bench_label)
+      << ",\"timestamp\":\"" << timestamp << "\"}";
+  return env.str();
+}
+
+bool BenchResults::write() {
+  if (FLAGS_bench_json_output.empty() || results_.empty()) {
+    results_.clear();
+    return true;
+  }
+  std::ofstream file;
+  const bool toStdout = (FLAGS_bench_json_output == "-");
+  if (!toStdout) {
+    file.open(FLAGS_bench_json_output, std::ios::app);
+    if (!file) {
+      LOG(ERROR) << "Unable to open " << FLAGS_bench_json_output;
+      results_.clear();
+      return false;
+    }
+  }
+  std::ostream &out = toStdout ? std::cout : file;
+  const std::streamsize oldPrecision = out.precision(10);
+  const std::string env = getEnvironmentJson();
+  for (const Result &result : results_) {
+    out << "{\"schema\":\"" << kBenchSchema
+        << "\",\"benchmark\":" << quote(benchmark_)
+        << ",\"case\":" << quote(result.caseName_) << ",\"params\":{";
+    for (size_t i = 0; i < result.params_.size(); i++) {
+      out << (i ? "," : "") << quote(result.params_[i].first) << ":"
+          << quote(result.params_[i].second);
+    }
+    out << "},\"metrics\":{";
+    for (size_t i = 0; i < result.metrics_.size(); i++) {
+      const Result::Metric &metric = result.metrics_[i];
+      out << (i ? "," : "") << quote(metric.name) << ":{\"value\":";
+      if (std::isfinite(metric.value)) {
+        out << metric.value;
+      } else {
+        out << "null";
+      }
+      out << ",\"unit\":" << quote(metric.unit) << ",\"better\":\""
+          << (metric.better == HIGHER ? "higher" : "lower") << "\"}";
+    }
+    out << "},\"env\":" << env << "}\n";
+  }
+  out.flush();
+  out.precision(oldPrecision);
+  results_.clear();
+  if (!out) {
+    LOG(ERROR) << "Unable to write the results to " << FLAGS_bench_json_output;
+    return false;
+  }
+  return true;
+}
+}
+}
@@ -0,0 +1,99 @@
+/**
+ * Copyright (c) 2014-present, Facebook, Inc.
+ * All rights reserved.
+ *
+ * This source code is licensed under the BSD-style license found in the
+ * LICENSE file in the root directory of this source tree. An additional grant
+ * of patent rights can be found in the PATENTS file in the same directory.
+ */
+#pragma once
+
+#include <sstream>
+#include <string>
+#include <utility>
+#include <vector>
+
+namespace facebook {
+namespace wdt {
+
+/**
+ * Results of a benchmark in the json schema shared by the wdt benchmarks,
+ * written when -bench_json_output is set so that runs can be stored and
+ * compared against a baseline (bench/wdt_bench_compare.py). Each result is a
+ * json line:
+ * {"schema":"wdt_bench_v1","benchmark":..,"case":..,"params":{..},
+ *  "metrics":{"name":{"value":..,"unit":..,"better":"higher"|"lower"}},
+ *  "env":{"host":..,"kernel":..,"cpu_model":..,"num_cpus":..,..}}
+ * The results of the repeated runs of a case are separate lines with the
+ * same benchmark, case and params, the comparison uses their spread.
+ */
+class BenchResults {
+ public:
+  /// whether a larger value of a metric is an improvement
+  enum Better { HIGHER, LOWER };
+
+  /// a result of the benchmark
+  class Result {
+   public:
+    explicit Result(const std::string &caseName) : caseName_(caseName) {
+    }
+
+    /// adds a parameter identifying the case
+    Result &param(const std::string &name, const std::string &value);
+
+    /// adds a numeric parameter identifying the case
+    template <typename T>
+    Result &param(const std::string &name, const T &value) {
+      std::ostringstream str;
+      str << value;
+      return param(name, str.str());
+    }
+
+    /// adds a measured value
+    Result &metric(const std::string &name, double value,
+                   const std::string &unit, Better better);
+
+   private:
+    friend class BenchResults;
+
+    struct Metric {
+      std::string name;
+      double value;
+      std::string unit;
+      Better better;
+    };
+
+    std::string caseName_;
+    std::vector<std::pair<std::string, std::string>> params_;
+    std::vector<Metric> metrics_;
+  };
+
+  /// @param benchmark    name of the benchmark binary
+  explicit BenchResults(const std::string &benchmark);
+
+  /// writes the results added, if -bench_json_output is set
+  ~BenchResults();
+
+  /// @return   a new result of caseName to fill, valid till the next add()
+  Result &add(const std::string &caseName);
+
+  /**
+   * Appends the results as json lines to the file of -bench_json_output,
+   * - for stdout, and forgets them. Nothing is done if the flag is empty
+   *
+   * @return    false if the file couldn't be written
+   */
+  bool write();
+
+  /// @return   json object of the host and build the benchmark runs on
+  static std::string getEnvironmentJson();
+
+  /// @return   str quoted and escaped as a json string
+  static std::string quote(const std::string &str);
+
+ private:
+  const std::string benchmark_;
+  std::vector<Result> results_;
+};
+}
+}
@@ -0,0 +1,172 @@
+/**
+ * Copyright (c) 2014-present, Facebook, Inc.
+ * All rights reserved.
+ *
+ * This source code is licensed under the BSD-style license found in the
+ * LICENSE file in the root directory of this source tree. An additional grant
+ * of patent rights can be found in the PATENTS file in the same directory.
+ */
+/**
+ * Measures the per chunk loop of the sender and receiver threads when it
+ * checks the footer type and the throttler for every chunk versus when it is
+ * specialized on them at compile time. The chunks are copied to a sink buffer
+ * instead of a socket so that the loop itself dominates.
+ * Prints one csv row per benchmark with its nanoseconds per chunk.
+ * Example use:
+ * wdt_chunk_loop_bench -chunk_size=4096 -num_chunks=10000000
+ */
+#include <string.h>
+#include <chrono>
+#include <iostream>
+#include <memory>
+#include <string>
+#include <vector>
+
+#include <folly/hash/Checksum.h>
+#include <gflags/gflags.h>
+#include <glog/logging.h>
+
+#include <wdt/WdtConfig.h>
+
+#include "BenchResults.h"
+
+DEFINE_int64(num_chunks, 10000000, "Number of chunks per benchmark");
+DEFINE_int32(chunk_size, 4096, "Size of each chunk");
+DEFINE_int32(iterations, 3, "Number of times each benchmark is run");
+
+using std::string;
+
+typedef std::chrono::steady_clock BenchClock;
+
+namespace {
+
+/// stands in for the throttler, only counts the bytes it is told about
+class BenchLimiter {
+ public:
+  virtual ~BenchLimiter() {
+  }
+  virtual void limit(int64_t deltaProgress) {
+    bytes_ += deltaProgress;
+  }
+  int64_t bytes_{0};
+};
+
+/// the transfer state the thread loops read, as members of the thread
+struct LoopState {
+  bool checksum{false};
+  std::shared_ptr<BenchLimiter> limiter;
+  std::shared_ptr<BenchLimiter> getLimiter() const {
+    return limiter;
+  }
+};
+
+/// checks the state for every chunk, as the loops did
+__attribute__((noinline)) int64_t genericLoop(const LoopState &state,
+                                              const char *src, char *sink) {
+  uint32_t checksum = 0;
+  int64_t total = 0;
+  for (int64_t i = 0; i < FLAGS_num_chunks; ++i) {
+    if (state.checksum) {
+      checksum = folly::crc32c((const uint8_t *)src, FLAGS_chunk_size,
+                               checksum);
+    }
+    memcpy(sink, src, FLAGS_chunk_size);
+    if (state.getLimiter()) {
+      state.getLimiter()->limit(FLAGS_chunk_size);
+    }
+    total += FLAGS_chunk_size;
+  }
+  return total + checksum;
+}
+
+/// specialized once on the state, as the loops now are
+template <bool kChecksum, bool kThrottled>
+__attribute__((noinline)) int64_t specializedLoop(const LoopState &state,
+                                                  const char *src,
+                                                  char *sink) {
+  BenchLimiter *const limiter =
+      kThrottled ? state.getLimiter().get() : nullptr;
+  uint32_t checksum = 0;
+  int64_t total = 0;
+  for (int64_t i = 0; i < FLAGS_num_chunks; ++i) {
+    if (kChecksum) {
+      checksum = folly::crc32c((const uint8_t *)src, FLAGS_chunk_size,
+                               checksum);
+    }
+    memcpy(sink, src, FLAGS_chunk_size);
+    if (kThrottled) {
+      limiter->limit(FLAGS_chunk_size);
+    }
+    total += FLAGS_chunk_size;
+  }
+  return total + checksum;
+}
+
+typedef int64_t (*LoopFunction)(const LoopState &, const char *, char *);
+
+LoopFunction chooseLoop(const LoopState &state) {
+  const bool throttled = (state.getLimiter() != nullptr);
+  if (state.checksum) {
+    return throttled ? &specializedLoop<true, true>
+                     : &specializedLoop<true, false>;
+  }
+  return throttled ? &specializedLoop<false, true>
+                   : &specializedLoop<false, false>;
+}
+
+void runBenchmark(const string &name, LoopFunction loop,
+                  const LoopState &state, const char *src, char *sink,
+                  facebook::wdt::BenchResults &results) {
+  for (int i = 0; i < FLAGS_iterations; ++i) {
+    auto start = BenchClock::now();
+    int64_t result = loop(state, src, sink);
+    double elapsed =
+        std::chrono::duration<double, std::nano>(BenchClock::now() - start)
+            .count();
+    CHECK_GE(result, FLAGS_num_chunks * FLAGS_chunk_size);
+    std::cout << name << "," << FLAGS_chunk_size << ","
+              << elapsed / FLAGS_num_chunks << std::endl;
+    results.add(name)
+        .param("chunk_size", FLAGS_chunk_size)
+        .metric("ns_per_chunk", elapsed / FLAGS_num_chunks, "ns",
+                facebook::wdt::BenchResults::LOWER);
+  }
+}
+}
+
+int main(int argc, char **argv) {
+  FLAGS_logtostderr = true;
+  // gflags api is nicely inconsistent here
+  GFLAGS_NAMESPACE::SetArgv(argc, const_cast<const char **>(argv));
+  GFLAGS_NAMESPACE::SetVersionString(WDT_VERSION_STR);
+  string usage("Send/receive chunk loop benchmark. v");
+  usage.append(GFLAGS_NAMESPACE::VersionString());
+  usage.append(". Sample usage:\n\t");
+  usage.append(GFLAGS_NAMESPACE::ProgramInvocationShortName());
+  usage.append(" [-num_chunks=n] [-chunk_size=bytes]");
+  GFLAGS_NAMESPACE::SetUsageMessage(usage);
+  GFLAGS_NAMESPACE::ParseCommandLineFlags(&argc, &argv, true);
+  google::InitGoogleLogging(argv[0]);
+
+  CHECK_GT(FLAGS_chunk_size, 0);
+  std::vector<char> src(FLAGS_chunk_size, 'd');
+  std::vector<char> sink(FLAGS_chunk_size);
+  facebook::wdt::BenchResults results("wdt_chunk_loop_bench");
+  std::cout << "benchmark,chunk_size,ns_per_chunk" << std::endl;
+  for (bool checksum : {false, true}) {
+    for (bool throttled : {false, true}) {
+      LoopState state;
+      state.checksum = checksum;
+      if (throttled) {
+        state.limiter = std::make_shared<BenchLimiter>();
+      }
+      const string suffix = string(checksum ? "_checksum" : "_nochecksum") +
+                            (throttled ? "_throttled" : "_unthrottled");
+      runBenchmark("generic" + suffix, &genericLoop, state, src.data(),
+                   sink.data(), results);
+      runBenchmark("specialized" + suffix, chooseLoop(state), state,
+                   src.data(), sink.data(), results);
+    }
+  }
+  return results.write() ? 0 : 1;
+}
@@ -0,0 +1,402 @@
+/**
+ * Copyright (c) 2014-present, Facebook, Inc.
+ * All rights reserved.
+ *
+ * This source code is licensed under the BSD-style license found in the
+ * LICENSE file in the root directory of this source tree. An additional grant
+ * of patent rights can be found in the PATENTS file in the same directory.
+ */
+/**
+ * Measures AESEncryptor::encrypt and AESDecryptor::decrypt the way WdtSocket
+ * drives them: the stream is processed in buffers of the given size, a tag
+ * is computed (sender) or verified (receiver) every tag interval for gcm and
+ * the iv is changed at the tags once the iv change interval is reached. Each
+ * thread goes over a shared input stream in a loop, each pass being a new
+ * session (start, then finish with the final tag). Prints one csv row per
+ * combination of the swept encryption types, buffer sizes, thread counts,
+ * tag and iv change intervals, with the throughput and the throughput per
+ * cpu second (per core), to size hosts for encrypted transfers.
+ * Each list flag is comma separated. Example use:
+ * wdt_crypto_bench -encryption_types=aes128gcm -num_threads=1,8
+ */
+#include <time.h>
+#include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <iostream>
+#include <memory>
+#include <random>
+#include <string>
+#include <thread>
+#include <vector>
+
+#include <gflags/gflags.h>
+#include <glog/logging.h>
+
+#include <wdt/Reporting.h>
+#include <wdt/WdtConfig.h>
+#include <wdt/util/EncryptionUtils.h>
+
+#include "BenchResults.h"
+
+DEFINE_string(encryption_types, "aes128ctr,aes128gcm",
+              "Encryption types to sweep");
+DEFINE_string(buffer_sizes, "16384,262144,4194304",
+              "Sizes passed to each encrypt/decrypt call to sweep");
+DEFINE_string(num_threads, "1,4,16", "Numbers of threads to sweep");
+DEFINE_string(tag_intervals_bytes, "0,4194304",
+              "encryption_tag_interval_bytes to sweep (gcm only), 0 for tags "
+              "only at the end of each pass");
+DEFINE_string(iv_change_intervals_mb, "0,16",
+              "iv_change_interval_mb to sweep, 0 for no iv change. The iv is "
+              "changed at tags only, as by wdt");
+DEFINE_int32(stream_mbytes, 64,
+             "Size of the stream each pass goes over, shared by the threads");
+DEFINE_int32(duration_millis, 1000, "Duration of each run");
+
+using namespace facebook::wdt;
+using std::string;
+
+typedef std::chrono::steady_clock BenchClock;
+
+namespace {
+std::vector<int64_t> parseList(const string &list) {
+  std::vector<int64_t> values;
+  size_t start = 0;
+  while (start < list.size()) {
+    size_t end = list.find(',', start);
+    if (end == string::npos) {
+      end = list.size();
+    }
+    if (end > start) {
+      values.push_back(std::stoll(list.substr(start, end - start)));
+    }
+    start = end + 1;
+  }
+  return values;
+}
+
+std::vector<string> parseStringList(const string &list) {
+  std::vector<string> values;
+  size_t start = 0;
+  while (start < list.size()) {
+    size_t end = list.find(',', start);
+    if (end == string::npos) {
+      end = list.size();
+    }
+    if (end > start) {
+      values.push_back(list.substr(start, end - start));
+    }
+    start = end + 1;
+  }
+  return values;
+}
+
+int64_t threadCpuNanos() {
+  struct timespec ts;
+  clock_gettime(CLOCK_THREAD_CPUTIME_ID, &ts);
+  return ts.tv_sec * 1000000000LL + ts.tv_nsec;
+}
+
+/// configuration of a run
+struct CryptoConfig {
+  EncryptionParams encryptionParams;
+  int bufferSize{0};
+  /// 0 when the encryption type has no tag or no intermediate tags are used
+  int64_t tagInterval{0};
+  int64_t ivChangeInterval{0};
+};
+
+/// what the sender sent besides the encrypted data, for the receiver
+struct SessionRecord {
+  /// iv of the start and of each iv change, in order
+  std::vector<string> ivs;
+  /// tags in the order they were computed, the last one ends the pass
+  std::vector<string> tags;
+};
+
+/// @return   offset of the next tag from processed, as WdtSocket computes it
+int64_t nextTagOffset(int64_t processed, int64_t tagInterval) {
+  if (processed == 0) {
+    return tagInterval;
+  }
+  const int64_t offset = tagInterval - (processed % tagInterval);
+  return offset == tagInterval ? 0 : offset;
+}
+
+/**
+ * Encrypts the stream once, as a sender socket does
+ *
+ * @param in        stream to encrypt
+ * @param out       buffer of the encrypted data, advanced with the stream
+ *                  when record is set, else of bufferSize reused
+ * @param record    where the ivs and tags are stored, if not null
+ *
+ * @return          whether the encryption was successful
+ */
+bool encryptStream(const CryptoConfig &config, const std::vector<char> &in,
+                   char *out, SessionRecord *record) {
+  auto encryptor = std::make_unique<AESEncryptor>();
+  string iv;
+  if (!encryptor->start(config.encryptionParams, iv)) {
+    return false;
+  }
+  if (record) {
+    record->ivs.push_back(iv);
+  }
+  const int64_t size = in.size();
+  int64_t processed = 0;
+  while (processed < size) {
+    int64_t toProcess = std::min<int64_t>(config.bufferSize, size - processed);
+    if (config.tagInterval > 0) {
+      const int64_t tagOffset = nextTagOffset(processed, config.tagInterval);
+      if (tagOffset == 0) {
+        const string tag = encryptor->computeCurrentTag();
+        if (tag.empty()) {
+          return false;
+        }
+        if (record) {
+          record->tags.push_back(tag);
+        }
+        if (config.ivChangeInterval > 0 &&
+            encryptor->getNumProcessed() + config.tagInterval >
+                config.ivChangeInterval) {
+          encryptor = std::make_unique<AESEncryptor>();
+          if (!encryptor->start(config.encryptionParams, iv)) {
+            return false;
+          }
+          if (record) {
+            record->ivs.push_back(iv);
+          }
+        }
+      } else {
+        toProcess = std::min(toProcess, tagOffset);
+      }
+    }
+    char *dest = record ? out + processed : out;
+    if (!encryptor->encrypt(in.data() + processed, toProcess, dest)) {
+      return false;
+    }
+    processed += toProcess;
+  }
+  string tag;
+  if (!encryptor->finish(tag)) {
+    return false;
+  }
+  if (record) {
+    record->tags.push_back(tag);
+  }
+  return true;
+}
+
+/**
+ * Decrypts the stream once, verifying its tags as a receiver socket does
+ *
+ * @param in        stream encrypted by encryptStream()
+ * @param out       buffer of bufferSize for the decrypted data
+ * @param record    ivs and tags of the encryption
+ *
+ * @return          whether the decryption and the tags verified
+ */
+bool decryptStream(const CryptoConfig &config, const std::vector<char> &in,
+                   char *out, const SessionRecord &record) {
+  size_t ivIndex = 0;
+  size_t tagIndex = 0;
+  auto decryptor = std::make_unique<AESDecryptor>();
+  if (!decryptor->start(config.encryptionParams, record.ivs[ivIndex++])) {
+    return false;
+  }
+  const int64_t size = in.size();
+  int64_t processed = 0;
+  while (processed < size) {
+    int64_t toProcess = std::min<int64_t>(config.bufferSize, size - processed);
+    if (config.tagInterval > 0) {
+      const int64_t tagOffset = nextTagOffset(processed, config.tagInterval);
+      if (tagOffset == 0) {
+        const string &tag = record.tags[tagIndex++];
+        if (!decryptor->verifyTag(tag)) {
+          return false;
+        }
+        if (config.ivChangeInterval > 0 &&
+            decryptor->getNumProcessed() + config.tagInterval >
+                config.ivChangeInterval) {
+          if (!decryptor->finish(tag)) {
+            return false;
+          }
+          decryptor = std::make_unique<AESDecryptor>();
+          if (!decryptor->start(config.encryptionParams,
+                                record.ivs[ivIndex++])) {
+            return false;
+          }
+        }
+      } else {
+        toProcess = std::min(toProcess, tagOffset);
+      }
+    }
+    if (!decryptor->decrypt(in.data() + processed, toProcess, out)) {
+      return false;
+    }
+    processed += toProcess;
+  }
+  return decryptor->finish(record.tags[tagIndex]);
+}
+
+/// what a run measured
+struct RunResult {
+  int64_t numBytes{0};
+  int64_t numPasses{0};
+  double elapsedSecs{0};
+  int64_t cpuNanos{0};
+  bool ok{true};
+};
+
+/**
+ * Runs the threads over the stream till the duration is over
+ *
+ * @param encrypt   whether to encrypt plain, else decrypt encrypted
+ */
+RunResult runThreads(const CryptoConfig &config, int numThreads, bool encrypt,
+                     const std::vector<char> &plain,
+                     const std::vector<char> &encrypted,
+                     const SessionRecord &record) {
+  std::vector<RunResult> results(numThreads);
+  std::atomic<bool> stop{false};
+  std::vector<std::thread> threads;
+  const auto start = BenchClock::now();
+  for (int i = 0; i < numThreads; i++) {
+    threads.emplace_back([&, i] {
+      RunResult &result = results[i];
+      std::vector<char> out(config.bufferSize);
+      const int64_t cpuStart = threadCpuNanos();
+      while (!stop.load(std::memory_order_relaxed)) {
+        const bool ok =
+            encrypt ? encryptStream(config, plain, out.data(), nullptr)
+                    : decryptStream(config, encrypted, out.data(), record);
+        if (!ok) {
+          result.ok = false;
+          break;
+        }
+        result.numPasses++;
+        result.numBytes += plain.size();
+      }
+      result.cpuNanos = threadCpuNanos() - cpuStart;
+    });
+  }
+  std::this_thread::sleep_for(std::chrono::milliseconds(FLAGS_duration_millis));
+  stop = true;
+  for (auto &t : threads) {
+    t.join();
+  }
+  RunResult total;
+  total.elapsedSecs =
+      std::chrono::duration<double>(BenchClock::now() - start).count();
+  for (const auto &result : results) {
+    total.numBytes += result.numBytes;
+    total.numPasses += result.numPasses;
+    total.cpuNanos += result.cpuNanos;
+    total.ok = total.ok && result.ok;
+  }
+  return total;
+}
+
+void runBenchmark(const CryptoConfig &config, int numThreads,
+                  const std::vector<char> &plain, BenchResults &benchResults) {
+  // the stream the receivers decrypt, with the ivs and tags sent with it
+  std::vector<char> encrypted(plain.size());
+  SessionRecord record;
+  const bool recorded =
+      encryptStream(config, plain, encrypted.data(), &record);
+  CHECK(recorded);
+  const string type =
+      encryptionTypeToStr(config.encryptionParams.getType());
+  for (bool encrypt : {true, false}) {
+    const RunResult result =
+        runThreads(config, numThreads, encrypt, plain, encrypted, record);
+    const char *op = encrypt ? "encrypt" : "decrypt";
+    if (!result.ok) {
+      LOG(ERROR) << op << " failed for " << type << " buffer size "
+                 << config.bufferSize;
+      continue;
+    }
+    const double gbytes = (double)result.numBytes / kMbToB / 1024;
+    const double gbytesPerSec = gbytes / result.elapsedSecs;
+    const double gbytesPerCpuSec =
+        result.cpuNanos > 0 ? gbytes / (result.cpuNanos / 1e9) : 0;
+    std::cout << op << "," << type << "," << config.bufferSize << ","
+              << numThreads << "," << config.tagInterval << ","
+              << config.ivChangeInterval / kMbToB << "," << result.numPasses
+              << "," << gbytesPerSec << "," << gbytesPerCpuSec << std::endl;
+    benchResults.add(op)
+        .param("encryption", type)
+        .param("buffer_size", config.bufferSize)
+        .param("threads", numThreads)
+        .param("tag_interval_bytes", config.tagInterval)
+        .param("iv_change_interval_mb", config.ivChangeInterval / kMbToB)
+        .metric("gbytes_per_sec", gbytesPerSec, "gbytes/s",
+                BenchResults::HIGHER)
+        .metric("gbytes_per_cpu_sec", gbytesPerCpuSec, "gbytes/cpu_s",
+                BenchResults::HIGHER);
+  }
+}
+}
+
+int main(int argc, char **argv) {
+  FLAGS_logtostderr = true;
+  // the encryptors log each finish at info, once per pass
+  FLAGS_minloglevel = google::WARNING;
+  // gflags api is nicely inconsistent here
+  GFLAGS_NAMESPACE::SetArgv(argc, const_cast<const char **>(argv));
+  GFLAGS_NAMESPACE::SetVersionString(WDT_VERSION_STR);
+  string usage("Encryption throughput benchmark. v");
+  usage.append(GFLAGS_NAMESPACE::VersionString());
+  usage.append(". Sample usage:\n\t");
+  usage.append(GFLAGS_NAMESPACE::ProgramInvocationShortName());
+  usage.append(" [-encryption_types=aes128gcm] [-num_threads=1,8]");
+  GFLAGS_NAMESPACE::SetUsageMessage(usage);
+  GFLAGS_NAMESPACE::ParseCommandLineFlags(&argc, &argv, true);
+  google::InitGoogleLogging(argv[0]);
+
+  CHECK_GT(FLAGS_stream_mbytes, 0);
+  std::vector<char> plain((int64_t)(FLAGS_stream_mbytes * kMbToB));
+  std::mt19937_64 rng(42);
+  for (auto &c : plain) {
+    c = (char)rng();
+  }
+
+  BenchResults benchResults("wdt_crypto_bench");
+  std::cout << "op,encryption,buffer_size,threads,tag_interval_bytes,"
+            << "iv_change_interval_mb,passes,gbytes_per_sec,"
+            << "gbytes_per_cpu_sec" << std::endl;
+  for (const string &typeStr : parseStringList(FLAGS_encryption_types)) {
+    const EncryptionType type = parseEncryptionType(typeStr);
+    if (type == ENC_NONE) {
+      LOG(ERROR) << "Skipping encryption type " << typeStr;
+      continue;
+    }
+    CryptoConfig config;
+    config.encryptionParams = EncryptionParams::generateEncryptionParams(type);
+    for (int64_t bufferSize : parseList(FLAGS_buffer_sizes)) {
+      CHECK_GT(bufferSize, 0);
+      config.bufferSize = bufferSize;
+      for (int64_t numThreads : parseList(FLAGS_num_threads)) {
+        CHECK_GT(numThreads, 0);
+        for (int64_t tagInterval : parseList(FLAGS_tag_intervals_bytes)) {
+          if (tagInterval > 0 && !encryptionTypeToTagLen(type)) {
+            // no intermediate tags without tag support, as in WdtSocket
+            continue;
+          }
+          config.tagInterval = tagInterval;
+          for (int64_t ivChangeMb : parseList(FLAGS_iv_change_intervals_mb)) {
+            if (ivChangeMb > 0 && tagInterval <= 0) {
+              // the iv only changes at tags
+              continue;
+            }
+            config.ivChangeInterval = (int64_t)(ivChangeMb * kMbToB);
+            runBenchmark(config, numThreads, plain, benchResults);
+          }
+        }
+      }
+    }
+  }
+  return benchResults.write() ? 0 : 1;
+}
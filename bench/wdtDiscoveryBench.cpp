@@ -0,0 +1,145 @@
+/**
+ * Copyright (c) 2014-present, Facebook, Inc.
+ * All rights reserved.
+ *
+ * This source code is licensed under the BSD-style license found in the
+ * LICENSE file in the root directory of this source tree. An additional grant
+ * of patent rights can be found in the PATENTS file in the same directory.
+ */
+/**
+ * Measures directory discovery speed in entries per second. Example use:
+ * wdt_discovery_bench -directory=/tmp/flat -create_files=1000000
+ * wdt_discovery_bench -directory=/data/src -num_discovery_threads=8
+ */
+#include <fcntl.h>
+#include <unistd.h>
+#include <atomic>
+#include <chrono>
+#include <deque>
+#include <iostream>
+
+#include <gflags/gflags.h>
+#include <glog/logging.h>
+
+#include <wdt/WdtConfig.h>
+#include <wdt/util/DirectoryReader.h>
+#include <wdt/util/DirectorySourceQueue.h>
+
+#include "BenchResults.h"
+
+DEFINE_string(directory, ".", "Directory to discover");
+DEFINE_int32(create_files, 0,
+             "If > 0, first create that many empty files directly in "
+             "directory (flat directory case)");
+DEFINE_int32(iterations, 3, "Number of times each discovery is run");
+DEFINE_int32(num_discovery_threads, 1,
+             "Number of threads for the full DirectorySourceQueue discovery");
+DEFINE_bool(follow_symlinks, false, "Follow symlinks during discovery");
+
+using namespace facebook::wdt;
+using std::string;
+
+typedef std::chrono::steady_clock BenchClock;
+
+static double secondsSince(BenchClock::time_point start) {
+  return std::chrono::duration<double>(BenchClock::now() - start).count();
+}
+
+/// raw DirectoryReader walk, stat'ing every non directory entry
+static int64_t readerWalk(const string &rootDir, int64_t &numBatches) {
+  DirectoryReader reader;
+  std::deque<string> todo;
+  todo.push_back(rootDir);
+  int64_t numEntries = 0;
+  while (!todo.empty()) {
+    string dir = std::move(todo.front());
+    todo.pop_front();
+    if (!reader.open(dir)) {
+      PLOG(ERROR) << "Unable to open " << dir;
+      continue;
+    }
+    const char *name;
+    unsigned char type;
+    while (reader.next(name, type)) {
+      ++numEntries;
+      if (type == DT_DIR) {
+        todo.push_back(dir + "/" + name);
+        continue;
+      }
+      struct stat st;
+      if (!reader.statEntry(name, false, st)) {
+        PLOG(ERROR) << "Unable to stat " << dir << "/" << name;
+        continue;
+      }
+      if (type == DT_UNKNOWN && S_ISDIR(st.st_mode)) {
+        todo.push_back(dir + "/" + name);
+      }
+    }
+  }
+  numBatches = reader.getNumBatches();
+  return numEntries;
+}
+
+int main(int argc, char **argv) {
+  FLAGS_logtostderr = true;
+  // gflags api is nicely inconsistent here
+  GFLAGS_NAMESPACE::SetArgv(argc, const_cast<const char **>(argv));
+  GFLAGS_NAMESPACE::SetVersionString(WDT_VERSION_STR);
+  string usage("Directory discovery benchmark. v");
+  usage.append(GFLAGS_NAMESPACE::VersionString());
+  usage.append(". Sample usage:\n\t");
+  usage.append(GFLAGS_NAMESPACE::ProgramInvocationShortName());
+  usage.append(" -directory=dir [-create_files=n]");
+  GFLAGS_NAMESPACE::SetUsageMessage(usage);
+  GFLAGS_NAMESPACE::ParseCommandLineFlags(&argc, &argv, true);
+  google::InitGoogleLogging(argv[0]);
+
+  for (int i = 0; i < FLAGS_create_files; ++i) {
+    const string path = FLAGS_directory + "/f" + std::to_string(i);
+    int fd = open(path.c_str(), O_CREAT | O_WRONLY | O_CLOEXEC, 0644);
+    if (fd < 0) {
+      PLOG(FATAL) << "Unable to create " << path;
+    }
+    close(fd);
+  }
+
+  BenchResults benchResults("wdt_discovery_bench");
+  for (int i = 0; i < FLAGS_iterations; ++i) {
+    int64_t numBatches = 0;
+    auto start = BenchClock::now();
+    const int64_t numEntries = readerWalk(FLAGS_directory, numBatches);
+    const double elapsed = secondsSince(start);
+    std::cout << "reader walk: " << numEntries << " entries in " << elapsed
+              << " s, " << numEntries / elapsed << " entries/s, "
+              << numBatches << " batches" << std::endl;
+    benchResults.add("reader_walk")
+        .param("entries", numEntries)
+        .metric("entries_per_sec", numEntries / elapsed, "entries/s",
+                BenchResults::HIGHER);
+  }
+
+  WdtOptions options;
+  std::atomic<bool> abortTrigger{false};
+  WdtAbortChecker abortChecker(abortTrigger);
+  for (int i = 0; i < FLAGS_iterations; ++i) {
+    DirectorySourceQueue queue(options, FLAGS_directory, &abortChecker);
+    queue.setNumDiscoveryThreads(FLAGS_num_discovery_threads);
+    queue.setFollowSymlinks(FLAGS_follow_symlinks);
+    auto start = BenchClock::now();
+    if (!queue.buildQueueSynchronously()) {
+      LOG(ERROR) << "Discovery reported errors";
+    }
+    const double elapsed = secondsSince(start);
+    std::cout << "queue discovery (" << FLAGS_num_discovery_threads
+              << " threads): " << queue.getCount() << " files in " << elapsed
+              << " s, " << queue.getCount() / elapsed << " files/s"
+              << std::endl;
+    benchResults.add("queue_discovery")
+        .param("files", queue.getCount())
+        .param("discovery_threads", FLAGS_num_discovery_threads)
+        .param("follow_symlinks", FLAGS_follow_symlinks)
+        .metric("files_per_sec", queue.getCount() / elapsed, "files/s",
+                BenchResults::HIGHER);
+  }
+  return benchResults.write() ? 0 : 1;
+}
@@ -9,14 +9,21 @@
 #include <assert.h>
 #include <time.h>
 #include <array>
+#include <atomic>
+#include <chrono>
+#include <cmath>
 #include <fstream>
 #include <future>
 #include <initializer_list>
 #include <iostream>
 #include <memory>
 #include <random>
+#include <string>
+#include <thread>
 #include <vector>
 
+#include <fcntl.h>
+#include <sys/stat.h>
 #include <unistd.h>
 
 #include <gflags/gflags.h>
@@ -25,14 +32,7 @@
 #include <wdt/WdtConfig.h>
 #include "Bigram.h"
 
-/* Future "interface"/"features":
-
-DEFINE_int32(dir_depth, 8, "Directory depth");
-DEFINE_int32(files_per_dir, 8, "Files per directory");
-DEFINE_int32(ascii_percent, 30, "Percentage of ASCII files");
-DEFINE_double(total_size_gb, 10.0, "Total data set size in gigabytes");
-*/
-/// For now:
+/// Single file mode:
 DEFINE_double(gen_size_mb, 10, "Size of data to generate in MBytes");
 DEFINE_int32(gen_block_size, 16384, "Size of blocks to generate (in bytes)");
 DEFINE_int32(num_threads, 16, "Number of threads");
@@ -45,6 +45,30 @@ DEFINE_string(reset_char, "",
               "In case of dead-end, try to start at that character, or rnd");
 DEFINE_string(directory, ".", "Directory in which to generate data");
 DEFINE_string(filename, "gen.data", "Base filename to use for generated data");
+/// Tree mode:
+DEFINE_int64(num_files, 0,
+             "If > 0, generates a tree of that many files in directory "
+             "instead of the single filename file");
+DEFINE_int32(dir_depth, 3, "Depth of the leaf directories of the tree");
+DEFINE_int32(dir_fanout, 8, "Sub directories per directory of the tree");
+DEFINE_int32(files_per_dir, 100, "Files per leaf directory of the tree");
+DEFINE_string(size_distribution, "lognormal",
+              "Distribution of the file sizes: fixed, lognormal or bimodal "
+              "(tiny and huge files)");
+DEFINE_double(file_size_kb, 64,
+              "Size of the files if fixed, median size if lognormal, size of "
+              "the tiny files if bimodal");
+DEFINE_double(file_size_sigma, 2,
+              "Standard deviation of the log of the sizes if lognormal");
+DEFINE_double(max_file_size_mb, 4096, "Max size of the lognormal files");
+DEFINE_double(huge_percent, 1, "Percentage of huge files if bimodal");
+DEFINE_double(huge_file_size_mb, 1024, "Size of the huge files if bimodal");
+DEFINE_int32(sparse_percent, 0,
+             "Percentage of sparse files, with only their first and last "
+             "gen_block_size bytes written");
+DEFINE_int32(ascii_percent, 30,
+             "Percentage of files of bigram text (compressible), the others "
+             "are random bytes");
 
 template <typename T>
 class ProbabilityTable;  // forward for operator below
@@ -322,6 +346,170 @@ void deserialize(std::vector<PairBigramCount> &statsData, std::istream &sin) {
 
 using std::string;
 
+/// @return   size of the next file of the tree
+static int64_t pickFileSize(RndEngine &gen) {
+  const double kKbToB = 1024;
+  const double kMbToB = 1024 * 1024;
+  if (FLAGS_size_distribution == "fixed") {
+    return FLAGS_file_size_kb * kKbToB;
+  }
+  if (FLAGS_size_distribution == "bimodal") {
+    std::uniform_real_distribution<double> percent(0, 100);
+    if (percent(gen) < FLAGS_huge_percent) {
+      return FLAGS_huge_file_size_mb * kMbToB;
+    }
+    return FLAGS_file_size_kb * kKbToB;
+  }
+  std::lognormal_distribution<double> size(log(FLAGS_file_size_kb * kKbToB),
+                                           FLAGS_file_size_sigma);
+  return std::min(size(gen), FLAGS_max_file_size_mb * kMbToB);
+}
+
+/// @return   relative path, ending with /, of a leaf directory of the tree.
+///           Indexes past the number of leaves wrap around
+static string leafDirectory(int64_t dirIndex) {
+  string path;
+  for (int depth = 0; depth < FLAGS_dir_depth; ++depth) {
+    path.append("d").append(std::to_string(dirIndex % FLAGS_dir_fanout));
+    path.push_back('/');
+    dirIndex /= FLAGS_dir_fanout;
+  }
+  return path;
+}
+
+/// appends len random, incompressible, bytes to result
+static void generateRandom(std::mt19937_64 &gen, string &result, size_t len) {
+  while (len > 0) {
+    const uint64_t value = gen();
+    const size_t n = std::min(len, sizeof(value));
+    result.append(reinterpret_cast<const char *>(&value), n);
+    len -= n;
+  }
+}
+
+/**
+ * Generates file index of the tree, the same whatever the thread generating
+ * it as its random generator is seeded with its index
+ *
+ * @return    number of bytes written
+ */
+static int64_t generateFile(SentenceGen *sg, int64_t index,
+                            const string &path) {
+  // consecutive seeds would start consecutive files with correlated values
+  const uint32_t seedTime = FLAGS_seed_with_time ? time(nullptr) : 0;
+  std::seed_seq seed{(uint32_t)index, (uint32_t)(index >> 32), seedTime};
+  std::shared_ptr<RndEngine> rndEngine = std::make_shared<RndEngine>(seed);
+  std::uniform_int_distribution<int> percent(0, 99);
+  const int64_t size = pickFileSize(*rndEngine);
+  const bool ascii =
+      (sg != nullptr && percent(*rndEngine) < FLAGS_ascii_percent);
+  const int64_t blockSz = FLAGS_gen_block_size;
+  const bool sparse = (percent(*rndEngine) < FLAGS_sparse_percent &&
+                       size > 2 * blockSz);
+  std::mt19937_64 randomBytes((*rndEngine)());
+  const int fd = open(path.c_str(), O_CREAT | O_WRONLY | O_TRUNC, 0644);
+  if (fd < 0) {
+    PLOG(FATAL) << "Unable to open " << path;
+  }
+  string res;
+  res.reserve(blockSz);
+  Bigram previous;
+  bool started = false;
+  auto writeBlock = [&](int64_t offset, int64_t len) {
+    res.clear();
+    if (!ascii) {
+      generateRandom(randomBytes, res, len);
+    } else if (started) {
+      sg->generate(*rndEngine, res, len, previous);
+    } else {
+      previous = sg->generateInitial(*rndEngine, res, len);
+      started = true;
+    }
+    ssize_t w = pwrite(fd, res.data(), res.size(), offset);
+    if (w != static_cast<ssize_t>(res.size())) {
+      PLOG(FATAL) << "Expected to write " << res.size() << " got " << w;
+    }
+  };
+  int64_t written = 0;
+  if (sparse) {
+    // the file size comes from the last block, the rest is a hole
+    writeBlock(0, blockSz);
+    writeBlock(size - blockSz, blockSz);
+    written = 2 * blockSz;
+  } else {
+    for (int64_t offset = 0; offset < size; offset += blockSz) {
+      writeBlock(offset, std::min(blockSz, size - offset));
+    }
+    written = size;
+  }
+  if (close(fd) != 0) {
+    PLOG(FATAL) << "Unable to close " << path;
+  }
+  return written;
+}
+
+/// generates the num_files files of the tree from num_threads threads
+static void generateTree(SentenceGen *sg) {
+  if (FLAGS_dir_depth < 0 || FLAGS_dir_fanout < 1 || FLAGS_files_per_dir < 1 ||
+      FLAGS_num_threads < 1) {
+    LOG(FATAL) << "Invalid dir_depth, dir_fanout, files_per_dir or "
+               << "num_threads";
+  }
+  if (FLAGS_size_distribution != "fixed" &&
+      FLAGS_size_distribution != "lognormal" &&
+      FLAGS_size_distribution != "bimodal") {
+    LOG(FATAL) << "Unknown size_distribution " << FLAGS_size_distribution;
+  }
+  int64_t numLeafDirs =
+      (FLAGS_num_files + FLAGS_files_per_dir - 1) / FLAGS_files_per_dir;
+  int64_t maxLeafDirs = 1;
+  for (int depth = 0; depth < FLAGS_dir_depth && maxLeafDirs < numLeafDirs;
+       ++depth) {
+    maxLeafDirs *= FLAGS_dir_fanout;
+  }
+  numLeafDirs = std::min(numLeafDirs, maxLeafDirs);
+  LOG(INFO) << "Generating " << FLAGS_num_files << " files in "
+            << numLeafDirs << " directories of depth " << FLAGS_dir_depth;
+  for (int64_t dirIndex = 0; dirIndex < numLeafDirs; ++dirIndex) {
+    const string path = leafDirectory(dirIndex);
+    // parents first
+    for (size_t pos = path.find('/'); pos != string::npos;
+         pos = path.find('/', pos + 1)) {
+      const string dir = path.substr(0, pos);
+      if (mkdir(dir.c_str(), 0755) != 0 && errno != EEXIST) {
+        PLOG(FATAL) << "Unable to create directory " << dir;
+      }
+    }
+  }
+  const auto startTime = std::chrono::steady_clock::now();
+  std::atomic<int64_t> nextFile{0};
+  std::atomic<int64_t> totalBytes{0};
+  std::vector<std::thread> threads;
+  for (int i = 0; i < FLAGS_num_threads; ++i) {
+    threads.emplace_back([sg, &nextFile, &totalBytes] {
+      while (true) {
+        const int64_t index = nextFile++;
+        if (index >= FLAGS_num_files) {
+          break;
+        }
+        const string path = leafDirectory(index / FLAGS_files_per_dir) + "f" +
+                            std::to_string(index);
+        totalBytes += generateFile(sg, index, path);
+      }
+    });
+  }
+  for (auto &thread : threads) {
+    thread.join();
+  }
+  const double seconds = std::chrono::duration<double>(
+                             std::chrono::steady_clock::now() - startTime)
+                             .count();
+  LOG(INFO) << "Generated " << FLAGS_num_files << " files, " << totalBytes
+            << " bytes written in " << seconds << " s: "
+            << FLAGS_num_files / seconds << " files/s, "
+            << totalBytes / seconds / 1024 / 1024 << " Mbytes/s";
+}
+
 int main(int argc, char **argv) {
   FLAGS_logtostderr = true;
   // gflags api is nicely inconsistent here
@@ -336,25 +524,44 @@ int main(int argc, char **argv) {
   GFLAGS_NAMESPACE::ParseCommandLineFlags(&argc, &argv, true);
   google::InitGoogleLogging(argv[0]);
 
+  if (FLAGS_gen_block_size < 1) {
+    LOG(FATAL) << "Invalid gen_block_size " << FLAGS_gen_block_size;
+  }
+  const bool treeMode = (FLAGS_num_files > 0);
   std::vector<PairBigramCount> statsData;
-  if (FLAGS_stats_source == "-") {
-    LOG(INFO) << "Reading stdin for Bigram data... (produced by wdt_gen_stats)";
-    deserialize(statsData, std::cin);
-  } else {
-    LOG(INFO) << "Reading " << FLAGS_stats_source << " for Bigram data... "
-              << "(produced by wdt_gen_stats)";
-    std::ifstream statsin(FLAGS_stats_source);
-    if (!statsin.good()) {
-      PLOG(FATAL) << "Unable to read bigrams from " << FLAGS_stats_source;
+  // random only trees need no bigrams
+  if (!treeMode || FLAGS_ascii_percent > 0) {
+    if (FLAGS_stats_source == "-") {
+      LOG(INFO) << "Reading stdin for Bigram data... "
+                << "(produced by wdt_gen_stats)";
+      deserialize(statsData, std::cin);
+    } else {
+      LOG(INFO) << "Reading " << FLAGS_stats_source << " for Bigram data... "
+                << "(produced by wdt_gen_stats)";
+      std::ifstream statsin(FLAGS_stats_source);
+      if (!statsin.good()) {
+        PLOG(FATAL) << "Unable to read bigrams from " << FLAGS_stats_source;
+      }
+      deserialize(statsData, statsin);
+    }
+    LOG(INFO) << "Found " << statsData.size() << " entries.";
+    if (statsData.empty()) {
+      LOG(FATAL) << "No bigram data found";
     }
-    deserialize(statsData, statsin);
   }
-  LOG(INFO) << "Found " << statsData.size() << " entries.";
 
   LOG(INFO) << "Will generate in directory=" << FLAGS_directory;
   if (chdir(FLAGS_directory.c_str())) {
     PLOG(FATAL) << "Error changing directory to " << FLAGS_directory;
   }
+  if (treeMode) {
+    std::unique_ptr<SentenceGen> sg;
+    if (!statsData.empty()) {
+      sg.reset(new SentenceGen(statsData));
+    }
+    generateTree(sg.get());
+    return 0;
+  }
 
   const size_t totalTargetSz = FLAGS_gen_size_mb * 1024 * 1024;
   const size_t numThreads = FLAGS_num_threads;
@@ -363,9 +570,6 @@ int main(int argc, char **argv) {
     LOG(FATAL) << "Invalid gen_size_mb and num_threads combo " << totalTargetSz;
   }
   const size_t totalSz = targetSzPerThread * numThreads;
-  if (FLAGS_gen_block_size < 1) {
-    LOG(FATAL) << "Invalid gen_block_size " << FLAGS_gen_block_size;
-  }
   const size_t blockSz =
       std::min(targetSzPerThread, (size_t)FLAGS_gen_block_size);
   LOG(INFO) << "Requested " << totalSz << " (" << targetSzPerThread
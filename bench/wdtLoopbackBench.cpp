@@ -0,0 +1,297 @@
+/**
+ * Copyright (c) 2014-present, Facebook, Inc.
+ * All rights reserved.
+ *
+ * This source code is licensed under the BSD-style license found in the
+ * LICENSE file in the root directory of this source tree. An additional grant
+ * of patent rights can be found in the PATENTS file in the same directory.
+ */
+/**
+ * Runs a sender and a receiver in this process over loopback, for each
+ * combination of the swept options, and prints one result per transfer as csv
+ * or json lines: throughput, files per second and cpu seconds per gbyte of
+ * both ends. Unless -directory is given, the files sent are generated first.
+ * Each list flag is comma separated. Example use:
+ * wdt_loopback_bench -num_ports=1,8 -encryption=none,aes128gcm
+ * wdt_loopback_bench -directory=/data/src -dst_root=/dev/shm -format=json
+ * wdt_loopback_bench -transport=tcp,shm (shm leaves out the network stack)
+ */
+#include <fcntl.h>
+#include <ftw.h>
+#include <signal.h>
+#include <stdlib.h>
+#include <sys/resource.h>
+#include <unistd.h>
+#include <chrono>
+#include <iostream>
+#include <string>
+#include <vector>
+
+#include <gflags/gflags.h>
+#include <glog/logging.h>
+
+#include <wdt/Receiver.h>
+#include <wdt/Sender.h>
+#include <wdt/WdtConfig.h>
+
+#include "BenchResults.h"
+
+DEFINE_string(directory, "",
+              "Directory to send. If empty, num_files files are generated");
+DEFINE_int32(num_files, 16, "Number of files generated");
+DEFINE_int64(file_size_mbytes, 64, "Size of each generated file");
+DEFINE_string(dst_root, "/tmp",
+              "Directory the generated files and the received ones go in");
+DEFINE_string(num_ports, "1,8", "Numbers of connections to sweep");
+DEFINE_string(buffer_size, "262144", "Buffer sizes to sweep");
+DEFINE_string(block_size_mbytes, "16", "Block sizes to sweep, in mbytes");
+DEFINE_string(encryption, "none,aes128gcm", "Encryption types to sweep");
+DEFINE_string(checksum, "false,true", "Checksum settings to sweep");
+DEFINE_string(transport, "tcp", "Transports to sweep: tcp, shm or rdma");
+DEFINE_int32(iterations, 1, "Number of transfers of each combination");
+DEFINE_bool(ipv6, true, "Transfer over ipv6 loopback, ipv4 otherwise");
+DEFINE_string(format, "csv", "Format of the results, csv or json");
+
+using namespace facebook::wdt;
+using std::string;
+
+typedef std::chrono::steady_clock BenchClock;
+
+namespace {
+/// one combination of the swept options
+struct BenchConfig {
+  int32_t numPorts;
+  int64_t bufferSize;
+  double blockSizeMbytes;
+  string encryption;
+  bool checksum;
+  string transport;
+};
+
+struct BenchResult {
+  ErrorCode status{OK};
+  double seconds{0};
+  int64_t dataBytes{0};
+  int64_t numFiles{0};
+  double cpuSeconds{0};
+};
+
+std::vector<string> splitList(const string &list) {
+  std::vector<string> items;
+  size_t start = 0;
+  while (start <= list.size()) {
+    size_t end = list.find(',', start);
+    if (end == string::npos) {
+      end = list.size();
+    }
+    if (end > start) {
+      items.push_back(list.substr(start, end - start));
+    }
+    start = end + 1;
+  }
+  CHECK(!items.empty()) << "Empty list " << list;
+  return items;
+}
+
+double cpuSeconds() {
+  struct rusage usage;
+  PCHECK(getrusage(RUSAGE_SELF, &usage) == 0);
+  auto toSeconds = [](const struct timeval &tv) {
+    return tv.tv_sec + tv.tv_usec / 1e6;
+  };
+  return toSeconds(usage.ru_utime) + toSeconds(usage.ru_stime);
+}
+
+int removeEntry(const char *path, const struct stat *, int, struct FTW *) {
+  return ::remove(path);
+}
+
+void removeTree(const string &dir) {
+  PCHECK(nftw(dir.c_str(), removeEntry, 64, FTW_DEPTH | FTW_PHYS) == 0)
+      << "Unable to remove " << dir;
+}
+
+string makeTempDir(const string &prefix) {
+  string dir = FLAGS_dst_root + "/" + prefix + "XXXXXX";
+  PCHECK(mkdtemp(&dir[0]) != nullptr) << "Unable to create " << dir;
+  return dir;
+}
+
+void generateFiles(const string &dir) {
+  const int64_t kChunkSize = 1024 * 1024;
+  std::vector<char> chunk(kChunkSize);
+  for (int64_t i = 0; i < kChunkSize; ++i) {
+    chunk[i] = (char)(i * 131 + (i >> 8));
+  }
+  for (int i = 0; i < FLAGS_num_files; ++i) {
+    const string path = dir + "/f" + std::to_string(i);
+    int fd = open(path.c_str(), O_CREAT | O_WRONLY | O_CLOEXEC, 0644);
+    PCHECK(fd >= 0) << "Unable to create " << path;
+    for (int64_t j = 0; j < FLAGS_file_size_mbytes; ++j) {
+      PCHECK(write(fd, chunk.data(), kChunkSize) == kChunkSize);
+    }
+    PCHECK(close(fd) == 0);
+  }
+}
+
+BenchResult runTransfer(const BenchConfig &config, const string &srcDir) {
+  WdtOptions options;
+  options.copyInto(WdtOptions::get());
+  options.num_ports = config.numPorts;
+  options.buffer_size = config.bufferSize;
+  options.block_size_mbytes = config.blockSizeMbytes;
+  options.encryption_type = config.encryption;
+  options.enable_checksum = config.checksum;
+  options.shm_transport = (config.transport == "shm");
+  options.rdma_transport = (config.transport == "rdma");
+  options.ipv6 = FLAGS_ipv6;
+  options.ipv4 = !FLAGS_ipv6;
+  const string dstDir = makeTempDir("wdtLoopbackBench");
+
+  BenchResult result;
+  const double startCpu = cpuSeconds();
+  const auto start = BenchClock::now();
+  {
+    WdtTransferRequest receiverRequest(0, config.numPorts, dstDir);
+    Receiver receiver(receiverRequest);
+    receiver.setWdtOptions(options);
+    WdtTransferRequest senderRequest = receiver.init();
+    CHECK_EQ(OK, senderRequest.errorCode) << "Receiver init failed";
+    receiver.transferAsync();
+    senderRequest.directory = srcDir;
+    Sender sender(senderRequest);
+    sender.setWdtOptions(options);
+    std::unique_ptr<TransferReport> senderReport = sender.transfer();
+    std::unique_ptr<TransferReport> receiverReport = receiver.finish();
+    const TransferStats &senderSummary = senderReport->getSummary();
+    result.status =
+        getMoreInterestingError(senderSummary.getErrorCode(),
+                                receiverReport->getSummary().getErrorCode());
+    result.dataBytes = senderSummary.getEffectiveDataBytes();
+    result.numFiles = senderSummary.getNumFiles();
+  }
+  result.seconds =
+      std::chrono::duration<double>(BenchClock::now() - start).count();
+  result.cpuSeconds = cpuSeconds() - startCpu;
+  removeTree(dstDir);
+  return result;
+}
+
+void printResult(const BenchConfig &config, const BenchResult &result,
+                 BenchResults &results) {
+  const double gbytes = result.dataBytes / (1024.0 * 1024 * 1024);
+  const double gbytesPerSec = gbytes / result.seconds;
+  const double filesPerSec = result.numFiles / result.seconds;
+  const double cpuPerGbyte = (gbytes > 0 ? result.cpuSeconds / gbytes : 0);
+  if (result.status == OK) {
+    results.add("transfer")
+        .param("num_ports", config.numPorts)
+        .param("buffer_size", config.bufferSize)
+        .param("block_size_mbytes", config.blockSizeMbytes)
+        .param("encryption", config.encryption)
+        .param("checksum", config.checksum ? "true" : "false")
+        .param("transport", config.transport)
+        .metric("gbytes_per_sec", gbytesPerSec, "GB/s", BenchResults::HIGHER)
+        .metric("files_per_sec", filesPerSec, "files/s", BenchResults::HIGHER)
+        .metric("cpu_seconds_per_gbyte", cpuPerGbyte, "s/GB",
+                BenchResults::LOWER);
+  }
+  if (FLAGS_format == "json") {
+    std::cout << "{\"num_ports\":" << config.numPorts
+              << ",\"buffer_size\":" << config.bufferSize
+              << ",\"block_size_mbytes\":" << config.blockSizeMbytes
+              << ",\"encryption\":\"" << config.encryption << "\""
+              << ",\"checksum\":" << (config.checksum ? "true" : "false")
+              << ",\"transport\":\"" << config.transport << "\""
+              << ",\"status\":\"" << errorCodeToStr(result.status) << "\""
+              << ",\"seconds\":" << result.seconds
+              << ",\"data_bytes\":" << result.dataBytes
+              << ",\"files\":" << result.numFiles
+              << ",\"gbytes_per_sec\":" << gbytesPerSec
+              << ",\"files_per_sec\":" << filesPerSec
+              << ",\"cpu_seconds_per_gbyte\":" << cpuPerGbyte << "}"
+              << std::endl;
+    return;
+  }
+  std::cout << config.numPorts << "," << config.bufferSize << ","
+            << config.blockSizeMbytes << "," << config.encryption << ","
+            << (config.checksum ? "true" : "false") << "," << config.transport
+            << "," << errorCodeToStr(result.status) << "," << result.seconds << ","
+            << result.dataBytes << "," << result.numFiles << ","
+            << gbytesPerSec << "," << filesPerSec << "," << cpuPerGbyte
+            << std::endl;
+}
+}
+
+int main(int argc, char **argv) {
+  FLAGS_logtostderr = true;
+  // gflags api is nicely inconsistent here
+  GFLAGS_NAMESPACE::SetArgv(argc, const_cast<const char **>(argv));
+  GFLAGS_NAMESPACE::SetVersionString(WDT_VERSION_STR);
+  string usage("Loopback transfer benchmark. v");
+  usage.append(GFLAGS_NAMESPACE::VersionString());
+  usage.append(". Sample usage:\n\t");
+  usage.append(GFLAGS_NAMESPACE::ProgramInvocationShortName());
+  usage.append(" [-directory=dir] [-num_ports=1,8] [-encryption=none,...]");
+  GFLAGS_NAMESPACE::SetUsageMessage(usage);
+  GFLAGS_NAMESPACE::ParseCommandLineFlags(&argc, &argv, true);
+  google::InitGoogleLogging(argv[0]);
+  CHECK(FLAGS_format == "csv" || FLAGS_format == "json")
+      << "Unknown format " << FLAGS_format;
+  // the receiver closing a connection must not kill the sender
+  signal(SIGPIPE, SIG_IGN);
+
+  string srcDir = FLAGS_directory;
+  if (srcDir.empty()) {
+    srcDir = makeTempDir("wdtLoopbackBenchSrc");
+    generateFiles(srcDir);
+  }
+  std::vector<BenchConfig> configs;
+  for (const string &numPorts : splitList(FLAGS_num_ports)) {
+    for (const string &bufferSize : splitList(FLAGS_buffer_size)) {
+      for (const string &blockSize : splitList(FLAGS_block_size_mbytes)) {
+        for (const string &encryption : splitList(FLAGS_encryption)) {
+          for (const string &checksum : splitList(FLAGS_checksum)) {
+            for (const string &transport : splitList(FLAGS_transport)) {
+              CHECK(transport == "tcp" || transport == "shm" ||
+                    transport == "rdma")
+                  << "Unknown transport " << transport;
+              BenchConfig config;
+              config.numPorts = std::stoi(numPorts);
+              config.bufferSize = std::stoll(bufferSize);
+              config.blockSizeMbytes = std::stod(blockSize);
+              config.encryption = encryption;
+              config.checksum = (checksum == "true" || checksum == "1");
+              config.transport = transport;
+              configs.push_back(config);
+            }
+          }
+        }
+      }
+    }
+  }
+  if (FLAGS_format == "csv") {
+    std::cout << "num_ports,buffer_size,block_size_mbytes,encryption,"
+              << "checksum,transport,status,seconds,data_bytes,files,"
+              << "gbytes_per_sec,files_per_sec,cpu_seconds_per_gbyte"
+              << std::endl;
+  }
+  int exitCode = 0;
+  BenchResults results("wdt_loopback_bench");
+  for (const BenchConfig &config : configs) {
+    for (int i = 0; i < FLAGS_iterations; ++i) {
+      const BenchResult result = runTransfer(config, srcDir);
+      printResult(config, result, results);
+      if (result.status != OK) {
+        exitCode = 1;
+      }
+    }
+  }
+  if (FLAGS_directory.empty()) {
+    removeTree(srcDir);
+  }
+  if (!results.write()) {
+    exitCode = 1;
+  }
+  return exitCode;
+}
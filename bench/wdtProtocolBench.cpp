@@ -0,0 +1,463 @@
+/**
+ * Copyright (c) 2014-present, Facebook, Inc.
+ * All rights reserved.
+ *
+ * This source code is licensed under the BSD-style license found in the
+ * LICENSE file in the root directory of this source tree. An additional grant
+ * of patent rights can be found in the PATENTS file in the same directory.
+ */
+/**
+ * Measures the encoding and decoding of each protocol command, for several
+ * protocol versions and path lengths, and of the varints they are made of.
+ * Prints one csv row per benchmark with its nanoseconds per operation.
+ * Example use:
+ * wdt_protocol_bench -num_ops=1000000 -path_lengths=16,64,200
+ * wdt_protocol_bench -versions=27,35 -filter=Header
+ */
+#include <chrono>
+#include <iostream>
+#include <string>
+#include <vector>
+
+#include <gflags/gflags.h>
+#include <glog/logging.h>
+
+#include <wdt/Protocol.h>
+#include <wdt/WdtConfig.h>
+#include <wdt/util/SerializationUtil.h>
+
+#include "BenchResults.h"
+
+DEFINE_int64(num_ops, 1000000, "Number of operations per benchmark");
+DEFINE_string(versions, "",
+              "Comma separated protocol versions, empty for the ones which "
+              "changed the encodings and the current one");
+DEFINE_string(path_lengths, "16,64,200",
+              "Comma separated lengths of the file names encoded");
+DEFINE_int32(num_chunks, 16, "Number of chunks of the file chunks encoded");
+DEFINE_int32(num_files, 100, "Number of files of the file chunks lists");
+DEFINE_string(filter, "", "Only run the benchmarks whose name contains this");
+
+using namespace facebook::wdt;
+using std::string;
+
+typedef std::chrono::steady_clock BenchClock;
+
+namespace {
+/// results of the benchmarked calls, so that they are not optimized away
+volatile int64_t sink = 0;
+
+/// results in the common schema, set by main()
+BenchResults *benchResults = nullptr;
+
+std::vector<int> parseList(const string &list) {
+  std::vector<int> values;
+  size_t start = 0;
+  while (start < list.size()) {
+    size_t end = list.find(',', start);
+    if (end == string::npos) {
+      end = list.size();
+    }
+    if (end > start) {
+      values.push_back(std::stoi(list.substr(start, end - start)));
+    }
+    start = end + 1;
+  }
+  return values;
+}
+
+/**
+ * Runs op num_ops times, after a short warm up, and prints its time
+ *
+ * @param op    one operation, returning a value depending on its result
+ */
+template <typename Op>
+void bench(const string &name, int version, int pathLength, int64_t numOps,
+           Op op) {
+  if (!FLAGS_filter.empty() && name.find(FLAGS_filter) == string::npos) {
+    return;
+  }
+  int64_t result = 0;
+  for (int64_t i = 0; i < std::min<int64_t>(numOps / 10, 1000); ++i) {
+    result += op();
+  }
+  const auto start = BenchClock::now();
+  for (int64_t i = 0; i < numOps; ++i) {
+    result += op();
+  }
+  const double nanos =
+      std::chrono::duration<double, std::nano>(BenchClock::now() - start)
+          .count();
+  sink = sink + result;
+  std::cout << name << "," << version << "," << pathLength << "," << numOps
+            << "," << nanos / numOps << std::endl;
+  benchResults->add(name)
+      .param("protocol_version", version)
+      .param("path_length", pathLength)
+      .metric("ns_per_op", nanos / numOps, "ns", BenchResults::LOWER);
+}
+
+string makePath(int length) {
+  string path;
+  while ((int)path.size() < length) {
+    path.append("dir").append(std::to_string(path.size())).push_back('/');
+  }
+  path.resize(length);
+  path.back() = 'f';
+  return path;
+}
+
+void makeFileChunks(FileChunksInfo &fileChunksInfo, int64_t seqId,
+                    const string &path) {
+  const int64_t kChunkSize = 16 * 1024 * 1024;
+  fileChunksInfo.setSeqId(seqId);
+  fileChunksInfo.setFileName(path);
+  fileChunksInfo.setFileSize(2 * kChunkSize * FLAGS_num_chunks);
+  for (int i = 0; i < FLAGS_num_chunks; ++i) {
+    fileChunksInfo.addChunk(
+        Interval(2 * i * kChunkSize, (2 * i + 1) * kChunkSize));
+  }
+}
+
+void benchVarints() {
+  const int64_t numOps = FLAGS_num_ops;
+  char buf[16];
+  // short, medium and longest varints
+  for (const int64_t value :
+       {(int64_t)42, (int64_t)1 << 20, (int64_t)9223372036854775807LL}) {
+    int64_t off = 0;
+    encodeVarI64(buf, sizeof(buf), off, value);
+    const string bytes = "_" + std::to_string(off) + "bytes";
+    bench("encodeVarI64" + bytes, 0, 0, numOps, [&] {
+      int64_t pos = 0;
+      encodeVarI64(buf, sizeof(buf), pos, value);
+      return pos;
+    });
+    bench("decodeVarI64" + bytes, 0, 0, numOps, [&] {
+      int64_t pos = 0;
+      int64_t decoded = 0;
+      CHECK(decodeVarI64(buf, sizeof(buf), pos, decoded));
+      return decoded;
+    });
+    bench("encodeVarI64C" + bytes, 0, 0, numOps, [&] {
+      int64_t pos = 0;
+      encodeVarI64C(buf, sizeof(buf), pos, value);
+      return pos;
+    });
+    off = 0;
+    encodeVarI64C(buf, sizeof(buf), off, value);
+    bench("decodeInt64C" + bytes, 0, 0, numOps, [&] {
+      folly::ByteRange br = makeByteRange(buf, sizeof(buf));
+      int64_t decoded = 0;
+      CHECK(decodeInt64C(br, decoded));
+      return decoded;
+    });
+    bench("encodeVarI64_string" + bytes, 0, 0, numOps, [&] {
+      string str;
+      return (int64_t)encodeVarI64(str, value);
+    });
+  }
+}
+
+/// commands which encoding does not depend on the path
+void benchCommands(int version) {
+  const int64_t numOps = FLAGS_num_ops;
+  char buf[Protocol::kMinBufLength];
+  int64_t off = 0;
+
+  std::vector<Checkpoint> checkpoints;
+  for (int port = 0; port < 8; ++port) {
+    Checkpoint checkpoint(22356 + port);
+    checkpoint.numBlocks = 1000 + port;
+    checkpoint.setLastBlockDetails(12345 + port, 1 << 30, 1 << 20);
+    checkpoints.push_back(checkpoint);
+  }
+  bench("encodeCheckpoints", version, 0, numOps, [&] {
+    int64_t pos = 0;
+    CHECK(Protocol::encodeCheckpoints(version, buf, pos, sizeof(buf),
+                                      checkpoints));
+    return pos;
+  });
+  off = 0;
+  Protocol::encodeCheckpoints(version, buf, off, sizeof(buf), checkpoints);
+  std::vector<Checkpoint> decodedCheckpoints;
+  bench("decodeCheckpoints", version, 0, numOps, [&] {
+    int64_t pos = 0;
+    decodedCheckpoints.clear();
+    CHECK(Protocol::decodeCheckpoints(version, buf, pos, off,
+                                      decodedCheckpoints));
+    return pos;
+  });
+
+  bench("encodeDone", version, 0, numOps, [&] {
+    int64_t pos = 0;
+    CHECK(Protocol::encodeDone(version, buf, pos, sizeof(buf), 123456,
+                               (int64_t)1 << 40));
+    return pos;
+  });
+  off = 0;
+  Protocol::encodeDone(version, buf, off, sizeof(buf), 123456,
+                       (int64_t)1 << 40);
+  bench("decodeDone", version, 0, numOps, [&] {
+    int64_t pos = 0;
+    int64_t numBlocks = 0;
+    int64_t totalBytes = 0;
+    CHECK(Protocol::decodeDone(version, buf, pos, off, numBlocks, totalBytes));
+    return numBlocks;
+  });
+
+  Settings settings;
+  settings.readTimeoutMillis = 5000;
+  settings.writeTimeoutMillis = 5000;
+  settings.transferId = "1735689600123456";
+  settings.enableChecksum = true;
+  settings.sendFileChunks = true;
+  bench("encodeSettings", version, 0, numOps, [&] {
+    int64_t pos = 0;
+    CHECK(Protocol::encodeSettings(version, buf, pos, sizeof(buf), settings));
+    return pos;
+  });
+  off = 0;
+  Protocol::encodeSettings(version, buf, off, sizeof(buf), settings);
+  Settings decodedSettings;
+  bench("decodeSettings", version, 0, numOps, [&] {
+    int64_t pos = 0;
+    int senderVersion = 0;
+    CHECK(Protocol::decodeVersion(buf, pos, off, senderVersion));
+    CHECK(Protocol::decodeSettings(senderVersion, buf, pos, off,
+                                   decodedSettings));
+    return pos;
+  });
+
+  bench("encodeAbort", version, 0, numOps, [&] {
+    int64_t pos = 0;
+    CHECK(Protocol::encodeAbort(buf, pos, sizeof(buf), version, ABORT,
+                                123456));
+    return pos;
+  });
+  off = 0;
+  Protocol::encodeAbort(buf, off, sizeof(buf), version, ABORT, 123456);
+  bench("decodeAbort", version, 0, numOps, [&] {
+    int64_t pos = 0;
+    int32_t abortVersion = 0;
+    ErrorCode errCode = OK;
+    int64_t checkpoint = 0;
+    CHECK(Protocol::decodeAbort(buf, pos, off, abortVersion, errCode,
+                                checkpoint));
+    return checkpoint;
+  });
+}
+
+/// commands which are not versioned
+void benchUnversionedCommands() {
+  const int64_t numOps = FLAGS_num_ops;
+  const int version = Protocol::protocol_version;
+  char buf[Protocol::kMinBufLength];
+  int64_t off = 0;
+
+  const string iv(16, 'i');
+  bench("encodeEncryptionSettings", version, 0, numOps, [&] {
+    int64_t pos = 0;
+    CHECK(Protocol::encodeEncryptionSettings(buf, pos, sizeof(buf),
+                                             ENC_AES128_GCM, iv, 4096));
+    return pos;
+  });
+  off = 0;
+  Protocol::encodeEncryptionSettings(buf, off, sizeof(buf), ENC_AES128_GCM, iv,
+                                     4096);
+  bench("decodeEncryptionSettings", version, 0, numOps, [&] {
+    int64_t pos = 0;
+    EncryptionType encryptionType = ENC_NONE;
+    string decodedIv;
+    int32_t tagInterval = 0;
+    CHECK(Protocol::decodeEncryptionSettings(buf, pos, off, encryptionType,
+                                             decodedIv, tagInterval));
+    return pos;
+  });
+
+  bench("encodeSize", version, 0, numOps, [&] {
+    int64_t pos = 0;
+    CHECK(Protocol::encodeSize(buf, pos, sizeof(buf), (int64_t)1 << 40));
+    return pos;
+  });
+  off = 0;
+  Protocol::encodeSize(buf, off, sizeof(buf), (int64_t)1 << 40);
+  bench("decodeSize", version, 0, numOps, [&] {
+    int64_t pos = 0;
+    int64_t size = 0;
+    CHECK(Protocol::decodeSize(buf, pos, off, size));
+    return size;
+  });
+
+  bench("encodeRate", version, 0, numOps, [&] {
+    int64_t pos = 0;
+    CHECK(Protocol::encodeRate(buf, pos, sizeof(buf), 1000 * 1024 * 1024));
+    return pos;
+  });
+  off = 0;
+  Protocol::encodeRate(buf, off, sizeof(buf), 1000 * 1024 * 1024);
+  bench("decodeRate", version, 0, numOps, [&] {
+    int64_t pos = 0;
+    int64_t rate = 0;
+    CHECK(Protocol::decodeRate(buf, pos, off, rate));
+    return rate;
+  });
+
+  bench("encodeFooter", version, 0, numOps, [&] {
+    int64_t pos = 0;
+    CHECK(Protocol::encodeFooter(buf, pos, sizeof(buf), 0x12345678));
+    return pos;
+  });
+  off = 0;
+  Protocol::encodeFooter(buf, off, sizeof(buf), 0x12345678);
+  bench("decodeFooter", version, 0, numOps, [&] {
+    int64_t pos = 0;
+    int64_t checksum = 0;
+    CHECK(Protocol::decodeFooter(buf, pos, off, checksum));
+    return checksum;
+  });
+
+  bench("encodeChunksCmd", version, 0, numOps, [&] {
+    int64_t pos = 0;
+    CHECK(Protocol::encodeChunksCmd(buf, pos, sizeof(buf), 1 << 20, 100000));
+    return pos;
+  });
+  off = 0;
+  Protocol::encodeChunksCmd(buf, off, sizeof(buf), 1 << 20, 100000);
+  bench("decodeChunksCmd", version, 0, numOps, [&] {
+    int64_t pos = 0;
+    int64_t bufSize = 0;
+    int64_t numFiles = 0;
+    CHECK(Protocol::decodeChunksCmd(buf, pos, off, bufSize, numFiles));
+    return numFiles;
+  });
+
+  const Interval chunk((int64_t)1 << 30, ((int64_t)1 << 30) + (16 << 20));
+  bench("encodeChunkInfo", version, 0, numOps, [&] {
+    int64_t pos = 0;
+    CHECK(Protocol::encodeChunkInfo(buf, pos, sizeof(buf), chunk));
+    return pos;
+  });
+  off = 0;
+  Protocol::encodeChunkInfo(buf, off, sizeof(buf), chunk);
+  bench("decodeChunkInfo", version, 0, numOps, [&] {
+    folly::ByteRange br = makeByteRange(buf, off);
+    Interval decodedChunk;
+    CHECK(Protocol::decodeChunkInfo(br, decodedChunk));
+    return decodedChunk.start_;
+  });
+}
+
+/// commands carrying a file name
+void benchPathCommands(int version, int pathLength) {
+  const int64_t numOps = FLAGS_num_ops;
+  const string path = makePath(pathLength);
+  std::vector<char> buffer(64 * 1024 + FLAGS_num_files * (pathLength + 1024));
+  char *buf = buffer.data();
+  const int64_t bufSize = buffer.size();
+  int64_t off = 0;
+
+  BlockDetails blockDetails;
+  blockDetails.fileName = path;
+  blockDetails.seqId = 123456;
+  blockDetails.fileSize = (int64_t)20 << 30;
+  blockDetails.offset = (int64_t)5 << 30;
+  blockDetails.dataSize = 16 << 20;
+  blockDetails.allocationStatus = EXISTS_TOO_SMALL;
+  blockDetails.prevSeqId = 123455;
+  bench("encodeHeader", version, pathLength, numOps, [&] {
+    int64_t pos = 0;
+    CHECK(Protocol::encodeHeader(version, buf, pos, bufSize, blockDetails));
+    return pos;
+  });
+  off = 0;
+  Protocol::encodeHeader(version, buf, off, bufSize, blockDetails);
+  BlockDetails decodedDetails;
+  bench("decodeHeader", version, pathLength, numOps, [&] {
+    int64_t pos = 0;
+    CHECK(Protocol::decodeHeader(version, buf, pos, off, decodedDetails));
+    return decodedDetails.seqId;
+  });
+
+  FileChunksInfo fileChunksInfo;
+  makeFileChunks(fileChunksInfo, 123456, path);
+  bench("encodeFileChunksInfo", version, pathLength, numOps, [&] {
+    int64_t pos = 0;
+    CHECK(Protocol::encodeFileChunksInfo(version, buf, pos, bufSize,
+                                         fileChunksInfo));
+    return pos;
+  });
+  off = 0;
+  Protocol::encodeFileChunksInfo(version, buf, off, bufSize, fileChunksInfo);
+  bench("decodeFileChunksInfo", version, pathLength, numOps, [&] {
+    folly::ByteRange br = makeByteRange(buf, off);
+    FileChunksInfo decodedChunks;
+    CHECK(Protocol::decodeFileChunksInfo(version, br, decodedChunks));
+    return decodedChunks.getSeqId();
+  });
+
+  std::vector<FileChunksInfo> fileChunksInfoList(FLAGS_num_files);
+  for (int i = 0; i < FLAGS_num_files; ++i) {
+    makeFileChunks(fileChunksInfoList[i], i, path);
+  }
+  // a list is encoded per chunks cmd buffer, not per block
+  const int64_t listOps = std::max<int64_t>(1, numOps / FLAGS_num_files);
+  bench("encodeFileChunksInfoList", version, pathLength, listOps, [&] {
+    int64_t pos = 0;
+    CHECK_EQ(FLAGS_num_files,
+             Protocol::encodeFileChunksInfoList(version, buf, pos, bufSize, 0,
+                                                fileChunksInfoList));
+    return pos;
+  });
+  off = 0;
+  Protocol::encodeFileChunksInfoList(version, buf, off, bufSize, 0,
+                                     fileChunksInfoList);
+  std::vector<FileChunksInfo> decodedList;
+  bench("decodeFileChunksInfoList", version, pathLength, listOps, [&] {
+    int64_t pos = 0;
+    decodedList.clear();
+    CHECK(Protocol::decodeFileChunksInfoList(version, buf, pos, off,
+                                             decodedList));
+    return (int64_t)decodedList.size();
+  });
+}
+}
+
+int main(int argc, char **argv) {
+  FLAGS_logtostderr = true;
+  // gflags api is nicely inconsistent here
+  GFLAGS_NAMESPACE::SetArgv(argc, const_cast<const char **>(argv));
+  GFLAGS_NAMESPACE::SetVersionString(WDT_VERSION_STR);
+  string usage("Protocol encoding benchmark. v");
+  usage.append(GFLAGS_NAMESPACE::VersionString());
+  usage.append(". Sample usage:\n\t");
+  usage.append(GFLAGS_NAMESPACE::ProgramInvocationShortName());
+  usage.append(" [-num_ops=n] [-versions=27,35] [-path_lengths=16,200]");
+  GFLAGS_NAMESPACE::SetUsageMessage(usage);
+  GFLAGS_NAMESPACE::ParseCommandLineFlags(&argc, &argv, true);
+  google::InitGoogleLogging(argv[0]);
+
+  std::vector<int> versions = parseList(FLAGS_versions);
+  if (versions.empty()) {
+    versions = {Protocol::HEADER_FLAG_AND_PREV_SEQ_ID_VERSION,
+                Protocol::CHECKPOINT_SEQ_ID_VERSION,
+                Protocol::VARINT_CHANGE - 1, Protocol::VARINT_CHANGE,
+                Protocol::protocol_version};
+  }
+  const std::vector<int> pathLengths = parseList(FLAGS_path_lengths);
+  CHECK(!pathLengths.empty()) << "No path lengths";
+
+  BenchResults results("wdt_protocol_bench");
+  benchResults = &results;
+  std::cout << "benchmark,protocol_version,path_length,ops,ns_per_op"
+            << std::endl;
+  benchVarints();
+  benchUnversionedCommands();
+  for (const int version : versions) {
+    benchCommands(version);
+    for (const int pathLength : pathLengths) {
+      benchPathCommands(version, pathLength);
+    }
+  }
+  return results.write() ? 0 : 1;
+}
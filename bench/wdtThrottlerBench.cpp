@@ -0,0 +1,263 @@
+/**
+ * Copyright (c) 2014-present, Facebook, Inc.
+ * All rights reserved.
+ *
+ * This source code is licensed under the BSD-style license found in the
+ * LICENSE file in the root directory of this source tree. An additional grant
+ * of patent rights can be found in the PATENTS file in the same directory.
+ */
+/**
+ * Drives Throttler::limit from several threads for each combination of the
+ * swept thread counts, rates and chunk sizes, and prints one csv row per
+ * run: the rate achieved and its error versus the target, the largest burst
+ * over the target rate compared with the bucket limit, how often and how
+ * long the calls slept, and the cpu time per call (a rate of 0 leaves the
+ * throttler unlimited, measuring its overhead and contention alone).
+ * A second table gives the time actually slept for small requested sleeps,
+ * the granularity the throttler works with.
+ * Each list flag is comma separated. Example use:
+ * wdt_throttler_bench -num_threads=1,16 -rates_mbytes=100,0
+ */
+#include <time.h>
+#include <algorithm>
+#include <cmath>
+#include <atomic>
+#include <chrono>
+#include <iostream>
+#include <string>
+#include <thread>
+#include <vector>
+
+#include <gflags/gflags.h>
+#include <glog/logging.h>
+
+#include <wdt/Throttler.h>
+#include <wdt/WdtConfig.h>
+#include <wdt/WdtOptions.h>
+
+#include "BenchResults.h"
+
+DEFINE_string(num_threads, "1,4,16,64", "Numbers of threads to sweep");
+DEFINE_string(rates_mbytes, "10,100,1000,0",
+              "Average rates to sweep in mbytes/sec, 0 for unlimited");
+DEFINE_string(chunk_sizes, "4096,65536,1048576",
+              "Sizes passed to each limit() call to sweep");
+DEFINE_double(peak_multiplier, 1.2,
+              "Peak rate as a multiple of the average, <= 0 for no peak rate");
+DEFINE_double(bucket_limit_mbytes, 0,
+              "Bucket limit of the throttler, 0 for the default");
+DEFINE_int64(lease_size, 0, "Tokens leased per thread, 0 for no lease");
+DEFINE_int32(duration_millis, 2000, "Duration of each run");
+DEFINE_string(sleeps_micros, "1,10,100,1000,10000",
+              "Requested sleeps whose actual duration is measured");
+
+using namespace facebook::wdt;
+using std::string;
+
+typedef std::chrono::steady_clock BenchClock;
+
+namespace {
+/// calls longer than this are counted as having slept
+const int64_t kSleepThresholdNanos = 20000;
+
+std::vector<int64_t> parseList(const string &list) {
+  std::vector<int64_t> values;
+  size_t start = 0;
+  while (start < list.size()) {
+    size_t end = list.find(',', start);
+    if (end == string::npos) {
+      end = list.size();
+    }
+    if (end > start) {
+      values.push_back(std::stoll(list.substr(start, end - start)));
+    }
+    start = end + 1;
+  }
+  return values;
+}
+
+int64_t nowNanos() {
+  return std::chrono::duration_cast<std::chrono::nanoseconds>(
+             BenchClock::now().time_since_epoch())
+      .count();
+}
+
+int64_t threadCpuNanos() {
+  struct timespec ts;
+  clock_gettime(CLOCK_THREAD_CPUTIME_ID, &ts);
+  return ts.tv_sec * 1000000000LL + ts.tv_nsec;
+}
+
+/// what a thread measured
+struct ThreadResult {
+  int64_t numCalls{0};
+  int64_t numSleeps{0};
+  int64_t sleepNanos{0};
+  int64_t cpuNanos{0};
+  /// time each call returned at, throttled runs only
+  std::vector<int64_t> grantTimes;
+};
+
+/**
+ * Largest number of bytes granted over the target rate in any interval,
+ * the burst the token bucket lets through
+ *
+ * @param grantTimes    times the calls returned at, sorted
+ * @param startNanos    start of the run
+ */
+double maxBurst(const std::vector<int64_t> &grantTimes, int64_t startNanos,
+                int64_t chunkSize, double ratePerSec) {
+  const double ratePerNano = ratePerSec / 1e9;
+  // excess of the bytes granted by each time over the target
+  double minExcess = 0;
+  double burst = 0;
+  double granted = 0;
+  for (int64_t t : grantTimes) {
+    granted += chunkSize;
+    const double excess = granted - ratePerNano * (t - startNanos);
+    burst = std::max(burst, excess - minExcess);
+    minExcess = std::min(minExcess, excess);
+  }
+  return burst;
+}
+
+void runBenchmark(int numThreads, int64_t rateMBytes, int64_t chunkSize,
+                  BenchResults &benchResults) {
+  WdtOptions options;
+  options.throttler_lease_size = FLAGS_lease_size;
+  ThrottlerOptions throttlerOptions;
+  throttlerOptions.avg_rate_per_sec = rateMBytes > 0 ? rateMBytes * kMbToB : -1;
+  throttlerOptions.max_rate_per_sec =
+      (rateMBytes > 0 && FLAGS_peak_multiplier > 0)
+          ? FLAGS_peak_multiplier * rateMBytes * kMbToB
+          : -1;
+  throttlerOptions.throttler_bucket_limit =
+      FLAGS_bucket_limit_mbytes * kMbToB;
+  throttlerOptions.single_request_limit = chunkSize;
+  throttlerOptions.lease_size = FLAGS_lease_size;
+  auto throttler = Throttler::makeThrottler(throttlerOptions);
+  throttler->startTransfer();
+  const bool throttled = rateMBytes > 0;
+  std::vector<ThreadResult> results(numThreads);
+  std::atomic<bool> stop{false};
+  std::vector<std::thread> threads;
+  const int64_t startNanos = nowNanos();
+  for (int i = 0; i < numThreads; i++) {
+    threads.emplace_back([&, i] {
+      ThreadCtx threadCtx(options, /* allocate buffer */ false, i);
+      ThreadResult &result = results[i];
+      const int64_t cpuStart = threadCpuNanos();
+      while (!stop.load(std::memory_order_relaxed)) {
+        const int64_t callStart = nowNanos();
+        throttler->limit(threadCtx, chunkSize);
+        const int64_t callEnd = nowNanos();
+        result.numCalls++;
+        if (callEnd - callStart >= kSleepThresholdNanos) {
+          result.numSleeps++;
+          result.sleepNanos += callEnd - callStart;
+        }
+        if (throttled) {
+          result.grantTimes.push_back(callEnd);
+        }
+      }
+      result.cpuNanos = threadCpuNanos() - cpuStart;
+    });
+  }
+  std::this_thread::sleep_for(std::chrono::milliseconds(FLAGS_duration_millis));
+  stop = true;
+  for (auto &t : threads) {
+    t.join();
+  }
+  const int64_t elapsedNanos = nowNanos() - startNanos;
+  throttler->endTransfer();
+
+  ThreadResult total;
+  for (auto &result : results) {
+    total.numCalls += result.numCalls;
+    total.numSleeps += result.numSleeps;
+    total.sleepNanos += result.sleepNanos;
+    total.cpuNanos += result.cpuNanos;
+    total.grantTimes.insert(total.grantTimes.end(), result.grantTimes.begin(),
+                            result.grantTimes.end());
+  }
+  std::sort(total.grantTimes.begin(), total.grantTimes.end());
+  const double achievedMBytes =
+      total.numCalls * chunkSize / (elapsedNanos / 1e9) / kMbToB;
+  const double errorPercent =
+      throttled ? 100 * (achievedMBytes - rateMBytes) / rateMBytes : 0;
+  const double burst =
+      throttled ? maxBurst(total.grantTimes, startNanos, chunkSize,
+                           rateMBytes * kMbToB)
+                : 0;
+  const int64_t numCalls = std::max<int64_t>(total.numCalls, 1);
+  std::cout << numThreads << "," << rateMBytes << "," << chunkSize << ","
+            << achievedMBytes << "," << errorPercent << ","
+            << (int64_t)burst << ","
+            << (int64_t)std::max(throttler->getBucketLimit(), 0.0) << ","
+            << total.numCalls << ","
+            << (double)total.numSleeps / numCalls << ","
+            << (total.numSleeps > 0
+                    ? total.sleepNanos / 1000.0 / total.numSleeps
+                    : 0)
+            << "," << (double)total.cpuNanos / numCalls << std::endl;
+  auto &result = benchResults.add("limit")
+                     .param("threads", numThreads)
+                     .param("rate_mbytes", rateMBytes)
+                     .param("chunk_size", chunkSize)
+                     .metric("cpu_ns_per_call",
+                             (double)total.cpuNanos / numCalls, "ns",
+                             BenchResults::LOWER);
+  if (throttled) {
+    result.metric("abs_rate_error_pct", std::abs(errorPercent), "%",
+                  BenchResults::LOWER);
+  } else {
+    result.metric("achieved_mbytes", achievedMBytes, "mbytes/s",
+                  BenchResults::HIGHER);
+  }
+}
+
+/// time slept for each requested sleep, as the throttler sleeps
+void runSleepBenchmark() {
+  const int kNumSleeps = 200;
+  std::cout << "sleep_requested_us,sleep_actual_us" << std::endl;
+  for (int64_t micros : parseList(FLAGS_sleeps_micros)) {
+    const int64_t start = nowNanos();
+    for (int i = 0; i < kNumSleeps; i++) {
+      std::this_thread::sleep_for(std::chrono::microseconds(micros));
+    }
+    std::cout << micros << ","
+              << (nowNanos() - start) / 1000.0 / kNumSleeps << std::endl;
+  }
+}
+}
+
+int main(int argc, char **argv) {
+  FLAGS_logtostderr = true;
+  // gflags api is nicely inconsistent here
+  GFLAGS_NAMESPACE::SetArgv(argc, const_cast<const char **>(argv));
+  GFLAGS_NAMESPACE::SetVersionString(WDT_VERSION_STR);
+  string usage("Throttler accuracy and overhead benchmark. v");
+  usage.append(GFLAGS_NAMESPACE::VersionString());
+  usage.append(". Sample usage:\n\t");
+  usage.append(GFLAGS_NAMESPACE::ProgramInvocationShortName());
+  usage.append(" [-num_threads=1,16] [-rates_mbytes=100,0]");
+  GFLAGS_NAMESPACE::SetUsageMessage(usage);
+  GFLAGS_NAMESPACE::ParseCommandLineFlags(&argc, &argv, true);
+  google::InitGoogleLogging(argv[0]);
+
+  BenchResults benchResults("wdt_throttler_bench");
+  std::cout << "threads,rate_mbytes,chunk_size,achieved_mbytes,"
+            << "rate_error_pct,max_burst_bytes,bucket_limit_bytes,calls,"
+            << "sleeps_per_call,avg_sleep_us,cpu_ns_per_call" << std::endl;
+  for (int64_t numThreads : parseList(FLAGS_num_threads)) {
+    for (int64_t rateMBytes : parseList(FLAGS_rates_mbytes)) {
+      for (int64_t chunkSize : parseList(FLAGS_chunk_sizes)) {
+        CHECK_GT(numThreads, 0);
+        CHECK_GT(chunkSize, 0);
+        runBenchmark(numThreads, rateMBytes, chunkSize, benchResults);
+      }
+    }
+  }
+  runSleepBenchmark();
+  return benchResults.write() ? 0 : 1;
+}
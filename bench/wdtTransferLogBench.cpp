@@ -0,0 +1,134 @@
+/**
+ * Copyright (c) 2014-present, Facebook, Inc.
+ * All rights reserved.
+ *
+ * This source code is licensed under the BSD-style license found in the
+ * LICENSE file in the root directory of this source tree. An additional grant
+ * of patent rights can be found in the PATENTS file in the same directory.
+ */
+/**
+ * Measures the block write entries per second the transfer log can encode
+ * alone, and encode and persist from many threads, with the log written by
+ * the writer thread versus memory mapped. The written log is left to the page
+ * cache while the mapped one is msynced once per batch, so the latter also
+ * pays for its durability. Example use:
+ * wdt_transfer_log_bench -num_entries=1000000 -num_threads=8
+ */
+#include <stdlib.h>
+#include <unistd.h>
+#include <chrono>
+#include <iostream>
+#include <string>
+#include <thread>
+#include <vector>
+
+#include <gflags/gflags.h>
+#include <glog/logging.h>
+
+#include <wdt/WdtConfig.h>
+#include <wdt/util/TransferLogManager.h>
+
+#include "BenchResults.h"
+
+DEFINE_int64(num_entries, 1000000, "Number of block entries per iteration");
+DEFINE_int32(num_threads, 8, "Number of threads adding entries");
+DEFINE_int32(iterations, 3, "Number of times each mode is run");
+DEFINE_string(directory, "/tmp", "Directory the transfer logs are made in");
+
+using namespace facebook::wdt;
+using std::string;
+
+typedef std::chrono::steady_clock BenchClock;
+
+static double secondsSince(BenchClock::time_point start) {
+  return std::chrono::duration<double>(BenchClock::now() - start).count();
+}
+
+/// encodes the entries in memory only
+static double encodeEntries() {
+  LogEncoderDecoder encoderDecoder;
+  char buf[TransferLogManager::kMaxEntryLength];
+  int64_t totalSize = 0;
+  auto start = BenchClock::now();
+  for (int64_t i = 0; i < FLAGS_num_entries; ++i) {
+    totalSize += encoderDecoder.encodeBlockWriteEntry(buf, sizeof(buf), i,
+                                                      i * 4096, 4096);
+  }
+  CHECK_GT(totalSize, 0);
+  return secondsSince(start);
+}
+
+/// encodes the entries from the threads and persists them in a new log
+static double persistEntries(bool useMmap) {
+  string dir = FLAGS_directory + "/wdtLogBenchXXXXXX";
+  PCHECK(mkdtemp(&dir[0]) != nullptr);
+  WdtOptions options;
+  options.enable_download_resumption = true;
+  options.transfer_log_mmap = useMmap;
+  TransferLogManager transferLog(options, dir);
+  CHECK_EQ(OK, transferLog.openLog());
+  std::vector<FileChunksInfo> chunks;
+  CHECK_EQ(OK, transferLog.parseAndMatch("bench", 0, chunks));
+  CHECK_EQ(OK, transferLog.startThread());
+  transferLog.verifySenderIp("::1");
+  transferLog.writeLogHeader();
+  const int64_t entriesPerThread = FLAGS_num_entries / FLAGS_num_threads;
+  auto start = BenchClock::now();
+  std::vector<std::thread> threads;
+  for (int t = 0; t < FLAGS_num_threads; ++t) {
+    threads.emplace_back([&transferLog, entriesPerThread, t] {
+      for (int64_t i = 0; i < entriesPerThread; ++i) {
+        transferLog.addBlockWriteEntry(t, i * 4096, 4096);
+      }
+    });
+  }
+  for (auto &thread : threads) {
+    thread.join();
+  }
+  // the entries are persisted once the log is closed
+  transferLog.closeLog();
+  const double elapsed = secondsSince(start);
+  transferLog.unlink();
+  PCHECK(rmdir(dir.c_str()) == 0);
+  return elapsed;
+}
+
+int main(int argc, char **argv) {
+  FLAGS_logtostderr = true;
+  // gflags api is nicely inconsistent here
+  GFLAGS_NAMESPACE::SetArgv(argc, const_cast<const char **>(argv));
+  GFLAGS_NAMESPACE::SetVersionString(WDT_VERSION_STR);
+  string usage("Transfer log benchmark. v");
+  usage.append(GFLAGS_NAMESPACE::VersionString());
+  usage.append(". Sample usage:\n\t");
+  usage.append(GFLAGS_NAMESPACE::ProgramInvocationShortName());
+  usage.append(" [-num_entries=n] [-num_threads=n]");
+  GFLAGS_NAMESPACE::SetUsageMessage(usage);
+  GFLAGS_NAMESPACE::ParseCommandLineFlags(&argc, &argv, true);
+  google::InitGoogleLogging(argv[0]);
+
+  BenchResults benchResults("wdt_transfer_log_bench");
+  for (int i = 0; i < FLAGS_iterations; ++i) {
+    const double encodeElapsed = encodeEntries();
+    std::cout << "encode: " << FLAGS_num_entries << " entries in "
+              << encodeElapsed << " s, " << FLAGS_num_entries / encodeElapsed
+              << " entries/s" << std::endl;
+    benchResults.add("encode")
+        .param("num_entries", FLAGS_num_entries)
+        .metric("entries_per_sec", FLAGS_num_entries / encodeElapsed,
+                "entries/s", BenchResults::HIGHER);
+    for (bool useMmap : {false, true}) {
+      const double elapsed = persistEntries(useMmap);
+      std::cout << (useMmap ? "mmap  " : "write ") << ": "
+                << FLAGS_num_entries << " entries from " << FLAGS_num_threads
+                << " threads in " << elapsed << " s, "
+                << FLAGS_num_entries / elapsed << " entries/s" << std::endl;
+      benchResults.add(useMmap ? "mmap" : "write")
+          .param("num_entries", FLAGS_num_entries)
+          .param("num_threads", FLAGS_num_threads)
+          .metric("entries_per_sec", FLAGS_num_entries / elapsed, "entries/s",
+                  BenchResults::HIGHER);
+    }
+  }
+  return benchResults.write() ? 0 : 1;
+}
@@ -0,0 +1,160 @@
+/**
+ * Copyright (c) 2014-present, Facebook, Inc.
+ * All rights reserved.
+ *
+ * This source code is licensed under the BSD-style license found in the
+ * LICENSE file in the root directory of this source tree. An additional grant
+ * of patent rights can be found in the PATENTS file in the same directory.
+ */
+/**
+ * Measures the socket writes needed to send small files, with a write per
+ * header, data and footer versus a single writev. Example use:
+ * wdt_writev_bench -num_files=100000 -file_size=1024
+ * wdt_writev_bench -encryption_type=aes128gcm
+ */
+#include <string.h>
+#include <sys/socket.h>
+#include <sys/uio.h>
+#include <unistd.h>
+#include <atomic>
+#include <chrono>
+#include <fstream>
+#include <iostream>
+#include <string>
+#include <thread>
+#include <vector>
+
+#include <gflags/gflags.h>
+#include <glog/logging.h>
+
+#include <wdt/WdtConfig.h>
+#include <wdt/util/WdtSocket.h>
+
+#include "BenchResults.h"
+
+DEFINE_int32(num_files, 100000, "Number of files sent per iteration");
+DEFINE_int32(file_size, 1024, "Size of each file");
+DEFINE_int32(iterations, 3, "Number of times each mode is run");
+DEFINE_string(encryption_type, "none", "Encryption type, as for wdt");
+
+using namespace facebook::wdt;
+using std::string;
+
+typedef std::chrono::steady_clock BenchClock;
+
+static double secondsSince(BenchClock::time_point start) {
+  return std::chrono::duration<double>(BenchClock::now() - start).count();
+}
+
+/// @return   number of write syscalls done by the calling thread so far
+static int64_t getNumWriteSyscalls() {
+  std::ifstream io("/proc/thread-self/io");
+  string key;
+  int64_t value;
+  while (io >> key >> value) {
+    if (key == "syscw:") {
+      return value;
+    }
+  }
+  return -1;
+}
+
+/// WdtSocket over one end of a socket pair
+class BenchSocket : public WdtSocket {
+ public:
+  BenchSocket(ThreadCtx &threadCtx, int fd,
+              const EncryptionParams &encryptionParams)
+      : WdtSocket(threadCtx, 0, encryptionParams, 0, nullptr) {
+    fd_ = fd;
+  }
+};
+
+/// sends the files, returns the number of write syscalls
+static int64_t sendFiles(BenchSocket &socket, bool useWritev) {
+  char header[64];
+  memset(header, 'h', sizeof(header));
+  char footer[8];
+  memset(footer, 'f', sizeof(footer));
+  std::vector<char> data(FLAGS_file_size, 'd');
+  const int64_t startSyscalls = getNumWriteSyscalls();
+  for (int i = 0; i < FLAGS_num_files; ++i) {
+    if (useWritev) {
+      struct iovec iov[3];
+      iov[0].iov_base = header;
+      iov[0].iov_len = sizeof(header);
+      iov[1].iov_base = data.data();
+      iov[1].iov_len = data.size();
+      iov[2].iov_base = footer;
+      iov[2].iov_len = sizeof(footer);
+      CHECK_GT(socket.writev(iov, 3, true), 0);
+    } else {
+      CHECK_GT(socket.write(header, sizeof(header), true), 0);
+      if (!data.empty()) {
+        CHECK_GT(socket.write(data.data(), data.size(), true), 0);
+      }
+      CHECK_GT(socket.write(footer, sizeof(footer), true), 0);
+    }
+  }
+  return getNumWriteSyscalls() - startSyscalls;
+}
+
+int main(int argc, char **argv) {
+  FLAGS_logtostderr = true;
+  // gflags api is nicely inconsistent here
+  GFLAGS_NAMESPACE::SetArgv(argc, const_cast<const char **>(argv));
+  GFLAGS_NAMESPACE::SetVersionString(WDT_VERSION_STR);
+  string usage("Small file send benchmark. v");
+  usage.append(GFLAGS_NAMESPACE::VersionString());
+  usage.append(". Sample usage:\n\t");
+  usage.append(GFLAGS_NAMESPACE::ProgramInvocationShortName());
+  usage.append(" [-num_files=n] [-file_size=bytes]");
+  GFLAGS_NAMESPACE::SetUsageMessage(usage);
+  GFLAGS_NAMESPACE::ParseCommandLineFlags(&argc, &argv, true);
+  google::InitGoogleLogging(argv[0]);
+
+  WdtOptions options;
+  std::atomic<bool> abortTrigger{false};
+  WdtAbortChecker abortChecker(abortTrigger);
+  BenchResults benchResults("wdt_writev_bench");
+  const EncryptionParams encryptionParams =
+      EncryptionParams::generateEncryptionParams(
+          parseEncryptionType(FLAGS_encryption_type));
+  for (int i = 0; i < FLAGS_iterations; ++i) {
+    for (bool useWritev : {false, true}) {
+      int fds[2];
+      PCHECK(socketpair(AF_UNIX, SOCK_STREAM, 0, fds) == 0);
+      // the receiving end only drains the data
+      std::thread drainer([fd = fds[1]] {
+        char buf[256 * 1024];
+        while (::read(fd, buf, sizeof(buf)) > 0) {
+        }
+        ::close(fd);
+      });
+      ThreadCtx threadCtx(options, false);
+      threadCtx.setAbortChecker(&abortChecker);
+      int64_t numSyscalls;
+      double elapsed;
+      {
+        BenchSocket socket(threadCtx, fds[0], encryptionParams);
+        auto start = BenchClock::now();
+        numSyscalls = sendFiles(socket, useWritev);
+        elapsed = secondsSince(start);
+      }
+      drainer.join();
+      std::cout << (useWritev ? "writev" : "write ") << ": "
+                << FLAGS_num_files << " files in " << elapsed << " s, "
+                << FLAGS_num_files / elapsed << " files/s, "
+                << (double)numSyscalls / FLAGS_num_files
+                << " write syscalls per file" << std::endl;
+      benchResults.add(useWritev ? "writev" : "write")
+          .param("num_files", FLAGS_num_files)
+          .param("file_size", FLAGS_file_size)
+          .param("encryption", FLAGS_encryption_type)
+          .metric("files_per_sec", FLAGS_num_files / elapsed, "files/s",
+                  BenchResults::HIGHER)
+          .metric("syscalls_per_file", (double)numSyscalls / FLAGS_num_files,
+                  "syscalls", BenchResults::LOWER);
+    }
+  }
+  return benchResults.write() ? 0 : 1;
+}
@@ -0,0 +1,199 @@
+#! /usr/bin/env python
+"""Compares benchmark results to a baseline and flags the regressions.
+
+Both files hold the json lines the wdt benchmarks write with
+-bench_json_output (schema wdt_bench_v1, see bench/BenchResults.h), or the
+pretty printed output of the folly benchmarks run with -json, which has no
+environment to check the results against. Run each benchmark several
+times (appending to the same file) so that the noise can be told apart from a
+change: a metric regresses when it got worse by more than -threshold percent
+and by more than -sigmas standard errors of the difference of the means.
+
+Exits with 1 if a metric regressed, 2 on bad input.
+Example use:
+  wdt_protocol_bench -bench_json_output=base.json  # a few times, old build
+  wdt_protocol_bench -bench_json_output=new.json   # a few times, new build
+  wdt_bench_compare.py base.json new.json
+"""
+
+from __future__ import print_function
+
+import argparse
+import json
+import math
+import sys
+
+SCHEMA = "wdt_bench_v1"
+# environment fields that make results of two hosts not comparable
+ENV_KEYS = ["host", "cpu_model", "num_cpus", "kernel", "build"]
+# exit code on bad input
+BAD_INPUT = 2
+
+
+def input_error(path, line_num, message):
+    print("{0}:{1}: {2}".format(path, line_num, message), file=sys.stderr)
+    sys.exit(BAD_INPUT)
+
+
+def to_float(path, line_num, value):
+    # bools are ints to python, but not benchmark values
+    if isinstance(value, (int, float)) and not isinstance(value, bool):
+        return float(value)
+    input_error(path, line_num, "non numeric value {0}".format(
+        json.dumps(value)))
+
+
+def read_records(path):
+    """Returns (line number, record) of each json value of a file, one per
+    line or spanning many lines"""
+    with open(path) as f:
+        text = f.read()
+    decoder = json.JSONDecoder()
+    records = []
+    pos = 0
+    while True:
+        while pos < len(text) and text[pos].isspace():
+            pos += 1
+        if pos == len(text):
+            return records
+        line_num = text.count("\n", 0, pos) + 1
+        try:
+            record, pos = decoder.raw_decode(text, pos)
+        except ValueError as e:
+            input_error(path, line_num, "invalid json: {0}".format(e))
+        records.append((line_num, record))
+
+
+def load_results(path):
+    """Returns {(benchmark, case, params): {metric: [values]}}, units, envs.
+    The env of the folly results is None. Exits on a record of another
+    schema or a value which is not a number"""
+    results = {}
+    units = {}
+    envs = []
+    for line_num, record in read_records(path):
+        if not isinstance(record, dict):
+            input_error(path, line_num, "unknown record")
+        if "schema" in record:
+            if record["schema"] != SCHEMA:
+                input_error(path, line_num, "unknown schema {0}".format(
+                    json.dumps(record["schema"])))
+            if "benchmark" not in record or "case" not in record:
+                input_error(path, line_num, "record without benchmark/case")
+            key = (record["benchmark"], record["case"],
+                   tuple(sorted(record.get("params", {}).items())))
+            metrics = results.setdefault(key, {})
+            for name, metric in record.get("metrics", {}).items():
+                if metric.get("value") is None:
+                    continue
+                metrics.setdefault(name, []).append(
+                    to_float(path, line_num, metric["value"]))
+                units[(key, name)] = (metric.get("unit", ""),
+                                      metric.get("better", "lower"))
+            envs.append(record.get("env", {}))
+        else:
+            # folly benchmark -json: {"name": time per iteration}
+            for name, value in record.items():
+                key = ("folly", name, ())
+                metrics = results.setdefault(key, {})
+                metrics.setdefault("time", []).append(
+                    to_float(path, line_num, value))
+                units[(key, "time")] = ("", "lower")
+            envs.append(None)
+    return results, units, envs
+
+
+def mean_stderr(values):
+    mean = sum(values) / len(values)
+    if len(values) < 2:
+        return mean, 0.0
+    variance = sum((v - mean) ** 2 for v in values) / (len(values) - 1)
+    return mean, math.sqrt(variance / len(values))
+
+
+def check_environments(base_envs, new_envs):
+    if None in base_envs or None in new_envs:
+        print("WARNING: folly results have no environment, make sure both "
+              "ran on the same host and build")
+        base_envs = [env for env in base_envs if env is not None]
+        new_envs = [env for env in new_envs if env is not None]
+    for key in ENV_KEYS:
+        base_values = set(str(env.get(key)) for env in base_envs)
+        new_values = set(str(env.get(key)) for env in new_envs)
+        if base_values != new_values:
+            print("WARNING: {0} differs, baseline {1} vs {2}".format(
+                key, sorted(base_values), sorted(new_values)))
+
+
+def format_key(key):
+    benchmark, case, params = key
+    name = "{0}/{1}".format(benchmark, case)
+    if params:
+        name += "[" + ",".join("{0}={1}".format(k, v) for k, v in params) + "]"
+    return name
+
+
+def compare(base, new, units, threshold, sigmas):
+    """Prints the comparison and returns the number of regressions"""
+    num_regressions = 0
+    print("{0:<60} {1:>14} {2:>14} {3:>8}  {4}".format(
+        "benchmark/case[params] metric", "baseline", "current", "change",
+        "status"))
+    for key in sorted(new):
+        if key not in base:
+            print("{0:<60} only in current".format(format_key(key)))
+            continue
+        for name in sorted(new[key]):
+            if name not in base[key]:
+                continue
+            unit, better = units[(key, name)]
+            base_mean, base_err = mean_stderr(base[key][name])
+            new_mean, new_err = mean_stderr(new[key][name])
+            diff = new_mean - base_mean
+            change = 100.0 * diff / abs(base_mean) if base_mean else 0.0
+            worse = diff < 0 if better == "higher" else diff > 0
+            noise = sigmas * math.sqrt(base_err ** 2 + new_err ** 2)
+            status = ""
+            if abs(change) > threshold and abs(diff) > noise:
+                if worse:
+                    status = "REGRESSION"
+                    num_regressions += 1
+                else:
+                    status = "improved"
+            print("{0:<60} {1:>14.6g} {2:>14.6g} {3:>+7.1f}%  {4}".format(
+                format_key(key) + " " + name + (" (" + unit + ")"
+                                                if unit else ""),
+                base_mean, new_mean, change, status))
+    for key in sorted(base):
+        if key not in new:
+            print("{0:<60} missing from current".format(format_key(key)))
+    return num_regressions
+
+
+def main():
+    parser = argparse.ArgumentParser(
+        description="Compares wdt benchmark results to a baseline")
+    parser.add_argument("baseline", help="json lines of the baseline runs")
+    parser.add_argument("current", help="json lines of the runs to check")
+    parser.add_argument("-threshold", type=float, default=5.0,
+                        help="minimum change in percent to report")
+    parser.add_argument("-sigmas", type=float, default=3.0,
+                        help="minimum change in standard errors to report")
+    args = parser.parse_args()
+    base, base_units, base_envs = load_results(args.baseline)
+    new, units, new_envs = load_results(args.current)
+    if not base or not new:
+        print("No results to compare", file=sys.stderr)
+        return BAD_INPUT
+    base_units.update(units)
+    check_environments(base_envs, new_envs)
+    num_regressions = compare(base, new, base_units, args.threshold,
+                              args.sigmas)
+    if num_regressions:
+        print("{0} regressions".format(num_regressions))
+        return 1
+    return 0
+
+
+if __name__ == "__main__":
+    sys.exit(main())
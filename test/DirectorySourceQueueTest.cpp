@@ -0,0 +1,650 @@
+/**
+ * Copyright (c) 2014-present, Facebook, Inc.
+ * All rights reserved.
+ *
+ * This source code is licensed under the BSD-style license found in the
+ * LICENSE file in the root directory of this source tree. An additional grant
+ * of patent rights can be found in the PATENTS file in the same directory.
+ */
+#include <wdt/Wdt.h>
+#include <wdt/test/TestCommon.h>
+#include <wdt/util/DirectorySourceQueue.h>
+#include <wdt/util/ThreadTransferHistory.h>
+
+#include <fcntl.h>
+#include <gflags/gflags.h>
+#include <glog/logging.h>
+#include <gtest/gtest.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#include <algorithm>
+#include <limits>
+#include <map>
+#include <set>
+#include <thread>
+
+namespace facebook {
+namespace wdt {
+
+namespace {
+
+void createFile(const std::string &path, const std::string &contents) {
+  int fd = open(path.c_str(), O_CREAT | O_WRONLY | O_TRUNC, 0644);
+  ASSERT_GE(fd, 0);
+  ASSERT_EQ(contents.size(), write(fd, contents.data(), contents.size()));
+  close(fd);
+}
+
+/// creates numDirs directories of numFiles files, half of them under a
+/// nested sub directory
+void createTree(const std::string &root, int numDirs, int numFiles) {
+  for (int i = 0; i < numDirs; i++) {
+    const std::string dir = root + "/dir" + std::to_string(i);
+    ASSERT_EQ(0, mkdir(dir.c_str(), 0755));
+    ASSERT_EQ(0, mkdir((dir + "/sub").c_str(), 0755));
+    for (int j = 0; j < numFiles; j++) {
+      const std::string parent = (j % 2) ? dir + "/sub" : dir;
+      createFile(parent + "/file" + std::to_string(j), std::string(j, 'a'));
+    }
+  }
+}
+
+struct DiscoveryResult {
+  bool success;
+  int64_t count;
+  int64_t totalSize;
+  int64_t previouslySentBytes;
+};
+
+DiscoveryResult discover(const std::string &root, int numThreads,
+                         const std::string &indexPath = "",
+                         bool saveIndex = false) {
+  std::atomic<bool> abortTrigger{false};
+  WdtAbortChecker abortChecker(abortTrigger);
+  DirectorySourceQueue queue(WdtOptions::get(), root, &abortChecker);
+  queue.setNumDiscoveryThreads(numThreads);
+  queue.setExcludePattern(".*file3");
+  queue.setDiscoveryIndexPath(indexPath);
+  DiscoveryResult result;
+  result.success = queue.buildQueueSynchronously();
+  result.count = queue.getCount();
+  result.totalSize = queue.getTotalSize();
+  result.previouslySentBytes = queue.getPreviouslySentBytes();
+  if (saveIndex) {
+    EXPECT_TRUE(queue.saveDiscoveryIndex());
+  }
+  return result;
+}
+}
+
+TEST(DirectorySourceQueue, ParallelDiscovery) {
+  TemporaryDirectory tmpDir;
+  createTree(tmpDir.dir(), 20, 10);
+  DiscoveryResult sequential = discover(tmpDir.dir(), 1);
+  EXPECT_TRUE(sequential.success);
+  // 9 files per directory, file3 is excluded
+  EXPECT_EQ(20 * 9, sequential.count);
+  for (int numThreads : {2, 4, 16}) {
+    DiscoveryResult parallel = discover(tmpDir.dir(), numThreads);
+    EXPECT_TRUE(parallel.success);
+    EXPECT_EQ(sequential.count, parallel.count);
+    EXPECT_EQ(sequential.totalSize, parallel.totalSize);
+  }
+}
+
+TEST(DirectorySourceQueue, DiscoveryCallback) {
+  TemporaryDirectory tmpDir;
+  createTree(tmpDir.dir(), 20, 10);
+  std::atomic<bool> abortTrigger{false};
+  WdtAbortChecker abortChecker(abortTrigger);
+  DirectorySourceQueue queue(WdtOptions::get(), tmpDir.dir(), &abortChecker);
+  queue.setNumDiscoveryThreads(4);
+  std::set<std::string> relPaths;
+  std::set<int64_t> seqIds;
+  int64_t totalSize = 0;
+  // calls are serialized, no lock needed
+  queue.setDiscoveryCallback([&](const SourceMetaData &metadata) {
+    relPaths.insert(metadata.getRelPath());
+    seqIds.insert(metadata.seqId);
+    totalSize += metadata.size;
+  });
+  EXPECT_TRUE(queue.buildQueueSynchronously());
+  EXPECT_EQ(20 * 10, relPaths.size());
+  EXPECT_EQ(20 * 10, seqIds.size());
+  EXPECT_EQ(queue.getTotalSize(), totalSize);
+  EXPECT_EQ(1, relPaths.count("dir3/sub/file5"));
+}
+
+TEST(DirectorySourceQueue, ShardedQueue) {
+  TemporaryDirectory tmpDir;
+  createTree(tmpDir.dir(), 10, 10);
+  const int kNumThreads = 4;
+  std::atomic<bool> abortTrigger{false};
+  WdtAbortChecker abortChecker(abortTrigger);
+  DirectorySourceQueue queue(WdtOptions::get(), tmpDir.dir(), &abortChecker);
+  queue.setNumQueueShards(kNumThreads);
+  queue.setNumClientThreads(kNumThreads);
+  std::thread discoveryThread = queue.buildQueueAsynchronously();
+  std::atomic<int64_t> numSources{0};
+  std::atomic<int64_t> numBytes{0};
+  std::vector<std::thread> threads;
+  for (int i = 0; i < kNumThreads; i++) {
+    threads.emplace_back([&, i]() {
+      ThreadCtx threadCtx(WdtOptions::get(), false, i);
+      while (true) {
+        ErrorCode status;
+        std::unique_ptr<ByteSource> source =
+            queue.getNextSource(&threadCtx, status);
+        if (!source) {
+          EXPECT_EQ(OK, status);
+          break;
+        }
+        numSources++;
+        numBytes += source->getSize();
+        source->close();
+      }
+    });
+  }
+  for (auto &thread : threads) {
+    thread.join();
+  }
+  discoveryThread.join();
+  EXPECT_TRUE(queue.finished());
+  EXPECT_EQ(10 * 10, numSources);
+  EXPECT_EQ(queue.getTotalSize(), numBytes);
+}
+
+TEST(DirectorySourceQueue, DiskOrder) {
+  TemporaryDirectory tmpDir;
+  createTree(tmpDir.dir(), 5, 10);
+  std::atomic<bool> abortTrigger{false};
+  WdtAbortChecker abortChecker(abortTrigger);
+  DirectorySourceQueue queue(WdtOptions::get(), tmpDir.dir(), &abortChecker);
+  queue.setDiskOrderReads(true);
+  EXPECT_TRUE(queue.buildQueueSynchronously());
+  ThreadCtx threadCtx(WdtOptions::get(), false, 0);
+  int64_t numSources = 0;
+  int64_t prevKey = -1;
+  while (true) {
+    ErrorCode status;
+    std::unique_ptr<ByteSource> source = queue.getNextSource(&threadCtx, status);
+    if (!source) {
+      break;
+    }
+    const int64_t key = source->getMetaData().diskOrderKey;
+    EXPECT_GE(key, prevKey);
+    prevKey = key;
+    numSources++;
+    source->close();
+  }
+  EXPECT_EQ(5 * 10, numSources);
+}
+
+TEST(DirectorySourceQueue, ReadersPerDevice) {
+  TemporaryDirectory tmpDir;
+  createTree(tmpDir.dir(), 2, 10);
+  struct stat rootStat;
+  ASSERT_EQ(0, stat(tmpDir.dir().c_str(), &rootStat));
+  std::atomic<bool> abortTrigger{false};
+  WdtAbortChecker abortChecker(abortTrigger);
+  DirectorySourceQueue queue(WdtOptions::get(), tmpDir.dir(), &abortChecker);
+  queue.setNumQueueShards(2);
+  queue.setMaxReadersPerDevice(1);
+  EXPECT_TRUE(queue.buildQueueSynchronously());
+  ThreadCtx threadCtx0(WdtOptions::get(), false, 0);
+  ThreadCtx threadCtx1(WdtOptions::get(), false, 1);
+  ErrorCode status;
+  std::unique_ptr<ByteSource> source = queue.getNextSource(&threadCtx0, status);
+  ASSERT_NE(nullptr, source);
+  EXPECT_EQ((int64_t)rootStat.st_dev, source->getMetaData().deviceId);
+  EXPECT_EQ(0, source->getMetaData().deviceIndex);
+  source->close();
+  // the only device already has its reader
+  const int64_t kMaxSize = std::numeric_limits<int64_t>::max();
+  EXPECT_EQ(nullptr, queue.getNextSmallSource(&threadCtx1, kMaxSize));
+  // released once the first thread stops
+  queue.returnInFlightSource(&threadCtx0);
+  source = queue.getNextSmallSource(&threadCtx1, kMaxSize);
+  ASSERT_NE(nullptr, source);
+  source->close();
+  EXPECT_EQ(nullptr, queue.getNextSmallSource(&threadCtx0, kMaxSize));
+  // the reader moves on to the next sources of its device
+  int64_t numSources = 2;
+  while ((source = queue.getNextSource(&threadCtx1, status)) != nullptr) {
+    numSources++;
+    source->close();
+  }
+  EXPECT_EQ(2 * 10, numSources);
+}
+
+TEST(DirectorySourceQueue, FilePriorities) {
+  TemporaryDirectory tmpDir;
+  createTree(tmpDir.dir(), 5, 10);
+  std::atomic<bool> abortTrigger{false};
+  WdtAbortChecker abortChecker(abortTrigger);
+  DirectorySourceQueue queue(WdtOptions::get(), tmpDir.dir(), &abortChecker);
+  queue.setNumQueueShards(4);
+  queue.setFilePriorities("*/file7=2,dir1/*=1,invalid,bad=x");
+  std::vector<int> finished;
+  queue.setPriorityClassCallback(
+      [&](int priority) { finished.push_back(priority); });
+  EXPECT_TRUE(queue.buildQueueSynchronously());
+  // sources of all the shards come by decreasing priority
+  ThreadCtx threadCtx(WdtOptions::get(), false, 0);
+  TransferStats threadStats;
+  ThreadTransferHistory history(queue, threadStats, 0, nullptr, true);
+  int prevPriority = 2;
+  std::map<int, int64_t> numSources;
+  while (true) {
+    ErrorCode status;
+    std::unique_ptr<ByteSource> source = queue.getNextSource(&threadCtx, status);
+    if (!source) {
+      break;
+    }
+    const int priority = source->getMetaData().priority;
+    EXPECT_LE(priority, prevPriority);
+    if (priority < prevPriority) {
+      // the sources sent so far are acked
+      history.markAllAcknowledged();
+      EXPECT_EQ(2 - priority, static_cast<int>(finished.size()));
+    }
+    prevPriority = priority;
+    numSources[priority]++;
+    TransferStats transferStats;
+    transferStats.addEffectiveBytes(0, source->getSize());
+    source->addTransferStats(transferStats);
+    source->close();
+    EXPECT_TRUE(history.addSource(source));
+  }
+  // dir1/sub/file7 is in the first class which matches
+  EXPECT_EQ(5, numSources[2]);
+  EXPECT_EQ(9, numSources[1]);
+  EXPECT_EQ(5 * 10 - 5 - 9, numSources[0]);
+  // the last class is sent but not acked yet
+  EXPECT_EQ(std::vector<int>({2, 1}), finished);
+  history.markAllAcknowledged();
+  EXPECT_EQ(std::vector<int>({2, 1, 0}), finished);
+  // the sources acked are folded in a row per file
+  SourceStatsTable sourceStats;
+  history.popAckedSourceStats(sourceStats);
+  EXPECT_EQ(5 * 10, sourceStats.size());
+}
+
+TEST(DirectorySourceQueue, AdaptiveBlockSize) {
+  TemporaryDirectory tmpDir;
+  const int64_t kMbytes = 1024 * 1024;
+  const int64_t kFileSize = 256 * kMbytes;
+  const std::string path = tmpDir.dir() + "/file";
+  int fd = open(path.c_str(), O_CREAT | O_WRONLY | O_TRUNC, 0644);
+  ASSERT_GE(fd, 0);
+  ASSERT_EQ(0, ftruncate(fd, kFileSize));
+  close(fd);
+  std::atomic<bool> abortTrigger{false};
+  WdtAbortChecker abortChecker(abortTrigger);
+  DirectorySourceQueue queue(WdtOptions::get(), tmpDir.dir(), &abortChecker);
+  queue.setBlockSizeMbytes(16);
+  queue.setNumClientThreads(2);
+  queue.setAdaptiveBlockSize(true);
+  EXPECT_TRUE(queue.buildQueueSynchronously());
+  // 64 blocks per thread
+  EXPECT_EQ(128, queue.getNumBlocksAndStatus().first);
+  ThreadCtx threadCtx(WdtOptions::get(), false, 0);
+  std::vector<std::pair<int64_t, int64_t>> blocks;
+  while (true) {
+    ErrorCode status;
+    std::unique_ptr<ByteSource> source = queue.getNextSource(&threadCtx, status);
+    if (!source) {
+      break;
+    }
+    blocks.emplace_back(source->getOffset(), source->getSize());
+    source->close();
+  }
+  // the last block got split in two
+  EXPECT_EQ(129, blocks.size());
+  EXPECT_EQ(129, queue.getNumBlocksAndStatus().first);
+  std::sort(blocks.begin(), blocks.end());
+  int64_t offset = 0;
+  for (const auto &block : blocks) {
+    EXPECT_EQ(offset, block.first);
+    EXPECT_GE(block.second, kMbytes);
+    offset += block.second;
+  }
+  EXPECT_EQ(kFileSize, offset);
+}
+
+TEST(DirectorySourceQueue, StealInFlightSegments) {
+  TemporaryDirectory tmpDir;
+  const int64_t kMbytes = 1024 * 1024;
+  const std::string path = tmpDir.dir() + "/file";
+  int fd = open(path.c_str(), O_CREAT | O_WRONLY | O_TRUNC, 0644);
+  ASSERT_GE(fd, 0);
+  ASSERT_EQ(0, ftruncate(fd, 16 * kMbytes));
+  close(fd);
+  std::atomic<bool> abortTrigger{false};
+  WdtAbortChecker abortChecker(abortTrigger);
+  DirectorySourceQueue queue(WdtOptions::get(), tmpDir.dir(), &abortChecker);
+  queue.setBlockSizeMbytes(16);
+  queue.setNumClientThreads(2);
+  queue.setStealSegmentSize(2 * kMbytes);
+  EXPECT_TRUE(queue.buildQueueSynchronously());
+  ThreadCtx threadCtx0(WdtOptions::get(), false, 0);
+  ThreadCtx threadCtx1(WdtOptions::get(), false, 1);
+  ErrorCode status;
+  std::vector<std::pair<int64_t, int64_t>> blocks;
+  auto expectBlock = [&](std::unique_ptr<ByteSource> source, int64_t offset,
+                         int64_t size) {
+    ASSERT_TRUE(source != nullptr);
+    EXPECT_EQ(offset * kMbytes, source->getOffset());
+    EXPECT_EQ(size * kMbytes, source->getSize());
+    blocks.emplace_back(source->getOffset(), source->getSize());
+    source->close();
+  };
+  // the block is cut to its first segment, the others are in flight
+  expectBlock(queue.getNextSource(&threadCtx0, status), 0, 2);
+  expectBlock(queue.getNextInFlightSource(&threadCtx0, status), 2, 2);
+  EXPECT_TRUE(queue.getNextSource(&threadCtx1, status) == nullptr);
+  // the second half of the 6 segments left of thread 0
+  expectBlock(queue.stealInFlightSource(&threadCtx1, status), 10, 2);
+  EXPECT_EQ(1, queue.getNumStolenSources());
+  // the segments left of thread 1 go back to the queue
+  queue.returnInFlightSource(&threadCtx1);
+  expectBlock(queue.getNextSource(&threadCtx1, status), 12, 2);
+  EXPECT_EQ(6, queue.getFinalNumBlocksAndStatus().first);
+  // not split anymore once the number of blocks is final
+  expectBlock(queue.getNextInFlightSource(&threadCtx0, status), 4, 6);
+  EXPECT_TRUE(queue.getNextInFlightSource(&threadCtx0, status) == nullptr);
+  EXPECT_TRUE(queue.stealInFlightSource(&threadCtx0, status) == nullptr);
+  expectBlock(queue.getNextInFlightSource(&threadCtx1, status), 14, 2);
+  EXPECT_TRUE(queue.getNextInFlightSource(&threadCtx1, status) == nullptr);
+  EXPECT_EQ(6, queue.getNumBlocksAndStatus().first);
+  EXPECT_EQ(6, blocks.size());
+  std::sort(blocks.begin(), blocks.end());
+  int64_t offset = 0;
+  for (const auto &block : blocks) {
+    EXPECT_EQ(offset, block.first);
+    offset += block.second;
+  }
+  EXPECT_EQ(16 * kMbytes, offset);
+}
+
+TEST(DirectorySourceQueue, SparseFiles) {
+  TemporaryDirectory tmpDir;
+  const int64_t kMbytes = 1024 * 1024;
+  const int64_t kFileSize = 8 * kMbytes;
+  const std::string path = tmpDir.dir() + "/sparse";
+  int fd = open(path.c_str(), O_CREAT | O_WRONLY | O_TRUNC, 0644);
+  ASSERT_GE(fd, 0);
+  ASSERT_EQ(0, ftruncate(fd, kFileSize));
+  const std::string data(kMbytes, 'a');
+  ASSERT_EQ(kMbytes, pwrite(fd, data.data(), data.size(), 2 * kMbytes));
+  ASSERT_EQ(0, fsync(fd));
+  struct stat fileStat;
+  ASSERT_EQ(0, fstat(fd, &fileStat));
+  close(fd);
+  if (fileStat.st_blocks * 512 >= kFileSize) {
+    WLOG(WARNING) << "Holes not supported by the filesystem, skipping";
+    return;
+  }
+  std::atomic<bool> abortTrigger{false};
+  WdtAbortChecker abortChecker(abortTrigger);
+  DirectorySourceQueue queue(WdtOptions::get(), tmpDir.dir(), &abortChecker);
+  queue.setBlockSizeMbytes(16);
+  queue.setSparseFiles(true);
+  EXPECT_TRUE(queue.buildQueueSynchronously());
+  ThreadCtx threadCtx(WdtOptions::get(), false, 0);
+  std::vector<std::pair<int64_t, int64_t>> blocks;
+  while (true) {
+    ErrorCode status;
+    std::unique_ptr<ByteSource> source = queue.getNextSource(&threadCtx, status);
+    if (!source) {
+      break;
+    }
+    EXPECT_EQ(kFileSize, source->getMetaData().size);
+    blocks.emplace_back(source->getOffset(), source->getSize());
+    source->close();
+  }
+  std::sort(blocks.begin(), blocks.end());
+  // the data and the last page of the file
+  ASSERT_EQ(2, blocks.size());
+  EXPECT_EQ(2 * kMbytes, blocks[0].first);
+  EXPECT_EQ(kMbytes, blocks[0].second);
+  EXPECT_EQ(kFileSize - 4096, blocks[1].first);
+  EXPECT_EQ(4096, blocks[1].second);
+  EXPECT_EQ(kMbytes + 4096, queue.getTotalSize());
+}
+
+TEST(DirectorySourceQueue, FedBlocks) {
+  TemporaryDirectory tmpDir;
+  const int64_t kMbytes = 1024 * 1024;
+  createFile(tmpDir.dir() + "/fed", std::string(3 * kMbytes, 'a'));
+  std::atomic<bool> abortTrigger{false};
+  WdtAbortChecker abortChecker(abortTrigger);
+  DirectorySourceQueue queue(WdtOptions::get(), tmpDir.dir(), &abortChecker);
+  queue.setBlockSizeMbytes(1);
+  queue.setFed();
+  std::thread queueThread = queue.buildQueueAsynchronously();
+  BlockDetails block;
+  block.fileName = "fed";
+  block.fileSize = 3 * kMbytes;
+  block.dataSize = 2 * kMbytes;
+  queue.feedBlock(block);
+  EXPECT_FALSE(queue.fileDiscoveryFinished());
+  EXPECT_EQ(2, queue.getNumQueuedSources());
+  // the receiver already has the first mbyte
+  std::string fileName = "fed";
+  std::vector<FileChunksInfo> chunks;
+  chunks.emplace_back(5, fileName, 3 * kMbytes);
+  chunks.back().addChunk(Interval(0, kMbytes));
+  queue.setPreviouslyReceivedChunks(chunks);
+  block.offset = 2 * kMbytes;
+  block.dataSize = kMbytes;
+  queue.feedBlock(block);
+  queue.endFeed();
+  queueThread.join();
+  EXPECT_TRUE(queue.fileDiscoveryFinished());
+  ThreadCtx threadCtx(WdtOptions::get(), false, 0);
+  std::vector<int64_t> offsets;
+  while (true) {
+    ErrorCode status;
+    std::unique_ptr<ByteSource> source = queue.getNextSource(&threadCtx, status);
+    if (!source) {
+      break;
+    }
+    EXPECT_EQ(5, source->getMetaData().seqId);
+    EXPECT_EQ(EXISTS_CORRECT_SIZE, source->getMetaData().allocationStatus);
+    EXPECT_EQ(kMbytes, source->getSize());
+    offsets.push_back(source->getOffset());
+    source->close();
+  }
+  std::sort(offsets.begin(), offsets.end());
+  ASSERT_EQ(2, offsets.size());
+  EXPECT_EQ(kMbytes, offsets[0]);
+  EXPECT_EQ(2 * kMbytes, offsets[1]);
+  EXPECT_EQ(1, queue.getCount());
+  EXPECT_EQ(2 * kMbytes, queue.getTotalSize());
+  EXPECT_EQ(kMbytes, queue.getPreviouslySentBytes());
+}
+
+TEST(DirectorySourceQueue, StreamBlocks) {
+  TemporaryDirectory tmpDir;
+  const int64_t kMbytes = 1024 * 1024;
+  std::string contents(5 * kMbytes / 2, 'a');
+  for (size_t i = 0; i < contents.size(); i++) {
+    contents[i] = 'a' + i % 23;
+  }
+  int pipeFds[2];
+  ASSERT_EQ(0, pipe(pipeFds));
+  std::thread writerThread([&] {
+    EXPECT_EQ(contents.size(),
+              write(pipeFds[1], contents.data(), contents.size()));
+    close(pipeFds[1]);
+  });
+  std::atomic<bool> abortTrigger{false};
+  WdtAbortChecker abortChecker(abortTrigger);
+  DirectorySourceQueue queue(WdtOptions::get(), tmpDir.dir(), &abortChecker);
+  queue.setBlockSizeMbytes(1);
+  queue.setStreamSpoolDir(tmpDir.dir());
+  std::vector<WdtFileInfo> fileInfo;
+  fileInfo.emplace_back(pipeFds[0], -1, "stream");
+  queue.setFileInfo(fileInfo);
+  EXPECT_TRUE(queue.isStreaming());
+  EXPECT_TRUE(queue.buildQueueSynchronously());
+  writerThread.join();
+  close(pipeFds[0]);
+  EXPECT_EQ(1, queue.getCount());
+  EXPECT_EQ(contents.size(), queue.getTotalSize());
+  ThreadCtx threadCtx(WdtOptions::get(), true, 0);
+  std::string received(contents.size(), '\0');
+  int numSources = 0;
+  while (true) {
+    ErrorCode status;
+    std::unique_ptr<ByteSource> source = queue.getNextSource(&threadCtx, status);
+    if (!source) {
+      break;
+    }
+    numSources++;
+    EXPECT_TRUE(source->getMetaData().isStream);
+    EXPECT_EQ(0, source->getMetaData().size);
+    EXPECT_EQ(NOT_EXISTS, source->getMetaData().allocationStatus);
+    ASSERT_EQ(OK, source->open(&threadCtx));
+    int64_t offset = source->getOffset();
+    int64_t size;
+    while (char *data = source->read(size)) {
+      received.replace(offset, size, data, size);
+      offset += size;
+    }
+    EXPECT_TRUE(source->finished());
+    EXPECT_EQ(source->getOffset() + source->getSize(), offset);
+    source->close();
+  }
+  EXPECT_EQ(3, numSources);
+  EXPECT_TRUE(received == contents);
+}
+
+TEST(DirectorySourceQueue, StreamSpoolLimit) {
+  TemporaryDirectory tmpDir;
+  const int64_t kMbytes = 1024 * 1024;
+  const std::string contents(kMbytes, 'a');
+  int pipeFds[2];
+  ASSERT_EQ(0, pipe(pipeFds));
+  std::atomic<bool> abortTrigger{false};
+  WdtAbortChecker abortChecker(abortTrigger);
+  DirectorySourceQueue queue(WdtOptions::get(), tmpDir.dir(), &abortChecker);
+  queue.setBlockSizeMbytes(1);
+  queue.setStreamSpoolDir(tmpDir.dir());
+  queue.setStreamSpoolMaxBytes(2 * kMbytes);
+  std::vector<WdtFileInfo> fileInfo;
+  fileInfo.emplace_back(pipeFds[0], -1, "stream");
+  queue.setFileInfo(fileInfo);
+  std::thread builderThread = queue.buildQueueAsynchronously();
+  for (int i = 0; i < 2; i++) {
+    EXPECT_EQ(contents.size(),
+              write(pipeFds[1], contents.data(), contents.size()));
+  }
+  ThreadCtx threadCtx(WdtOptions::get(), true, 0);
+  ErrorCode status;
+  std::unique_ptr<ByteSource> source = queue.getNextSource(&threadCtx, status);
+  ASSERT_TRUE(source != nullptr);
+  EXPECT_EQ(OK, status);
+  // the data acked is freed from the spool
+  queue.addAckedBytes(source->getMetaData(), source->getOffset(),
+                      source->getSize());
+  struct stat spoolStat;
+  ASSERT_EQ(0, fstat(source->getMetaData().fd, &spoolStat));
+  EXPECT_LE(spoolStat.st_blocks * 512, kMbytes + 64 * 1024);
+  source->close();
+  // and makes room for more
+  EXPECT_EQ(contents.size(),
+            write(pipeFds[1], contents.data(), contents.size()));
+  EXPECT_EQ(1, write(pipeFds[1], "a", 1));
+  close(pipeFds[1]);
+  builderThread.join();
+  close(pipeFds[0]);
+  // the byte past the limit failed the stream
+  while ((source = queue.getNextSource(&threadCtx, status))) {
+    source->close();
+  }
+  EXPECT_EQ(ERROR, status);
+}
+
+TEST(DirectorySourceQueue, DiscoveryIndex) {
+  TemporaryDirectory tmpDir;
+  const std::string root = tmpDir.dir() + "/src";
+  const std::string indexPath = tmpDir.dir() + "/index";
+  ASSERT_EQ(0, mkdir(root.c_str(), 0755));
+  createTree(root, 4, 10);
+  DiscoveryResult first = discover(root, 1, indexPath, true);
+  EXPECT_TRUE(first.success);
+  EXPECT_EQ(4 * 9, first.count);
+  EXPECT_EQ(0, first.previouslySentBytes);
+
+  // nothing changed, everything is skipped
+  DiscoveryResult second = discover(root, 2, indexPath, true);
+  EXPECT_TRUE(second.success);
+  EXPECT_EQ(0, second.count);
+  EXPECT_EQ(first.totalSize, second.previouslySentBytes);
+
+  // a file modified in place and a new file are found again
+  createFile(root + "/dir1/sub/file5", "modified");
+  createFile(root + "/dir2/newfile", "new");
+  DiscoveryResult third = discover(root, 1, indexPath, false);
+  EXPECT_TRUE(third.success);
+  EXPECT_EQ(2, third.count);
+  EXPECT_EQ(8 + 3, third.totalSize);
+
+  // index was not saved for the third run, so the changes are still found
+  DiscoveryResult fourth = discover(root, 1, indexPath, true);
+  EXPECT_EQ(2, fourth.count);
+  DiscoveryResult fifth = discover(root, 1, indexPath, false);
+  EXPECT_EQ(0, fifth.count);
+}
+
+TEST(DirectorySourceQueue, DiscoveryIndexKeepsUnchangedFiles) {
+  TemporaryDirectory tmpDir;
+  const std::string root = tmpDir.dir() + "/src";
+  const std::string indexPath = tmpDir.dir() + "/index";
+  ASSERT_EQ(0, mkdir(root.c_str(), 0755));
+  createTree(root, 2, 4);
+  discover(root, 1, indexPath, true);
+
+  std::atomic<bool> abortTrigger{false};
+  WdtAbortChecker abortChecker(abortTrigger);
+  DirectorySourceQueue queue(WdtOptions::get(), root, &abortChecker);
+  queue.setDiscoveryIndexPath(indexPath);
+  queue.enableFileDeletion();
+  // the receiver has an unchanged file and a file removed from the source
+  std::string unchangedName = "dir0/file2";
+  std::string goneName = "dir0/gone";
+  std::vector<FileChunksInfo> chunks;
+  chunks.emplace_back(1, unchangedName, 2);
+  chunks.back().addChunk(Interval(0, 2));
+  chunks.emplace_back(2, goneName, 5);
+  chunks.back().addChunk(Interval(0, 5));
+  queue.setPreviouslyReceivedChunks(chunks);
+  EXPECT_TRUE(queue.buildQueueSynchronously());
+  ThreadCtx threadCtx(WdtOptions::get(), false, 0);
+  std::vector<std::string> deleted;
+  while (true) {
+    ErrorCode status;
+    std::unique_ptr<ByteSource> source = queue.getNextSource(&threadCtx, status);
+    if (!source) {
+      break;
+    }
+    EXPECT_EQ(TO_BE_DELETED, source->getMetaData().allocationStatus);
+    deleted.push_back(source->getIdentifier());
+  }
+  ASSERT_EQ(1, deleted.size());
+  EXPECT_EQ("dir0/gone", deleted[0]);
+}
+}
+}  // namespace end
+
+int main(int argc, char *argv[]) {
+  FLAGS_logtostderr = true;
+  testing::InitGoogleTest(&argc, argv);
+  GFLAGS_NAMESPACE::ParseCommandLineFlags(&argc, &argv, true);
+  google::InitGoogleLogging(argv[0]);
+  facebook::wdt::Wdt::initializeWdt("wdt");
+  int ret = RUN_ALL_TESTS();
+  return ret;
+}
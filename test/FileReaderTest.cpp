@@ -12,7 +12,10 @@
 #include <stdlib.h>
 #include <wdt/Wdt.h>
 #include <wdt/test/TestCommon.h>
+#include <wdt/util/ReadAheadPipeline.h>
+#include <deque>
 #include <fstream>
+#include <tuple>
 
 namespace facebook {
 namespace wdt {
@@ -40,8 +43,7 @@ class RandomFile {
     if (metaData_ == nullptr) {
       metaData_ = new SourceMetaData();
     }
-    metaData_->fullPath = fileName_;
-    metaData_->relPath = getShortName();
+    metaData_->setPaths(getShortName(), fileName_);
     metaData_->seqId = 0;
     metaData_->size = fileSize_;
     metaData_->directReads = true;
@@ -140,6 +142,213 @@ TEST(FileByteSource, ODIRECT_NONMULTIPLE_OFFSET) {
   }
 }
 
+TEST(FileByteSource, IO_URING_READS) {
+  WdtOptions options;
+  options.io_uring_reads = true;
+  for (int numTests = 0; numTests < 10; ++numTests) {
+    int64_t fileSize = options.buffer_size * (1 + rand32() % 8) +
+                       (rand32() % options.buffer_size);
+    testFileRead(options, fileSize, false);
+    if (canSupportODirect()) {
+      testFileRead(options, fileSize, true);
+    }
+  }
+}
+
+TEST(FileByteSource, READ_AHEAD_PIPELINE) {
+  WdtOptions options;
+  const int64_t numFiles = 5;
+  std::vector<RandomFile> randFiles;
+  randFiles.reserve(numFiles);
+  std::vector<std::unique_ptr<FileByteSource>> sources;
+  ThreadCtx threadCtx(options, true);
+  ASSERT_TRUE(threadCtx.addBuffers(3));
+  for (int i = 0; i < numFiles; i++) {
+    randFiles.emplace_back(options.buffer_size * (i + 1) + i * 1000);
+    auto metaData = randFiles.back().getMetaData();
+    metaData->directReads = (i % 2 == 0) && canSupportODirect();
+    sources.emplace_back(
+        std::make_unique<FileByteSource>(metaData, metaData->size, 0));
+    EXPECT_EQ(OK, sources.back()->open(&threadCtx));
+  }
+  ReadAheadPipeline pipeline(threadCtx);
+  for (auto& source : sources) {
+    pipeline.addSource(source.get());
+  }
+  for (int i = 0; i < numFiles; i++) {
+    int64_t totalSizeRead = 0;
+    while (true) {
+      int64_t size;
+      char* data = pipeline.read(sources[i].get(), size);
+      if (data == nullptr) {
+        break;
+      }
+      EXPECT_GT(size, 0);
+      totalSizeRead += size;
+    }
+    EXPECT_TRUE(sources[i]->finished());
+    EXPECT_EQ(randFiles[i].getSize(), totalSizeRead);
+  }
+  EXPECT_TRUE(pipeline.isIdle());
+}
+
+/// in memory source of deterministic bytes, read asynchronously
+class AsyncTestSource : public ByteSource {
+ public:
+  explicit AsyncTestSource(int64_t size) : size_(size) {
+    metaData_.setPaths(identifier_, identifier_);
+    metaData_.size = size;
+  }
+  string getIdentifier() const override {
+    return identifier_;
+  }
+  int64_t getSize() const override {
+    return size_;
+  }
+  int64_t getOffset() const override {
+    return 0;
+  }
+  const SourceMetaData& getMetaData() const override {
+    return metaData_;
+  }
+  bool finished() const override {
+    return numReturned_ == size_;
+  }
+  bool hasError() const override {
+    return false;
+  }
+  char* read(int64_t& size) override {
+    size = 0;
+    return nullptr;
+  }
+  void setReadBuffer(const Buffer* /* buffer */) override {
+  }
+  int getZeroCopyFd() override {
+    return -1;
+  }
+  void markRead(int64_t /* numBytes */) override {
+  }
+  bool supportsAsyncReads() const override {
+    return true;
+  }
+  int64_t submitRead(char* buffer, int64_t capacity) override {
+    const int64_t size = std::min(capacity, size_ - numSubmitted_);
+    if (size == 0) {
+      return 0;
+    }
+    pending_.emplace_back(buffer, numSubmitted_, size);
+    numSubmitted_ += size;
+    maxInFlight_ = std::max<int64_t>(maxInFlight_, pending_.size());
+    return size;
+  }
+  char* waitForRead(int64_t& size) override {
+    char* buffer;
+    int64_t offset;
+    std::tie(buffer, offset, size) = pending_.front();
+    pending_.pop_front();
+    for (int64_t i = 0; i < size; i++) {
+      buffer[i] = getByte(offset + i);
+    }
+    numReturned_ += size;
+    return buffer;
+  }
+  void advanceOffset(int64_t /* numBytes */) override {
+  }
+  ErrorCode open(ThreadCtx* /* threadCtx */) override {
+    return OK;
+  }
+  void close() override {
+  }
+  TransferStats& getTransferStats() override {
+    return stats_;
+  }
+  void addTransferStats(const TransferStats& stats) override {
+    stats_ += stats;
+  }
+  static char getByte(int64_t offset) {
+    return static_cast<char>(offset % 251);
+  }
+  int64_t getMaxInFlight() const {
+    return maxInFlight_;
+  }
+
+ private:
+  const string identifier_{"async_test_source"};
+  const int64_t size_;
+  SourceMetaData metaData_;
+  TransferStats stats_;
+  /// buffer, offset and size of the reads submitted
+  std::deque<std::tuple<char*, int64_t, int64_t>> pending_;
+  int64_t numSubmitted_{0};
+  int64_t numReturned_{0};
+  int64_t maxInFlight_{0};
+};
+
+TEST(FileByteSource, ASYNC_READ_AHEAD_PIPELINE) {
+  WdtOptions options;
+  ThreadCtx threadCtx(options, true);
+  ASSERT_TRUE(threadCtx.addBuffers(4));
+  AsyncTestSource source(options.buffer_size * 10 + 123);
+  ReadAheadPipeline pipeline(threadCtx);
+  pipeline.addSource(&source);
+  int64_t totalSizeRead = 0;
+  while (true) {
+    int64_t size;
+    char* data = pipeline.read(&source, size);
+    if (data == nullptr) {
+      break;
+    }
+    for (int64_t i = 0; i < size; i++) {
+      ASSERT_EQ(AsyncTestSource::getByte(totalSizeRead + i), data[i]);
+    }
+    totalSizeRead += size;
+  }
+  EXPECT_EQ(source.getSize(), totalSizeRead);
+  EXPECT_TRUE(source.finished());
+  EXPECT_GT(source.getMaxInFlight(), 1);
+  EXPECT_TRUE(pipeline.isIdle());
+}
+
+TEST(FileByteSource, READ_AHEAD_PIPELINE_HOLD_BUFFERS) {
+  WdtOptions options;
+  ThreadCtx threadCtx(options, true);
+  ASSERT_TRUE(threadCtx.addBuffers(4));
+  AsyncTestSource source(options.buffer_size * 10 + 123);
+  ReadAheadPipeline pipeline(threadCtx);
+  pipeline.addSource(&source);
+  // held chunks with their offset and size, they must not be read into
+  std::deque<std::tuple<const char*, int64_t, int64_t>> held;
+  auto releaseOldest = [&]() {
+    const char* data;
+    int64_t offset, size;
+    std::tie(data, offset, size) = held.front();
+    for (int64_t i = 0; i < size; i++) {
+      ASSERT_EQ(AsyncTestSource::getByte(offset + i), data[i]);
+    }
+    pipeline.releaseBuffer(data);
+    held.pop_front();
+  };
+  int64_t totalSizeRead = 0;
+  while (true) {
+    if (held.size() >= 2) {
+      releaseOldest();
+    }
+    int64_t size;
+    char* data = pipeline.read(&source, size);
+    if (data == nullptr) {
+      break;
+    }
+    EXPECT_EQ(data, pipeline.holdBuffer());
+    held.emplace_back(data, totalSizeRead, size);
+    totalSizeRead += size;
+  }
+  while (!held.empty()) {
+    releaseOldest();
+  }
+  EXPECT_EQ(source.getSize(), totalSizeRead);
+  EXPECT_TRUE(pipeline.isIdle());
+}
+
 TEST(FileByteSource, FILEINFO_ODIRECT) {
   int64_t fileSize = kDiskBlockSize * 10 + 11;
   int64_t sizeToRead = fileSize / 10;
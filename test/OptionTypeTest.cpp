@@ -30,6 +30,8 @@ namespace wdt {
 const std::string NUM_PORTS_FLAG = WDT_FLAG_STR(num_ports);
 const std::string BLOCK_SIZE_FLAG = WDT_FLAG_STR(block_size_mbytes);
 const std::string OPTION_TYPE_FLAG = WDT_FLAG_STR(option_type);
+const std::string VERIFY_FLAG = WDT_FLAG_STR(verify);
+const std::string DELTA_THREADS_FLAG = WDT_FLAG_STR(delta_resumption_threads);
 
 void overrideTest1(const std::string &optionType) {
   WdtOptions options;
@@ -92,6 +94,20 @@ TEST(OptionType, DiskOptionTypeTest3) {
 TEST(OptionType, DiskOptionTypeTest4) {
   overrideTest2("disk");
 }
+
+TEST(OptionType, VerifyTest) {
+  WdtOptions options;
+  GFLAGS_NAMESPACE::SetCommandLineOption(OPTION_TYPE_FLAG.c_str(), "flash");
+  GFLAGS_NAMESPACE::SetCommandLineOption(VERIFY_FLAG.c_str(), "true");
+  GFLAGS_NAMESPACE::SetCommandLineOption(DELTA_THREADS_FLAG.c_str(), "4");
+  WdtFlags::initializeFromFlags(options);
+  EXPECT_TRUE(options.isDirectoryTreeBasedResumption());
+  EXPECT_TRUE(options.disable_preallocation);
+  EXPECT_EQ(1024, options.delta_resumption_block_kbytes);
+  // not overwritten when specified
+  EXPECT_EQ(4, options.delta_resumption_threads);
+  GFLAGS_NAMESPACE::SetCommandLineOption(VERIFY_FLAG.c_str(), "false");
+}
 }
 }
 
@@ -96,6 +96,41 @@ void testHeader() {
   EXPECT_FALSE(success);
 }
 
+void testSparseHeader() {
+  BlockDetails bd;
+  bd.fileName = "sparse";
+  bd.seqId = 3;
+  bd.dataSize = 3;
+  bd.offset = 4;
+  bd.fileSize = 10;
+  bd.allocationStatus = NOT_EXISTS;
+  bd.sparseFile = true;
+
+  char buf[128];
+  int64_t off = 0;
+  EXPECT_TRUE(Protocol::encodeHeader(Protocol::SPARSE_FILE_VERSION, buf, off,
+                                     sizeof(buf), bd));
+  BlockDetails nbd;
+  int64_t noff = 0;
+  EXPECT_TRUE(Protocol::decodeHeader(Protocol::SPARSE_FILE_VERSION, buf, noff,
+                                     sizeof(buf), nbd));
+  EXPECT_EQ(noff, off);
+  EXPECT_EQ(nbd.allocationStatus, bd.allocationStatus);
+  EXPECT_TRUE(nbd.sparseFile);
+
+  // older receivers must not see the flag
+  off = 0;
+  EXPECT_TRUE(Protocol::encodeHeader(Protocol::FILE_BATCH_VERSION, buf, off,
+                                     sizeof(buf), bd));
+  BlockDetails obd;
+  noff = 0;
+  EXPECT_TRUE(Protocol::decodeHeader(Protocol::FILE_BATCH_VERSION, buf, noff,
+                                     sizeof(buf), obd));
+  EXPECT_EQ(noff, off);
+  EXPECT_EQ(obd.allocationStatus, bd.allocationStatus);
+  EXPECT_FALSE(obd.sparseFile);
+}
+
 void testFileChunksInfo() {
   FileChunksInfo fileChunksInfo;
   fileChunksInfo.setSeqId(10);
@@ -104,12 +139,14 @@ void testFileChunksInfo() {
   fileChunksInfo.addChunk(Interval(1, 10));
   fileChunksInfo.addChunk(Interval(20, 30));
 
+  const int version = Protocol::protocol_version;
   char buf[128];
   int64_t off = 0;
-  Protocol::encodeFileChunksInfo(buf, off, sizeof(buf), fileChunksInfo);
+  Protocol::encodeFileChunksInfo(version, buf, off, sizeof(buf),
+                                 fileChunksInfo);
   FileChunksInfo nFileChunksInfo;
   folly::ByteRange br((uint8_t *)buf, sizeof(buf));
-  bool success = Protocol::decodeFileChunksInfo(br, nFileChunksInfo);
+  bool success = Protocol::decodeFileChunksInfo(version, br, nFileChunksInfo);
   EXPECT_TRUE(success);
   int64_t noff = br.start() - (uint8_t *)buf;
   EXPECT_EQ(noff, off);
@@ -117,14 +154,65 @@ void testFileChunksInfo() {
 
   // test with smaller buffer; exact size:
   br.reset((uint8_t *)buf, off);
-  success = Protocol::decodeFileChunksInfo(br, nFileChunksInfo);
+  success = Protocol::decodeFileChunksInfo(version, br, nFileChunksInfo);
   EXPECT_TRUE(success);
   // 1 byte missing :
   br.reset((uint8_t *)buf, off - 1);
-  success = Protocol::decodeFileChunksInfo(br, nFileChunksInfo);
+  success = Protocol::decodeFileChunksInfo(version, br, nFileChunksInfo);
   EXPECT_FALSE(success);
 }
 
+void testFileChunksInfoBlockHashes() {
+  FileChunksInfo fileChunksInfo;
+  fileChunksInfo.setSeqId(10);
+  fileChunksInfo.setFileName("abc");
+  fileChunksInfo.setFileSize(128);
+  fileChunksInfo.addChunk(Interval(0, 128));
+  std::string hashes(2 * FileChunksInfo::kBlockHashLen, 'h');
+  hashes[FileChunksInfo::kBlockHashLen] = 'x';
+  fileChunksInfo.setBlockHashes(64, 0, hashes);
+
+  char buf[256];
+  int64_t off = 0;
+  EXPECT_TRUE(Protocol::encodeFileChunksInfo(Protocol::DELTA_RESUMPTION_VERSION,
+                                             buf, off, sizeof(buf),
+                                             fileChunksInfo));
+  EXPECT_GE(Protocol::maxEncodeLen(Protocol::DELTA_RESUMPTION_VERSION,
+                                   fileChunksInfo),
+            off);
+  FileChunksInfo nFileChunksInfo;
+  folly::ByteRange br((uint8_t *)buf, off);
+  EXPECT_TRUE(Protocol::decodeFileChunksInfo(Protocol::DELTA_RESUMPTION_VERSION,
+                                             br, nFileChunksInfo));
+  EXPECT_TRUE(br.empty());
+  EXPECT_EQ(nFileChunksInfo, fileChunksInfo);
+  // truncated hashes
+  FileChunksInfo tFileChunksInfo;
+  br.reset((uint8_t *)buf, off - 1);
+  EXPECT_FALSE(Protocol::decodeFileChunksInfo(
+      Protocol::DELTA_RESUMPTION_VERSION, br, tFileChunksInfo));
+
+  // older senders do not get the hashes
+  off = 0;
+  EXPECT_TRUE(Protocol::encodeFileChunksInfo(Protocol::RECEIVER_RATE_VERSION,
+                                             buf, off, sizeof(buf),
+                                             fileChunksInfo));
+  FileChunksInfo oFileChunksInfo;
+  br.reset((uint8_t *)buf, off);
+  EXPECT_TRUE(Protocol::decodeFileChunksInfo(Protocol::RECEIVER_RATE_VERSION,
+                                             br, oFileChunksInfo));
+  EXPECT_TRUE(br.empty());
+  EXPECT_EQ(0, oFileChunksInfo.getBlockHashSize());
+  EXPECT_TRUE(fileChunksInfo.getChunks() == oFileChunksInfo.getChunks());
+
+  // the entry with the next hashes of a large file
+  FileChunksInfo next;
+  next.setBlockHashes(64, 2, std::string(FileChunksInfo::kBlockHashLen, 'n'));
+  EXPECT_TRUE(nFileChunksInfo.appendBlockHashes(next));
+  EXPECT_EQ(3, nFileChunksInfo.getNumBlockHashes());
+  EXPECT_FALSE(nFileChunksInfo.appendBlockHashes(next));
+}
+
 void testSettings() {
   Settings settings;
   int senderProtocolVersion = Protocol::SETTINGS_FLAG_VERSION;
@@ -159,6 +247,337 @@ void testSettings() {
   EXPECT_EQ(nsettings.blockModeDisabled, settings.blockModeDisabled);
 }
 
+void testCompression() {
+  BlockDetails bd;
+  bd.fileName = "compressed";
+  bd.seqId = 3;
+  bd.dataSize = 1000;
+  bd.fileSize = 1000;
+  bd.compressed = true;
+
+  char buf[128];
+  int64_t off = 0;
+  EXPECT_TRUE(Protocol::encodeHeader(Protocol::COMPRESSION_VERSION, buf, off,
+                                     sizeof(buf), bd));
+  BlockDetails nbd;
+  int64_t noff = 0;
+  EXPECT_TRUE(Protocol::decodeHeader(Protocol::COMPRESSION_VERSION, buf, noff,
+                                     sizeof(buf), nbd));
+  EXPECT_EQ(noff, off);
+  EXPECT_TRUE(nbd.compressed);
+  EXPECT_EQ(bd.dataSize, nbd.dataSize);
+
+  // older receivers must not see the flag
+  off = 0;
+  EXPECT_TRUE(Protocol::encodeHeader(Protocol::MANIFEST_VERSION, buf, off,
+                                     sizeof(buf), bd));
+  BlockDetails obd;
+  noff = 0;
+  EXPECT_TRUE(Protocol::decodeHeader(Protocol::MANIFEST_VERSION, buf, noff,
+                                     sizeof(buf), obd));
+  EXPECT_EQ(noff, off);
+  EXPECT_FALSE(obd.compressed);
+
+  Settings settings;
+  settings.transferId = "abc";
+  settings.enableChecksum = true;
+  settings.compressionType = COMP_ZSTD;
+  off = 0;
+  EXPECT_TRUE(Protocol::encodeSettings(Protocol::COMPRESSION_VERSION, buf, off,
+                                       sizeof(buf), settings));
+  int senderProtocolVersion;
+  Settings nsettings;
+  noff = 0;
+  EXPECT_TRUE(Protocol::decodeVersion(buf, noff, off, senderProtocolVersion));
+  EXPECT_EQ(Protocol::COMPRESSION_VERSION, senderProtocolVersion);
+  EXPECT_TRUE(Protocol::decodeSettings(senderProtocolVersion, buf, noff, off,
+                                       nsettings));
+  EXPECT_EQ(noff, off);
+  EXPECT_EQ(COMP_ZSTD, nsettings.compressionType);
+  EXPECT_TRUE(nsettings.enableChecksum);
+
+  // unknown compression type
+  buf[off - 1] = NUM_COMP_TYPES;
+  noff = 0;
+  EXPECT_TRUE(Protocol::decodeVersion(buf, noff, off, senderProtocolVersion));
+  EXPECT_FALSE(Protocol::decodeSettings(senderProtocolVersion, buf, noff, off,
+                                        nsettings));
+}
+
+void testDuplicate() {
+  BlockDetails bd;
+  bd.fileName = "copy";
+  bd.seqId = 7;
+  bd.fileSize = 1000;
+  bd.duplicateOfSeqId = 5;
+
+  char buf[128];
+  int64_t off = 0;
+  EXPECT_TRUE(Protocol::encodeHeader(Protocol::DEDUP_VERSION, buf, off,
+                                     sizeof(buf), bd));
+  BlockDetails nbd;
+  int64_t noff = 0;
+  EXPECT_TRUE(Protocol::decodeHeader(Protocol::DEDUP_VERSION, buf, noff,
+                                     sizeof(buf), nbd));
+  EXPECT_EQ(noff, off);
+  EXPECT_EQ(5, nbd.duplicateOfSeqId);
+  EXPECT_EQ(0, nbd.dataSize);
+  EXPECT_EQ(bd.fileSize, nbd.fileSize);
+
+  // older receivers must not see the flag
+  off = 0;
+  EXPECT_TRUE(Protocol::encodeHeader(Protocol::COMPRESSION_VERSION, buf, off,
+                                     sizeof(buf), bd));
+  BlockDetails obd;
+  noff = 0;
+  EXPECT_TRUE(Protocol::decodeHeader(Protocol::COMPRESSION_VERSION, buf, noff,
+                                     sizeof(buf), obd));
+  EXPECT_EQ(noff, off);
+  EXPECT_EQ(0, obd.duplicateOfSeqId);
+
+  // prev seq-id of a sparse file is kept along with the other flags
+  BlockDetails sbd;
+  sbd.fileName = "sparse";
+  sbd.seqId = 8;
+  sbd.dataSize = 10;
+  sbd.fileSize = 1000;
+  sbd.allocationStatus = EXISTS_TOO_SMALL;
+  sbd.prevSeqId = 4;
+  sbd.sparseFile = true;
+  off = 0;
+  EXPECT_TRUE(Protocol::encodeHeader(Protocol::DEDUP_VERSION, buf, off,
+                                     sizeof(buf), sbd));
+  BlockDetails nsbd;
+  noff = 0;
+  EXPECT_TRUE(Protocol::decodeHeader(Protocol::DEDUP_VERSION, buf, noff,
+                                     sizeof(buf), nsbd));
+  EXPECT_EQ(noff, off);
+  EXPECT_EQ(4, nsbd.prevSeqId);
+  EXPECT_TRUE(nsbd.sparseFile);
+  EXPECT_EQ(0, nsbd.duplicateOfSeqId);
+
+  Settings settings;
+  settings.transferId = "abc";
+  settings.dedupFiles = true;
+  off = 0;
+  EXPECT_TRUE(Protocol::encodeSettings(Protocol::DEDUP_VERSION, buf, off,
+                                       sizeof(buf), settings));
+  int senderProtocolVersion;
+  Settings nsettings;
+  noff = 0;
+  EXPECT_TRUE(Protocol::decodeVersion(buf, noff, off, senderProtocolVersion));
+  EXPECT_TRUE(Protocol::decodeSettings(senderProtocolVersion, buf, noff, off,
+                                       nsettings));
+  EXPECT_EQ(noff, off);
+  EXPECT_TRUE(nsettings.dedupFiles);
+  EXPECT_FALSE(nsettings.enableChecksum);
+}
+
+void testChecksumType() {
+  Settings settings;
+  settings.transferId = "abc";
+  settings.enableChecksum = true;
+  settings.checksumType = CHECKSUM_XXH3_64;
+  char buf[128];
+  int64_t off = 0;
+  EXPECT_TRUE(Protocol::encodeSettings(Protocol::CHECKSUM_TYPE_VERSION, buf,
+                                       off, sizeof(buf), settings));
+  int senderProtocolVersion;
+  Settings nsettings;
+  int64_t noff = 0;
+  EXPECT_TRUE(Protocol::decodeVersion(buf, noff, off, senderProtocolVersion));
+  EXPECT_TRUE(Protocol::decodeSettings(senderProtocolVersion, buf, noff, off,
+                                       nsettings));
+  EXPECT_EQ(noff, off);
+  EXPECT_EQ(CHECKSUM_XXH3_64, nsettings.checksumType);
+
+  // unknown checksum type
+  buf[off - 1] = NUM_CHECKSUM_TYPES;
+  noff = 0;
+  EXPECT_TRUE(Protocol::decodeVersion(buf, noff, off, senderProtocolVersion));
+  EXPECT_FALSE(Protocol::decodeSettings(senderProtocolVersion, buf, noff, off,
+                                        nsettings));
+
+  // older receivers only know crc32c
+  off = 0;
+  EXPECT_TRUE(Protocol::encodeSettings(Protocol::DEDUP_VERSION, buf, off,
+                                       sizeof(buf), settings));
+  noff = 0;
+  EXPECT_TRUE(Protocol::decodeVersion(buf, noff, off, senderProtocolVersion));
+  EXPECT_TRUE(Protocol::decodeSettings(senderProtocolVersion, buf, noff, off,
+                                       nsettings));
+  EXPECT_EQ(noff, off);
+  EXPECT_EQ(CHECKSUM_CRC32C, nsettings.checksumType);
+
+  // 64 bits footers, crc32c ones encoded as before
+  for (int64_t checksum : {(int64_t)-0x7edcba98, (int64_t)0x12345678,
+                           (int64_t)0x8123456789abcdefULL}) {
+    off = 0;
+    EXPECT_TRUE(Protocol::encodeFooter(buf, off, Protocol::kMaxFooter,
+                                       checksum));
+    int64_t decoded = 0;
+    noff = 0;
+    EXPECT_TRUE(Protocol::decodeFooter(buf, noff, off, decoded));
+    EXPECT_EQ(noff, off);
+    EXPECT_EQ(checksum, decoded);
+  }
+}
+
+void testChecksumCombine() {
+  std::string data(100000, 0);
+  for (size_t i = 0; i < data.size(); i++) {
+    data[i] = (char)(i * 7 + (i >> 8));
+  }
+  BlockChecksum whole(CHECKSUM_CRC32C);
+  whole.update(data.data(), data.size());
+  BlockChecksum piece(CHECKSUM_CRC32C);
+  for (int64_t split : {0, 1, 4, 1000, 65536, 99999}) {
+    piece.reset();
+    piece.update(data.data(), split);
+    const int64_t first = piece.getValue();
+    piece.reset();
+    piece.update(data.data() + split, data.size() - split);
+    EXPECT_EQ(whole.getValue(),
+              BlockChecksum::combine(CHECKSUM_CRC32C, first, piece.getValue(),
+                                     data.size() - split));
+  }
+  EXPECT_EQ(whole.getValue(), BlockChecksum::combine(CHECKSUM_CRC32C, 0,
+                                                     whole.getValue(),
+                                                     data.size()));
+}
+
+void testCompactFileChunksInfoList() {
+  std::vector<FileChunksInfo> fileChunksInfoList;
+  for (int i = 0; i < 20; i++) {
+    string fileName = "some/long/directory/name/file" + std::to_string(i);
+    FileChunksInfo fileChunksInfo(100 - 3 * i, fileName, 1000 + i);
+    if (i % 3 == 0) {
+      fileChunksInfo.addChunk(Interval(0, 1000 + i));
+    } else if (i % 3 == 1) {
+      fileChunksInfo.addChunk(Interval(10, 20));
+      fileChunksInfo.addChunk(Interval(500, 1000 + i));
+    } else {
+      // chunk past the end of a file which shrank
+      fileChunksInfo.addChunk(Interval(0, 2000));
+    }
+    if (i == 4) {
+      fileChunksInfo.setBlockHashes(
+          64, 0, string(FileChunksInfo::kBlockHashLen, 'h'));
+    }
+    fileChunksInfoList.emplace_back(std::move(fileChunksInfo));
+  }
+  // a name which is a prefix of the previous one
+  string shortName = "some/long";
+  fileChunksInfoList.emplace_back(7, shortName, 10);
+  fileChunksInfoList.emplace_back(8, shortName, 0);
+
+  char buf[2048];
+  int64_t compactLen = 0;
+  const int64_t numEntries = fileChunksInfoList.size();
+  for (int version : {Protocol::STREAMED_FILE_CHUNKS_VERSION,
+                      Protocol::COMPACT_FILE_CHUNKS_VERSION}) {
+    int64_t off = 0;
+    EXPECT_EQ(numEntries,
+              Protocol::encodeFileChunksInfoList(version, buf, off, sizeof(buf),
+                                                 0, fileChunksInfoList));
+    std::vector<FileChunksInfo> decoded;
+    int64_t noff = 0;
+    EXPECT_TRUE(Protocol::decodeFileChunksInfoList(version, buf, noff, off,
+                                                   decoded));
+    EXPECT_EQ(off, noff);
+    ASSERT_EQ(numEntries, (int64_t)decoded.size());
+    for (int64_t i = 0; i < numEntries; i++) {
+      EXPECT_EQ(fileChunksInfoList[i], decoded[i]);
+      EXPECT_EQ(fileChunksInfoList[i].getBlockHashes(),
+                decoded[i].getBlockHashes());
+    }
+    // truncated buffer
+    decoded.clear();
+    noff = 0;
+    EXPECT_FALSE(Protocol::decodeFileChunksInfoList(version, buf, noff,
+                                                    off - 1, decoded));
+    if (version == Protocol::STREAMED_FILE_CHUNKS_VERSION) {
+      compactLen = off;
+    } else {
+      EXPECT_LT(2 * off, compactLen);
+    }
+  }
+
+  // buffers starting at any entry decode on their own, appended to the list
+  const int version = Protocol::COMPACT_FILE_CHUNKS_VERSION;
+  std::vector<FileChunksInfo> decoded;
+  int64_t startIndex = 0;
+  while (startIndex < numEntries) {
+    int64_t off = 0;
+    const int64_t numEncoded = Protocol::encodeFileChunksInfoList(
+        version, buf, off, 180, startIndex, fileChunksInfoList);
+    EXPECT_GT(numEncoded, 0);
+    EXPECT_LT(numEncoded, numEntries);
+    int64_t noff = 0;
+    EXPECT_TRUE(Protocol::decodeFileChunksInfoList(version, buf, noff, off,
+                                                   decoded));
+    startIndex += numEncoded;
+  }
+  ASSERT_EQ(numEntries, (int64_t)decoded.size());
+  for (int64_t i = 0; i < numEntries; i++) {
+    EXPECT_EQ(fileChunksInfoList[i], decoded[i]);
+  }
+
+  // a shared prefix longer than the previous name
+  char bogus[] = {0, 3, 0, 0, 0, 0};
+  folly::ByteRange br((uint8_t *)bogus, sizeof(bogus));
+  FileChunksInfo bogusInfo;
+  EXPECT_FALSE(Protocol::decodeFileChunksInfo(version, br, bogusInfo));
+}
+
+void testManifest() {
+  std::vector<BlockDetails> entries(4);
+  entries[0].fileName = "dir/sub/a";
+  entries[0].seqId = 5;
+  entries[0].fileSize = 1 << 20;
+  entries[1].fileName = "dir/sub/b";
+  entries[1].seqId = 3;
+  entries[1].fileSize = 0;
+  entries[1].allocationStatus = EXISTS_TOO_LARGE;
+  entries[1].prevSeqId = 9;
+  entries[2].fileName = "dir/other";
+  entries[2].seqId = 6;
+  entries[2].fileSize = 123456789;
+  entries[2].allocationStatus = EXISTS_TOO_SMALL;
+  entries[2].prevSeqId = 2;
+  entries[2].sparseFile = true;
+  entries[3].fileName = "top";
+  entries[3].seqId = 7;
+
+  char buf[256];
+  int64_t off = 0;
+  int64_t maxLen = 0;
+  for (const BlockDetails &entry : entries) {
+    maxLen += Protocol::maxManifestEntryLen(entry);
+  }
+  EXPECT_TRUE(Protocol::encodeManifest(buf, off, sizeof(buf), entries));
+  EXPECT_GE(maxLen, off);
+  std::vector<BlockDetails> decoded;
+  int64_t noff = 0;
+  EXPECT_TRUE(Protocol::decodeManifest(buf, noff, off, decoded));
+  EXPECT_EQ(off, noff);
+  ASSERT_EQ(entries.size(), decoded.size());
+  for (size_t i = 0; i < entries.size(); i++) {
+    EXPECT_EQ(entries[i].fileName, decoded[i].fileName);
+    EXPECT_EQ(entries[i].seqId, decoded[i].seqId);
+    EXPECT_EQ(entries[i].fileSize, decoded[i].fileSize);
+    EXPECT_EQ(entries[i].allocationStatus, decoded[i].allocationStatus);
+    EXPECT_EQ(entries[i].prevSeqId, decoded[i].prevSeqId);
+    EXPECT_EQ(entries[i].sparseFile, decoded[i].sparseFile);
+  }
+  // truncated, and too small a buffer
+  decoded.clear();
+  noff = 0;
+  EXPECT_FALSE(Protocol::decodeManifest(buf, noff, off - 1, decoded));
+  int64_t smallOff = 0;
+  EXPECT_FALSE(Protocol::encodeManifest(buf, smallOff, off - 1, entries));
+}
+
 TEST(Protocol, EncodeString) {
   string inp1("abc");
   char buf[10];
@@ -211,12 +630,51 @@ TEST(Protocol, encodeVarI64C) {
 TEST(Protocol, Simple_Header) {
   testHeader();
 }
+TEST(Protocol, Sparse_Header) {
+  testSparseHeader();
+}
 TEST(Protocol, Simple_Settings) {
   testSettings();
 }
+TEST(Protocol, Rate) {
+  char buf[Protocol::kRateCmdLen];
+  int64_t off = 0;
+  buf[off++] = Protocol::RATE_CMD;
+  EXPECT_TRUE(Protocol::encodeRate(buf, off, sizeof(buf), 123456789));
+  EXPECT_EQ(Protocol::kRateCmdLen, off);
+  int64_t rate = 0;
+  int64_t noff = 1;
+  EXPECT_TRUE(Protocol::decodeRate(buf, noff, off, rate));
+  EXPECT_EQ(off, noff);
+  EXPECT_EQ(123456789, rate);
+  // truncated cmd
+  noff = 1;
+  EXPECT_FALSE(Protocol::decodeRate(buf, noff, off - 1, rate));
+}
 TEST(Protocol, FileChunksInfo) {
   testFileChunksInfo();
 }
+TEST(Protocol, FileChunksInfoBlockHashes) {
+  testFileChunksInfoBlockHashes();
+}
+TEST(Protocol, CompactFileChunksInfoList) {
+  testCompactFileChunksInfoList();
+}
+TEST(Protocol, Manifest) {
+  testManifest();
+}
+TEST(Protocol, Compression) {
+  testCompression();
+}
+TEST(Protocol, Duplicate) {
+  testDuplicate();
+}
+TEST(Protocol, ChecksumType) {
+  testChecksumType();
+}
+TEST(Protocol, ChecksumCombine) {
+  testChecksumCombine();
+}
 }
 }  // namespaces
 
@@ -104,6 +104,17 @@ TEST(ThreadsController, Barrier) {
   }
 }
 
+TEST(ThreadsController, BarrierHit) {
+  // threads which can't block hit the barrier and poll it
+  Barrier barrier(3);
+  EXPECT_FALSE(barrier.hit());
+  EXPECT_FALSE(barrier.isComplete());
+  barrier.deRegister();
+  EXPECT_FALSE(barrier.isComplete());
+  EXPECT_TRUE(barrier.hit());
+  EXPECT_TRUE(barrier.isComplete());
+}
+
 TEST(ThreadsController, ExecutOnceFunc) {
   int numThreads = 8;
   ExecuteOnceFunc execAtStart(numThreads, true);
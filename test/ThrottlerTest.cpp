@@ -1,7 +1,10 @@
 #include <wdt/Throttler.h>
+#include <wdt/util/BandwidthScheduler.h>
+#include <wdt/util/RateScheduler.h>
 
 #include <glog/logging.h>
 #include <gtest/gtest.h>
+#include <atomic>
 #include <chrono>
 
 namespace facebook {
@@ -42,6 +45,68 @@ TEST(ThrottlerTest, RATE_CHANGE) {
   throttler->endTransfer();
 }
 
+TEST(ThrottlerTest, LEASE) {
+  WdtOptions options;
+  options.avg_mbytes_per_sec = 50;
+  options.throttler_lease_size = 1024 * 1024;
+  std::shared_ptr<Throttler> throttler =
+      Throttler::makeThrottler(options.getThrottlerOptions());
+  throttler->startTransfer();
+  ThreadCtx threadCtx(options, false);
+
+  int64_t numTransferred = 0;
+  auto startTime = Clock::now();
+  while (durationSeconds(Clock::now() - startTime) <= 2) {
+    throttler->limit(threadCtx, 1000);
+    numTransferred += 1000;
+  }
+  double durationSecs = durationSeconds(Clock::now() - startTime);
+  EXPECT_NEAR(numTransferred / durationSecs / kMbToB, 50, 1);
+  // the throttler only sees whole leases, the rest is the thread's credit
+  const int64_t progress = throttler->getProgress();
+  EXPECT_EQ(0, progress % options.throttler_lease_size);
+  EXPECT_EQ(progress - numTransferred,
+            threadCtx.getThrottlerCredit().tokens);
+
+  // credit leased before a rate change is dropped
+  throttler->setThrottlerRates(options.getThrottlerOptions());
+  throttler->limit(threadCtx, 1000);
+  EXPECT_EQ(options.throttler_lease_size, throttler->getProgress());
+  EXPECT_EQ(options.throttler_lease_size - 1000,
+            threadCtx.getThrottlerCredit().tokens);
+
+  throttler->endTransfer();
+}
+
+TEST(ThrottlerTest, HIERARCHY) {
+  WdtOptions options;
+  options.avg_mbytes_per_sec = 40;
+  std::shared_ptr<Throttler> parent =
+      Throttler::makeThrottler(options.getThrottlerOptions());
+  options.avg_mbytes_per_sec = 30;
+  std::shared_ptr<Throttler> child1 =
+      Throttler::makeThrottler(options.getThrottlerOptions(), parent);
+  std::shared_ptr<Throttler> child2 =
+      Throttler::makeThrottler(options.getThrottlerOptions(), parent);
+
+  // alone, a child is limited by its own rate
+  child1->startTransfer();
+  testThrottling(child1, 30);
+  child1->endTransfer();
+
+  // together, the children share the rate of the parent
+  child1->startTransfer();
+  child2->startTransfer();
+  std::thread t1(testThrottling, child1, 20);
+  std::thread t2(testThrottling, child2, 20);
+  t1.join();
+  t2.join();
+  child1->endTransfer();
+  child2->endTransfer();
+  EXPECT_EQ(child1->getProgress() + child2->getProgress(),
+            parent->getProgress());
+}
+
 TEST(ThrottlerTest, FAIRNESS) {
   WdtOptions options;
   options.avg_mbytes_per_sec = 60;
@@ -90,5 +155,138 @@ TEST(ThrottlerTest, FAIRNESS) {
             << maxThroughput << ", fairness " << fairness;
   EXPECT_LT(fairness, 2.2);
 }
+
+TEST(ThrottlerTest, WEIGHTED_SHARES) {
+  using Share = BandwidthScheduler::Share;
+  // weighted shares, the part a transfer doesn't want goes to the others
+  auto rates = BandwidthScheduler::shareRate(100, {Share{1, -1}, Share{3, -1}});
+  EXPECT_NEAR(25, rates[0], 0.01);
+  EXPECT_NEAR(75, rates[1], 0.01);
+  rates = BandwidthScheduler::shareRate(
+      100, {Share{1, 10}, Share{1, -1}, Share{2, 60}});
+  EXPECT_NEAR(10, rates[0], 0.01);
+  EXPECT_NEAR(30, rates[1], 0.01);
+  EXPECT_NEAR(60, rates[2], 0.01);
+
+  WdtOptions options;
+  options.avg_mbytes_per_sec = 100;
+  auto parent = Throttler::makeThrottler(options.getThrottlerOptions());
+  const ThrottlerOptions transferOptions =
+      options.getTransferThrottlerOptions();
+  auto child1 = Throttler::makeThrottler(transferOptions, parent);
+  auto child2 = Throttler::makeThrottler(transferOptions, parent);
+  auto scheduler = std::make_shared<BandwidthScheduler>(parent, 0);
+  auto share1 = scheduler->addTransfer(child1, "a");
+  auto share2 = scheduler->addTransfer(child2, "b");
+  // an idle transfer gets nothing
+  child1->startTransfer();
+  scheduler->updateShares();
+  EXPECT_NEAR(100 * kMbToB, child1->getAvgRatePerSec(), 1);
+  child1->endTransfer();
+  scheduler->updateShares();
+  // the namespaces share by weight
+  scheduler->setGroupWeight("a", 3);
+  child1->startTransfer();
+  child2->startTransfer();
+  scheduler->updateShares();
+  EXPECT_NEAR(75 * kMbToB, child1->getAvgRatePerSec(), 1);
+  EXPECT_NEAR(25 * kMbToB, child2->getAvgRatePerSec(), 1);
+  child1->endTransfer();
+  child2->endTransfer();
+  share1.reset();
+  share2.reset();
+
+  // a transfer with 4 threads doesn't starve one with a single thread
+  options.avg_mbytes_per_sec = 60;
+  parent->setThrottlerRates(options.getThrottlerOptions());
+  child1 = Throttler::makeThrottler(transferOptions, parent);
+  child2 = Throttler::makeThrottler(transferOptions, parent);
+  scheduler = std::make_shared<BandwidthScheduler>(parent, 100);
+  share1 = scheduler->addTransfer(child1, "a");
+  share2 = scheduler->addTransfer(child2, "a");
+  child1->startTransfer();
+  child2->startTransfer();
+  std::atomic<int64_t> numTransferred1{0};
+  std::vector<std::thread> threads;
+  for (int i = 0; i < 4; i++) {
+    threads.emplace_back([&] {
+      auto startTime = Clock::now();
+      while (durationSeconds(Clock::now() - startTime) <= 3) {
+        child1->limit(1000);
+        numTransferred1 += 1000;
+      }
+    });
+  }
+  int64_t numTransferred2 = 0;
+  auto startTime = Clock::now();
+  while (durationSeconds(Clock::now() - startTime) <= 3) {
+    child2->limit(1000);
+    numTransferred2 += 1000;
+  }
+  for (auto &t : threads) {
+    t.join();
+  }
+  const double durationSecs = durationSeconds(Clock::now() - startTime);
+  EXPECT_NEAR(30, numTransferred1 / durationSecs / kMbToB, 3);
+  EXPECT_NEAR(30, numTransferred2 / durationSecs / kMbToB, 3);
+  child1->endTransfer();
+  child2->endTransfer();
+}
+TEST(ThrottlerTest, RATE_SCHEDULE) {
+  RateSchedule schedule;
+  RateSchedule::Window businessHours;
+  businessHours.startMinute = 9 * 60;
+  businessHours.endMinute = 17 * 60;
+  // monday to friday
+  businessHours.days = 0x3E;
+  businessHours.rates.avg_rate_per_sec = 30 * kMbToB;
+  RateSchedule::Window night;
+  night.startMinute = 22 * 60;
+  night.endMinute = 6 * 60;
+  night.days = 0x02;
+  night.rates.avg_rate_per_sec = 100 * kMbToB;
+  schedule.windows = {businessHours, night};
+  struct tm localTime = {};
+  // monday 10:00
+  localTime.tm_wday = 1;
+  localTime.tm_hour = 10;
+  EXPECT_EQ(0, schedule.findWindow(localTime));
+  // saturday 10:00
+  localTime.tm_wday = 6;
+  EXPECT_EQ(-1, schedule.findWindow(localTime));
+  EXPECT_EQ(-1, schedule.getRates(-1).avg_rate_per_sec);
+  // monday night, before and after midnight
+  localTime.tm_wday = 1;
+  localTime.tm_hour = 23;
+  EXPECT_EQ(1, schedule.findWindow(localTime));
+  localTime.tm_wday = 2;
+  localTime.tm_hour = 3;
+  EXPECT_EQ(1, schedule.findWindow(localTime));
+  // the night window only starts on mondays
+  localTime.tm_wday = 3;
+  EXPECT_EQ(-1, schedule.findWindow(localTime));
+
+  WdtOptions options;
+  options.avg_mbytes_per_sec = 50;
+  auto throttler = Throttler::makeThrottler(options.getThrottlerOptions());
+  throttler->startTransfer();
+  RateScheduler scheduler(throttler, 100);
+  RateSchedule allDay;
+  RateSchedule::Window window;
+  window.endMinute = 24 * 60;
+  window.rates.avg_rate_per_sec = 40 * kMbToB;
+  allDay.windows = {window};
+  scheduler.setSchedule(allDay);
+  EXPECT_NEAR(40 * kMbToB, throttler->getAvgRatePerSec(), 1);
+  testThrottling(throttler, 40);
+  // live update, kept till the next window
+  ThrottlerOptions rates;
+  rates.avg_rate_per_sec = 20 * kMbToB;
+  scheduler.setRates(rates);
+  std::this_thread::sleep_for(std::chrono::milliseconds(300));
+  EXPECT_NEAR(20 * kMbToB, throttler->getAvgRatePerSec(), 1);
+  testThrottling(throttler, 20);
+  throttler->endTransfer();
+}
 }
 }
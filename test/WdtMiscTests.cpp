@@ -8,8 +8,41 @@
  */
 
 #include <wdt/Wdt.h>
+#include <wdt/WdtThread.h>
 #include <wdt/test/TestCommon.h>
+#include <wdt/util/BackpressureMonitor.h>
+#include <wdt/util/BufferPool.h>
+#include <wdt/util/ClientSocket.h>
+#include <wdt/util/ConnectionScaler.h>
+#include <wdt/util/CryptoWorker.h>
+#include <wdt/util/DeltaResumption.h>
+#include <wdt/util/DiskWriterPool.h>
+#include <wdt/util/DurabilityQueue.h>
+#include <wdt/util/FdCache.h>
+#include <wdt/util/LatencyHistograms.h>
+#include <wdt/util/MemoryWriter.h>
+#include <wdt/util/PathArena.h>
+#include <wdt/util/ListenSocketPool.h>
+#include <wdt/util/Prefetcher.h>
+#include <wdt/util/RdmaTransport.h>
+#include <wdt/util/ReceiverRuntime.h>
+#include <wdt/util/SenderJournal.h>
+#include <wdt/util/ServerSocket.h>
+#include <wdt/util/ShmRing.h>
+#include <wdt/util/ShmTransport.h>
+#include <wdt/util/ThreadAffinity.h>
+#include <wdt/util/TransferLogManager.h>
+#include <wdt/util/TransferTracer.h>
+#include <wdt/util/WriteBehindController.h>
 
+#include <algorithm>
+#include <fcntl.h>
+#include <fstream>
+#include <map>
+#include <mutex>
+#include <sched.h>
+#include <sys/socket.h>
+#include <sys/stat.h>
 #include <thread>
 
 using namespace std;
@@ -96,6 +129,1522 @@ TEST(BasicTest, ThrottlerWithoutReporting) {
   EXPECT_GT(durationMs, 1900);
   EXPECT_LT(durationMs, 2200);
 }
+
+TEST(BasicTest, ThreadCpuList) {
+  std::vector<int> cpus;
+  EXPECT_TRUE(ThreadAffinity::parseCpuList("0-3,8,10-11", cpus));
+  EXPECT_EQ(std::vector<int>({0, 1, 2, 3, 8, 10, 11}), cpus);
+  EXPECT_TRUE(ThreadAffinity::parseCpuList("5,1-2,2", cpus));
+  EXPECT_EQ(std::vector<int>({1, 2, 5}), cpus);
+  EXPECT_FALSE(ThreadAffinity::parseCpuList("", cpus));
+  EXPECT_FALSE(ThreadAffinity::parseCpuList("3-1", cpus));
+  EXPECT_FALSE(ThreadAffinity::parseCpuList("1-a", cpus));
+  EXPECT_FALSE(ThreadAffinity::parseCpuList("1x", cpus));
+
+  // a cpu the test is allowed to run on, cpu 0 may not be
+  cpu_set_t allowed;
+  CPU_ZERO(&allowed);
+  ASSERT_EQ(0, sched_getaffinity(0, sizeof(allowed), &allowed));
+  int cpu = 0;
+  while (cpu < CPU_SETSIZE && !CPU_ISSET(cpu, &allowed)) {
+    cpu++;
+  }
+  ASSERT_LT(cpu, CPU_SETSIZE);
+  WdtOptions options;
+  options.thread_cpu_list = std::to_string(cpu);
+  ThreadAffinity affinity(options);
+  EXPECT_TRUE(affinity.isEnabled());
+  std::thread pinnedThread([&affinity, cpu]() {
+    EXPECT_TRUE(affinity.pinCurrentThread());
+    EXPECT_EQ(cpu, sched_getcpu());
+  });
+  pinnedThread.join();
+}
+
+TEST(BasicTest, DiskWriterPool) {
+  const int64_t kBufferSize = 4 * kDiskBlockSize;
+  char path[] = "/tmp/wdtDiskWriterPoolXXXXXX";
+  const int fd = mkstemp(path);
+  ASSERT_GE(fd, 0);
+  unlink(path);
+  {
+    // room for 2 buffers only, one writer per device
+    DiskWriterPool pool(2, kBufferSize, 2 * kBufferSize + 1, 1);
+    EXPECT_EQ(kBufferSize, pool.getBufferSize());
+    EXPECT_TRUE(pool.isPerDevice());
+    std::atomic<bool> abort{false};
+    WdtAbortChecker abortChecker(abort);
+    const int kNumWrites = 8;
+    std::vector<DiskWriterPool::Write> writes(kNumWrites);
+    for (int i = 0; i < kNumWrites; i++) {
+      char *data = pool.getBuffer(&abortChecker);
+      ASSERT_TRUE(data != nullptr);
+      memset(data, 'a' + i, kBufferSize);
+      writes[i].fd = fd;
+      writes[i].data = data;
+      writes[i].size = kBufferSize;
+      // written in reverse order
+      writes[i].offset = (kNumWrites - 1 - i) * kBufferSize;
+      // spread over two devices, and one of unknown device
+      writes[i].deviceId = (i % 3) - 1;
+      writes[i].computeChecksum = (i % 2 == 0);
+      pool.submit(&writes[i]);
+    }
+    for (int i = 0; i < kNumWrites; i++) {
+      DiskWriterPool::Write &write = writes[i];
+      pool.wait(&write);
+      EXPECT_TRUE(pool.isDone(&write));
+      EXPECT_EQ(kBufferSize, write.result);
+      if (write.computeChecksum) {
+        const std::string data(kBufferSize, 'a' + i);
+        BlockChecksum checksum(CHECKSUM_CRC32C);
+        checksum.update(data.data(), data.size());
+        EXPECT_EQ(checksum.getValue(), write.checksum);
+      }
+    }
+    // cap is hit while both buffers are held
+    char *first = pool.getBuffer(&abortChecker);
+    char *second = pool.getBuffer(&abortChecker);
+    EXPECT_TRUE(first != nullptr && second != nullptr);
+    abort = true;
+    EXPECT_TRUE(pool.getBuffer(&abortChecker) == nullptr);
+    pool.releaseBuffer(first);
+    EXPECT_EQ(first, pool.getBuffer(&abortChecker));
+    pool.releaseBuffer(first);
+    pool.releaseBuffer(second);
+  }
+  std::vector<char> content(kBufferSize);
+  for (int i = 0; i < 8; i++) {
+    EXPECT_EQ(kBufferSize,
+              pread(fd, content.data(), kBufferSize, i * kBufferSize));
+    EXPECT_EQ(std::string(kBufferSize, 'a' + 7 - i),
+              std::string(content.begin(), content.end()));
+  }
+  close(fd);
+}
+
+TEST(BasicTest, DiskWriterPoolDeviceLimit) {
+  const int64_t kBufferSize = 256 * kDiskBlockSize;
+  char path[] = "/tmp/wdtDiskWriterPoolXXXXXX";
+  const int fd = mkstemp(path);
+  ASSERT_GE(fd, 0);
+  unlink(path);
+  for (int limit = 1; limit <= 2; limit++) {
+    // more threads than the writers allowed on the two devices
+    DiskWriterPool pool(8, kBufferSize, 16 * kBufferSize, limit);
+    std::atomic<bool> abort{false};
+    WdtAbortChecker abortChecker(abort);
+    const int kNumWrites = 64;
+    std::vector<DiskWriterPool::Write> writes(kNumWrites);
+    for (int i = 0; i < kNumWrites; i++) {
+      char *data = pool.getBuffer(&abortChecker);
+      ASSERT_TRUE(data != nullptr);
+      memset(data, 'a', kBufferSize);
+      writes[i].fd = fd;
+      writes[i].data = data;
+      writes[i].size = kBufferSize;
+      writes[i].offset = (i % 16) * kBufferSize;
+      writes[i].deviceId = i % 2;
+      writes[i].computeChecksum = true;
+      pool.submit(&writes[i]);
+    }
+    for (auto &write : writes) {
+      pool.wait(&write);
+      EXPECT_EQ(kBufferSize, write.result);
+    }
+    EXPECT_GE(pool.getPeakDeviceWriters(), 1);
+    EXPECT_LE(pool.getPeakDeviceWriters(), limit);
+  }
+  close(fd);
+}
+
+TEST(BasicTest, DurabilityQueue) {
+  WdtOptions options;
+  options.fsync = true;
+  TransferLogManager transferLogManager(options, "/tmp");
+  DurabilityQueue durabilityQueue(options, transferLogManager);
+  const int kNumFiles = DurabilityQueue::kSyncfsBatchSize + 4;
+  std::vector<int> fds;
+  for (int i = 0; i < kNumFiles; i++) {
+    char path[] = "/tmp/wdtDurabilityQueueXXXXXX";
+    const int fd = mkstemp(path);
+    ASSERT_GE(fd, 0);
+    unlink(path);
+    EXPECT_EQ(1, write(fd, "x", 1));
+    BlockDetails blockDetails;
+    blockDetails.seqId = i;
+    blockDetails.dataSize = 1;
+    durabilityQueue.add(fd, blockDetails);
+    fds.push_back(fd);
+  }
+  EXPECT_TRUE(durabilityQueue.drain(-1));
+  EXPECT_FALSE(durabilityQueue.hasFailed());
+  for (int fd : fds) {
+    // closed by the queue
+    EXPECT_EQ(-1, fcntl(fd, F_GETFD));
+  }
+  BlockDetails badBlock;
+  durabilityQueue.add(-1, badBlock);
+  EXPECT_TRUE(durabilityQueue.drain(-1));
+  EXPECT_TRUE(durabilityQueue.hasFailed());
+  durabilityQueue.reset();
+  EXPECT_FALSE(durabilityQueue.hasFailed());
+}
+
+TEST(BasicTest, WriteBehindController) {
+  WdtOptions options;
+  options.write_behind_target_millis = 10;
+  options.write_behind_max_window_mb = 4;
+  WriteBehindController writeBehind(options);
+  EXPECT_GE(writeBehind.getWindowSize(), WriteBehindController::kMinWindow);
+  EXPECT_LE(writeBehind.getWindowSize(), 4 * 1024 * 1024);
+  const int kNumFiles = 4;
+  const int64_t kWriteSize = 64 * 1024;
+  const int kNumWrites = 64;
+  std::vector<char> data(kWriteSize, 'w');
+  std::vector<int> fds;
+  std::vector<int64_t> fileIds;
+  for (int i = 0; i < kNumFiles; i++) {
+    char path[] = "/tmp/wdtWriteBehindXXXXXX";
+    const int fd = mkstemp(path);
+    ASSERT_GE(fd, 0);
+    unlink(path);
+    fds.push_back(fd);
+    fileIds.push_back(writeBehind.addFile(fd, 0));
+  }
+  for (int w = 0; w < kNumWrites; w++) {
+    for (int i = 0; i < kNumFiles; i++) {
+      ASSERT_EQ(kWriteSize, write(fds[i], data.data(), kWriteSize));
+      writeBehind.recordWrite(fileIds[i], kWriteSize);
+    }
+  }
+  // lets the flush thread take some of the windows
+  std::this_thread::sleep_for(std::chrono::milliseconds(50));
+  for (int i = 0; i < kNumFiles; i++) {
+    EXPECT_TRUE(writeBehind.removeFile(fileIds[i]));
+    // unknown once removed
+    writeBehind.recordWrite(fileIds[i], kWriteSize);
+    EXPECT_TRUE(writeBehind.removeFile(fileIds[i]));
+    close(fds[i]);
+  }
+  EXPECT_GE(writeBehind.getWindowSize(), WriteBehindController::kMinWindow);
+  EXPECT_LE(writeBehind.getWindowSize(), 4 * 1024 * 1024);
+}
+
+TEST(BasicTest, MappedTransferLog) {
+  TemporaryDirectory tmpDir;
+  WdtOptions options;
+  options.enable_download_resumption = true;
+  options.transfer_log_mmap = true;
+  options.transfer_log_write_interval_ms = 1;
+  // grown many times
+  options.transfer_log_preallocation_size = 4096;
+  const int kNumThreads = 4;
+  const int kNumFiles = 10;
+  const int kNumBlocks = 100;
+  for (int i = 0; i < kNumThreads * kNumFiles; i++) {
+    const std::string path = tmpDir.dir() + "/file" + std::to_string(i);
+    const int fd = open(path.c_str(), O_CREAT | O_WRONLY, 0644);
+    ASSERT_GE(fd, 0);
+    EXPECT_EQ(0, ftruncate(fd, kNumBlocks));
+    close(fd);
+  }
+  {
+    TransferLogManager transferLog(options, tmpDir.dir());
+    ASSERT_EQ(OK, transferLog.openLog());
+    std::vector<FileChunksInfo> chunks;
+    EXPECT_EQ(OK, transferLog.parseAndMatch("id", 0, chunks));
+    ASSERT_EQ(OK, transferLog.startThread());
+    EXPECT_TRUE(transferLog.verifySenderIp("::1"));
+    transferLog.writeLogHeader();
+    std::vector<std::thread> threads;
+    for (int t = 0; t < kNumThreads; t++) {
+      threads.emplace_back([&, t] {
+        for (int i = t * kNumFiles; i < (t + 1) * kNumFiles; i++) {
+          transferLog.addFileCreationEntry("file" + std::to_string(i), i,
+                                           kNumBlocks);
+          for (int b = 0; b < kNumBlocks; b++) {
+            transferLog.addBlockWriteEntry(i, b, 1);
+          }
+        }
+      });
+    }
+    for (auto &thread : threads) {
+      thread.join();
+    }
+    transferLog.closeLog();
+  }
+  // space preallocated and left behind by a crash is ignored
+  const std::string logPath = tmpDir.dir() + "/" + kWdtLogName;
+  struct stat logStat;
+  ASSERT_EQ(0, stat(logPath.c_str(), &logStat));
+  const int64_t logSize = logStat.st_size;
+  ASSERT_EQ(0, truncate(logPath.c_str(), logSize + 4096));
+  options.transfer_log_mmap = false;
+  TransferLogManager transferLog(options, tmpDir.dir());
+  ASSERT_EQ(OK, transferLog.openLog());
+  std::vector<FileChunksInfo> chunks;
+  EXPECT_EQ(OK, transferLog.parseAndMatch("id", 0, chunks));
+  EXPECT_EQ(kNumThreads * kNumFiles, chunks.size());
+  for (const auto &chunk : chunks) {
+    EXPECT_EQ(kNumBlocks, chunk.getTotalChunkSize());
+  }
+  transferLog.closeLog();
+  ASSERT_EQ(0, stat(logPath.c_str(), &logStat));
+  EXPECT_EQ(logSize, logStat.st_size);
+}
+
+TEST(BasicTest, TransferLogParse) {
+  TemporaryDirectory tmpDir;
+  WdtOptions options;
+  options.enable_download_resumption = true;
+  options.transfer_log_parse_threads = 4;
+  // the entries span many segments stat-ed in parallel
+  const int kNumFiles = 4000;
+  const int kNumBlocks = 10;
+  for (int i = 0; i < kNumFiles; i++) {
+    const std::string path = tmpDir.dir() + "/file" + std::to_string(i);
+    const int fd = open(path.c_str(), O_CREAT | O_WRONLY, 0644);
+    ASSERT_GE(fd, 0);
+    EXPECT_EQ(0, ftruncate(fd, kNumBlocks));
+    close(fd);
+  }
+  {
+    TransferLogManager transferLog(options, tmpDir.dir());
+    ASSERT_EQ(OK, transferLog.openLog());
+    std::vector<FileChunksInfo> chunks;
+    EXPECT_EQ(OK, transferLog.parseAndMatch("id", 0, chunks));
+    ASSERT_EQ(OK, transferLog.startThread());
+    EXPECT_TRUE(transferLog.verifySenderIp("::1"));
+    transferLog.writeLogHeader();
+    for (int i = 0; i < kNumFiles; i++) {
+      transferLog.addFileCreationEntry("file" + std::to_string(i), i,
+                                       kNumBlocks);
+      for (int b = 0; b < kNumBlocks; b++) {
+        transferLog.addBlockWriteEntry(i, b, 1);
+      }
+    }
+    transferLog.closeLog();
+  }
+  // a file removed since, and an entry partially written at the end
+  EXPECT_EQ(0, unlink((tmpDir.dir() + "/file0").c_str()));
+  const std::string logPath = tmpDir.dir() + "/" + kWdtLogName;
+  const int logFd = open(logPath.c_str(), O_WRONLY | O_APPEND);
+  ASSERT_GE(logFd, 0);
+  const char partialEntry[] = {20, 0, TransferLogManager::BLOCK_WRITE};
+  EXPECT_EQ(sizeof(partialEntry),
+            write(logFd, partialEntry, sizeof(partialEntry)));
+  close(logFd);
+  for (int i = 0; i < 2; i++) {
+    // the first parse fixes the log, the second parses the fixed log
+    TransferLogManager transferLog(options, tmpDir.dir());
+    ASSERT_EQ(OK, transferLog.openLog());
+    std::vector<FileChunksInfo> chunks;
+    EXPECT_EQ(OK, transferLog.parseAndMatch("id", 0, chunks));
+    EXPECT_EQ(kNumFiles - 1, chunks.size());
+    for (const auto &chunk : chunks) {
+      EXPECT_NE(0, chunk.getSeqId());
+      EXPECT_EQ(kNumBlocks, chunk.getTotalChunkSize());
+    }
+    transferLog.closeLog();
+  }
+}
+
+TEST(BasicTest, TransferLogBlockChecksum) {
+  LogEncoderDecoder encoderDecoder;
+  char buf[TransferLogManager::kMaxEntryLength];
+  int64_t timestamp, seqId, offset, blockSize, checksum;
+  ChecksumType checksumType;
+  // entries without a checksum are as before
+  int64_t size = encoderDecoder.encodeBlockWriteEntry(buf, sizeof(buf), 3, 10,
+                                                      20);
+  ASSERT_GT(size, 0);
+  EXPECT_TRUE(encoderDecoder.decodeBlockWriteEntry(
+      buf + 3, size - 3, timestamp, seqId, offset, blockSize, checksumType,
+      checksum));
+  EXPECT_EQ(3, seqId);
+  EXPECT_EQ(10, offset);
+  EXPECT_EQ(20, blockSize);
+  EXPECT_EQ(NUM_CHECKSUM_TYPES, checksumType);
+  for (int64_t value : {(int64_t)0, (int64_t)-1234567, INT64_MIN}) {
+    size = encoderDecoder.encodeBlockWriteEntry(
+        buf, sizeof(buf), 3, 10, 20, CHECKSUM_CRC32C, value);
+    ASSERT_GT(size, 0);
+    EXPECT_TRUE(encoderDecoder.decodeBlockWriteEntry(
+        buf + 3, size - 3, timestamp, seqId, offset, blockSize, checksumType,
+        checksum));
+    EXPECT_EQ(20, blockSize);
+    EXPECT_EQ(CHECKSUM_CRC32C, checksumType);
+    EXPECT_EQ(value, checksum);
+  }
+}
+
+TEST(BasicTest, TransferLogOnlineCompaction) {
+  const int kNumFiles = 4;
+  const int kNumBlocks = 8000;
+  for (bool useMmap : {false, true}) {
+    TemporaryDirectory tmpDir;
+    WdtOptions options;
+    options.enable_download_resumption = true;
+    options.transfer_log_mmap = useMmap;
+    options.transfer_log_compaction_interval_ms = 1;
+    for (int i = 0; i < kNumFiles; i++) {
+      const std::string path = tmpDir.dir() + "/file" + std::to_string(i);
+      const int fd = open(path.c_str(), O_CREAT | O_WRONLY, 0644);
+      ASSERT_GE(fd, 0);
+      EXPECT_EQ(0, ftruncate(fd, 2 * kNumBlocks));
+      close(fd);
+    }
+    {
+      TransferLogManager transferLog(options, tmpDir.dir());
+      ASSERT_EQ(OK, transferLog.openLog());
+      std::vector<FileChunksInfo> chunks;
+      EXPECT_EQ(OK, transferLog.parseAndMatch("id", 0, chunks));
+      ASSERT_EQ(OK, transferLog.startThread());
+      EXPECT_TRUE(transferLog.verifySenderIp("::1"));
+      transferLog.writeLogHeader();
+      for (int i = 0; i < kNumFiles; i++) {
+        transferLog.addFileCreationEntry("file" + std::to_string(i), i,
+                                         2 * kNumBlocks);
+      }
+      // the second round of blocks is written after the first is compacted
+      for (int round = 0; round < 2; round++) {
+        for (int b = 0; b < kNumBlocks; b++) {
+          for (int i = 0; i < kNumFiles; i++) {
+            transferLog.addBlockWriteEntry(i, round * kNumBlocks + b, 1);
+          }
+        }
+        /* sleep override */
+        std::this_thread::sleep_for(std::chrono::milliseconds(200));
+      }
+      transferLog.closeLog();
+    }
+    struct stat logStat;
+    ASSERT_EQ(0, stat((tmpDir.dir() + "/" + kWdtLogName).c_str(), &logStat));
+    // much less than an entry per block
+    EXPECT_LT(logStat.st_size, kNumFiles * kNumBlocks);
+    EXPECT_NE(0, access((tmpDir.dir() + "/" + kWdtCompactedLogName).c_str(),
+                        F_OK));
+    TransferLogManager transferLog(options, tmpDir.dir());
+    ASSERT_EQ(OK, transferLog.openLog());
+    std::vector<FileChunksInfo> chunks;
+    EXPECT_EQ(OK, transferLog.parseAndMatch("id", 0, chunks));
+    EXPECT_EQ(kNumFiles, chunks.size());
+    for (const auto &chunk : chunks) {
+      EXPECT_EQ(1, chunk.getChunks().size());
+      EXPECT_EQ(2 * kNumBlocks, chunk.getTotalChunkSize());
+    }
+    transferLog.closeLog();
+  }
+}
+
+TEST(BasicTest, DeltaResumption) {
+  TemporaryDirectory tmpDir;
+  const int64_t kBlockSize = 16;
+  // more blocks than an entry of the chunks list holds
+  const int64_t kFileSize =
+      (DeltaResumption::kMaxHashesPerEntry + 500) * kBlockSize + 5;
+  std::string content(kFileSize, 0);
+  for (int64_t i = 0; i < kFileSize; i++) {
+    content[i] = 'a' + i % 23;
+  }
+  const std::string receiverPath = tmpDir.dir() + "/file";
+  const std::string senderPath = tmpDir.dir() + "/sender";
+  auto writeFile = [](const std::string &path, const std::string &data) {
+    const int fd = open(path.c_str(), O_CREAT | O_TRUNC | O_WRONLY, 0644);
+    ASSERT_GE(fd, 0);
+    EXPECT_EQ(data.size(), write(fd, data.data(), data.size()));
+    close(fd);
+  };
+  writeFile(receiverPath, content);
+  // the sender modified the 4th block, and appended to the file
+  content[3 * kBlockSize + 1] = 'Z';
+  content.append(100, 'z');
+  writeFile(senderPath, content);
+
+  std::vector<FileChunksInfo> fileChunksInfo;
+  std::string fileName = "file";
+  fileChunksInfo.emplace_back(1, fileName, kFileSize);
+  fileChunksInfo.back().addChunk(Interval(0, kFileSize));
+  std::atomic<bool> abort{false};
+  WdtAbortChecker abortChecker(abort);
+  DeltaReadOptions readOptions;
+  readOptions.numThreads = 2;
+  DeltaResumption::hashReceivedFiles(tmpDir.dir(), kBlockSize, readOptions,
+                                     &abortChecker, fileChunksInfo);
+  ASSERT_EQ(2, fileChunksInfo.size());
+  EXPECT_EQ(1, fileChunksInfo[0].getChunks().size());
+  EXPECT_EQ(DeltaResumption::kMaxHashesPerEntry,
+            fileChunksInfo[0].getNumBlockHashes());
+  EXPECT_TRUE(fileChunksInfo[1].getChunks().empty());
+  FileChunksInfo received = std::move(fileChunksInfo[0]);
+  EXPECT_TRUE(received.appendBlockHashes(fileChunksInfo[1]));
+  EXPECT_EQ((kFileSize + kBlockSize - 1) / kBlockSize,
+            received.getNumBlockHashes());
+
+  // the ranges found by the threads are merged, the unaligned blocks are
+  // read buffered even with direct reads
+  for (int numThreads : {1, 3}) {
+    readOptions.numThreads = numThreads;
+    readOptions.directReads = (numThreads > 1);
+    readOptions.dropCache = true;
+    std::vector<Interval> unchanged;
+    EXPECT_TRUE(DeltaResumption::findUnchangedBlocks(
+        senderPath, content.size(), received, readOptions, &abortChecker,
+        unchanged));
+    ASSERT_EQ(2, unchanged.size());
+    EXPECT_EQ(0, unchanged[0].start_);
+    EXPECT_EQ(3 * kBlockSize, unchanged[0].end_);
+    EXPECT_EQ(4 * kBlockSize, unchanged[1].start_);
+    EXPECT_EQ(kFileSize, unchanged[1].end_);
+  }
+}
+
+TEST(BasicTest, FdCache) {
+  std::vector<int> fds;
+  for (int i = 0; i < 4; i++) {
+    const int fd = open("/dev/null", O_WRONLY);
+    ASSERT_GE(fd, 0);
+    fds.push_back(fd);
+  }
+  {
+    FdCache fdCache(2);
+    fdCache.put(1, fds[0]);
+    fdCache.put(2, fds[1]);
+    // 1 becomes the most recently used
+    EXPECT_EQ(fds[0], fdCache.take(1));
+    EXPECT_EQ(-1, fdCache.take(1));
+    fdCache.put(1, fds[0]);
+    // evicts 2
+    fdCache.put(3, fds[2]);
+    EXPECT_EQ(2, fdCache.size());
+    EXPECT_EQ(-1, fdCache.take(2));
+    EXPECT_EQ(-1, fcntl(fds[1], F_GETFD));
+    // replaces the fd cached for 3
+    fdCache.put(3, fds[3]);
+    EXPECT_EQ(-1, fcntl(fds[2], F_GETFD));
+    fdCache.erase(1);
+    EXPECT_EQ(-1, fcntl(fds[0], F_GETFD));
+    EXPECT_EQ(1, fdCache.size());
+    EXPECT_NE(-1, fcntl(fds[3], F_GETFD));
+  }
+  EXPECT_EQ(-1, fcntl(fds[3], F_GETFD));
+}
+
+TEST(BasicTest, ConnectionScaler) {
+  WdtOptions options;
+  options.auto_scale_min_connections = 2;
+  options.auto_scale_interval_millis = 1000;
+  options.auto_scale_lan_rtt_micros = 2000;
+  const auto start = Clock::now();
+  const auto at = [&start](int secs) {
+    return start + std::chrono::seconds(secs);
+  };
+  const int64_t kMb = 1024 * 1024;
+  {
+    // long haul: connections are added while the throughput increases
+    ConnectionScaler scaler(options, 4);
+    EXPECT_EQ(2, scaler.getNumActive());
+    EXPECT_FALSE(scaler.waitForTurn(2, 0));
+    scaler.reportProgress(0, 0, 50000, at(0));
+    scaler.reportProgress(0, 100 * kMb, 50000, at(1));
+    EXPECT_EQ(3, scaler.getNumActive());
+    EXPECT_TRUE(scaler.waitForTurn(2, 0));
+    EXPECT_TRUE(scaler.isActive(2));
+    scaler.reportProgress(0, 250 * kMb, 50000, at(2));
+    EXPECT_EQ(4, scaler.getNumActive());
+    // the last connection did not pay off and is retired
+    scaler.reportProgress(0, 400 * kMb, 50000, at(3));
+    EXPECT_TRUE(scaler.shouldRetire(3));
+    EXPECT_FALSE(scaler.shouldRetire(2));
+    EXPECT_EQ(3, scaler.getNumActive());
+    scaler.reportProgress(0, 1000 * kMb, 50000, at(5));
+    EXPECT_EQ(3, scaler.getNumActive());
+  }
+  {
+    // local: stays at the min number of connections
+    ConnectionScaler scaler(options, 4);
+    scaler.reportProgress(0, 0, 100, at(0));
+    scaler.reportProgress(0, 100 * kMb, 100, at(1));
+    scaler.reportProgress(1, 100 * kMb, 100, at(2));
+    EXPECT_EQ(2, scaler.getNumActive());
+    EXPECT_FALSE(scaler.shouldRetire(0));
+    // parked threads are not needed anymore
+    scaler.finish();
+    EXPECT_TRUE(scaler.waitForTurn(3, 0));
+    EXPECT_FALSE(scaler.isActive(3));
+  }
+  {
+    // a parked thread replaces an active one ending early
+    ConnectionScaler scaler(options, 3);
+    scaler.threadDone(0);
+    EXPECT_TRUE(scaler.isActive(2));
+    EXPECT_EQ(2, scaler.getNumActive());
+  }
+}
+
+TEST(BasicTest, CryptoWorker) {
+  CryptoWorker worker(100);
+  string data(1050, 'a');
+  string chunks;
+  // chunks are processed in submission order, on the worker thread
+  worker.begin([&](char *buf, int len) {
+    EXPECT_LE(len, 100);
+    chunks += string(buf, len);
+    memset(buf, 'b', len);
+    return true;
+  });
+  worker.submit(&data[0], 1000);
+  worker.submit(&data[1000], 50);
+  int64_t ready = worker.waitFor(250);
+  EXPECT_GE(ready, 250);
+  EXPECT_EQ(string(250, 'b'), data.substr(0, 250));
+  EXPECT_TRUE(worker.end());
+  EXPECT_EQ(string(1050, 'b'), data);
+  EXPECT_EQ(string(1050, 'a'), chunks);
+  // a failure stops the processing of the session
+  int numCalls = 0;
+  worker.begin([&](char *, int) { return ++numCalls < 2; });
+  worker.submit(&data[0], 1000);
+  EXPECT_EQ(-1, worker.waitFor(1000));
+  EXPECT_FALSE(worker.end());
+  EXPECT_EQ(2, numCalls);
+  // the worker can be reused
+  worker.begin([](char *, int) { return true; });
+  worker.submit(&data[0], 10);
+  EXPECT_EQ(10, worker.waitFor(10));
+  EXPECT_TRUE(worker.end());
+}
+
+namespace {
+/// waits for a fd to be readable, or for a timeout, in slices
+class TestRuntimeTask : public RuntimeTask {
+ public:
+  TestRuntimeTask(int fd, int timeoutMillis)
+      : fd_(fd), timeoutMillis_(timeoutMillis) {
+  }
+  bool runSlice(Wait &wait) override {
+    ++numSlices_;
+    if (numSlices_ > 1) {
+      return true;
+    }
+    if (fd_ >= 0) {
+      wait.fds.push_back(fd_);
+    }
+    wait.timeoutMillis = timeoutMillis_;
+    return false;
+  }
+  int numSlices_{0};
+
+ private:
+  const int fd_;
+  const int timeoutMillis_;
+};
+}
+
+TEST(BasicTest, ReceiverRuntime) {
+  ReceiverRuntime runtime(2);
+  ASSERT_TRUE(runtime.isValid());
+  int fds[2];
+  ASSERT_EQ(0, pipe(fds));
+  // a task waiting on a fd is run again once the fd is readable, well
+  // before its timeout
+  TestRuntimeTask fdTask(fds[0], 60000);
+  TestRuntimeTask timerTask(-1, 50);
+  auto startTime = Clock::now();
+  runtime.start(&fdTask);
+  runtime.start(&timerTask);
+  runtime.waitForEnd(&timerTask);
+  EXPECT_GE(durationMillis(Clock::now() - startTime), 50);
+  EXPECT_EQ(2, timerTask.numSlices_);
+  EXPECT_EQ(1, fdTask.numSlices_);
+  ASSERT_EQ(1, write(fds[1], "x", 1));
+  runtime.waitForEnd(&fdTask);
+  EXPECT_EQ(2, fdTask.numSlices_);
+  EXPECT_LT(durationMillis(Clock::now() - startTime), 60000);
+  close(fds[0]);
+  close(fds[1]);
+}
+
+namespace {
+/// waits for a fd to be writable, then runs busy slices yielding in between
+class YieldRuntimeTask : public RuntimeTask {
+ public:
+  YieldRuntimeTask(char id, int fd, std::mutex &mutex, std::string &slices)
+      : id_(id), fd_(fd), mutex_(mutex), slices_(slices) {
+  }
+  bool runSlice(Wait &wait) override {
+    if (numSlices_++ == 0) {
+      wait.writeFds.push_back(fd_);
+      wait.timeoutMillis = 60000;
+      return false;
+    }
+    {
+      std::lock_guard<std::mutex> lock(mutex_);
+      slices_.push_back(id_);
+    }
+    /* sleep override */
+    std::this_thread::sleep_for(std::chrono::milliseconds(10));
+    return numSlices_ > 5;
+  }
+
+ private:
+  const char id_;
+  const int fd_;
+  int numSlices_{0};
+  std::mutex &mutex_;
+  std::string &slices_;
+};
+}
+
+TEST(BasicTest, ReceiverRuntimeYield) {
+  ReceiverRuntime runtime(1);
+  ASSERT_TRUE(runtime.isValid());
+  int fds[2];
+  ASSERT_EQ(0, pipe(fds));
+  std::mutex mutex;
+  std::string slices;
+  YieldRuntimeTask taskA('a', fds[1], mutex, slices);
+  YieldRuntimeTask taskB('b', fds[1], mutex, slices);
+  auto startTime = Clock::now();
+  runtime.start(&taskA);
+  runtime.start(&taskB);
+  runtime.waitForEnd(&taskA);
+  runtime.waitForEnd(&taskB);
+  // the pipe is writable right away
+  EXPECT_LT(durationMillis(Clock::now() - startTime), 60000);
+  // a single thread takes turns between the tasks which yield
+  ASSERT_EQ(10, slices.size());
+  int numSwitches = 0;
+  for (size_t i = 1; i < slices.size(); i++) {
+    numSwitches += (slices[i] != slices[i - 1]);
+  }
+  EXPECT_GE(numSwitches, 4);
+  close(fds[0]);
+  close(fds[1]);
+}
+
+namespace {
+/// runs a few busy slices, counting the slices of its group running at once
+class GroupRuntimeTask : public RuntimeTask {
+ public:
+  GroupRuntimeTask(std::atomic<int> &numRunning, std::atomic<int> &maxRunning)
+      : numRunning_(numRunning), maxRunning_(maxRunning) {
+  }
+  bool runSlice(Wait &wait) override {
+    int running = ++numRunning_;
+    int current = maxRunning_.load();
+    while (running > current &&
+           !maxRunning_.compare_exchange_weak(current, running)) {
+    }
+    /* sleep override */
+    std::this_thread::sleep_for(std::chrono::milliseconds(20));
+    --numRunning_;
+    endTime_ = Clock::now();
+    wait.timeoutMillis = 0;
+    return ++numSlices_ >= 3;
+  }
+  Clock::time_point endTime_;
+
+ private:
+  std::atomic<int> &numRunning_;
+  std::atomic<int> &maxRunning_;
+  int numSlices_{0};
+};
+}
+
+TEST(BasicTest, ReceiverRuntimeGroupLimit) {
+  ReceiverRuntime runtime(4);
+  ASSERT_TRUE(runtime.isValid());
+  runtime.setGroupLimit("a", 1);
+  std::atomic<int> numRunningA{0}, maxRunningA{0};
+  std::atomic<int> numRunningB{0}, maxRunningB{0};
+  std::vector<std::unique_ptr<GroupRuntimeTask>> tasksA;
+  for (int i = 0; i < 4; i++) {
+    tasksA.emplace_back(new GroupRuntimeTask(numRunningA, maxRunningA));
+    runtime.start(tasksA.back().get(), "a");
+  }
+  GroupRuntimeTask taskB(numRunningB, maxRunningB);
+  runtime.start(&taskB, "b");
+  for (auto &task : tasksA) {
+    runtime.waitForEnd(task.get());
+  }
+  runtime.waitForEnd(&taskB);
+  // the slices of "a" run one at a time, "b" runs on the other threads
+  // meanwhile instead of waiting for "a" to be done
+  EXPECT_EQ(1, maxRunningA.load());
+  Clock::time_point endTimeA;
+  for (auto &task : tasksA) {
+    endTimeA = std::max(endTimeA, task->endTime_);
+  }
+  EXPECT_TRUE(taskB.endTime_ < endTimeA);
+}
+
+TEST(BasicTest, ListenSocketPool) {
+  TemporaryDirectory tmpDir;
+  std::vector<int32_t> ports;
+  {
+    Receiver receiver(0, 2, tmpDir.dir());
+    receiver.getWdtOptions().listen_socket_pool_size = 2;
+    WdtTransferRequest req = receiver.init();
+    ASSERT_EQ(OK, req.errorCode);
+    ports = req.ports;
+  }
+  // the ports are kept listening once the receiver is gone
+  EXPECT_EQ(2, ListenSocketPool::get().size());
+  Receiver receiver(0, 2, tmpDir.dir());
+  receiver.getWdtOptions().listen_socket_pool_size = 2;
+  WdtTransferRequest req = receiver.init();
+  ASSERT_EQ(OK, req.errorCode);
+  EXPECT_EQ(0, ListenSocketPool::get().size());
+  std::sort(ports.begin(), ports.end());
+  std::sort(req.ports.begin(), req.ports.end());
+  EXPECT_EQ(ports, req.ports);
+}
+
+TEST(BasicTest, BufferPool) {
+  const int64_t kSize = 64 * 1024;
+  BufferPool &pool = BufferPool::get();
+  pool.clear();
+  WdtOptions options;
+  options.buffer_size = kSize;
+  options.buffer_pool_max_mbytes = 1;
+  char *data = nullptr;
+  {
+    ThreadCtx threadCtx(options, /* allocate buffer */ true);
+    ASSERT_TRUE(threadCtx.getBuffer()->getData() != nullptr);
+    data = threadCtx.getBuffer()->getData();
+    EXPECT_EQ(kSize, pool.getNumBytesInUse());
+  }
+  // the buffer of a thread done is reused by the next one
+  EXPECT_EQ(kSize, pool.getNumFreeBytes());
+  {
+    ThreadCtx threadCtx(options, /* allocate buffer */ true);
+    EXPECT_EQ(data, threadCtx.getBuffer()->getData());
+    EXPECT_EQ(0, pool.getNumFreeBytes());
+  }
+  // buffers are only reused for the same size and placement
+  auto buffer = pool.acquire(kSize, /* numa node */ 0, false, kMbToB);
+  EXPECT_TRUE(buffer->getData() != data);
+  EXPECT_EQ(kSize, pool.getNumFreeBytes());
+  // the ones not fitting in the cap are freed
+  std::vector<std::unique_ptr<Buffer>> buffers;
+  for (int i = 0; i < 16; i++) {
+    buffers.push_back(pool.acquire(kSize, -1, false, kMbToB));
+  }
+  EXPECT_EQ(0, pool.getNumFreeBytes());
+  EXPECT_EQ(17 * kSize, pool.getNumBytesInUse());
+  for (auto &pooled : buffers) {
+    pool.release(std::move(pooled), kMbToB);
+  }
+  pool.release(std::move(buffer), kMbToB);
+  EXPECT_EQ(kMbToB, pool.getNumFreeBytes());
+  EXPECT_EQ(0, pool.getNumBytesInUse());
+  // reservations are capped, and given back when destroyed
+  auto reservation = pool.reserve(kMbToB / 2, kMbToB);
+  ASSERT_TRUE(reservation != nullptr);
+  EXPECT_TRUE(pool.reserve(kMbToB, kMbToB) == nullptr);
+  reservation.reset();
+  EXPECT_EQ(0, pool.getNumBytesReserved());
+  EXPECT_TRUE(pool.reserve(kMbToB, kMbToB) != nullptr);
+  pool.clear();
+  EXPECT_EQ(0, pool.getNumFreeBytes());
+}
+
+TEST(BasicTest, HugePageBuffer) {
+  const int64_t kSize = 4 * 1024 * 1024;
+  WdtOptions options;
+  options.buffer_size = kSize;
+  options.buffer_huge_pages = true;
+  // huge pages are used if the machine has some, the buffer is allocated
+  // either way
+  ThreadCtx threadCtx(options, /* allocate buffer */ true);
+  const Buffer *buffer = threadCtx.getBuffer();
+  ASSERT_TRUE(buffer->getData() != nullptr);
+  EXPECT_TRUE(buffer->isAligned());
+  EXPECT_TRUE(buffer->isOnHugePages());
+  EXPECT_EQ(0, (int64_t)buffer->getData() % (2 * 1024 * 1024));
+  EXPECT_GE(buffer->getNumHugePageBytes(), 0);
+  EXPECT_LE(buffer->getNumHugePageBytes(), kSize);
+  memset(buffer->getData(), 'a', kSize);
+  // and the perf stats tell how many bytes are on huge pages
+  const PerfStatReport &report = threadCtx.getPerfReport();
+  EXPECT_EQ(kSize, report.getHugePageRequestedBytes());
+  EXPECT_EQ(buffer->getNumHugePageBytes(), report.getHugePageBytes());
+  // no huge page asked, nothing reported
+  options.buffer_huge_pages = false;
+  ThreadCtx otherCtx(options, /* allocate buffer */ true);
+  EXPECT_FALSE(otherCtx.getBuffer()->isOnHugePages());
+  EXPECT_EQ(0, otherCtx.getBuffer()->getNumHugePageBytes());
+  EXPECT_EQ(0, otherCtx.getPerfReport().getHugePageRequestedBytes());
+}
+
+TEST(BasicTest, BackpressureMonitor) {
+  WdtOptions options;
+  options.backpressure_interval_millis = 0;
+  options.backpressure_max_write_latency_millis = 1;
+  BackpressureMonitor monitor(options, nullptr);
+  EXPECT_EQ(0, monitor.getTargetRate());
+  /* sleep override */
+  std::this_thread::sleep_for(std::chrono::milliseconds(10));
+  // slow writes ask for a rate below the one written
+  monitor.recordWrite(10 * 1024 * 1024, 5000);
+  monitor.recordWrite(10 * 1024 * 1024, 5000);
+  const int64_t targetRate = monitor.getTargetRate();
+  EXPECT_GT(targetRate, 0);
+  // nothing written, nothing changes
+  /* sleep override */
+  std::this_thread::sleep_for(std::chrono::milliseconds(10));
+  EXPECT_EQ(targetRate, monitor.getTargetRate());
+  // fast writes at a fraction of the target remove the limit
+  monitor.recordWrite(1024 * 1024, 0);
+  /* sleep override */
+  std::this_thread::sleep_for(std::chrono::milliseconds(10));
+  EXPECT_EQ(0, monitor.getTargetRate());
+}
+
+TEST(BasicTest, TransferStatsSnapshot) {
+  const int64_t kNumUpdates = 200000;
+  TransferStats stats;
+  std::atomic<bool> done{false};
+  // the owner adds bytes, another thread adjusts the effective bytes like
+  // the handling of a global checkpoint does
+  std::thread owner([&] {
+    for (int64_t i = 0; i < kNumUpdates; i++) {
+      stats.addHeaderBytes(1);
+      stats.addDataBytes(3);
+      stats.addEffectiveBytes(1, 3);
+    }
+  });
+  std::thread other([&] {
+    for (int64_t i = 0; i < kNumUpdates; i++) {
+      stats.addEffectiveBytes(2, 6);
+      stats.subtractEffectiveBytes(1, 3);
+    }
+  });
+  std::thread reporter([&] {
+    while (!done) {
+      TransferStats snapshot;
+      snapshot += stats;
+      ASSERT_EQ(3 * snapshot.getEffectiveHeaderBytes(),
+                snapshot.getEffectiveDataBytes());
+    }
+  });
+  owner.join();
+  other.join();
+  done = true;
+  reporter.join();
+  EXPECT_EQ(kNumUpdates, stats.getHeaderBytes());
+  EXPECT_EQ(3 * kNumUpdates, stats.getDataBytes());
+  EXPECT_EQ(2 * kNumUpdates, stats.getEffectiveHeaderBytes());
+  EXPECT_EQ(6 * kNumUpdates, stats.getEffectiveDataBytes());
+  TransferStats moved = std::move(stats);
+  EXPECT_EQ(8 * kNumUpdates, moved.getEffectiveTotalBytes());
+}
+
+TEST(BasicTest, TransferStatsTcpInfo) {
+  TransferStats summary;
+  EXPECT_EQ(0, summary.getTcpInfo().numConnections);
+  for (int i = 1; i <= 2; i++) {
+    TcpInfoSample sample;
+    sample.rttMicros = 1000 * i;
+    sample.cwndBytes = 64 * 1024;
+    sample.totalRetransmits = i;
+    sample.deliveryRateBytesPerSec = 100 * 1024 * 1024;
+    TransferStats threadStats;
+    threadStats.setTcpInfo(sample);
+    // a new sample replaces the previous one
+    threadStats.setTcpInfo(sample);
+    summary += threadStats;
+  }
+  const TcpInfoSample tcpInfo = summary.getTcpInfo();
+  EXPECT_EQ(2, tcpInfo.numConnections);
+  EXPECT_EQ(1500, tcpInfo.rttMicros);
+  EXPECT_EQ(128 * 1024, tcpInfo.cwndBytes);
+  EXPECT_EQ(3, tcpInfo.totalRetransmits);
+  EXPECT_EQ(200 * 1024 * 1024, tcpInfo.deliveryRateBytesPerSec);
+  EXPECT_EQ(0, tcpInfo.pacingRateBytesPerSec);
+  summary.reset();
+  EXPECT_EQ(0, summary.getTcpInfo().numConnections);
+}
+
+TEST(BasicTest, TransferReportProgressUpdate) {
+  TransferStats threadStats;
+  threadStats.setNumBlocksSend(3);
+  threadStats.addEffectiveBytes(10, 100);
+  TransferReport report(TransferStats(), 0, 0, 0, false);
+  report.startProgressUpdate(1, 1000, 5, false);
+  report.addTransferStats(threadStats);
+  EXPECT_EQ(100, report.getSummary().getEffectiveDataBytes());
+  EXPECT_EQ(100, report.getEffectiveDataBytesDelta());
+  EXPECT_EQ(1000, report.getTotalFileSize());
+  EXPECT_EQ(5, report.getNumDiscoveredFiles());
+  threadStats.addEffectiveBytes(5, 50);
+  report.startProgressUpdate(2, 1000, 8, true);
+  report.addTransferStats(threadStats);
+  // the summary is recomputed, not accumulated over the updates
+  EXPECT_EQ(150, report.getSummary().getEffectiveDataBytes());
+  EXPECT_EQ(50, report.getEffectiveDataBytesDelta());
+  EXPECT_EQ(3, report.getSummary().getNumBlocksSend());
+  EXPECT_EQ(2, report.getTotalTime());
+  EXPECT_TRUE(report.fileDiscoveryFinished());
+}
+
+TEST(BasicTest, SourceStatsTable) {
+  SourceStatsTable table;
+  // two blocks of the same file share its row
+  for (int i = 0; i < 2; i++) {
+    TransferStats blockStats("dir/file1");
+    blockStats.addDataBytes(100);
+    blockStats.addEffectiveBytes(10, 100);
+    blockStats.incrNumBlocks();
+    table.add(3, blockStats);
+  }
+  TransferStats failedStats("file2");
+  failedStats.incrFailedAttempts();
+  failedStats.setLocalErrorCode(SOCKET_WRITE_ERROR);
+  table.add(1, failedStats);
+  // no seq-id, gets its own row
+  TransferStats unknownStats("file3");
+  unknownStats.setLocalErrorCode(BYTE_SOURCE_READ_ERROR);
+  table.add(-1, unknownStats);
+  ASSERT_EQ(3, table.size());
+  EXPECT_EQ("dir/file1", table.getId(0));
+  EXPECT_EQ(3, table.getSeqId(0));
+  EXPECT_EQ(200, table.getDataBytes(0));
+  EXPECT_EQ(200, table.getEffectiveDataBytes(0));
+  EXPECT_EQ(20, table.getEffectiveHeaderBytes(0));
+  EXPECT_EQ(2, table.getNumBlocks(0));
+  EXPECT_EQ(OK, table.getErrorCode(0));
+  EXPECT_EQ(1, table.getFailedAttempts(1));
+  EXPECT_EQ(SOCKET_WRITE_ERROR, table.getErrorCode(1));
+  EXPECT_EQ(-1, table.getSeqId(2));
+
+  SourceStatsTable other;
+  TransferStats retryStats("dir/file1");
+  retryStats.incrFailedAttempts();
+  retryStats.setLocalErrorCode(SOCKET_WRITE_ERROR);
+  other.add(3, retryStats);
+  table.merge(other);
+  ASSERT_EQ(3, table.size());
+  EXPECT_EQ(1, table.getFailedAttempts(0));
+  EXPECT_EQ(SOCKET_WRITE_ERROR, table.getErrorCode(0));
+}
+
+TEST(BasicTest, LatencyHistograms) {
+  LatencyHistograms &histograms = LatencyHistograms::get();
+  histograms.start(20);
+  std::atomic<bool> done{false};
+  // records from several threads till a window with the values is complete
+  std::vector<std::thread> threads;
+  for (int t = 0; t < 4; t++) {
+    threads.emplace_back([&] {
+      while (!done) {
+        histograms.record(FILE_CREATE, 10);
+        /* sleep override */
+        std::this_thread::sleep_for(std::chrono::microseconds(100));
+      }
+    });
+  }
+  LatencyPercentiles percentiles;
+  for (int i = 0; i < 500 && percentiles.count == 0; i++) {
+    /* sleep override */
+    std::this_thread::sleep_for(std::chrono::milliseconds(10));
+    percentiles = histograms.getPercentiles(FILE_CREATE);
+  }
+  done = true;
+  for (auto &thread : threads) {
+    thread.join();
+  }
+  EXPECT_GT(percentiles.count, 0);
+  EXPECT_EQ(10, percentiles.maxMicros);
+  EXPECT_NEAR(10, percentiles.p50Micros, 1);
+  EXPECT_LE(percentiles.p999Micros, 10);
+  EXPECT_STREQ("file create", LatencyHistograms::getPhaseName(FILE_CREATE));
+}
+}
+
+TEST(BasicTest, TransferTracer) {
+  char path[] = "/tmp/wdtTraceXXXXXX";
+  const int fd = mkstemp(path);
+  ASSERT_GE(fd, 0);
+  close(fd);
+  TransferTracer &tracer = TransferTracer::get();
+  EXPECT_FALSE(tracer.isEnabled());
+  // room for 4 spans per thread
+  tracer.start(4);
+  ASSERT_TRUE(tracer.isEnabled());
+  static const char *kNames[] = {"span 0", "span 1", "span 2",
+                                 "span 3", "span 4", "span 5"};
+  std::thread thread([] {
+    TransferTracer::get().setThreadName("tracer test");
+    for (const char *name : kNames) {
+      TraceSpan span(name);
+    }
+  });
+  thread.join();
+  EXPECT_EQ(OK, tracer.dump(path));
+  std::string trace;
+  {
+    std::ifstream in(path);
+    trace.assign(std::istreambuf_iterator<char>(in),
+                 std::istreambuf_iterator<char>());
+  }
+  EXPECT_EQ(0, trace.find("{\"displayTimeUnit\":\"ms\",\"traceEvents\":["));
+  EXPECT_NE(std::string::npos,
+            trace.find("\"args\":{\"name\":\"tracer test\"}"));
+  // the oldest spans were overwritten
+  EXPECT_EQ(std::string::npos, trace.find("span 1"));
+  for (int i = 2; i < 6; i++) {
+    EXPECT_NE(std::string::npos, trace.find(kNames[i]));
+  }
+  int numSpans = 0;
+  for (size_t pos = trace.find("\"ph\":\"X\""); pos != std::string::npos;
+       pos = trace.find("\"ph\":\"X\"", pos + 1)) {
+    numSpans++;
+  }
+  EXPECT_EQ(4, numSpans);
+  // the spans are forgotten once dumped, nothing is written again
+  unlink(path);
+  EXPECT_EQ(OK, tracer.dump(path));
+  EXPECT_NE(0, access(path, F_OK));
+}
+
+TEST(BasicTest, TimeBreakdownBottleneck) {
+  TimeBreakdown idle;
+  idle.setTotalMicros(1000000);
+  idle.add(TimeBreakdown::DISK, 1000);
+  EXPECT_EQ(UNKNOWN_BOTTLENECK, idle.classify(true));
+
+  TimeBreakdown reader;
+  reader.setTotalMicros(1000000);
+  reader.add(TimeBreakdown::DISK, 600000);
+  reader.add(TimeBreakdown::NETWORK, 300000);
+  EXPECT_EQ(DISK_READ_BOUND, reader.classify(true));
+  EXPECT_EQ(RECEIVER_DISK_BOUND, reader.classify(false));
+
+  // inline crypto is part of the socket time
+  TimeBreakdown crypto;
+  crypto.setTotalMicros(1000000);
+  crypto.add(TimeBreakdown::NETWORK, 900000);
+  crypto.add(TimeBreakdown::CRYPTO, 600000);
+  crypto.add(TimeBreakdown::DISK, 100000);
+  EXPECT_EQ(CPU_CRYPTO_BOUND, crypto.classify(true));
+
+  TimeBreakdown writer;
+  writer.setTotalMicros(1000000);
+  writer.add(TimeBreakdown::NETWORK, 800000);
+  writer.addBlockedWrite(true, false);
+  EXPECT_EQ(NETWORK_BOUND, writer.classify(true));
+  writer.addBlockedWrite(false, true);
+  writer.addBlockedWrite(false, true);
+  EXPECT_EQ(RECEIVER_DISK_BOUND, writer.classify(true));
+  // a receiver can't tell the network from the sender
+  EXPECT_EQ(NETWORK_BOUND, writer.classify(false));
+
+  TimeBreakdown throttled;
+  throttled.setTotalMicros(1000000);
+  throttled.add(TimeBreakdown::THROTTLE, 500000);
+  throttled.add(TimeBreakdown::NETWORK, 200000);
+  EXPECT_EQ(THROTTLED, throttled.classify(true));
+
+  // the transfer is classified on the sum of its threads
+  TransferReport report(TransferStats{});
+  report.setTimeBreakdowns({reader, writer, throttled}, true);
+  ASSERT_EQ(3, report.getThreadBottlenecks().size());
+  EXPECT_EQ(DISK_READ_BOUND, report.getThreadBottlenecks()[0]);
+  EXPECT_EQ(RECEIVER_DISK_BOUND, report.getThreadBottlenecks()[1]);
+  EXPECT_EQ(THROTTLED, report.getThreadBottlenecks()[2]);
+  EXPECT_EQ(RECEIVER_DISK_BOUND, report.getBottleneck());
+  EXPECT_EQ(3000000, report.getTimeBreakdown().getTotalMicros());
+  EXPECT_STREQ("receiver-disk-bound", bottleneckToStr(RECEIVER_DISK_BOUND));
+}
+
+TEST(BasicTest, MemoryWriterSink) {
+  TemporaryDirectory tmpDir;
+  const string srcDir = tmpDir.dir() + "/src";
+  const string dstDir = tmpDir.dir() + "/dst";
+  ASSERT_EQ(0, mkdir(srcDir.c_str(), 0755));
+  map<string, string> files;
+  for (int64_t size : {0, 1000, 3 * 1024 * 1024 + 12345}) {
+    const string name = "file" + to_string(size);
+    string contents(size, 0);
+    for (auto &c : contents) {
+      c = rand32();
+    }
+    ofstream(srcDir + "/" + name, ios::binary) << contents;
+    files[name] = contents;
+  }
+  // the files are received in memory, never in the destination directory
+  mutex memoryMutex;
+  map<string, vector<char>> received;
+  auto factory = MemoryWriter::makeFactory([&](const BlockDetails &block) {
+    lock_guard<mutex> lock(memoryMutex);
+    auto &memory = received[block.fileName];
+    memory.resize(block.fileSize);
+    return memory.data() + block.offset;
+  });
+  WdtOptions options;
+  options.block_size_mbytes = 1;
+  WdtTransferRequest req(/* start port */ 0, /* num ports */ 3, dstDir);
+  Receiver receiver(req);
+  receiver.setWdtOptions(options);
+  receiver.setWriterFactory(factory);
+  req = receiver.init();
+  ASSERT_EQ(OK, req.errorCode);
+  ASSERT_EQ(OK, receiver.transferAsync());
+  req.directory = srcDir;
+  Sender sender(req);
+  sender.setWdtOptions(options);
+  EXPECT_EQ(OK, sender.transfer()->getSummary().getErrorCode());
+  EXPECT_EQ(OK, receiver.finish()->getSummary().getErrorCode());
+  for (const auto &file : files) {
+    if (file.second.empty()) {
+      continue;
+    }
+    ASSERT_EQ(1, received.count(file.first));
+    const auto &memory = received[file.first];
+    EXPECT_EQ(file.second, string(memory.begin(), memory.end()));
+  }
+  struct stat fileStat;
+  EXPECT_NE(0, stat((dstDir + "/file1000").c_str(), &fileStat));
+}
+
+TEST(BasicTest, ShmRing) {
+  TemporaryDirectory tmpDir;
+  const string path = tmpDir.dir() + "/ring";
+  auto ring = ShmRing::create(path, 64 * 1024);
+  ASSERT_TRUE(ring != nullptr);
+  // the consumer has its own mapping, as another process would
+  auto consumer = ShmRing::attach(path);
+  ASSERT_TRUE(consumer != nullptr);
+  EXPECT_TRUE(ShmRing::attach(tmpDir.dir() + "/missing") == nullptr);
+  const int64_t blockSize = 100 * 1000;
+  const int numBlocks = 20;
+  vector<char> data(blockSize);
+  for (int64_t i = 0; i < blockSize; i++) {
+    data[i] = i % 251;
+  }
+  thread producer([&] {
+    BlockDetails block;
+    block.fileName = "dir/file";
+    block.seqId = 7;
+    block.fileSize = numBlocks * blockSize;
+    for (int i = 0; i < numBlocks; i++) {
+      block.offset = i * blockSize;
+      // larger than the ring, appended as several records
+      EXPECT_EQ(OK, ring->append(block, block.offset, data.data(), blockSize,
+                                 10000));
+    }
+    ring->close();
+  });
+  int64_t expectedOffset = 0;
+  int numRecords = 0;
+  ShmRing::Record record;
+  while (consumer->read(record, 10000)) {
+    EXPECT_EQ("dir/file", record.fileName);
+    EXPECT_EQ(7, record.seqId);
+    EXPECT_EQ(numBlocks * blockSize, record.fileSize);
+    ASSERT_EQ(expectedOffset, record.offset);
+    for (size_t i = 0; i < record.data.size(); i++) {
+      ASSERT_EQ(data[(record.offset + i) % blockSize], record.data[i]);
+    }
+    expectedOffset += record.data.size();
+    numRecords++;
+  }
+  producer.join();
+  EXPECT_TRUE(consumer->isDone());
+  EXPECT_EQ(numBlocks * blockSize, expectedOffset);
+  EXPECT_GT(numRecords, numBlocks);
+  BlockDetails block;
+  EXPECT_EQ(ERROR, ring->append(block, 0, data.data(), 1, 0));
+}
+
+TEST(BasicTest, ShmTransport) {
+  WdtOptions options;
+  options.shm_buffer_mbytes = 1;
+  int fds[2];
+  ASSERT_EQ(0, socketpair(AF_UNIX, SOCK_STREAM, 0, fds));
+  ThreadCtx writerCtx(options, false);
+  ThreadCtx readerCtx(options, false);
+  unique_ptr<Transport> writer;
+  unique_ptr<Transport> reader;
+  // both sides exchange their setup at the same time
+  thread readerSetup([&] {
+    EXPECT_EQ(OK, ShmTransport::connect(readerCtx, fds[1], false, reader));
+  });
+  EXPECT_EQ(OK, ShmTransport::connect(writerCtx, fds[0], true, writer));
+  readerSetup.join();
+  ASSERT_TRUE(writer != nullptr && reader != nullptr);
+  EXPECT_EQ("shm", writer->getName());
+  EXPECT_FALSE(reader->isDataOnFd());
+  EXPECT_FALSE(reader->isReadable());
+  // several times the ring, so that it wraps around
+  const int64_t numBytes = 5 * 1024 * 1024 + 123;
+  thread writerThread([&] {
+    vector<char> chunk(100 * 1000);
+    int64_t written = 0;
+    while (written < numBytes) {
+      const int64_t count = min<int64_t>(chunk.size(), numBytes - written);
+      for (int64_t i = 0; i < count; i++) {
+        chunk[i] = (written + i) % 251;
+      }
+      int64_t done = 0;
+      while (done < count) {
+        const int64_t ret =
+            writer->write(chunk.data() + done, count - done, 10000);
+        ASSERT_GT(ret, 0);
+        done += ret;
+      }
+      written += count;
+    }
+    EXPECT_EQ(0, writer->shutdownWrites());
+  });
+  vector<char> buf(64 * 1024);
+  int64_t numRead = 0;
+  while (true) {
+    const int64_t ret = reader->read(buf.data(), buf.size(), 10000);
+    ASSERT_GE(ret, 0);
+    if (ret == 0) {
+      break;
+    }
+    for (int64_t i = 0; i < ret; i++) {
+      ASSERT_EQ((char)((numRead + i) % 251), buf[i]);
+    }
+    numRead += ret;
+  }
+  writerThread.join();
+  EXPECT_EQ(numBytes, numRead);
+  EXPECT_EQ(0, writer->getUnackedBytes());
+  // the replies go over the connection itself
+  const char reply[] = "ack";
+  EXPECT_EQ(3, reader->write(reply, 3, 1000));
+  EXPECT_EQ(3, writer->read(buf.data(), buf.size(), 1000));
+  writer.reset();
+  reader.reset();
+  ::close(fds[0]);
+  ::close(fds[1]);
+}
+
+TEST(BasicTest, RdmaNegotiation) {
+  WdtOptions rdmaOptions;
+  rdmaOptions.rdma_transport = true;
+  rdmaOptions.read_timeout_millis = 1000;
+  WdtOptions tcpOptions;
+  tcpOptions.read_timeout_millis = 1000;
+  // rdma_transport set on the writer only
+  {
+    int fds[2];
+    ASSERT_EQ(0, socketpair(AF_UNIX, SOCK_STREAM, 0, fds));
+    ThreadCtx writerCtx(rdmaOptions, false);
+    ThreadCtx readerCtx(tcpOptions, false);
+    bool readerRdma = true;
+    thread readerSetup([&] {
+      EXPECT_EQ(OK,
+                RdmaTransport::negotiate(readerCtx, fds[1], false, readerRdma));
+    });
+    bool writerRdma = true;
+    EXPECT_EQ(OK, RdmaTransport::negotiate(writerCtx, fds[0], true, writerRdma));
+    readerSetup.join();
+    EXPECT_FALSE(writerRdma);
+    EXPECT_FALSE(readerRdma);
+    // the capability byte was consumed, the protocol starts clean
+    const char cmd = Protocol::SETTINGS_CMD;
+    EXPECT_EQ(1, ::write(fds[0], &cmd, 1));
+    char peerCmd = 0;
+    EXPECT_EQ(1, ::read(fds[1], &peerCmd, 1));
+    EXPECT_EQ(cmd, peerCmd);
+    ::close(fds[0]);
+    ::close(fds[1]);
+  }
+  // rdma_transport set on the reader only, the first command is left unread
+  {
+    int fds[2];
+    ASSERT_EQ(0, socketpair(AF_UNIX, SOCK_STREAM, 0, fds));
+    ThreadCtx writerCtx(tcpOptions, false);
+    ThreadCtx readerCtx(rdmaOptions, false);
+    bool writerRdma = true;
+    EXPECT_EQ(OK, RdmaTransport::negotiate(writerCtx, fds[0], true, writerRdma));
+    EXPECT_FALSE(writerRdma);
+    const char cmd = Protocol::SETTINGS_CMD;
+    EXPECT_EQ(1, ::write(fds[0], &cmd, 1));
+    bool readerRdma = true;
+    EXPECT_EQ(OK,
+              RdmaTransport::negotiate(readerCtx, fds[1], false, readerRdma));
+    EXPECT_FALSE(readerRdma);
+    char peerCmd = 0;
+    EXPECT_EQ(1, ::read(fds[1], &peerCmd, 1));
+    EXPECT_EQ(cmd, peerCmd);
+    ::close(fds[0]);
+    ::close(fds[1]);
+  }
+}
+
+TEST(BasicTest, AcceptSenderReadingFirst) {
+  // without fast_reconnect, a sender reads the checkpoint of the receiver
+  // before writing anything, accepting must not wait for its first byte
+  WdtOptions options;
+  options.fast_reconnect = false;
+  ThreadCtx serverCtx(options, false);
+  ThreadCtx clientCtx(options, false);
+  EncryptionParams noEncryption;
+  ServerSocket server(serverCtx, 0, 1, noEncryption, 0, [] {});
+  ASSERT_EQ(OK, server.listen());
+  ClientSocket client(clientCtx, "localhost", server.getPort(), noEncryption,
+                      0);
+  ASSERT_EQ(OK, client.connect());
+  const auto startTime = Clock::now();
+  ASSERT_EQ(OK, server.acceptNextConnection(1000, false));
+  EXPECT_LT(durationMillis(Clock::now() - startTime),
+            options.read_timeout_millis / 2);
+  char checkpoint[] = "ckpt";
+  EXPECT_EQ(4, server.write(checkpoint, 4));
+  char buf[4];
+  EXPECT_EQ(4, client.read(buf, 4));
+  EXPECT_EQ(0, memcmp(buf, checkpoint, 4));
+}
+
+TEST(BasicTest, RetrySleepBackoff) {
+  WdtOptions options;
+  options.sleep_millis = 50;
+  options.max_sleep_millis = 500;
+  int64_t maxSleepMillis = 50;
+  for (int attempt = 1; attempt <= 12; attempt++) {
+    const int64_t sleepMillis =
+        WdtThread::getRetrySleepMillis(options, attempt);
+    EXPECT_LE(maxSleepMillis / 2, sleepMillis);
+    EXPECT_GE(maxSleepMillis, sleepMillis);
+    maxSleepMillis = std::min<int64_t>(2 * maxSleepMillis, 500);
+  }
+  // the sleep is fixed without a higher cap
+  options.max_sleep_millis = 0;
+  EXPECT_EQ(50, WdtThread::getRetrySleepMillis(options, 1));
+  EXPECT_EQ(50, WdtThread::getRetrySleepMillis(options, 10));
+}
+
+TEST(BasicTest, Prefetcher) {
+  SourceMetaData metadata;
+  metadata.setPaths("exe", "/proc/self/exe");
+  SourceMetaData directMetadata;
+  directMetadata.directReads = true;
+  Prefetcher prefetcher(100);
+  prefetcher.add(metadata, 0, 60);
+  // already queued
+  prefetcher.add(metadata, 0, 60);
+  // over the budget
+  prefetcher.add(metadata, 60, 60);
+  // not through the page cache
+  prefetcher.add(directMetadata, 0, 60);
+  EXPECT_EQ(1, prefetcher.getStats().numOverBudget);
+  // reading the first block releases its budget
+  prefetcher.markRead(metadata, 0);
+  prefetcher.add(metadata, 60, 60);
+  prefetcher.markRead(metadata, 120);
+  prefetcher.markRead(metadata, 60);
+  const Prefetcher::Stats stats = prefetcher.getStats();
+  EXPECT_EQ(3, stats.numReads);
+  EXPECT_EQ(2, stats.numHits + stats.numLate);
+  EXPECT_EQ(1, stats.numOverBudget);
+  EXPECT_GE(2, stats.numPrefetched);
+  // a block returned to the queue or split gives its budget back unread
+  prefetcher.add(metadata, 0, 100);
+  prefetcher.add(metadata, 100, 10);
+  EXPECT_EQ(2, prefetcher.getStats().numOverBudget);
+  prefetcher.release(metadata, 0);
+  prefetcher.add(metadata, 100, 10);
+  EXPECT_EQ(2, prefetcher.getStats().numOverBudget);
+  EXPECT_EQ(3, prefetcher.getStats().numReads);
+}
+
+TEST(BasicTest, PathArena) {
+  PathArena arena("/root/");
+  const int64_t fileId = arena.add("a/b/c.txt");
+  const int64_t siblingId = arena.add("a/b/d.txt");
+  const int64_t topId = arena.add("e");
+  const int64_t emptyDirId = arena.add("a//f");
+  EXPECT_EQ("a/b/c.txt", arena.getRelPath(fileId));
+  EXPECT_EQ("a/b/d.txt", arena.getRelPath(siblingId));
+  EXPECT_EQ("e", arena.getRelPath(topId));
+  EXPECT_EQ("a//f", arena.getRelPath(emptyDirId));
+  EXPECT_EQ("/root/a/b/c.txt", arena.getFullPath(fileId));
+  EXPECT_EQ("/root/e", arena.getFullPath(topId));
+  // names are packed into chunks, the first ones small
+  const int64_t numBytes = arena.getNumBytes();
+  EXPECT_LT(numBytes, 16 * 1024);
+  arena.add("a/b/g");
+  EXPECT_EQ(numBytes, arena.getNumBytes());
+  EXPECT_EQ("a/b/g", arena.getRelPath(arena.add("a/b/g")));
+  // chunks grow as paths are added, earlier ones stay valid
+  std::vector<int64_t> ids;
+  for (int i = 0; i < 10000; i++) {
+    ids.push_back(arena.add("a/" + std::to_string(i % 7) + "/" +
+                            std::to_string(i)));
+  }
+  for (int i = 0; i < 10000; i++) {
+    EXPECT_EQ("a/" + std::to_string(i % 7) + "/" + std::to_string(i),
+              arena.getRelPath(ids[i]));
+  }
+  EXPECT_EQ("a/b/c.txt", arena.getRelPath(fileId));
+  EXPECT_GT(arena.getNumBytes(), numBytes);
+
+  SourceMetaData metadata;
+  metadata.setPaths(arena, "a/b/c.txt", "/root/a/b/c.txt");
+  EXPECT_EQ("a/b/c.txt", metadata.getRelPath());
+  EXPECT_EQ("/root/a/b/c.txt", metadata.getFullPath());
+  // a symlink resolved elsewhere keeps its full path
+  metadata.setPaths(arena, "e", "/elsewhere/e");
+  EXPECT_EQ("e", metadata.getRelPath());
+  EXPECT_EQ("/elsewhere/e", metadata.getFullPath());
+}
+
+TEST(BasicTest, SenderJournal) {
+  TemporaryDirectory tmpDir;
+  const string path = tmpDir.dir() + "/journal";
+  {
+    SenderJournal journal(path, "sig");
+    EXPECT_FALSE(journal.open());
+    journal.addDiscoveredFile("a", 100);
+    journal.addDiscoveredFile("b", 100);
+    journal.addDiscoveredFile("c", 0);
+    EXPECT_TRUE(journal.saveSnapshot());
+    EXPECT_TRUE(journal.addAckedBlocks({{"a", 50, 50}, {"b", 0, 60}}));
+    EXPECT_TRUE(journal.addAckedBlocks({{"a", 0, 50}, {"c", 0, 0}}));
+  }
+  {
+    SenderJournal journal(path, "sig");
+    EXPECT_TRUE(journal.open());
+    EXPECT_EQ(2, journal.getNumAckedFiles());
+    // the partially acked file is sent again entirely
+    auto files = journal.getRemainingFiles(true, false);
+    ASSERT_EQ(1, files.size());
+    EXPECT_EQ("b", files[0].fileName);
+    EXPECT_EQ(100, files[0].fileSize);
+    EXPECT_EQ(3, journal.getRemainingFiles(false, false).size());
+    EXPECT_TRUE(journal.addAckedBlocks({{"b", 0, 100}}));
+  }
+  {
+    SenderJournal journal(path, "sig");
+    EXPECT_TRUE(journal.open());
+    EXPECT_EQ(3, journal.getNumAckedFiles());
+    EXPECT_TRUE(journal.getRemainingFiles(true, false).empty());
+  }
+  {
+    SenderJournal journal(path + ".other", "other");
+    EXPECT_FALSE(journal.open());
+    journal.addDiscoveredFile("a", 100);
+    EXPECT_TRUE(journal.saveSnapshot());
+  }
+  {
+    // a journal of other sources is ignored
+    SenderJournal journal(path + ".other", "sig");
+    EXPECT_FALSE(journal.open());
+  }
+  SenderJournal journal(path, "sig");
+  EXPECT_TRUE(journal.open());
+  journal.remove();
+  SenderJournal removedJournal(path, "sig");
+  EXPECT_FALSE(removedJournal.open());
+}
 }
 }  // namespace end
 
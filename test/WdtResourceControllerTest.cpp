@@ -12,6 +12,9 @@
 #include <glog/logging.h>
 #include <gtest/gtest.h>
 
+#include <atomic>
+#include <thread>
+
 using namespace std;
 
 namespace facebook {
@@ -34,6 +37,12 @@ class WdtResourceControllerTest : public WdtResourceController {
   void AddObjectsWithLimitsTest();
   void InvalidNamespaceTest();
   void ReleaseStaleTest();
+  void ThrottlerHierarchyTest();
+  void MetricsTest();
+  void ThreadLimitTest();
+  void BufferLimitTest();
+  void FairShareTest();
+  void ConcurrentTransfersTest();
 
  private:
   string getTransferId(const string &wdtNamespace, int index) {
@@ -281,6 +290,262 @@ void WdtResourceControllerTest::ReleaseStaleTest() {
   }
 }
 
+void WdtResourceControllerTest::ThrottlerHierarchyTest() {
+  auto transferRequest = makeTransferRequest("throttler-hierarchy");
+  SenderPtr senderPtr;
+  ErrorCode code = createSender("test-namespace-1", transferRequest.transferId,
+                                transferRequest, senderPtr);
+  ASSERT_TRUE(code == OK);
+  ReceiverPtr receiverPtr;
+  code = createReceiver("test-namespace-2", transferRequest.transferId,
+                        transferRequest, receiverPtr);
+  ASSERT_TRUE(code == OK);
+  auto namespaceThrottler1 =
+      getNamespaceController("test-namespace-1")->getThrottler();
+  auto namespaceThrottler2 =
+      getNamespaceController("test-namespace-2")->getThrottler();
+  EXPECT_NE(namespaceThrottler1, namespaceThrottler2);
+  EXPECT_EQ(getWdtThrottler(), namespaceThrottler1->getParent());
+  EXPECT_EQ(getWdtThrottler(), namespaceThrottler2->getParent());
+  // per transfer rates are set, each transfer gets its own throttler
+  EXPECT_EQ(namespaceThrottler1, senderPtr->getThrottler()->getParent());
+  EXPECT_EQ(namespaceThrottler2, receiverPtr->getThrottler()->getParent());
+
+  ThrottlerOptions throttlerOptions;
+  throttlerOptions.avg_rate_per_sec = 20 * kMbToB;
+  updateThrottlerRates("test-namespace-1", throttlerOptions);
+  EXPECT_EQ(20 * kMbToB, namespaceThrottler1->getAvgRatePerSec());
+}
+
+void WdtResourceControllerTest::MetricsTest() {
+  const string wdtNamespace = "metrics-namespace";
+  auto transferRequest = makeTransferRequest("metrics");
+  SenderPtr senderPtr;
+  ErrorCode code = createSender(wdtNamespace, transferRequest.transferId,
+                                transferRequest, senderPtr);
+  ASSERT_TRUE(code == OK);
+  ReceiverPtr receiverPtr;
+  code = createReceiver(wdtNamespace, transferRequest.transferId,
+                        transferRequest, receiverPtr);
+  ASSERT_TRUE(code == OK);
+  WdtMetrics metrics = getMetrics();
+  ASSERT_EQ(1, metrics.namespaces.size());
+  const NamespaceMetrics &namespaceMetrics = metrics.namespaces[0];
+  EXPECT_EQ(wdtNamespace, namespaceMetrics.wdtNamespace);
+  EXPECT_EQ(1, namespaceMetrics.numSenders);
+  EXPECT_EQ(1, namespaceMetrics.numReceivers);
+  // not started yet
+  EXPECT_EQ(0, namespaceMetrics.sent.numOngoing);
+  EXPECT_EQ(0, namespaceMetrics.received.dataBytes);
+  const string prometheus = metrics.toPrometheus();
+  EXPECT_NE(string::npos,
+            prometheus.find("wdt_transfers{namespace=\"metrics-namespace\","
+                            "direction=\"send\"} 1\n"));
+  EXPECT_NE(string::npos, prometheus.find("# TYPE wdt_data_bytes gauge\n"));
+  EXPECT_NE(string::npos,
+            metrics.toJson().find("\"namespace\":\"metrics-namespace\""));
+  // namespaces are escaped
+  metrics.namespaces[0].wdtNamespace = "a\"b\\c";
+  const string escaped = "a\\\"b\\\\c";
+  EXPECT_NE(string::npos,
+            metrics.toPrometheus().find("namespace=\"" + escaped + "\""));
+  EXPECT_NE(string::npos,
+            metrics.toJson().find("\"namespace\":\"" + escaped + "\""));
+  releaseAllSenders(wdtNamespace);
+  releaseAllReceivers(wdtNamespace);
+}
+
+void WdtResourceControllerTest::ThreadLimitTest() {
+  string wdtNamespace = "test-namespace-threads";
+  registerWdtNamespace(wdtNamespace);
+  string transferPrefix = "thread-limit-transfer";
+  // a thread per port, the receiver and the sender take 16 of the 20 threads
+  auto transferRequest = makeTransferRequest(getTransferId(transferPrefix, 0));
+  ReceiverPtr receiverPtr;
+  ErrorCode code = createReceiver(wdtNamespace, transferRequest.transferId,
+                                  transferRequest, receiverPtr);
+  ASSERT_TRUE(code == OK);
+  SenderPtr senderPtr;
+  code = createSender(wdtNamespace, transferRequest.transferId,
+                      transferRequest, senderPtr);
+  ASSERT_TRUE(code == OK);
+  auto nextRequest = makeTransferRequest(getTransferId(transferPrefix, 1));
+  SenderPtr nextSender;
+  code = createSender(wdtNamespace, nextRequest.transferId, nextRequest,
+                      nextSender);
+  EXPECT_EQ(QUOTA_EXCEEDED, code);
+  EXPECT_TRUE(nextSender == nullptr);
+  // other namespaces have their own threads
+  registerWdtNamespace("test-namespace-threads-2");
+  code = createSender("test-namespace-threads-2", nextRequest.transferId,
+                      nextRequest, nextSender);
+  EXPECT_EQ(OK, code);
+  // the threads of a transfer released are available again
+  EXPECT_EQ(OK, releaseSender(wdtNamespace, transferRequest.transferId));
+  code = createSender(wdtNamespace, nextRequest.transferId, nextRequest,
+                      nextSender);
+  EXPECT_EQ(OK, code);
+  auto lastRequest = makeTransferRequest(getTransferId(transferPrefix, 2));
+  code = createSender(wdtNamespace, lastRequest.transferId, lastRequest,
+                      senderPtr);
+  EXPECT_EQ(QUOTA_EXCEEDED, code);
+  updateMaxThreadsLimit(wdtNamespace, 0);
+  code = createSender(wdtNamespace, lastRequest.transferId, lastRequest,
+                      senderPtr);
+  EXPECT_EQ(OK, code);
+  releaseAllSenders(wdtNamespace);
+  releaseAllReceivers(wdtNamespace);
+  releaseAllSenders("test-namespace-threads-2");
+}
+
+void WdtResourceControllerTest::BufferLimitTest() {
+  string wdtNamespace = "test-namespace-buffers";
+  registerWdtNamespace(wdtNamespace);
+  string transferPrefix = "buffer-limit-transfer";
+  // 8 buffers of 256KB a transfer, two fit in 4MB
+  auto transferRequest = makeTransferRequest(getTransferId(transferPrefix, 0));
+  ReceiverPtr receiverPtr;
+  ErrorCode code = createReceiver(wdtNamespace, transferRequest.transferId,
+                                  transferRequest, receiverPtr);
+  ASSERT_TRUE(code == OK);
+  SenderPtr senderPtr;
+  code = createSender(wdtNamespace, transferRequest.transferId,
+                      transferRequest, senderPtr);
+  ASSERT_TRUE(code == OK);
+  EXPECT_EQ(4 * 1024 * 1024, BufferPool::get().getNumBytesReserved());
+  // the cap is shared by all the namespaces
+  registerWdtNamespace("test-namespace-buffers-2");
+  auto nextRequest = makeTransferRequest(getTransferId(transferPrefix, 1));
+  SenderPtr nextSender;
+  code = createSender("test-namespace-buffers-2", nextRequest.transferId,
+                      nextRequest, nextSender);
+  EXPECT_EQ(QUOTA_EXCEEDED, code);
+  EXPECT_TRUE(nextSender == nullptr);
+  // the memory of a transfer released is available again
+  EXPECT_EQ(OK, releaseReceiver(wdtNamespace, transferRequest.transferId));
+  code = createSender("test-namespace-buffers-2", nextRequest.transferId,
+                      nextRequest, nextSender);
+  EXPECT_EQ(OK, code);
+  releaseAllSenders(wdtNamespace);
+  releaseAllSenders("test-namespace-buffers-2");
+  EXPECT_EQ(0, BufferPool::get().getNumBytesReserved());
+}
+
+void WdtResourceControllerTest::FairShareTest() {
+  string wdtNamespace = "test-namespace-fair";
+  registerWdtNamespace(wdtNamespace);
+  ASSERT_TRUE(getBandwidthScheduler() != nullptr);
+  string transferPrefix = "fair-share-transfer";
+  SenderPtr senders[2];
+  for (int index = 0; index < 2; index++) {
+    auto request = makeTransferRequest(getTransferId(transferPrefix, index));
+    ErrorCode code = createSender(wdtNamespace, request.transferId, request,
+                                  senders[index]);
+    ASSERT_TRUE(code == OK);
+  }
+  // each transfer has a throttler of its own, child of the namespace one
+  auto throttler = senders[0]->getThrottler();
+  ASSERT_TRUE(throttler != nullptr);
+  EXPECT_TRUE(throttler != senders[1]->getThrottler());
+  EXPECT_TRUE(throttler->getParent() != nullptr);
+  auto parent = senders[1]->getThrottler()->getParent();
+  EXPECT_TRUE(throttler->getParent() == parent);
+  EXPECT_EQ(OK, setTransferWeight(wdtNamespace,
+                                  getTransferId(transferPrefix, 0), 2));
+  EXPECT_EQ(NOT_FOUND, setTransferWeight(wdtNamespace, "unknown", 2));
+  EXPECT_EQ(OK, setNamespaceWeight(wdtNamespace, 3));
+  // the active transfers share the global rate by weight
+  throttler->startTransfer();
+  senders[1]->getThrottler()->startTransfer();
+  getBandwidthScheduler()->updateShares();
+  const double globalRate = getWdtThrottler()->getAvgRatePerSec();
+  EXPECT_NEAR(globalRate * 2 / 3, throttler->getAvgRatePerSec(), 1);
+  EXPECT_NEAR(globalRate / 3, senders[1]->getThrottler()->getAvgRatePerSec(),
+              1);
+  throttler->endTransfer();
+  senders[1]->getThrottler()->endTransfer();
+  releaseAllSenders(wdtNamespace);
+}
+
+void WdtResourceControllerTest::ConcurrentTransfersTest() {
+  const int numThreads = 8;
+  const int numPerThread = 4;
+  // more senders asked than allowed, from namespaces of their own
+  std::atomic<int> numCreated{0};
+  std::atomic<int> numRejected{0};
+  vector<thread> threads;
+  for (int t = 0; t < numThreads; t++) {
+    threads.emplace_back([&, t]() {
+      const string wdtNamespace = "concurrent-namespace-" + to_string(t);
+      for (int index = 0; index < numPerThread; index++) {
+        auto transferRequest =
+            makeTransferRequest(getTransferId(wdtNamespace, index));
+        SenderPtr sender;
+        ErrorCode code = createSender(wdtNamespace, transferRequest.transferId,
+                                      transferRequest, sender);
+        if (code == OK) {
+          ++numCreated;
+        } else if (code == QUOTA_EXCEEDED) {
+          ++numRejected;
+        }
+        ReceiverPtr receiver;
+        code = createReceiver(wdtNamespace, transferRequest.transferId,
+                              transferRequest, receiver);
+        EXPECT_EQ(OK, code);
+        // the transfers of the other namespaces are not stale
+        vector<string> erasedIds;
+        EXPECT_EQ(OK, releaseStaleReceivers(wdtNamespace, erasedIds));
+        EXPECT_TRUE(erasedIds.empty());
+      }
+    });
+  }
+  for (auto &t : threads) {
+    t.join();
+  }
+  threads.clear();
+  const int maxNumSenders = maxNumSenders_;
+  EXPECT_EQ(maxNumSenders, numCreated.load());
+  EXPECT_EQ(numThreads * numPerThread - maxNumSenders, numRejected.load());
+  int32_t numNamespaces = 0;
+  int32_t numSenders = 0;
+  int32_t numReceivers = 0;
+  getCounts(numNamespaces, numSenders, numReceivers);
+  EXPECT_EQ(numThreads, numNamespaces);
+  EXPECT_EQ(maxNumSenders, numSenders);
+  EXPECT_EQ(numThreads * numPerThread, numReceivers);
+
+  // the same transfer created by all the threads at once
+  const string wdtNamespace = "concurrent-namespace-0";
+  auto transferRequest = makeTransferRequest("concurrent-same-transfer");
+  vector<ReceiverPtr> receivers(numThreads);
+  std::atomic<int> numAlreadyExisting{0};
+  for (int t = 0; t < numThreads; t++) {
+    threads.emplace_back([&, t]() {
+      ErrorCode code = createReceiver(wdtNamespace, transferRequest.transferId,
+                                      transferRequest, receivers[t]);
+      if (code == ALREADY_EXISTS) {
+        ++numAlreadyExisting;
+      } else {
+        EXPECT_EQ(OK, code);
+      }
+    });
+  }
+  for (auto &t : threads) {
+    t.join();
+  }
+  EXPECT_EQ(numThreads - 1, numAlreadyExisting.load());
+  for (const auto &receiver : receivers) {
+    EXPECT_TRUE(receiver == receivers[0]);
+  }
+  getCounts(numNamespaces, numSenders, numReceivers);
+  EXPECT_EQ(numThreads * numPerThread + 1, numReceivers);
+  shutdown();
+  getCounts(numNamespaces, numSenders, numReceivers);
+  EXPECT_EQ(0, numNamespaces);
+  EXPECT_EQ(0, numSenders);
+  EXPECT_EQ(0, numReceivers);
+}
+
 TEST(WdtResourceController, AddObjectsWithNoLimits) {
   auto &options = WdtOptions::getMutable();
   options.namespace_receiver_limit = 0;
@@ -316,6 +581,69 @@ TEST(WdtResourceControllerTest, ReleaseStaleTest) {
   WdtResourceControllerTest t;
   t.ReleaseStaleTest();
 }
+
+TEST(WdtResourceControllerTest, ThrottlerHierarchyTest) {
+  auto &options = WdtOptions::getMutable();
+  options.namespace_avg_mbytes_per_sec = 50;
+  options.transfer_avg_mbytes_per_sec = 30;
+  WdtResourceControllerTest t;
+  t.ThrottlerHierarchyTest();
+  options.namespace_avg_mbytes_per_sec = -1;
+  options.transfer_avg_mbytes_per_sec = -1;
+}
+
+TEST(WdtResourceControllerTest, MetricsTest) {
+  WdtResourceControllerTest t;
+  t.MetricsTest();
+}
+
+TEST(WdtResourceControllerTest, ThreadLimitTest) {
+  auto &options = WdtOptions::getMutable();
+  options.global_sender_limit = 0;
+  options.global_receiver_limit = 0;
+  options.namespace_receiver_limit = 0;
+  options.namespace_thread_limit = 20;
+  WdtResourceControllerTest t;
+  t.ThreadLimitTest();
+  options.namespace_thread_limit = 0;
+}
+
+TEST(WdtResourceControllerTest, BufferLimitTest) {
+  auto &options = WdtOptions::getMutable();
+  options.global_sender_limit = 0;
+  options.global_receiver_limit = 0;
+  options.namespace_receiver_limit = 0;
+  options.buffer_pool_max_mbytes = 4;
+  WdtResourceControllerTest t;
+  t.BufferLimitTest();
+  options.buffer_pool_max_mbytes = 0;
+}
+
+TEST(WdtResourceControllerTest, FairShareTest) {
+  auto &options = WdtOptions::getMutable();
+  options.global_sender_limit = 0;
+  options.namespace_sender_limit = 0;
+  const double avgRate = options.avg_mbytes_per_sec;
+  options.avg_mbytes_per_sec = 90;
+  // shares updated by the test
+  options.fair_share_interval_millis = 1000 * 1000;
+  WdtResourceControllerTest t;
+  t.FairShareTest();
+  options.fair_share_interval_millis = 0;
+  options.avg_mbytes_per_sec = avgRate;
+}
+
+TEST(WdtResourceControllerTest, ConcurrentTransfersTest) {
+  auto &options = WdtOptions::getMutable();
+  options.global_sender_limit = 10;
+  options.global_receiver_limit = 0;
+  options.namespace_sender_limit = 0;
+  options.namespace_receiver_limit = 0;
+  options.namespace_thread_limit = 0;
+  WdtResourceControllerTest t;
+  t.ConcurrentTransfersTest();
+  options.global_sender_limit = 0;
+}
 }
 }
 
@@ -215,6 +215,21 @@ TEST(RequestSerializationTest, UrlTests) {
     WLOG(INFO) << dummy.getLogSafeString();
     EXPECT_EQ(transferRequest, dummy);
   }
+  {
+    string uri =
+        "wdt://host1?ports=1,2&raddrs=host2,host3&laddrs=10.0.0.1,10.0.1.1";
+    WdtTransferRequest transferRequest(uri);
+    EXPECT_EQ(transferRequest.errorCode, OK);
+    vector<string> expectedReceivers{"host2", "host3"};
+    vector<string> expectedLocals{"10.0.0.1", "10.0.1.1"};
+    EXPECT_EQ(transferRequest.receiverAddresses, expectedReceivers);
+    EXPECT_EQ(transferRequest.localAddresses, expectedLocals);
+    WdtTransferRequest deser(transferRequest.genWdtUrlWithSecret());
+    EXPECT_EQ(deser.errorCode, OK);
+    EXPECT_EQ(deser, transferRequest);
+    deser.localAddresses.pop_back();
+    EXPECT_FALSE(deser == transferRequest);
+  }
   {
     string uri = "wdt://localhost?ports=1&recpv=10";
     WdtTransferRequest transferRequest(uri);
@@ -107,6 +107,44 @@ TEST(encDecI64, encodeDecodeI64Random) {
   }
 }
 
+TEST(encDecI64, decodeWordAndByteLoopMatch) {
+  // values of every length, decoded 8 bytes at a time with garbage after
+  // them, and from a buffer ending with them, which takes the byte loop
+  for (int bits = 0; bits < 64; ++bits) {
+    for (int64_t v : {(int64_t)1 << bits, ((int64_t)1 << bits) - 1,
+                      -((int64_t)1 << bits), (int64_t)rand64()}) {
+      char tmp[2 * EDI64_MAX];
+      memset(tmp, 0xff, sizeof(tmp));
+      int64_t len = 0;
+      EXPECT_TRUE(encodeVarI64(tmp, sizeof(tmp), len, v));
+      int64_t x = ~v;
+      int64_t pos = 0;
+      EXPECT_TRUE(decodeVarI64(tmp, sizeof(tmp), pos, x));
+      EXPECT_EQ(len, pos);
+      EXPECT_EQ(v, x);
+      x = ~v;
+      pos = 0;
+      EXPECT_TRUE(decodeVarI64(tmp, len, pos, x));
+      EXPECT_EQ(len, pos);
+      EXPECT_EQ(v, x);
+    }
+  }
+  // consecutive values, as in the file chunks lists
+  std::vector<int64_t> values;
+  string buf;
+  for (int i = 0; i < 10000; ++i) {
+    values.push_back(rand64() >> (rand32() % 64));
+    encodeVarI64(buf, values.back());
+  }
+  int64_t pos = 0;
+  for (int64_t v : values) {
+    int64_t x = ~v;
+    EXPECT_TRUE(decodeVarI64(buf.data(), buf.size(), pos, x));
+    EXPECT_EQ(v, x);
+  }
+  EXPECT_EQ(buf.size(), pos);
+}
+
 TEST(encDecI64, encodeDecodeI64Errors) {
   const int64_t v1 = -33;
   const int64_t v2 = 513;
@@ -15,6 +15,7 @@
 
 #include <common/encode/Coding.h>  // this won't work outside of fb
 #include <folly/Benchmark.h>
+#include <gflags/gflags.h>
 #include "TestCommon.h"
 
 using namespace facebook::wdt;
@@ -144,7 +145,9 @@ BENCHMARK_PARAM(BM_encodeDecodeI64_vi_str, 10);
 
 // -- main
 
-int main(int /* unused */, char ** /* unused */) {
+// -json (folly benchmark flag) prints results bench/wdt_bench_compare.py reads
+int main(int argc, char **argv) {
+  GFLAGS_NAMESPACE::ParseCommandLineFlags(&argc, &argv, true);
   folly::runBenchmarks();
   return 0;
 }
@@ -0,0 +1,67 @@
+#! /usr/bin/env python
+
+# Checks the exit codes of bench/wdt_bench_compare.py: 0 without regression,
+# 1 on a regression and 2 on bad input, which must not end in a traceback
+
+from __future__ import print_function
+
+import json
+import os
+import shutil
+import subprocess
+import sys
+import tempfile
+
+script = os.path.join(os.path.dirname(os.path.abspath(__file__)), "..",
+                      "bench", "wdt_bench_compare.py")
+test_dir = tempfile.mkdtemp(prefix="wdt_bench_compare_")
+errors = 0
+
+
+def record(value, schema="wdt_bench_v1"):
+    return json.dumps({
+        "schema": schema, "benchmark": "protocol", "case": "encode",
+        "params": {"size": 4096},
+        "metrics": {"time": {"value": value, "unit": "ns",
+                             "better": "lower"}},
+        "env": {"host": "h", "cpu_model": "c", "num_cpus": 8,
+                "kernel": "k", "build": "opt"}})
+
+
+def write_file(name, text):
+    path = os.path.join(test_dir, name)
+    with open(path, "w") as f:
+        f.write(text)
+    return path
+
+
+def check(name, base_text, new_text, expected_code):
+    global errors
+    base = write_file(name + ".base.json", base_text)
+    new = write_file(name + ".new.json", new_text)
+    proc = subprocess.Popen([sys.executable, script, base, new],
+                            stdout=subprocess.PIPE, stderr=subprocess.PIPE,
+                            universal_newlines=True)
+    out, err = proc.communicate()
+    if proc.returncode != expected_code or "Traceback" in err:
+        print("FAILED {0}: exit code {1}, expected {2}\n{3}{4}".format(
+            name, proc.returncode, expected_code, out, err))
+        errors += 1
+    else:
+        print("OK {0}".format(name))
+
+
+base_runs = "\n".join(record(v) for v in [100, 101, 99]) + "\n"
+check("same", base_runs, base_runs, 0)
+check("regression", base_runs,
+      "\n".join(record(v) for v in [150, 151, 149]) + "\n", 1)
+check("folly", '{\n  "encode": 100\n}\n', '{\n  "encode": 100\n}\n', 0)
+check("malformed json", base_runs, '{"schema": "wdt_bench_v1",\n', 2)
+check("not an object", base_runs, "[1, 2]\n", 2)
+check("unknown schema", base_runs, record(100, "wdt_bench_v2") + "\n", 2)
+check("non numeric value", base_runs, record("fast") + "\n", 2)
+check("non numeric folly value", base_runs, '{"encode": "fast"}\n', 2)
+check("empty", base_runs, "", 2)
+
+shutil.rmtree(test_dir)
+sys.exit(1 if errors else 0)
@@ -11,17 +11,50 @@ echo "Run from the cmake build dir (or ~/fbcode - or fbmake runtests)"
 
 BASEDIR=/tmp/wdtTest_$USER
 USE_ODIRECT=false
+TEST_SPARSE=false
+TEST_DEDUP=false
+TEST_LOCAL_COPY=false
+TEST_CHAIN=false
+TEST_FAN_OUT=false
+TEST_STREAM=false
+TEST_MODE_OPTS=""
 usage="
 The possible options to this script are
 -d base directory to use (defaults to $BASEDIR)
 -o if the value is true, o_direct read is used
+-O if the value is true, o_direct writes are used by the receiver
+-z if the value is true, unencrypted zero copy (sendfile) send is used
+-w if the value is true, MSG_ZEROCOPY socket writes are used
+-b if the value is true, small files are sent in batches
+-p if the value is true, the source directory is explored by many threads
+-s if the value is true, holes of sparse files are not sent
+-a if the value is true, receiver writes files using io_uring
+-t if the value is true, receiver hands writes off to disk writer threads
+-f if the value is true, receiver syncs and closes files in the background
+-l if the value is true, receiver allocates files in the background
+-c if the value is true, fds are cached for the next blocks of a file
+-r if the value is true, receiver receives file data in the write buffers
+-R if the value is true, receiver checks its free space and prepares the
+   manifest files in batches
+-n if the value is true, sender auto scales its connections
+-u if the value is true, sockets set congestion control and auto size buffers
+-k if the value is true, encryption is done by kernel tls when available
+-g if the value is true, encryption runs on a crypto worker per connection
+-m if the value is true, receiver ports share a runtime of 2 threads
+-M if the value is true, sender ports share a runtime of 2 threads
+-x if the value is true, block data is compressed with zstd
+-D if the value is true, identical files are sent once and copied
+-L if the value is true, files are copied locally, without a receiver
+-C if the value is true, the receiver forwards the files to a second one
+-F if the value is true, the receiver forwards the files to two others
+-S if the value is true, a tar of the files is also streamed and untarred
 "
 
 if [ "$1" == "-h" ]; then
   echo "$usage"
   exit 0
 fi
-while getopts ":d:h:o:" opt; do
+while getopts ":d:h:o:O:z:w:b:p:s:a:t:f:l:c:r:R:n:u:k:g:m:M:x:D:L:C:F:S:" opt; do
   case $opt in
     d) BASEDIR="$OPTARG"
     ;;
@@ -31,6 +64,168 @@ while getopts ":d:h:o:" opt; do
       USE_ODIRECT=true
     fi
     ;;
+    O)
+    if [ "$OPTARG" == "true" ]; then
+      echo "Testing with o_direct writes"
+      TEST_MODE_OPTS="$TEST_MODE_OPTS -odirect_writes -enable_checksum"
+    fi
+    ;;
+    z)
+    if [ "$OPTARG" == "true" ]; then
+      echo "Testing with zero copy send"
+      TEST_MODE_OPTS="$TEST_MODE_OPTS -zero_copy_send -encryption_type=none"
+    fi
+    ;;
+    w)
+    if [ "$OPTARG" == "true" ]; then
+      echo "Testing with zero copy writes"
+      TEST_MODE_OPTS="$TEST_MODE_OPTS -zero_copy_writes -read_ahead_buffers=4"
+    fi
+    ;;
+    b)
+    if [ "$OPTARG" == "true" ]; then
+      echo "Testing with small file batching"
+      TEST_MODE_OPTS="$TEST_MODE_OPTS -small_file_batch_bytes=65536 "\
+"-enable_checksum"
+    fi
+    ;;
+    p)
+    if [ "$OPTARG" == "true" ]; then
+      echo "Testing with parallel discovery"
+      TEST_MODE_OPTS="$TEST_MODE_OPTS -num_discovery_threads=4"
+    fi
+    ;;
+    s)
+    if [ "$OPTARG" == "true" ]; then
+      echo "Testing with sparse files"
+      TEST_SPARSE=true
+      TEST_MODE_OPTS="$TEST_MODE_OPTS -sparse_files"
+    fi
+    ;;
+    a)
+    if [ "$OPTARG" == "true" ]; then
+      echo "Testing with io_uring writes"
+      TEST_MODE_OPTS="$TEST_MODE_OPTS -io_uring_writes -enable_checksum"
+    fi
+    ;;
+    t)
+    if [ "$OPTARG" == "true" ]; then
+      echo "Testing with disk writer threads"
+      # small memory cap, so that receiving is paused
+      TEST_MODE_OPTS="$TEST_MODE_OPTS -disk_writer_threads=2 "\
+"-disk_writer_memory_mb=1"
+    fi
+    ;;
+    f)
+    if [ "$OPTARG" == "true" ]; then
+      echo "Testing with background sync"
+      TEST_MODE_OPTS="$TEST_MODE_OPTS -background_sync"
+    fi
+    ;;
+    l)
+    if [ "$OPTARG" == "true" ]; then
+      echo "Testing with background allocation"
+      TEST_MODE_OPTS="$TEST_MODE_OPTS -background_allocation -enable_checksum"
+    fi
+    ;;
+    c)
+    if [ "$OPTARG" == "true" ]; then
+      echo "Testing with fd cache"
+      TEST_MODE_OPTS="$TEST_MODE_OPTS -fd_cache_size=4 -enable_checksum"
+    fi
+    ;;
+    r)
+    if [ "$OPTARG" == "true" ]; then
+      echo "Testing with vectored receive"
+      TEST_MODE_OPTS="$TEST_MODE_OPTS -vectored_receive "\
+"-disk_writer_threads=2 -enable_checksum"
+    fi
+    ;;
+    n)
+    if [ "$OPTARG" == "true" ]; then
+      echo "Testing with connection auto scaling"
+      TEST_MODE_OPTS="$TEST_MODE_OPTS -auto_scale_connections "\
+"-auto_scale_interval_millis=50"
+    fi
+    ;;
+    u)
+    if [ "$OPTARG" == "true" ]; then
+      echo "Testing with congestion control and auto sized buffers"
+      TEST_MODE_OPTS="$TEST_MODE_OPTS -tcp_congestion_control=cubic "\
+"-auto_buffer_size"
+    fi
+    ;;
+    k)
+    if [ "$OPTARG" == "true" ]; then
+      echo "Testing with kernel tls"
+      TEST_MODE_OPTS="$TEST_MODE_OPTS -ktls -encryption_type=aes128gcm "\
+"-zero_copy_send"
+    fi
+    ;;
+    g)
+    if [ "$OPTARG" == "true" ]; then
+      echo "Testing with pipelined encryption"
+      TEST_MODE_OPTS="$TEST_MODE_OPTS -encryption_pipeline "\
+"-encryption_pipeline_chunk_kbytes=16"
+    fi
+    ;;
+    m)
+    if [ "$OPTARG" == "true" ]; then
+      echo "Testing with the receiver runtime"
+      TEST_MODE_OPTS="$TEST_MODE_OPTS -receiver_runtime_threads=2"
+    fi
+    ;;
+    R)
+    if [ "$OPTARG" == "true" ]; then
+      echo "Testing with free space check and batched preparation"
+      TEST_MODE_OPTS="$TEST_MODE_OPTS -check_free_space -stream_manifest "\
+"-manifest_prepare_batch_mb=16"
+    fi
+    ;;
+    M)
+    if [ "$OPTARG" == "true" ]; then
+      echo "Testing with the sender runtime"
+      TEST_MODE_OPTS="$TEST_MODE_OPTS -sender_runtime_threads=2"
+    fi
+    ;;
+    x)
+    if [ "$OPTARG" == "true" ]; then
+      echo "Testing with compression"
+      TEST_MODE_OPTS="$TEST_MODE_OPTS -compression=zstd -enable_checksum"
+    fi
+    ;;
+    D)
+    if [ "$OPTARG" == "true" ]; then
+      echo "Testing with duplicate files"
+      TEST_DEDUP=true
+      TEST_MODE_OPTS="$TEST_MODE_OPTS -dedup_files -dedup_min_file_kbytes=1"
+    fi
+    ;;
+    L)
+    if [ "$OPTARG" == "true" ]; then
+      echo "Testing with local copy"
+      TEST_LOCAL_COPY=true
+    fi
+    ;;
+    C)
+    if [ "$OPTARG" == "true" ]; then
+      echo "Testing with a chain of receivers"
+      TEST_CHAIN=true
+    fi
+    ;;
+    F)
+    if [ "$OPTARG" == "true" ]; then
+      echo "Testing with a receiver forwarding to two receivers"
+      TEST_CHAIN=true
+      TEST_FAN_OUT=true
+    fi
+    ;;
+    S)
+    if [ "$OPTARG" == "true" ]; then
+      echo "Testing with a stream of unknown size"
+      TEST_STREAM=true
+    fi
+    ;;
     h) echo "$usage"
        exit
     ;;
@@ -54,7 +249,7 @@ echo "WDT_TEST_SYMLINKS=$WDT_TEST_SYMLINKS"
 # Normal:
 WDTBIN_OPTS="-minloglevel=0 -sleep_millis 1 -max_retries 999 -full_reporting "\
 "-avg_mbytes_per_sec=3000 -max_mbytes_per_sec=3500 "\
-"-num_ports=4 -throttler_log_time_millis=200"
+"-num_ports=4 -throttler_log_time_millis=200 $TEST_MODE_OPTS"
 extendWdtOptions
 WDTBIN="$WDT_BINARY $WDTBIN_OPTS"
 MD5SUM=`which md5sum`
@@ -96,6 +291,19 @@ do
                  -directory="$DIR/src" -filename="$base.$i" -gen_size_mb="$size"
     done
 done
+if [ "$TEST_SPARSE" == "true" ]; then
+  # holes at the start, in the middle and at the end, and a file of holes only
+  (cd $DIR/src ; truncate -s 40M sparse1; \
+    dd if=$DIR/src/inp1.1 of=sparse1 bs=1M seek=8 conv=notrunc; \
+    dd if=$DIR/src/inp20.1 of=sparse1 bs=1M seek=16 count=4 conv=notrunc; \
+    truncate -s 3M sparse2; truncate -s 20000 sparse3; \
+    dd if=$DIR/src/inp1.2 of=sparse3 bs=1000 seek=11 count=1 conv=notrunc)
+fi
+if [ "$TEST_DEDUP" == "true" ]; then
+  # copies of single and multi block files, and of a file copied twice
+  (cd $DIR/src ; mkdir dups; cp inp20.1 dups/inp20.1; cp inp1.3 dups/a; \
+    cp inp1.3 dups/b; cp inp0.0625.2 dups/inp0.0625.2)
+fi
 echo "done with setup"
 
 if [ $WDT_TEST_SYMLINKS -eq 1 ]; then
@@ -105,18 +313,58 @@ if [ $WDT_TEST_SYMLINKS -eq 1 ]; then
 fi
 
 
-CMD="$WDTBIN -minloglevel=0 -directory $DIR/dst 2> $DIR/server.log | \
+if [ "$TEST_LOCAL_COPY" == "true" ]; then
+  touch $DIR/server.log
+  CMD="$WDTBIN -directory $DIR/src -copy_to $DIR/dst \
+    -odirect_reads=$USE_ODIRECT 2>&1 | tee $DIR/client1.log"
+elif [ "$TEST_CHAIN" == "true" ]; then
+  # the second receiver of the chain prints its url for the first one
+  $WDTBIN -minloglevel=0 -directory $DIR/dst_next > $DIR/next.url \
+    2> $DIR/next_server.log &
+  NEXT_PID=$!
+  while [ ! -s $DIR/next.url ]; do
+    sleep 0.1
+  done
+  NEXT_URL=`head -1 $DIR/next.url`
+  if [ "$TEST_FAN_OUT" == "true" ]; then
+    $WDTBIN -minloglevel=0 -directory $DIR/dst_next2 > $DIR/next2.url \
+      2> $DIR/next2_server.log &
+    NEXT2_PID=$!
+    while [ ! -s $DIR/next2.url ]; do
+      sleep 0.1
+    done
+    NEXT_URL="$NEXT_URL `head -1 $DIR/next2.url`"
+  fi
+  CMD="$WDTBIN -minloglevel=0 -directory $DIR/dst \
+    -forward_url '$NEXT_URL' 2> $DIR/server.log | \
+    $WDTBIN -directory $DIR/src -odirect_reads=$USE_ODIRECT - 2>&1 | \
+    tee $DIR/client1.log"
+else
+  CMD="$WDTBIN -minloglevel=0 -directory $DIR/dst 2> $DIR/server.log | \
     $WDTBIN -directory $DIR/src -odirect_reads=$USE_ODIRECT - 2>&1 | \
     tee $DIR/client1.log"
+fi
 echo "First transfer: $CMD"
 eval $CMD
 STATUS=$?
 # TODO check for $? / crash... though diff will indirectly find that case
+if [ "$TEST_CHAIN" == "true" ]; then
+  wait $NEXT_PID
+fi
+if [ "$TEST_FAN_OUT" == "true" ]; then
+  wait $NEXT2_PID
+fi
 
 if [ $WDT_TEST_SYMLINKS -eq 1 ]; then
-  CMD="$WDTBIN -minloglevel=0 -directory $DIR/dst_symlinks 2>> $DIR/server.log \
-   | $WDTBIN -follow_symlinks -directory $DIR/src \
-    -odirect_reads=$USE_ODIRECT - 2>&1 | tee $DIR/client2.log"
+  if [ "$TEST_LOCAL_COPY" == "true" ]; then
+    CMD="$WDTBIN -follow_symlinks -directory $DIR/src \
+      -copy_to $DIR/dst_symlinks -odirect_reads=$USE_ODIRECT 2>&1 | \
+      tee $DIR/client2.log"
+  else
+    CMD="$WDTBIN -minloglevel=0 -directory $DIR/dst_symlinks \
+      2>> $DIR/server.log | $WDTBIN -follow_symlinks -directory $DIR/src \
+      -odirect_reads=$USE_ODIRECT - 2>&1 | tee $DIR/client2.log"
+  fi
   echo "Second transfer: $CMD"
   eval $CMD
   # TODO check for $? / crash... though diff will indirectly find that case
@@ -137,6 +385,40 @@ if [ $DO_VERIFY -eq 1 ] ; then
     echo "Should be no diff"
     (cd $DIR; diff -u src.md5s dst.md5s)
     STATUS=$?
+    if [ $STATUS -eq 0 ] && [ "$TEST_CHAIN" == "true" ]; then
+      (cd $DIR/dst_next ; ( find . -type f -print0 | xargs -0 $MD5SUM | \
+          sort ) > ../dst_next.md5s )
+      echo "Should be no diff for the second receiver of the chain"
+      (cd $DIR; diff -u src.md5s dst_next.md5s)
+      STATUS=$?
+    fi
+    if [ $STATUS -eq 0 ] && [ "$TEST_FAN_OUT" == "true" ]; then
+      (cd $DIR/dst_next2 ; ( find . -type f -print0 | xargs -0 $MD5SUM | \
+          sort ) > ../dst_next2.md5s )
+      echo "Should be no diff for the third receiver"
+      (cd $DIR; diff -u src.md5s dst_next2.md5s)
+      STATUS=$?
+    fi
+    if [ $STATUS -eq 0 ] && [ "$TEST_STREAM" == "true" ]; then
+      # the receiver prints its url on stderr, stdout gets the stream
+      mkdir -p $DIR/dst_untar
+      ($WDTBIN -minloglevel=0 -directory $DIR/dst_stream \
+        -stream_output src.tar 2> $DIR/stream_server.log | \
+        (cd $DIR/dst_untar && tar xf -)) &
+      STREAM_PID=$!
+      while ! grep -q '^wdt://' $DIR/stream_server.log 2> /dev/null; do
+        sleep 0.1
+      done
+      STREAM_URL=`grep -m 1 '^wdt://' $DIR/stream_server.log`
+      (cd $DIR/src && tar cf - .) | $WDTBIN -stream_name src.tar \
+        -connection_url "$STREAM_URL" 2>&1 | tee $DIR/client_stream.log
+      wait $STREAM_PID
+      (cd $DIR/dst_untar ; ( find . -type f -print0 | xargs -0 $MD5SUM | \
+          sort ) > ../dst_untar.md5s )
+      echo "Should be no diff for the files streamed"
+      (cd $DIR; diff -u src.md5s dst_untar.md5s)
+      STATUS=$?
+    fi
 
 
   if [ $WDT_TEST_SYMLINKS -eq 1 ]; then
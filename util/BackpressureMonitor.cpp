@@ -0,0 +1,90 @@
+/**
+ * Copyright (c) 2014-present, Facebook, Inc.
+ * All rights reserved.
+ *
+ * This source code is licensed under the BSD-style license found in the
+ * LICENSE file in the root directory of this source tree. An additional grant
+ * of patent rights can be found in the PATENTS file in the same directory.
+ */
+#include <wdt/util/BackpressureMonitor.h>
+
+#include <algorithm>
+
+namespace facebook {
+namespace wdt {
+
+/// queue fill ratio of the disk writer pool from which the disks are behind
+const double kHighFillRatio = 0.9;
+/// target rate is this fraction of the rate written when the disks are behind
+const double kDecreaseFactor = 0.8;
+/// target rate increase per interval while the disks keep up, as a fraction
+/// of the target of the last decrease
+const double kIncreaseStepRatio = 0.1;
+/// the limit is dropped once the target is this many times the rate written
+const double kReleaseFactor = 2;
+/// the sender is never asked to go slower than this
+const int64_t kMinTargetRate = 1024 * 1024;
+
+BackpressureMonitor::BackpressureMonitor(const WdtOptions &options,
+                                         DiskWriterPool *diskWriterPool)
+    : maxWriteLatencyMicros_(options.backpressure_max_write_latency_millis *
+                             1000),
+      intervalMillis_(options.backpressure_interval_millis),
+      diskWriterPool_(diskWriterPool),
+      intervalStart_(Clock::now()) {
+}
+
+void BackpressureMonitor::recordWrite(int64_t bytes, int64_t blockedMicros) {
+  bytes_ += bytes;
+  blockedMicros_ += blockedMicros;
+  numWrites_++;
+}
+
+int64_t BackpressureMonitor::getTargetRate() {
+  std::unique_lock<std::mutex> lock(lock_, std::try_to_lock);
+  if (lock.owns_lock()) {
+    const auto now = Clock::now();
+    if (durationMillis(now - intervalStart_) >= intervalMillis_) {
+      update(now);
+    }
+  }
+  return targetRate_;
+}
+
+void BackpressureMonitor::update(const Clock::time_point &now) {
+  const double elapsedSecs = durationSeconds(now - intervalStart_);
+  intervalStart_ = now;
+  const int64_t bytes = bytes_.exchange(0);
+  const int64_t numWrites = numWrites_.exchange(0);
+  const int64_t blockedMicros = blockedMicros_.exchange(0);
+  if (numWrites == 0 || elapsedSecs <= 0) {
+    // nothing written, nothing learnt about the disks
+    return;
+  }
+  const int64_t latencyMicros = blockedMicros / numWrites;
+  const double fillRatio =
+      diskWriterPool_ ? diskWriterPool_->getFillRatio() : 0;
+  const double writtenRate = bytes / elapsedSecs;
+  int64_t targetRate = targetRate_;
+  if (latencyMicros > maxWriteLatencyMicros_ || fillRatio >= kHighFillRatio) {
+    double rate = writtenRate;
+    if (targetRate > 0) {
+      rate = std::min<double>(rate, targetRate);
+    }
+    targetRate = std::max<int64_t>(kMinTargetRate, rate * kDecreaseFactor);
+    increaseStep_ = std::max<int64_t>(1, targetRate * kIncreaseStepRatio);
+    WLOG(WARNING) << "Disks falling behind, write latency " << latencyMicros
+                  << " us, write queue fill " << fillRatio
+                  << ", asking the sender for " << targetRate << " bytes/sec";
+  } else if (targetRate > 0 && latencyMicros < maxWriteLatencyMicros_ / 2 &&
+             fillRatio < kHighFillRatio / 2) {
+    targetRate += increaseStep_;
+    if (targetRate > kReleaseFactor * writtenRate) {
+      WLOG(INFO) << "Disks caught up, removing the sender rate limit";
+      targetRate = 0;
+    }
+  }
+  targetRate_ = targetRate;
+}
+}
+}
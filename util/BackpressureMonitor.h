@@ -0,0 +1,82 @@
+/**
+ * Copyright (c) 2014-present, Facebook, Inc.
+ * All rights reserved.
+ *
+ * This source code is licensed under the BSD-style license found in the
+ * LICENSE file in the root directory of this source tree. An additional grant
+ * of patent rights can be found in the PATENTS file in the same directory.
+ */
+#pragma once
+
+#include <wdt/Reporting.h>
+#include <wdt/WdtOptions.h>
+#include <wdt/util/DiskWriterPool.h>
+
+#include <atomic>
+#include <mutex>
+
+namespace facebook {
+namespace wdt {
+
+/**
+ * Derives the rate a receiver can sustain from how its disks keep up, so that
+ * the sender slows down before the receiver threads stop reading their
+ * sockets long enough for the sender to time out. The disks are behind when
+ * the receiver threads block in the writes for more than
+ * backpressure_max_write_latency_millis on average, or when the queue of the
+ * disk writer pool is almost full. The target rate then decreases
+ * multiplicatively from the rate actually written, and increases back
+ * additively, by a fixed step per interval, while the disks keep up, till it
+ * is no longer needed (AIMD). Shared by all the receiver
+ * threads of a receiver, all the methods are thread safe.
+ */
+class BackpressureMonitor {
+ public:
+  /**
+   * @param options           options to use
+   * @param diskWriterPool    pool whose queue depth is watched, can be
+   *                          nullptr
+   */
+  BackpressureMonitor(const WdtOptions &options,
+                      DiskWriterPool *diskWriterPool);
+
+  /**
+   * Records data handed to the disk by a receiver thread
+   *
+   * @param bytes           size of the data
+   * @param blockedMicros   time the thread was blocked writing it
+   */
+  void recordWrite(int64_t bytes, int64_t blockedMicros);
+
+  /**
+   * @return    rate in bytes/sec the sender should not exceed, 0 for no
+   *            limit. Updated at most once per backpressure_interval_millis
+   */
+  int64_t getTargetRate();
+
+ private:
+  /// computes the target rate for the interval ending now, lock_ must be held
+  void update(const Clock::time_point &now);
+
+  const int64_t maxWriteLatencyMicros_;
+  const int64_t intervalMillis_;
+  DiskWriterPool *const diskWriterPool_;
+
+  /// data written in the current interval
+  std::atomic<int64_t> bytes_{0};
+  /// number of writes in the current interval
+  std::atomic<int64_t> numWrites_{0};
+  /// time blocked writing in the current interval
+  std::atomic<int64_t> blockedMicros_{0};
+  /// target rate computed for the last interval
+  std::atomic<int64_t> targetRate_{0};
+
+  std::mutex lock_;
+  /// start of the current interval
+  Clock::time_point intervalStart_;
+  /// additive increase of the target rate per interval, set from the target
+  /// of the last decrease. Guarded by lock_
+  int64_t increaseStep_{0};
+};
+}
+}
@@ -0,0 +1,229 @@
+/**
+ * Copyright (c) 2014-present, Facebook, Inc.
+ * All rights reserved.
+ *
+ * This source code is licensed under the BSD-style license found in the
+ * LICENSE file in the root directory of this source tree. An additional grant
+ * of patent rights can be found in the PATENTS file in the same directory.
+ */
+#include <wdt/util/BandwidthScheduler.h>
+
+#include <wdt/Reporting.h>
+
+#include <algorithm>
+#include <cmath>
+
+namespace facebook {
+namespace wdt {
+
+/// a transfer using less than this part of its rate has a demand of its own
+const double kBusyRatio = 0.9;
+/// rate given to a transfer over what it used, for it to grow its share
+const double kDemandHeadroom = 1.25;
+/// min demand of an active transfer, as a part of the total rate
+const double kMinDemandRatio = 0.01;
+/// changes of the rate of a transfer smaller than this part are ignored, each
+/// change resets its throttler
+const double kMinChangeRatio = 0.05;
+
+std::vector<double> BandwidthScheduler::shareRate(
+    double totalRate, const std::vector<Share> &shares) {
+  std::vector<double> rates(shares.size(), 0);
+  std::vector<bool> satisfied(shares.size(), false);
+  double remainingRate = totalRate;
+  while (true) {
+    double sumWeights = 0;
+    for (size_t i = 0; i < shares.size(); i++) {
+      if (!satisfied[i]) {
+        sumWeights += shares[i].weight;
+      }
+    }
+    if (sumWeights <= 0) {
+      break;
+    }
+    const double ratePerWeight = remainingRate / sumWeights;
+    // the transfers wanting less than their weighted share get what they
+    // want, the rest is shared again between the others
+    bool anySatisfied = false;
+    for (size_t i = 0; i < shares.size(); i++) {
+      const Share &share = shares[i];
+      if (!satisfied[i] && share.demand >= 0 &&
+          share.demand <= share.weight * ratePerWeight) {
+        rates[i] = share.demand;
+        remainingRate -= share.demand;
+        satisfied[i] = true;
+        anySatisfied = true;
+      }
+    }
+    if (anySatisfied) {
+      continue;
+    }
+    for (size_t i = 0; i < shares.size(); i++) {
+      if (!satisfied[i]) {
+        rates[i] = shares[i].weight * ratePerWeight;
+      }
+    }
+    break;
+  }
+  return rates;
+}
+
+BandwidthScheduler::Registration::Registration(
+    std::shared_ptr<BandwidthScheduler> scheduler, int64_t id)
+    : scheduler_(std::move(scheduler)), id_(id) {
+}
+
+BandwidthScheduler::Registration::~Registration() {
+  scheduler_->removeTransfer(id_);
+}
+
+void BandwidthScheduler::Registration::setWeight(double weight) {
+  scheduler_->setTransferWeight(id_, weight);
+}
+
+BandwidthScheduler::BandwidthScheduler(std::shared_ptr<Throttler> throttler,
+                                       int64_t intervalMillis)
+    : throttler_(std::move(throttler)), intervalMillis_(intervalMillis) {
+  if (intervalMillis_ > 0) {
+    updateThread_ = std::thread(&BandwidthScheduler::updateLoop, this);
+  }
+}
+
+BandwidthScheduler::~BandwidthScheduler() {
+  {
+    std::lock_guard<std::mutex> lock(mutex_);
+    stopped_ = true;
+    stopCond_.notify_all();
+  }
+  if (updateThread_.joinable()) {
+    updateThread_.join();
+  }
+}
+
+std::unique_ptr<BandwidthScheduler::Registration>
+BandwidthScheduler::addTransfer(std::shared_ptr<Throttler> throttler,
+                                const std::string &group, double weight) {
+  Transfer transfer;
+  transfer.maxRate = throttler->getAvgRatePerSec();
+  transfer.throttler = std::move(throttler);
+  transfer.group = group;
+  transfer.weight = weight > 0 ? weight : 1;
+  transfer.lastUpdateTime = Clock::now();
+  std::lock_guard<std::mutex> lock(mutex_);
+  const int64_t id = nextId_++;
+  transfers_.emplace(id, std::move(transfer));
+  return std::make_unique<Registration>(shared_from_this(), id);
+}
+
+void BandwidthScheduler::removeTransfer(int64_t id) {
+  std::lock_guard<std::mutex> lock(mutex_);
+  transfers_.erase(id);
+}
+
+void BandwidthScheduler::setTransferWeight(int64_t id, double weight) {
+  if (weight <= 0) {
+    WLOG(ERROR) << "Ignoring the weight " << weight << ", it has to be > 0";
+    return;
+  }
+  std::lock_guard<std::mutex> lock(mutex_);
+  auto it = transfers_.find(id);
+  if (it != transfers_.end()) {
+    it->second.weight = weight;
+  }
+}
+
+void BandwidthScheduler::setGroupWeight(const std::string &group,
+                                        double weight) {
+  if (weight <= 0) {
+    WLOG(ERROR) << "Ignoring the weight " << weight << " of " << group
+                << ", it has to be > 0";
+    return;
+  }
+  std::lock_guard<std::mutex> lock(mutex_);
+  groupWeights_[group] = weight;
+}
+
+double BandwidthScheduler::getGroupWeightLocked(
+    const std::string &group) const {
+  auto it = groupWeights_.find(group);
+  return it == groupWeights_.end() ? 1 : it->second;
+}
+
+void BandwidthScheduler::updateShares() {
+  const double totalRate = throttler_->getAvgRatePerSec();
+  if (totalRate <= 0) {
+    // nothing to share, the transfers keep the rates they have
+    return;
+  }
+  const Clock::time_point now = Clock::now();
+  std::lock_guard<std::mutex> lock(mutex_);
+  std::vector<Transfer *> active;
+  std::unordered_map<std::string, double> groupSumWeights;
+  for (auto &it : transfers_) {
+    Transfer &transfer = it.second;
+    if (transfer.throttler->getNumTransfers() <= 0) {
+      // not started or done, its share goes to the others
+      transfer.rate = -1;
+      continue;
+    }
+    active.push_back(&transfer);
+    groupSumWeights[transfer.group] += transfer.weight;
+  }
+  std::vector<Share> shares(active.size());
+  std::vector<double> progresses(active.size());
+  for (size_t i = 0; i < active.size(); i++) {
+    const Transfer &transfer = *active[i];
+    Share &share = shares[i];
+    share.weight = getGroupWeightLocked(transfer.group) * transfer.weight /
+                   groupSumWeights[transfer.group];
+    // the progress restarts from 0 when the throttler is reset
+    const double progress = transfer.throttler->getProgress();
+    const double delta = progress >= transfer.lastProgress
+                             ? progress - transfer.lastProgress
+                             : progress;
+    progresses[i] = progress;
+    const int64_t elapsedMicros = durationMicros(now - transfer.lastUpdateTime);
+    if (transfer.rate > 0 && elapsedMicros > 0) {
+      const double usedRate = delta * kMicroToSec / elapsedMicros;
+      if (usedRate < kBusyRatio * transfer.rate) {
+        share.demand = std::max(usedRate * kDemandHeadroom,
+                                kMinDemandRatio * totalRate);
+      }
+    }
+    if (transfer.maxRate > 0) {
+      share.demand = share.demand < 0
+                         ? transfer.maxRate
+                         : std::min(share.demand, transfer.maxRate);
+    }
+  }
+  const std::vector<double> rates = shareRate(totalRate, shares);
+  for (size_t i = 0; i < active.size(); i++) {
+    Transfer &transfer = *active[i];
+    transfer.lastUpdateTime = now;
+    transfer.lastProgress = progresses[i];
+    if (transfer.rate > 0 &&
+        std::abs(rates[i] - transfer.rate) <= kMinChangeRatio * transfer.rate) {
+      continue;
+    }
+    WVLOG(1) << "Rate of a transfer of " << transfer.group << " changed from "
+             << transfer.rate << " to " << rates[i];
+    transfer.throttler->setAvgRatePerSec(rates[i]);
+    transfer.rate = rates[i];
+    transfer.lastProgress = 0;
+  }
+}
+
+void BandwidthScheduler::updateLoop() {
+  std::unique_lock<std::mutex> lock(mutex_);
+  while (!stopped_) {
+    stopCond_.wait_for(lock, std::chrono::milliseconds(intervalMillis_));
+    if (stopped_) {
+      break;
+    }
+    lock.unlock();
+    updateShares();
+    lock.lock();
+  }
+}
+}
+}
@@ -0,0 +1,147 @@
+/**
+ * Copyright (c) 2014-present, Facebook, Inc.
+ * All rights reserved.
+ *
+ * This source code is licensed under the BSD-style license found in the
+ * LICENSE file in the root directory of this source tree. An additional grant
+ * of patent rights can be found in the PATENTS file in the same directory.
+ */
+#pragma once
+
+#include <wdt/Throttler.h>
+
+#include <condition_variable>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <thread>
+#include <unordered_map>
+#include <vector>
+
+namespace facebook {
+namespace wdt {
+
+/**
+ * Shares the rate of a throttler between the transfers using it, by weight.
+ * The transfers throttling with children of the same throttler otherwise
+ * take its tokens first come first served, so that the transfer with the
+ * most threads gets most of the rate. The scheduler periodically sets the
+ * average rate of the throttler of each active transfer to its weighted
+ * max-min fair share of the total: a transfer using less than its share
+ * keeps what it uses (and some more to grow), and the rest is split between
+ * the others, so that no rate is lost to idle or slow transfers. Transfers
+ * are put in groups (e.g. their namespace) which share the total by the
+ * weight of the group first, then the transfers of a group share its part by
+ * their own weight.
+ */
+class BandwidthScheduler
+    : public std::enable_shared_from_this<BandwidthScheduler> {
+ public:
+  /// what a transfer gets a share of the total for
+  struct Share {
+    double weight{1};
+    /// rate the transfer can use, < 0 for any
+    double demand{-1};
+  };
+
+  /**
+   * Weighted max-min fair sharing (water filling) of a total rate
+   *
+   * @param totalRate   rate shared
+   * @param shares      weights and demands of the transfers
+   *
+   * @return            rate of each transfer, in the order of shares
+   */
+  static std::vector<double> shareRate(double totalRate,
+                                       const std::vector<Share> &shares);
+
+  /// a transfer scheduled, removed from the scheduler when destroyed
+  class Registration {
+   public:
+    Registration(std::shared_ptr<BandwidthScheduler> scheduler, int64_t id);
+
+    ~Registration();
+
+    /// changes the weight of the transfer within its group
+    void setWeight(double weight);
+
+    Registration(const Registration &that) = delete;
+    Registration &operator=(const Registration &that) = delete;
+
+   private:
+    std::shared_ptr<BandwidthScheduler> scheduler_;
+    const int64_t id_;
+  };
+
+  /**
+   * @param throttler       throttler whose average rate is shared, the
+   *                        throttlers of the transfers are its descendants
+   * @param intervalMillis  interval between the updates of the shares, the
+   *                        periodic updates are disabled if <= 0
+   */
+  BandwidthScheduler(std::shared_ptr<Throttler> throttler,
+                     int64_t intervalMillis);
+
+  /// stops the update thread
+  ~BandwidthScheduler();
+
+  /**
+   * Adds a transfer to schedule
+   *
+   * @param throttler   throttler of the transfer alone, its rate is set by
+   *                    the scheduler. The rate it was made with, if any,
+   *                    is the max share of the transfer
+   * @param group       group of the transfer
+   * @param weight      weight of the transfer within its group
+   *
+   * @return            registration of the transfer
+   */
+  std::unique_ptr<Registration> addTransfer(
+      std::shared_ptr<Throttler> throttler, const std::string &group,
+      double weight = 1);
+
+  /// sets the weight of a group, 1 by default
+  void setGroupWeight(const std::string &group, double weight);
+
+  /// updates the shares of the transfers, called periodically
+  void updateShares();
+
+ private:
+  struct Transfer {
+    std::shared_ptr<Throttler> throttler;
+    std::string group;
+    double weight{1};
+    /// max rate of the transfer, <= 0 for none
+    double maxRate{-1};
+    /// rate set by the scheduler, <= 0 if not set yet
+    double rate{-1};
+    /// progress of the throttler at the last update
+    double lastProgress{0};
+    Clock::time_point lastUpdateTime;
+  };
+
+  /// removes a transfer, called by its registration
+  void removeTransfer(int64_t id);
+
+  /// sets the weight of a transfer, called by its registration
+  void setTransferWeight(int64_t id, double weight);
+
+  /// has to be called with mutex_ held
+  double getGroupWeightLocked(const std::string &group) const;
+
+  /// main loop of the update thread
+  void updateLoop();
+
+  const std::shared_ptr<Throttler> throttler_;
+  const int64_t intervalMillis_;
+  std::mutex mutex_;
+  std::unordered_map<int64_t, Transfer> transfers_;
+  std::unordered_map<std::string, double> groupWeights_;
+  int64_t nextId_{0};
+  bool stopped_{false};
+  /// notified to stop the update thread
+  std::condition_variable stopCond_;
+  std::thread updateThread_;
+};
+}
+}
@@ -0,0 +1,193 @@
+/**
+ * Copyright (c) 2014-present, Facebook, Inc.
+ * All rights reserved.
+ *
+ * This source code is licensed under the BSD-style license found in the
+ * LICENSE file in the root directory of this source tree. An additional grant
+ * of patent rights can be found in the PATENTS file in the same directory.
+ */
+#include <wdt/util/BlockChecksum.h>
+
+#include <wdt/ErrorCodes.h>
+
+#include <folly/Conv.h>
+#include <folly/hash/Checksum.h>
+#include <folly/lang/Bits.h>
+
+#ifdef WDT_HAS_XXHASH
+#define XXH_INLINE_ALL
+#include <xxhash.h>
+#endif
+
+namespace facebook {
+namespace wdt {
+
+const char *const kChecksumTypeDescriptions[] = {"crc32c", "xxh3"};
+
+static_assert(NUM_CHECKSUM_TYPES ==
+                  sizeof(kChecksumTypeDescriptions) /
+                      sizeof(kChecksumTypeDescriptions[0]),
+              "must provide description for all checksum types");
+
+/// reflected crc32c polynomial
+const uint32_t kCrc32cPolynomial = 0x82F63B78;
+
+std::string checksumTypeToStr(ChecksumType checksumType) {
+  if (checksumType >= NUM_CHECKSUM_TYPES) {
+    WLOG(ERROR) << "Unknown checksum type " << checksumType;
+    return folly::to<std::string>(checksumType);
+  }
+  return kChecksumTypeDescriptions[checksumType];
+}
+
+ChecksumType parseChecksumType(const std::string &str) {
+  for (int i = 0; i < NUM_CHECKSUM_TYPES; i++) {
+    if (str == kChecksumTypeDescriptions[i]) {
+      return static_cast<ChecksumType>(i);
+    }
+  }
+  WLOG(WARNING) << "Unknown checksum type " << str
+                << ", defaulting to crc32c";
+  return CHECKSUM_CRC32C;
+}
+
+bool isChecksumTypeSupported(ChecksumType checksumType) {
+  switch (checksumType) {
+    case CHECKSUM_CRC32C:
+      return true;
+    case CHECKSUM_XXH3_64:
+#ifdef WDT_HAS_XXHASH
+      return true;
+#else
+      return false;
+#endif
+    default:
+      return false;
+  }
+}
+
+BlockChecksum::BlockChecksum(ChecksumType type) : type_(type) {
+  WDT_CHECK(isChecksumTypeSupported(type_))
+      << "Unsupported checksum type " << checksumTypeToStr(type_);
+#ifdef WDT_HAS_XXHASH
+  if (type_ == CHECKSUM_XXH3_64) {
+    xxh3State_ = XXH3_createState();
+    WDT_CHECK(xxh3State_ != nullptr);
+  }
+#endif
+  reset();
+}
+
+BlockChecksum::~BlockChecksum() {
+#ifdef WDT_HAS_XXHASH
+  XXH3_freeState(static_cast<XXH3_state_t *>(xxh3State_));
+#endif
+}
+
+void BlockChecksum::reset() {
+  crc_ = 0;
+#ifdef WDT_HAS_XXHASH
+  if (xxh3State_ != nullptr) {
+    XXH3_64bits_reset(static_cast<XXH3_state_t *>(xxh3State_));
+  }
+#endif
+}
+
+void BlockChecksum::update(const char *data, int64_t size) {
+  if (type_ == CHECKSUM_CRC32C) {
+    crc_ = folly::crc32c((const uint8_t *)data, size, crc_);
+    return;
+  }
+#ifdef WDT_HAS_XXHASH
+  XXH3_64bits_update(static_cast<XXH3_state_t *>(xxh3State_), data, size);
+#endif
+}
+
+int64_t BlockChecksum::getValue() const {
+  if (type_ == CHECKSUM_CRC32C) {
+    return (int32_t)crc_;
+  }
+#ifdef WDT_HAS_XXHASH
+  return (int64_t)XXH3_64bits_digest(
+      static_cast<const XXH3_state_t *>(xxh3State_));
+#else
+  return 0;
+#endif
+}
+
+/// @return   vec multiplied by the 32x32 matrix over GF(2)
+static uint32_t gf2MatrixTimes(const uint32_t *mat, uint32_t vec) {
+  uint32_t sum = 0;
+  while (vec) {
+    if (vec & 1) {
+      sum ^= *mat;
+    }
+    vec >>= 1;
+    mat++;
+  }
+  return sum;
+}
+
+static void gf2MatrixSquare(uint32_t *square, const uint32_t *mat) {
+  for (int n = 0; n < 32; n++) {
+    square[n] = gf2MatrixTimes(mat, mat[n]);
+  }
+}
+
+/// crc of the data of both pieces, by appending as many zeros to the first
+/// crc as there are bytes in the second piece (as zlib's crc32_combine)
+static uint32_t crc32cCombine(uint32_t crc1, uint32_t crc2, int64_t len2) {
+  if (len2 <= 0) {
+    return crc1;
+  }
+  uint32_t even[32];
+  uint32_t odd[32];
+  // operator for one zero bit
+  odd[0] = kCrc32cPolynomial;
+  uint32_t row = 1;
+  for (int n = 1; n < 32; n++) {
+    odd[n] = row;
+    row <<= 1;
+  }
+  // operators for two and four zero bits
+  gf2MatrixSquare(even, odd);
+  gf2MatrixSquare(odd, even);
+  // each square doubles the zeros, the first one being for a zero byte
+  while (true) {
+    gf2MatrixSquare(even, odd);
+    if (len2 & 1) {
+      crc1 = gf2MatrixTimes(even, crc1);
+    }
+    len2 >>= 1;
+    if (len2 == 0) {
+      break;
+    }
+    gf2MatrixSquare(odd, even);
+    if (len2 & 1) {
+      crc1 = gf2MatrixTimes(odd, crc1);
+    }
+    len2 >>= 1;
+    if (len2 == 0) {
+      break;
+    }
+  }
+  return crc1 ^ crc2;
+}
+
+int64_t BlockChecksum::combine(ChecksumType type, int64_t first,
+                               int64_t second, int64_t secondSize) {
+  if (type == CHECKSUM_CRC32C) {
+    return (int32_t)crc32cCombine((uint32_t)first, (uint32_t)second,
+                                  secondSize);
+  }
+#ifdef WDT_HAS_XXHASH
+  const uint64_t littleEndianSecond = folly::Endian::little((uint64_t)second);
+  return (int64_t)XXH3_64bits_withSeed(&littleEndianSecond,
+                                       sizeof(littleEndianSecond),
+                                       (uint64_t)first);
+#else
+  return 0;
+#endif
+}
+}
+}
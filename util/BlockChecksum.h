@@ -0,0 +1,89 @@
+/**
+ * Copyright (c) 2014-present, Facebook, Inc.
+ * All rights reserved.
+ *
+ * This source code is licensed under the BSD-style license found in the
+ * LICENSE file in the root directory of this source tree. An additional grant
+ * of patent rights can be found in the PATENTS file in the same directory.
+ */
+#pragma once
+
+#include <cstdint>
+#include <string>
+
+namespace facebook {
+namespace wdt {
+
+/// algorithm of the checksum footers, sent in the settings
+enum ChecksumType { CHECKSUM_CRC32C, CHECKSUM_XXH3_64, NUM_CHECKSUM_TYPES };
+
+/// @return  string description for checksum type
+std::string checksumTypeToStr(ChecksumType checksumType);
+
+/// @return  checksum type for the input string
+ChecksumType parseChecksumType(const std::string &str);
+
+/// @return  whether this build can compute checksums of the type
+bool isChecksumTypeSupported(ChecksumType checksumType);
+
+/**
+ * Checksum of the data of a block, computed incrementally as the chunks of
+ * the block are sent or received. crc32c uses the crc instructions of the
+ * cpu when it has them (SSE4.2). The checksums of consecutive data can
+ * be combined without going over the data again, which gives the checksum of
+ * a whole file from the checksums of its blocks. Not thread safe.
+ */
+class BlockChecksum {
+ public:
+  /// @param type   type of checksum, must be supported
+  explicit BlockChecksum(ChecksumType type);
+
+  ~BlockChecksum();
+
+  /// @return   type of checksum
+  ChecksumType getType() const {
+    return type_;
+  }
+
+  /// starts the checksum of a new block
+  void reset();
+
+  /// @param data   next data of the block
+  /// @param size   length of the data
+  void update(const char *data, int64_t size);
+
+  /**
+   * @return    checksum of the data so far, as sent in the footer. A crc32c
+   *            is sign extended from 32 bits for compatibility with the
+   *            footers of older versions
+   */
+  int64_t getValue() const;
+
+  /**
+   * Combines the checksums of two consecutive pieces of data. For crc32c the
+   * result is the crc32c of the concatenated data. xxh3 can't be combined,
+   * the result is then a hash of the two checksums, which still only matches
+   * for the same pieces in the same order
+   *
+   * @param type        type of the checksums
+   * @param first       checksum of the first piece, 0 for an empty one
+   * @param second      checksum of the second piece
+   * @param secondSize  length of the second piece
+   *
+   * @return            checksum of the data of both pieces
+   */
+  static int64_t combine(ChecksumType type, int64_t first, int64_t second,
+                         int64_t secondSize);
+
+  BlockChecksum(const BlockChecksum &) = delete;
+  BlockChecksum &operator=(const BlockChecksum &) = delete;
+
+ private:
+  ChecksumType type_;
+  /// crc32c so far, not finalized
+  uint32_t crc_{0};
+  /// XXH3_state_t, allocated for xxh3
+  void *xxh3State_{nullptr};
+};
+}
+}
@@ -0,0 +1,223 @@
+/**
+ * Copyright (c) 2014-present, Facebook, Inc.
+ * All rights reserved.
+ *
+ * This source code is licensed under the BSD-style license found in the
+ * LICENSE file in the root directory of this source tree. An additional grant
+ * of patent rights can be found in the PATENTS file in the same directory.
+ */
+#include <wdt/util/BlockCompressor.h>
+
+#include <wdt/ErrorCodes.h>
+
+#include <folly/Conv.h>
+#include <algorithm>
+
+#ifdef WDT_HAS_LZ4
+#include <lz4.h>
+#endif
+#ifdef WDT_HAS_ZSTD
+#include <zstd.h>
+#endif
+
+namespace facebook {
+namespace wdt {
+
+const char *const kCompressionTypeDescriptions[] = {"none", "lz4", "zstd"};
+
+static_assert(NUM_COMP_TYPES ==
+                  sizeof(kCompressionTypeDescriptions) /
+                      sizeof(kCompressionTypeDescriptions[0]),
+              "must provide description for all compression types");
+
+/// length of the sample compressed to decide whether to turn compression on
+const int64_t kCompressionSampleLen = 4 * 1024;
+/// bytes sent raw before the first sample once compression turned off
+const int64_t kMinProbeInterval = 4 * 1024 * 1024;
+const int64_t kMaxProbeInterval = 256 * 1024 * 1024;
+
+std::string compressionTypeToStr(CompressionType compressionType) {
+  if (compressionType >= NUM_COMP_TYPES) {
+    WLOG(ERROR) << "Unknown compression type " << compressionType;
+    return folly::to<std::string>(compressionType);
+  }
+  return kCompressionTypeDescriptions[compressionType];
+}
+
+CompressionType parseCompressionType(const std::string &str) {
+  for (int i = 0; i < NUM_COMP_TYPES; i++) {
+    if (str == kCompressionTypeDescriptions[i]) {
+      return static_cast<CompressionType>(i);
+    }
+  }
+  WLOG(WARNING) << "Unknown compression type " << str << ", defaulting to none";
+  return COMP_NONE;
+}
+
+bool isCompressionTypeSupported(CompressionType compressionType) {
+  switch (compressionType) {
+    case COMP_NONE:
+      return true;
+    case COMP_LZ4:
+#ifdef WDT_HAS_LZ4
+      return true;
+#else
+      return false;
+#endif
+    case COMP_ZSTD:
+#ifdef WDT_HAS_ZSTD
+      return true;
+#else
+      return false;
+#endif
+    default:
+      return false;
+  }
+}
+
+BlockCompressor::BlockCompressor(CompressionType type, int level,
+                                 int minSavingsPercent)
+    : type_(type),
+      level_(level),
+      minSavingsPercent_(minSavingsPercent),
+      probeInterval_(kMinProbeInterval) {
+  WDT_CHECK(type_ != COMP_NONE && isCompressionTypeSupported(type_))
+      << "Unsupported compression type " << compressionTypeToStr(type_);
+}
+
+BlockCompressor::~BlockCompressor() {
+#ifdef WDT_HAS_ZSTD
+  ZSTD_freeCCtx(static_cast<ZSTD_CCtx *>(zstdCCtx_));
+  ZSTD_freeDCtx(static_cast<ZSTD_DCtx *>(zstdDCtx_));
+#endif
+}
+
+CompressionType BlockCompressor::getType() const {
+  return type_;
+}
+
+bool BlockCompressor::shouldCompressBlock() const {
+  return enabled_ || bytesUntilProbe_ <= 0;
+}
+
+int64_t BlockCompressor::getMaxCompressedLen(int64_t rawSize) const {
+  switch (type_) {
+#ifdef WDT_HAS_LZ4
+    case COMP_LZ4:
+      return LZ4_compressBound(rawSize);
+#endif
+#ifdef WDT_HAS_ZSTD
+    case COMP_ZSTD:
+      return ZSTD_compressBound(rawSize);
+#endif
+    default:
+      return rawSize;
+  }
+}
+
+int64_t BlockCompressor::compress(const char *src, int64_t size) {
+  compressed_.resize(std::max<int64_t>(compressed_.size(),
+                                       getMaxCompressedLen(size)));
+  switch (type_) {
+#ifdef WDT_HAS_LZ4
+    case COMP_LZ4: {
+      const int compressedSize =
+          LZ4_compress_fast(src, compressed_.data(), size, compressed_.size(),
+                            std::max(1, level_));
+      return (compressedSize > 0 ? compressedSize : -1);
+    }
+#endif
+#ifdef WDT_HAS_ZSTD
+    case COMP_ZSTD: {
+      if (zstdCCtx_ == nullptr) {
+        zstdCCtx_ = ZSTD_createCCtx();
+        if (zstdCCtx_ == nullptr) {
+          WLOG(ERROR) << "Unable to create zstd compression context";
+          return -1;
+        }
+      }
+      const size_t compressedSize = ZSTD_compressCCtx(
+          static_cast<ZSTD_CCtx *>(zstdCCtx_), compressed_.data(),
+          compressed_.size(), src, size, level_);
+      return (ZSTD_isError(compressedSize) ? -1 : compressedSize);
+    }
+#endif
+    default:
+      return -1;
+  }
+}
+
+bool BlockCompressor::savesEnough(int64_t size, int64_t compressedSize) const {
+  return compressedSize >= 0 &&
+         compressedSize * 100 <= size * (100 - minSavingsPercent_);
+}
+
+const char *BlockCompressor::compressFrame(const char *src, int64_t size,
+                                           int64_t &compressedSize) {
+  if (!enabled_) {
+    if (bytesUntilProbe_ > 0) {
+      bytesUntilProbe_ -= size;
+      return nullptr;
+    }
+    // quick look at the start of the frame before compressing all of it
+    const int64_t sampleLen = std::min(size, kCompressionSampleLen);
+    if (sampleLen < size && !savesEnough(sampleLen, compress(src, sampleLen))) {
+      probeInterval_ = std::min(2 * probeInterval_, kMaxProbeInterval);
+      bytesUntilProbe_ = probeInterval_ - size;
+      return nullptr;
+    }
+  }
+  compressedSize = compress(src, size);
+  const bool worthIt = savesEnough(size, compressedSize);
+  if (worthIt != enabled_) {
+    WVLOG(1) << "Turning " << compressionTypeToStr(type_) << " compression "
+             << (worthIt ? "on" : "off") << ", " << size << " bytes frame "
+             << "compressed to " << compressedSize;
+  }
+  if (worthIt) {
+    enabled_ = true;
+    probeInterval_ = kMinProbeInterval;
+  } else {
+    enabled_ = false;
+    bytesUntilProbe_ = probeInterval_;
+  }
+  // a frame which still got smaller is better sent compressed
+  if (compressedSize < 0 || compressedSize >= size) {
+    return nullptr;
+  }
+  return compressed_.data();
+}
+
+void BlockCompressor::skipUncompressed(int64_t size) {
+  bytesUntilProbe_ -= size;
+}
+
+bool BlockCompressor::decompressFrame(const char *src, int64_t size,
+                                      char *dest, int64_t rawSize) {
+  switch (type_) {
+#ifdef WDT_HAS_LZ4
+    case COMP_LZ4:
+      return LZ4_decompress_safe(src, dest, size, rawSize) == rawSize;
+#endif
+#ifdef WDT_HAS_ZSTD
+    case COMP_ZSTD: {
+      if (zstdDCtx_ == nullptr) {
+        zstdDCtx_ = ZSTD_createDCtx();
+        if (zstdDCtx_ == nullptr) {
+          WLOG(ERROR) << "Unable to create zstd decompression context";
+          return false;
+        }
+      }
+      const size_t decompressedSize =
+          ZSTD_decompressDCtx(static_cast<ZSTD_DCtx *>(zstdDCtx_), dest,
+                              rawSize, src, size);
+      return !ZSTD_isError(decompressedSize) &&
+             (int64_t)decompressedSize == rawSize;
+    }
+#endif
+    default:
+      return false;
+  }
+}
+}
+}
@@ -0,0 +1,114 @@
+/**
+ * Copyright (c) 2014-present, Facebook, Inc.
+ * All rights reserved.
+ *
+ * This source code is licensed under the BSD-style license found in the
+ * LICENSE file in the root directory of this source tree. An additional grant
+ * of patent rights can be found in the PATENTS file in the same directory.
+ */
+#pragma once
+
+#include <cstdint>
+#include <string>
+#include <vector>
+
+namespace facebook {
+namespace wdt {
+
+/// compression of the block data, sent in the settings
+enum CompressionType { COMP_NONE, COMP_LZ4, COMP_ZSTD, NUM_COMP_TYPES };
+
+/// @return  string description for compression type
+std::string compressionTypeToStr(CompressionType compressionType);
+
+/// @return  compression type for the input string
+CompressionType parseCompressionType(const std::string &str);
+
+/// @return  whether this build can compress and decompress with the type
+bool isCompressionTypeSupported(CompressionType compressionType);
+
+/**
+ * Compresses and decompresses the frames the data of compressed blocks is
+ * split into, each frame independently of the others. On the sending side
+ * it also decides whether compressing is worth it, from the data seen by the
+ * thread: once frames stop saving enough, compression is turned off, and only
+ * tried again on a small sample of the data after a number of bytes doubling
+ * while the data stays incompressible. Each thread is expected to own its
+ * compressor, the class is not thread safe.
+ */
+class BlockCompressor {
+ public:
+  /**
+   * @param type                type of compression, must be supported
+   * @param level               zstd level, or lz4 acceleration
+   * @param minSavingsPercent   percentage of a frame compression must save
+   *                            to stay on
+   */
+  BlockCompressor(CompressionType type, int level, int minSavingsPercent);
+
+  ~BlockCompressor();
+
+  /// @return   type of compression
+  CompressionType getType() const;
+
+  /// @return   whether the next block should be sent as compressed frames
+  bool shouldCompressBlock() const;
+
+  /**
+   * Compresses a frame, if compression is on or due to be tried again
+   *
+   * @param src             raw data of the frame
+   * @param size            length of the frame
+   * @param compressedSize  set to the length of the compressed data
+   *
+   * @return                compressed data, valid till the next call, or
+   *                        nullptr if the frame is to be sent raw
+   */
+  const char *compressFrame(const char *src, int64_t size,
+                            int64_t &compressedSize);
+
+  /// @param size   bytes of a block sent uncompressed as compression is off
+  void skipUncompressed(int64_t size);
+
+  /**
+   * @param src       compressed data of a frame
+   * @param size      length of the compressed data
+   * @param dest      buffer of at least rawSize bytes
+   * @param rawSize   length of the frame once decompressed
+   *
+   * @return          whether the frame decompressed to exactly rawSize bytes
+   */
+  bool decompressFrame(const char *src, int64_t size, char *dest,
+                       int64_t rawSize);
+
+  /// @return   max length of a compressed frame of rawSize bytes
+  int64_t getMaxCompressedLen(int64_t rawSize) const;
+
+  // making the object non-copyable and non-moveable
+  BlockCompressor(const BlockCompressor &) = delete;
+  BlockCompressor &operator=(const BlockCompressor &) = delete;
+
+ private:
+  /// @return   compressed length, or -1 if the data could not be compressed
+  int64_t compress(const char *src, int64_t size);
+
+  /// @return   whether compression saves enough on size bytes
+  bool savesEnough(int64_t size, int64_t compressedSize) const;
+
+  const CompressionType type_;
+  const int level_;
+  const int minSavingsPercent_;
+  /// whether frames are compressed
+  bool enabled_{false};
+  /// bytes to send raw before trying a sample again, while compression is off
+  int64_t bytesUntilProbe_{0};
+  /// doubled each time a sample does not compress well
+  int64_t probeInterval_;
+  /// output of the last compression
+  std::vector<char> compressed_;
+  /// zstd contexts, created on first use
+  void *zstdCCtx_{nullptr};
+  void *zstdDCtx_{nullptr};
+};
+}
+}
@@ -0,0 +1,116 @@
+/**
+ * Copyright (c) 2014-present, Facebook, Inc.
+ * All rights reserved.
+ *
+ * This source code is licensed under the BSD-style license found in the
+ * LICENSE file in the root directory of this source tree. An additional grant
+ * of patent rights can be found in the PATENTS file in the same directory.
+ */
+#include <wdt/util/BufferPool.h>
+
+#include <vector>
+
+namespace facebook {
+namespace wdt {
+
+BufferPool::Reservation::Reservation(int64_t numBytes) : numBytes_(numBytes) {
+}
+
+BufferPool::Reservation::~Reservation() {
+  BufferPool &pool = BufferPool::get();
+  std::lock_guard<std::mutex> lock(pool.mutex_);
+  pool.numBytesReserved_ -= numBytes_;
+}
+
+int64_t BufferPool::Reservation::getNumBytes() const {
+  return numBytes_;
+}
+
+BufferPool &BufferPool::get() {
+  static BufferPool pool;
+  return pool;
+}
+
+std::unique_ptr<Buffer> BufferPool::acquire(int64_t size, int numaNode,
+                                            bool hugePages, int64_t maxBytes) {
+  std::vector<std::unique_ptr<Buffer>> toFree;
+  {
+    std::lock_guard<std::mutex> lock(mutex_);
+    for (auto it = freeBuffers_.begin(); it != freeBuffers_.end(); ++it) {
+      const Buffer &buffer = **it;
+      if (buffer.getSize() == size && buffer.getNumaNode() == numaNode &&
+          buffer.isOnHugePages() == hugePages) {
+        std::unique_ptr<Buffer> reused = std::move(*it);
+        freeBuffers_.erase(it);
+        numFreeBytes_ -= size;
+        numBytesInUse_ += size;
+        return reused;
+      }
+    }
+    // the buffers left don't match, make room for the new one
+    while (maxBytes > 0 && !freeBuffers_.empty() &&
+           numFreeBytes_ + numBytesInUse_ + size > maxBytes) {
+      numFreeBytes_ -= freeBuffers_.front()->getSize();
+      toFree.push_back(std::move(freeBuffers_.front()));
+      freeBuffers_.pop_front();
+    }
+  }
+  auto buffer = std::make_unique<Buffer>(size, numaNode, hugePages);
+  std::lock_guard<std::mutex> lock(mutex_);
+  numBytesInUse_ += buffer->getSize();
+  return buffer;
+}
+
+void BufferPool::release(std::unique_ptr<Buffer> buffer, int64_t maxBytes) {
+  if (buffer == nullptr) {
+    return;
+  }
+  const int64_t size = buffer->getSize();
+  // declared before the lock, to be freed once it is released
+  std::unique_ptr<Buffer> toFree;
+  std::lock_guard<std::mutex> lock(mutex_);
+  numBytesInUse_ -= size;
+  if (buffer->getData() == nullptr ||
+      (maxBytes > 0 && numFreeBytes_ + numBytesInUse_ + size > maxBytes)) {
+    toFree = std::move(buffer);
+    return;
+  }
+  numFreeBytes_ += size;
+  freeBuffers_.push_back(std::move(buffer));
+}
+
+std::unique_ptr<BufferPool::Reservation> BufferPool::reserve(
+    int64_t numBytes, int64_t maxBytes) {
+  std::lock_guard<std::mutex> lock(mutex_);
+  if (maxBytes > 0 && numBytesReserved_ + numBytes > maxBytes) {
+    WLOG(WARNING) << "Can't reserve " << numBytes << " bytes of buffers, "
+                  << numBytesReserved_ << " reserved out of " << maxBytes;
+    return nullptr;
+  }
+  numBytesReserved_ += numBytes;
+  return std::make_unique<Reservation>(numBytes);
+}
+
+void BufferPool::clear() {
+  std::deque<std::unique_ptr<Buffer>> buffers;
+  std::lock_guard<std::mutex> lock(mutex_);
+  buffers.swap(freeBuffers_);
+  numFreeBytes_ = 0;
+}
+
+int64_t BufferPool::getNumFreeBytes() {
+  std::lock_guard<std::mutex> lock(mutex_);
+  return numFreeBytes_;
+}
+
+int64_t BufferPool::getNumBytesInUse() {
+  std::lock_guard<std::mutex> lock(mutex_);
+  return numBytesInUse_;
+}
+
+int64_t BufferPool::getNumBytesReserved() {
+  std::lock_guard<std::mutex> lock(mutex_);
+  return numBytesReserved_;
+}
+}
+}
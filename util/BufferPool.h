@@ -0,0 +1,103 @@
+/**
+ * Copyright (c) 2014-present, Facebook, Inc.
+ * All rights reserved.
+ *
+ * This source code is licensed under the BSD-style license found in the
+ * LICENSE file in the root directory of this source tree. An additional grant
+ * of patent rights can be found in the PATENTS file in the same directory.
+ */
+#pragma once
+
+#include <wdt/util/CommonImpl.h>
+
+#include <deque>
+#include <memory>
+#include <mutex>
+
+namespace facebook {
+namespace wdt {
+
+/**
+ * Process wide pool of the transfer buffers. The threads of a transfer
+ * acquire their buffers from the pool and give them back when they are done,
+ * the next transfers reuse them instead of allocating and faulting in new
+ * ones. The memory of the buffers is capped: buffers given back past the cap
+ * are freed, and the resource controller reserves the memory of a transfer
+ * before creating it so that the transfers running fit in the cap.
+ */
+class BufferPool {
+ public:
+  /// memory reserved for the buffers of a transfer, given back on destruction
+  class Reservation {
+   public:
+    explicit Reservation(int64_t numBytes);
+
+    ~Reservation();
+
+    /// @return   number of bytes reserved
+    int64_t getNumBytes() const;
+
+    Reservation(const Reservation &that) = delete;
+    Reservation &operator=(const Reservation &that) = delete;
+
+   private:
+    const int64_t numBytes_;
+  };
+
+  /// @return   the pool of the process
+  static BufferPool &get();
+
+  /**
+   * Acquires a buffer, reusing a matching one of the pool if any
+   *
+   * @param size        size of the buffer
+   * @param numaNode    numa node of the buffer, -1 for any
+   * @param hugePages   whether the buffer is on huge pages
+   * @param maxBytes    cap of the memory of the buffers, the buffers of the
+   *                    pool not matching are freed to make room for a new
+   *                    one. 0 for no cap
+   *
+   * @return            buffer, with null data if the allocation failed
+   */
+  std::unique_ptr<Buffer> acquire(int64_t size, int numaNode, bool hugePages,
+                                  int64_t maxBytes);
+
+  /**
+   * Gives back a buffer acquired from the pool, it is freed if keeping it
+   * would exceed maxBytes (0 for no cap)
+   */
+  void release(std::unique_ptr<Buffer> buffer, int64_t maxBytes);
+
+  /**
+   * Reserves memory for the buffers of a transfer
+   *
+   * @param numBytes    bytes of the buffers of the transfer
+   * @param maxBytes    max number of bytes reserved at once, 0 for no cap
+   *
+   * @return            reservation, nullptr if there is not enough memory
+   *                    left
+   */
+  std::unique_ptr<Reservation> reserve(int64_t numBytes, int64_t maxBytes);
+
+  /// frees the buffers of the pool
+  void clear();
+
+  /// @return   bytes of the buffers kept by the pool
+  int64_t getNumFreeBytes();
+
+  /// @return   bytes of the buffers acquired and not given back
+  int64_t getNumBytesInUse();
+
+  /// @return   bytes reserved by the transfers
+  int64_t getNumBytesReserved();
+
+ private:
+  std::mutex mutex_;
+  /// buffers given back, the oldest first
+  std::deque<std::unique_ptr<Buffer>> freeBuffers_;
+  int64_t numFreeBytes_{0};
+  int64_t numBytesInUse_{0};
+  int64_t numBytesReserved_{0};
+};
+}
+}
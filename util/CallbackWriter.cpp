@@ -0,0 +1,34 @@
+/**
+ * Copyright (c) 2014-present, Facebook, Inc.
+ * All rights reserved.
+ *
+ * This source code is licensed under the BSD-style license found in the
+ * LICENSE file in the root directory of this source tree. An additional grant
+ * of patent rights can be found in the PATENTS file in the same directory.
+ */
+#include <wdt/util/CallbackWriter.h>
+
+namespace facebook {
+namespace wdt {
+
+WriterFactory CallbackWriter::makeFactory(BlockDataCallback callback) {
+  return [callback](ThreadCtx & /* threadCtx */,
+                    BlockDetails const *blockDetails) {
+    return std::unique_ptr<Writer>(
+        std::make_unique<CallbackWriter>(blockDetails, callback));
+  };
+}
+
+ErrorCode CallbackWriter::write(char *buf, int64_t size) {
+  const ErrorCode code = callback_(
+      *blockDetails_, blockDetails_->offset + totalWritten_, buf, size);
+  if (code != OK) {
+    WLOG(ERROR) << "Callback failed for " << blockDetails_->fileName << " "
+                << errorCodeToStr(code);
+    return code;
+  }
+  totalWritten_ += size;
+  return OK;
+}
+}
+}
@@ -0,0 +1,83 @@
+/**
+ * Copyright (c) 2014-present, Facebook, Inc.
+ * All rights reserved.
+ *
+ * This source code is licensed under the BSD-style license found in the
+ * LICENSE file in the root directory of this source tree. An additional grant
+ * of patent rights can be found in the PATENTS file in the same directory.
+ */
+#pragma once
+
+#include <wdt/Protocol.h>
+#include <wdt/Writer.h>
+
+#include <functional>
+
+namespace facebook {
+namespace wdt {
+
+/**
+ * Callback given the data of the blocks received. The data is in the buffer
+ * it was received in, only valid during the call, so that it is not copied.
+ * Called by the receiver threads concurrently, with the data of each block
+ * in order.
+ *
+ * @param blockDetails    header of the block
+ * @param offset          offset of the data in the file
+ * @param data            data received
+ * @param size            number of bytes of data
+ *
+ * @return                OK, or an error aborting the transfer
+ */
+typedef std::function<ErrorCode(const BlockDetails &blockDetails,
+                                int64_t offset, const char *data,
+                                int64_t size)>
+    BlockDataCallback;
+
+/**
+ * Writer handing the data of a block to a callback instead of writing it to
+ * a file
+ */
+class CallbackWriter : public Writer {
+ public:
+  CallbackWriter(BlockDetails const *blockDetails, BlockDataCallback callback)
+      : blockDetails_(blockDetails), callback_(std::move(callback)) {
+  }
+
+  /// @return   factory of writers calling callback, for
+  ///           Receiver::setWriterFactory
+  static WriterFactory makeFactory(BlockDataCallback callback);
+
+  /// @see Writer.h
+  ErrorCode open() override {
+    return OK;
+  }
+
+  /// @see Writer.h
+  ErrorCode write(char *buf, int64_t size) override;
+
+  /// @see Writer.h
+  int64_t getTotalWritten() override {
+    return totalWritten_;
+  }
+
+  /// @see Writer.h
+  ErrorCode sync() override {
+    return OK;
+  }
+
+  /// @see Writer.h
+  ErrorCode close() override {
+    return OK;
+  }
+
+ private:
+  /// details of the block
+  BlockDetails const *blockDetails_;
+  /// callback given the data
+  const BlockDataCallback callback_;
+  /// number of bytes given to the callback
+  int64_t totalWritten_{0};
+};
+}
+}
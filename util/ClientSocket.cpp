@@ -11,6 +11,7 @@
 
 #include <fcntl.h>
 #include <glog/logging.h>
+#include <netinet/in.h>
 #include <poll.h>
 #include <sys/socket.h>
 
@@ -71,6 +72,12 @@ ErrorCode ClientSocket::connect() {
     WVLOG(1) << "new socket " << fd_ << " for port " << port_;
 
     setSendBufferSize();
+    setCongestionControl();
+
+    if (!localAddress_.empty() && !bindToLocalAddress(info->ai_family)) {
+      closeConnection();
+      continue;
+    }
 
     // make the socket non blocking
     int sockArg = fcntl(fd_, F_GETFL, nullptr);
@@ -171,6 +178,10 @@ ErrorCode ClientSocket::connect() {
   }
   setSocketTimeouts();
   setDscp(threadCtx_.getOptions().dscp);
+  if (setupTransport(true) != OK) {
+    closeNoCheck();
+    return CONN_ERROR_RETRYABLE;
+  }
   return OK;
 }
 
@@ -178,6 +189,41 @@ const std::string &ClientSocket::getPeerIp() const {
   return peerIp_;
 }
 
+void ClientSocket::setLocalAddress(const string &localAddress) {
+  localAddress_ = localAddress;
+}
+
+bool ClientSocket::bindToLocalAddress(int family) {
+  struct addrinfo hints;
+  memset(&hints, 0, sizeof(hints));
+  hints.ai_family = family;
+  hints.ai_socktype = SOCK_STREAM;
+  struct addrinfo *infoList = nullptr;
+  int res = getaddrinfo(localAddress_.c_str(), nullptr, &hints, &infoList);
+  if (res) {
+    WLOG(WARNING) << "Failed getaddrinfo for local address " << localAddress_
+                  << " : " << gai_strerror(res);
+    return false;
+  }
+  auto guard = folly::makeGuard([&] { freeaddrinfo(infoList); });
+#ifdef IP_BIND_ADDRESS_NO_PORT
+  // the port is picked at connect time, so that local ports are not used up
+  // for the (address, port) pairs already in use with other destinations
+  int one = 1;
+  if (::setsockopt(fd_, IPPROTO_IP, IP_BIND_ADDRESS_NO_PORT, &one,
+                   sizeof(one)) != 0) {
+    WPLOG(WARNING) << "Failed to set IP_BIND_ADDRESS_NO_PORT " << fd_;
+  }
+#endif
+  if (::bind(fd_, infoList->ai_addr, infoList->ai_addrlen) != 0) {
+    WPLOG(ERROR) << "Failed to bind to local address " << localAddress_
+                 << " port " << port_;
+    return false;
+  }
+  WVLOG(1) << "Bound " << fd_ << " to local address " << localAddress_;
+  return true;
+}
+
 void ClientSocket::setSendBufferSize() {
   int bufSize = threadCtx_.getOptions().send_buffer_size;
   if (bufSize <= 0) {
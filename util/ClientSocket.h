@@ -21,6 +21,11 @@ class ClientSocket : public WdtSocket {
                const EncryptionParams &encryptionParams,
                int64_t ivChangeInterval);
   virtual ErrorCode connect();
+  /**
+   * Binds the next connections to a local address, so that they go through
+   * the matching NIC. Empty (the default) lets the routing pick it.
+   */
+  void setLocalAddress(const std::string &localAddress);
   /// @return   peer-ip of the connected socket
   const std::string &getPeerIp() const;
   /// shutdown() is now on WdtSocket as shutdownWrites()
@@ -30,7 +35,11 @@ class ClientSocket : public WdtSocket {
   /// sets the send buffer size for this socket
   void setSendBufferSize();
 
+  /// binds fd_ to localAddress_, @return false in case of error
+  bool bindToLocalAddress(int family);
+
   const std::string dest_;
+  std::string localAddress_;
   std::string peerIp_;
   struct addrinfo sa_;
 };
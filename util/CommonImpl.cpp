@@ -7,17 +7,90 @@
  * of patent rights can be found in the PATENTS file in the same directory.
  */
 #include <wdt/util/CommonImpl.h>
+#include <wdt/util/BufferPool.h>
+#include <wdt/util/ThreadAffinity.h>
+
+#include <sys/mman.h>
+#include <cinttypes>
+#include <cstdio>
+#include <fstream>
 
 namespace facebook {
 namespace wdt {
 
-Buffer::Buffer(const int64_t size) {
+/// size of the explicit huge pages
+const int64_t kHugePageSize = 2 * 1024 * 1024;
+
+Buffer::Buffer(const int64_t size) : Buffer(size, -1, false) {
+}
+
+Buffer::Buffer(const int64_t size, int numaNode)
+    : Buffer(size, numaNode, false) {
+}
+
+namespace {
+/// @return   bytes of the memory at data backed by transparent huge pages,
+///           from the AnonHugePages of its mapping in /proc/self/smaps
+int64_t getTransparentHugePageBytes(const char* data, int64_t size) {
+  std::ifstream smaps("/proc/self/smaps");
+  const unsigned long address = reinterpret_cast<unsigned long>(data);
+  bool inMapping = false;
+  std::string line;
+  while (std::getline(smaps, line)) {
+    unsigned long start, end;
+    if (sscanf(line.c_str(), "%lx-%lx", &start, &end) == 2) {
+      inMapping = start <= address && address < end;
+      continue;
+    }
+    int64_t kbytes;
+    if (inMapping &&
+        sscanf(line.c_str(), "AnonHugePages: %" SCNd64, &kbytes) == 1) {
+      return std::min<int64_t>(kbytes * 1024, size);
+    }
+  }
+  return 0;
+}
+}
+
+Buffer::Buffer(const int64_t size, int numaNode, bool hugePages)
+    : numaNode_(numaNode), hugePages_(hugePages) {
   WDT_CHECK_EQ(0, size % kDiskBlockSize);
+  if (!hugePages || !mapHugePages(size)) {
+    // aligned on a huge page for the kernel to back it with transparent ones
+    allocate(size, hugePages ? kHugePageSize : kDiskBlockSize);
+  }
+  if (numaNode >= 0 && isAligned_ && size_ > 0) {
+    // pages are placed on the node on first touch, and moved if already used
+    ThreadAffinity::bindToNumaNode(data_, size_, numaNode);
+  }
+  if (!hugePages || size_ == 0) {
+    return;
+  }
+  if (isMapped_) {
+    numHugePageBytes_ = size_;
+    return;
+  }
+#ifdef MADV_HUGEPAGE
+  if (!isAligned_ || madvise(data_, size_, MADV_HUGEPAGE) != 0) {
+    WPLOG(WARNING) << "Transparent huge pages not available for " << size_;
+    return;
+  }
+  // touched now for the kernel to allocate the pages, huge ones if it has some
+  memset(data_, 0, size_);
+  numHugePageBytes_ = getTransparentHugePageBytes(data_, size_);
+#endif
+  if (numHugePageBytes_ < size_) {
+    WVLOG(1) << "Only " << numHugePageBytes_ << " bytes of the buffer of "
+             << size_ << " bytes are on huge pages";
+  }
+}
+
+void Buffer::allocate(int64_t size, int64_t alignment) {
   isAligned_ = false;
   size_ = 0;
 #ifdef HAS_POSIX_MEMALIGN
   // always allocate aligned buffer if possible
-  int ret = posix_memalign((void**)&data_, kDiskBlockSize, size);
+  int ret = posix_memalign((void**)&data_, alignment, size);
   if (ret || data_ == nullptr) {
     WLOG(ERROR) << "posix_memalign failed " << strerrorStr(ret) << " size "
                 << size;
@@ -38,6 +111,28 @@ Buffer::Buffer(const int64_t size) {
 #endif
 }
 
+bool Buffer::mapHugePages(int64_t size) {
+#ifdef MAP_HUGETLB
+  if (size % kHugePageSize != 0) {
+    return false;
+  }
+  void* data = mmap(nullptr, size, PROT_READ | PROT_WRITE,
+                    MAP_PRIVATE | MAP_ANONYMOUS | MAP_HUGETLB, -1, 0);
+  if (data == MAP_FAILED) {
+    WVLOG(1) << "No explicit huge pages free for " << size;
+    return false;
+  }
+  WVLOG(1) << "Mapped memory on huge pages " << size;
+  data_ = (char*)data;
+  size_ = size;
+  isAligned_ = true;
+  isMapped_ = true;
+  return true;
+#else
+  return false;
+#endif
+}
+
 char* Buffer::getData() const {
   return data_;
 }
@@ -50,8 +145,25 @@ int64_t Buffer::getSize() const {
   return size_;
 }
 
+int Buffer::getNumaNode() const {
+  return numaNode_;
+}
+
+bool Buffer::isOnHugePages() const {
+  return hugePages_;
+}
+
+int64_t Buffer::getNumHugePageBytes() const {
+  return numHugePageBytes_;
+}
+
 Buffer::~Buffer() {
-  if (data_ != nullptr) {
+  if (data_ == nullptr) {
+    return;
+  }
+  if (isMapped_) {
+    munmap(data_, size_);
+  } else {
     free(data_);
   }
 }
@@ -61,7 +173,7 @@ ThreadCtx::ThreadCtx(const WdtOptions& options, bool allocateBuffer)
   if (!allocateBuffer) {
     return;
   }
-  buffer_ = std::make_unique<Buffer>(options_.buffer_size);
+  buffers_.emplace_back(newBuffer());
 }
 
 ThreadCtx::ThreadCtx(const WdtOptions& options, bool allocateBuffer,
@@ -70,6 +182,47 @@ ThreadCtx::ThreadCtx(const WdtOptions& options, bool allocateBuffer,
   threadIndex_ = threadIndex;
 }
 
+ThreadCtx::ThreadCtx(const WdtOptions& options, bool allocateBuffer,
+                     int threadIndex, int numaNode)
+    : options_(options), perfReport_(options) {
+  threadIndex_ = threadIndex;
+  numaNode_ = numaNode;
+  if (!allocateBuffer) {
+    return;
+  }
+  buffers_.emplace_back(newBuffer());
+}
+
+ThreadCtx::~ThreadCtx() {
+  if (options_.buffer_pool_max_mbytes <= 0) {
+    return;
+  }
+  // the requests in flight and the chunks queued use the buffers
+  ioUring_.reset();
+  cryptoWorker_.reset();
+  const int64_t maxBytes = options_.buffer_pool_max_mbytes * kMbToB;
+  for (auto& buffer : buffers_) {
+    BufferPool::get().release(std::move(buffer), maxBytes);
+  }
+}
+
+std::unique_ptr<Buffer> ThreadCtx::newBuffer() {
+  std::unique_ptr<Buffer> buffer;
+  if (options_.buffer_pool_max_mbytes > 0) {
+    const int64_t maxBytes = options_.buffer_pool_max_mbytes * kMbToB;
+    buffer = BufferPool::get().acquire(options_.buffer_size, numaNode_,
+                                       options_.buffer_huge_pages, maxBytes);
+  } else {
+    buffer = std::make_unique<Buffer>(options_.buffer_size, numaNode_,
+                                      options_.buffer_huge_pages);
+  }
+  if (buffer->isOnHugePages()) {
+    perfReport_.addHugePageBuffer(buffer->getSize(),
+                                  buffer->getNumHugePageBytes());
+  }
+  return buffer;
+}
+
 const WdtOptions& ThreadCtx::getOptions() const {
   return options_;
 }
@@ -80,13 +233,69 @@ int ThreadCtx::getThreadIndex() const {
 }
 
 const Buffer* ThreadCtx::getBuffer() const {
-  return buffer_.get();
+  return buffers_.empty() ? nullptr : buffers_[0].get();
+}
+
+const Buffer* ThreadCtx::getBuffer(int index) const {
+  WDT_CHECK_LT(index, (int)buffers_.size());
+  return buffers_[index].get();
+}
+
+int ThreadCtx::getNumBuffers() const {
+  return buffers_.size();
+}
+
+bool ThreadCtx::addBuffers(int count) {
+  for (int i = 0; i < count; i++) {
+    auto buffer = newBuffer();
+    if (buffer->getData() == nullptr) {
+      return false;
+    }
+    buffers_.emplace_back(std::move(buffer));
+  }
+  return true;
+}
+
+IoUring* ThreadCtx::getIoUring() {
+  if (!ioUringSetupDone_) {
+    ioUringSetupDone_ = true;
+    auto ioUring = std::make_unique<IoUring>(options_.io_uring_queue_depth);
+    if (ioUring->isValid()) {
+      ioUring_ = std::move(ioUring);
+    } else {
+      WLOG(WARNING) << "io_uring not available, using blocking io instead";
+    }
+  }
+  return ioUring_.get();
+}
+
+FdCache* ThreadCtx::getFdCache() {
+  if (fdCache_ == nullptr && options_.fd_cache_size > 0) {
+    fdCache_ = std::make_unique<FdCache>(options_.fd_cache_size);
+  }
+  return fdCache_.get();
+}
+
+CryptoWorker* ThreadCtx::getCryptoWorker() {
+  if (cryptoWorker_ == nullptr && options_.encryption_pipeline) {
+    cryptoWorker_ = std::make_unique<CryptoWorker>(
+        options_.encryption_pipeline_chunk_kbytes * 1024);
+  }
+  return cryptoWorker_.get();
+}
+
+ThreadCtx::ThrottlerCredit& ThreadCtx::getThrottlerCredit() {
+  return throttlerCredit_;
 }
 
 PerfStatReport& ThreadCtx::getPerfReport() {
   return perfReport_;
 }
 
+TimeBreakdown& ThreadCtx::getTimeBreakdown() {
+  return timeBreakdown_;
+}
+
 void ThreadCtx::setAbortChecker(IAbortChecker const* abortChecker) {
   abortChecker_ = abortChecker;
 }
@@ -9,8 +9,14 @@
 #pragma once
 
 #include <atomic>
+#include <vector>
 
 #include <wdt/Reporting.h>
+#include <wdt/util/CryptoWorker.h>
+#include <wdt/util/FdCache.h>
+#include <wdt/util/IoUring.h>
+#include <wdt/util/LatencyHistograms.h>
+#include <wdt/util/TransferTracer.h>
 
 namespace facebook {
 namespace wdt {
@@ -23,6 +29,16 @@ class Buffer {
   /// @param size     size to allocate
   explicit Buffer(const int64_t size);
 
+  /// @param size     size to allocate
+  /// @param numaNode numa node to allocate the memory on, -1 for any
+  Buffer(const int64_t size, int numaNode);
+
+  /// @param size       size to allocate
+  /// @param numaNode   numa node to allocate the memory on, -1 for any
+  /// @param hugePages  whether to allocate the memory on huge pages, explicit
+  ///                   ones if reserved, transparent ones otherwise
+  Buffer(const int64_t size, int numaNode, bool hugePages);
+
   /// @return   buffer ptr
   char *getData() const;
 
@@ -32,6 +48,15 @@ class Buffer {
   /// @return   buffer size
   int64_t getSize() const;
 
+  /// @return   numa node the buffer was asked on, -1 for any
+  int getNumaNode() const;
+
+  /// @return   whether the buffer was asked on huge pages
+  bool isOnHugePages() const;
+
+  /// @return   bytes of the buffer actually backed by huge pages
+  int64_t getNumHugePageBytes() const;
+
   ~Buffer();
 
   // making the object non-copyable and non-moveable
@@ -41,9 +66,21 @@ class Buffer {
   Buffer &operator=(Buffer &&stats) = delete;
 
  private:
+  /// allocates the memory, aligned if possible
+  void allocate(int64_t size, int64_t alignment);
+
+  /// maps the memory on explicit huge pages, @return false if none is free
+  bool mapHugePages(int64_t size);
+
   char *data_{nullptr};
   int64_t size_{0};
   bool isAligned_{false};
+  int numaNode_{-1};
+  bool hugePages_{false};
+  /// bytes of the memory backed by huge pages
+  int64_t numHugePageBytes_{0};
+  /// whether the memory was mapped rather than allocated
+  bool isMapped_{false};
 };
 
 /// class representing thread context
@@ -58,6 +95,16 @@ class ThreadCtx {
   /// @param  threadIndex    index of the thread
   ThreadCtx(const WdtOptions &options, bool allocateBuffer, int threadIndex);
 
+  /// @param  options        options to use
+  /// @param  allocateBuffer whether to allocate buffer
+  /// @param  threadIndex    index of the thread
+  /// @param  numaNode       numa node to allocate the buffers on, -1 for any
+  ThreadCtx(const WdtOptions &options, bool allocateBuffer, int threadIndex,
+            int numaNode);
+
+  /// gives the buffers back to the buffer pool if they come from it
+  ~ThreadCtx();
+
   /// @return   options to use
   const WdtOptions &getOptions() const;
 
@@ -67,9 +114,66 @@ class ThreadCtx {
   /// @return   buffer to use
   const Buffer *getBuffer() const;
 
+  /**
+   * @param index   index of the buffer, 0 being the one returned by
+   *                getBuffer()
+   *
+   * @return        buffer at the given index
+   */
+  const Buffer *getBuffer(int index) const;
+
+  /// @return   number of buffers allocated
+  int getNumBuffers() const;
+
+  /**
+   * Allocates extra buffers of buffer_size each
+   *
+   * @param count   number of buffers to add
+   *
+   * @return        false if allocation failed
+   */
+  bool addBuffers(int count);
+
+  /**
+   * Returns the io_uring instance of this thread, setting it up on first use.
+   *
+   * @return    ring to use for asynchronous file io, nullptr if io_uring is
+   *            not available
+   */
+  IoUring *getIoUring();
+
+  /**
+   * Returns the fd cache of this thread, creating it on first use.
+   *
+   * @return    cache of the fds of multi-block files, nullptr if fd_cache_size
+   *            is 0
+   */
+  FdCache *getFdCache();
+
+  /**
+   * Returns the crypto worker of this thread, starting it on first use.
+   *
+   * @return    worker to overlap the encryption of the sockets with their io,
+   *            nullptr if encryption_pipeline is not set
+   */
+  CryptoWorker *getCryptoWorker();
+
+  /// throttler tokens leased by this thread and not consumed yet
+  struct ThrottlerCredit {
+    /// generation of the throttler state the tokens were leased from
+    int64_t generation{0};
+    int64_t tokens{0};
+  };
+
+  /// @return   throttler credit of this thread
+  ThrottlerCredit &getThrottlerCredit();
+
   /// @return   perf stat reporter
   PerfStatReport &getPerfReport();
 
+  /// @return   time breakdown of this thread
+  TimeBreakdown &getTimeBreakdown();
+
   /// @param    abort checker to use
   void setAbortChecker(IAbortChecker const *abortChecker);
 
@@ -83,34 +187,78 @@ class ThreadCtx {
   ThreadCtx &operator=(ThreadCtx &&stats) = delete;
 
  private:
+  /// @return   a new buffer of buffer_size, from the buffer pool if enabled
+  std::unique_ptr<Buffer> newBuffer();
+
   const WdtOptions &options_;
   int threadIndex_{-1};
-  std::unique_ptr<Buffer> buffer_{nullptr};
+  /// numa node the buffers are allocated on, -1 for any
+  int numaNode_{-1};
+  /// buffers owned by this thread, the first one is the main buffer
+  std::vector<std::unique_ptr<Buffer>> buffers_;
+  /// must be destroyed before the buffers, as requests in flight write into
+  /// them
+  std::unique_ptr<IoUring> ioUring_{nullptr};
+  /// whether setup of ioUring_ has already been attempted
+  bool ioUringSetupDone_{false};
+  std::unique_ptr<FdCache> fdCache_{nullptr};
+  std::unique_ptr<CryptoWorker> cryptoWorker_{nullptr};
   PerfStatReport perfReport_;
+  TimeBreakdown timeBreakdown_;
+  ThrottlerCredit throttlerCredit_;
   IAbortChecker const *abortChecker_{nullptr};
 };
 
-/// util class to collect perf stat
+/// util class to collect perf stat, and optionally the latency histogram of
+/// an operation of the hot path
 class PerfStatCollector {
  public:
   PerfStatCollector(ThreadCtx &threadCtx,
-                    const PerfStatReport::StatType statType)
-      : threadCtx_(threadCtx), statType_(statType) {
-    if (threadCtx_.getOptions().enable_perf_stat_collection) {
+                    const PerfStatReport::StatType statType,
+                    const LatencyPhase latencyPhase = NUM_LATENCY_PHASES)
+      : threadCtx_(threadCtx),
+        statType_(statType),
+        latencyPhase_(latencyPhase),
+        traced_(TransferTracer::get().isEnabled()) {
+    const WdtOptions &options = threadCtx_.getOptions();
+    if (latencyPhase_ != NUM_LATENCY_PHASES &&
+        options.latency_histogram_window_millis <= 0) {
+      latencyPhase_ = NUM_LATENCY_PHASES;
+    }
+    if (options.enable_perf_stat_collection ||
+        latencyPhase_ != NUM_LATENCY_PHASES || traced_) {
       startTime_ = Clock::now();
     }
   }
 
   ~PerfStatCollector() {
-    if (threadCtx_.getOptions().enable_perf_stat_collection) {
-      int64_t duration = durationMicros(Clock::now() - startTime_);
+    const bool collectPerfStat =
+        threadCtx_.getOptions().enable_perf_stat_collection;
+    if (!collectPerfStat && latencyPhase_ == NUM_LATENCY_PHASES && !traced_) {
+      return;
+    }
+    const Clock::time_point endTime = Clock::now();
+    int64_t duration = durationMicros(endTime - startTime_);
+    if (collectPerfStat) {
       threadCtx_.getPerfReport().addPerfStat(statType_, duration);
     }
+    if (latencyPhase_ != NUM_LATENCY_PHASES) {
+      LatencyHistograms::get().record(latencyPhase_, duration);
+    }
+    if (traced_) {
+      TransferTracer::get().record(
+          PerfStatReport::getStatTypeDescription(statType_).c_str(),
+          startTime_, endTime);
+    }
   }
 
  private:
   ThreadCtx &threadCtx_;
   const PerfStatReport::StatType statType_;
+  /// NUM_LATENCY_PHASES if the latency is not recorded
+  LatencyPhase latencyPhase_;
+  /// whether the operation is recorded as a span of the trace
+  const bool traced_;
   Clock::time_point startTime_;
 };
 
@@ -0,0 +1,185 @@
+/**
+ * Copyright (c) 2014-present, Facebook, Inc.
+ * All rights reserved.
+ *
+ * This source code is licensed under the BSD-style license found in the
+ * LICENSE file in the root directory of this source tree. An additional grant
+ * of patent rights can be found in the PATENTS file in the same directory.
+ */
+#include <wdt/util/ConnectionScaler.h>
+
+#include <wdt/ErrorCodes.h>
+
+#include <algorithm>
+#include <chrono>
+
+namespace facebook {
+namespace wdt {
+
+const double ConnectionScaler::kMinGain = 0.1;
+
+ConnectionScaler::ConnectionScaler(const WdtOptions &options, int numThreads)
+    : minActive_(std::max(
+          1, std::min(options.auto_scale_min_connections, numThreads))),
+      intervalMillis_(std::max(1, options.auto_scale_interval_millis)),
+      lanRttMicros_(options.auto_scale_lan_rtt_micros),
+      states_(numThreads, PARKED),
+      bytes_(numThreads, 0),
+      rtts_(numThreads, -1) {
+  for (int i = 0; i < minActive_; ++i) {
+    activateNext();
+  }
+  WLOG(INFO) << "Auto scaling connections, starting with " << numActive_
+             << " of " << numThreads;
+}
+
+bool ConnectionScaler::activateNext() {
+  for (size_t i = 0; i < states_.size(); ++i) {
+    if (states_[i] == PARKED) {
+      states_[i] = ACTIVE;
+      ++numActive_;
+      cond_.notify_all();
+      return true;
+    }
+  }
+  return false;
+}
+
+bool ConnectionScaler::waitForTurn(int threadIndex, int timeoutMillis) {
+  std::unique_lock<std::mutex> lock(mutex_);
+  return cond_.wait_for(lock, std::chrono::milliseconds(timeoutMillis),
+                        [&] { return states_[threadIndex] != PARKED; });
+}
+
+bool ConnectionScaler::isActive(int threadIndex) {
+  std::lock_guard<std::mutex> lock(mutex_);
+  return states_[threadIndex] == ACTIVE;
+}
+
+bool ConnectionScaler::shouldRetire(int threadIndex) {
+  std::lock_guard<std::mutex> lock(mutex_);
+  if (numToRetire_ <= 0 || finished_ || states_[threadIndex] != ACTIVE ||
+      numActive_ <= minActive_) {
+    return false;
+  }
+  states_[threadIndex] = RETIRED;
+  --numActive_;
+  --numToRetire_;
+  WLOG(INFO) << "Retiring connection of thread " << threadIndex << ", "
+             << numActive_ << " active connections";
+  return true;
+}
+
+void ConnectionScaler::reportProgress(int threadIndex, int64_t totalBytes,
+                                      int rttMicros, Clock::time_point now) {
+  std::lock_guard<std::mutex> lock(mutex_);
+  if (states_[threadIndex] != ACTIVE) {
+    return;
+  }
+  bytes_[threadIndex] = totalBytes;
+  rtts_[threadIndex] = rttMicros;
+  evaluate(now);
+}
+
+void ConnectionScaler::evaluate(Clock::time_point now) {
+  int64_t totalBytes = 0;
+  for (int64_t bytes : bytes_) {
+    totalBytes += bytes;
+  }
+  if (!started_) {
+    started_ = true;
+    lastEvalTime_ = now;
+    lastTotalBytes_ = totalBytes;
+    return;
+  }
+  const int elapsedMillis = durationMillis(now - lastEvalTime_);
+  if (elapsedMillis < intervalMillis_) {
+    return;
+  }
+  const double throughput =
+      (totalBytes - lastTotalBytes_) * 1000.0 / elapsedMillis;
+  const double prevThroughput = lastThroughput_;
+  lastEvalTime_ = now;
+  lastTotalBytes_ = totalBytes;
+  lastThroughput_ = throughput;
+
+  int64_t rttSum = 0;
+  int numRtts = 0;
+  for (size_t i = 0; i < states_.size(); ++i) {
+    if (states_[i] == ACTIVE && rtts_[i] >= 0) {
+      rttSum += rtts_[i];
+      ++numRtts;
+    }
+  }
+  if (settled_ || finished_ || numToRetire_ > 0 || numRtts == 0) {
+    return;
+  }
+  const int64_t avgRtt = rttSum / numRtts;
+  const bool isLan = avgRtt < lanRttMicros_;
+  const bool hasPrev = prevThroughput >= 0;
+  Action action = NO_ACTION;
+  if (hasPrev && lastAction_ == ADD &&
+      throughput < prevThroughput * (1 + kMinGain)) {
+    // the connection added did not pay off
+    settled_ = true;
+    action = RETIRE;
+  } else if (hasPrev && lastAction_ == RETIRE &&
+             throughput < prevThroughput * (1 - kMinGain)) {
+    // the connection retired was needed
+    settled_ = true;
+    action = ADD;
+  } else {
+    action = (isLan ? RETIRE : ADD);
+  }
+  if (action == ADD && !activateNext()) {
+    action = NO_ACTION;
+  }
+  if (action == RETIRE) {
+    if (numActive_ > minActive_) {
+      numToRetire_ = 1;
+    } else {
+      action = NO_ACTION;
+    }
+  }
+  if (action != NO_ACTION) {
+    WLOG(INFO) << "Auto scaling: throughput " << throughput / kMbToB
+               << " Mbytes/sec, avg rtt " << avgRtt << " us, "
+               << (action == ADD ? "adding" : "retiring") << " a connection, "
+               << numActive_ << " active";
+  }
+  lastAction_ = action;
+}
+
+void ConnectionScaler::threadDone(int threadIndex) {
+  std::lock_guard<std::mutex> lock(mutex_);
+  const ThreadState state = states_[threadIndex];
+  states_[threadIndex] = DONE;
+  if (state != ACTIVE) {
+    return;
+  }
+  --numActive_;
+  if (!finished_) {
+    activateNext();
+  }
+}
+
+void ConnectionScaler::finish() {
+  std::lock_guard<std::mutex> lock(mutex_);
+  if (finished_) {
+    return;
+  }
+  finished_ = true;
+  for (auto &state : states_) {
+    if (state == PARKED) {
+      state = DONE;
+    }
+  }
+  cond_.notify_all();
+}
+
+int ConnectionScaler::getNumActive() {
+  std::lock_guard<std::mutex> lock(mutex_);
+  return numActive_;
+}
+}
+}
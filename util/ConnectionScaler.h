@@ -0,0 +1,130 @@
+/**
+ * Copyright (c) 2014-present, Facebook, Inc.
+ * All rights reserved.
+ *
+ * This source code is licensed under the BSD-style license found in the
+ * LICENSE file in the root directory of this source tree. An additional grant
+ * of patent rights can be found in the PATENTS file in the same directory.
+ */
+#pragma once
+
+#include <wdt/Reporting.h>
+#include <wdt/WdtOptions.h>
+
+#include <condition_variable>
+#include <mutex>
+#include <vector>
+
+namespace facebook {
+namespace wdt {
+
+/**
+ * Decides how many of the sender threads use their connection, for
+ * auto_scale_connections. The transfer starts with auto_scale_min_connections
+ * threads, the others are parked before connecting. Every
+ * auto_scale_interval_millis the aggregate throughput and the average rtt of
+ * the active connections are compared to the previous interval:
+ * - on long-haul links (rtt >= auto_scale_lan_rtt_micros) a connection is
+ *   added as long as the previous one increased the throughput
+ * - on local links a connection is retired as long as the throughput holds,
+ *   which saves cpu
+ * A retired thread sends its done cmd, so its port is not reused in the
+ * session. Threads still parked when nothing is left to send never connect.
+ * If an active thread ends early, a parked one takes its place. All the
+ * methods are thread safe.
+ */
+class ConnectionScaler {
+ public:
+  /// min relative change of throughput considered significant
+  static const double kMinGain;
+
+  /**
+   * @param options       options of the sender
+   * @param numThreads    number of sender threads, one per receiver port
+   */
+  ConnectionScaler(const WdtOptions &options, int numThreads);
+
+  /**
+   * Waits till the thread is either activated or not needed anymore
+   *
+   * @param threadIndex   index of the thread
+   * @param timeoutMillis max time to wait, so that the caller can check for
+   *                      aborts
+   *
+   * @return              false on timeout
+   */
+  bool waitForTurn(int threadIndex, int timeoutMillis);
+
+  /// @return   whether the thread is allowed to use its connection
+  bool isActive(int threadIndex);
+
+  /**
+   * Called by an active thread before it takes the next source, once it is
+   * safe for it to end its connection
+   *
+   * @return              true if the thread is picked to be retired
+   */
+  bool shouldRetire(int threadIndex);
+
+  /**
+   * Records the progress of an active thread, and makes a scaling decision if
+   * the interval has elapsed
+   *
+   * @param threadIndex   index of the thread
+   * @param totalBytes    bytes sent by the thread so far
+   * @param rttMicros     current rtt of its connection, < 0 if unknown
+   * @param now           current time
+   */
+  void reportProgress(int threadIndex, int64_t totalBytes, int rttMicros,
+                      Clock::time_point now);
+
+  /**
+   * Called when a thread ends. If an active thread ends before the transfer
+   * is over, a parked thread takes its place
+   */
+  void threadDone(int threadIndex);
+
+  /// nothing is left to send, the parked threads are not needed anymore
+  void finish();
+
+  /// @return   number of threads allowed to use their connection
+  int getNumActive();
+
+ private:
+  enum ThreadState { PARKED, ACTIVE, RETIRED, DONE };
+
+  enum Action { NO_ACTION, ADD, RETIRE };
+
+  /// makes a scaling decision from the progress of the last interval
+  void evaluate(Clock::time_point now);
+
+  /// activates the next parked thread, @return false if there is none
+  bool activateNext();
+
+  const int minActive_;
+  const int intervalMillis_;
+  const int lanRttMicros_;
+
+  std::vector<ThreadState> states_;
+  std::vector<int64_t> bytes_;
+  std::vector<int> rtts_;
+  int numActive_{0};
+  /// number of connections to retire, decided but not retired yet
+  int numToRetire_{0};
+  bool finished_{false};
+  /// set once the last action did not pay off, no more scaling then
+  bool settled_{false};
+  Action lastAction_{NO_ACTION};
+
+  bool started_{false};
+  Clock::time_point lastEvalTime_;
+  int64_t lastTotalBytes_{0};
+  /// throughput of the previous interval in bytes/sec, < 0 if none yet
+  double lastThroughput_{-1};
+
+  std::mutex mutex_;
+  /// notified when threads are activated
+  std::condition_variable cond_;
+};
+}
+}
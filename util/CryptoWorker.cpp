@@ -0,0 +1,94 @@
+/**
+ * Copyright (c) 2014-present, Facebook, Inc.
+ * All rights reserved.
+ *
+ * This source code is licensed under the BSD-style license found in the
+ * LICENSE file in the root directory of this source tree. An additional grant
+ * of patent rights can be found in the PATENTS file in the same directory.
+ */
+#include <wdt/util/CryptoWorker.h>
+
+#include <wdt/ErrorCodes.h>
+
+#include <algorithm>
+
+namespace facebook {
+namespace wdt {
+
+CryptoWorker::CryptoWorker(int chunkSize)
+    : chunkSize_(std::max(1, chunkSize)) {
+  thread_ = std::thread(&CryptoWorker::run, this);
+}
+
+CryptoWorker::~CryptoWorker() {
+  {
+    std::lock_guard<std::mutex> lock(mutex_);
+    stop_ = true;
+  }
+  jobCond_.notify_one();
+  thread_.join();
+}
+
+void CryptoWorker::begin(ChunkFunc func) {
+  std::lock_guard<std::mutex> lock(mutex_);
+  WDT_CHECK(func_ == nullptr) << "crypto worker session already active";
+  func_ = std::move(func);
+  numSubmitted_ = 0;
+  numProcessed_ = 0;
+  failed_ = false;
+}
+
+void CryptoWorker::submit(char *data, int len) {
+  {
+    std::lock_guard<std::mutex> lock(mutex_);
+    WDT_CHECK(func_ != nullptr);
+    jobs_.push_back({data, len});
+    numSubmitted_ += len;
+  }
+  jobCond_.notify_one();
+}
+
+int64_t CryptoWorker::waitFor(int64_t numBytes) {
+  std::unique_lock<std::mutex> lock(mutex_);
+  WDT_CHECK_LE(numBytes, numSubmitted_);
+  progressCond_.wait(lock,
+                     [&] { return failed_ || numProcessed_ >= numBytes; });
+  return failed_ ? -1 : numProcessed_;
+}
+
+bool CryptoWorker::end() {
+  std::unique_lock<std::mutex> lock(mutex_);
+  progressCond_.wait(lock, [&] { return jobs_.empty(); });
+  const bool success = !failed_;
+  func_ = nullptr;
+  return success;
+}
+
+void CryptoWorker::run() {
+  std::unique_lock<std::mutex> lock(mutex_);
+  while (true) {
+    jobCond_.wait(lock, [&] { return stop_ || !jobs_.empty(); });
+    if (stop_) {
+      return;
+    }
+    const Job job = jobs_.front();
+    for (int done = 0; done < job.len;) {
+      const int len = std::min(chunkSize_, job.len - done);
+      bool success = true;
+      if (!failed_) {
+        // the caller only touches data once it is processed
+        lock.unlock();
+        success = func_(job.data + done, len);
+        lock.lock();
+      }
+      failed_ = failed_ || !success;
+      done += len;
+      numProcessed_ += len;
+      progressCond_.notify_all();
+    }
+    jobs_.pop_front();
+    progressCond_.notify_all();
+  }
+}
+}
+}
@@ -0,0 +1,97 @@
+/**
+ * Copyright (c) 2014-present, Facebook, Inc.
+ * All rights reserved.
+ *
+ * This source code is licensed under the BSD-style license found in the
+ * LICENSE file in the root directory of this source tree. An additional grant
+ * of patent rights can be found in the PATENTS file in the same directory.
+ */
+#pragma once
+
+#include <condition_variable>
+#include <deque>
+#include <functional>
+#include <mutex>
+#include <thread>
+
+namespace facebook {
+namespace wdt {
+
+/**
+ * Runs the encryption or decryption of a socket on a separate thread, so that
+ * the crypto of a buffer overlaps with the socket io of the connection thread.
+ * The cipher stream of a connection direction is sequential: the buffers
+ * submitted are processed in order on the worker, chunk by chunk, and the
+ * number of bytes processed so far is published so that the caller can write
+ * the chunks that are ready while the next ones are encrypted. A session is
+ * started by begin() and ended by end(), only one session can be active at a
+ * time. Each connection thread is expected to own its worker.
+ */
+class CryptoWorker {
+ public:
+  /// encrypts or decrypts len bytes in place, @return false on failure
+  using ChunkFunc = std::function<bool(char *data, int len)>;
+
+  /// @param chunkSize    number of bytes processed at a time
+  explicit CryptoWorker(int chunkSize);
+
+  /// stops the worker thread
+  ~CryptoWorker();
+
+  /// @return   number of bytes processed at a time
+  int getChunkSize() const {
+    return chunkSize_;
+  }
+
+  /// starts a session processing the buffers submitted with func
+  void begin(ChunkFunc func);
+
+  /// queues len bytes of data to be processed after the previous ones
+  void submit(char *data, int len);
+
+  /**
+   * Waits till the first numBytes bytes submitted in the session are
+   * processed
+   *
+   * @return              number of bytes processed, which can be more than
+   *                      numBytes, -1 if processing failed
+   */
+  int64_t waitFor(int64_t numBytes);
+
+  /**
+   * Waits for all the buffers submitted and ends the session
+   *
+   * @return              false if processing of any buffer failed
+   */
+  bool end();
+
+  CryptoWorker(const CryptoWorker &) = delete;
+  CryptoWorker &operator=(const CryptoWorker &) = delete;
+
+ private:
+  struct Job {
+    char *data;
+    int len;
+  };
+
+  /// worker thread loop
+  void run();
+
+  const int chunkSize_;
+  ChunkFunc func_{nullptr};
+  std::deque<Job> jobs_;
+  /// bytes submitted and processed in the current session
+  int64_t numSubmitted_{0};
+  int64_t numProcessed_{0};
+  bool failed_{false};
+  bool stop_{false};
+
+  std::mutex mutex_;
+  /// notified when jobs are submitted or the worker has to stop
+  std::condition_variable jobCond_;
+  /// notified when a chunk is processed
+  std::condition_variable progressCond_;
+  std::thread thread_;
+};
+}
+}
@@ -0,0 +1,290 @@
+/**
+ * Copyright (c) 2014-present, Facebook, Inc.
+ * All rights reserved.
+ *
+ * This source code is licensed under the BSD-style license found in the
+ * LICENSE file in the root directory of this source tree. An additional grant
+ * of patent rights can be found in the PATENTS file in the same directory.
+ */
+#include <wdt/util/DeltaResumption.h>
+
+#include <wdt/ErrorCodes.h>
+#include <wdt/Reporting.h>
+#include <wdt/WdtConfig.h>
+#include <wdt/util/CommonImpl.h>
+#include <wdt/util/EncryptionUtils.h>
+
+#include <errno.h>
+#include <fcntl.h>
+#include <openssl/evp.h>
+#include <string.h>
+#include <unistd.h>
+#include <algorithm>
+#include <atomic>
+#include <thread>
+
+namespace facebook {
+namespace wdt {
+
+/// size of the reads done to hash a block
+static const int64_t kHashReadSize = 1024 * 1024;
+
+void DeltaResumption::hashReceivedFiles(
+    const std::string &rootDir, int64_t blockSize,
+    const DeltaReadOptions &readOptions, const IAbortChecker *abortChecker,
+    std::vector<FileChunksInfo> &fileChunksInfo) {
+  WDT_CHECK_GT(blockSize, 0);
+  std::string dir = rootDir;
+  if (!dir.empty() && dir.back() != '/') {
+    dir.push_back('/');
+  }
+  // split the entries first, each entry is then hashed by a single thread
+  std::vector<FileChunksInfo> entries;
+  for (auto &fileInfo : fileChunksInfo) {
+    const int64_t seqId = fileInfo.getSeqId();
+    const int64_t fileSize = fileInfo.getFileSize();
+    std::string fileName = fileInfo.getFileName();
+    // the first entry of a file keeps the chunks
+    fileInfo.setBlockHashes(blockSize, 0, std::string());
+    entries.emplace_back(std::move(fileInfo));
+    const int64_t numBlocks = (fileSize + blockSize - 1) / blockSize;
+    for (int64_t block = kMaxHashesPerEntry; block < numBlocks;
+         block += kMaxHashesPerEntry) {
+      FileChunksInfo entry(seqId, fileName, fileSize);
+      entry.setBlockHashes(blockSize, block, std::string());
+      entries.emplace_back(std::move(entry));
+    }
+  }
+  std::atomic<int64_t> nextEntry{0};
+  std::atomic<int64_t> numBlocksHashed{0};
+  auto hashEntries = [&] {
+    std::vector<char> buf;
+    while (true) {
+      const int64_t index = nextEntry++;
+      if (index >= (int64_t)entries.size()) {
+        return;
+      }
+      FileChunksInfo &entry = entries[index];
+      const int64_t fileSize = entry.getFileSize();
+      const int64_t firstBlock = entry.getFirstHashedBlock();
+      const int64_t endBlock =
+          std::min((fileSize + blockSize - 1) / blockSize,
+                   firstBlock + kMaxHashesPerEntry);
+      if (firstBlock >= endBlock) {
+        continue;
+      }
+      const std::string path = dir + entry.getFileName();
+      int fd = openForHashing(path, readOptions);
+      if (fd < 0) {
+        WPLOG(WARNING) << "Unable to open " << path << " to hash its blocks";
+        continue;
+      }
+      std::string hashes(
+          (endBlock - firstBlock) * FileChunksInfo::kBlockHashLen, 0);
+      int64_t block = firstBlock;
+      for (; block < endBlock; block++) {
+        if (abortChecker->shouldAbort()) {
+          break;
+        }
+        const int64_t offset = block * blockSize;
+        const int64_t size = std::min(blockSize, fileSize - offset);
+        char *hash =
+            &hashes[(block - firstBlock) * FileChunksInfo::kBlockHashLen];
+        if (!hashBlock(fd, offset, size, buf, hash, readOptions)) {
+          WPLOG(WARNING) << "Unable to hash block " << block << " of "
+                         << path;
+          break;
+        }
+      }
+      ::close(fd);
+      // the blocks hashed before an error are still usable
+      hashes.resize((block - firstBlock) * FileChunksInfo::kBlockHashLen);
+      numBlocksHashed += block - firstBlock;
+      entry.setBlockHashes(blockSize, firstBlock, std::move(hashes));
+    }
+  };
+  auto startTime = Clock::now();
+  std::vector<std::thread> threads;
+  const int numThreads = std::max<int>(
+      1, std::min<int64_t>(readOptions.numThreads, entries.size()));
+  for (int i = 1; i < numThreads; i++) {
+    threads.emplace_back(hashEntries);
+  }
+  hashEntries();
+  for (auto &thread : threads) {
+    thread.join();
+  }
+  fileChunksInfo = std::move(entries);
+  WLOG(INFO) << "Hashed " << numBlocksHashed << " blocks of " << blockSize
+             << " bytes in " << durationMillis(Clock::now() - startTime)
+             << " ms";
+}
+
+bool DeltaResumption::findUnchangedBlocks(const std::string &fullPath,
+                                          int64_t fileSize,
+                                          const FileChunksInfo &received,
+                                          const DeltaReadOptions &readOptions,
+                                          const IAbortChecker *abortChecker,
+                                          std::vector<Interval> &unchanged) {
+  const int64_t blockSize = received.getBlockHashSize();
+  WDT_CHECK_GT(blockSize, 0);
+  int fd = openForHashing(fullPath, readOptions);
+  if (fd < 0) {
+    WPLOG(ERROR) << "Unable to open " << fullPath << " to compare its blocks";
+    return false;
+  }
+  const std::string &hashes = received.getBlockHashes();
+  const int64_t firstBlock = received.getFirstHashedBlock();
+  const int64_t numHashes = received.getNumBlockHashes();
+  // each thread compares a contiguous range of the blocks
+  const int numThreads = std::max<int>(
+      1, std::min<int64_t>(readOptions.numThreads, numHashes));
+  const int64_t blocksPerThread = (numHashes + numThreads - 1) / numThreads;
+  std::vector<std::vector<Interval>> threadUnchanged(numThreads);
+  std::atomic<bool> success{true};
+  auto compareBlocks = [&](int thread) {
+    std::vector<char> buf;
+    char hash[FileChunksInfo::kBlockHashLen];
+    std::vector<Interval> &ranges = threadUnchanged[thread];
+    const int64_t end = std::min(numHashes, (thread + 1) * blocksPerThread);
+    for (int64_t i = thread * blocksPerThread; i < end; i++) {
+      if (!success || abortChecker->shouldAbort()) {
+        success = false;
+        return;
+      }
+      const int64_t offset = (firstBlock + i) * blockSize;
+      // the last block of the receiver can be shorter
+      const int64_t blockEnd =
+          std::min(offset + blockSize, received.getFileSize());
+      if (blockEnd > fileSize) {
+        return;
+      }
+      if (!hashBlock(fd, offset, blockEnd - offset, buf, hash, readOptions)) {
+        WPLOG(ERROR) << "Unable to read " << fullPath << " at " << offset;
+        success = false;
+        return;
+      }
+      if (memcmp(hash, &hashes[i * FileChunksInfo::kBlockHashLen],
+                 FileChunksInfo::kBlockHashLen) != 0) {
+        continue;
+      }
+      if (!ranges.empty() && ranges.back().end_ == offset) {
+        ranges.back().end_ = blockEnd;
+      } else {
+        ranges.emplace_back(offset, blockEnd);
+      }
+    }
+  };
+  std::vector<std::thread> threads;
+  for (int i = 1; i < numThreads; i++) {
+    threads.emplace_back(compareBlocks, i);
+  }
+  compareBlocks(0);
+  for (auto &thread : threads) {
+    thread.join();
+  }
+  ::close(fd);
+  for (const auto &ranges : threadUnchanged) {
+    for (const auto &range : ranges) {
+      if (!unchanged.empty() && unchanged.back().end_ == range.start_) {
+        unchanged.back().end_ = range.end_;
+      } else {
+        unchanged.push_back(range);
+      }
+    }
+  }
+  return success;
+}
+
+bool DeltaResumption::hashFile(const std::string &fullPath, int64_t fileSize,
+                               std::string &hash) {
+  int fd = ::open(fullPath.c_str(), O_RDONLY | O_CLOEXEC);
+  if (fd < 0) {
+    WPLOG(ERROR) << "Unable to open " << fullPath << " to hash it";
+    return false;
+  }
+  std::vector<char> buf;
+  hash.resize(FileChunksInfo::kBlockHashLen);
+  const bool success = hashBlock(fd, 0, fileSize, buf, &hash[0]);
+  if (!success) {
+    WPLOG(ERROR) << "Unable to read " << fullPath << " to hash it";
+  }
+  ::close(fd);
+  return success;
+}
+
+int DeltaResumption::openForHashing(const std::string &path,
+                                    const DeltaReadOptions &readOptions) {
+  int flags = O_RDONLY | O_CLOEXEC;
+#ifdef O_DIRECT
+  if (readOptions.directReads) {
+    flags |= O_DIRECT;
+  }
+#endif
+  int fd = ::open(path.c_str(), flags);
+  if (fd < 0 && errno == EINVAL && flags != (O_RDONLY | O_CLOEXEC)) {
+    WVLOG(1) << "O_DIRECT not supported for " << path;
+    fd = ::open(path.c_str(), O_RDONLY | O_CLOEXEC);
+  }
+  return fd;
+}
+
+bool DeltaResumption::hashBlock(int fd, int64_t offset, int64_t size,
+                                std::vector<char> &buf, char *hash,
+                                const DeltaReadOptions &readOptions) {
+  const int64_t blockOffset = offset;
+  const int64_t blockSize = size;
+  // room to align the buffer and round the reads up for O_DIRECT
+  buf.resize(std::min(size, kHashReadSize) + 2 * kDiskBlockSize);
+  char *data = buf.data();
+  const int64_t misalignment = (uintptr_t)data % kDiskBlockSize;
+  if (misalignment != 0) {
+    data += kDiskBlockSize - misalignment;
+  }
+  bool directReads = readOptions.directReads;
+  WdtCryptoIntializer::ensureInitialized();
+  EVP_MD_CTX *ctx = EVP_MD_CTX_create();
+  bool success = EVP_DigestInit_ex(ctx, EVP_sha256(), nullptr) == 1;
+  while (success && size > 0) {
+    int64_t toRead = std::min<int64_t>(size, kHashReadSize);
+    if (directReads) {
+      toRead = (toRead + kDiskBlockSize - 1) / kDiskBlockSize * kDiskBlockSize;
+    }
+    const ssize_t numRead = ::pread(fd, data, toRead, offset);
+#ifdef O_DIRECT
+    if (numRead < 0 && errno == EINVAL && directReads) {
+      // unaligned block, the fd is shared by the threads hashing the file
+      WVLOG(1) << "O_DIRECT read refused at " << offset << ", reading buffered";
+      const int flags = fcntl(fd, F_GETFL, 0);
+      success = flags >= 0 && fcntl(fd, F_SETFL, flags & ~O_DIRECT) == 0;
+      directReads = false;
+      continue;
+    }
+#endif
+    if (numRead <= 0) {
+      success = false;
+      break;
+    }
+    // direct reads can go past the block
+    const int64_t hashed = std::min<int64_t>(numRead, size);
+    success = EVP_DigestUpdate(ctx, data, hashed) == 1;
+    offset += hashed;
+    size -= hashed;
+  }
+  unsigned int hashLen = 0;
+  success = success &&
+            EVP_DigestFinal_ex(ctx, reinterpret_cast<unsigned char *>(hash),
+                               &hashLen) == 1 &&
+            hashLen == FileChunksInfo::kBlockHashLen;
+  EVP_MD_CTX_destroy(ctx);
+#ifdef HAS_POSIX_FADVISE
+  if (readOptions.dropCache && !readOptions.directReads &&
+      posix_fadvise(fd, blockOffset, blockSize, POSIX_FADV_DONTNEED) != 0) {
+    WPLOG(WARNING) << "posix_fadvise failed for fd " << fd << " "
+                   << blockOffset << " " << blockSize;
+  }
+#endif
+  return success;
+}
+}
+}
@@ -0,0 +1,103 @@
+/**
+ * Copyright (c) 2014-present, Facebook, Inc.
+ * All rights reserved.
+ *
+ * This source code is licensed under the BSD-style license found in the
+ * LICENSE file in the root directory of this source tree. An additional grant
+ * of patent rights can be found in the PATENTS file in the same directory.
+ */
+#pragma once
+
+#include <wdt/AbortChecker.h>
+#include <wdt/Protocol.h>
+
+#include <string>
+#include <vector>
+
+namespace facebook {
+namespace wdt {
+
+/// how the blocks are read to be hashed
+struct DeltaReadOptions {
+  /// number of threads hashing
+  int numThreads{1};
+  /// whether the files are read with O_DIRECT, when the filesystem allows
+  bool directReads{false};
+  /// whether the blocks read are dropped from the page cache
+  bool dropCache{false};
+};
+
+/**
+ * Block by block comparison of the files found on both sides of a resumed
+ * transfer. The receiver hashes the blocks of the files it has, sends the
+ * hashes with the file chunks and the sender only sends the blocks whose
+ * content differs, so a large file with a few modified blocks costs those
+ * blocks instead of the whole file.
+ */
+class DeltaResumption {
+ public:
+  /// max number of hashes in an entry of the file chunks list, so that an
+  /// entry fits in the buffer the list is sent with
+  static constexpr int64_t kMaxHashesPerEntry = 1024;
+
+  /**
+   * Hashes the blocks of the files of the receiver. Entries of the files with
+   * more than kMaxHashesPerEntry blocks are split in several entries, the
+   * chunks staying with the first one
+   *
+   * @param rootDir         directory of the files
+   * @param blockSize       size of the blocks hashed
+   * @param readOptions     how the blocks are read
+   * @param abortChecker    checked between blocks
+   * @param fileChunksInfo  entries of the files, hashes are added to them
+   */
+  static void hashReceivedFiles(const std::string &rootDir, int64_t blockSize,
+                                const DeltaReadOptions &readOptions,
+                                const IAbortChecker *abortChecker,
+                                std::vector<FileChunksInfo> &fileChunksInfo);
+
+  /**
+   * Compares the blocks of a file of the sender with the hashes of the
+   * receiver, the blocks being split between the threads
+   *
+   * @param fullPath        path of the file
+   * @param fileSize        size of the file
+   * @param received        receiver entry of the file, with its hashes
+   * @param readOptions     how the blocks are read
+   * @param abortChecker    checked between blocks
+   * @param unchanged       set to the ranges identical on the receiver side
+   *
+   * @return                false if the file could not be read
+   */
+  static bool findUnchangedBlocks(const std::string &fullPath,
+                                  int64_t fileSize,
+                                  const FileChunksInfo &received,
+                                  const DeltaReadOptions &readOptions,
+                                  const IAbortChecker *abortChecker,
+                                  std::vector<Interval> &unchanged);
+
+  /**
+   * Hashes the whole content of a file, used to find the files of a
+   * transfer with the same content
+   *
+   * @param fullPath        path of the file
+   * @param fileSize        size of the file
+   * @param hash            set to the kBlockHashLen bytes hash of the file
+   *
+   * @return                false if the file could not be read
+   */
+  static bool hashFile(const std::string &fullPath, int64_t fileSize,
+                       std::string &hash);
+
+ private:
+  /// @return   fd of the file opened for hashing, -1 on error
+  static int openForHashing(const std::string &path,
+                            const DeltaReadOptions &readOptions);
+
+  /// hashes size bytes of fd at offset into hash, buf is used for reading
+  static bool hashBlock(
+      int fd, int64_t offset, int64_t size, std::vector<char> &buf,
+      char *hash, const DeltaReadOptions &readOptions = DeltaReadOptions());
+};
+}
+}
@@ -0,0 +1,152 @@
+/**
+ * Copyright (c) 2014-present, Facebook, Inc.
+ * All rights reserved.
+ *
+ * This source code is licensed under the BSD-style license found in the
+ * LICENSE file in the root directory of this source tree. An additional grant
+ * of patent rights can be found in the PATENTS file in the same directory.
+ */
+#include <wdt/util/DirectoryReader.h>
+
+#include <wdt/ErrorCodes.h>
+
+#include <errno.h>
+#include <fcntl.h>
+#include <limits.h>
+#include <unistd.h>
+#include <algorithm>
+#ifdef __linux__
+#include <sys/syscall.h>
+#endif
+
+namespace facebook {
+namespace wdt {
+
+// big enough for thousands of entries per syscall
+const int DirectoryReader::kDefaultBufferSize = 256 * 1024;
+
+#ifdef __linux__
+/// layout of the records returned by getdents64 (not exported by glibc)
+struct LinuxDirent64 {
+  uint64_t d_ino;
+  int64_t d_off;
+  unsigned short d_reclen;
+  unsigned char d_type;
+  char d_name[];
+};
+#endif
+
+static bool isDotOrDotDot(const char *name) {
+  return name[0] == '.' &&
+         (name[1] == '\0' || (name[1] == '.' && name[2] == '\0'));
+}
+
+DirectoryReader::DirectoryReader(int bufferSize) {
+#ifdef __linux__
+  buffer_.resize(std::max<int>(bufferSize, sizeof(LinuxDirent64) + NAME_MAX));
+#endif
+}
+
+DirectoryReader::~DirectoryReader() {
+  close();
+}
+
+bool DirectoryReader::open(const std::string &path) {
+  close();
+  fd_ = ::open(path.c_str(), O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+  if (fd_ < 0) {
+    return false;
+  }
+#ifndef __linux__
+  dirPtr_ = fdopendir(fd_);
+  if (dirPtr_ == nullptr) {
+    int savedErrno = errno;
+    ::close(fd_);
+    fd_ = -1;
+    errno = savedErrno;
+    return false;
+  }
+#endif
+  return true;
+}
+
+void DirectoryReader::close() {
+#ifdef __linux__
+  bufferOffset_ = bufferSize_ = 0;
+  eof_ = false;
+  if (fd_ >= 0) {
+    ::close(fd_);
+  }
+#else
+  if (dirPtr_ != nullptr) {
+    // also closes fd_
+    closedir(dirPtr_);
+    dirPtr_ = nullptr;
+  }
+#endif
+  fd_ = -1;
+  hasError_ = false;
+}
+
+bool DirectoryReader::next(const char *&name, unsigned char &type) {
+  if (fd_ < 0 || hasError_) {
+    return false;
+  }
+#ifdef __linux__
+  while (true) {
+    if (bufferOffset_ >= bufferSize_) {
+      if (eof_) {
+        return false;
+      }
+      long numRead;
+      do {
+        numRead =
+            syscall(SYS_getdents64, fd_, buffer_.data(), buffer_.size());
+      } while (numRead < 0 && errno == EINTR);
+      if (numRead < 0) {
+        hasError_ = true;
+        return false;
+      }
+      numBatches_++;
+      if (numRead == 0) {
+        eof_ = true;
+        return false;
+      }
+      bufferOffset_ = 0;
+      bufferSize_ = numRead;
+    }
+    const LinuxDirent64 *entry = reinterpret_cast<const LinuxDirent64 *>(
+        buffer_.data() + bufferOffset_);
+    bufferOffset_ += entry->d_reclen;
+    if (isDotOrDotDot(entry->d_name)) {
+      continue;
+    }
+    name = entry->d_name;
+    type = entry->d_type;
+    return true;
+  }
+#else
+  while (true) {
+    errno = 0;  // yes that's right
+    struct dirent *entry = readdir(dirPtr_);
+    if (entry == nullptr) {
+      hasError_ = (errno != 0);
+      return false;
+    }
+    if (isDotOrDotDot(entry->d_name)) {
+      continue;
+    }
+    name = entry->d_name;
+    type = entry->d_type;
+    return true;
+  }
+#endif
+}
+
+bool DirectoryReader::statEntry(const char *name, bool followLink,
+                                struct stat &st) const {
+  WDT_CHECK_GE(fd_, 0);
+  return fstatat(fd_, name, &st, followLink ? 0 : AT_SYMLINK_NOFOLLOW) == 0;
+}
+}
+}
@@ -0,0 +1,113 @@
+/**
+ * Copyright (c) 2014-present, Facebook, Inc.
+ * All rights reserved.
+ *
+ * This source code is licensed under the BSD-style license found in the
+ * LICENSE file in the root directory of this source tree. An additional grant
+ * of patent rights can be found in the PATENTS file in the same directory.
+ */
+#pragma once
+
+#include <dirent.h>
+#include <sys/stat.h>
+
+#include <string>
+#include <vector>
+
+namespace facebook {
+namespace wdt {
+
+/**
+ * Reads the entries of directories through their fd. On linux the entries are
+ * read with getdents64 in large batches, elsewhere this falls back to readdir.
+ * Entries are only valid till the next call to next() or open(). One reader
+ * can be reused for many directories to avoid reallocating the batch buffer.
+ * Not thread safe.
+ */
+class DirectoryReader {
+ public:
+  /// default size of the buffer entries are read into
+  static const int kDefaultBufferSize;
+
+  /// @param bufferSize   size of the batch buffer (linux only)
+  explicit DirectoryReader(int bufferSize = kDefaultBufferSize);
+
+  /// closes the current directory, if any
+  ~DirectoryReader();
+
+  /**
+   * Opens a directory, closing the previous one
+   *
+   * @param path    path of the directory
+   *
+   * @return        false on error, errno is set
+   */
+  bool open(const std::string &path);
+
+  /**
+   * Reads the next entry. "." and ".." are skipped.
+   *
+   * @param name    set to the name of the entry
+   * @param type    set to the d_type of the entry (may be DT_UNKNOWN)
+   *
+   * @return        false once there are no entries left or on error, in which
+   *                case hasError() returns true and errno is set
+   */
+  bool next(const char *&name, unsigned char &type);
+
+  /**
+   * Stats an entry of the current directory, relative to the directory fd
+   * so that the path is not looked up again from the root
+   *
+   * @param name        name of the entry
+   * @param followLink  whether to stat the target of a symlink
+   * @param st          filled with the result
+   *
+   * @return            false on error, errno is set
+   */
+  bool statEntry(const char *name, bool followLink, struct stat &st) const;
+
+  /// @return   whether an error happened reading the current directory
+  bool hasError() const {
+    return hasError_;
+  }
+
+  /// @return   fd of the current directory, -1 if none is open
+  int getFd() const {
+    return fd_;
+  }
+
+  /// @return   number of batches read from the kernel since construction
+  int64_t getNumBatches() const {
+    return numBatches_;
+  }
+
+  /// closes the current directory
+  void close();
+
+  // making the object non-copyable and non-moveable
+  DirectoryReader(const DirectoryReader &) = delete;
+  DirectoryReader &operator=(const DirectoryReader &) = delete;
+
+ private:
+  /// fd of the current directory
+  int fd_{-1};
+  /// whether an error happened reading the current directory
+  bool hasError_{false};
+  /// number of batches read
+  int64_t numBatches_{0};
+#ifdef __linux__
+  /// batch of raw linux_dirent64 records
+  std::vector<char> buffer_;
+  /// offset of the next record in buffer_
+  int64_t bufferOffset_{0};
+  /// number of valid bytes in buffer_
+  int64_t bufferSize_{0};
+  /// set once getdents64 returned 0
+  bool eof_{false};
+#else
+  DIR *dirPtr_{nullptr};
+#endif
+};
+}
+}
@@ -8,15 +8,25 @@
  */
 #include <wdt/util/DirectorySourceQueue.h>
 
+#include <wdt/util/DeltaResumption.h>
+#include <wdt/util/DirectoryReader.h>
+#include <wdt/util/DiscoveryIndex.h>
+
 #include <sys/stat.h>
 #include <sys/types.h>
 #include <unistd.h>
 #include <wdt/Protocol.h>
 #include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <iterator>
+#include <limits>
 #include <set>
 #include <utility>
 
 #include <fcntl.h>
+#include <fnmatch.h>
+#include <poll.h>
 #include <regex>
 
 // NOTE: this should remain standalone code and not use WdtOptions directly
@@ -29,6 +39,23 @@ namespace wdt {
 
 using std::string;
 
+/// block size of the streams when block transfer is disabled
+const int64_t kDefaultStreamBlockBytes = 16 * 1024 * 1024;
+/// size of the reads of a stream
+const int64_t kStreamReadBytes = 1024 * 1024;
+/// interval between the abort checks while waiting for stream data
+const int kStreamPollMillis = 100;
+
+/// @return   whether fd is a stream of unknown size, not a regular file
+static bool isStreamFd(int fd) {
+  struct stat fileStat;
+  if (fstat(fd, &fileStat) != 0) {
+    WPLOG(ERROR) << "fstat failed on fd " << fd;
+    return false;
+  }
+  return !S_ISREG(fileStat.st_mode);
+}
+
 WdtFileInfo::WdtFileInfo(const string &name, int64_t size, bool doDirectReads)
     : fileName(name), fileSize(size), directReads(doDirectReads) {
 }
@@ -63,12 +90,51 @@ DirectorySourceQueue::DirectorySourceQueue(const WdtOptions &options,
       std::make_unique<ThreadCtx>(options, /* do not allocate buffer */ false);
   threadCtx_->setAbortChecker(abortChecker);
   setRootDir(rootDir);
+  setNumQueueShards(1);
 }
 
 void DirectorySourceQueue::setIncludePattern(const string &includePattern) {
   includePattern_ = includePattern;
 }
 
+void DirectorySourceQueue::setFilePriorities(const string &filePriorities) {
+  priorityGlobs_.clear();
+  size_t start = 0;
+  while (start < filePriorities.size()) {
+    size_t end = filePriorities.find(',', start);
+    if (end == string::npos) {
+      end = filePriorities.size();
+    }
+    const string pair = filePriorities.substr(start, end - start);
+    start = end + 1;
+    if (pair.empty()) {
+      continue;
+    }
+    // the glob may contain '=', the priority can't
+    const size_t equal = pair.rfind('=');
+    if (equal == string::npos || equal == 0 || equal + 1 == pair.size()) {
+      WLOG(ERROR) << "Ignoring invalid file priority " << pair;
+      continue;
+    }
+    char *parseEnd = nullptr;
+    const long priority = strtol(pair.c_str() + equal + 1, &parseEnd, 10);
+    if (*parseEnd != '\0') {
+      WLOG(ERROR) << "Ignoring invalid file priority " << pair;
+      continue;
+    }
+    priorityGlobs_.emplace_back(pair.substr(0, equal), (int)priority);
+  }
+}
+
+int DirectorySourceQueue::getGlobPriority(const string &relPath) const {
+  for (const auto &glob : priorityGlobs_) {
+    if (fnmatch(glob.first.c_str(), relPath.c_str(), 0) == 0) {
+      return glob.second;
+    }
+  }
+  return 0;
+}
+
 void DirectorySourceQueue::setExcludePattern(const string &excludePattern) {
   excludePattern_ = excludePattern;
 }
@@ -85,6 +151,11 @@ void DirectorySourceQueue::setFileInfo(
     const std::vector<WdtFileInfo> &fileInfo) {
   fileInfo_ = fileInfo;
   exploreDirectory_ = false;
+  for (const WdtFileInfo &info : fileInfo_) {
+    if (info.fd >= 0 && info.fileSize < 0 && isStreamFd(info.fd)) {
+      streaming_ = true;
+    }
+  }
 }
 
 const std::vector<WdtFileInfo> &DirectorySourceQueue::getFileInfo() const {
@@ -122,25 +193,237 @@ bool DirectorySourceQueue::setRootDir(const string &newRootDir) {
   if (dir.back() != '/') {
     dir.push_back('/');
   }
-  if (dir != rootDir_) {
+  if (dir != rootDir_ || !pathArena_) {
     rootDir_.assign(dir);
+    pathArena_ = std::make_unique<PathArena>(rootDir_);
     WLOG(INFO) << "Root dir now " << rootDir_;
   }
   return true;
 }
 
+void DirectorySourceQueue::setNumQueueShards(int numShards) {
+  std::lock_guard<std::mutex> lock(mutex_);
+  WDT_CHECK_EQ(0, numQueuedSources_.load()) << "Queue already has sources";
+  numShards = std::max(1, numShards);
+  shards_.clear();
+  for (int i = 0; i < numShards; i++) {
+    shards_.emplace_back(std::make_unique<QueueShard>());
+  }
+}
+
 void DirectorySourceQueue::clearSourceQueue() {
   // clear current content of the queue. For some reason, priority_queue does
   // not have a clear method
-  while (!sourceQueue_.empty()) {
-    sourceQueue_.pop();
+  for (auto &shard : shards_) {
+    std::lock_guard<std::mutex> lock(shard->mutex);
+    while (!shard->queue.empty()) {
+      shard->queue.pop();
+    }
+  }
+  numQueuedSources_ = 0;
+  numQueuedBytes_ = 0;
+}
+
+void DirectorySourceQueue::pushSource(std::unique_ptr<ByteSource> source) {
+  // sources are spread round robin, so that blocks of the same file end up in
+  // different shards, and are read by different threads. In disk order mode,
+  // a region of the disk is read by a single shard instead. With readers per
+  // device limited, a device is in a single shard, so that the top of each
+  // shard tells whether it can be read
+  const SourceMetaData &metadata = source->getMetaData();
+  uint64_t shardIndex;
+  if (metadata.deviceIndex >= 0) {
+    shardIndex = metadata.deviceIndex;
+  } else if (metadata.diskRegion >= 0) {
+    shardIndex = metadata.diskRegion;
+  } else {
+    shardIndex = nextPushShard_++;
+  }
+  QueueShard &shard = *shards_[shardIndex % shards_.size()];
+  std::lock_guard<std::mutex> lock(shard.mutex);
+  numQueuedBytes_ += source->getSize();
+  shard.queue.push(std::move(source));
+  numQueuedSources_++;
+}
+
+std::unique_ptr<ByteSource> DirectorySourceQueue::popSource(int preferredShard,
+                                                            int64_t maxSize) {
+  const int numShards = shards_.size();
+  int firstShard = std::max(0, preferredShard) % numShards;
+  if (numShards > 1 && hasPriorities_) {
+    // a higher priority class in another shard is sent first
+    firstShard = findPriorityShard(firstShard, maxSize);
+  }
+  for (int i = 0; i < numShards; i++) {
+    if (numQueuedSources_ == 0) {
+      break;
+    }
+    // own shard first, then steal from the others
+    std::unique_ptr<ByteSource> source =
+        popFromShard((firstShard + i) % numShards, maxSize);
+    if (source) {
+      return source;
+    }
+  }
+  return nullptr;
+}
+
+std::unique_ptr<ByteSource> DirectorySourceQueue::popFromShard(
+    int shardIndex, int64_t maxSize) {
+  QueueShard &shard = *shards_[shardIndex];
+  std::lock_guard<std::mutex> lock(shard.mutex);
+  if (shard.queue.empty() || shard.queue.top()->getSize() > maxSize) {
+    return nullptr;
+  }
+  // using const_cast since priority_queue returns a const reference
+  std::unique_ptr<ByteSource> source = std::move(
+      const_cast<std::unique_ptr<ByteSource> &>(shard.queue.top()));
+  shard.queue.pop();
+  numQueuedSources_--;
+  numQueuedBytes_ -= source->getSize();
+  if (prefetcher_) {
+    prefetcher_->markRead(source->getMetaData(), source->getOffset());
+  }
+  if (!shard.queue.empty()) {
+    // most likely the next source of the thread of this shard
+    const std::unique_ptr<ByteSource> &next = shard.queue.top();
+    next->prefetch();
+    if (prefetcher_) {
+      prefetcher_->add(next->getMetaData(), next->getOffset(),
+                       next->getSize());
+    }
+  }
+  return source;
+}
+
+void DirectorySourceQueue::releasePrefetch(const ByteSource &source) {
+  if (prefetcher_) {
+    prefetcher_->release(source.getMetaData(), source.getOffset());
+  }
+}
+
+std::unique_ptr<ByteSource> DirectorySourceQueue::popDeviceSource(
+    int threadIndex, int64_t maxSize, bool &saturated) {
+  saturated = false;
+  std::unique_ptr<ByteSource> source;
+  int32_t releasedDevice;
+  {
+    std::lock_guard<std::mutex> lock(deviceMutex_);
+    auto it = threadDevices_.find(threadIndex);
+    releasedDevice = (it == threadDevices_.end()) ? -1 : it->second;
+    releaseDeviceLocked(threadIndex);
+    const int numShards = shards_.size();
+    int bestShard = -1;
+    int bestPriority = 0;
+    int bestNumReaders = 0;
+    for (int i = 0; i < numShards; i++) {
+      // own shard first, so that a thread tends to stay on a device
+      const int shardIndex = (threadIndex + i) % numShards;
+      QueueShard &shard = *shards_[shardIndex];
+      std::lock_guard<std::mutex> shardLock(shard.mutex);
+      if (shard.queue.empty() || shard.queue.top()->getSize() > maxSize) {
+        continue;
+      }
+      const SourceMetaData &metadata = shard.queue.top()->getMetaData();
+      const int numReaders = metadata.deviceIndex >= 0
+                                 ? numDeviceReaders_[metadata.deviceIndex]
+                                 : 0;
+      if (numReaders >= maxReadersPerDevice_) {
+        saturated = true;
+        continue;
+      }
+      // higher priority classes first, then the device with the fewest
+      // readers
+      if (bestShard < 0 || metadata.priority > bestPriority ||
+          (metadata.priority == bestPriority && numReaders < bestNumReaders)) {
+        bestShard = shardIndex;
+        bestPriority = metadata.priority;
+        bestNumReaders = numReaders;
+      }
+    }
+    if (bestShard >= 0) {
+      // devices sharing a shard may have changed its top since, the limit is
+      // then only approximate
+      source = popFromShard(bestShard, maxSize);
+    }
+    if (source) {
+      saturated = false;
+      const int32_t deviceIndex = source->getMetaData().deviceIndex;
+      if (deviceIndex >= 0) {
+        numDeviceReaders_[deviceIndex]++;
+        threadDevices_[threadIndex] = deviceIndex;
+      }
+    }
+  }
+  if (releasedDevice >= 0 &&
+      (!source || source->getMetaData().deviceIndex != releasedDevice)) {
+    // threads waiting for a device may read this one now
+    notifyAllConsumers();
+  }
+  return source;
+}
+
+void DirectorySourceQueue::releaseDeviceLocked(int threadIndex) {
+  auto it = threadDevices_.find(threadIndex);
+  if (it == threadDevices_.end()) {
+    return;
+  }
+  numDeviceReaders_[it->second]--;
+  threadDevices_.erase(it);
+}
+
+void DirectorySourceQueue::setDevice(SourceMetaData *metadata,
+                                     int64_t deviceId) {
+  if (deviceId < 0) {
+    struct stat fileStat;
+    const int ret = (metadata->fd >= 0)
+                        ? fstat(metadata->fd, &fileStat)
+                        : stat(metadata->getFullPath().c_str(), &fileStat);
+    if (ret != 0) {
+      // will fail again, and be reported, when sending
+      WPLOG(WARNING) << "stat() failed on " << metadata->getFullPath();
+      return;
+    }
+    deviceId = fileStat.st_dev;
+  }
+  std::lock_guard<std::mutex> lock(deviceMutex_);
+  auto it = deviceIndexes_.find(deviceId);
+  if (it == deviceIndexes_.end()) {
+    it = deviceIndexes_.emplace(deviceId, numDeviceReaders_.size()).first;
+    numDeviceReaders_.push_back(0);
+    WLOG(INFO) << "Reading from device " << deviceId << " as device "
+               << it->second << ", up to " << maxReadersPerDevice_
+               << " readers";
   }
+  metadata->deviceId = deviceId;
+  metadata->deviceIndex = it->second;
+}
+
+int DirectorySourceQueue::findPriorityShard(int preferredShard,
+                                            int64_t maxSize) {
+  const int numShards = shards_.size();
+  int bestShard = preferredShard;
+  int bestPriority = std::numeric_limits<int>::min();
+  for (int i = 0; i < numShards; i++) {
+    const int shardIndex = (preferredShard + i) % numShards;
+    QueueShard &shard = *shards_[shardIndex];
+    std::lock_guard<std::mutex> lock(shard.mutex);
+    if (shard.queue.empty() || shard.queue.top()->getSize() > maxSize) {
+      continue;
+    }
+    const int priority = shard.queue.top()->getMetaData().priority;
+    if (priority > bestPriority) {
+      bestPriority = priority;
+      bestShard = shardIndex;
+    }
+  }
+  return bestShard;
 }
 
 void DirectorySourceQueue::setPreviouslyReceivedChunks(
     std::vector<FileChunksInfo> &previouslyTransferredChunks) {
   std::unique_lock<std::mutex> lock(mutex_);
-  WDT_CHECK_EQ(0, numBlocksDequeued_);
+  WDT_CHECK_EQ(0, numBlocksDequeued_.load());
   // reset all the queue variables
   nextSeqId_ = 0;
   totalFileSize_ = 0;
@@ -148,21 +431,67 @@ void DirectorySourceQueue::setPreviouslyReceivedChunks(
   numBlocks_ = 0;
   for (auto &chunkInfo : previouslyTransferredChunks) {
     nextSeqId_ = std::max(nextSeqId_, chunkInfo.getSeqId() + 1);
+    auto prev = previouslyTransferredChunks_.find(chunkInfo.getFileName());
+    if (prev != previouslyTransferredChunks_.end()) {
+      // next block hashes of a large file
+      if (!prev->second.appendBlockHashes(chunkInfo)) {
+        WLOG(ERROR) << "Unexpected block hashes for " << chunkInfo.getFileName()
+                    << " starting at block " << chunkInfo.getFirstHashedBlock();
+      }
+      continue;
+    }
     auto fileName = chunkInfo.getFileName();
     previouslyTransferredChunks_.insert(
         std::make_pair(std::move(fileName), std::move(chunkInfo)));
   }
   clearSourceQueue();
+  // the seq-ids and allocation status of the files change
+  manifest_.clear();
+  nextManifestIndex_ = 0;
+  numPendingManifestEntries_ = 0;
+  // and so do the files sent in full, the hashes are kept
+  dedupBySize_.clear();
+  dedupByHash_.clear();
+  numDuplicates_ = 0;
+  duplicateBytes_ = 0;
   // recreate the queue
-  for (const auto metadata : sharedFileData_) {
-    // TODO: do not notify inside createIntoQueueInternal. This method still
-    // holds the lock, so no point in notifying
-    createIntoQueueInternal(metadata);
+  if (fed_) {
+    for (const auto metadata : sharedFileData_) {
+      setFedFileStatus(metadata);
+    }
+    for (const auto &fedRange : fedRanges_) {
+      queueFedRange(fedRange.first, fedRange.second);
+    }
+  } else {
+    for (const auto metadata : sharedFileData_) {
+      if (metadata->isStream) {
+        setStreamFileStatus(metadata);
+        continue;
+      }
+      // TODO: do not notify inside createIntoQueueInternal. This method still
+      // holds the lock, so no point in notifying
+      createIntoQueueInternal(metadata);
+    }
+    for (const auto &streamBlock : streamBlocks_) {
+      queueStreamBlock(streamBlock.first, streamBlock.second);
+    }
   }
   enqueueFilesToBeDeleted();
 }
 
 DirectorySourceQueue::~DirectorySourceQueue() {
+  {
+    std::unique_lock<std::mutex> lock(mutex_);
+    if (deltaThreadRunning_) {
+      WLOG(WARNING) << "Waiting for the comparison of " << deltaFiles_.size()
+                    << " files";
+    }
+  }
+  if (deltaThread_.joinable()) {
+    deltaThread_.join();
+  }
+  // the prefetch thread reads the metadata
+  prefetcher_.reset();
   // need to remove all the sources because they access metadata at the
   // destructor.
   clearSourceQueue();
@@ -170,10 +499,13 @@ DirectorySourceQueue::~DirectorySourceQueue() {
     if (fileData->needToClose && fileData->fd >= 0) {
       int ret = ::close(fileData->fd);
       if (ret) {
-        WPLOG(ERROR) << "Failed to close file " << fileData->fullPath;
+        WPLOG(ERROR) << "Failed to close file " << fileData->getFullPath();
       }
     }
-    delete fileData;
+  }
+  if (pathArena_) {
+    WVLOG(1) << "Paths of " << sharedFileData_.size() << " files took "
+             << pathArena_->getNumBytes() << " bytes";
   }
 }
 
@@ -195,7 +527,9 @@ bool DirectorySourceQueue::buildQueueSynchronously() {
   bool res = false;
   // either traverse directory or we already have a fixed set of candidate
   // files
-  if (exploreDirectory_) {
+  if (fed_) {
+    res = waitForFeed();
+  } else if (exploreDirectory_) {
     res = explore();
   } else {
     WLOG(INFO) << "Using list of file info. Number of files "
@@ -206,9 +540,14 @@ bool DirectorySourceQueue::buildQueueSynchronously() {
     std::lock_guard<std::mutex> lock(mutex_);
     initFinished_ = true;
     enqueueFilesToBeDeleted();
+    reportFinishedPrioritiesLocked();
+    if (numDuplicates_ > 0) {
+      WLOG(INFO) << "Queued " << numDuplicates_ << " duplicate files, "
+                 << duplicateBytes_ << " bytes not sent";
+    }
     // TODO: comment why
-    if (sourceQueue_.empty()) {
-      conditionNotEmpty_.notify_all();
+    if (numQueuedSources_ == 0) {
+      notifyAllConsumers();
     }
   }
   directoryTime_ = durationSeconds(Clock::now() - startTime);
@@ -240,166 +579,352 @@ bool DirectorySourceQueue::explore() {
   WLOG(INFO) << "Exploring root dir " << rootDir_
              << " include_pattern : " << includePattern_
              << " exclude_pattern : " << excludePattern_
-             << " prune_dir_pattern : " << pruneDirPattern_;
+             << " prune_dir_pattern : " << pruneDirPattern_
+             << " discovery threads : " << numDiscoveryThreads_;
   WDT_CHECK(!rootDir_.empty());
-  bool hasError = false;
-  std::set<string> visited;
-  std::regex includeRegex(includePattern_);
-  std::regex excludeRegex(excludePattern_);
-  std::regex pruneDirRegex(pruneDirPattern_);
-  std::deque<string> todoList;
-  todoList.push_back("");
-  while (!todoList.empty()) {
-    if (threadCtx_->getAbortChecker()->shouldAbort()) {
-      WLOG(ERROR) << "Directory transfer thread aborted";
-      hasError = true;
-      break;
+  ExploreState state(includePattern_, excludePattern_, pruneDirPattern_);
+  if (!discoveryIndexPath_.empty()) {
+    // the index is only valid for the exact same discovery
+    string signature = rootDir_ + '\0' + includePattern_ + '\0' +
+                       excludePattern_ + '\0' + pruneDirPattern_ + '\0' +
+                       (followSymlinks_ ? "follow" : "nofollow");
+    discoveryIndex_ =
+        std::make_unique<DiscoveryIndex>(discoveryIndexPath_, signature);
+    discoveryIndex_->load();
+  }
+  if (numDiscoveryThreads_ > 1) {
+    exploreInParallel(state);
+  } else {
+    std::deque<string> todoList;
+    todoList.push_back("");
+    std::vector<string> subDirs;
+    DirectoryReader reader;
+    while (!todoList.empty()) {
+      if (threadCtx_->getAbortChecker()->shouldAbort()) {
+        WLOG(ERROR) << "Directory transfer thread aborted";
+        state.hasError = true;
+        break;
+      }
+      auto relativePath = todoList.front();
+      todoList.pop_front();
+      exploreDirectory(state, reader, relativePath, subDirs);
+      for (auto &subDir : subDirs) {
+        todoList.push_back(std::move(subDir));
+      }
+      subDirs.clear();
     }
-    // would be nice to do those 2 in 1 call...
-    auto relativePath = todoList.front();
-    todoList.pop_front();
-    const string fullPath = rootDir_ + relativePath;
-    WVLOG(1) << "Processing directory " << fullPath;
-    DIR *dirPtr = opendir(fullPath.c_str());
-    if (!dirPtr) {
-      WPLOG(ERROR) << "Error opening dir " << fullPath;
-      failedDirectories_.emplace_back(fullPath);
-      hasError = true;
-      continue;
+  }
+  const bool hasError = state.hasError;
+  WLOG(INFO) << "Number of files explored: " << numEntries_ << " opened "
+             << numFilesOpened_ << " with direct " << numFilesOpenedWithDirect_
+             << " unchanged " << numUnchangedFiles_ << " errors "
+             << std::boolalpha << hasError;
+  if (hasError) {
+    // an incomplete index would make the next run skip what it missed
+    discoveryIndex_.reset();
+  }
+  return !hasError;
+}
+
+bool DirectorySourceQueue::saveDiscoveryIndex() {
+  if (!discoveryIndex_) {
+    return false;
+  }
+  return discoveryIndex_->save();
+}
+
+void DirectorySourceQueue::exploreInParallel(ExploreState &state) {
+  const int numThreads = numDiscoveryThreads_;
+  struct WorkerQueue {
+    std::mutex mutex;
+    std::deque<string> dirs;
+  };
+  std::vector<std::unique_ptr<WorkerQueue>> queues;
+  for (int i = 0; i < numThreads; i++) {
+    queues.emplace_back(std::make_unique<WorkerQueue>());
+  }
+  // directories queued or being explored, discovery is over once it is 0
+  std::atomic<int64_t> numPendingDirs{1};
+  std::atomic<bool> aborted{false};
+  std::mutex idleMutex;
+  std::condition_variable idleCond;
+  queues[0]->dirs.push_back("");
+
+  auto popDir = [&](int index, string &dir) {
+    // own queue is used as a stack, so that each worker goes depth first in
+    // its part of the tree
+    {
+      WorkerQueue &own = *queues[index];
+      std::lock_guard<std::mutex> lock(own.mutex);
+      if (!own.dirs.empty()) {
+        dir = std::move(own.dirs.back());
+        own.dirs.pop_back();
+        return true;
+      }
     }
-    // http://elliotth.blogspot.com/2012/10/how-not-to-use-readdirr3.html
-    // tl;dr readdir is actually better than readdir_r ! (because of the
-    // nastiness of calculating correctly buffer size and race conditions there)
-    struct dirent *dirEntryRes = nullptr;
+    // steal the oldest directory of another worker, likely the largest
+    // remaining sub tree
+    for (int i = 1; i < numThreads; i++) {
+      WorkerQueue &victim = *queues[(index + i) % numThreads];
+      std::lock_guard<std::mutex> lock(victim.mutex);
+      if (!victim.dirs.empty()) {
+        dir = std::move(victim.dirs.front());
+        victim.dirs.pop_front();
+        return true;
+      }
+    }
+    return false;
+  };
+
+  auto worker = [&](int index) {
+    std::vector<string> subDirs;
+    DirectoryReader reader;
+    string dir;
     while (true) {
       if (threadCtx_->getAbortChecker()->shouldAbort()) {
-        break;
+        if (!aborted.exchange(true)) {
+          WLOG(ERROR) << "Directory transfer thread aborted";
+        }
+        state.hasError = true;
+        idleCond.notify_all();
+        return;
+      }
+      if (aborted) {
+        return;
       }
-      errno = 0;  // yes that's right
-      dirEntryRes = readdir(dirPtr);
-      if (!dirEntryRes) {
-        if (errno) {
-          WPLOG(ERROR) << "Error reading dir " << fullPath;
-          // closedir always called
-          hasError = true;
-        } else {
-          WVLOG(2) << "Done with " << fullPath;
-          // finished reading dir
+      if (!popDir(index, dir)) {
+        std::unique_lock<std::mutex> lock(idleMutex);
+        if (numPendingDirs == 0) {
+          return;
         }
-        break;
+        // timed wait to also poll the abort checker
+        idleCond.wait_for(lock, std::chrono::milliseconds(10));
+        continue;
       }
-      const auto dType = dirEntryRes->d_type;
-      WVLOG(2) << "Found entry " << dirEntryRes->d_name << " type "
-               << (int)dType;
-      if (dirEntryRes->d_name[0] == '.') {
-        if (dirEntryRes->d_name[1] == '\0' ||
-            (dirEntryRes->d_name[1] == '.' && dirEntryRes->d_name[2] == '\0')) {
-          WVLOG(3) << "Skipping entry : " << dirEntryRes->d_name;
-          continue;
+      exploreDirectory(state, reader, dir, subDirs);
+      if (!subDirs.empty()) {
+        numPendingDirs += subDirs.size();
+        WorkerQueue &own = *queues[index];
+        {
+          std::lock_guard<std::mutex> lock(own.mutex);
+          for (auto &subDir : subDirs) {
+            own.dirs.push_back(std::move(subDir));
+          }
         }
+        subDirs.clear();
+        idleCond.notify_all();
+      }
+      if (--numPendingDirs == 0) {
+        std::lock_guard<std::mutex> lock(idleMutex);
+        idleCond.notify_all();
       }
-      // Following code is a bit ugly trying to save stat() call for directories
-      // yet still work for xfs which returns DT_UNKNOWN for everything
-      // would be simpler to always stat()
+    }
+  };
 
-      // if we reach DT_DIR and DT_REG directly:
-      bool isDir = (dType == DT_DIR);
-      bool isLink = (dType == DT_LNK);
-      bool keepEntry = (isDir || dType == DT_REG || dType == DT_UNKNOWN);
-      if (followSymlinks_) {
-        keepEntry |= isLink;
+  std::vector<std::thread> threads;
+  for (int i = 1; i < numThreads; i++) {
+    threads.emplace_back(worker, i);
+  }
+  worker(0);
+  for (auto &thread : threads) {
+    thread.join();
+  }
+}
+
+void DirectorySourceQueue::exploreDirectory(ExploreState &state,
+                                            DirectoryReader &reader,
+                                            const string &relativePath,
+                                            std::vector<string> &subDirs) {
+  const string fullPath = rootDir_ + relativePath;
+  WVLOG(1) << "Processing directory " << fullPath;
+  if (!reader.open(fullPath)) {
+    WPLOG(ERROR) << "Error opening dir " << fullPath;
+    {
+      std::lock_guard<std::mutex> lock(state.mutex);
+      failedDirectories_.emplace_back(fullPath);
+    }
+    hasFailures_ = true;
+    state.hasError = true;
+    return;
+  }
+  // with a discovery index, entries of directories which did not change since
+  // the last successful send are taken from the index instead of being read
+  struct stat dirStat;
+  bool useIndex = false;
+  const std::vector<DiscoveryIndex::DirEntry> *indexedEntries = nullptr;
+  std::vector<DiscoveryIndex::DirEntry> readEntries;
+  size_t nextIndexedEntry = 0;
+  if (discoveryIndex_) {
+    if (fstat(reader.getFd(), &dirStat) == 0) {
+      useIndex = true;
+      indexedEntries =
+          discoveryIndex_->getUnchangedDirEntries(relativePath, dirStat);
+    } else {
+      WPLOG(ERROR) << "fstat() failed on dir " << fullPath;
+    }
+  }
+  bool aborted = false;
+  // entries are read in large batches and stat'ed relative to the directory
+  // fd, full paths are only built for the entries we keep
+  const char *name = nullptr;
+  unsigned char dType = DT_UNKNOWN;
+  while (true) {
+    if (threadCtx_->getAbortChecker()->shouldAbort()) {
+      aborted = true;
+      break;
+    }
+    if (indexedEntries) {
+      if (nextIndexedEntry >= indexedEntries->size()) {
+        WVLOG(2) << "Done with unchanged " << fullPath;
+        break;
+      }
+      const auto &entry = (*indexedEntries)[nextIndexedEntry++];
+      name = entry.name.c_str();
+      dType = entry.type;
+    } else if (!reader.next(name, dType)) {
+      if (reader.hasError()) {
+        WPLOG(ERROR) << "Error reading dir " << fullPath;
+        state.hasError = true;
+      } else {
+        WVLOG(2) << "Done with " << fullPath;
+        // finished reading dir
       }
-      if (!keepEntry) {
-        WVLOG(3) << "Ignoring entry type " << (int)(dType);
+      break;
+    } else if (useIndex) {
+      readEntries.push_back({name, dType});
+    }
+    WVLOG(2) << "Found entry " << name << " type " << (int)dType;
+    // Following code is a bit ugly trying to save stat() call for directories
+    // yet still work for xfs which returns DT_UNKNOWN for everything
+    // would be simpler to always stat()
+
+    // if we reach DT_DIR and DT_REG directly:
+    bool isDir = (dType == DT_DIR);
+    bool isLink = (dType == DT_LNK);
+    bool keepEntry = (isDir || dType == DT_REG || dType == DT_UNKNOWN);
+    if (followSymlinks_) {
+      keepEntry |= isLink;
+    }
+    if (!keepEntry) {
+      WVLOG(3) << "Ignoring entry type " << (int)(dType);
+      continue;
+    }
+    string newRelativePath = relativePath + name;
+    string newFullPath;
+    if (!isDir) {
+      // DT_REG, DT_LNK or DT_UNKNOWN cases
+      struct stat fileStat;
+      // On XFS we don't know yet if this is a symlink, so check
+      // if following symlinks is ok we will do stat() too
+      if (!reader.statEntry(name, false, fileStat)) {
+        WPLOG(ERROR) << "lstat() failed on path " << rootDir_
+                     << newRelativePath;
+        state.hasError = true;
         continue;
       }
-      string newRelativePath = relativePath + string(dirEntryRes->d_name);
-      string newFullPath = rootDir_ + newRelativePath;
-      if (!isDir) {
-        // DT_REG, DT_LNK or DT_UNKNOWN cases
-        struct stat fileStat;
-        // On XFS we don't know yet if this is a symlink, so check
-        // if following symlinks is ok we will do stat() too
-        if (lstat(newFullPath.c_str(), &fileStat) != 0) {
-          WPLOG(ERROR) << "lstat() failed on path " << newFullPath;
-          hasError = true;
+      isLink = S_ISLNK(fileStat.st_mode);
+      WVLOG(2) << "lstat for " << newRelativePath << " is link ? " << isLink;
+      if (followSymlinks_ && isLink) {
+        // Use stat to see if the pointed file is of the right type
+        // (overrides previous stat call result)
+        if (!reader.statEntry(name, true, fileStat)) {
+          WPLOG(ERROR) << "stat() failed on path " << rootDir_
+                       << newRelativePath;
+          state.hasError = true;
           continue;
         }
-        isLink = S_ISLNK(fileStat.st_mode);
-        WVLOG(2) << "lstat for " << newFullPath << " is link ? " << isLink;
-        if (followSymlinks_ && isLink) {
-          // Use stat to see if the pointed file is of the right type
-          // (overrides previous stat call result)
-          if (stat(newFullPath.c_str(), &fileStat) != 0) {
-            WPLOG(ERROR) << "stat() failed on path " << newFullPath;
-            hasError = true;
-            continue;
-          }
-          newFullPath = resolvePath(newFullPath);
-          if (newFullPath.empty()) {
-            // already logged error
-            hasError = true;
-            continue;
-          }
-          WVLOG(2) << "Resolved symlink " << dirEntryRes->d_name << " to "
-                   << newFullPath;
+        newFullPath = resolvePath(rootDir_ + newRelativePath);
+        if (newFullPath.empty()) {
+          // already logged error
+          state.hasError = true;
+          continue;
         }
+        WVLOG(2) << "Resolved symlink " << name << " to " << newFullPath;
+      }
 
-        // could dcheck that if DT_REG we better be !isDir
-        isDir = S_ISDIR(fileStat.st_mode);
-        // if we were DT_UNKNOWN this could still be a symlink, block device
-        // etc... (xfs)
-        if (S_ISREG(fileStat.st_mode)) {
-          WVLOG(2) << "Found file " << newFullPath << " of size "
-                   << fileStat.st_size;
-          if (!excludePattern_.empty() &&
-              std::regex_match(newRelativePath, excludeRegex)) {
-            continue;
-          }
-          if (!includePattern_.empty() &&
-              !std::regex_match(newRelativePath, includeRegex)) {
-            continue;
-          }
-          WdtFileInfo fileInfo(newRelativePath, fileStat.st_size, directReads_);
-          createIntoQueue(newFullPath, fileInfo);
+      // could dcheck that if DT_REG we better be !isDir
+      isDir = S_ISDIR(fileStat.st_mode);
+      // if we were DT_UNKNOWN this could still be a symlink, block device
+      // etc... (xfs)
+      if (S_ISREG(fileStat.st_mode)) {
+        WVLOG(2) << "Found file " << newRelativePath << " of size "
+                 << fileStat.st_size;
+        if (!excludePattern_.empty() &&
+            std::regex_match(newRelativePath, state.excludeRegex)) {
           continue;
         }
-      }
-      if (isDir) {
-        if (followSymlinks_) {
-          if (visited.find(newFullPath) != visited.end()) {
-            WLOG(ERROR) << "Attempted to visit directory twice: "
-                        << newFullPath;
-            hasError = true;
+        if (!includePattern_.empty() &&
+            !std::regex_match(newRelativePath, state.includeRegex)) {
+          continue;
+        }
+        if (useIndex) {
+          discoveryIndex_->addFile(newRelativePath, fileStat);
+          if (discoveryIndex_->isFileUnchanged(newRelativePath, fileStat)) {
+            WVLOG(2) << newRelativePath << " unchanged since last send";
+            const int64_t pathId = pathArena_->add(newRelativePath);
+            std::lock_guard<std::mutex> lock(mutex_);
+            previouslySentBytes_ += fileStat.st_size;
+            numUnchangedFiles_++;
+            unchangedPathIds_.push_back(pathId);
             continue;
           }
-          // TODO: consider custom hashing ignoring common prefix
-          visited.insert(newFullPath);
         }
-        newRelativePath.push_back('/');
-        if (pruneDirPattern_.empty() ||
-            !std::regex_match(newRelativePath, pruneDirRegex)) {
-          WVLOG(2) << "Adding " << newRelativePath;
-          todoList.push_back(std::move(newRelativePath));
+        if (newFullPath.empty()) {
+          newFullPath = rootDir_ + newRelativePath;
         }
+        WdtFileInfo fileInfo(newRelativePath, fileStat.st_size, directReads_);
+        createIntoQueue(newFullPath, fileInfo, fileStat.st_dev);
+        continue;
+      }
+    }
+    if (isDir) {
+      if (followSymlinks_) {
+        if (newFullPath.empty()) {
+          newFullPath = rootDir_ + newRelativePath;
+        }
+        std::lock_guard<std::mutex> lock(state.mutex);
+        if (!state.visited.insert(newFullPath).second) {
+          WLOG(ERROR) << "Attempted to visit directory twice: "
+                      << newFullPath;
+          state.hasError = true;
+          continue;
+        }
+        // TODO: consider custom hashing ignoring common prefix
+      }
+      newRelativePath.push_back('/');
+      if (pruneDirPattern_.empty() ||
+          !std::regex_match(newRelativePath, state.pruneDirRegex)) {
+        WVLOG(2) << "Adding " << newRelativePath;
+        subDirs.push_back(std::move(newRelativePath));
       }
     }
-    closedir(dirPtr);
   }
-  WLOG(INFO) << "Number of files explored: " << numEntries_ << " opened "
-             << numFilesOpened_ << " with direct " << numFilesOpenedWithDirect_
-             << " errors " << std::boolalpha << hasError;
-  return !hasError;
+  if (useIndex && !aborted && !reader.hasError()) {
+    discoveryIndex_->addDirectory(
+        relativePath, dirStat,
+        indexedEntries ? *indexedEntries : std::move(readEntries));
+  }
+  reader.close();
 }
 
 void DirectorySourceQueue::smartNotify(int32_t addedSource) {
   if (addedSource >= numClientThreads_) {
-    conditionNotEmpty_.notify_all();
+    notifyAllConsumers();
     return;
   }
   for (int i = 0; i < addedSource; i++) {
     conditionNotEmpty_.notify_one();
   }
+  if (addedSource > 0 && wakeUpCallback_) {
+    wakeUpCallback_();
+  }
+}
+
+void DirectorySourceQueue::notifyAllConsumers() {
+  conditionNotEmpty_.notify_all();
+  if (wakeUpCallback_) {
+    wakeUpCallback_();
+  }
 }
 
 void DirectorySourceQueue::returnToQueue(
@@ -407,9 +932,10 @@ void DirectorySourceQueue::returnToQueue(
   int returnedCount = 0;
   std::unique_lock<std::mutex> lock(mutex_);
   for (auto &source : sources) {
-    sourceQueue_.push(std::move(source));
+    releasePrefetch(*source);
+    pushSource(std::move(source));
     returnedCount++;
-    WDT_CHECK_GT(numBlocksDequeued_, 0);
+    WDT_CHECK_GT(numBlocksDequeued_.load(), 0);
     numBlocksDequeued_--;
   }
   lock.unlock();
@@ -423,7 +949,8 @@ void DirectorySourceQueue::returnToQueue(std::unique_ptr<ByteSource> &source) {
 }
 
 void DirectorySourceQueue::createIntoQueue(const string &fullPath,
-                                           WdtFileInfo &fileInfo) {
+                                           WdtFileInfo &fileInfo,
+                                           int64_t deviceId) {
   // TODO: currently we are treating small files(size less than blocksize) as
   // blocks. Also, we transfer file name in the header for all the blocks for a
   // large file. This can be optimized as follows -
@@ -434,29 +961,138 @@ void DirectorySourceQueue::createIntoQueue(const string &fullPath,
   // block and use a shorter header for subsequent blocks. Also, we can remove
   // block size once negotiated, since blocksize is sort of fixed.
   fileInfo.verifyAndFixFlags();
-  SourceMetaData *metadata = new SourceMetaData();
-  metadata->fullPath = fullPath;
-  metadata->relPath = fileInfo.fileName;
+  SourceMetaData *metadata = newMetaData();
+  metadata->setPaths(*pathArena_, fileInfo.fileName, fullPath);
   metadata->fd = fileInfo.fd;
   metadata->directReads = fileInfo.directReads;
   metadata->size = fileInfo.fileSize;
-  if ((openFilesDuringDiscovery_ != 0) && (metadata->fd < 0)) {
-    metadata->fd =
-        FileUtil::openForRead(*threadCtx_, fullPath, metadata->directReads);
-    ++numFilesOpened_;
-    if (metadata->directReads) {
-      ++numFilesOpenedWithDirect_;
-    }
-    metadata->needToClose = (metadata->fd >= 0);
-    // works for -1 up to 4B files
-    if (--openFilesDuringDiscovery_ == 0) {
-      WLOG(WARNING) << "Already opened " << numFilesOpened_
-                    << " files, will open the reminder as they are sent";
+  metadata->priority = fileInfo.priority != 0
+                           ? fileInfo.priority
+                           : getGlobPriority(fileInfo.fileName);
+  if (metadata->priority != 0) {
+    hasPriorities_ = true;
+  }
+  if (metadata->fd < 0) {
+    // discovery threads share the open counters and threadCtx_
+    std::lock_guard<std::mutex> openLock(openMutex_);
+    if (openFilesDuringDiscovery_ != 0) {
+      metadata->fd =
+          FileUtil::openForRead(*threadCtx_, fullPath, metadata->directReads);
+      ++numFilesOpened_;
+      if (metadata->directReads) {
+        ++numFilesOpenedWithDirect_;
+      }
+      metadata->needToClose = (metadata->fd >= 0);
+      // works for -1 up to 4B files
+      if (--openFilesDuringDiscovery_ == 0) {
+        WLOG(WARNING) << "Already opened " << numFilesOpened_
+                      << " files, will open the reminder as they are sent";
+      }
     }
   }
+  if (maxReadersPerDevice_ > 0) {
+    setDevice(metadata, deviceId);
+  }
+  if (diskOrderReads_) {
+    setDiskOrder(metadata);
+  }
+  if (sparseFiles_) {
+    setDataExtents(metadata);
+  }
+  if (dedupFiles_ && metadata->size >= dedupMinFileBytes_ &&
+      metadata->dataExtents.empty()) {
+    hashForDedup(metadata);
+  }
   std::unique_lock<std::mutex> lock(mutex_);
   sharedFileData_.emplace_back(metadata);
+  if (priorityCallback_) {
+    // a class with nothing left to send is still reported
+    pendingPriorityBytes_[metadata->priority];
+  }
   createIntoQueueInternal(metadata);
+  if (discoveryCallback_) {
+    discoveryCallback_(*metadata);
+  }
+}
+
+void DirectorySourceQueue::setDiskOrder(SourceMetaData *metadata) {
+  // files of the same region go to the same shard, so that each thread reads
+  // a part of the disk mostly sequentially
+  const int64_t kRegionBytes = 1LL << 30;
+  const int64_t kRegionInodes = 1LL << 16;
+  int fd = metadata->fd;
+  if (fd < 0) {
+    fd = ::open(metadata->getFullPath().c_str(), O_RDONLY | O_CLOEXEC);
+    if (fd < 0) {
+      // will fail again, and be reported, when sending
+      WPLOG(WARNING) << "Unable to open " << metadata->getFullPath()
+                     << " to find its disk location";
+      return;
+    }
+  }
+  const int64_t physicalOffset = FileUtil::getPhysicalOffset(fd);
+  if (physicalOffset >= 0) {
+    metadata->diskOrderKey = physicalOffset;
+    metadata->diskRegion = physicalOffset / kRegionBytes;
+  } else {
+    struct stat fileStat;
+    if (fstat(fd, &fileStat) == 0) {
+      metadata->diskOrderKey = fileStat.st_ino;
+      metadata->diskRegion = fileStat.st_ino / kRegionInodes;
+    } else {
+      WPLOG(WARNING) << "fstat() failed on " << metadata->getFullPath();
+    }
+  }
+  if (fd != metadata->fd) {
+    ::close(fd);
+  }
+  WVLOG(3) << metadata->getRelPath() << " disk order key "
+           << metadata->diskOrderKey << " region " << metadata->diskRegion;
+}
+
+void DirectorySourceQueue::setDataExtents(SourceMetaData *metadata) {
+  if (metadata->size <= 0) {
+    return;
+  }
+  struct stat fileStat;
+  const int ret = (metadata->fd >= 0)
+                      ? fstat(metadata->fd, &fileStat)
+                      : stat(metadata->getFullPath().c_str(), &fileStat);
+  if (ret != 0) {
+    WPLOG(WARNING) << "stat() failed on " << metadata->getFullPath();
+    return;
+  }
+  // st_blocks is in 512 bytes units, no need to look for holes if all the
+  // bytes are allocated
+  if (fileStat.st_blocks * 512 >= metadata->size) {
+    return;
+  }
+  int fd = metadata->fd;
+  if (fd < 0) {
+    fd = ::open(metadata->getFullPath().c_str(), O_RDONLY | O_CLOEXEC);
+    if (fd < 0) {
+      // will fail again, and be reported, when sending
+      WPLOG(WARNING) << "Unable to open " << metadata->getFullPath()
+                     << " to find its holes";
+      return;
+    }
+  }
+  if (FileUtil::getDataExtents(fd, metadata->size, metadata->dataExtents)) {
+    WVLOG(2) << metadata->getRelPath() << " is sparse, "
+             << metadata->dataExtents.size() << " data extents";
+  }
+  if (fd != metadata->fd) {
+    ::close(fd);
+  }
+}
+
+SourceMetaData *DirectorySourceQueue::newMetaData() {
+  std::lock_guard<std::mutex> lock(metaDataMutex_);
+  if (numSlabMetaData_ == kMetaDataPerSlab) {
+    metaDataSlabs_.emplace_back(new SourceMetaData[kMetaDataPerSlab]);
+    numSlabMetaData_ = 0;
+  }
+  return &metaDataSlabs_.back()[numSlabMetaData_++];
 }
 
 void DirectorySourceQueue::createIntoQueueInternal(SourceMetaData *metadata) {
@@ -470,7 +1106,7 @@ void DirectorySourceQueue::createIntoQueueInternal(SourceMetaData *metadata) {
   // block and use a shorter header for subsequent blocks. Also, we can remove
   // block size once negotiated, since blocksize is sort of fixed.
   auto &fileSize = metadata->size;
-  auto &relPath = metadata->relPath;
+  const std::string relPath = metadata->getRelPath();
   int64_t blockSizeBytes = blockSizeMbytes_ * 1024 * 1024;
   bool enableBlockTransfer = blockSizeBytes > 0;
   if (!enableBlockTransfer) {
@@ -479,12 +1115,22 @@ void DirectorySourceQueue::createIntoQueueInternal(SourceMetaData *metadata) {
   // if block transfer is disabled, treating fileSize as block size. This
   // ensures that we create a single block
   auto blockSize = enableBlockTransfer ? blockSizeBytes : fileSize;
+  if (enableBlockTransfer && adaptiveBlockSize_) {
+    blockSize = getAdaptiveBlockSize(totalFileSize_ + fileSize);
+  }
   int blockCount = 0;
   std::vector<Interval> remainingChunks;
   int64_t seqId;
   FileAllocationStatus allocationStatus;
   int64_t prevSeqId = 0;
   auto it = previouslyTransferredChunks_.find(relPath);
+  if (it != previouslyTransferredChunks_.end() &&
+      it->second.getBlockHashSize() > 0 &&
+      it->second.getFileSize() <= fileSize) {
+    // a larger file of the receiver is sent again in full, it is truncated
+    queueDeltaFile(metadata);
+    return;
+  }
   if (it == previouslyTransferredChunks_.end()) {
     // No previously transferred chunks
     remainingChunks.emplace_back(0, fileSize);
@@ -514,9 +1160,42 @@ void DirectorySourceQueue::createIntoQueueInternal(SourceMetaData *metadata) {
                            ? EXISTS_TOO_SMALL
                            : EXISTS_CORRECT_SIZE;
   }
+  if (!metadata->dataExtents.empty()) {
+    // holes are not sent, they are recreated by the receiver
+    std::vector<Interval> dataChunks;
+    for (const auto &chunk : remainingChunks) {
+      for (const auto &extent : metadata->dataExtents) {
+        const int64_t start = std::max(chunk.start_, extent.start_);
+        const int64_t end = std::min(chunk.end_, extent.end_);
+        if (start < end) {
+          dataChunks.emplace_back(start, end);
+        }
+      }
+    }
+    if (dataChunks.empty()) {
+      WLOG(INFO) << relPath << " data completely sent in previous transfer";
+      return;
+    }
+    remainingChunks = std::move(dataChunks);
+  }
   metadata->seqId = seqId;
   metadata->prevSeqId = prevSeqId;
   metadata->allocationStatus = allocationStatus;
+  metadata->duplicateOfSeqId = 0;
+  if (dedupFiles_ && allocationStatus == NOT_EXISTS &&
+      fileSize >= dedupMinFileBytes_ && metadata->dataExtents.empty()) {
+    // only a file sent in full in this transfer can be copied by the receiver
+    const std::string &hash = metadata->contentHash;
+    auto original = hash.empty() ? dedupByHash_.end() : dedupByHash_.find(hash);
+    if (original != dedupByHash_.end()) {
+      queueDuplicate(metadata, original->second);
+      return;
+    }
+    dedupBySize_[fileSize].push_back(metadata);
+    if (!hash.empty()) {
+      dedupByHash_.emplace(hash, metadata);
+    }
+  }
 
   for (const auto &chunk : remainingChunks) {
     int64_t offset = chunk.start_;
@@ -524,25 +1203,339 @@ void DirectorySourceQueue::createIntoQueueInternal(SourceMetaData *metadata) {
     do {
       const int64_t size = std::min<int64_t>(remainingBytes, blockSize);
       std::unique_ptr<ByteSource> source =
-          std::make_unique<FileByteSource>(metadata, size, offset);
-      sourceQueue_.push(std::move(source));
+          byteSourceFactory_
+              ? byteSourceFactory_(metadata, size, offset)
+              : std::make_unique<FileByteSource>(metadata, size, offset);
+      pushSource(std::move(source));
       remainingBytes -= size;
       offset += size;
       blockCount++;
     } while (remainingBytes > 0);
     totalFileSize_ += chunk.size();
+    if (priorityCallback_) {
+      pendingPriorityBytes_[metadata->priority] += chunk.size();
+    }
+  }
+  numEntries_++;
+  numBlocks_ += blockCount;
+  if (manifestEnabled_) {
+    manifest_.push_back(metadata);
+    numPendingManifestEntries_++;
+  }
+  smartNotify(blockCount);
+}
+
+void DirectorySourceQueue::feedBlock(const BlockDetails &block) {
+  std::lock_guard<std::mutex> lock(mutex_);
+  WDT_CHECK(fed_);
+  if (initFinished_) {
+    WLOG(ERROR) << "Block of " << block.fileName << " at " << block.offset
+                << " fed after the end of the feed";
+    hasFailures_ = true;
+    return;
+  }
+  SourceMetaData *&metadata = fedFiles_[block.fileName];
+  if (metadata == nullptr) {
+    metadata = newMetaData();
+    metadata->setPaths(*pathArena_, block.fileName, rootDir_ + block.fileName);
+    metadata->size = block.fileSize;
+    sharedFileData_.emplace_back(metadata);
+    setFedFileStatus(metadata);
+  } else if (metadata->size != block.fileSize) {
+    WLOG(WARNING) << block.fileName << " fed with size " << block.fileSize
+                  << " instead of " << metadata->size;
+  }
+  const Interval range(block.offset, block.offset + block.dataSize);
+  if (block.sparseFile) {
+    // the receiver must not preallocate the file either
+    metadata->dataExtents.push_back(range);
+  }
+  fedRanges_.emplace_back(metadata, range);
+  queueFedRange(metadata, range);
+}
+
+void DirectorySourceQueue::endFeed() {
+  std::lock_guard<std::mutex> lock(mutex_);
+  feedEnded_ = true;
+  conditionFeedEnded_.notify_all();
+}
+
+bool DirectorySourceQueue::waitForSources(int timeoutMillis) const {
+  std::unique_lock<std::mutex> lock(mutex_);
+  return conditionNotEmpty_.wait_for(
+      lock, std::chrono::milliseconds(timeoutMillis), [this] {
+        return numQueuedSources_ > 0 || (initFinished_ && deltaFiles_.empty());
+      });
+}
+
+bool DirectorySourceQueue::waitForFeed() {
+  WLOG(INFO) << "Queueing the blocks fed, of files of " << rootDir_;
+  const int kAbortCheckMillis = 100;
+  std::unique_lock<std::mutex> lock(mutex_);
+  while (!feedEnded_) {
+    if (threadCtx_->getAbortChecker()->shouldAbort()) {
+      WLOG(ERROR) << "Transfer aborted before the end of the feed";
+      return false;
+    }
+    conditionFeedEnded_.wait_for(lock,
+                                 std::chrono::milliseconds(kAbortCheckMillis));
+  }
+  WLOG(INFO) << "Feed ended, " << numEntries_ << " files " << numBlocks_
+             << " blocks";
+  return true;
+}
+
+void DirectorySourceQueue::setFedFileStatus(SourceMetaData *metadata) {
+  metadata->prevSeqId = 0;
+  auto it = previouslyTransferredChunks_.find(metadata->getRelPath());
+  if (it == previouslyTransferredChunks_.end()) {
+    metadata->seqId = nextSeqId_++;
+    metadata->allocationStatus = NOT_EXISTS;
+  } else if (it->second.getFileSize() > metadata->size) {
+    metadata->seqId = nextSeqId_++;
+    metadata->allocationStatus = EXISTS_TOO_LARGE;
+    metadata->prevSeqId = it->second.getSeqId();
+  } else {
+    metadata->seqId = it->second.getSeqId();
+    metadata->allocationStatus = it->second.getFileSize() < metadata->size
+                                     ? EXISTS_TOO_SMALL
+                                     : EXISTS_CORRECT_SIZE;
   }
   numEntries_++;
+  if (manifestEnabled_) {
+    manifest_.push_back(metadata);
+    numPendingManifestEntries_++;
+  }
+}
+
+void DirectorySourceQueue::queueFedRange(SourceMetaData *metadata,
+                                         const Interval &range) {
+  std::vector<Interval> toSend;
+  auto it = previouslyTransferredChunks_.find(metadata->getRelPath());
+  if (it != previouslyTransferredChunks_.end() &&
+      metadata->allocationStatus != EXISTS_TOO_LARGE) {
+    int64_t sentBytes = range.size();
+    for (const auto &chunk : it->second.getRemainingChunks(metadata->size)) {
+      const int64_t start = std::max(chunk.start_, range.start_);
+      const int64_t end = std::min(chunk.end_, range.end_);
+      if (start < end) {
+        toSend.emplace_back(start, end);
+        sentBytes -= end - start;
+      }
+    }
+    previouslySentBytes_ += sentBytes;
+    if (toSend.empty()) {
+      return;
+    }
+  } else {
+    toSend.push_back(range);
+  }
+  const int64_t blockSizeBytes = blockSizeMbytes_ * 1024 * 1024;
+  int blockCount = 0;
+  for (const auto &chunk : toSend) {
+    int64_t offset = chunk.start_;
+    int64_t remainingBytes = chunk.size();
+    do {
+      const int64_t size =
+          blockSizeBytes > 0 ? std::min(remainingBytes, blockSizeBytes)
+                             : remainingBytes;
+      pushSource(std::make_unique<FileByteSource>(metadata, size, offset));
+      remainingBytes -= size;
+      offset += size;
+      blockCount++;
+    } while (remainingBytes > 0);
+    totalFileSize_ += chunk.size();
+  }
   numBlocks_ += blockCount;
   smartNotify(blockCount);
 }
 
-std::vector<TransferStats> &DirectorySourceQueue::getFailedSourceStats() {
-  while (!sourceQueue_.empty()) {
-    failedSourceStats_.emplace_back(
-        std::move(sourceQueue_.top()->getTransferStats()));
-    sourceQueue_.pop();
+void DirectorySourceQueue::queueDuplicate(SourceMetaData *metadata,
+                                          const SourceMetaData *original) {
+  WVLOG(1) << metadata->getRelPath() << " is a duplicate of "
+           << original->getRelPath();
+  metadata->duplicateOfSeqId = original->seqId;
+  pushSource(std::make_unique<FileByteSource>(metadata, 0, 0));
+  numEntries_++;
+  numBlocks_++;
+  numDuplicates_++;
+  duplicateBytes_ += metadata->size;
+  // not in the manifest, the receiver must not prepare it
+  smartNotify(1);
+}
+
+void DirectorySourceQueue::hashForDedup(SourceMetaData *metadata) {
+  std::vector<SourceMetaData *> toHash;
+  {
+    std::lock_guard<std::mutex> lock(mutex_);
+    auto it = dedupBySize_.find(metadata->size);
+    if (it == dedupBySize_.end()) {
+      // no file to compare to yet, hashed if another file of its size comes
+      return;
+    }
+    for (SourceMetaData *sameSize : it->second) {
+      if (sameSize->contentHash.empty()) {
+        toHash.push_back(sameSize);
+      }
+    }
+  }
+  toHash.push_back(metadata);
+  std::vector<std::string> hashes(toHash.size());
+  for (size_t i = 0; i < toHash.size(); i++) {
+    if (!DeltaResumption::hashFile(toHash[i]->getFullPath(), toHash[i]->size,
+                                   hashes[i])) {
+      // sent as usual
+      hashes[i].clear();
+    }
+  }
+  std::lock_guard<std::mutex> lock(mutex_);
+  for (size_t i = 0; i < toHash.size(); i++) {
+    SourceMetaData *hashed = toHash[i];
+    if (!hashed->contentHash.empty() || hashes[i].empty()) {
+      // hashed by another discovery thread meanwhile
+      continue;
+    }
+    hashed->contentHash = std::move(hashes[i]);
+    if (hashed != metadata) {
+      // already queued in full
+      dedupByHash_.emplace(hashed->contentHash, hashed);
+    }
+  }
+}
+
+void DirectorySourceQueue::getManifestEntries(
+    int64_t maxBytes, std::vector<BlockDetails> &entries) {
+  std::lock_guard<std::mutex> lock(mutex_);
+  while (nextManifestIndex_ < manifest_.size()) {
+    const SourceMetaData *metadata = manifest_[nextManifestIndex_];
+    BlockDetails entry;
+    entry.fileName = metadata->getRelPath();
+    entry.seqId = metadata->seqId;
+    entry.fileSize = metadata->size;
+    entry.allocationStatus = metadata->allocationStatus;
+    entry.prevSeqId = metadata->prevSeqId;
+    entry.sparseFile = !metadata->dataExtents.empty();
+    maxBytes -= Protocol::maxManifestEntryLen(entry);
+    if (maxBytes < 0) {
+      break;
+    }
+    entries.emplace_back(std::move(entry));
+    nextManifestIndex_++;
+    numPendingManifestEntries_--;
+  }
+}
+
+void DirectorySourceQueue::queueDeltaFile(SourceMetaData *metadata) {
+  deltaFiles_.push_back(metadata);
+  if (deltaThreadRunning_) {
+    return;
+  }
+  if (deltaThread_.joinable()) {
+    // done with its loop, does not need the lock anymore
+    deltaThread_.join();
+  }
+  deltaThreadRunning_ = true;
+  deltaThread_ = std::thread(&DirectorySourceQueue::compareDeltaFiles, this);
+}
+
+void DirectorySourceQueue::compareDeltaFiles() {
+  std::unique_lock<std::mutex> lock(mutex_);
+  while (!deltaFiles_.empty()) {
+    SourceMetaData *metadata = deltaFiles_.front();
+    auto it = previouslyTransferredChunks_.find(metadata->getRelPath());
+    WDT_CHECK(it != previouslyTransferredChunks_.end());
+    // only this thread changes the entry once received, and references to
+    // the map elements stay valid
+    FileChunksInfo &received = it->second;
+    lock.unlock();
+    std::vector<Interval> unchanged;
+    if (!DeltaResumption::findUnchangedBlocks(
+            metadata->getFullPath(), metadata->size, received,
+            deltaReadOptions_, threadCtx_->getAbortChecker(), unchanged)) {
+      // sent in full, reading it again reports the error
+      unchanged.clear();
+    }
+    lock.lock();
+    deltaFiles_.pop_front();
+    int64_t unchangedSize = 0;
+    for (const auto &chunk : unchanged) {
+      unchangedSize += chunk.size();
+    }
+    WVLOG(1) << metadata->getRelPath() << " has " << unchangedSize << " of "
+             << metadata->size << " bytes unchanged on the receiver side";
+    received.setChunks(std::move(unchanged));
+    received.setBlockHashes(0, 0, std::string());
+    createIntoQueueInternal(metadata);
+  }
+  deltaThreadRunning_ = false;
+  reportFinishedPrioritiesLocked();
+  // consumers wait for the comparisons to end
+  notifyAllConsumers();
+}
+
+void DirectorySourceQueue::addAckedBytes(const SourceMetaData &metadata,
+                                         int64_t offset, int64_t dataBytes) {
+  if (dataBytes <= 0) {
+    return;
+  }
+  if (metadata.isStream && metadata.fd >= 0) {
+    // acked data is never sent again
+    numSpooledBytes_ -= dataBytes;
+#if defined(HAS_FALLOCATE) && defined(FALLOC_FL_PUNCH_HOLE)
+    if (fallocate(metadata.fd, FALLOC_FL_PUNCH_HOLE | FALLOC_FL_KEEP_SIZE,
+                  offset, dataBytes) != 0) {
+      WPLOG(WARNING) << "Unable to free " << dataBytes << " bytes at offset "
+                     << offset << " of the spool file of stream "
+                     << metadata.getRelPath();
+    }
+#endif
+  }
+  if (!priorityCallback_) {
+    return;
+  }
+  std::lock_guard<std::mutex> lock(mutex_);
+  auto it = pendingPriorityBytes_.find(metadata.priority);
+  if (it == pendingPriorityBytes_.end()) {
+    // already reported
+    return;
+  }
+  it->second -= dataBytes;
+  if (it->second <= 0) {
+    reportFinishedPrioritiesLocked();
+  }
+}
+
+void DirectorySourceQueue::reportFinishedPrioritiesLocked() {
+  if (!priorityCallback_ || !initFinished_ || !deltaFiles_.empty()) {
+    // more files of any class may come
+    return;
+  }
+  // a lower class done first, by threads with nothing else to send, is
+  // reported after the higher ones
+  while (!pendingPriorityBytes_.empty()) {
+    auto highest = std::prev(pendingPriorityBytes_.end());
+    if (highest->second > 0) {
+      return;
+    }
+    const int priority = highest->first;
+    pendingPriorityBytes_.erase(highest);
+    WLOG(INFO) << "All the files of priority " << priority << " acked";
+    priorityCallback_(priority);
+  }
+}
+
+SourceStatsTable &DirectorySourceQueue::getFailedSourceStats() {
+  for (auto &shard : shards_) {
+    std::lock_guard<std::mutex> lock(shard->mutex);
+    while (!shard->queue.empty()) {
+      const auto &source = shard->queue.top();
+      failedSourceStats_.add(source->getMetaData().seqId,
+                             source->getTransferStats());
+      shard->queue.pop();
+    }
   }
+  numQueuedSources_ = 0;
+  numQueuedBytes_ = 0;
   return failedSourceStats_;
 }
 
@@ -556,6 +1549,12 @@ bool DirectorySourceQueue::enqueueFiles() {
       WLOG(ERROR) << "Directory transfer thread aborted";
       return false;
     }
+    if (info.fd >= 0 && info.fileSize < 0 && isStreamFd(info.fd)) {
+      if (!enqueueStream(info)) {
+        return false;
+      }
+      continue;
+    }
     string fullPath = rootDir_ + info.fileName;
     if (info.fileSize < 0) {
       struct stat fileStat;
@@ -566,8 +1565,9 @@ bool DirectorySourceQueue::enqueueFiles() {
         failedSourceStat.setLocalErrorCode(BYTE_SOURCE_READ_ERROR);
         {
           std::unique_lock<std::mutex> lock(mutex_);
-          failedSourceStats_.emplace_back(std::move(failedSourceStat));
+          failedSourceStats_.add(-1, failedSourceStat);
         }
+        hasFailures_ = true;
 
         return false;
       }
@@ -578,9 +1578,141 @@ bool DirectorySourceQueue::enqueueFiles() {
   return true;
 }
 
+bool DirectorySourceQueue::enqueueStream(const WdtFileInfo &fileInfo) {
+  TransferStats failedSourceStat(fileInfo.fileName);
+  failedSourceStat.setLocalErrorCode(BYTE_SOURCE_READ_ERROR);
+  string spoolPath = streamSpoolDir_ + "/wdt_stream_XXXXXX";
+  const int spoolFd = mkstemp(&spoolPath[0]);
+  if (spoolFd < 0) {
+    WPLOG(ERROR) << "Unable to create the spool file " << spoolPath;
+    std::lock_guard<std::mutex> lock(mutex_);
+    failedSourceStats_.add(-1, failedSourceStat);
+    hasFailures_ = true;
+    return false;
+  }
+  // only the fd is used, the space is freed once it is closed
+  if (unlink(spoolPath.c_str()) != 0) {
+    WPLOG(WARNING) << "Unable to unlink the spool file " << spoolPath;
+  }
+  SourceMetaData *metadata = newMetaData();
+  metadata->setPaths(*pathArena_, fileInfo.fileName, spoolPath);
+  metadata->fd = spoolFd;
+  metadata->needToClose = true;
+  metadata->isStream = true;
+  {
+    std::lock_guard<std::mutex> lock(mutex_);
+    sharedFileData_.emplace_back(metadata);
+    setStreamFileStatus(metadata);
+  }
+  const int64_t blockSizeBytes = blockSizeMbytes_ * 1024 * 1024;
+  const int64_t blockSize =
+      blockSizeBytes > 0 ? blockSizeBytes : kDefaultStreamBlockBytes;
+  WLOG(INFO) << "Reading stream " << fileInfo.fileName << " from fd "
+             << fileInfo.fd << " in blocks of " << blockSize << " bytes";
+  std::vector<char> buffer(kStreamReadBytes);
+  int64_t numSpooled = 0;
+  int64_t numQueued = 0;
+  bool success = true;
+  while (true) {
+    if (threadCtx_->getAbortChecker()->shouldAbort()) {
+      WLOG(ERROR) << "Transfer aborted while reading stream "
+                  << fileInfo.fileName;
+      success = false;
+      break;
+    }
+    struct pollfd pollFd = {fileInfo.fd, POLLIN, 0};
+    const int numReady = poll(&pollFd, 1, kStreamPollMillis);
+    if (numReady == 0 || (numReady < 0 && errno == EINTR)) {
+      continue;
+    }
+    int64_t numRead = -1;
+    if (numReady > 0) {
+      numRead = ::read(fileInfo.fd, buffer.data(), buffer.size());
+      if (numRead < 0 && (errno == EINTR || errno == EAGAIN)) {
+        continue;
+      }
+    }
+    if (numRead < 0) {
+      WPLOG(ERROR) << "Error reading stream " << fileInfo.fileName;
+      success = false;
+      break;
+    }
+    if (numRead == 0) {
+      break;
+    }
+    if (streamSpoolMaxBytes_ > 0 &&
+        numSpooledBytes_ + numRead > streamSpoolMaxBytes_) {
+      // acks only come at checkpoints and at the end, waiting for them here
+      // would never end
+      WLOG(ERROR) << "Spool of stream " << fileInfo.fileName << " is full, "
+                  << numSpooledBytes_ << " bytes not acked yet, max "
+                  << streamSpoolMaxBytes_;
+      success = false;
+      break;
+    }
+    for (int64_t written = 0; written < numRead;) {
+      const int64_t numWritten =
+          ::pwrite(spoolFd, buffer.data() + written, numRead - written,
+                   numSpooled + written);
+      if (numWritten < 0 && errno == EINTR) {
+        continue;
+      }
+      if (numWritten <= 0) {
+        WPLOG(ERROR) << "Error writing the spool file of stream "
+                     << fileInfo.fileName;
+        success = false;
+        break;
+      }
+      written += numWritten;
+    }
+    if (!success) {
+      break;
+    }
+    numSpooled += numRead;
+    numSpooledBytes_ += numRead;
+    std::lock_guard<std::mutex> lock(mutex_);
+    for (; numSpooled - numQueued >= blockSize; numQueued += blockSize) {
+      streamBlocks_.emplace_back(metadata,
+                                 Interval(numQueued, numQueued + blockSize));
+      queueStreamBlock(metadata, streamBlocks_.back().second);
+    }
+  }
+  std::lock_guard<std::mutex> lock(mutex_);
+  if (!success) {
+    failedSourceStats_.add(-1, failedSourceStat);
+    hasFailures_ = true;
+    return false;
+  }
+  if (numSpooled > numQueued || numSpooled == 0) {
+    // an empty stream still creates the file
+    streamBlocks_.emplace_back(metadata, Interval(numQueued, numSpooled));
+    queueStreamBlock(metadata, streamBlocks_.back().second);
+  }
+  WLOG(INFO) << "End of stream " << fileInfo.fileName << ", " << numSpooled
+             << " bytes read";
+  return true;
+}
+
+void DirectorySourceQueue::setStreamFileStatus(SourceMetaData *metadata) {
+  // the chunks of the receiver are of another stream with the same name
+  metadata->seqId = nextSeqId_++;
+  metadata->prevSeqId = 0;
+  metadata->allocationStatus = NOT_EXISTS;
+  numEntries_++;
+}
+
+void DirectorySourceQueue::queueStreamBlock(SourceMetaData *metadata,
+                                            const Interval &block) {
+  pushSource(
+      std::make_unique<FileByteSource>(metadata, block.size(), block.start_));
+  totalFileSize_ += block.size();
+  numBlocks_++;
+  smartNotify(1);
+}
+
 bool DirectorySourceQueue::finished() const {
   std::lock_guard<std::mutex> lock(mutex_);
-  return initFinished_ && sourceQueue_.empty();
+  return initFinished_ && numQueuedSources_ == 0 && deltaFiles_.empty();
 }
 
 int64_t DirectorySourceQueue::getCount() const {
@@ -596,7 +1728,7 @@ std::pair<int64_t, ErrorCode> DirectorySourceQueue::getNumBlocksAndStatus()
     const {
   std::lock_guard<std::mutex> lock(mutex_);
   ErrorCode status = OK;
-  if (!failedSourceStats_.empty() || !failedDirectories_.empty()) {
+  if (hasFailures_) {
     // this function is called by active sender threads. The only way files or
     // directories can fail when sender threads are active is due to read errors
     status = BYTE_SOURCE_READ_ERROR;
@@ -604,6 +1736,15 @@ std::pair<int64_t, ErrorCode> DirectorySourceQueue::getNumBlocksAndStatus()
   return std::make_pair(numBlocks_, status);
 }
 
+std::pair<int64_t, ErrorCode>
+DirectorySourceQueue::getFinalNumBlocksAndStatus() {
+  {
+    std::lock_guard<std::mutex> lock(mutex_);
+    numBlocksFinal_ = true;
+  }
+  return getNumBlocksAndStatus();
+}
+
 int64_t DirectorySourceQueue::getTotalSize() const {
   std::lock_guard<std::mutex> lock(mutex_);
   return totalFileSize_;
@@ -615,7 +1756,7 @@ int64_t DirectorySourceQueue::getPreviouslySentBytes() const {
 
 bool DirectorySourceQueue::fileDiscoveryFinished() const {
   std::lock_guard<std::mutex> lock(mutex_);
-  return initFinished_;
+  return initFinished_ && deltaFiles_.empty();
 }
 
 void DirectorySourceQueue::enqueueFilesToBeDeleted() {
@@ -629,7 +1770,11 @@ void DirectorySourceQueue::enqueueFilesToBeDeleted() {
   }
   std::set<std::string> discoveredFiles;
   for (const SourceMetaData *metadata : sharedFileData_) {
-    discoveredFiles.insert(metadata->relPath);
+    discoveredFiles.insert(metadata->getRelPath());
+  }
+  // the files skipped as unchanged are discovered too
+  for (int64_t pathId : unchangedPathIds_) {
+    discoveredFiles.insert(pathArena_->getRelPath(pathId));
   }
   int64_t numFilesToBeDeleted = 0;
   for (auto &it : previouslyTransferredChunks_) {
@@ -641,8 +1786,8 @@ void DirectorySourceQueue::enqueueFilesToBeDeleted() {
     // extra file on the receiver side
     WLOG(INFO) << "Extra file " << fileName << " seq-id " << seqId
                << " on the receiver side, will be deleted";
-    SourceMetaData *metadata = new SourceMetaData();
-    metadata->relPath = fileName;
+    SourceMetaData *metadata = newMetaData();
+    metadata->setPaths(*pathArena_, fileName, rootDir_ + fileName);
     metadata->size = 0;
     // we can reuse the previous seq-id
     metadata->seqId = seqId;
@@ -651,7 +1796,7 @@ void DirectorySourceQueue::enqueueFilesToBeDeleted() {
     // create a byte source with size and offset equal to 0
     std::unique_ptr<ByteSource> source =
         std::make_unique<FileByteSource>(metadata, 0, 0);
-    sourceQueue_.push(std::move(source));
+    pushSource(std::move(source));
     numFilesToBeDeleted++;
   }
   numEntries_ += numFilesToBeDeleted;
@@ -661,42 +1806,275 @@ void DirectorySourceQueue::enqueueFilesToBeDeleted() {
 
 std::unique_ptr<ByteSource> DirectorySourceQueue::getNextSource(
     ThreadCtx *callerThreadCtx, ErrorCode &status) {
-  std::unique_ptr<ByteSource> source;
+  return getNextSourceImpl(callerThreadCtx, status, true);
+}
+
+std::unique_ptr<ByteSource> DirectorySourceQueue::tryGetNextSource(
+    ThreadCtx *callerThreadCtx, ErrorCode &status) {
+  return getNextSourceImpl(callerThreadCtx, status, false);
+}
+
+std::unique_ptr<ByteSource> DirectorySourceQueue::getNextSourceImpl(
+    ThreadCtx *callerThreadCtx, ErrorCode &status, bool wait) {
+  const int shard = callerThreadCtx ? callerThreadCtx->getThreadIndex() : 0;
+  const bool perDevice = callerThreadCtx && maxReadersPerDevice_ > 0;
   while (true) {
-    std::unique_lock<std::mutex> lock(mutex_);
-    while (sourceQueue_.empty() && !initFinished_) {
-      conditionNotEmpty_.wait(lock);
+    bool saturated = false;
+    std::unique_ptr<ByteSource> source =
+        perDevice ? popDeviceSource(shard, std::numeric_limits<int64_t>::max(),
+                                    saturated)
+                  : popSource(shard, std::numeric_limits<int64_t>::max());
+    if (!source) {
+      if (!wait) {
+        status = hasFailures_ ? ERROR : OK;
+        return nullptr;
+      }
+      std::unique_lock<std::mutex> lock(mutex_);
+      if (saturated) {
+        // released devices notify, the timeout covers a release racing with
+        // this wait
+        conditionNotEmpty_.wait_for(lock, std::chrono::milliseconds(100));
+        continue;
+      }
+      while (numQueuedSources_ == 0 &&
+             (!initFinished_ || !deltaFiles_.empty())) {
+        conditionNotEmpty_.wait(lock);
+      }
+      if (numQueuedSources_ == 0) {
+        status = hasFailures_ ? ERROR : OK;
+        return nullptr;
+      }
+      continue;
     }
-    if (!failedSourceStats_.empty() || !failedDirectories_.empty()) {
-      status = ERROR;
-    } else {
-      status = OK;
+    status = hasFailures_ ? ERROR : OK;
+    splitTailSource(source);
+    if (callerThreadCtx && stealSegmentSize_ > 0 &&
+        canSplitInSegments(*source)) {
+      std::lock_guard<std::mutex> lock(mutex_);
+      const int threadIndex = callerThreadCtx->getThreadIndex();
+      if (inFlightSources_.find(threadIndex) == inFlightSources_.end()) {
+        startInFlightLocked(threadIndex, source);
+      }
     }
-    if (sourceQueue_.empty()) {
+    if (openSource(source, callerThreadCtx)) {
+      return source;
+    }
+  }
+}
+
+int64_t DirectorySourceQueue::getAdaptiveBlockSize(int64_t totalSize) const {
+  // enough blocks for every thread to get many of them, but not so many that
+  // per block header and checkpoint overheads matter
+  const int64_t kBlocksPerThread = 64;
+  const int64_t kMinBlockSize = 1024 * 1024;
+  const int64_t kMaxBlockSize = 256 * 1024 * 1024;
+  int64_t blockSize =
+      totalSize / (std::max<int64_t>(numClientThreads_, 1) * kBlocksPerThread);
+  blockSize = std::min(std::max(blockSize, kMinBlockSize), kMaxBlockSize);
+  // multiple of the min size keeps blocks aligned for direct reads
+  return blockSize - blockSize % kMinBlockSize;
+}
+
+void DirectorySourceQueue::splitTailSource(
+    std::unique_ptr<ByteSource> &source) {
+  const int64_t kMinSplitSize = 1024 * 1024;
+  if (!adaptiveBlockSize_ || blockSizeMbytes_ <= 0 || byteSourceFactory_) {
+    // only a FileByteSource can be split
+    return;
+  }
+  const int64_t size = source->getSize();
+  if (size < 2 * kMinSplitSize ||
+      source->getTransferStats().getFailedAttempts() > 0 ||
+      source->getMetaData().allocationStatus == TO_BE_DELETED) {
+    return;
+  }
+  // enough data left for every thread to get a block of that size
+  if (numQueuedBytes_ + size >= numClientThreads_ * size) {
+    return;
+  }
+  std::lock_guard<std::mutex> lock(mutex_);
+  if (!initFinished_ || !deltaFiles_.empty() || numBlocksFinal_) {
+    // more files may come, or the number of blocks is already sent
+    return;
+  }
+  int64_t firstSize = size / 2;
+  firstSize -= firstSize % kMinSplitSize;
+  WVLOG(1) << "Splitting tail block " << source->getIdentifier() << " "
+           << source->getOffset() << " of size " << size << " at "
+           << firstSize;
+  releasePrefetch(*source);
+  pushSource(
+      static_cast<FileByteSource *>(source.get())->splitOff(firstSize));
+  numBlocks_++;
+  smartNotify(1);
+}
+
+bool DirectorySourceQueue::canSplitInSegments(const ByteSource &source) const {
+  // only a FileByteSource can be split
+  const SourceMetaData &metadata = source.getMetaData();
+  return stealSegmentSize_ > 0 && !byteSourceFactory_ &&
+         source.getSize() >= 2 * stealSegmentSize_ &&
+         metadata.allocationStatus != TO_BE_DELETED && !metadata.isStream;
+}
+
+void DirectorySourceQueue::startInFlightLocked(
+    int threadIndex, std::unique_ptr<ByteSource> &source) {
+  if (numBlocksFinal_ || !canSplitInSegments(*source)) {
+    return;
+  }
+  WDT_CHECK(inFlightSources_.find(threadIndex) == inFlightSources_.end());
+  releasePrefetch(*source);
+  inFlightSources_[threadIndex] =
+      static_cast<FileByteSource *>(source.get())->splitOff(stealSegmentSize_);
+  numBlocks_++;
+}
+
+std::unique_ptr<ByteSource> DirectorySourceQueue::getNextInFlightSource(
+    ThreadCtx *callerThreadCtx, ErrorCode &status) {
+  if (!callerThreadCtx || stealSegmentSize_ <= 0) {
+    return nullptr;
+  }
+  const int threadIndex = callerThreadCtx->getThreadIndex();
+  while (true) {
+    std::unique_ptr<ByteSource> source;
+    {
+      std::lock_guard<std::mutex> lock(mutex_);
+      auto it = inFlightSources_.find(threadIndex);
+      if (it == inFlightSources_.end()) {
+        return nullptr;
+      }
+      source = std::move(it->second);
+      inFlightSources_.erase(it);
+      startInFlightLocked(threadIndex, source);
+      status = hasFailures_ ? ERROR : OK;
+    }
+    if (openSource(source, callerThreadCtx)) {
+      return source;
+    }
+  }
+}
+
+std::unique_ptr<ByteSource> DirectorySourceQueue::stealInFlightSource(
+    ThreadCtx *callerThreadCtx, ErrorCode &status) {
+  if (!callerThreadCtx || stealSegmentSize_ <= 0) {
+    return nullptr;
+  }
+  const int threadIndex = callerThreadCtx->getThreadIndex();
+  std::unique_ptr<ByteSource> source;
+  {
+    std::lock_guard<std::mutex> lock(mutex_);
+    if (numBlocksFinal_ ||
+        inFlightSources_.find(threadIndex) != inFlightSources_.end()) {
       return nullptr;
     }
-    // using const_cast since priority_queue returns a const reference
-    source = std::move(
-        const_cast<std::unique_ptr<ByteSource> &>(sourceQueue_.top()));
-    sourceQueue_.pop();
-    if (sourceQueue_.empty() && initFinished_) {
-      conditionNotEmpty_.notify_all();
+    // the thread with the most segments left is the furthest from done
+    auto victim = inFlightSources_.end();
+    for (auto it = inFlightSources_.begin(); it != inFlightSources_.end();
+         ++it) {
+      if (victim == inFlightSources_.end() ||
+          it->second->getSize() > victim->second->getSize()) {
+        victim = it;
+      }
     }
-    lock.unlock();
-    WVLOG(1) << "got next source " << rootDir_ + source->getIdentifier()
-             << " size " << source->getSize();
-    // try to open the source
-    if (source->open(callerThreadCtx) == OK) {
-      lock.lock();
-      numBlocksDequeued_++;
+    if (victim == inFlightSources_.end()) {
+      return nullptr;
+    }
+    ByteSource &rest = *victim->second;
+    const int64_t numSegments =
+        (rest.getSize() + stealSegmentSize_ - 1) / stealSegmentSize_;
+    const int64_t keptSize = (numSegments / 2) * stealSegmentSize_;
+    WVLOG(1) << "Thread " << threadIndex << " stealing "
+             << rest.getIdentifier() << " from offset "
+             << rest.getOffset() + keptSize << " of thread " << victim->first
+             << ", " << rest.getSize() - keptSize << " bytes";
+    if (keptSize == 0) {
+      // a single segment left, taken whole
+      source = std::move(victim->second);
+      inFlightSources_.erase(victim);
+    } else {
+      releasePrefetch(rest);
+      source = static_cast<FileByteSource &>(rest).splitOff(keptSize);
+      numBlocks_++;
+    }
+    numStolenSources_++;
+    startInFlightLocked(threadIndex, source);
+    status = hasFailures_ ? ERROR : OK;
+  }
+  if (!openSource(source, callerThreadCtx)) {
+    return nullptr;
+  }
+  return source;
+}
+
+void DirectorySourceQueue::returnInFlightSource(ThreadCtx *callerThreadCtx) {
+  if (!callerThreadCtx) {
+    return;
+  }
+  if (maxReadersPerDevice_ > 0) {
+    // the thread stops reading
+    bool released;
+    {
+      std::lock_guard<std::mutex> deviceLock(deviceMutex_);
+      released = threadDevices_.count(callerThreadCtx->getThreadIndex()) > 0;
+      releaseDeviceLocked(callerThreadCtx->getThreadIndex());
+    }
+    if (released) {
+      notifyAllConsumers();
+    }
+  }
+  std::unique_lock<std::mutex> lock(mutex_);
+  auto it = inFlightSources_.find(callerThreadCtx->getThreadIndex());
+  if (it == inFlightSources_.end()) {
+    return;
+  }
+  WVLOG(1) << "Returning the segments in flight of "
+           << it->second->getIdentifier();
+  pushSource(std::move(it->second));
+  inFlightSources_.erase(it);
+  lock.unlock();
+  smartNotify(1);
+}
+
+std::unique_ptr<ByteSource> DirectorySourceQueue::getNextSmallSource(
+    ThreadCtx *callerThreadCtx, int64_t maxSize) {
+  const int shard = callerThreadCtx ? callerThreadCtx->getThreadIndex() : 0;
+  while (true) {
+    bool saturated;
+    std::unique_ptr<ByteSource> source =
+        (callerThreadCtx && maxReadersPerDevice_ > 0)
+            ? popDeviceSource(shard, maxSize, saturated)
+            : popSource(shard, maxSize);
+    if (!source) {
+      return nullptr;
+    }
+    if (openSource(source, callerThreadCtx)) {
       return source;
     }
-    source->close();
-    // we need to lock again as we will be adding element to failedSourceStats
-    // vector
-    lock.lock();
-    failedSourceStats_.emplace_back(std::move(source->getTransferStats()));
   }
 }
+
+bool DirectorySourceQueue::openSource(std::unique_ptr<ByteSource> &source,
+                                      ThreadCtx *callerThreadCtx) {
+  if (numQueuedSources_ == 0) {
+    std::lock_guard<std::mutex> lock(mutex_);
+    if (initFinished_) {
+      notifyAllConsumers();
+    }
+  }
+  WVLOG(1) << "got next source " << rootDir_ + source->getIdentifier()
+           << " size " << source->getSize();
+  // try to open the source
+  if (source->open(callerThreadCtx) == OK) {
+    numBlocksDequeued_++;
+    return true;
+  }
+  source->close();
+  // we need to lock as we will be adding a row to failedSourceStats_
+  std::lock_guard<std::mutex> lock(mutex_);
+  failedSourceStats_.add(source->getMetaData().seqId,
+                         source->getTransferStats());
+  hasFailures_ = true;
+  return false;
+}
 }
 }
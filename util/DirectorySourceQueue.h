@@ -11,21 +11,34 @@
 #include <dirent.h>
 #include <glog/logging.h>
 #include <algorithm>
+#include <atomic>
 #include <condition_variable>
+#include <deque>
+#include <functional>
+#include <map>
 #include <mutex>
 #include <queue>
+#include <regex>
+#include <set>
 #include <string>
 #include <thread>
 #include <unordered_map>
 #include <utility>
+#include <vector>
 
 #include <wdt/Protocol.h>
 #include <wdt/SourceQueue.h>
 #include <wdt/WdtTransferRequest.h>
+#include <wdt/util/DeltaResumption.h>
 #include <wdt/util/FileByteSource.h>
+#include <wdt/util/Prefetcher.h>
 
 namespace facebook {
 namespace wdt {
+
+class DirectoryReader;
+class DiscoveryIndex;
+
 /**
  * SourceQueue that returns all the regular files under a given directory
  * (recursively) as individual FileByteSource objects, sorted by decreasing
@@ -88,15 +101,58 @@ class DirectorySourceQueue : public SourceQueue {
   std::unique_ptr<ByteSource> getNextSource(ThreadCtx *callerThreadCtx,
                                             ErrorCode &status) override;
 
+  /**
+   * Non blocking version of getNextSource()
+   *
+   * @param callerThreadCtx context of the calling thread
+   * @param status          this variable is set to the status of the transfer
+   *
+   * @return next FileByteSource to consume or nullptr if none can be
+   *         consumed right now, the queue being empty or the devices of its
+   *         sources having max_readers_per_device readers already
+   */
+  std::unique_ptr<ByteSource> tryGetNextSource(ThreadCtx *callerThreadCtx,
+                                               ErrorCode &status);
+
+  /**
+   * Non blocking version of getNextSource() only returning sources up to a
+   * given size
+   *
+   * @param callerThreadCtx context of the calling thread
+   * @param maxSize         max size of the source to return
+   *
+   * @return next FileByteSource to consume or nullptr if the queue is empty
+   *         or the next source is larger than maxSize
+   */
+  std::unique_ptr<ByteSource> getNextSmallSource(ThreadCtx *callerThreadCtx,
+                                                 int64_t maxSize);
+
   /// @return         total number of files processed/enqueued
   int64_t getCount() const override;
 
   /// @return         total size of files processed/enqueued
   int64_t getTotalSize() const override;
 
+  /// @return         number of sources waiting in the queue
+  int64_t getNumQueuedSources() const {
+    return numQueuedSources_;
+  }
+
+  /// @return         number of bytes of the sources waiting in the queue
+  int64_t getNumQueuedBytes() const {
+    return numQueuedBytes_;
+  }
+
   /// @return         total number of blocks and status of the transfer
   std::pair<int64_t, ErrorCode> getNumBlocksAndStatus() const;
 
+  /**
+   * Same as getNumBlocksAndStatus, for the count sent to the receiver once
+   * there is nothing left to send. No block is split anymore afterwards, so
+   * that the count is the same for all the threads
+   */
+  std::pair<int64_t, ErrorCode> getFinalNumBlocksAndStatus();
+
   /// @return         perf report
   const PerfStatReport &getPerfReport() const;
 
@@ -107,6 +163,15 @@ class DirectorySourceQueue : public SourceQueue {
    */
   void setIncludePattern(const std::string &includePattern);
 
+  /**
+   * Sets the priority classes of the files, as comma separated glob=priority
+   * pairs matched against the relative paths, first match wins. Invalid
+   * pairs are logged and ignored
+   *
+   * @param filePriorities          pairs of the file_priorities option
+   */
+  void setFilePriorities(const std::string &filePriorities);
+
   /**
    * Sets regex representing files to exclude for transfer
    *
@@ -129,6 +194,186 @@ class DirectorySourceQueue : public SourceQueue {
     numClientThreads_ = numClientThreads;
   }
 
+  /**
+   * Sets the number of shards of the queue. Each shard is a priority queue
+   * with its own lock, consumer threads pop from the shard of their thread
+   * index and steal from the other shards when it is empty. Ordering of the
+   * sources is only kept within a shard. Must be called before any source is
+   * added.
+   */
+  void setNumQueueShards(int numShards);
+
+  /**
+   * If set, sources are ordered by their location on disk (using FIEMAP, or
+   * the inode number as a proxy) instead of by size, and with many shards each
+   * region of the disk goes to one shard.
+   */
+  void setDiskOrderReads(bool diskOrderReads) {
+    diskOrderReads_ = diskOrderReads;
+  }
+
+  /**
+   * If > 0, files are tagged with their device (st_dev) and the sources of a
+   * device all go to the same shard. A thread asking for a source releases
+   * the device of its previous one and gets one from the device with the
+   * fewest readers, waiting if all the devices with sources queued already
+   * have maxReaders threads. Threads without a context and segments stolen
+   * are not limited. Must be called before any source is added.
+   */
+  void setMaxReadersPerDevice(int maxReaders) {
+    maxReadersPerDevice_ = maxReaders;
+  }
+
+  /**
+   * If set, only the data extents of sparse files are sent, holes are
+   * recreated by the receiver
+   */
+  void setSparseFiles(bool sparseFiles) {
+    sparseFiles_ = sparseFiles;
+  }
+
+  /**
+   * Creates the sources of the blocks of the files discovered, instead of
+   * sources reading the local files. Tail blocks are then never split.
+   *
+   * @param byteSourceFactory   factory, empty for the local files
+   */
+  void setByteSourceFactory(ByteSourceFactory byteSourceFactory) {
+    byteSourceFactory_ = std::move(byteSourceFactory);
+  }
+
+  /**
+   * Directory of the spool files of the streams of fileInfo, entries of
+   * unknown size whose fd is a pipe, socket or character device
+   */
+  void setStreamSpoolDir(const std::string &streamSpoolDir) {
+    streamSpoolDir_ = streamSpoolDir;
+  }
+
+  /**
+   * Max bytes of the spool files not acked yet, reading a stream fails past
+   * it. 0 for no limit
+   */
+  void setStreamSpoolMaxBytes(int64_t streamSpoolMaxBytes) {
+    streamSpoolMaxBytes_ = streamSpoolMaxBytes;
+  }
+
+  /**
+   * If set, each file queued is also added to the manifest, returned by
+   * getManifestEntries so that the receiver prepares it before its data
+   */
+  void setManifestEnabled(bool manifestEnabled) {
+    manifestEnabled_ = manifestEnabled;
+  }
+
+  /**
+   * If set, files of at least minFileBytes with the same size are hashed and
+   * a file identical to one queued in full is queued as a duplicate of it, a
+   * single source without data
+   */
+  void setDedupFiles(bool dedupFiles, int64_t minFileBytes) {
+    dedupFiles_ = dedupFiles;
+    dedupMinFileBytes_ = minFileBytes;
+  }
+
+  /// sets how the files are read to be compared with the receiver hashes
+  void setDeltaReadOptions(const DeltaReadOptions &deltaReadOptions) {
+    deltaReadOptions_ = deltaReadOptions;
+  }
+
+  /**
+   * If budgetBytes > 0, the next block of each shard is prefetched into the
+   * page cache when a block is popped, with at most budgetBytes prefetched
+   * and not read yet
+   */
+  void setPrefetchBytes(int64_t budgetBytes) {
+    if (budgetBytes > 0) {
+      prefetcher_ = std::make_unique<Prefetcher>(budgetBytes);
+    }
+  }
+
+  /// @return   summary of the prefetches, empty if prefetching is disabled
+  std::string getPrefetchSummary() const {
+    return prefetcher_ ? prefetcher_->getSummary() : std::string();
+  }
+
+  /// @return   whether files can be queued as duplicates
+  bool isDedupEnabled() const {
+    return dedupFiles_;
+  }
+
+  /// @return   whether files queued are waiting in the manifest
+  bool hasManifestEntries() const {
+    return numPendingManifestEntries_.load(std::memory_order_relaxed) > 0;
+  }
+
+  /**
+   * Moves the oldest files of the manifest into entries, as many as can be
+   * encoded in maxBytes. Each file is only returned once per transfer, unless
+   * the queue is recreated with the previously received chunks.
+   *
+   * @param maxBytes    max encoded size of the returned entries
+   * @param entries     set to the files, only with the fields of a manifest
+   */
+  void getManifestEntries(int64_t maxBytes, std::vector<BlockDetails> &entries);
+
+  /**
+   * If set, the block size of each file is chosen from the total size
+   * discovered so far and the number of consumer threads, and blocks are
+   * split in two at the end of the transfer so that all the threads finish
+   * together. Only used if block mode is enabled.
+   */
+  void setAdaptiveBlockSize(bool adaptiveBlockSize) {
+    adaptiveBlockSize_ = adaptiveBlockSize;
+  }
+
+  /**
+   * If > 0, a source of at least twice that size returned by getNextSource
+   * is cut to its first segment of that size, and its other segments are in
+   * flight for the calling thread: it gets them from getNextInFlightSource,
+   * unless another thread steals them first with stealInFlightSource. The
+   * threads getting sources with a thread context have to call
+   * returnInFlightSource before they stop. Only FileByteSources are cut.
+   */
+  void setStealSegmentSize(int64_t stealSegmentSize) {
+    stealSegmentSize_ = stealSegmentSize;
+  }
+
+  /**
+   * @param callerThreadCtx   context of the calling thread
+   * @param status            this variable is set to the status of the
+   *                          transfer
+   *
+   * @return                  next segment in flight for the calling thread,
+   *                          opened, nullptr if there is none left
+   */
+  std::unique_ptr<ByteSource> getNextInFlightSource(ThreadCtx *callerThreadCtx,
+                                                    ErrorCode &status);
+
+  /**
+   * Steals the second half of the segments in flight of the thread with the
+   * most of them left (or its last one), for a thread with nothing else to
+   * send. The first of the segments stolen is returned, the others are in
+   * flight for the calling thread.
+   *
+   * @param callerThreadCtx   context of the calling thread
+   * @param status            this variable is set to the status of the
+   *                          transfer
+   *
+   * @return                  segment stolen, opened, nullptr if no thread
+   *                          has segments in flight
+   */
+  std::unique_ptr<ByteSource> stealInFlightSource(ThreadCtx *callerThreadCtx,
+                                                  ErrorCode &status);
+
+  /// Puts the segments in flight for the calling thread back in the queue
+  void returnInFlightSource(ThreadCtx *callerThreadCtx);
+
+  /// @return   number of times segments in flight were stolen
+  int64_t getNumStolenSources() const {
+    return numStolenSources_;
+  }
+
   /**
    * Sets the count and trigger for files to open during discovery
    * (negative is keep opening until we run out of fd, positive is how
@@ -145,6 +390,74 @@ class DirectorySourceQueue : public SourceQueue {
     directReads_ = directReads;
   }
 
+  /**
+   * Sets the number of threads exploring the directory tree. With more than
+   * one thread, each one explores directories from its own queue and steals
+   * from the others when it runs out of work.
+   */
+  void setNumDiscoveryThreads(int numDiscoveryThreads) {
+    numDiscoveryThreads_ = std::max(1, numDiscoveryThreads);
+  }
+
+  /**
+   * Sets the path of the discovery index. When set, files which did not change
+   * since the last saved index are not sent, and directories which did not
+   * change are not read again.
+   */
+  void setDiscoveryIndexPath(const std::string &discoveryIndexPath) {
+    discoveryIndexPath_ = discoveryIndexPath;
+  }
+
+  /**
+   * Saves the index of the files discovered by this run. Must only be called
+   * once the transfer of all the files has succeeded.
+   *
+   * @return    true if the index was saved, false if disabled, discovery did
+   *            not complete or on error (logged)
+   */
+  bool saveDiscoveryIndex();
+
+  /**
+   * Sets a function called with each file as it is discovered, once it has
+   * its seq-id. Calls are serialized, also with many discovery threads, and
+   * made with the queue lock held so they must not call back into the queue.
+   */
+  void setDiscoveryCallback(
+      std::function<void(const SourceMetaData &)> discoveryCallback) {
+    discoveryCallback_ = std::move(discoveryCallback);
+  }
+
+  /**
+   * Sets a function called once with each priority class whose files have all
+   * been acked by the receiver, after discovery is done. Classes finish from
+   * the highest one. Calls are made with the queue lock held so they must not
+   * call back into the queue
+   */
+  void setPriorityClassCallback(std::function<void(int)> priorityCallback) {
+    priorityCallback_ = std::move(priorityCallback);
+  }
+
+  /**
+   * Sets a function called when sources may have become available, for the
+   * consumers polling the queue instead of waiting in getNextSource() (e.g.
+   * the sender threads running on a ReceiverRuntime). Calls can be made with
+   * the queue lock held so they must not call back into the queue
+   */
+  void setWakeUpCallback(std::function<void()> wakeUpCallback) {
+    wakeUpCallback_ = std::move(wakeUpCallback);
+  }
+
+  /**
+   * Accounts for data of a file acked by the receiver, for the priority class
+   * callback. The data of a stream is also freed from its spool file
+   *
+   * @param metadata    file of the data
+   * @param offset      offset of the data in the file
+   * @param dataBytes   bytes acked
+   */
+  void addAckedBytes(const SourceMetaData &metadata, int64_t offset,
+                     int64_t dataBytes);
+
   /// enable extra file deletion in the receiver side
   void enableFileDeletion() {
     deleteFiles_ = true;
@@ -161,6 +474,49 @@ class DirectorySourceQueue : public SourceQueue {
   /// @param blockSizeMbytes    block size in Mbytes
   void setBlockSizeMbytes(int64_t blockSizeMbytes);
 
+  /**
+   * Has the sources of the queue fed by feedBlock() instead of discovered,
+   * till endFeed() is called. Used to forward blocks as they are received.
+   */
+  void setFed() {
+    fed_ = true;
+  }
+
+  /// @return   whether the sources of the queue are fed by feedBlock()
+  bool isFed() const {
+    return fed_;
+  }
+
+  /**
+   * @return    whether the file info has streams, whose blocks are queued as
+   *            the data is read
+   */
+  bool isStreaming() const {
+    return streaming_;
+  }
+
+  /**
+   * Queues a range of a file of the root directory, split in blocks of the
+   * block size. The bytes the receiver already has are skipped, also if its
+   * chunks are received later. Thread safe.
+   *
+   * @param block   file name and size, offset and size of the range. The
+   *                range only contains data if it is of a sparse file
+   */
+  void feedBlock(const BlockDetails &block);
+
+  /// ends the feed, buildQueueSynchronously() returns once called
+  void endFeed();
+
+  /**
+   * Waits till a source is queued or the queue is finished
+   *
+   * @param timeoutMillis   max time to wait
+   *
+   * @return                false if timed out
+   */
+  bool waitForSources(int timeoutMillis) const;
+
   /// Get the file info in this directory queue
   const std::vector<WdtFileInfo> &getFileInfo() const;
 
@@ -202,7 +558,7 @@ class DirectorySourceQueue : public SourceQueue {
    *
    * @return                      stats for failed sources
    */
-  std::vector<TransferStats> &getFailedSourceStats();
+  SourceStatsTable &getFailedSourceStats();
 
   /// @return   returns list of directories which could not be opened
   std::vector<std::string> &getFailedDirectories();
@@ -230,6 +586,78 @@ class DirectorySourceQueue : public SourceQueue {
   bool setRootDir(const std::string &newRootDir);
 
  private:
+  /// adds a source to the next shard, the count of queued sources is
+  /// incremented. mutex_ must be held, so that waiting consumers are notified
+  void pushSource(std::unique_ptr<ByteSource> source);
+
+  /**
+   * Pops the top source of the preferred shard, or of the first other non
+   * empty shard
+   *
+   * @param preferredShard  shard to pop from first
+   * @param maxSize         only sources up to that size are returned
+   *
+   * @return                source or nullptr if none was found
+   */
+  std::unique_ptr<ByteSource> popSource(int preferredShard, int64_t maxSize);
+
+  /**
+   * Pops the top source of a shard
+   *
+   * @return                source or nullptr if the shard is empty or its top
+   *                        source is larger than maxSize
+   */
+  std::unique_ptr<ByteSource> popFromShard(int shardIndex, int64_t maxSize);
+
+  /// releases the prefetch budget charged for a source returned or split,
+  /// whose block is not read as it was prefetched
+  void releasePrefetch(const ByteSource &source);
+
+  /// @return   the first shard from preferredShard whose top source has the
+  ///           highest priority, preferredShard if all are empty
+  int findPriorityShard(int preferredShard, int64_t maxSize);
+
+  /**
+   * Pops a source for a thread when readers per device are limited. The
+   * device of the previous source of the thread is released first
+   *
+   * @param threadIndex     index of the calling thread
+   * @param maxSize         only sources up to that size are returned
+   * @param saturated       set if sources are queued but all their devices
+   *                        have their max number of readers
+   *
+   * @return                source or nullptr if none can be read
+   */
+  std::unique_ptr<ByteSource> popDeviceSource(int threadIndex, int64_t maxSize,
+                                              bool &saturated);
+
+  /// @see getNextSource(), returns nullptr instead of waiting if wait is false
+  std::unique_ptr<ByteSource> getNextSourceImpl(ThreadCtx *callerThreadCtx,
+                                                ErrorCode &status, bool wait);
+
+  /// releases the device the thread reads from, if any. deviceMutex_ has to
+  /// be held
+  void releaseDeviceLocked(int threadIndex);
+
+  /// sets the device of a file and its index in the queue
+  void setDevice(SourceMetaData *metadata, int64_t deviceId);
+
+  /// @return   priority class of the file at relPath from the globs
+  int getGlobPriority(const std::string &relPath) const;
+
+  /// calls the priority callback with the classes fully sent, once discovery
+  /// is done. mutex_ must be held
+  void reportFinishedPrioritiesLocked();
+
+  /**
+   * Opens a source popped from the queue. Sources which fail to open are added
+   * to the failed sources.
+   *
+   * @return                true if the source was opened
+   */
+  bool openSource(std::unique_ptr<ByteSource> &source,
+                  ThreadCtx *callerThreadCtx);
+
   /**
    * Resolves a symlink.
    *
@@ -237,6 +665,25 @@ class DirectorySourceQueue : public SourceQueue {
    */
   std::string resolvePath(const std::string &path);
 
+  /// state shared by the threads exploring the directory tree
+  struct ExploreState {
+    ExploreState(const std::string &includePattern,
+                 const std::string &excludePattern,
+                 const std::string &pruneDirPattern)
+        : includeRegex(includePattern),
+          excludeRegex(excludePattern),
+          pruneDirRegex(pruneDirPattern) {
+    }
+    const std::regex includeRegex;
+    const std::regex excludeRegex;
+    const std::regex pruneDirRegex;
+    /// protects visited and failedDirectories_
+    std::mutex mutex;
+    /// directories visited when following symlinks
+    std::set<std::string> visited;
+    std::atomic<bool> hasError{false};
+  };
+
   /**
    * Traverse rootDir_ to gather files and sizes to enqueue
    *
@@ -244,20 +691,54 @@ class DirectorySourceQueue : public SourceQueue {
    */
   bool explore();
 
+  /**
+   * Traverse rootDir_ using numDiscoveryThreads_ work stealing threads,
+   * returns once the whole tree is explored or on abort
+   *
+   * @param state           shared exploration state
+   */
+  void exploreInParallel(ExploreState &state);
+
+  /**
+   * Enqueues the matching files of one directory
+   *
+   * @param state           shared exploration state
+   * @param reader          reader of the calling thread
+   * @param relativePath    path of the directory relative to rootDir_
+   * @param subDirs         sub directories left to explore are appended to it
+   */
+  void exploreDirectory(ExploreState &state, DirectoryReader &reader,
+                        const std::string &relativePath,
+                        std::vector<std::string> &subDirs);
+
   /**
    * Stat the input files and populate queue
    * @return                true on success, false on error
    */
   bool enqueueFiles();
 
+  /**
+   * Reads a stream till its end, copying the data to a spool file. Each
+   * block is queued as soon as it is read, so that the data read is spread
+   * across the sender threads in order
+   *
+   * @param fileInfo    file info of the stream, with its fd
+   *
+   * @return            true on success, false on error
+   */
+  bool enqueueStream(const WdtFileInfo &fileInfo);
+
   /**
    * initial creation from either explore or enqueue files, uses
    * createIntoQueueInternal to create blocks
    *
    * @param fullPath             full path of the file to be added
    * @param fileInfo             Information about file
+   * @param deviceId             device of the file if already stat'ed, -1
+   *                             if unknown
    */
-  void createIntoQueue(const std::string &fullPath, WdtFileInfo &fileInfo);
+  void createIntoQueue(const std::string &fullPath, WdtFileInfo &fileInfo,
+                       int64_t deviceId = -1);
 
   /**
    * initial creation from either explore or enqueue files - always increment
@@ -267,6 +748,20 @@ class DirectorySourceQueue : public SourceQueue {
    */
   void createIntoQueueInternal(SourceMetaData *metadata);
 
+  /// @return   new metadata from the current slab, freed with the queue
+  SourceMetaData *newMetaData();
+
+  /**
+   * Queues a file whose blocks have to be compared with the hashes of the
+   * receiver before its blocks are created, starting the delta thread if
+   * needed. mutex_ must be held
+   */
+  void queueDeltaFile(SourceMetaData *metadata);
+
+  /// loop of the delta thread, compares the queued files with the hashes of
+  /// the receiver off the lock then creates the blocks which differ
+  void compareDeltaFiles();
+
   /**
    * when adding multiple files, we have the option of using notify_one multiple
    * times or notify_all once. Depending on number of added sources, this
@@ -276,6 +771,52 @@ class DirectorySourceQueue : public SourceQueue {
    */
   void smartNotify(int32_t addedSource);
 
+  /// wakes up all the consumers waiting for sources
+  void notifyAllConsumers();
+
+  /**
+   * @param totalSize   total size of the files discovered so far
+   *
+   * @return            block size to use in adaptive mode
+   */
+  int64_t getAdaptiveBlockSize(int64_t totalSize) const;
+
+  /**
+   * In adaptive block size mode, once discovery is finished, splits a source
+   * popped from the queue if what is left is not enough to keep all the
+   * threads busy. The second half goes back to the queue.
+   */
+  void splitTailSource(std::unique_ptr<ByteSource> &source);
+
+  /// @return   whether source can be split in segments of stealSegmentSize_
+  bool canSplitInSegments(const ByteSource &source) const;
+
+  /**
+   * Cuts source to its first segment, the other ones are put in flight for
+   * the thread, which must have none. mutex_ must be held
+   */
+  void startInFlightLocked(int threadIndex,
+                           std::unique_ptr<ByteSource> &source);
+
+  /// sets the disk order key and region of a file
+  void setDiskOrder(SourceMetaData *metadata);
+
+  /// sets the data extents of a file, if it has holes
+  void setDataExtents(SourceMetaData *metadata);
+
+  /**
+   * Hashes a file if files of its size were queued in full, and those files
+   * not hashed yet. The first file of each size is only hashed once a second
+   * one is found
+   */
+  void hashForDedup(SourceMetaData *metadata);
+
+  /**
+   * Queues a file identical to original as a single source without data.
+   * This method should be called while holding the lock
+   */
+  void queueDuplicate(SourceMetaData *metadata, const SourceMetaData *original);
+
   /// Removes all elements from the source queue
   void clearSourceQueue();
 
@@ -283,6 +824,25 @@ class DirectorySourceQueue : public SourceQueue {
   /// method should be called while holding the lock
   void enqueueFilesToBeDeleted();
 
+  /// waits till endFeed() is called or the transfer is aborted
+  bool waitForFeed();
+
+  /// sets the seq-id and allocation status of a file fed, from the chunks of
+  /// the receiver. This method should be called while holding the lock
+  void setFedFileStatus(SourceMetaData *metadata);
+
+  /// queues the blocks of a range fed. This method should be called while
+  /// holding the lock
+  void queueFedRange(SourceMetaData *metadata, const Interval &range);
+
+  /// sets the seq-id and allocation status of a stream, always sent in full.
+  /// This method should be called while holding the lock
+  void setStreamFileStatus(SourceMetaData *metadata);
+
+  /// queues a block of a stream. This method should be called while holding
+  /// the lock
+  void queueStreamBlock(SourceMetaData *metadata, const Interval &block);
+
   std::unique_ptr<ThreadCtx> threadCtx_{nullptr};
 
   /// root directory to recurse on if fileInfo_ is empty
@@ -303,10 +863,11 @@ class DirectorySourceQueue : public SourceQueue {
   /// List of files to enqueue instead of recursing over rootDir_.
   std::vector<WdtFileInfo> fileInfo_;
 
-  /// protects initCalled_/initFinished_/sourceQueue_/failedSourceStats_
+  /// protects initCalled_/initFinished_/failedSourceStats_, held while
+  /// pushing sources into the shards
   mutable std::mutex mutex_;
 
-  /// condition variable indicating sourceQueue_ is not empty
+  /// condition variable indicating the queue is not empty
   mutable std::condition_variable conditionNotEmpty_;
 
   /// Indicates whether init() has been called to prevent multiple calls
@@ -326,36 +887,75 @@ class DirectorySourceQueue : public SourceQueue {
         // always send files to be deleted first
         return toBeDeleted2;
       }
+      const int priority1 = source1->getMetaData().priority;
+      const int priority2 = source2->getMetaData().priority;
+      if (priority1 != priority2) {
+        return priority1 < priority2;
+      }
 
       auto retryCount1 = source1->getTransferStats().getFailedAttempts();
       auto retryCount2 = source2->getTransferStats().getFailedAttempts();
       if (retryCount1 != retryCount2) {
         return retryCount1 > retryCount2;
       }
+      const int64_t diskOrderKey1 = source1->getMetaData().diskOrderKey;
+      const int64_t diskOrderKey2 = source2->getMetaData().diskOrderKey;
+      if (diskOrderKey1 >= 0 && diskOrderKey2 >= 0) {
+        // lowest disk location first, then blocks of a file in order
+        if (diskOrderKey1 != diskOrderKey2) {
+          return diskOrderKey1 > diskOrderKey2;
+        }
+        if (source1->getOffset() != source2->getOffset()) {
+          return source1->getOffset() > source2->getOffset();
+        }
+      }
       if (source1->getSize() != source2->getSize()) {
         return source1->getSize() < source2->getSize();
       }
       if (source1->getOffset() != source2->getOffset()) {
         return source1->getOffset() > source2->getOffset();
       }
-      return source1->getIdentifier() > source2->getIdentifier();
+      // discovery order, cheaper than comparing the paths
+      return source1->getMetaData().seqId > source2->getMetaData().seqId;
     }
   };
 
   /**
-   * priority queue of sources. Sources are first ordered by increasing
-   * failedAttempts, then by decreasing size. If sizes are equal(always for
-   * blocks), sources are ordered by offset. This way, we ensure that all the
-   * threads in the receiver side are not writing to the same file at the same
-   * time.
+   * priority queue of sources. Sources are first ordered by decreasing
+   * priority class, increasing failedAttempts, then by decreasing size. If
+   * sizes are equal(always for blocks), sources are ordered by offset. This
+   * way, we ensure that all the threads in the receiver side are not writing
+   * to the same file at the same time.
    */
-  std::priority_queue<std::unique_ptr<ByteSource>,
-                      std::vector<std::unique_ptr<ByteSource>>,
-                      SourceComparator>
-      sourceQueue_;
+  typedef std::priority_queue<std::unique_ptr<ByteSource>,
+                              std::vector<std::unique_ptr<ByteSource>>,
+                              SourceComparator>
+      SourcePriorityQueue;
+
+  /// one shard of the queue
+  struct QueueShard {
+    /// protects queue
+    std::mutex mutex;
+    SourcePriorityQueue queue;
+  };
+
+  /// shards of the queue, at least one. Not resized once sources are added
+  std::vector<std::unique_ptr<QueueShard>> shards_;
+
+  /// total number of sources in all the shards
+  std::atomic<int64_t> numQueuedSources_{0};
+
+  /// total number of bytes of the sources in all the shards
+  std::atomic<int64_t> numQueuedBytes_{0};
+
+  /// shard the next source is pushed to, modulo the number of shards
+  std::atomic<uint64_t> nextPushShard_{0};
+
+  /// whether any source or directory failed
+  std::atomic<bool> hasFailures_{false};
 
   /// Transfer stats for sources which are not transferred
-  std::vector<TransferStats> failedSourceStats_;
+  SourceStatsTable failedSourceStats_;
 
   /// directories which could not be opened
   std::vector<std::string> failedDirectories_;
@@ -376,7 +976,7 @@ class DirectorySourceQueue : public SourceQueue {
   int64_t totalFileSize_{0};
 
   /// Number of blocks dequeued
-  int64_t numBlocksDequeued_{0};
+  std::atomic<int64_t> numBlocksDequeued_{0};
 
   /// Whether to follow symlinks or not
   bool followSymlinks_{false};
@@ -385,9 +985,34 @@ class DirectorySourceQueue : public SourceQueue {
   /// contribution
   std::vector<SourceMetaData *> sharedFileData_;
 
+  /// number of metadata allocated at once
+  static const int64_t kMetaDataPerSlab = 256;
+  /// slabs the metadata are allocated from, the last one is being filled
+  std::vector<std::unique_ptr<SourceMetaData[]>> metaDataSlabs_;
+  /// number of metadata used in the last slab
+  int64_t numSlabMetaData_{kMetaDataPerSlab};
+  /// protects the slabs, discovery threads allocate concurrently
+  std::mutex metaDataMutex_;
+  /// relative paths of the files, interned. Made again when the root
+  /// directory changes, which must happen before discovery
+  std::unique_ptr<PathArena> pathArena_;
+
   /// A map from relative file name to previously received chunks
   std::unordered_map<std::string, FileChunksInfo> previouslyTransferredChunks_;
 
+  /// files waiting for their blocks to be compared with the receiver ones,
+  /// the one being compared stays first until its blocks are created
+  std::deque<SourceMetaData *> deltaFiles_;
+  /// thread comparing the blocks of deltaFiles_
+  std::thread deltaThread_;
+  /// whether the delta thread is still running its loop
+  bool deltaThreadRunning_{false};
+  /// how the delta thread reads the files it compares
+  DeltaReadOptions deltaReadOptions_;
+
+  /// prefetches the next blocks of the shards, if enabled
+  std::unique_ptr<Prefetcher> prefetcher_;
+
   /// Stores the time difference between the start and the end of the
   /// traversal of directory
   double directoryTime_{0};
@@ -410,12 +1035,107 @@ class DirectorySourceQueue : public SourceQueue {
   int64_t numFilesOpened_{0};
   // Number of files opened with odirect
   int64_t numFilesOpenedWithDirect_{0};
+  /// protects the opening of files during discovery
+  std::mutex openMutex_;
+  /// number of threads exploring the directory tree
+  int numDiscoveryThreads_{1};
+  /// whether sources are ordered by disk location
+  bool diskOrderReads_{false};
+  /// whether block sizes are adapted to the transfer
+  bool adaptiveBlockSize_{false};
+  /// size of the segments of the blocks in flight, 0 if not split
+  int64_t stealSegmentSize_{0};
+  /// segments not sent yet of the block of each thread, by thread index
+  std::unordered_map<int, std::unique_ptr<ByteSource>> inFlightSources_;
+  /// set once the number of blocks is sent to the receiver, blocks are not
+  /// split anymore then
+  bool numBlocksFinal_{false};
+  /// number of steals of segments in flight
+  std::atomic<int64_t> numStolenSources_{0};
+  /// max threads reading from one device, 0 if not limited
+  int maxReadersPerDevice_{0};
+  /// protects the fields below, taken before the shard locks
+  std::mutex deviceMutex_;
+  /// index of each device (st_dev) seen
+  std::unordered_map<int64_t, int32_t> deviceIndexes_;
+  /// number of threads reading from each device, by device index
+  std::vector<int> numDeviceReaders_;
+  /// device index the thread reads from, by thread index
+  std::unordered_map<int, int32_t> threadDevices_;
+  /// whether holes of sparse files are skipped
+  bool sparseFiles_{false};
+  /// whether queued files are added to the manifest
+  bool manifestEnabled_{false};
+  /// whether identical files are queued as duplicates
+  bool dedupFiles_{false};
+  /// smaller files are not hashed
+  int64_t dedupMinFileBytes_{0};
+  /// files queued in full by size, the ones hashed are also in dedupByHash_
+  std::unordered_map<int64_t, std::vector<SourceMetaData *>> dedupBySize_;
+  /// files queued in full by content hash, the originals of the duplicates
+  std::unordered_map<std::string, const SourceMetaData *> dedupByHash_;
+  /// number of files queued as duplicates
+  int64_t numDuplicates_{0};
+  /// size of the files queued as duplicates
+  int64_t duplicateBytes_{0};
+  /// files queued, with their final seq-id and allocation status
+  std::vector<const SourceMetaData *> manifest_;
+  /// index in manifest_ of the next file to return
+  size_t nextManifestIndex_{0};
+  /// number of files of manifest_ not returned yet
+  std::atomic<int64_t> numPendingManifestEntries_{0};
+  /// called with each file discovered, can be empty
+  std::function<void(const SourceMetaData &)> discoveryCallback_;
+  /// (glob, priority) of the file priorities, in order
+  std::vector<std::pair<std::string, int>> priorityGlobs_;
+  /// whether a file has a non default priority, the shards are then compared
+  /// to pop the highest priority source
+  std::atomic<bool> hasPriorities_{false};
+  /// called with each priority class fully acked, can be empty
+  std::function<void(int)> priorityCallback_;
+  /// called when sources may have become available, can be empty
+  std::function<void()> wakeUpCallback_;
+  /// bytes left to be acked of each priority class, only tracked with
+  /// priorityCallback_. The classes reported are removed
+  std::map<int, int64_t> pendingPriorityBytes_;
+  /// path of the discovery index, empty if disabled
+  std::string discoveryIndexPath_;
+  /// index of the previous and current discovery, nullptr if disabled
+  std::unique_ptr<DiscoveryIndex> discoveryIndex_;
+  /// number of files skipped as unchanged since the last index
+  int64_t numUnchangedFiles_{0};
+  /// paths in pathArena_ of the files skipped as unchanged, still present
+  /// on the receiver, so not to be deleted as extra files
+  std::vector<int64_t> unchangedPathIds_;
   // Number of consumer threads (to tell between notify/notifyall)
   int64_t numClientThreads_{1};
   // Should we explore or use fileInfo
   bool exploreDirectory_{true};
   /// delete extra files in the receiver side
   bool deleteFiles_{false};
+  /// whether the sources are fed instead of discovered
+  bool fed_{false};
+  /// set by endFeed()
+  bool feedEnded_{false};
+  /// notified by endFeed()
+  std::condition_variable conditionFeedEnded_;
+  /// files fed by relative path
+  std::unordered_map<std::string, SourceMetaData *> fedFiles_;
+  /// ranges fed, queued again when the chunks of the receiver are received
+  std::vector<std::pair<SourceMetaData *, Interval>> fedRanges_;
+  /// creates the sources of the files discovered, empty for FileByteSource
+  ByteSourceFactory byteSourceFactory_;
+  /// whether fileInfo_ has streams
+  bool streaming_{false};
+  /// directory of the spool files of the streams
+  std::string streamSpoolDir_{"/tmp"};
+  /// max bytes of spool files not acked yet, 0 for no limit
+  int64_t streamSpoolMaxBytes_{0};
+  /// bytes of the spool files not acked yet
+  std::atomic<int64_t> numSpooledBytes_{0};
+  /// blocks of the streams read, queued again when the chunks of the
+  /// receiver are received
+  std::vector<std::pair<SourceMetaData *, Interval>> streamBlocks_;
 };
 }
 }
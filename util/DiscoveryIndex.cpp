@@ -0,0 +1,287 @@
+/**
+ * Copyright (c) 2014-present, Facebook, Inc.
+ * All rights reserved.
+ *
+ * This source code is licensed under the BSD-style license found in the
+ * LICENSE file in the root directory of this source tree. An additional grant
+ * of patent rights can be found in the PATENTS file in the same directory.
+ */
+#include <wdt/util/DiscoveryIndex.h>
+
+#include <wdt/ErrorCodes.h>
+#include <wdt/util/SerializationUtil.h>
+
+#include <errno.h>
+#include <fcntl.h>
+#include <stdio.h>
+#include <unistd.h>
+
+namespace facebook {
+namespace wdt {
+
+namespace {
+
+const char kIndexMagic[] = "WDTDIDX1";
+const size_t kIndexMagicLen = sizeof(kIndexMagic) - 1;
+const char kFileRecord = 'F';
+const char kDirRecord = 'D';
+// index is written in chunks of this size
+const size_t kWriteChunkSize = 1024 * 1024;
+
+void encodeStr(std::string &buf, const std::string &str) {
+  encodeVarU64(buf, str.size());
+  buf.append(str);
+}
+
+bool decodeStr(const std::string &data, int64_t &pos, std::string &str) {
+  uint64_t len;
+  if (!decodeVarU64(data.data(), data.size(), pos, len) ||
+      len > data.size() - pos) {
+    return false;
+  }
+  str.assign(data.data() + pos, len);
+  pos += len;
+  return true;
+}
+
+bool decodeI64(const std::string &data, int64_t &pos, int64_t &value) {
+  return decodeVarI64(data.data(), data.size(), pos, value);
+}
+
+bool decodeU64(const std::string &data, int64_t &pos, uint64_t &value) {
+  return decodeVarU64(data.data(), data.size(), pos, value);
+}
+
+bool writeFully(int fd, const std::string &buf) {
+  size_t written = 0;
+  while (written < buf.size()) {
+    ssize_t ret = ::write(fd, buf.data() + written, buf.size() - written);
+    if (ret < 0) {
+      if (errno == EINTR) {
+        continue;
+      }
+      return false;
+    }
+    written += ret;
+  }
+  return true;
+}
+}
+
+DiscoveryIndex::DiscoveryIndex(const std::string &indexPath,
+                               const std::string &signature)
+    : indexPath_(indexPath), signature_(signature) {
+}
+
+int64_t DiscoveryIndex::getMtimeNs(const struct stat &st) {
+#ifdef __APPLE__
+  return st.st_mtimespec.tv_sec * 1000000000LL + st.st_mtimespec.tv_nsec;
+#else
+  return st.st_mtim.tv_sec * 1000000000LL + st.st_mtim.tv_nsec;
+#endif
+}
+
+bool DiscoveryIndex::load() {
+  int fd = ::open(indexPath_.c_str(), O_RDONLY | O_CLOEXEC);
+  if (fd < 0) {
+    if (errno == ENOENT) {
+      WLOG(INFO) << "No discovery index at " << indexPath_;
+    } else {
+      WPLOG(ERROR) << "Unable to open discovery index " << indexPath_;
+    }
+    return false;
+  }
+  std::string data;
+  char buf[64 * 1024];
+  while (true) {
+    ssize_t numRead = ::read(fd, buf, sizeof(buf));
+    if (numRead < 0) {
+      if (errno == EINTR) {
+        continue;
+      }
+      WPLOG(ERROR) << "Unable to read discovery index " << indexPath_;
+      ::close(fd);
+      return false;
+    }
+    if (numRead == 0) {
+      break;
+    }
+    data.append(buf, numRead);
+  }
+  ::close(fd);
+  if (!decode(data)) {
+    oldIndex_ = Index();
+    return false;
+  }
+  WLOG(INFO) << "Loaded discovery index " << indexPath_ << " with "
+             << oldIndex_.files.size() << " files and "
+             << oldIndex_.dirs.size() << " directories";
+  return true;
+}
+
+bool DiscoveryIndex::decode(const std::string &data) {
+  if (data.compare(0, kIndexMagicLen, kIndexMagic) != 0) {
+    WLOG(ERROR) << "Invalid discovery index header " << indexPath_;
+    return false;
+  }
+  int64_t pos = kIndexMagicLen;
+  std::string signature;
+  if (!decodeStr(data, pos, signature)) {
+    WLOG(ERROR) << "Unable to decode discovery index signature";
+    return false;
+  }
+  if (signature != signature_) {
+    WLOG(WARNING) << "Ignoring discovery index " << indexPath_
+                  << " built for a different transfer: " << signature;
+    return false;
+  }
+  std::string relPath;
+  while (pos < (int64_t)data.size()) {
+    const char recordType = data[pos++];
+    if (!decodeStr(data, pos, relPath)) {
+      WLOG(ERROR) << "Unable to decode discovery index path at " << pos;
+      return false;
+    }
+    if (recordType == kFileRecord) {
+      FileInfo info;
+      if (!decodeI64(data, pos, info.size) ||
+          !decodeI64(data, pos, info.mtimeNs) ||
+          !decodeU64(data, pos, info.inode)) {
+        WLOG(ERROR) << "Unable to decode discovery index file " << relPath;
+        return false;
+      }
+      oldIndex_.files[relPath] = info;
+    } else if (recordType == kDirRecord) {
+      DirInfo info;
+      uint64_t numEntries;
+      if (!decodeI64(data, pos, info.mtimeNs) ||
+          !decodeU64(data, pos, info.inode) ||
+          !decodeU64(data, pos, numEntries)) {
+        WLOG(ERROR) << "Unable to decode discovery index dir " << relPath;
+        return false;
+      }
+      for (uint64_t i = 0; i < numEntries; i++) {
+        DirEntry entry;
+        if (pos >= (int64_t)data.size() || !decodeStr(data, pos, entry.name) ||
+            pos >= (int64_t)data.size()) {
+          WLOG(ERROR) << "Unable to decode entries of dir " << relPath;
+          return false;
+        }
+        entry.type = data[pos++];
+        info.entries.emplace_back(std::move(entry));
+      }
+      oldIndex_.dirs[relPath] = std::move(info);
+    } else {
+      WLOG(ERROR) << "Unknown discovery index record " << (int)recordType;
+      return false;
+    }
+  }
+  return true;
+}
+
+const std::vector<DiscoveryIndex::DirEntry> *
+DiscoveryIndex::getUnchangedDirEntries(const std::string &relPath,
+                                       const struct stat &st) const {
+  auto it = oldIndex_.dirs.find(relPath);
+  if (it == oldIndex_.dirs.end() || it->second.mtimeNs != getMtimeNs(st) ||
+      it->second.inode != (uint64_t)st.st_ino) {
+    return nullptr;
+  }
+  return &it->second.entries;
+}
+
+bool DiscoveryIndex::isFileUnchanged(const std::string &relPath,
+                                     const struct stat &st) const {
+  auto it = oldIndex_.files.find(relPath);
+  return it != oldIndex_.files.end() && it->second.size == st.st_size &&
+         it->second.mtimeNs == getMtimeNs(st) &&
+         it->second.inode == (uint64_t)st.st_ino;
+}
+
+void DiscoveryIndex::addDirectory(const std::string &relPath,
+                                  const struct stat &st,
+                                  std::vector<DirEntry> entries) {
+  DirInfo info;
+  info.mtimeNs = getMtimeNs(st);
+  info.inode = st.st_ino;
+  info.entries = std::move(entries);
+  std::lock_guard<std::mutex> lock(mutex_);
+  newIndex_.dirs[relPath] = std::move(info);
+}
+
+void DiscoveryIndex::addFile(const std::string &relPath,
+                             const struct stat &st) {
+  FileInfo info;
+  info.size = st.st_size;
+  info.mtimeNs = getMtimeNs(st);
+  info.inode = st.st_ino;
+  std::lock_guard<std::mutex> lock(mutex_);
+  newIndex_.files[relPath] = info;
+}
+
+bool DiscoveryIndex::save() {
+  const std::string tmpPath = indexPath_ + ".tmp";
+  int fd = ::open(tmpPath.c_str(), O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC,
+                  0644);
+  if (fd < 0) {
+    WPLOG(ERROR) << "Unable to create discovery index " << tmpPath;
+    return false;
+  }
+  bool success = true;
+  std::string buf(kIndexMagic, kIndexMagicLen);
+  encodeStr(buf, signature_);
+  auto flush = [&](bool force) {
+    if (success && (force || buf.size() >= kWriteChunkSize)) {
+      success = writeFully(fd, buf);
+      buf.clear();
+    }
+  };
+  {
+    std::lock_guard<std::mutex> lock(mutex_);
+    for (const auto &it : newIndex_.dirs) {
+      buf.push_back(kDirRecord);
+      encodeStr(buf, it.first);
+      encodeVarI64(buf, it.second.mtimeNs);
+      encodeVarU64(buf, it.second.inode);
+      encodeVarU64(buf, it.second.entries.size());
+      for (const auto &entry : it.second.entries) {
+        encodeStr(buf, entry.name);
+        buf.push_back(entry.type);
+      }
+      flush(false);
+    }
+    for (const auto &it : newIndex_.files) {
+      buf.push_back(kFileRecord);
+      encodeStr(buf, it.first);
+      encodeVarI64(buf, it.second.size);
+      encodeVarI64(buf, it.second.mtimeNs);
+      encodeVarU64(buf, it.second.inode);
+      flush(false);
+    }
+  }
+  flush(true);
+  if (!success) {
+    WPLOG(ERROR) << "Unable to write discovery index " << tmpPath;
+  } else if (fsync(fd) != 0) {
+    WPLOG(ERROR) << "Unable to fsync discovery index " << tmpPath;
+    success = false;
+  }
+  if (::close(fd) != 0) {
+    WPLOG(ERROR) << "Unable to close discovery index " << tmpPath;
+    success = false;
+  }
+  if (success && rename(tmpPath.c_str(), indexPath_.c_str()) != 0) {
+    WPLOG(ERROR) << "Unable to rename " << tmpPath << " to " << indexPath_;
+    success = false;
+  }
+  if (!success) {
+    unlink(tmpPath.c_str());
+    return false;
+  }
+  WLOG(INFO) << "Saved discovery index " << indexPath_ << " with "
+             << newIndex_.files.size() << " files and "
+             << newIndex_.dirs.size() << " directories";
+  return true;
+}
+}
+}
@@ -0,0 +1,117 @@
+/**
+ * Copyright (c) 2014-present, Facebook, Inc.
+ * All rights reserved.
+ *
+ * This source code is licensed under the BSD-style license found in the
+ * LICENSE file in the root directory of this source tree. An additional grant
+ * of patent rights can be found in the PATENTS file in the same directory.
+ */
+#pragma once
+
+#include <sys/stat.h>
+
+#include <cstdint>
+#include <mutex>
+#include <string>
+#include <unordered_map>
+#include <vector>
+
+namespace facebook {
+namespace wdt {
+
+/**
+ * Sender side on-disk index of the files discovered by the last successful
+ * send of a directory. It lets the next run of the same transfer skip reading
+ * directories whose mtime did not change and skip files whose size, mtime and
+ * inode did not change.
+ * The index loaded from disk is read only, the entries of the current run are
+ * recorded separately (thread safe) and only written by save(), which is
+ * expected to be called after the transfer succeeded.
+ */
+class DiscoveryIndex {
+ public:
+  /// one entry of a directory, as returned by the directory reader
+  struct DirEntry {
+    std::string name;
+    unsigned char type;
+  };
+
+  /**
+   * @param indexPath   path of the index file
+   * @param signature   describes what was discovered (root dir, patterns
+   *                    etc), an index with a different signature is ignored
+   */
+  DiscoveryIndex(const std::string &indexPath, const std::string &signature);
+
+  /**
+   * Loads the index of the previous run, a missing or invalid index is
+   * treated as empty
+   *
+   * @return    true if a valid index was loaded
+   */
+  bool load();
+
+  /**
+   * @param relPath   path of the directory relative to the root
+   * @param st        current stat of the directory
+   *
+   * @return          entries of the directory if it did not change since the
+   *                  previous run, nullptr otherwise
+   */
+  const std::vector<DirEntry> *getUnchangedDirEntries(
+      const std::string &relPath, const struct stat &st) const;
+
+  /// @return   whether the file did not change since the previous run
+  bool isFileUnchanged(const std::string &relPath,
+                       const struct stat &st) const;
+
+  /// records a directory and its entries in the new index
+  void addDirectory(const std::string &relPath, const struct stat &st,
+                    std::vector<DirEntry> entries);
+
+  /// records a file in the new index
+  void addFile(const std::string &relPath, const struct stat &st);
+
+  /**
+   * Atomically replaces the index on disk by the entries recorded during this
+   * run
+   *
+   * @return    true on success
+   */
+  bool save();
+
+ private:
+  struct FileInfo {
+    int64_t size{0};
+    int64_t mtimeNs{0};
+    uint64_t inode{0};
+  };
+
+  struct DirInfo {
+    int64_t mtimeNs{0};
+    uint64_t inode{0};
+    std::vector<DirEntry> entries;
+  };
+
+  struct Index {
+    std::unordered_map<std::string, FileInfo> files;
+    std::unordered_map<std::string, DirInfo> dirs;
+  };
+
+  /// @return   mtime in nanoseconds of the stat
+  static int64_t getMtimeNs(const struct stat &st);
+
+  /// decodes the content of an index file into oldIndex_
+  bool decode(const std::string &data);
+
+  const std::string indexPath_;
+  const std::string signature_;
+  /// index of the previous run, not modified after load()
+  Index oldIndex_;
+  /// index being built by this run
+  Index newIndex_;
+  /// protects newIndex_
+  std::mutex mutex_;
+};
+}
+}
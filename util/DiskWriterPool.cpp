@@ -0,0 +1,174 @@
+/**
+ * Copyright (c) 2014-present, Facebook, Inc.
+ * All rights reserved.
+ *
+ * This source code is licensed under the BSD-style license found in the
+ * LICENSE file in the root directory of this source tree. An additional grant
+ * of patent rights can be found in the PATENTS file in the same directory.
+ */
+#include <wdt/util/DiskWriterPool.h>
+
+#include <errno.h>
+#include <unistd.h>
+#include <algorithm>
+#include <chrono>
+
+namespace facebook {
+namespace wdt {
+
+DiskWriterPool::DiskWriterPool(int numThreads, int64_t bufferSize,
+                               int64_t memoryCap, int maxWritersPerDevice)
+    : bufferSize_(bufferSize),
+      maxBuffers_(std::max<int64_t>(1, memoryCap / bufferSize)),
+      maxWritersPerDevice_(maxWritersPerDevice) {
+  WDT_CHECK_GT(numThreads, 0);
+  WLOG(INFO) << "Starting " << numThreads << " disk writer threads with up to "
+             << maxBuffers_ << " buffers of " << bufferSize_
+             << ", max writers per device " << maxWritersPerDevice_;
+  for (int i = 0; i < numThreads; i++) {
+    writerThreads_.emplace_back(&DiskWriterPool::writeLoop, this);
+  }
+}
+
+DiskWriterPool::~DiskWriterPool() {
+  {
+    std::lock_guard<std::mutex> lock(mutex_);
+    stop_ = true;
+  }
+  workCond_.notify_all();
+  for (auto &writerThread : writerThreads_) {
+    writerThread.join();
+  }
+}
+
+char *DiskWriterPool::getBuffer(const IAbortChecker *abortChecker) {
+  std::unique_lock<std::mutex> lock(mutex_);
+  while (freeBuffers_.empty()) {
+    if (buffers_.size() < maxBuffers_) {
+      std::unique_ptr<Buffer> buffer = std::make_unique<Buffer>(bufferSize_);
+      if (buffer->getData() == nullptr) {
+        return nullptr;
+      }
+      buffers_.emplace_back(std::move(buffer));
+      return buffers_.back()->getData();
+    }
+    // memory cap hit, wait for the disks to catch up
+    doneCond_.wait_for(lock, std::chrono::milliseconds(100));
+    if (abortChecker != nullptr && abortChecker->shouldAbort()) {
+      return nullptr;
+    }
+  }
+  char *data = freeBuffers_.back();
+  freeBuffers_.pop_back();
+  return data;
+}
+
+void DiskWriterPool::releaseBuffer(char *data) {
+  {
+    std::lock_guard<std::mutex> lock(mutex_);
+    freeBuffers_.push_back(data);
+  }
+  doneCond_.notify_all();
+}
+
+double DiskWriterPool::getFillRatio() {
+  std::lock_guard<std::mutex> lock(mutex_);
+  return (double)(buffers_.size() - freeBuffers_.size()) / maxBuffers_;
+}
+
+int DiskWriterPool::getPeakDeviceWriters() {
+  std::lock_guard<std::mutex> lock(mutex_);
+  return peakDeviceWriters_;
+}
+
+void DiskWriterPool::submit(Write *write) {
+  {
+    std::lock_guard<std::mutex> lock(mutex_);
+    write->done = false;
+    toWrite_.push_back(write);
+  }
+  workCond_.notify_one();
+}
+
+void DiskWriterPool::wait(Write *write) {
+  std::unique_lock<std::mutex> lock(mutex_);
+  doneCond_.wait(lock, [write] { return write->done; });
+}
+
+bool DiskWriterPool::isDone(const Write *write) {
+  std::lock_guard<std::mutex> lock(mutex_);
+  return write->done;
+}
+
+std::deque<DiskWriterPool::Write *>::iterator
+DiskWriterPool::findWriteLocked() {
+  if (maxWritersPerDevice_ <= 0) {
+    return toWrite_.begin();
+  }
+  return std::find_if(toWrite_.begin(), toWrite_.end(), [this](Write *write) {
+    if (write->deviceId < 0) {
+      return true;
+    }
+    auto it = numDeviceWriters_.find(write->deviceId);
+    return it == numDeviceWriters_.end() || it->second < maxWritersPerDevice_;
+  });
+}
+
+void DiskWriterPool::writeLoop() {
+  std::unique_lock<std::mutex> lock(mutex_);
+  while (true) {
+    // writes handed off are always completed, their owners wait for them.
+    // Writes to a device at the limit wait for a write to it to be done
+    auto it = toWrite_.end();
+    workCond_.wait(lock, [this, &it] {
+      it = findWriteLocked();
+      return it != toWrite_.end() || (stop_ && toWrite_.empty());
+    });
+    if (it == toWrite_.end()) {
+      return;
+    }
+    Write *write = *it;
+    toWrite_.erase(it);
+    const bool counted = maxWritersPerDevice_ > 0 && write->deviceId >= 0;
+    if (counted) {
+      peakDeviceWriters_ = std::max(peakDeviceWriters_,
+                                    ++numDeviceWriters_[write->deviceId]);
+    }
+    lock.unlock();
+    if (write->computeChecksum) {
+      BlockChecksum checksum(write->checksumType);
+      checksum.update(write->data, write->size);
+      write->checksum = checksum.getValue();
+    }
+    int64_t written = 0;
+    while (written < write->size) {
+      const int64_t ret = ::pwrite(write->fd, write->data + written,
+                                   write->size - written,
+                                   write->offset + written);
+      if (ret < 0 && errno == EINTR) {
+        continue;
+      }
+      if (ret <= 0) {
+        written = (ret < 0) ? -errno : -EIO;
+        break;
+      }
+      written += ret;
+    }
+    lock.lock();
+    if (counted && --numDeviceWriters_[write->deviceId] == 0) {
+      numDeviceWriters_.erase(write->deviceId);
+    }
+    write->result = written;
+    write->done = true;
+    freeBuffers_.push_back(write->data);
+    lock.unlock();
+    doneCond_.notify_all();
+    if (counted) {
+      // a write to this device may have been waiting
+      workCond_.notify_one();
+    }
+    lock.lock();
+  }
+}
+}
+}
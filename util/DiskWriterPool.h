@@ -0,0 +1,146 @@
+/**
+ * Copyright (c) 2014-present, Facebook, Inc.
+ * All rights reserved.
+ *
+ * This source code is licensed under the BSD-style license found in the
+ * LICENSE file in the root directory of this source tree. An additional grant
+ * of patent rights can be found in the PATENTS file in the same directory.
+ */
+#pragma once
+
+#include <wdt/AbortChecker.h>
+#include <wdt/util/BlockChecksum.h>
+#include <wdt/util/CommonImpl.h>
+
+#include <condition_variable>
+#include <deque>
+#include <memory>
+#include <mutex>
+#include <thread>
+#include <unordered_map>
+#include <vector>
+
+namespace facebook {
+namespace wdt {
+
+/**
+ * Pool of threads writing file data on behalf of the receiver threads, so that
+ * they keep draining their sockets while the disks catch up. Data is handed
+ * off in buffers of the pool. Their total size is capped, receiver threads
+ * block in getBuffer() once the cap is hit. The number of threads writing to
+ * one device can be limited, writes to a device at the limit wait while the
+ * ones to other devices go first. The writer threads can also compute the
+ * checksum of the data they write, so that the receiver threads don't.
+ * Shared by all the receiver threads, all the methods are thread safe.
+ */
+class DiskWriterPool {
+ public:
+  /// one write handed off to the pool
+  struct Write {
+    int fd{-1};
+    /// buffer of the pool, released by the pool once written
+    char *data{nullptr};
+    int64_t size{0};
+    int64_t offset{0};
+    /// device of the file, -1 if unknown
+    int64_t deviceId{-1};
+    /// whether the writer thread computes the checksum of the data
+    bool computeChecksum{false};
+    ChecksumType checksumType{CHECKSUM_CRC32C};
+    /// checksum of the data, valid once done if computeChecksum is set
+    int64_t checksum{0};
+    /// size on success or -errno, valid once done
+    int64_t result{0};
+    bool done{false};
+  };
+
+  /**
+   * @param numThreads    number of writer threads
+   * @param bufferSize    size of each buffer
+   * @param memoryCap     max total size of the buffers, at least one buffer
+   *                      is always allowed
+   * @param maxWritersPerDevice   max threads writing to one device, 0 for no
+   *                              limit
+   */
+  DiskWriterPool(int numThreads, int64_t bufferSize, int64_t memoryCap,
+                 int maxWritersPerDevice = 0);
+
+  /// waits for the writes handed off and joins the writer threads
+  ~DiskWriterPool();
+
+  /// @return   size of the buffers
+  int64_t getBufferSize() const {
+    return bufferSize_;
+  }
+
+  /// @return   whether the writes need their device
+  bool isPerDevice() const {
+    return maxWritersPerDevice_ > 0;
+  }
+
+  /**
+   * Returns a free buffer, blocking while the memory cap is hit
+   *
+   * @param abortChecker    checked while blocked, can be nullptr
+   *
+   * @return                buffer of getBufferSize() bytes, nullptr if
+   *                        aborted or out of memory
+   */
+  char *getBuffer(const IAbortChecker *abortChecker);
+
+  /// returns a buffer obtained from getBuffer() without writing it
+  void releaseBuffer(char *data);
+
+  /**
+   * Hands off a write. Its buffer can't be used by the caller anymore and the
+   * write must stay in place till wait() returns for it
+   */
+  void submit(Write *write);
+
+  /// waits till the write is done
+  void wait(Write *write);
+
+  /// @return   whether the write is done, without blocking
+  bool isDone(const Write *write);
+
+  /// @return   fraction of the memory cap held by data not written yet
+  double getFillRatio();
+
+  /// @return   max number of threads seen writing to one device at a time
+  int getPeakDeviceWriters();
+
+ private:
+  /// main loop of the writer threads
+  void writeLoop();
+
+  /**
+   * @return    first write of toWrite_ whose device is below the limit,
+   *            toWrite_.end() if none. mutex_ has to be held
+   */
+  std::deque<Write *>::iterator findWriteLocked();
+
+  const int64_t bufferSize_;
+  /// max number of buffers
+  const size_t maxBuffers_;
+  const int maxWritersPerDevice_;
+  /// number of threads writing to each device, only with a limit
+  std::unordered_map<int64_t, int> numDeviceWriters_;
+  /// max value seen in numDeviceWriters_
+  int peakDeviceWriters_{0};
+  /// all the buffers allocated so far
+  std::vector<std::unique_ptr<Buffer>> buffers_;
+  /// buffers available for the receiver threads
+  std::vector<char *> freeBuffers_;
+  /// writes handed off and not picked by a writer thread yet
+  std::deque<Write *> toWrite_;
+  /// set when the pool is destroyed
+  bool stop_{false};
+  std::mutex mutex_;
+  /// notified when a write is submitted
+  std::condition_variable workCond_;
+  /// notified when a write is done, freeing its buffer
+  std::condition_variable doneCond_;
+  std::vector<std::thread> writerThreads_;
+};
+}
+}
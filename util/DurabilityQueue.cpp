@@ -0,0 +1,210 @@
+/**
+ * Copyright (c) 2014-present, Facebook, Inc.
+ * All rights reserved.
+ *
+ * This source code is licensed under the BSD-style license found in the
+ * LICENSE file in the root directory of this source tree. An additional grant
+ * of patent rights can be found in the PATENTS file in the same directory.
+ */
+#include <wdt/util/DurabilityQueue.h>
+
+#include <wdt/util/LatencyHistograms.h>
+
+#include <fcntl.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#include <chrono>
+
+namespace facebook {
+namespace wdt {
+
+const size_t DurabilityQueue::kSyncfsBatchSize = 16;
+
+DurabilityQueue::DurabilityQueue(const WdtOptions &options,
+                                 TransferLogManager &transferLogManager)
+    : options_(options), transferLogManager_(transferLogManager) {
+  syncThread_ = std::thread(&DurabilityQueue::syncLoop, this);
+}
+
+DurabilityQueue::~DurabilityQueue() {
+  drain(-1);
+  {
+    std::lock_guard<std::mutex> lock(mutex_);
+    stop_ = true;
+  }
+  workCond_.notify_all();
+  syncThread_.join();
+}
+
+void DurabilityQueue::add(int fd, const BlockDetails &blockDetails) {
+  {
+    std::lock_guard<std::mutex> lock(mutex_);
+    PendingFile file;
+    file.fd = fd;
+    file.key = BlockKey(blockDetails.seqId, blockDetails.offset);
+    file.offset = blockDetails.offset;
+    file.dataSize = blockDetails.dataSize;
+    toSync_.emplace_back(file);
+    if (options_.isLogBasedResumption()) {
+      // a block sent again replaces its previous status
+      BlockStatus &status = blocks_[file.key];
+      status = BlockStatus();
+      status.dataSize = blockDetails.dataSize;
+    }
+  }
+  workCond_.notify_one();
+}
+
+void DurabilityQueue::markVerified(const BlockDetails &blockDetails) {
+  const BlockKey key(blockDetails.seqId, blockDetails.offset);
+  {
+    std::lock_guard<std::mutex> lock(mutex_);
+    auto it = blocks_.find(key);
+    if (it != blocks_.end() && !it->second.durable) {
+      it->second.verified = true;
+      it->second.checksumType = blockDetails.checksumType;
+      it->second.checksum = blockDetails.checksum;
+      return;
+    }
+    if (it != blocks_.end()) {
+      blocks_.erase(it);
+    }
+  }
+  // durable, or never handed off when writes are skipped
+  BlockStatus status;
+  status.dataSize = blockDetails.dataSize;
+  status.checksumType = blockDetails.checksumType;
+  status.checksum = blockDetails.checksum;
+  addBlockWriteEntry(key, status);
+}
+
+bool DurabilityQueue::drain(int timeoutMillis) {
+  std::unique_lock<std::mutex> lock(mutex_);
+  auto isDrained = [this] { return toSync_.empty() && !syncing_; };
+  if (timeoutMillis < 0) {
+    doneCond_.wait(lock, isDrained);
+    return true;
+  }
+  return doneCond_.wait_for(lock, std::chrono::milliseconds(timeoutMillis),
+                            isDrained);
+}
+
+bool DurabilityQueue::hasFailed() {
+  std::lock_guard<std::mutex> lock(mutex_);
+  return failed_;
+}
+
+void DurabilityQueue::reset() {
+  std::lock_guard<std::mutex> lock(mutex_);
+  failed_ = false;
+  blocks_.clear();
+}
+
+void DurabilityQueue::syncLoop() {
+  std::unique_lock<std::mutex> lock(mutex_);
+  while (true) {
+    workCond_.wait(lock, [this] { return stop_ || !toSync_.empty(); });
+    if (toSync_.empty()) {
+      return;
+    }
+    // everything handed off so far is synced as one batch
+    std::vector<PendingFile> batch;
+    batch.swap(toSync_);
+    syncing_ = true;
+    lock.unlock();
+    std::vector<bool> synced;
+    syncBatch(batch, synced);
+    std::vector<std::pair<BlockKey, BlockStatus>> toLog;
+    lock.lock();
+    for (size_t i = 0; i < batch.size(); i++) {
+      auto it = blocks_.find(batch[i].key);
+      if (!synced[i]) {
+        // the status is kept, so that the block is never logged
+        failed_ = true;
+        continue;
+      }
+      if (it == blocks_.end()) {
+        continue;
+      }
+      if (it->second.verified) {
+        toLog.emplace_back(it->first, it->second);
+        blocks_.erase(it);
+      } else {
+        it->second.durable = true;
+      }
+    }
+    lock.unlock();
+    for (const auto &entry : toLog) {
+      addBlockWriteEntry(entry.first, entry.second);
+    }
+    lock.lock();
+    syncing_ = false;
+    doneCond_.notify_all();
+  }
+}
+
+void DurabilityQueue::syncBatch(const std::vector<PendingFile> &batch,
+                                std::vector<bool> &synced) {
+  synced.assign(batch.size(), true);
+  const bool needSync = options_.fsync || options_.isLogBasedResumption();
+  if (needSync) {
+    // files of the batch, grouped by filesystem
+    std::map<dev_t, std::vector<size_t>> fileSystems;
+    for (size_t i = 0; i < batch.size(); i++) {
+      struct stat fileStat;
+      if (fstat(batch[i].fd, &fileStat) != 0) {
+        WPLOG(ERROR) << "fstat failed for fd " << batch[i].fd;
+        synced[i] = false;
+        continue;
+      }
+      fileSystems[fileStat.st_dev].push_back(i);
+    }
+    for (const auto &fileSystem : fileSystems) {
+      const std::vector<size_t> &files = fileSystem.second;
+#ifdef HAS_SYNCFS
+      if (files.size() >= kSyncfsBatchSize) {
+        if (::syncfs(batch[files.front()].fd) == 0) {
+          WVLOG(1) << "Synced " << files.size() << " files using syncfs";
+          continue;
+        }
+        WPLOG(WARNING) << "syncfs failed, syncing files one by one";
+      }
+#endif
+      for (size_t i : files) {
+        LatencyRecorder latencyRecorder(options_, FSYNC);
+        if (::fdatasync(batch[i].fd) != 0) {
+          WPLOG(ERROR) << "Unable to fdatasync() fd " << batch[i].fd;
+          synced[i] = false;
+        }
+      }
+    }
+  }
+  for (size_t i = 0; i < batch.size(); i++) {
+    const PendingFile &file = batch[i];
+#ifdef HAS_POSIX_FADVISE
+    if (!options_.skip_fadvise &&
+        posix_fadvise(file.fd, file.offset, file.dataSize,
+                      POSIX_FADV_DONTNEED) != 0) {
+      WPLOG(ERROR) << "posix_fadvise failed for fd " << file.fd << " "
+                   << file.offset << " " << file.dataSize;
+      synced[i] = false;
+    }
+#endif
+    if (::close(file.fd) != 0) {
+      WPLOG(ERROR) << "Unable to close fd " << file.fd;
+      synced[i] = false;
+    }
+  }
+}
+
+void DurabilityQueue::addBlockWriteEntry(const BlockKey &key,
+                                         const BlockStatus &status) {
+  if (!options_.isLogBasedResumption()) {
+    return;
+  }
+  transferLogManager_.addBlockWriteEntry(key.first, key.second,
+                                         status.dataSize, status.checksumType,
+                                         status.checksum);
+}
+}
+}
@@ -0,0 +1,132 @@
+/**
+ * Copyright (c) 2014-present, Facebook, Inc.
+ * All rights reserved.
+ *
+ * This source code is licensed under the BSD-style license found in the
+ * LICENSE file in the root directory of this source tree. An additional grant
+ * of patent rights can be found in the PATENTS file in the same directory.
+ */
+#pragma once
+
+#include <wdt/Protocol.h>
+#include <wdt/WdtOptions.h>
+#include <wdt/util/TransferLogManager.h>
+
+#include <condition_variable>
+#include <map>
+#include <mutex>
+#include <thread>
+#include <utility>
+#include <vector>
+
+namespace facebook {
+namespace wdt {
+
+/**
+ * Syncs and closes the files written by the receiver threads on a background
+ * thread, so that fsync latency is not serialized into the transfer. Files
+ * handed off together are synced in a batch, with a single syncfs() for many
+ * files of the same filesystem. A block is added to the transfer log once it
+ * is both durable and verified by the receiver thread. All the methods are
+ * thread safe.
+ */
+class DurabilityQueue {
+ public:
+  /// files of a filesystem from which a batch is synced using syncfs()
+  static const size_t kSyncfsBatchSize;
+
+  /**
+   * @param options               options of the receiver
+   * @param transferLogManager    log durable blocks are added to
+   */
+  DurabilityQueue(const WdtOptions &options,
+                  TransferLogManager &transferLogManager);
+
+  /// drains the queue and joins the sync thread
+  ~DurabilityQueue();
+
+  /**
+   * Hands off the fd of a completely written block, the queue syncs and
+   * closes it
+   */
+  void add(int fd, const BlockDetails &blockDetails);
+
+  /**
+   * Called once the data of the block is verified. The block is added to the
+   * transfer log now if already durable, else once durable
+   */
+  void markVerified(const BlockDetails &blockDetails);
+
+  /**
+   * Waits till every file handed off is synced and closed
+   *
+   * @param timeoutMillis   max time to wait, negative to wait forever
+   *
+   * @return                false on timeout
+   */
+  bool drain(int timeoutMillis);
+
+  /// @return   whether syncing or closing any file failed since reset()
+  bool hasFailed();
+
+  /// clears the failure status, for a new transfer
+  void reset();
+
+ private:
+  /// (seqId, offset) of a block
+  typedef std::pair<int64_t, int64_t> BlockKey;
+
+  /// one file handed off
+  struct PendingFile {
+    int fd{-1};
+    BlockKey key;
+    int64_t offset{0};
+    int64_t dataSize{0};
+  };
+
+  /// durability and verification status of a block handed off
+  struct BlockStatus {
+    int64_t dataSize{0};
+    /// checksum of the block, logged with it
+    ChecksumType checksumType{NUM_CHECKSUM_TYPES};
+    int64_t checksum{0};
+    bool durable{false};
+    bool verified{false};
+  };
+
+  /// main loop of the sync thread
+  void syncLoop();
+
+  /**
+   * Syncs, fadvises and closes a batch of files
+   *
+   * @param batch     files to sync
+   * @param synced    set to whether each file was synced and closed
+   */
+  void syncBatch(const std::vector<PendingFile> &batch,
+                 std::vector<bool> &synced);
+
+  /// adds a verified and durable block to the transfer log
+  void addBlockWriteEntry(const BlockKey &key, const BlockStatus &status);
+
+  const WdtOptions &options_;
+  TransferLogManager &transferLogManager_;
+  /// files waiting to be synced
+  std::vector<PendingFile> toSync_;
+  /// status of the blocks handed off and not logged yet
+  std::map<BlockKey, BlockStatus> blocks_;
+  /// whether the sync thread is syncing a batch
+  bool syncing_{false};
+  /// set when syncing or closing a file failed
+  bool failed_{false};
+  /// set when the queue is destroyed
+  bool stop_{false};
+  std::mutex mutex_;
+  /// notified when files are handed off
+  std::condition_variable workCond_;
+  /// notified when a batch is done
+  std::condition_variable doneCond_;
+  std::thread syncThread_;
+};
+}
+}
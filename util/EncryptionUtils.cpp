@@ -100,6 +100,10 @@ WdtCryptoIntializer::~WdtCryptoIntializer() {
 #endif
 }
 
+void WdtCryptoIntializer::ensureInitialized() {
+  static WdtCryptoIntializer initializer;
+}
+
 EncryptionType parseEncryptionType(const std::string& str) {
   if (str == kEncryptionTypeDescriptions[ENC_AES128_GCM]) {
     return ENC_AES128_GCM;
@@ -235,6 +239,7 @@ EncryptionParams EncryptionParams::generateEncryptionParams(
     return EncryptionParams();
   }
   WDT_CHECK(type > ENC_NONE && type < NUM_ENC_TYPES);
+  WdtCryptoIntializer::ensureInitialized();
   uint8_t key[kAESBlockSize];
   if (RAND_bytes(key, kAESBlockSize) != 1) {
     WLOG(ERROR) << "RAND_bytes failed, unable to generate symmetric key";
@@ -265,6 +270,7 @@ const EVP_CIPHER* AESBase::getCipher(const EncryptionType encryptionType) {
 }
 
 EVP_CIPHER_CTX* createAndInitCtx() {
+  WdtCryptoIntializer::ensureInitialized();
   auto ctx = EVP_CIPHER_CTX_new();
   EVP_CIPHER_CTX_init(ctx);
   return ctx;
@@ -36,6 +36,12 @@ class WdtCryptoIntializer {
  public:
   WdtCryptoIntializer();
   ~WdtCryptoIntializer();
+
+  /**
+   * Initializes openssl on first use, so that the transfers without
+   * encryption don't pay for it. Called before any openssl call, thread safe
+   */
+  static void ensureInitialized();
 };
 
 class EncryptionParams {
@@ -0,0 +1,67 @@
+/**
+ * Copyright (c) 2014-present, Facebook, Inc.
+ * All rights reserved.
+ *
+ * This source code is licensed under the BSD-style license found in the
+ * LICENSE file in the root directory of this source tree. An additional grant
+ * of patent rights can be found in the PATENTS file in the same directory.
+ */
+#include <wdt/util/FdCache.h>
+#include <wdt/ErrorCodes.h>
+
+#include <unistd.h>
+#include <algorithm>
+
+namespace facebook {
+namespace wdt {
+
+FdCache::FdCache(int capacity) : capacity_(std::max(1, capacity)) {
+}
+
+FdCache::~FdCache() {
+  clear();
+}
+
+int FdCache::take(int64_t seqId) {
+  auto it = fds_.find(seqId);
+  if (it == fds_.end()) {
+    return -1;
+  }
+  const int fd = it->second->second;
+  lru_.erase(it->second);
+  fds_.erase(it);
+  return fd;
+}
+
+void FdCache::put(int64_t seqId, int fd) {
+  erase(seqId);
+  while (fds_.size() >= capacity_) {
+    closeEntry(std::prev(lru_.end()));
+  }
+  lru_.emplace_front(seqId, fd);
+  fds_[seqId] = lru_.begin();
+}
+
+void FdCache::erase(int64_t seqId) {
+  auto it = fds_.find(seqId);
+  if (it != fds_.end()) {
+    closeEntry(it->second);
+  }
+}
+
+void FdCache::clear() {
+  while (!lru_.empty()) {
+    closeEntry(lru_.begin());
+  }
+}
+
+void FdCache::closeEntry(FdList::iterator it) {
+  const int fd = it->second;
+  fds_.erase(it->first);
+  lru_.erase(it);
+  if (::close(fd) != 0) {
+    WPLOG(ERROR) << "Unable to close cached fd " << fd;
+  }
+}
+}
+}
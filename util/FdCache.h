@@ -0,0 +1,78 @@
+/**
+ * Copyright (c) 2014-present, Facebook, Inc.
+ * All rights reserved.
+ *
+ * This source code is licensed under the BSD-style license found in the
+ * LICENSE file in the root directory of this source tree. An additional grant
+ * of patent rights can be found in the PATENTS file in the same directory.
+ */
+#pragma once
+
+#include <cstddef>
+#include <cstdint>
+#include <list>
+#include <unordered_map>
+#include <utility>
+
+namespace facebook {
+namespace wdt {
+
+/**
+ * Bounded LRU cache of the fds of the files a thread works on, keyed by the
+ * seqId of the file. Lets the blocks of a large file handled by the same
+ * thread reuse the fd opened for the previous one instead of reopening the
+ * file. A cached fd is owned by the cache, take() hands its ownership back to
+ * the caller. Each thread is expected to own its cache, the class is not
+ * thread safe.
+ */
+class FdCache {
+ public:
+  /// @param capacity   max number of fds kept open
+  explicit FdCache(int capacity);
+
+  /// closes all the cached fds
+  ~FdCache();
+
+  /**
+   * Removes the fd of a file from the cache
+   *
+   * @param seqId   seqId of the file
+   *
+   * @return        fd now owned by the caller, -1 if not cached
+   */
+  int take(int64_t seqId);
+
+  /**
+   * Puts the fd of a file in the cache, closing the least recently used fd if
+   * the cache is full, or the fd already cached for the same file
+   */
+  void put(int64_t seqId, int fd);
+
+  /// closes the fd cached for a file, if any
+  void erase(int64_t seqId);
+
+  /// closes all the cached fds, for a new transfer
+  void clear();
+
+  /// @return   number of fds cached
+  size_t size() const {
+    return fds_.size();
+  }
+
+  // making the object non-copyable
+  FdCache(const FdCache &) = delete;
+  FdCache &operator=(const FdCache &) = delete;
+
+ private:
+  /// (seqId, fd), most recently used first
+  typedef std::list<std::pair<int64_t, int>> FdList;
+
+  /// removes an entry and closes its fd
+  void closeEntry(FdList::iterator it);
+
+  const size_t capacity_;
+  FdList lru_;
+  std::unordered_map<int64_t, FdList::iterator> fds_;
+};
+}
+}
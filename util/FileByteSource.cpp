@@ -13,9 +13,84 @@
 #include <sys/stat.h>
 #include <sys/types.h>
 #include <algorithm>
+#ifdef WDT_HAS_FIEMAP
+#include <linux/fiemap.h>
+#include <linux/fs.h>
+#include <string.h>
+#include <sys/ioctl.h>
+#endif
 namespace facebook {
 namespace wdt {
 
+int64_t FileUtil::getPhysicalOffset(int fd) {
+#if defined(WDT_HAS_FIEMAP) && defined(FS_IOC_FIEMAP)
+  // room for exactly one extent
+  alignas(struct fiemap) char
+      buf[sizeof(struct fiemap) + sizeof(struct fiemap_extent)];
+  memset(buf, 0, sizeof(buf));
+  struct fiemap *map = reinterpret_cast<struct fiemap *>(buf);
+  map->fm_start = 0;
+  map->fm_length = FIEMAP_MAX_OFFSET;
+  map->fm_extent_count = 1;
+  if (ioctl(fd, FS_IOC_FIEMAP, map) != 0) {
+    WVLOG(2) << "FIEMAP failed for fd " << fd << " " << strerrorStr(errno);
+    return -1;
+  }
+  if (map->fm_mapped_extents == 0) {
+    return 0;
+  }
+  return map->fm_extents[0].fe_physical;
+#else
+  return -1;
+#endif
+}
+
+bool FileUtil::getDataExtents(int fd, int64_t fileSize,
+                              std::vector<Interval> &extents) {
+  extents.clear();
+#if defined(SEEK_DATA) && defined(SEEK_HOLE)
+  // last page of the file, sent even if it is a hole
+  const int64_t kTailSize = 4096;
+  int64_t offset = 0;
+  while (offset < fileSize) {
+    const int64_t dataStart = lseek(fd, offset, SEEK_DATA);
+    if (dataStart < 0 && errno == ENXIO) {
+      // only a hole left
+      break;
+    }
+    const int64_t dataEnd =
+        (dataStart < 0) ? -1 : lseek(fd, dataStart, SEEK_HOLE);
+    if (dataEnd < 0) {
+      WPLOG(WARNING) << "Unable to find data extents of fd " << fd;
+      extents.clear();
+      return false;
+    }
+    if (dataStart >= fileSize) {
+      break;
+    }
+    extents.emplace_back(dataStart, std::min(dataEnd, fileSize));
+    offset = dataEnd;
+  }
+  const int64_t lastEnd = extents.empty() ? 0 : extents.back().end_;
+  if (lastEnd < fileSize) {
+    const int64_t tailStart = (fileSize - 1) / kTailSize * kTailSize;
+    if (!extents.empty() && lastEnd >= tailStart) {
+      extents.back().end_ = fileSize;
+    } else {
+      extents.emplace_back(tailStart, fileSize);
+    }
+  }
+  if (extents.size() == 1 && extents[0].start_ == 0) {
+    // no hole
+    extents.clear();
+    return false;
+  }
+  return true;
+#else
+  return false;
+#endif
+}
+
 int FileUtil::openForRead(ThreadCtx &threadCtx, const std::string &filename,
                           const bool isDirectReads) {
   int openFlags = O_RDONLY;
@@ -63,6 +138,18 @@ FileByteSource::FileByteSource(SourceMetaData *metadata, int64_t size,
   transferStats_.setId(getIdentifier());
 }
 
+std::unique_ptr<FileByteSource> FileByteSource::splitOff(int64_t size) {
+  WDT_CHECK_GT(size, 0);
+  WDT_CHECK_LT(size, size_);
+  // the source gets reopened before being read again
+  this->close();
+  bytesRead_ = 0;
+  auto rest =
+      std::make_unique<FileByteSource>(metadata_, size_ - size, offset_ + size);
+  size_ = size;
+  return rest;
+}
+
 ErrorCode FileByteSource::open(ThreadCtx *threadCtx) {
   if (metadata_->allocationStatus == TO_BE_DELETED) {
     return OK;
@@ -70,6 +157,8 @@ ErrorCode FileByteSource::open(ThreadCtx *threadCtx) {
   bytesRead_ = 0;
   this->close();
   threadCtx_ = threadCtx;
+  readThreadCtx_ = nullptr;
+  readBuffer_ = nullptr;
   ErrorCode errCode = OK;
   const bool isDirectReads = metadata_->directReads;
   WVLOG(1) << "Reading in direct mode " << isDirectReads;
@@ -79,12 +168,24 @@ ErrorCode FileByteSource::open(ThreadCtx *threadCtx) {
 #endif
   }
 
+  ioUring_ = nullptr;
+  if (threadCtx_->getOptions().io_uring_reads) {
+    ioUring_ = threadCtx_->getIoUring();
+  }
+
   if (metadata_->fd >= 0) {
     WVLOG(1) << "metadata already has fd, no need to open " << getIdentifier();
     fd_ = metadata_->fd;
   } else {
-    fd_ =
-        FileUtil::openForRead(*threadCtx_, metadata_->fullPath, isDirectReads);
+    FdCache *fdCache = threadCtx_->getFdCache();
+    if (fdCache != nullptr) {
+      // reads use explicit offsets, the position of the fd does not matter
+      fd_ = fdCache->take(metadata_->seqId);
+    }
+    if (fd_ < 0) {
+      fd_ = FileUtil::openForRead(*threadCtx_, metadata_->getFullPath(),
+                                  isDirectReads);
+    }
     if (fd_ < 0) {
       errCode = BYTE_SOURCE_READ_ERROR;
     }
@@ -94,7 +195,31 @@ ErrorCode FileByteSource::open(ThreadCtx *threadCtx) {
   return errCode;
 }
 
+void FileByteSource::setReadBuffer(const Buffer *buffer) {
+  if (buffer != nullptr) {
+    // async reads are tied to the thread buffer
+    stopAsyncReads();
+  }
+  readBuffer_ = buffer;
+}
+
+int FileByteSource::getZeroCopyFd() {
+  if (fd_ < 0 || metadata_->directReads) {
+    // sendfile goes through the page cache, which direct reads avoid
+    return -1;
+  }
+  // data is not read through the thread buffer anymore
+  stopAsyncReads();
+  return fd_;
+}
+
+void FileByteSource::markRead(int64_t numBytes) {
+  WDT_CHECK_LE(bytesRead_ + numBytes, size_) << getIdentifier();
+  bytesRead_ += numBytes;
+}
+
 void FileByteSource::advanceOffset(int64_t numBytes) {
+  stopAsyncReads();
   offset_ += numBytes;
   size_ -= numBytes;
 }
@@ -104,7 +229,20 @@ char *FileByteSource::read(int64_t &size) {
   if (hasError() || finished()) {
     return nullptr;
   }
-  const Buffer *buffer = threadCtx_->getBuffer();
+  if (ioUring_ != nullptr) {
+    if (asyncSlots_.empty()) {
+      setupAsyncReads();
+    }
+    if (!asyncSlots_.empty()) {
+      return readAsync(size);
+    }
+  }
+  return readSync(size);
+}
+
+char *FileByteSource::readSync(int64_t &size) {
+  const Buffer *buffer =
+      (readBuffer_ != nullptr ? readBuffer_ : threadCtx_->getBuffer());
   int64_t offsetRemainder = 0;
   if (alignedReadNeeded_) {
     offsetRemainder = (offset_ + bytesRead_) % kDiskBlockSize;
@@ -120,11 +258,12 @@ char *FileByteSource::read(int64_t &size) {
   const int64_t seekPos = (offset_ + bytesRead_) - offsetRemainder;
   int numRead;
   {
-    PerfStatCollector statCollector(*threadCtx_, PerfStatReport::FILE_READ);
+    PerfStatCollector statCollector(statsCtx(), PerfStatReport::FILE_READ,
+                                    DISK_READ);
     numRead = ::pread(fd_, buffer->getData(), physicalRead, seekPos);
   }
   if (numRead < 0) {
-    WPLOG(ERROR) << "Failure while reading file " << metadata_->fullPath
+    WPLOG(ERROR) << "Failure while reading file " << metadata_->getFullPath()
                  << " need align " << alignedReadNeeded_ << " physicalRead "
                  << physicalRead << " offset " << offset_ << " seepPos "
                  << seekPos << " offsetRemainder " << offsetRemainder
@@ -134,9 +273,9 @@ char *FileByteSource::read(int64_t &size) {
     return nullptr;
   }
   if (numRead == 0) {
-    WLOG(ERROR) << "Unexpected EOF on " << metadata_->fullPath << " need align "
-                << alignedReadNeeded_ << " physicalRead " << physicalRead
-                << " offset " << offset_ << " seepPos " << seekPos
+    WLOG(ERROR) << "Unexpected EOF on " << metadata_->getFullPath()
+                << " need align " << alignedReadNeeded_ << " physicalRead "
+                << physicalRead << " offset " << offset_ << " seepPos " << seekPos
                 << " offsetRemainder " << offsetRemainder << " bytesRead "
                 << bytesRead_;
     this->close();
@@ -160,6 +299,142 @@ char *FileByteSource::read(int64_t &size) {
   return buffer->getData() + offsetRemainder;
 }
 
+void FileByteSource::setupAsyncReads() {
+  const Buffer *buffer = threadCtx_->getBuffer();
+  const int64_t remaining = size_ - bytesRead_;
+  int64_t numSlots = ioUring_->getQueueDepth();
+  int64_t slotSize =
+      (buffer->getSize() / numSlots / kDiskBlockSize) * kDiskBlockSize;
+  if (slotSize < kDiskBlockSize) {
+    slotSize = kDiskBlockSize;
+    numSlots = buffer->getSize() / kDiskBlockSize;
+  }
+  // one extra slot to account for the alignment of the first read
+  numSlots = std::min<int64_t>(numSlots, (remaining + slotSize - 1) / slotSize +
+                                             (alignedReadNeeded_ ? 1 : 0));
+  if (numSlots < 2) {
+    // a single read in flight is no better than a pread
+    WVLOG(2) << "Not using io_uring for " << getIdentifier() << " remaining "
+             << remaining << " slot size " << slotSize;
+    ioUring_ = nullptr;
+    return;
+  }
+  asyncSlots_.resize(numSlots);
+  for (int64_t i = 0; i < numSlots; i++) {
+    asyncSlots_[i].data = buffer->getData() + i * slotSize;
+    asyncSlots_[i].capacity = slotSize;
+  }
+  nextAsyncSlot_ = 0;
+  reuseReturnedSlot_ = false;
+  bytesQueued_ = bytesRead_;
+  for (auto &slot : asyncSlots_) {
+    if (!prepareAsyncRead(slot)) {
+      break;
+    }
+  }
+  if (ioUring_->submit() < 0) {
+    stopAsyncReads();
+  }
+}
+
+bool FileByteSource::prepareAsyncRead(AsyncReadSlot &slot) {
+  if (bytesQueued_ >= size_) {
+    return false;
+  }
+  const int64_t pos = offset_ + bytesQueued_;
+  int64_t offsetRemainder = 0;
+  if (alignedReadNeeded_) {
+    offsetRemainder = pos % kDiskBlockSize;
+  }
+  const int64_t logicalRead = std::min<int64_t>(
+      slot.capacity - offsetRemainder, size_ - bytesQueued_);
+  int64_t physicalRead = logicalRead;
+  if (alignedReadNeeded_) {
+    physicalRead = ((logicalRead + offsetRemainder + kDiskBlockSize - 1) /
+                    kDiskBlockSize) *
+                   kDiskBlockSize;
+  }
+  const int64_t seekPos = pos - offsetRemainder;
+  if (!ioUring_->prepareRead(&slot.request, fd_, slot.data, physicalRead,
+                             seekPos)) {
+    return false;
+  }
+  slot.seekPos = seekPos;
+  slot.physicalSize = physicalRead;
+  slot.logicalSize = logicalRead;
+  slot.offsetRemainder = offsetRemainder;
+  bytesQueued_ += logicalRead;
+  return true;
+}
+
+char *FileByteSource::readAsync(int64_t &size) {
+  const size_t numSlots = asyncSlots_.size();
+  if (reuseReturnedSlot_) {
+    // the caller is done with the data of the previous read, the slot goes at
+    // the back of the pipeline
+    reuseReturnedSlot_ = false;
+    AsyncReadSlot &returnedSlot =
+        asyncSlots_[(nextAsyncSlot_ + numSlots - 1) % numSlots];
+    if (!prepareAsyncRead(returnedSlot) && bytesQueued_ < size_) {
+      WLOG(WARNING) << "io_uring submission queue full, switching to pread "
+                    << getIdentifier();
+      stopAsyncReads();
+      return readSync(size);
+    }
+    if (ioUring_->submit() < 0) {
+      stopAsyncReads();
+      return readSync(size);
+    }
+  }
+  AsyncReadSlot &slot = asyncSlots_[nextAsyncSlot_];
+  if (!slot.request.pending && slot.logicalSize == 0) {
+    WLOG(ERROR) << "No async read queued for " << getIdentifier()
+                << " bytesRead " << bytesRead_ << " bytesQueued "
+                << bytesQueued_;
+    stopAsyncReads();
+    return readSync(size);
+  }
+  {
+    PerfStatCollector statCollector(statsCtx(), PerfStatReport::FILE_READ,
+                                    DISK_READ);
+    ioUring_->wait(&slot.request);
+  }
+  const int64_t numRead = slot.request.result;
+  if (numRead < slot.offsetRemainder + slot.logicalSize) {
+    // error or short read, let the blocking path retry from the current
+    // position and report errors if any
+    WLOG(WARNING) << "Async read of " << getIdentifier() << " returned "
+                  << numRead << " expected "
+                  << (slot.offsetRemainder + slot.logicalSize) << " seekPos "
+                  << slot.seekPos << ", retrying with pread";
+    stopAsyncReads();
+    return readSync(size);
+  }
+  size = slot.logicalSize;
+  bytesRead_ += size;
+  slot.logicalSize = 0;
+  nextAsyncSlot_ = (nextAsyncSlot_ + 1) % numSlots;
+  reuseReturnedSlot_ = true;
+  WVLOG(1) << "Async size " << size << " need align " << alignedReadNeeded_
+           << " physicalRead " << slot.physicalSize << " offset " << offset_
+           << " seekPos " << slot.seekPos << " offsetRemainder "
+           << slot.offsetRemainder << " bytesRead " << bytesRead_;
+  return slot.data + slot.offsetRemainder;
+}
+
+void FileByteSource::stopAsyncReads() {
+  for (auto &slot : asyncSlots_) {
+    if (slot.request.pending && !ioUring_->wait(&slot.request)) {
+      WLOG(ERROR) << "Unable to wait for async read of " << getIdentifier();
+    }
+  }
+  asyncSlots_.clear();
+  nextAsyncSlot_ = 0;
+  reuseReturnedSlot_ = false;
+  bytesQueued_ = bytesRead_;
+  ioUring_ = nullptr;
+}
+
 void FileByteSource::clearPageCache() {
 #ifdef HAS_POSIX_FADVISE
   if (metadata_->directReads) {
@@ -171,7 +446,7 @@ void FileByteSource::clearPageCache() {
   }
   auto &options = threadCtx_->getOptions();
   if (bytesRead_ > 0 && !options.skip_fadvise) {
-    PerfStatCollector statCollector(*threadCtx_, PerfStatReport::FADVISE);
+    PerfStatCollector statCollector(statsCtx(), PerfStatReport::FADVISE);
     if (posix_fadvise(fd_, offset_, bytesRead_, POSIX_FADV_DONTNEED) != 0) {
       WPLOG(ERROR) << "posix_fadvise failed for " << getIdentifier() << " "
                    << offset_ << " " << bytesRead_;
@@ -181,14 +456,23 @@ void FileByteSource::clearPageCache() {
 }
 
 void FileByteSource::close() {
+  stopAsyncReads();
   clearPageCache();
   if (metadata_->fd >= 0) {
     // if the fd is not opened by this source, no need to close it
     WVLOG(1) << "No need to close " << getIdentifier()
              << ", this was not opened by FileByteSource";
   } else if (fd_ >= 0) {
-    PerfStatCollector statCollector(*threadCtx_, PerfStatReport::FILE_CLOSE);
-    ::close(fd_);
+    // on read errors, close() may be called by a read ahead thread, the fd
+    // cache is only used by the owner of the context
+    FdCache *fdCache =
+        (bytesRead_ == size_) ? threadCtx_->getFdCache() : nullptr;
+    if (fdCache != nullptr) {
+      fdCache->put(metadata_->seqId, fd_);
+    } else {
+      PerfStatCollector statCollector(statsCtx(), PerfStatReport::FILE_CLOSE);
+      ::close(fd_);
+    }
   }
   fd_ = -1;
   threadCtx_ = nullptr;
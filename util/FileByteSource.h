@@ -12,6 +12,9 @@
 
 #include <wdt/ByteSource.h>
 #include <wdt/util/CommonImpl.h>
+#include <wdt/util/IoUring.h>
+
+#include <vector>
 
 namespace facebook {
 namespace wdt {
@@ -30,6 +33,34 @@ class FileUtil {
    */
   static int openForRead(ThreadCtx &threadCtx, const std::string &filename,
                          bool isDirectReads);
+
+  /**
+   * Returns the physical location on disk of the start of the file, using
+   * FIEMAP
+   *
+   * @param fd      fd of the file
+   *
+   * @return        physical byte offset of the first extent, 0 if the file
+   *                has no extent, -1 if not supported by the system or the
+   *                filesystem
+   */
+  static int64_t getPhysicalOffset(int fd);
+
+  /**
+   * Finds the data extents of a sparse file using SEEK_DATA and SEEK_HOLE.
+   * The last bytes of the file are always part of the extents, even if they
+   * are in a hole, so that a receiver writing only the extents ends up with
+   * a file of the right size.
+   *
+   * @param fd          fd of the file
+   * @param fileSize    size of the file
+   * @param extents     set to the data extents, in increasing order
+   *
+   * @return            false if holes are not supported or the file has
+   *                    none, extents is empty in that case
+   */
+  static bool getDataExtents(int fd, int64_t fileSize,
+                             std::vector<Interval> &extents);
   // TODO: create a separate file for this class and move other file related
   // code here
 };
@@ -55,8 +86,8 @@ class FileByteSource : public ByteSource {
   }
 
   /// @return filepath
-  const std::string &getIdentifier() const override {
-    return metadata_->relPath;
+  std::string getIdentifier() const override {
+    return metadata_->getRelPath();
   }
 
   /// @return size of file in bytes
@@ -87,6 +118,20 @@ class FileByteSource : public ByteSource {
   /// @see ByteSource.h
   char *read(int64_t &size) override;
 
+  /// @see ByteSource.h
+  void setReadBuffer(const Buffer *buffer) override;
+
+  /// @see ByteSource.h
+  void setReadThreadCtx(ThreadCtx *threadCtx) override {
+    readThreadCtx_ = threadCtx;
+  }
+
+  /// @see ByteSource.h
+  int getZeroCopyFd() override;
+
+  /// @see ByteSource.h
+  void markRead(int64_t numBytes) override;
+
   /// @see ByteSource.h
   void advanceOffset(int64_t numBytes) override;
 
@@ -109,12 +154,71 @@ class FileByteSource : public ByteSource {
     transferStats_ += stats;
   }
 
+  /**
+   * Splits a source which is not being read in two. This source keeps the
+   * first size bytes, the remaining ones are returned as a new source.
+   *
+   * @param size    new size of this source, must be less than getSize()
+   *
+   * @return        source for the rest of the block
+   */
+  std::unique_ptr<FileByteSource> splitOff(int64_t size);
+
  private:
+  /// one chunk of the thread buffer used for asynchronous reads
+  struct AsyncReadSlot {
+    /// request tracked by the ring
+    IoRequest request;
+    /// start of the slot inside the thread buffer
+    char *data{nullptr};
+    /// size of the slot
+    int64_t capacity{0};
+    /// file position the read starts at
+    int64_t seekPos{0};
+    /// number of bytes asked to the kernel
+    int64_t physicalSize{0};
+    /// number of bytes of the block this slot contributes
+    int64_t logicalSize{0};
+    /// alignment padding at the start of the slot
+    int64_t offsetRemainder{0};
+  };
+
+  /// reads next chunk using a single blocking pread
+  char *readSync(int64_t &size);
+
+  /// reads next chunk from the asynchronous read pipeline
+  char *readAsync(int64_t &size);
+
+  /**
+   * Splits the thread buffer into slots and starts the first reads. Leaves
+   * asyncSlots_ empty if io_uring can not be used.
+   */
+  void setupAsyncReads();
+
+  /**
+   * queues a read of the next unread part of the block in the given slot
+   *
+   * @return    false if nothing was left to read or the ring is full
+   */
+  bool prepareAsyncRead(AsyncReadSlot &slot);
+
+  /// waits for all the reads in flight and disables async reads for the
+  /// rest of the block
+  void stopAsyncReads();
+
   /// clears page cache
   void clearPageCache();
 
+  /// @return   context the reads and close are accounted in
+  ThreadCtx &statsCtx() {
+    return readThreadCtx_ != nullptr ? *readThreadCtx_ : *threadCtx_;
+  }
+
   ThreadCtx *threadCtx_{nullptr};
 
+  /// context of the thread reading, nullptr if it is threadCtx_
+  ThreadCtx *readThreadCtx_{nullptr};
+
   /// shared file information
   SourceMetaData *metadata_;
 
@@ -135,6 +239,24 @@ class FileByteSource : public ByteSource {
 
   /// transfer stats
   TransferStats transferStats_;
+
+  /// buffer to read into, nullptr to use the thread buffer
+  const Buffer *readBuffer_{nullptr};
+
+  /// ring owned by the thread, nullptr if reads are blocking
+  IoUring *ioUring_{nullptr};
+
+  /// slots of the thread buffer used for reads in flight, in file order
+  std::vector<AsyncReadSlot> asyncSlots_;
+
+  /// index of the slot to be returned by the next read
+  size_t nextAsyncSlot_{0};
+
+  /// whether the slot returned by the previous read can be reused
+  bool reuseReturnedSlot_{false};
+
+  /// number of bytes of the block queued for reading so far
+  int64_t bytesQueued_{0};
 };
 }
 }
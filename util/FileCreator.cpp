@@ -12,13 +12,542 @@
 #include <fcntl.h>
 #include <folly/Conv.h>
 #include <string.h>
+#include <sys/ioctl.h>
 #include <sys/stat.h>
+#include <sys/statvfs.h>
 #include <sys/types.h>
+#include <unistd.h>
+#ifdef __linux__
+#include <linux/fs.h>
+#include <sys/syscall.h>
+#endif
+#include <algorithm>
+#include <chrono>
 
 namespace facebook {
 namespace wdt {
 
-bool FileCreator::setFileSize(ThreadCtx &threadCtx, int fd, int64_t fileSize) {
+/// buffer used to copy duplicates without copy_file_range
+static const int64_t kCopyBufferSize = 1024 * 1024;
+
+FileCreator::~FileCreator() {
+  {
+    std::lock_guard<std::mutex> lock(prepareMutex_);
+    stopPreparing_ = true;
+    toPrepare_.clear();
+  }
+  prepareCond_.notify_all();
+  for (std::thread &prepareThread : prepareThreads_) {
+    prepareThread.join();
+  }
+  {
+    std::lock_guard<std::mutex> lock(duplicatesMutex_);
+    toCopy_.clear();
+  }
+  if (duplicatesThread_.joinable()) {
+    duplicatesThread_.join();
+  }
+  {
+    std::lock_guard<std::mutex> lock(allocatorMutex_);
+    stopAllocator_ = true;
+  }
+  allocatorCond_.notify_all();
+  if (allocatorThread_.joinable()) {
+    allocatorThread_.join();
+  }
+  resetDirCache();
+  if (rootFd_ >= 0) {
+    ::close(rootFd_);
+  }
+  delete[] threadConditionVariables_;
+}
+
+void FileCreator::openRootDir() {
+  rootFd_ = ::open(rootDir_.c_str(), O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+  if (rootFd_ < 0) {
+    WPLOG(WARNING) << "Unable to open " << rootDir_
+                   << ", creating files using full paths";
+  }
+}
+
+void FileCreator::resetDirCache() {
+  for (auto &shard : dirCache_) {
+    std::lock_guard<std::mutex> lock(shard.mutex);
+    for (const auto &entry : shard.dirFds) {
+      if (entry.second >= 0) {
+        ::close(entry.second);
+      }
+    }
+    for (int fd : shard.replacedFds) {
+      ::close(fd);
+    }
+    shard.dirFds.clear();
+    shard.replacedFds.clear();
+    shard.dirDevices.clear();
+  }
+  numCachedDirFds_ = 0;
+}
+
+FileCreator::DirCacheShard &FileCreator::getDirCacheShard(
+    const std::string &dir) {
+  return dirCache_[std::hash<std::string>()(dir) % kNumDirCacheShards];
+}
+
+bool FileCreator::lookupDir(const std::string &dir, int &dirFd) {
+  DirCacheShard &shard = getDirCacheShard(dir);
+  std::lock_guard<std::mutex> lock(shard.mutex);
+  auto it = shard.dirFds.find(dir);
+  if (it == shard.dirFds.end()) {
+    dirFd = -1;
+    return false;
+  }
+  dirFd = it->second;
+  return true;
+}
+
+void FileCreator::addCreatedDir(const std::string &dir, int dirFd) {
+  DirCacheShard &shard = getDirCacheShard(dir);
+  std::lock_guard<std::mutex> lock(shard.mutex);
+  auto it = shard.dirFds.find(dir);
+  if (it == shard.dirFds.end()) {
+    shard.dirFds.emplace(dir, dirFd);
+    return;
+  }
+  // created again, other threads may still be using the previous fd
+  if (it->second >= 0) {
+    shard.replacedFds.push_back(it->second);
+  }
+  it->second = dirFd;
+}
+
+int64_t FileCreator::getDeviceId(const std::string &relPath, int fd) {
+  const size_t slash = relPath.rfind('/');
+  const std::string dir =
+      (slash == std::string::npos) ? std::string() : relPath.substr(0, slash);
+  DirCacheShard &shard = getDirCacheShard(dir);
+  {
+    std::lock_guard<std::mutex> lock(shard.mutex);
+    auto it = shard.dirDevices.find(dir);
+    if (it != shard.dirDevices.end()) {
+      return it->second;
+    }
+  }
+  struct stat fileStat;
+  if (fstat(fd, &fileStat) != 0) {
+    WPLOG(ERROR) << "fstat() failed for " << relPath;
+    return -1;
+  }
+  std::lock_guard<std::mutex> lock(shard.mutex);
+  shard.dirDevices.emplace(dir, fileStat.st_dev);
+  return fileStat.st_dev;
+}
+
+int FileCreator::openRelative(const std::string &relPath, int flags) {
+  const size_t slash = relPath.rfind('/');
+  int dirFd = rootFd_;
+  if (slash != std::string::npos) {
+    lookupDir(relPath.substr(0, slash + 1), dirFd);
+  }
+  if (dirFd < 0) {
+    return ::open(getFullPath(relPath).c_str(), flags, 0644);
+  }
+  const char *name =
+      relPath.c_str() + (slash == std::string::npos ? 0 : slash + 1);
+  return ::openat(dirFd, name, flags, 0644);
+}
+
+bool FileCreator::allocateInBackground(int fd, int64_t fileSize) {
+#ifdef HAS_FALLOCATE
+  // writes can start as soon as the file has its final size. Allocating the
+  // space of an extended file does not change its data
+  if (ftruncate(fd, fileSize) != 0) {
+    WPLOG(ERROR) << "ftruncate() failed for " << fd << " " << fileSize;
+    return false;
+  }
+  const int allocationFd = dup(fd);
+  if (allocationFd < 0) {
+    WPLOG(WARNING) << "dup() failed for " << fd;
+    return false;
+  }
+  {
+    std::lock_guard<std::mutex> lock(allocatorMutex_);
+    if (!allocatorThread_.joinable()) {
+      allocatorThread_ = std::thread(&FileCreator::allocateLoop, this);
+    }
+    toAllocate_.emplace_back(allocationFd, fileSize);
+  }
+  allocatorCond_.notify_one();
+  return true;
+#else
+  return false;
+#endif
+}
+
+void FileCreator::allocateLoop() {
+  std::unique_lock<std::mutex> lock(allocatorMutex_);
+  while (true) {
+    allocatorCond_.wait(
+        lock, [this] { return stopAllocator_ || !toAllocate_.empty(); });
+    if (toAllocate_.empty()) {
+      return;
+    }
+    const std::pair<int, int64_t> file = toAllocate_.front();
+    toAllocate_.pop_front();
+    const bool stopping = stopAllocator_;
+    lock.unlock();
+#ifdef HAS_FALLOCATE
+    // unlike posix_fallocate, fallocate never emulates the allocation by
+    // writing, which would race with the writes of the receiver threads
+    if (!stopping && fallocate(file.first, 0, 0, file.second) != 0) {
+      WPLOG(WARNING) << "Background fallocate() failed for fd " << file.first
+                     << " size " << file.second;
+    }
+#endif
+    ::close(file.first);
+    lock.lock();
+  }
+}
+
+void FileCreator::prepareFiles(const WdtOptions &options,
+                               std::vector<BlockDetails> &files) {
+  if (numPrepareThreads_ == 0) {
+    return;
+  }
+  {
+    std::lock_guard<std::mutex> lock(prepareMutex_);
+    if (stopPreparing_) {
+      return;
+    }
+    prepareOptions_ = &options;
+    for (BlockDetails &file : files) {
+      // nothing to create for the others
+      if (file.allocationStatus == NOT_EXISTS ||
+          file.allocationStatus == EXISTS_TOO_LARGE ||
+          file.allocationStatus == EXISTS_TOO_SMALL) {
+        toPrepare_.emplace_back(std::move(file));
+      }
+    }
+    while ((int)prepareThreads_.size() < numPrepareThreads_) {
+      prepareThreads_.emplace_back(&FileCreator::prepareLoop, this,
+                                   numThreads_ + (int)prepareThreads_.size());
+    }
+  }
+  prepareCond_.notify_all();
+}
+
+void FileCreator::prepareLoop(int threadIndex) {
+  std::unique_ptr<ThreadCtx> threadCtx;
+  std::vector<BlockDetails> batch;
+  std::unique_lock<std::mutex> lock(prepareMutex_);
+  while (true) {
+    prepareCond_.wait(
+        lock, [this] { return stopPreparing_ || !toPrepare_.empty(); });
+    if (stopPreparing_) {
+      return;
+    }
+    if (!threadCtx) {
+      threadCtx = std::make_unique<ThreadCtx>(
+          *prepareOptions_, /* do not allocate buffer */ false, threadIndex);
+    }
+    // consecutive files allocated back to back by one thread get adjacent
+    // extents, instead of being interleaved with the ones of other threads
+    const int64_t batchBytes =
+        prepareOptions_->manifest_prepare_batch_mb * kMbToB;
+    int64_t numBytes = 0;
+    do {
+      numBytes += toPrepare_.front().fileSize;
+      batch.emplace_back(std::move(toPrepare_.front()));
+      toPrepare_.pop_front();
+    } while (!toPrepare_.empty() && numBytes < batchBytes);
+    numPreparing_ += batch.size();
+    lock.unlock();
+    int64_t numPrepared = 0;
+    for (const BlockDetails &file : batch) {
+      if (prepareFile(*threadCtx, file)) {
+        numPrepared++;
+      }
+    }
+    lock.lock();
+    numPrepared_ += numPrepared;
+    numPreparing_ -= batch.size();
+    batch.clear();
+    if (numPreparing_ == 0 && toPrepare_.empty()) {
+      prepareCond_.notify_all();
+    }
+  }
+}
+
+bool FileCreator::prepareFile(ThreadCtx &threadCtx, const BlockDetails &file) {
+  {
+    folly::SpinLockGuard guard(lock_);
+    if (fileStatusMap_.find(file.seqId) != fileStatusMap_.end()) {
+      // already opened by a receiver thread
+      return false;
+    }
+    fileStatusMap_.insert(
+        std::make_pair(file.seqId, threadCtx.getThreadIndex()));
+  }
+  const int fd = openForFirstBlock(threadCtx, &file);
+  if (fd < 0) {
+    WLOG(ERROR) << "Unable to prepare " << file.fileName;
+    return false;
+  }
+  WVLOG(1) << "Prepared " << file.fileName << " seq-id " << file.seqId;
+  ::close(fd);
+  return true;
+}
+
+ErrorCode FileCreator::checkFreeSpace(const WdtOptions &options,
+                                      int64_t totalBytes) {
+  std::lock_guard<std::mutex> lock(freeSpaceMutex_);
+  if (freeSpaceStatus_ != OK || skipWrites_ ||
+      totalBytes <= checkedTotalBytes_) {
+    return freeSpaceStatus_;
+  }
+  checkedTotalBytes_ = totalBytes;
+  struct statvfs fsStat;
+  if (statvfs(rootDir_.c_str(), &fsStat) != 0) {
+    WPLOG(WARNING) << "statvfs() failed for " << rootDir_
+                   << ", free space not checked";
+    return freeSpaceStatus_;
+  }
+  const int64_t freeBytes = (int64_t)fsStat.f_bavail * fsStat.f_frsize;
+  // files already allocated or written in the session are part of the total
+  const int64_t neededBytes =
+      std::max<int64_t>(0, totalBytes - allocatedBytes_.load()) +
+      options.free_space_margin_mb * kMbToB;
+  if (neededBytes > freeBytes) {
+    WLOG(ERROR) << "Not enough space in " << rootDir_ << " for the transfer, "
+                << neededBytes << " bytes needed, " << freeBytes << " free";
+    freeSpaceStatus_ = NO_SPACE;
+  } else {
+    WVLOG(1) << "Free space check passed, " << neededBytes
+             << " bytes needed, " << freeBytes << " free";
+  }
+  return freeSpaceStatus_;
+}
+
+void FileCreator::addWrittenBytes(const WdtOptions &options,
+                                  const BlockDetails &blockDetails,
+                                  int64_t bytes) {
+  const bool allocated =
+      !blockDetails.sparseFile && options.shouldPreallocateFiles();
+  if (allocated || bytes <= 0 ||
+      blockDetails.allocationStatus == EXISTS_CORRECT_SIZE) {
+    return;
+  }
+  allocatedBytes_ += bytes;
+}
+
+void FileCreator::clearAllocationMap() {
+  {
+    // the files being prepared are in the map
+    std::unique_lock<std::mutex> lock(prepareMutex_);
+    toPrepare_.clear();
+    prepareCond_.wait(lock, [this] { return numPreparing_ == 0; });
+    if (numPrepared_ > 0) {
+      WLOG(INFO) << "Prepared " << numPrepared_
+                 << " files ahead of their data";
+    }
+    numPrepared_ = 0;
+  }
+  {
+    // duplicates left come from a failed session
+    std::unique_lock<std::mutex> lock(duplicatesMutex_);
+    toCopy_.clear();
+    duplicatesCond_.wait(lock, [this] { return !copyingDuplicates_; });
+    if (numCopied_ > 0) {
+      WLOG(INFO) << "Copied " << numCopied_ << " duplicate files";
+    }
+    numCopied_ = 0;
+    receivedFiles_.clear();
+    failedDuplicates_ = false;
+  }
+  {
+    std::lock_guard<std::mutex> lock(freeSpaceMutex_);
+    checkedTotalBytes_ = 0;
+    freeSpaceStatus_ = OK;
+    allocatedBytes_ = 0;
+  }
+  folly::SpinLockGuard guard(lock_);
+  fileStatusMap_.clear();
+}
+
+void FileCreator::addReceivedFile(int64_t seqId, const std::string &fileName) {
+  std::lock_guard<std::mutex> lock(duplicatesMutex_);
+  receivedFiles_.emplace(seqId, fileName);
+}
+
+void FileCreator::addDuplicate(const BlockDetails &duplicate) {
+  std::lock_guard<std::mutex> lock(duplicatesMutex_);
+  toCopy_.emplace(duplicate.seqId, duplicate);
+}
+
+bool FileCreator::copyDuplicates(const WdtOptions &options,
+                                 int timeoutMillis) {
+  std::unique_lock<std::mutex> lock(duplicatesMutex_);
+  if (!toCopy_.empty() && !copyingDuplicates_) {
+    if (duplicatesThread_.joinable()) {
+      // done with its loop, does not need the lock anymore
+      duplicatesThread_.join();
+    }
+    copyOptions_ = &options;
+    copyingDuplicates_ = true;
+    duplicatesThread_ = std::thread(&FileCreator::copyDuplicatesLoop, this);
+  }
+  return duplicatesCond_.wait_for(lock,
+                                  std::chrono::milliseconds(timeoutMillis),
+                                  [this] { return !copyingDuplicates_; });
+}
+
+bool FileCreator::hasFailedDuplicates() {
+  std::lock_guard<std::mutex> lock(duplicatesMutex_);
+  return failedDuplicates_;
+}
+
+void FileCreator::copyDuplicatesLoop() {
+  std::unique_ptr<ThreadCtx> threadCtx;
+  std::unique_lock<std::mutex> lock(duplicatesMutex_);
+  while (!toCopy_.empty()) {
+    if (!threadCtx) {
+      threadCtx = std::make_unique<ThreadCtx>(
+          *copyOptions_, /* do not allocate buffer */ false,
+          numThreads_ + numPrepareThreads_);
+    }
+    const BlockDetails duplicate = std::move(toCopy_.begin()->second);
+    toCopy_.erase(toCopy_.begin());
+    auto it = receivedFiles_.find(duplicate.duplicateOfSeqId);
+    if (it == receivedFiles_.end()) {
+      WLOG(ERROR) << "Original " << duplicate.duplicateOfSeqId << " of "
+                  << duplicate.fileName << " not received";
+      failedDuplicates_ = true;
+      continue;
+    }
+    const std::string originalName = it->second;
+    lock.unlock();
+    const bool copied = copyDuplicate(*threadCtx, duplicate, originalName);
+    lock.lock();
+    if (copied) {
+      numCopied_++;
+      if (duplicateCopiedCallback_) {
+        duplicateCopiedCallback_(duplicate);
+      }
+    } else {
+      failedDuplicates_ = true;
+    }
+  }
+  copyingDuplicates_ = false;
+  duplicatesCond_.notify_all();
+}
+
+bool FileCreator::copyDuplicate(ThreadCtx &threadCtx,
+                                const BlockDetails &duplicate,
+                                const std::string &originalName) {
+  if (skipWrites_) {
+    return true;
+  }
+  const int srcFd = openRelative(originalName, O_RDONLY | O_CLOEXEC);
+  if (srcFd < 0) {
+    WPLOG(ERROR) << "Unable to open " << originalName << " to copy it to "
+                 << duplicate.fileName;
+    return false;
+  }
+  struct stat srcStat;
+  if (fstat(srcFd, &srcStat) != 0 || srcStat.st_size != duplicate.fileSize) {
+    WLOG(ERROR) << "Original " << originalName << " of " << duplicate.fileName
+                << " does not have the size " << duplicate.fileSize;
+    ::close(srcFd);
+    return false;
+  }
+  const int fd = createFile(threadCtx, duplicate.fileName);
+  if (fd < 0) {
+    ::close(srcFd);
+    return false;
+  }
+  bool success = copyFileData(srcFd, fd, duplicate.fileSize);
+  if (!success) {
+    WPLOG(ERROR) << "Unable to copy " << originalName << " to "
+                 << duplicate.fileName;
+  } else if (threadCtx.getOptions().fsync && ::fsync(fd) != 0) {
+    WPLOG(ERROR) << "fsync() failed for " << duplicate.fileName;
+    success = false;
+  }
+  ::close(srcFd);
+  if (::close(fd) != 0) {
+    WPLOG(ERROR) << "close() failed for " << duplicate.fileName;
+    success = false;
+  }
+  if (success && threadCtx.getOptions().isLogBasedResumption()) {
+    transferLogManager_.addFileCreationEntry(
+        duplicate.fileName, duplicate.seqId, duplicate.fileSize);
+    transferLogManager_.addBlockWriteEntry(duplicate.seqId, 0,
+                                           duplicate.fileSize);
+  }
+  WVLOG(1) << "Copied " << originalName << " to " << duplicate.fileName << " "
+           << success;
+  return success;
+}
+
+bool FileCreator::copyFileData(int srcFd, int destFd, int64_t size) {
+#ifdef FICLONE
+  if (ioctl(destFd, FICLONE, srcFd) == 0) {
+    return true;
+  }
+#endif
+  return copyFileRange(srcFd, destFd, 0, size);
+}
+
+bool FileCreator::copyFileRange(int srcFd, int destFd, int64_t offset,
+                                int64_t size) {
+#ifdef FICLONERANGE
+  struct file_clone_range cloneRange;
+  cloneRange.src_fd = srcFd;
+  cloneRange.src_offset = offset;
+  cloneRange.src_length = size;
+  cloneRange.dest_offset = offset;
+  // ranges not aligned to the filesystem blocks are copied below
+  if (size > 0 && ioctl(destFd, FICLONERANGE, &cloneRange) == 0) {
+    return true;
+  }
+#endif
+  int64_t copied = 0;
+#if defined(__linux__) && defined(__NR_copy_file_range)
+  while (copied < size) {
+    loff_t srcOffset = offset + copied;
+    loff_t destOffset = offset + copied;
+    const ssize_t numCopied =
+        syscall(__NR_copy_file_range, srcFd, &srcOffset, destFd, &destOffset,
+                size - copied, 0);
+    if (numCopied <= 0) {
+      // not supported across these filesystems, copied below
+      break;
+    }
+    copied += numCopied;
+  }
+#endif
+  std::vector<char> buf(std::min<int64_t>(size - copied, kCopyBufferSize));
+  while (copied < size) {
+    const int64_t pos = offset + copied;
+    const ssize_t numRead = ::pread(
+        srcFd, buf.data(), std::min<int64_t>(buf.size(), size - copied), pos);
+    if (numRead <= 0) {
+      return false;
+    }
+    for (ssize_t written = 0; written < numRead;) {
+      const ssize_t numWritten = ::pwrite(destFd, buf.data() + written,
+                                          numRead - written, pos + written);
+      if (numWritten <= 0) {
+        return false;
+      }
+      written += numWritten;
+    }
+    copied += numRead;
+  }
+  return true;
+}
+
+bool FileCreator::setFileSize(ThreadCtx &threadCtx, int fd, int64_t fileSize,
+                              bool sparseFile) {
   struct stat fileStat;
   if (fstat(fd, &fileStat) != 0) {
     WPLOG(ERROR) << "fstat() failed for " << fd;
@@ -26,8 +555,11 @@ bool FileCreator::setFileSize(ThreadCtx &threadCtx, int fd, int64_t fileSize) {
   }
   if (fileStat.st_size > fileSize) {
     // existing file is larger than required
+    // old data must not show through the holes of a sparse file
     int64_t sizeToTruncate =
-        (threadCtx.getOptions().shouldPreallocateFiles() ? fileSize : 0);
+        (threadCtx.getOptions().shouldPreallocateFiles() && !sparseFile
+             ? fileSize
+             : 0);
     if (ftruncate(fd, sizeToTruncate) != 0) {
       WPLOG(ERROR) << "ftruncate() failed for " << fd << " " << sizeToTruncate;
       return false;
@@ -36,16 +568,33 @@ bool FileCreator::setFileSize(ThreadCtx &threadCtx, int fd, int64_t fileSize) {
   if (fileSize == 0) {
     return true;
   }
+  if (sparseFile) {
+    // holes are never written, extending the file creates them
+    if (ftruncate(fd, fileSize) != 0) {
+      WPLOG(ERROR) << "ftruncate() failed for " << fd << " " << fileSize;
+      return false;
+    }
+    return true;
+  }
   if (!threadCtx.getOptions().shouldPreallocateFiles()) {
     // pre-allocation is disabled
     return true;
   }
+  // blocks the file already had were used before the session
+  const int64_t newBytes =
+      std::max<int64_t>(0, fileSize - (int64_t)fileStat.st_blocks * 512);
+  if (threadCtx.getOptions().background_allocation &&
+      allocateInBackground(fd, fileSize)) {
+    allocatedBytes_ += newBytes;
+    return true;
+  }
 #ifdef HAS_POSIX_FALLOCATE
   int status = posix_fallocate(fd, 0, fileSize);
   if (status != 0) {
     WLOG(ERROR) << "fallocate() failed " << strerrorStr(status);
     return false;
   }
+  allocatedBytes_ += newBytes;
   return true;
 #else
   WDT_CHECK(false) << "Should never reach here";
@@ -68,7 +617,8 @@ int FileCreator::openAndSetSize(ThreadCtx &threadCtx,
   if (blockDetails->allocationStatus == EXISTS_CORRECT_SIZE) {
     return fd;
   }
-  if (!setFileSize(threadCtx, fd, blockDetails->fileSize)) {
+  if (!setFileSize(threadCtx, fd, blockDetails->fileSize,
+                   blockDetails->sparseFile)) {
     close(fd);
     return -1;
   }
@@ -133,6 +683,10 @@ int FileCreator::openForBlocks(ThreadCtx &threadCtx,
       PerfStatCollector statCollector(threadCtx, PerfStatReport::UNLINK);
       status = ::unlink(path.c_str());
     }
+    FdCache *fdCache = threadCtx.getFdCache();
+    if (fdCache != nullptr) {
+      fdCache->erase(blockDetails->seqId);
+    }
     if (status != 0) {
       WPLOG(ERROR) << "Failed to delete file " << path;
     } else {
@@ -140,6 +694,16 @@ int FileCreator::openForBlocks(ThreadCtx &threadCtx,
     }
     return -1;
   }
+  FdCache *fdCache = threadCtx.getFdCache();
+  if (fdCache != nullptr) {
+    // the file was already allocated when this thread opened it
+    const int fd = fdCache->take(blockDetails->seqId);
+    if (fd >= 0) {
+      WVLOG(1) << "Reusing cached fd " << fd << " for "
+               << blockDetails->fileName;
+      return fd;
+    }
+  }
   lock_.lock();
   auto it = fileStatusMap_.find(blockDetails->seqId);
   if (blockDetails->allocationStatus == EXISTS_CORRECT_SIZE &&
@@ -187,7 +751,7 @@ int FileCreator::openExistingFile(ThreadCtx &threadCtx,
   int res;
   {
     PerfStatCollector statCollector(threadCtx, PerfStatReport::FILE_OPEN);
-    res = open(path.c_str(), openFlags, 0644);
+    res = openRelative(relPathStr, openFlags);
   }
   if (res < 0) {
     WPLOG(ERROR) << "failed opening file " << path;
@@ -254,8 +818,9 @@ int FileCreator::createFile(ThreadCtx &threadCtx, const string &relPathStr) {
   }
   int res;
   {
-    PerfStatCollector statCollector(threadCtx, PerfStatReport::FILE_OPEN);
-    res = open(path.c_str(), openFlags, 0644);
+    PerfStatCollector statCollector(threadCtx, PerfStatReport::FILE_OPEN,
+                                    FILE_CREATE);
+    res = openRelative(relPathStr, openFlags);
   }
   if (res < 0) {
     if (dir.empty()) {
@@ -275,8 +840,9 @@ int FileCreator::createFile(ThreadCtx &threadCtx, const string &relPathStr) {
       return -1;
     }
     {
-      PerfStatCollector statCollector(threadCtx, PerfStatReport::FILE_OPEN);
-      res = open(path.c_str(), openFlags, 0644);
+      PerfStatCollector statCollector(threadCtx, PerfStatReport::FILE_OPEN,
+                                      FILE_CREATE);
+      res = openRelative(relPathStr, openFlags);
     }
     if (res < 0) {
       WPLOG(ERROR) << "failed creating file " << path;
@@ -304,14 +870,22 @@ bool FileCreator::createDirRecursively(const std::string dir, bool force) {
     lastIndex--;
   }
 
+  int parentFd = rootFd_;
   if (lastIndex > 0) {
-    if (!createDirRecursively(dir.substr(0, lastIndex), force)) {
+    const std::string parentDir = dir.substr(0, lastIndex);
+    if (!createDirRecursively(parentDir, force)) {
       return false;
     }
+    lookupDir(parentDir, parentFd);
   }
 
   std::string fullDirPath = getFullPath(dir);
-  int code = mkdir(fullDirPath.c_str(), S_IRWXU | S_IRWXG | S_IROTH | S_IXOTH);
+  // name of the directory in its parent, without the trailing slash
+  const std::string dirName = dir.substr(lastIndex, dir.size() - 1 - lastIndex);
+  const mode_t mode = S_IRWXU | S_IRWXG | S_IROTH | S_IXOTH;
+  const bool useParentFd = (parentFd >= 0 && !dirName.empty());
+  int code = useParentFd ? mkdirat(parentFd, dirName.c_str(), mode)
+                         : mkdir(fullDirPath.c_str(), mode);
   if (code != 0 && errno != EEXIST && errno != EISDIR) {
     WPLOG(ERROR) << "failed to make directory " << fullDirPath;
     return false;
@@ -320,10 +894,16 @@ bool FileCreator::createDirRecursively(const std::string dir, bool force) {
   } else {
     WLOG(INFO) << "made dir " << fullDirPath;
   }
-  {
-    std::lock_guard<std::mutex> lock(mutex_);
-    createdDirs_.insert(dir);
+  int dirFd = -1;
+  if (numCachedDirFds_.fetch_add(1) < kMaxCachedDirFds) {
+    const int flags = O_RDONLY | O_DIRECTORY | O_CLOEXEC;
+    dirFd = useParentFd ? openat(parentFd, dirName.c_str(), flags)
+                        : ::open(fullDirPath.c_str(), flags);
+  }
+  if (dirFd < 0) {
+    numCachedDirFds_--;
   }
+  addCreatedDir(dir, dirFd);
 
   return true;
 }
@@ -15,11 +15,18 @@
 
 #include <folly/SpinLock.h>
 #include <glog/logging.h>
+#include <array>
+#include <atomic>
 #include <condition_variable>
+#include <deque>
+#include <functional>
 #include <map>
 #include <mutex>
 #include <string>
-#include <unordered_set>
+#include <thread>
+#include <unordered_map>
+#include <utility>
+#include <vector>
 
 namespace facebook {
 namespace wdt {
@@ -36,9 +43,21 @@ namespace wdt {
  */
 class FileCreator {
  public:
+  /**
+   * @param rootDir             directory the files are created in
+   * @param numThreads          number of receiver threads
+   * @param transferLogManager  log of the transfer
+   * @param skipWrites          whether files must not be created
+   * @param numPrepareThreads   number of threads preparing the files of
+   *                            prepareFiles, 0 to ignore it
+   */
   FileCreator(const std::string &rootDir, int numThreads,
-              TransferLogManager &transferLogManager, bool skipWrites)
-      : transferLogManager_(transferLogManager), skipWrites_(skipWrites) {
+              TransferLogManager &transferLogManager, bool skipWrites,
+              int numPrepareThreads = 0)
+      : transferLogManager_(transferLogManager),
+        skipWrites_(skipWrites),
+        numThreads_(numThreads),
+        numPrepareThreads_(skipWrites ? 0 : numPrepareThreads) {
     CHECK(!rootDir.empty());
 
     // For creating root directory, we are using createDirRecursively.
@@ -50,12 +69,13 @@ class FileCreator {
     createDirRecursively(rootDirPath, false);
     resetDirCache();
     rootDir_ = rootDirPath;
-    threadConditionVariables_ = new std::condition_variable[numThreads];
+    openRootDir();
+    // preparing threads wait and notify like the receiver threads
+    threadConditionVariables_ =
+        new std::condition_variable[numThreads + numPrepareThreads_];
   }
 
-  virtual ~FileCreator() {
-    delete[] threadConditionVariables_;
-  }
+  virtual ~FileCreator();
 
   /**
    * This is used to open the file in block mode. If the current thread is the
@@ -70,18 +90,111 @@ class FileCreator {
    */
   int openForBlocks(ThreadCtx &threadCtx, BlockDetails const *blockDetails);
 
-  /// reset internal directory cache
-  void resetDirCache() {
-    std::lock_guard<std::mutex> lock(mutex_);
-    createdDirs_.clear();
-  }
+  /// reset internal directory cache, must not be called while files are
+  /// being created
+  void resetDirCache();
+
+  /**
+   * Looks up the device of a file, only stat'ing the first file of each
+   * directory since mount points are directories
+   *
+   * @param relPath   path of the file relative to the root
+   * @param fd        fd of the file
+   *
+   * @return          device of the file, -1 on error (logged)
+   */
+  int64_t getDeviceId(const std::string &relPath, int fd);
+
+  /**
+   * Queues files announced by the sender to be created and allocated by the
+   * preparing threads. A file is skipped if a receiver thread already started
+   * to open it, else the receiver threads wait for its preparation like for
+   * the allocation by another receiver thread.
+   *
+   * @param options   options of the receiver, must outlive the preparation
+   * @param files     files, only with the fields of a manifest; moved from
+   */
+  void prepareFiles(const WdtOptions &options,
+                    std::vector<BlockDetails> &files);
+
+  /**
+   * Checks that the filesystem of the root directory has room for the bytes
+   * announced by the sender, minus the space already allocated or written for
+   * the files of the session, so that a transfer which can't fit fails before
+   * its data flows instead of hitting ENOSPC midway. Checked again whenever
+   * the total grows, as a sender still discovering its files announces a
+   * partial total first
+   *
+   * @param options     options of the receiver
+   * @param totalBytes  total bytes of the transfer, from the size cmd
+   *
+   * @return            NO_SPACE if they don't fit, OK otherwise, also when
+   *                    the free space can't be read
+   */
+  ErrorCode checkFreeSpace(const WdtOptions &options, int64_t totalBytes);
 
-  /// clears allocation status map, called after end of each session
-  void clearAllocationMap() {
-    folly::SpinLockGuard guard(lock_);
-    fileStatusMap_.clear();
+  /**
+   * Credits the bytes written for a block to the space used by the session,
+   * unless its file was allocated up front, which is credited already
+   *
+   * @param options       options of the receiver
+   * @param blockDetails  block written
+   * @param bytes         bytes written for the block
+   */
+  void addWrittenBytes(const WdtOptions &options,
+                       const BlockDetails &blockDetails, int64_t bytes);
+
+  /// clears allocation status map, called after end of each session. Files
+  /// not prepared yet are dropped, and so are the duplicates not copied
+  void clearAllocationMap();
+
+  /// records the name of a file received, duplicates name it by its seq-id
+  void addReceivedFile(int64_t seqId, const std::string &fileName);
+
+  /**
+   * Queues a file received as a duplicate of another file of the transfer,
+   * copied by copyDuplicates()
+   *
+   * @param duplicate   header of the duplicate, with the seq-id of the
+   *                    original
+   */
+  void addDuplicate(const BlockDetails &duplicate);
+
+  /**
+   * Copies the duplicates queued from their originals, meant to be called
+   * once every block of the transfer is received. The copy is a reflink
+   * where the filesystem supports it. The copies are made by a background
+   * thread, several receiver threads can wait for them
+   *
+   * @param options         options of the receiver, must outlive the copies
+   * @param timeoutMillis   max time to wait
+   *
+   * @return                false on timeout
+   */
+  bool copyDuplicates(const WdtOptions &options, int timeoutMillis);
+
+  /// @return   whether a duplicate could not be copied in this session
+  bool hasFailedDuplicates();
+
+  /**
+   * Sets a function called with each duplicate once copied, by the copying
+   * thread. Must be set before the transfer starts
+   */
+  void setDuplicateCopiedCallback(
+      std::function<void(const BlockDetails &)> duplicateCopiedCallback) {
+    duplicateCopiedCallback_ = std::move(duplicateCopiedCallback);
   }
 
+  /**
+   * Copies size bytes at offset of a file to the same offset of another,
+   * reflinking them if the filesystem allows it, else with copy_file_range or
+   * reads and writes
+   *
+   * @return  whether all the bytes were copied
+   */
+  static bool copyFileRange(int srcFd, int destFd, int64_t offset,
+                            int64_t size);
+
  private:
   /**
    * Opens the file and sets its size. If the existing file size is greater than
@@ -116,15 +229,63 @@ class FileCreator {
 
   /**
    * sets the size of the file. If the size is greater then the
-   * file is truncated using ftruncate. Space is allocated using fallocate.
+   * file is truncated using ftruncate. Space is allocated using fallocate,
+   * except for sparse files which are only extended to keep their holes.
+   *
+   * @param threadCtx   context of the calling thread
+   * @param fd          file descriptor
+   * @param fileSize    size of the file
+   * @param sparseFile  whether only the data of the file is sent
+   *
+   * @return            true for success, false otherwise
+   */
+  bool setFileSize(ThreadCtx &threadCtx, int fd, int64_t fileSize,
+                   bool sparseFile);
+
+  /**
+   * Extends the file to its size and queues the allocation of its space to
+   * the allocator thread, so that the caller can start writing right away.
+   *
+   * @param fd          file descriptor, the queue uses a duplicate of it
+   * @param fileSize    size of the file
+   *
+   * @return            false if the file could not be extended or queued,
+   *                    it should then be allocated inline
+   */
+  bool allocateInBackground(int fd, int64_t fileSize);
+
+  /// main loop of the allocator thread
+  void allocateLoop();
+
+  /// main loop of a preparing thread
+  void prepareLoop(int threadIndex);
+
+  /// main loop of the thread copying the duplicates, till none is left
+  void copyDuplicatesLoop();
+
+  /**
+   * Creates a duplicate with the content of a file received
+   *
+   * @param threadCtx     context of the calling thread
+   * @param duplicate     header of the duplicate
+   * @param originalName  path of the original relative to root dir
    *
-   * @param threadCtx context of the calling thread
-   * @param fd        file descriptor
-   * @param fileSize  size of the file
+   * @return              whether the duplicate was created
+   */
+  bool copyDuplicate(ThreadCtx &threadCtx, const BlockDetails &duplicate,
+                     const std::string &originalName);
+
+  /**
+   * Copies size bytes of a file into an empty one, reflinking them if
+   * possible, else with copy_file_range or reads and writes
    *
-   * @return          true for success, false otherwise
+   * @return  whether all the bytes were copied
    */
-  bool setFileSize(ThreadCtx &threadCtx, int fd, int64_t fileSize);
+  static bool copyFileData(int srcFd, int destFd, int64_t size);
+
+  /// creates and allocates a file unless a receiver thread did
+  /// @return   whether the file was prepared by this call
+  bool prepareFile(ThreadCtx &threadCtx, const BlockDetails &file);
 
   /**
    * opens the file and sets it size. Called only for the first block to request
@@ -159,21 +320,68 @@ class FileCreator {
 
   /// Check whether directory has been created/is in cache
   bool dirCreated(const std::string &dir) {
-    std::lock_guard<std::mutex> lock(mutex_);
-    return createdDirs_.find(dir) != createdDirs_.end();
+    int dirFd;
+    return lookupDir(dir, dirFd);
   }
 
+  /**
+   * @param dir     directory relative to root, with a trailing /
+   * @param dirFd   set to the fd of the directory, -1 if not kept open
+   *
+   * @return        whether the directory is in the cache
+   */
+  bool lookupDir(const std::string &dir, int &dirFd);
+
+  /// adds a directory to the cache, with its fd or -1
+  void addCreatedDir(const std::string &dir, int dirFd);
+
+  /// opens rootFd_, directories and files are then created relative to it
+  void openRootDir();
+
+  /**
+   * Opens a file relative to the fd of its directory if cached, avoiding the
+   * walk of the full path, else using the full path
+   *
+   * @param relPath   path relative to root dir
+   * @param flags     open flags
+   *
+   * @return          fd or -1 on error
+   */
+  int openRelative(const std::string &relPath, int flags);
+
   /// returns full path of a file
   std::string getFullPath(const std::string &relPath);
 
   /// root directory
   std::string rootDir_;
 
-  /// directories created so far, relative to root
-  std::unordered_set<std::string> createdDirs_;
+  /// number of shards of the directory cache
+  static const int kNumDirCacheShards = 32;
+  /// max number of directory fds kept open by the cache
+  static const int kMaxCachedDirFds = 1024;
+
+  /// one shard of the cache of created directories
+  struct DirCacheShard {
+    /// directories relative to root, mapped to their fd or -1 if not kept open
+    std::unordered_map<std::string, int> dirFds;
+    /// fds of directories created again, closed with the cache
+    std::vector<int> replacedFds;
+    /// devices of the directories whose files were looked up
+    std::unordered_map<std::string, int64_t> dirDevices;
+    std::mutex mutex;
+  };
+
+  /// @return   shard of the cache a directory belongs to
+  DirCacheShard &getDirCacheShard(const std::string &dir);
+
+  /// directories created so far, sharded to avoid contention
+  std::array<DirCacheShard, kNumDirCacheShards> dirCache_;
+
+  /// number of directory fds opened by the cache
+  std::atomic<int> numCachedDirFds_{0};
 
-  /// protects createdDirs_
-  std::mutex mutex_;
+  /// fd of the root directory, -1 if it could not be opened
+  int rootFd_{-1};
 
   const int ALLOCATED{-1};
   const int FAILED{-2};
@@ -194,6 +402,71 @@ class FileCreator {
 
   // Set to prevent creating files
   bool skipWrites_;
+
+  /// files waiting for space allocation, as (duplicate fd, size)
+  std::deque<std::pair<int, int64_t>> toAllocate_;
+  /// set when the allocator thread must exit
+  bool stopAllocator_{false};
+  /// protects toAllocate_ and stopAllocator_
+  std::mutex allocatorMutex_;
+  /// notified when a file is queued for allocation
+  std::condition_variable allocatorCond_;
+  /// started on first use
+  std::thread allocatorThread_;
+
+  /// number of receiver threads, preparing threads come after them
+  const int numThreads_;
+  /// number of preparing threads
+  const int numPrepareThreads_;
+  /// options of the preparing threads, set by the first prepareFiles
+  const WdtOptions *prepareOptions_{nullptr};
+  /// files waiting to be prepared, in manifest order
+  std::deque<BlockDetails> toPrepare_;
+  /// number of files being prepared
+  int numPreparing_{0};
+  /// number of files prepared during the session, logged at its end
+  int64_t numPrepared_{0};
+  /// set when the preparing threads must exit
+  bool stopPreparing_{false};
+  /// protects the fields above
+  std::mutex prepareMutex_;
+  /// notified when files are queued for preparation, or when the last file
+  /// being prepared is done
+  std::condition_variable prepareCond_;
+  /// started on first use
+  std::vector<std::thread> prepareThreads_;
+
+  /// names of the files received in the session by seq-id, for duplicates
+  std::unordered_map<int64_t, std::string> receivedFiles_;
+  /// duplicates waiting to be copied by seq-id, a duplicate sent again is
+  /// only copied once
+  std::map<int64_t, BlockDetails> toCopy_;
+  /// options of the copying thread, set by copyDuplicates
+  const WdtOptions *copyOptions_{nullptr};
+  /// whether the copying thread is running its loop
+  bool copyingDuplicates_{false};
+  /// set when a duplicate could not be copied
+  bool failedDuplicates_{false};
+  /// called with each duplicate copied, can be empty
+  std::function<void(const BlockDetails &)> duplicateCopiedCallback_;
+  /// number of duplicates copied during the session, logged at its end
+  int64_t numCopied_{0};
+  /// protects the fields above
+  std::mutex duplicatesMutex_;
+  /// notified when the copying thread is done with its loop
+  std::condition_variable duplicatesCond_;
+  /// copies the duplicates, started again for each batch
+  std::thread duplicatesThread_;
+
+  /// space allocated or written for the files of the session, not counted as
+  /// used by the free space check
+  std::atomic<int64_t> allocatedBytes_{0};
+  /// largest total the free space was checked for in the session, and the
+  /// result
+  int64_t checkedTotalBytes_{0};
+  ErrorCode freeSpaceStatus_{OK};
+  /// protects the fields above
+  std::mutex freeSpaceMutex_;
 };
 }
 }
@@ -12,7 +12,9 @@
 #include <fcntl.h>
 #include <gflags/gflags.h>
 #include <glog/logging.h>
+#include <string.h>
 #include <sys/types.h>
+#include <algorithm>
 
 namespace facebook {
 namespace wdt {
@@ -38,7 +40,9 @@ ErrorCode FileWriter::open() {
     WDT_CHECK_EQ(-1, fd_);
     return OK;
   }
-  if (fd_ >= 0 && blockDetails_->offset > 0) {
+  // a cached fd may have been left anywhere by the previous block
+  if (fd_ >= 0 &&
+      (blockDetails_->offset > 0 || threadCtx_.getFdCache() != nullptr)) {
     int64_t ret;
     {
       PerfStatCollector statCollector(threadCtx_, PerfStatReport::FILE_SEEK);
@@ -55,17 +59,111 @@ ErrorCode FileWriter::open() {
     WLOG(ERROR) << "File open/seek failed for " << blockDetails_->fileName;
     return FILE_WRITE_ERROR;
   }
+  setupDirectWrites();
+  if (directBuffer_ == nullptr) {
+    setupAsyncWrites();
+    // O_DIRECT writes leave nothing to write back
+    if (writeBehind_ != nullptr) {
+      writeBehindId_ = writeBehind_->addFile(fd_, blockDetails_->offset);
+    }
+  }
   return OK;
 }
 
+void FileWriter::setupDirectWrites() {
+  if (!threadCtx_.getOptions().odirect_writes || fd_ < 0) {
+    return;
+  }
+#ifdef O_DIRECT
+  if (blockDetails_->offset % kDiskBlockSize != 0) {
+    WVLOG(1) << "Unaligned block at " << blockDetails_->offset << " for "
+             << blockDetails_->fileName << ", not using O_DIRECT";
+    return;
+  }
+  // buffer 0 is the main buffer of the thread, used for the protocol
+  if (threadCtx_.getNumBuffers() < 2 && !threadCtx_.addBuffers(1)) {
+    WLOG(WARNING) << "Unable to allocate the O_DIRECT buffer, using buffered "
+                  << "writes";
+    return;
+  }
+  const Buffer *buffer = threadCtx_.getBuffer(1);
+  if (!buffer->isAligned()) {
+    return;
+  }
+  const int flags = fcntl(fd_, F_GETFL);
+  if (flags < 0 || fcntl(fd_, F_SETFL, flags | O_DIRECT) < 0) {
+    WPLOG(WARNING) << "Unable to set O_DIRECT for " << blockDetails_->fileName
+                   << ", using buffered writes";
+    return;
+  }
+  directBuffer_ = buffer->getData();
+  directBufferSize_ = buffer->getSize();
+  directWriteOffset_ = blockDetails_->offset;
+  directFlagSet_ = true;
+#elif defined(F_NOCACHE)
+  // no alignment constraint, data is written as usual
+  if (fcntl(fd_, F_NOCACHE, 1) != 0) {
+    WPLOG(ERROR) << "Not able to set F_NOCACHE";
+  }
+#endif
+}
+
+void FileWriter::setupAsyncWrites() {
+  const auto &options = threadCtx_.getOptions();
+  if (fd_ < 0 || (diskWriterPool_ == nullptr && !options.io_uring_writes)) {
+    return;
+  }
+  const Buffer *mainBuffer = threadCtx_.getBuffer();
+  // a block received in a single read gains nothing from writes in flight
+  if (mainBuffer == nullptr ||
+      blockDetails_->dataSize <= mainBuffer->getSize()) {
+    return;
+  }
+  if (diskWriterPool_ != nullptr) {
+    writeBufferSize_ = diskWriterPool_->getBufferSize();
+    if (diskWriterPool_->isPerDevice() && fileCreator_ != nullptr) {
+      deviceId_ = fileCreator_->getDeviceId(blockDetails_->fileName, fd_);
+    }
+  } else {
+    IoUring *ioUring = threadCtx_.getIoUring();
+    if (ioUring == nullptr) {
+      return;
+    }
+    const int numBuffers = std::max(2, options.io_uring_write_buffers);
+    const int missing = 1 + numBuffers - threadCtx_.getNumBuffers();
+    if (missing > 0 && !threadCtx_.addBuffers(missing)) {
+      WLOG(WARNING) << "Unable to allocate " << numBuffers
+                    << " write buffers, using blocking writes";
+      return;
+    }
+    // buffer 0 is the main buffer of the thread, used for the protocol
+    freeBuffers_.clear();
+    for (int i = numBuffers; i >= 1; i--) {
+      freeBuffers_.push_back(threadCtx_.getBuffer(i)->getData());
+    }
+    writeBufferSize_ = threadCtx_.getBuffer(1)->getSize();
+    ioUring_ = ioUring;
+  }
+  nextWriteOffset_ = blockDetails_->offset;
+  asyncWrites_ = true;
+}
+
 ErrorCode FileWriter::sync() {
   if (fd_ < 0) {
     // File was either never opened or already closed
     return OK;
   }
+  if (!waitForWrites()) {
+    return FILE_WRITE_ERROR;
+  }
+  if (durabilityQueue_ != nullptr) {
+    // done in the background once the file is closed
+    return OK;
+  }
   const auto &options = threadCtx_.getOptions();
   if (options.fsync || options.isLogBasedResumption()) {
-    PerfStatCollector statCollector(threadCtx_, PerfStatReport::FSYNC_STATS);
+    PerfStatCollector statCollector(threadCtx_, PerfStatReport::FSYNC_STATS,
+                                    FSYNC);
     if (::fsync(fd_) < 0) {
       WPLOG(ERROR) << "Unable to fsync() fd " << fd_;
       return FILE_WRITE_ERROR;
@@ -88,6 +186,27 @@ ErrorCode FileWriter::sync() {
 
 ErrorCode FileWriter::close() {
   if (fd_ >= 0) {
+    ErrorCode code = OK;
+    // the kernel may still be using the fd and the buffers
+    const bool writesDone = waitForWrites();
+    if (fileCreator_ != nullptr) {
+      fileCreator_->addWrittenBytes(threadCtx_.getOptions(), *blockDetails_,
+                                    totalWritten_);
+    }
+    // and the write behind thread the fd
+    if (writeBehindId_ >= 0) {
+      if (!writeBehind_->removeFile(writeBehindId_)) {
+        WLOG(ERROR) << "Write behind failed for " << blockDetails_->fileName;
+        code = FILE_WRITE_ERROR;
+      }
+      writeBehindId_ = -1;
+    }
+    if (!writesDone) {
+      WLOG(ERROR) << "Asynchronous writes failed for "
+                  << blockDetails_->fileName;
+    } else if (releaseToCache()) {
+      return code;
+    }
     PerfStatCollector statCollector(threadCtx_, PerfStatReport::FILE_CLOSE);
     if (::close(fd_) != 0) {
       WPLOG(ERROR) << "Unable to close fd " << fd_;
@@ -95,10 +214,38 @@ ErrorCode FileWriter::close() {
       return FILE_WRITE_ERROR;
     }
     fd_ = -1;
+    return code;
   }
   return OK;
 }
 
+bool FileWriter::releaseToCache() {
+  // the O_DIRECT flag is shared by all the users of the fd
+  FdCache *fdCache = directFlagSet_ ? nullptr : threadCtx_.getFdCache();
+  if (durabilityQueue_ != nullptr) {
+    int fd = fd_;
+    if (fdCache != nullptr) {
+      // the queue closes its own fd, the cached one stays open
+      fd = ::dup(fd_);
+      if (fd < 0) {
+        WPLOG(WARNING) << "Unable to dup fd " << fd_ << ", not caching it";
+        fd = fd_;
+      } else {
+        fdCache->put(blockDetails_->seqId, fd_);
+      }
+    }
+    durabilityQueue_->add(fd, *blockDetails_);
+    fd_ = -1;
+    return true;
+  }
+  if (fdCache == nullptr) {
+    return false;
+  }
+  fdCache->put(blockDetails_->seqId, fd_);
+  fd_ = -1;
+  return true;
+}
+
 bool FileWriter::isClosed() {
   return fd_ < 0;
 }
@@ -106,12 +253,23 @@ bool FileWriter::isClosed() {
 ErrorCode FileWriter::write(char *buf, int64_t size) {
   WDT_CHECK_NE(TO_BE_DELETED, blockDetails_->allocationStatus);
   auto &options = threadCtx_.getOptions();
-  if (!options.skip_writes) {
+  if (!options.skip_writes && isAsync()) {
+    const ErrorCode code = writeAsync(buf, size);
+    if (code != OK) {
+      return code;
+    }
+  } else if (!options.skip_writes && directBuffer_ != nullptr) {
+    const ErrorCode code = writeDirect(buf, size);
+    if (code != OK) {
+      return code;
+    }
+  } else if (!options.skip_writes) {
     int64_t count = 0;
     while (count < size) {
       int64_t written;
       {
-        PerfStatCollector statCollector(threadCtx_, PerfStatReport::FILE_WRITE);
+        PerfStatCollector statCollector(threadCtx_, PerfStatReport::FILE_WRITE,
+                                        DISK_WRITE);
         written = ::write(fd_, buf + count, size - count);
       }
       if (written == -1) {
@@ -138,12 +296,317 @@ ErrorCode FileWriter::write(char *buf, int64_t size) {
   return OK;
 }
 
+ErrorCode FileWriter::writeDirect(const char *buf, int64_t size) {
+  int64_t count = 0;
+  if (buf == directBuffer_ + directBuffered_) {
+    // data was received directly in the staging buffer
+    WDT_CHECK_LE(size, directBufferSize_ - directBuffered_);
+    directBuffered_ += size;
+    count = size;
+    if (directBuffered_ == directBufferSize_ && !flushDirectWrites()) {
+      return FILE_WRITE_ERROR;
+    }
+  }
+  while (count < size) {
+    const int64_t toCopy =
+        std::min(size - count, directBufferSize_ - directBuffered_);
+    memcpy(directBuffer_ + directBuffered_, buf + count, toCopy);
+    directBuffered_ += toCopy;
+    count += toCopy;
+    if (directBuffered_ == directBufferSize_ && !flushDirectWrites()) {
+      return FILE_WRITE_ERROR;
+    }
+  }
+  if (totalWritten_ + size == blockDetails_->dataSize && !flushDirectWrites()) {
+    return FILE_WRITE_ERROR;
+  }
+  return OK;
+}
+
+/// pwrite()s all the data, retrying on EINTR. errno is set on failure
+static bool pwriteFully(ThreadCtx &threadCtx, int fd, const char *data,
+                        int64_t size, int64_t offset) {
+  PerfStatCollector statCollector(threadCtx, PerfStatReport::FILE_WRITE,
+                                  DISK_WRITE);
+  int64_t count = 0;
+  while (count < size) {
+    const int64_t written =
+        ::pwrite(fd, data + count, size - count, offset + count);
+    if (written < 0 && errno == EINTR) {
+      continue;
+    }
+    if (written <= 0) {
+      if (written == 0) {
+        errno = EIO;
+      }
+      return false;
+    }
+    count += written;
+  }
+  return true;
+}
+
+bool FileWriter::flushDirectWrites() {
+  const int64_t aligned = directBuffered_ - directBuffered_ % kDiskBlockSize;
+  if (aligned > 0 &&
+      !pwriteFully(threadCtx_, fd_, directBuffer_, aligned,
+                   directWriteOffset_)) {
+    // some filesystems accept the flag but refuse the writes
+    if (errno != EINVAL || !directFlagSet_ || !disableDirectWrites() ||
+        !pwriteFully(threadCtx_, fd_, directBuffer_, aligned,
+                     directWriteOffset_)) {
+      WPLOG(ERROR) << "File write failed for " << blockDetails_->fileName
+                   << " at " << directWriteOffset_;
+      return false;
+    }
+    WLOG(WARNING) << "O_DIRECT write refused for " << blockDetails_->fileName
+                  << ", using buffered writes";
+  }
+  const int64_t tail = directBuffered_ - aligned;
+  if (tail > 0) {
+    if (directFlagSet_ && !disableDirectWrites()) {
+      return false;
+    }
+    if (!pwriteFully(threadCtx_, fd_, directBuffer_ + aligned, tail,
+                     directWriteOffset_ + aligned)) {
+      WPLOG(ERROR) << "File write failed for " << blockDetails_->fileName
+                   << " at " << directWriteOffset_ + aligned;
+      return false;
+    }
+  }
+  WVLOG(1) << "Successfully written " << directBuffered_ << " bytes at "
+           << directWriteOffset_ << " for file " << blockDetails_->fileName;
+  directWriteOffset_ += directBuffered_;
+  directBuffered_ = 0;
+  return true;
+}
+
+bool FileWriter::disableDirectWrites() {
+#ifdef O_DIRECT
+  const int flags = fcntl(fd_, F_GETFL);
+  if (flags < 0 || fcntl(fd_, F_SETFL, flags & ~O_DIRECT) < 0) {
+    WPLOG(ERROR) << "Unable to clear O_DIRECT for " << blockDetails_->fileName;
+    return false;
+  }
+#endif
+  directFlagSet_ = false;
+  return true;
+}
+
+ErrorCode FileWriter::writeAsync(char *buf, int64_t size) {
+  int64_t count = 0;
+  if (lentBuffer_ != nullptr && buf == lentBuffer_) {
+    // data was received directly in the write buffer
+    lentBuffer_ = nullptr;
+    if (!submitWrite(buf, size)) {
+      return FILE_WRITE_ERROR;
+    }
+    count = size;
+  }
+  while (count < size) {
+    int64_t bufSize;
+    char *data = getWriteBuffer(bufSize);
+    if (data == nullptr) {
+      return FILE_WRITE_ERROR;
+    }
+    const int64_t toCopy = std::min(bufSize, size - count);
+    memcpy(data, buf + count, toCopy);
+    lentBuffer_ = nullptr;
+    if (!submitWrite(data, toCopy)) {
+      return FILE_WRITE_ERROR;
+    }
+    count += toCopy;
+  }
+  return OK;
+}
+
+bool FileWriter::offloadChecksum(ChecksumType type) {
+  if (!isAsync() || ioUring_ != nullptr || type != CHECKSUM_CRC32C ||
+      threadCtx_.getOptions().skip_writes || totalWritten_ > 0) {
+    return false;
+  }
+  offloadedChecksum_ = true;
+  checksumType_ = type;
+  checksum_ = 0;
+  return true;
+}
+
+char *FileWriter::getWriteBuffer(int64_t &size) {
+  if (directBuffer_ != nullptr) {
+    // always has room, it is flushed once full
+    size = directBufferSize_ - directBuffered_;
+    return directBuffer_ + directBuffered_;
+  }
+  WDT_CHECK(isAsync());
+  if (asyncWriteFailed_) {
+    return nullptr;
+  }
+  if (lentBuffer_ == nullptr) {
+    if (ioUring_ == nullptr) {
+      // account for the writes already done, so that errors and syncs are
+      // not delayed till the end of the block
+      while (!pendingWrites_.empty() &&
+             diskWriterPool_->isDone(&pendingWrites_.front().poolWrite)) {
+        if (!retireOldestWrite()) {
+          return nullptr;
+        }
+      }
+      PerfStatCollector statCollector(threadCtx_, PerfStatReport::FILE_WRITE,
+                                      DISK_WRITE);
+      lentBuffer_ = diskWriterPool_->getBuffer(threadCtx_.getAbortChecker());
+      if (lentBuffer_ == nullptr) {
+        WLOG(ERROR) << "Unable to get a write buffer for "
+                    << blockDetails_->fileName;
+        return nullptr;
+      }
+    } else {
+      while (freeBuffers_.empty()) {
+        if (!retireOldestWrite()) {
+          return nullptr;
+        }
+      }
+      lentBuffer_ = freeBuffers_.back();
+      freeBuffers_.pop_back();
+    }
+  }
+  size = writeBufferSize_;
+  return lentBuffer_;
+}
+
+bool FileWriter::submitWrite(char *data, int64_t size) {
+  pendingWrites_.emplace_back();
+  AsyncWrite &asyncWrite = pendingWrites_.back();
+  asyncWrite.data = data;
+  asyncWrite.size = size;
+  asyncWrite.offset = nextWriteOffset_;
+  nextWriteOffset_ += size;
+  if (ioUring_ == nullptr) {
+    DiskWriterPool::Write &poolWrite = asyncWrite.poolWrite;
+    poolWrite.fd = fd_;
+    poolWrite.data = data;
+    poolWrite.size = size;
+    poolWrite.offset = asyncWrite.offset;
+    poolWrite.deviceId = deviceId_;
+    poolWrite.computeChecksum = offloadedChecksum_;
+    poolWrite.checksumType = checksumType_;
+    diskWriterPool_->submit(&poolWrite);
+    return true;
+  }
+  while (!ioUring_->prepareWrite(&asyncWrite.request, fd_, data, size,
+                                 asyncWrite.offset)) {
+    // submission queue is full, wait for room. If no other write of ours is
+    // in flight the ring is too small to be used at all
+    if (pendingWrites_.size() < 2 || !retireOldestWrite()) {
+      WLOG(ERROR) << "Unable to queue asynchronous write for "
+                  << blockDetails_->fileName;
+      freeBuffers_.push_back(data);
+      pendingWrites_.pop_back();
+      asyncWriteFailed_ = true;
+      return false;
+    }
+  }
+  if (ioUring_->submit() < 0) {
+    // the write stays pending, waiting for it reports the failure
+    asyncWriteFailed_ = true;
+    return false;
+  }
+  return true;
+}
+
+bool FileWriter::retireOldestWrite() {
+  WDT_CHECK(!pendingWrites_.empty());
+  AsyncWrite &asyncWrite = pendingWrites_.front();
+  bool ok = true;
+  int64_t written;
+  {
+    PerfStatCollector statCollector(threadCtx_, PerfStatReport::FILE_WRITE,
+                                    DISK_WRITE);
+    if (ioUring_ == nullptr) {
+      // the pool completes writes entirely and takes its buffer back
+      diskWriterPool_->wait(&asyncWrite.poolWrite);
+      written = asyncWrite.poolWrite.result;
+      if (offloadedChecksum_) {
+        // writes are retired in order
+        checksum_ = BlockChecksum::combine(checksumType_, checksum_,
+                                           asyncWrite.poolWrite.checksum,
+                                           asyncWrite.size);
+      }
+    } else {
+      ok = ioUring_->wait(&asyncWrite.request);
+      written = asyncWrite.request.result;
+    }
+  }
+  if (!ok || written < 0) {
+    WLOG(ERROR) << "Asynchronous write failed for " << blockDetails_->fileName
+                << " at " << asyncWrite.offset << " "
+                << strerrorStr(-written);
+    ok = false;
+  } else if (written < asyncWrite.size) {
+    // short write, finishing it synchronously
+    const char *data = asyncWrite.data;
+    while (written < asyncWrite.size) {
+      const int64_t ret = ::pwrite(fd_, data + written, asyncWrite.size - written,
+                                   asyncWrite.offset + written);
+      if (ret < 0 && errno == EINTR) {
+        continue;
+      }
+      if (ret <= 0) {
+        WPLOG(ERROR) << "File write failed for " << blockDetails_->fileName
+                     << " at " << asyncWrite.offset + written;
+        ok = false;
+        break;
+      }
+      written += ret;
+    }
+  }
+  if (ok) {
+    totalCompleted_ += asyncWrite.size;
+    const bool finished = (totalCompleted_ == blockDetails_->dataSize);
+    ok = syncFileRange(asyncWrite.size, finished /*forced*/);
+  }
+  if (ioUring_ != nullptr) {
+    freeBuffers_.push_back(asyncWrite.data);
+  }
+  pendingWrites_.pop_front();
+  if (!ok) {
+    asyncWriteFailed_ = true;
+  }
+  return ok;
+}
+
+bool FileWriter::waitForWrites() {
+  if (directBuffered_ > 0) {
+    return flushDirectWrites();
+  }
+  if (!isAsync()) {
+    return true;
+  }
+  if (lentBuffer_ != nullptr) {
+    if (ioUring_ == nullptr) {
+      diskWriterPool_->releaseBuffer(lentBuffer_);
+    } else {
+      freeBuffers_.push_back(lentBuffer_);
+    }
+    lentBuffer_ = nullptr;
+  }
+  bool ok = !asyncWriteFailed_;
+  while (!pendingWrites_.empty()) {
+    ok = retireOldestWrite() && ok;
+  }
+  return ok;
+}
+
 bool FileWriter::syncFileRange(int64_t written, bool forced) {
 #ifdef HAS_SYNC_FILE_RANGE
   const WdtOptions &options = threadCtx_.getOptions();
   if (options.disk_sync_interval_mb < 0) {
     return true;
   }
+  if (writeBehindId_ >= 0) {
+    // the controller flushes the rest of the block once it is closed
+    writeBehind_->recordWrite(writeBehindId_, written);
+    return true;
+  }
   const int64_t syncIntervalBytes = options.disk_sync_interval_mb * 1024 * 1024;
   writtenSinceLastSync_ += written;
   if (writtenSinceLastSync_ == 0) {
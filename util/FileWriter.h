@@ -11,21 +11,42 @@
 #include <wdt/Protocol.h>
 #include <wdt/WdtConfig.h>
 #include <wdt/Writer.h>
+#include <wdt/util/DiskWriterPool.h>
+#include <wdt/util/DurabilityQueue.h>
 #include <wdt/util/FileCreator.h>
+#include <wdt/util/IoUring.h>
+#include <wdt/util/WriteBehindController.h>
+
+#include <deque>
+#include <vector>
 
 namespace facebook {
 namespace wdt {
 
 class FileWriter : public Writer {
  public:
+  /**
+   * @param diskWriterPool    if not nullptr, large blocks are written by the
+   *                          threads of this pool
+   * @param durabilityQueue   if not nullptr, the file is synced and closed by
+   *                          this queue instead of sync() and close()
+   * @param writeBehind       if not nullptr, the writeback of the data is
+   *                          started by this controller instead of every
+   *                          disk_sync_interval_mb
+   */
   FileWriter(ThreadCtx &threadCtx, BlockDetails const *blockDetails,
-             FileCreator *fileCreator)
+             FileCreator *fileCreator, DiskWriterPool *diskWriterPool = nullptr,
+             DurabilityQueue *durabilityQueue = nullptr,
+             WriteBehindController *writeBehind = nullptr)
       : threadCtx_(threadCtx),
         blockDetails_(blockDetails),
 #ifdef HAS_SYNC_FILE_RANGE
         nextSyncOffset_(blockDetails->offset),
 #endif
-        fileCreator_(fileCreator) {
+        fileCreator_(fileCreator),
+        diskWriterPool_(diskWriterPool),
+        durabilityQueue_(durabilityQueue),
+        writeBehind_(writeBehind) {
   }
 
   ~FileWriter() override;
@@ -37,21 +58,74 @@ class FileWriter : public Writer {
   ErrorCode write(char *buf, int64_t size) override;
 
   /// @see Writer.h
+  /// With asynchronous writes, this includes the writes still in flight
   int64_t getTotalWritten() override {
     return totalWritten_;
   }
 
+  /// @return   whether writes are done asynchronously, using io_uring or
+  ///           the disk writer pool
+  bool isAsync() const {
+    return asyncWrites_;
+  }
+
+  /// @return   whether getWriteBuffer() can be used, in asynchronous mode or
+  ///           when staging writes for O_DIRECT
+  bool hasWriteBuffers() const override {
+    return asyncWrites_ || directBuffer_ != nullptr;
+  }
+
+  /**
+   * Returns a buffer data can be received into and then passed to write()
+   * without any copy. For O_DIRECT, this is the free part of the aligned
+   * staging buffer. In asynchronous mode, blocks till the oldest write in
+   * flight completes if all the buffers are in use, or while the memory cap
+   * of the disk writer pool is hit.
+   *
+   * @param size    set to the size of the buffer
+   *
+   * @return        buffer to use, nullptr if a previous write failed
+   */
+  char *getWriteBuffer(int64_t &size) override;
+
+  /**
+   * Waits for all the writes in flight to complete, and writes the data
+   * staged for O_DIRECT
+   *
+   * @return    false if any of the writes failed
+   */
+  bool waitForWrites() override;
+
+  /// @return   number of bytes whose write is complete
+  int64_t getTotalCompleted() override {
+    return isAsync() ? totalCompleted_ : totalWritten_;
+  }
+
+  /// @see Writer.h
+  /// Only with the disk writer pool, whose threads checksum each write. The
+  /// checksums of the writes are combined as they complete, which needs
+  /// crc32c
+  bool offloadChecksum(ChecksumType type) override;
+
+  /// @see Writer.h
+  int64_t getChecksum() override {
+    return checksum_;
+  }
+
   /// @see Writer.h
   /// This method calls fsync() and posix_fadvise, except if options are set
-  /// to disable it.
+  /// to disable it. They are deferred to the durability queue if any.
   ErrorCode sync() override;
 
   /// @see Writer.h
+  /// With a durability queue, the fd is handed off to it instead. With an fd
+  /// cache, the fd is kept open there for the next block of the file.
   ErrorCode close() override;
 
  private:
   /**
-   * calls sync_file_range at disk_sync_interval_mb intervals.
+   * calls sync_file_range at disk_sync_interval_mb intervals, or hands the
+   * data written to the write behind controller.
    *
    * @param written   number of bytes last written
    * @param forced    whether to force syncing or not
@@ -63,6 +137,51 @@ class FileWriter : public Writer {
    */
   bool isClosed();
 
+  /// sets up O_DIRECT writes if enabled and possible for this block
+  void setupDirectWrites();
+
+  /// O_DIRECT version of write(), staging data in an aligned buffer
+  ErrorCode writeDirect(const char *buf, int64_t size);
+
+  /**
+   * Writes the data staged for O_DIRECT. The unaligned tail, which can only
+   * be at the end of the block, is written without O_DIRECT.
+   */
+  bool flushDirectWrites();
+
+  /// clears O_DIRECT on the file, for the tail or if the filesystem refuses it
+  bool disableDirectWrites();
+
+  /**
+   * Hands the fd off to the durability queue and/or the fd cache of the
+   * thread instead of closing it
+   *
+   * @return    false if the fd still has to be closed
+   */
+  bool releaseToCache();
+
+  /// sets up asynchronous writes if enabled and useful for this block
+  void setupAsyncWrites();
+
+  /// asynchronous version of write()
+  ErrorCode writeAsync(char *buf, int64_t size);
+
+  /// submits a write of size bytes from a write buffer
+  bool submitWrite(char *data, int64_t size);
+
+  /// waits for the oldest write in flight and releases its buffer
+  bool retireOldestWrite();
+
+  /// one write submitted to io_uring or to the disk writer pool
+  struct AsyncWrite {
+    IoRequest request;
+    DiskWriterPool::Write poolWrite;
+    /// write buffer holding the data
+    char *data{nullptr};
+    int64_t size{0};
+    int64_t offset{0};
+  };
+
   ThreadCtx &threadCtx_;
 
   /// file handler
@@ -82,6 +201,53 @@ class FileWriter : public Writer {
 #endif
   /// reference to file creator
   FileCreator *fileCreator_;
+
+  /// aligned buffer data is staged in for O_DIRECT writes, nullptr if not
+  /// writing in O_DIRECT
+  char *directBuffer_{nullptr};
+  /// size of directBuffer_
+  int64_t directBufferSize_{0};
+  /// number of bytes staged in directBuffer_
+  int64_t directBuffered_{0};
+  /// file offset of the start of directBuffer_
+  int64_t directWriteOffset_{0};
+  /// whether O_DIRECT is still set on the file
+  bool directFlagSet_{false};
+
+  /// pool the writes are handed off to, if any
+  DiskWriterPool *diskWriterPool_;
+  /// device of the file, only looked up if the pool limits the writers per
+  /// device
+  int64_t deviceId_{-1};
+  /// queue the file is handed off to for syncing and closing, if any
+  DurabilityQueue *durabilityQueue_;
+  /// controller starting the writeback of the data, if any
+  WriteBehindController *writeBehind_;
+  /// id of the file in writeBehind_, -1 if not registered
+  int64_t writeBehindId_{-1};
+  /// whether writes of this block are asynchronous
+  bool asyncWrites_{false};
+  /// ring used for asynchronous writes, nullptr if the pool is used instead
+  IoUring *ioUring_{nullptr};
+  /// writes in flight, oldest first. A deque keeps the requests in place
+  std::deque<AsyncWrite> pendingWrites_;
+  /// ThreadCtx buffers not used by any io_uring write
+  std::vector<char *> freeBuffers_;
+  /// size of the write buffers
+  int64_t writeBufferSize_{0};
+  /// buffer returned by getWriteBuffer() and not yet written, if any
+  char *lentBuffer_{nullptr};
+  /// number of bytes whose asynchronous write is complete
+  int64_t totalCompleted_{0};
+  /// file offset of the next asynchronous write
+  int64_t nextWriteOffset_{0};
+  /// set once an asynchronous write failed
+  bool asyncWriteFailed_{false};
+  /// whether the disk writer pool computes the checksum of the writes
+  bool offloadedChecksum_{false};
+  ChecksumType checksumType_{CHECKSUM_CRC32C};
+  /// checksum of the writes completed so far
+  int64_t checksum_{0};
 };
 }
 }
@@ -0,0 +1,271 @@
+/**
+ * Copyright (c) 2014-present, Facebook, Inc.
+ * All rights reserved.
+ *
+ * This source code is licensed under the BSD-style license found in the
+ * LICENSE file in the root directory of this source tree. An additional grant
+ * of patent rights can be found in the PATENTS file in the same directory.
+ */
+#include <wdt/util/IoUring.h>
+
+#include <wdt/ErrorCodes.h>
+
+#include <errno.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <sys/syscall.h>
+#include <unistd.h>
+#include <algorithm>
+
+#if defined(WDT_HAS_IO_URING) && defined(__NR_io_uring_setup) && \
+    defined(__NR_io_uring_enter)
+#include <linux/io_uring.h>
+#define WDT_IO_URING_ENABLED 1
+#endif
+
+namespace facebook {
+namespace wdt {
+
+#ifdef WDT_IO_URING_ENABLED
+
+static int ioUringSetup(unsigned entries, struct io_uring_params *params) {
+  return (int)syscall(__NR_io_uring_setup, entries, params);
+}
+
+static int ioUringEnter(int fd, unsigned toSubmit, unsigned minComplete,
+                        unsigned flags) {
+  return (int)syscall(__NR_io_uring_enter, fd, toSubmit, minComplete, flags,
+                      nullptr, 0);
+}
+
+static void *mmapRing(int fd, int64_t size, int64_t offset) {
+  void *ptr = mmap(nullptr, size, PROT_READ | PROT_WRITE,
+                   MAP_SHARED | MAP_POPULATE, fd, offset);
+  return ptr == MAP_FAILED ? nullptr : ptr;
+}
+
+IoUring::IoUring(int queueDepth) {
+  struct io_uring_params params;
+  memset(&params, 0, sizeof(params));
+  ringFd_ = ioUringSetup(queueDepth, &params);
+  if (ringFd_ < 0) {
+    WPLOG(WARNING) << "io_uring_setup failed for queue depth " << queueDepth;
+    ringFd_ = -1;
+    return;
+  }
+  queueDepth_ = params.sq_entries;
+  sqRingSize_ = params.sq_off.array + params.sq_entries * sizeof(unsigned);
+  cqRingSize_ =
+      params.cq_off.cqes + params.cq_entries * sizeof(struct io_uring_cqe);
+  const bool singleMmap = (params.features & IORING_FEAT_SINGLE_MMAP);
+  if (singleMmap) {
+    sqRingSize_ = cqRingSize_ = std::max(sqRingSize_, cqRingSize_);
+  }
+  sqRing_ = mmapRing(ringFd_, sqRingSize_, IORING_OFF_SQ_RING);
+  if (sqRing_ == nullptr) {
+    WPLOG(ERROR) << "Unable to mmap io_uring submission ring";
+    destroy();
+    return;
+  }
+  if (singleMmap) {
+    cqRing_ = sqRing_;
+  } else {
+    cqRing_ = mmapRing(ringFd_, cqRingSize_, IORING_OFF_CQ_RING);
+    if (cqRing_ == nullptr) {
+      WPLOG(ERROR) << "Unable to mmap io_uring completion ring";
+      destroy();
+      return;
+    }
+  }
+  sqesSize_ = params.sq_entries * sizeof(struct io_uring_sqe);
+  sqes_ = mmapRing(ringFd_, sqesSize_, IORING_OFF_SQES);
+  if (sqes_ == nullptr) {
+    WPLOG(ERROR) << "Unable to mmap io_uring submission entries";
+    destroy();
+    return;
+  }
+  char *sq = static_cast<char *>(sqRing_);
+  sqHead_ = reinterpret_cast<unsigned *>(sq + params.sq_off.head);
+  sqTail_ = reinterpret_cast<unsigned *>(sq + params.sq_off.tail);
+  sqMask_ = reinterpret_cast<unsigned *>(sq + params.sq_off.ring_mask);
+  sqEntries_ = reinterpret_cast<unsigned *>(sq + params.sq_off.ring_entries);
+  sqArray_ = reinterpret_cast<unsigned *>(sq + params.sq_off.array);
+  char *cq = static_cast<char *>(cqRing_);
+  cqHead_ = reinterpret_cast<unsigned *>(cq + params.cq_off.head);
+  cqTail_ = reinterpret_cast<unsigned *>(cq + params.cq_off.tail);
+  cqMask_ = reinterpret_cast<unsigned *>(cq + params.cq_off.ring_mask);
+  cqes_ = cq + params.cq_off.cqes;
+  WVLOG(1) << "Setup io_uring with queue depth " << queueDepth_;
+}
+
+IoUring::~IoUring() {
+  if (numInFlight_ > 0) {
+    // the kernel may still write into the buffers of pending requests, wait
+    // for them before tearing everything down
+    WLOG(WARNING) << "Destroying io_uring with " << numInFlight_
+                  << " requests in flight";
+    while (numInFlight_ > 0) {
+      if (ioUringEnter(ringFd_, 0, 1, IORING_ENTER_GETEVENTS) < 0 &&
+          errno != EINTR) {
+        WPLOG(ERROR) << "io_uring_enter failed while draining";
+        break;
+      }
+      reapCompletions();
+    }
+  }
+  destroy();
+}
+
+void IoUring::destroy() {
+  if (sqes_ != nullptr) {
+    munmap(sqes_, sqesSize_);
+    sqes_ = nullptr;
+  }
+  if (cqRing_ != nullptr && cqRing_ != sqRing_) {
+    munmap(cqRing_, cqRingSize_);
+  }
+  cqRing_ = nullptr;
+  if (sqRing_ != nullptr) {
+    munmap(sqRing_, sqRingSize_);
+    sqRing_ = nullptr;
+  }
+  if (ringFd_ >= 0) {
+    ::close(ringFd_);
+    ringFd_ = -1;
+  }
+}
+
+bool IoUring::prepareRead(IoRequest *req, int fd, char *buf, int64_t size,
+                          int64_t offset) {
+  return prepare(IORING_OP_READ, req, fd, buf, size, offset);
+}
+
+bool IoUring::prepareWrite(IoRequest *req, int fd, char *buf, int64_t size,
+                           int64_t offset) {
+  return prepare(IORING_OP_WRITE, req, fd, buf, size, offset);
+}
+
+bool IoUring::prepare(uint8_t opcode, IoRequest *req, int fd, char *buf,
+                      int64_t size, int64_t offset) {
+  WDT_CHECK(isValid());
+  const unsigned head = __atomic_load_n(sqHead_, __ATOMIC_ACQUIRE);
+  const unsigned tail = *sqTail_;
+  if (tail - head >= *sqEntries_) {
+    return false;
+  }
+  const unsigned index = tail & *sqMask_;
+  struct io_uring_sqe *sqe = static_cast<struct io_uring_sqe *>(sqes_) + index;
+  memset(sqe, 0, sizeof(*sqe));
+  sqe->opcode = opcode;
+  sqe->fd = fd;
+  sqe->addr = reinterpret_cast<uint64_t>(buf);
+  sqe->len = size;
+  sqe->off = offset;
+  sqe->user_data = reinterpret_cast<uint64_t>(req);
+  sqArray_[index] = index;
+  __atomic_store_n(sqTail_, tail + 1, __ATOMIC_RELEASE);
+  req->pending = true;
+  req->result = 0;
+  numToSubmit_++;
+  return true;
+}
+
+int IoUring::submit() {
+  if (numToSubmit_ == 0) {
+    return 0;
+  }
+  int ret;
+  do {
+    ret = ioUringEnter(ringFd_, numToSubmit_, 0, 0);
+  } while (ret < 0 && errno == EINTR);
+  if (ret < 0) {
+    WPLOG(ERROR) << "io_uring_enter failed to submit " << numToSubmit_;
+    return -errno;
+  }
+  numToSubmit_ -= ret;
+  numInFlight_ += ret;
+  return ret;
+}
+
+void IoUring::reapCompletions() {
+  unsigned head = *cqHead_;
+  const unsigned tail = __atomic_load_n(cqTail_, __ATOMIC_ACQUIRE);
+  while (head != tail) {
+    struct io_uring_cqe *cqe =
+        static_cast<struct io_uring_cqe *>(cqes_) + (head & *cqMask_);
+    IoRequest *req = reinterpret_cast<IoRequest *>(cqe->user_data);
+    req->result = cqe->res;
+    req->pending = false;
+    numInFlight_--;
+    head++;
+  }
+  __atomic_store_n(cqHead_, head, __ATOMIC_RELEASE);
+}
+
+bool IoUring::wait(IoRequest *req) {
+  if (req->pending && numToSubmit_ > 0 && submit() < 0) {
+    req->result = -EIO;
+    return false;
+  }
+  reapCompletions();
+  while (req->pending) {
+    if (ioUringEnter(ringFd_, 0, 1, IORING_ENTER_GETEVENTS) < 0) {
+      if (errno == EINTR) {
+        continue;
+      }
+      WPLOG(ERROR) << "io_uring_enter failed while waiting for completion";
+      req->result = -errno;
+      return false;
+    }
+    reapCompletions();
+  }
+  return true;
+}
+
+#else
+
+IoUring::IoUring(int queueDepth) {
+  WLOG(WARNING) << "io_uring is not supported by this build, queue depth "
+                << queueDepth << " ignored";
+}
+
+IoUring::~IoUring() {
+}
+
+void IoUring::destroy() {
+}
+
+bool IoUring::prepareRead(IoRequest *req, int fd, char *buf, int64_t size,
+                          int64_t offset) {
+  WDT_CHECK(false) << "io_uring not supported";
+  return false;
+}
+
+bool IoUring::prepareWrite(IoRequest *req, int fd, char *buf, int64_t size,
+                           int64_t offset) {
+  WDT_CHECK(false) << "io_uring not supported";
+  return false;
+}
+
+bool IoUring::prepare(uint8_t opcode, IoRequest *req, int fd, char *buf,
+                      int64_t size, int64_t offset) {
+  WDT_CHECK(false) << "io_uring not supported";
+  return false;
+}
+
+int IoUring::submit() {
+  return -ENOSYS;
+}
+
+void IoUring::reapCompletions() {
+}
+
+bool IoUring::wait(IoRequest *req) {
+  req->result = -ENOSYS;
+  req->pending = false;
+  return false;
+}
+
+#endif
+}
+}
@@ -0,0 +1,143 @@
+/**
+ * Copyright (c) 2014-present, Facebook, Inc.
+ * All rights reserved.
+ *
+ * This source code is licensed under the BSD-style license found in the
+ * LICENSE file in the root directory of this source tree. An additional grant
+ * of patent rights can be found in the PATENTS file in the same directory.
+ */
+#pragma once
+
+#include <wdt/WdtConfig.h>
+
+#include <cstdint>
+
+namespace facebook {
+namespace wdt {
+
+/// one asynchronous request tracked by IoUring
+struct IoRequest {
+  /// result of the operation, same semantics as the return of pread/pwrite or
+  /// -errno in case of failure
+  int32_t result{0};
+  /// whether the request has been submitted and not yet completed
+  bool pending{false};
+};
+
+/**
+ * Minimal wrapper around a linux io_uring instance, talking to the kernel
+ * through raw syscalls so that no extra library is needed. Each thread is
+ * expected to own its ring, the class is not thread safe.
+ * If io_uring is not supported by the build or by the running kernel, isValid()
+ * returns false and callers should fallback to regular blocking calls.
+ */
+class IoUring {
+ public:
+  /// @param queueDepth   number of submission queue entries
+  explicit IoUring(int queueDepth);
+
+  ~IoUring();
+
+  /// @return   whether the ring was successfully setup
+  bool isValid() const {
+    return ringFd_ >= 0;
+  }
+
+  /// @return   number of submission queue entries
+  int getQueueDepth() const {
+    return queueDepth_;
+  }
+
+  /**
+   * Queues a read request. The request is only sent to the kernel on the next
+   * call to submit().
+   *
+   * @param req       request to track, must stay valid till it completes
+   * @param fd        file descriptor to read from
+   * @param buf       destination buffer
+   * @param size      number of bytes to read
+   * @param offset    file offset to read from
+   *
+   * @return          false if the submission queue is full
+   */
+  bool prepareRead(IoRequest *req, int fd, char *buf, int64_t size,
+                   int64_t offset);
+
+  /**
+   * Queues a write request, same as prepareRead() but writing buf to the file.
+   * The buffer must not be modified till the request completes.
+   */
+  bool prepareWrite(IoRequest *req, int fd, char *buf, int64_t size,
+                    int64_t offset);
+
+  /**
+   * Submits all the prepared requests to the kernel
+   *
+   * @return    number of requests submitted, or -errno on failure
+   */
+  int submit();
+
+  /**
+   * Blocks till the given request is complete. Completions for other requests
+   * are recorded in their IoRequest as they are reaped.
+   *
+   * @param req   request to wait for
+   *
+   * @return      false if waiting failed, in which case req->result is set to
+   *              -errno
+   */
+  bool wait(IoRequest *req);
+
+  /// @return   number of requests submitted and not yet completed
+  int getNumInFlight() const {
+    return numInFlight_;
+  }
+
+  // making the object non-copyable and non-moveable
+  IoUring(const IoUring &) = delete;
+  IoUring &operator=(const IoUring &) = delete;
+  IoUring(IoUring &&) = delete;
+  IoUring &operator=(IoUring &&) = delete;
+
+ private:
+  /// queues a read or write request, see prepareRead()
+  bool prepare(uint8_t opcode, IoRequest *req, int fd, char *buf, int64_t size,
+               int64_t offset);
+
+  /// reaps all the available completions without blocking
+  void reapCompletions();
+
+  /// closes the ring and unmaps the shared memory
+  void destroy();
+
+  /// fd returned by io_uring_setup, < 0 if not setup
+  int ringFd_{-1};
+  /// number of submission queue entries
+  int queueDepth_{0};
+  /// number of requests prepared but not yet submitted
+  int numToSubmit_{0};
+  /// number of requests submitted but not completed
+  int numInFlight_{0};
+
+  /// mmaped submission ring
+  void *sqRing_{nullptr};
+  int64_t sqRingSize_{0};
+  /// mmaped completion ring, same as sqRing_ for single mmap kernels
+  void *cqRing_{nullptr};
+  int64_t cqRingSize_{0};
+  /// mmaped submission queue entries
+  void *sqes_{nullptr};
+  int64_t sqesSize_{0};
+
+  unsigned *sqHead_{nullptr};
+  unsigned *sqTail_{nullptr};
+  unsigned *sqMask_{nullptr};
+  unsigned *sqEntries_{nullptr};
+  unsigned *sqArray_{nullptr};
+  unsigned *cqHead_{nullptr};
+  unsigned *cqTail_{nullptr};
+  unsigned *cqMask_{nullptr};
+  void *cqes_{nullptr};
+};
+}
+}
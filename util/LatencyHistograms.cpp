@@ -0,0 +1,72 @@
+/**
+ * Copyright (c) 2014-present, Facebook, Inc.
+ * All rights reserved.
+ *
+ * This source code is licensed under the BSD-style license found in the
+ * LICENSE file in the root directory of this source tree. An additional grant
+ * of patent rights can be found in the PATENTS file in the same directory.
+ */
+#include <wdt/util/LatencyHistograms.h>
+
+namespace facebook {
+namespace wdt {
+
+/// operations are recorded in microseconds, one per bucket unit
+const int32_t kLatencyHistogramScale = 1;
+
+LatencyHistograms &LatencyHistograms::get() {
+  // never destroyed: the thread local histograms can't go away before the
+  // threads recording into them, which can outlive static destruction
+  static LatencyHistograms *histograms = new LatencyHistograms();
+  return *histograms;
+}
+
+LatencyHistograms::LatencyHistograms() {
+  std::vector<SwapableNode *> nodes;
+  for (int i = 0; i < NUM_LATENCY_PHASES; i++) {
+    histograms_[i] = std::make_unique<ThreadLocalHistogram>(
+        kLatencyHistogramScale, [this, i](const Histogram &window) {
+          std::lock_guard<std::mutex> lock(mutex_);
+          windows_[i].reset();
+          windows_[i].merge(window);
+        });
+    nodes.push_back(histograms_[i].get());
+  }
+  periodicCounters_ = std::make_unique<PeriodicCounters>(nodes);
+}
+
+void LatencyHistograms::start(int windowMillis) {
+  if (windowMillis <= 0 || started_.exchange(true)) {
+    return;
+  }
+  periodicCounters_->schedule(windowMillis / 1000.0);
+  WLOG(INFO) << "Latency histograms rotating every " << windowMillis << " ms";
+}
+
+LatencyPercentiles LatencyHistograms::getPercentiles(LatencyPhase phase) {
+  std::lock_guard<std::mutex> lock(mutex_);
+  const Histogram &window = windows_[phase];
+  LatencyPercentiles percentiles;
+  percentiles.count = window.getCount();
+  if (percentiles.count == 0) {
+    return percentiles;
+  }
+  percentiles.p50Micros = window.calcPercentile(50);
+  percentiles.p99Micros = window.calcPercentile(99);
+  percentiles.p999Micros = window.calcPercentile(99.9);
+  percentiles.maxMicros = window.getMax();
+  return percentiles;
+}
+
+const char *LatencyHistograms::getPhaseName(LatencyPhase phase) {
+  static const char *kPhaseNames[] = {"disk read",      "disk write",
+                                      "encrypt",        "socket read",
+                                      "socket write",   "throttle sleep",
+                                      "fsync",          "file create"};
+  static_assert(sizeof(kPhaseNames) / sizeof(kPhaseNames[0]) ==
+                    NUM_LATENCY_PHASES,
+                "Mismatch between number of phases and their names");
+  return kPhaseNames[phase];
+}
+}
+}
@@ -0,0 +1,134 @@
+/**
+ * Copyright (c) 2014-present, Facebook, Inc.
+ * All rights reserved.
+ *
+ * This source code is licensed under the BSD-style license found in the
+ * LICENSE file in the root directory of this source tree. An additional grant
+ * of patent rights can be found in the PATENTS file in the same directory.
+ */
+#pragma once
+
+#include <wdt/Reporting.h>
+#include <wdt/WdtOptions.h>
+#include <wdt/util/Stats.h>
+#include <wdt/util/TransferTracer.h>
+
+#include <atomic>
+#include <memory>
+#include <mutex>
+
+namespace facebook {
+namespace wdt {
+
+/// operations of the hot paths whose latency is tracked
+enum LatencyPhase {
+  DISK_READ,
+  DISK_WRITE,
+  ENCRYPT,
+  SOCKET_READ,
+  SOCKET_WRITE,
+  THROTTLE_SLEEP,
+  FSYNC,
+  FILE_CREATE,
+  NUM_LATENCY_PHASES
+};
+
+/// latency percentiles of a phase over a window
+struct LatencyPercentiles {
+  /// number of operations in the window
+  int64_t count{0};
+  double p50Micros{0};
+  double p99Micros{0};
+  double p999Micros{0};
+  int64_t maxMicros{0};
+};
+
+/**
+ * Process wide latency histograms of the hot path operations, cheap enough to
+ * be always on: each thread records into its own thread local histogram, and
+ * a PeriodicCounters thread merges them every window. Percentiles of the last
+ * complete window can be read at any time during a transfer, so that tail
+ * stalls can be seen without a rerun with enable_perf_stat_collection.
+ */
+class LatencyHistograms {
+ public:
+  /// @return   the histograms of the process
+  static LatencyHistograms &get();
+
+  /**
+   * Starts rotating the windows, only the first call of the process sets the
+   * window duration. Called when a transfer starts with the histograms
+   * enabled.
+   */
+  void start(int windowMillis);
+
+  /// records the duration of an operation, from any thread
+  void record(LatencyPhase phase, int64_t micros) {
+    histograms_[phase]->record(micros);
+  }
+
+  /// @return   percentiles of a phase in the last complete window
+  LatencyPercentiles getPercentiles(LatencyPhase phase);
+
+  /// @return   name of a phase, for logging
+  static const char *getPhaseName(LatencyPhase phase);
+
+ private:
+  LatencyHistograms();
+
+  /// thread local histograms the operations are recorded into
+  std::unique_ptr<ThreadLocalHistogram> histograms_[NUM_LATENCY_PHASES];
+  std::mutex mutex_;
+  /// merged histograms of the last complete window, guarded by mutex_
+  Histogram windows_[NUM_LATENCY_PHASES];
+  std::atomic<bool> started_{false};
+  /// merges and resets the thread local histograms every window
+  std::unique_ptr<PeriodicCounters> periodicCounters_;
+};
+
+/// records the time spent in its scope into a phase, if the transfer has the
+/// histograms enabled, as a span of the trace if tracing is enabled, and
+/// into a category of the time breakdown of the thread if one is given
+class LatencyRecorder {
+ public:
+  LatencyRecorder(const WdtOptions &options, LatencyPhase phase,
+                  TimeBreakdown *timeBreakdown = nullptr,
+                  TimeBreakdown::Category category = TimeBreakdown::CRYPTO)
+      : phase_(phase),
+        enabled_(options.latency_histogram_window_millis > 0),
+        traced_(TransferTracer::get().isEnabled()),
+        timeBreakdown_(timeBreakdown),
+        category_(category) {
+    if (enabled_ || traced_ || timeBreakdown_ != nullptr) {
+      startTime_ = Clock::now();
+    }
+  }
+
+  ~LatencyRecorder() {
+    if (!enabled_ && !traced_ && timeBreakdown_ == nullptr) {
+      return;
+    }
+    const Clock::time_point endTime = Clock::now();
+    const int64_t duration = durationMicros(endTime - startTime_);
+    if (enabled_) {
+      LatencyHistograms::get().record(phase_, duration);
+    }
+    if (timeBreakdown_ != nullptr) {
+      timeBreakdown_->add(category_, duration);
+    }
+    if (traced_) {
+      TransferTracer::get().record(LatencyHistograms::getPhaseName(phase_),
+                                   startTime_, endTime);
+    }
+  }
+
+ private:
+  const LatencyPhase phase_;
+  const bool enabled_;
+  const bool traced_;
+  TimeBreakdown *const timeBreakdown_;
+  const TimeBreakdown::Category category_;
+  Clock::time_point startTime_;
+};
+}
+}
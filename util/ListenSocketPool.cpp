@@ -0,0 +1,125 @@
+/**
+ * Copyright (c) 2014-present, Facebook, Inc.
+ * All rights reserved.
+ *
+ * This source code is licensed under the BSD-style license found in the
+ * LICENSE file in the root directory of this source tree. An additional grant
+ * of patent rights can be found in the PATENTS file in the same directory.
+ */
+#include <wdt/util/ListenSocketPool.h>
+
+#include <wdt/ErrorCodes.h>
+#include <wdt/Reporting.h>
+
+#include <fcntl.h>
+#include <sys/socket.h>
+#include <unistd.h>
+
+namespace facebook {
+namespace wdt {
+
+ListenSocketPool &ListenSocketPool::get() {
+  static ListenSocketPool pool;
+  return pool;
+}
+
+std::vector<int> ListenSocketPool::lease(const Config &config, int &port) {
+  std::vector<int> fds;
+  {
+    std::lock_guard<std::mutex> lock(mutex_);
+    for (auto it = entries_.begin(); it != entries_.end(); ++it) {
+      if (it->config == config && (port == 0 || it->port == port)) {
+        port = it->port;
+        fds = std::move(it->fds);
+        entries_.erase(it);
+        break;
+      }
+    }
+  }
+  for (int fd : fds) {
+    drain(fd);
+  }
+  if (!fds.empty()) {
+    WVLOG(1) << "Leased pooled listening fds " << fds << " port " << port;
+  }
+  return fds;
+}
+
+void ListenSocketPool::release(const Config &config, int port,
+                               std::vector<int> fds, int maxSize) {
+  if (fds.empty()) {
+    return;
+  }
+  Entry entry{config, port, std::move(fds)};
+  std::vector<Entry> toClose;
+  {
+    std::lock_guard<std::mutex> lock(mutex_);
+    entries_.push_back(std::move(entry));
+    while ((int)entries_.size() > maxSize) {
+      toClose.push_back(std::move(entries_.front()));
+      entries_.pop_front();
+    }
+  }
+  for (const auto &closed : toClose) {
+    closeEntry(closed);
+  }
+  WVLOG(1) << "Released listening port " << port << " to the pool";
+}
+
+void ListenSocketPool::clear() {
+  std::deque<Entry> entries;
+  {
+    std::lock_guard<std::mutex> lock(mutex_);
+    entries.swap(entries_);
+  }
+  for (const auto &entry : entries) {
+    closeEntry(entry);
+  }
+}
+
+int ListenSocketPool::size() {
+  std::lock_guard<std::mutex> lock(mutex_);
+  return entries_.size();
+}
+
+ListenSocketPool::~ListenSocketPool() {
+  clear();
+}
+
+void ListenSocketPool::drain(int fd) {
+  int flags = fcntl(fd, F_GETFL, 0);
+  if (flags < 0 || fcntl(fd, F_SETFL, flags | O_NONBLOCK) < 0) {
+    WPLOG(ERROR) << "Unable to make listening fd " << fd << " non blocking";
+    return;
+  }
+  int numDropped = 0;
+  while (true) {
+    int connFd = ::accept(fd, nullptr, nullptr);
+    if (connFd < 0) {
+      if (errno == EINTR) {
+        continue;
+      }
+      break;
+    }
+    ::close(connFd);
+    ++numDropped;
+  }
+  if (fcntl(fd, F_SETFL, flags) < 0) {
+    WPLOG(ERROR) << "Unable to restore flags of listening fd " << fd;
+  }
+  if (numDropped > 0) {
+    WLOG(WARNING) << "Dropped " << numDropped
+                  << " stale connections of pooled listening fd " << fd;
+  }
+}
+
+void ListenSocketPool::closeEntry(const Entry &entry) {
+  for (int fd : entry.fds) {
+    if (::close(fd) != 0) {
+      WPLOG(ERROR) << "Error closing pooled listening fd " << fd << " port "
+                   << entry.port;
+    }
+  }
+}
+}
+}
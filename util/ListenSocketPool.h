@@ -0,0 +1,89 @@
+/**
+ * Copyright (c) 2014-present, Facebook, Inc.
+ * All rights reserved.
+ *
+ * This source code is licensed under the BSD-style license found in the
+ * LICENSE file in the root directory of this source tree. An additional grant
+ * of patent rights can be found in the PATENTS file in the same directory.
+ */
+#pragma once
+
+#include <deque>
+#include <mutex>
+#include <vector>
+
+namespace facebook {
+namespace wdt {
+
+/**
+ * Process wide pool of listening sockets, kept bound and listening between
+ * the receivers of back to back transfers. A server socket leases the fds of
+ * a port from the pool instead of binding a new one, and returns them when it
+ * is destroyed, so that starting a receiver does not go through the bind
+ * and listen (and their retries) again. Connections queued on a port while it
+ * is in the pool are dropped when it is leased.
+ */
+class ListenSocketPool {
+ public:
+  /// what the listening sockets are made for, only matching ones are shared
+  struct Config {
+    /// address family asked, AF_UNSPEC for both
+    int family;
+    /// listen backlog
+    int backlog;
+    /// receive buffer size set on the sockets, inherited by the connections
+    int receiveBufferSize;
+
+    bool operator==(const Config &that) const {
+      return family == that.family && backlog == that.backlog &&
+             receiveBufferSize == that.receiveBufferSize;
+    }
+  };
+
+  /// @return   the pool of the process
+  static ListenSocketPool &get();
+
+  /**
+   * Leases the listening fds of a port
+   *
+   * @param config    config the fds have to match
+   * @param port      port wanted, 0 for any. Set to the port leased
+   *
+   * @return          fds listening on the port, empty if the pool has none
+   */
+  std::vector<int> lease(const Config &config, int &port);
+
+  /**
+   * Gives back the fds listening on a port, they are closed if the pool
+   * already has maxSize ports
+   */
+  void release(const Config &config, int port, std::vector<int> fds,
+               int maxSize);
+
+  /// closes all the fds of the pool
+  void clear();
+
+  /// @return   number of ports in the pool
+  int size();
+
+  ~ListenSocketPool();
+
+ private:
+  struct Entry {
+    Config config;
+    int port;
+    std::vector<int> fds;
+  };
+
+  /// accepts and closes the connections queued on a listening fd
+  static void drain(int fd);
+
+  /// closes the fds of an entry
+  static void closeEntry(const Entry &entry);
+
+  std::mutex mutex_;
+  /// ports in release order, the oldest first
+  std::deque<Entry> entries_;
+};
+}
+}
@@ -0,0 +1,63 @@
+/**
+ * Copyright (c) 2014-present, Facebook, Inc.
+ * All rights reserved.
+ *
+ * This source code is licensed under the BSD-style license found in the
+ * LICENSE file in the root directory of this source tree. An additional grant
+ * of patent rights can be found in the PATENTS file in the same directory.
+ */
+#include <wdt/util/MemoryWriter.h>
+
+#include <string.h>
+
+namespace facebook {
+namespace wdt {
+
+WriterFactory MemoryWriter::makeFactory(BlockMemoryCallback callback) {
+  return [callback](ThreadCtx & /* threadCtx */,
+                    BlockDetails const *blockDetails) {
+    return std::unique_ptr<Writer>(
+        std::make_unique<MemoryWriter>(blockDetails, callback));
+  };
+}
+
+ErrorCode MemoryWriter::open() {
+  if (blockDetails_->dataSize <= 0) {
+    return OK;
+  }
+  memory_ = callback_(*blockDetails_);
+  if (memory_ == nullptr) {
+    WLOG(ERROR) << "No memory to receive " << blockDetails_->fileName
+                << " at " << blockDetails_->offset;
+    return FILE_WRITE_ERROR;
+  }
+  return OK;
+}
+
+char *MemoryWriter::getWriteBuffer(int64_t &size) {
+  size = blockDetails_->dataSize - totalWritten_;
+  if (memory_ == nullptr || size <= 0) {
+    size = 0;
+    return nullptr;
+  }
+  return memory_ + totalWritten_;
+}
+
+ErrorCode MemoryWriter::write(char *buf, int64_t size) {
+  if (size == 0) {
+    return OK;
+  }
+  if (memory_ == nullptr || totalWritten_ + size > blockDetails_->dataSize) {
+    WLOG(ERROR) << "Write of " << size << " bytes past the end of block "
+                << blockDetails_->fileName << " at " << blockDetails_->offset;
+    return FILE_WRITE_ERROR;
+  }
+  char *dest = memory_ + totalWritten_;
+  if (buf != dest) {
+    memcpy(dest, buf, size);
+  }
+  totalWritten_ += size;
+  return OK;
+}
+}
+}
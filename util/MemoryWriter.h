@@ -0,0 +1,89 @@
+/**
+ * Copyright (c) 2014-present, Facebook, Inc.
+ * All rights reserved.
+ *
+ * This source code is licensed under the BSD-style license found in the
+ * LICENSE file in the root directory of this source tree. An additional grant
+ * of patent rights can be found in the PATENTS file in the same directory.
+ */
+#pragma once
+
+#include <wdt/Protocol.h>
+#include <wdt/Writer.h>
+
+#include <functional>
+
+namespace facebook {
+namespace wdt {
+
+/**
+ * Returns the memory the data of a block is received into, at least
+ * blockDetails.dataSize bytes, or nullptr to fail the block. Called by the
+ * receiver threads concurrently, once for each block with data. The memory
+ * of a block can be asked for again after a connection error.
+ *
+ * @param blockDetails    header of the block
+ */
+typedef std::function<char *(const BlockDetails &blockDetails)>
+    BlockMemoryCallback;
+
+/**
+ * Writer receiving the data of a block in memory of the application. The
+ * data is read from the socket directly into that memory, except for the
+ * bytes read along with the block header and decompressed data, which are
+ * copied.
+ */
+class MemoryWriter : public Writer {
+ public:
+  MemoryWriter(BlockDetails const *blockDetails, BlockMemoryCallback callback)
+      : blockDetails_(blockDetails), callback_(std::move(callback)) {
+  }
+
+  /// @return   factory of writers receiving into the memory given by
+  ///           callback, for Receiver::setWriterFactory
+  static WriterFactory makeFactory(BlockMemoryCallback callback);
+
+  /// @see Writer.h
+  /// Gets the memory of the block from the callback
+  ErrorCode open() override;
+
+  /// @see Writer.h
+  /// Copies the data, except if it was received in getWriteBuffer()
+  ErrorCode write(char *buf, int64_t size) override;
+
+  /// @see Writer.h
+  int64_t getTotalWritten() override {
+    return totalWritten_;
+  }
+
+  /// @see Writer.h
+  bool hasWriteBuffers() const override {
+    return memory_ != nullptr;
+  }
+
+  /// @see Writer.h
+  /// The rest of the memory of the block
+  char *getWriteBuffer(int64_t &size) override;
+
+  /// @see Writer.h
+  ErrorCode sync() override {
+    return OK;
+  }
+
+  /// @see Writer.h
+  ErrorCode close() override {
+    return OK;
+  }
+
+ private:
+  /// details of the block
+  BlockDetails const *blockDetails_;
+  /// callback giving the memory
+  const BlockMemoryCallback callback_;
+  /// memory of the block, nullptr till opened
+  char *memory_{nullptr};
+  /// number of bytes received in memory_
+  int64_t totalWritten_{0};
+};
+}
+}
@@ -0,0 +1,161 @@
+/**
+ * Copyright (c) 2014-present, Facebook, Inc.
+ * All rights reserved.
+ *
+ * This source code is licensed under the BSD-style license found in the
+ * LICENSE file in the root directory of this source tree. An additional grant
+ * of patent rights can be found in the PATENTS file in the same directory.
+ */
+#include <wdt/util/PathArena.h>
+#include <wdt/ErrorCodes.h>
+
+#include <algorithm>
+#include <cstring>
+#include <limits>
+
+namespace facebook {
+namespace wdt {
+
+const int64_t PathArena::kFirstChunkEntries;
+const int PathArena::kMaxChunks;
+const int64_t PathArena::kFirstNameChunkSize;
+const int64_t PathArena::kMaxNameChunkSize;
+
+size_t PathArena::DirKeyHash::operator()(const DirKey &key) const {
+  // fnv-1a of the parent id and the name
+  uint64_t hash = 14695981039346656037ULL;
+  auto mix = [&hash](uint8_t byte) {
+    hash ^= byte;
+    hash *= 1099511628211ULL;
+  };
+  for (int i = 0; i < 4; i++) {
+    mix((uint8_t)((uint32_t)key.parentId >> (i * 8)));
+  }
+  for (uint32_t i = 0; i < key.nameLength; i++) {
+    mix((uint8_t)key.name[i]);
+  }
+  return hash;
+}
+
+PathArena::PathArena(const std::string &rootDir) : rootDir_(rootDir) {
+}
+
+int64_t PathArena::add(const std::string &relPath) {
+  std::lock_guard<std::mutex> lock(mutex_);
+  const size_t slash = relPath.rfind('/');
+  if (slash == std::string::npos) {
+    return addEntryLocked(-1, relPath.data(), relPath.size());
+  }
+  const int32_t parentId = addDirLocked(-1, relPath.data(), slash);
+  return addEntryLocked(parentId, relPath.data() + slash + 1,
+                        relPath.size() - slash - 1);
+}
+
+int32_t PathArena::addDirLocked(int32_t parentId, const char *path,
+                                int64_t length) {
+  // walks down from the root, a component at a time, so that no substring of
+  // the path is ever allocated
+  const char *end = path + length;
+  while (true) {
+    const char *slash = (const char *)memchr(path, '/', end - path);
+    const char *nameEnd = slash ? slash : end;
+    DirKey key{parentId, path, (uint32_t)(nameEnd - path)};
+    auto it = dirIds_.find(key);
+    if (it != dirIds_.end()) {
+      parentId = it->second;
+    } else {
+      parentId = addEntryLocked(parentId, key.name, key.nameLength);
+      // the key points to the copy in the arena, which never moves
+      key.name = getEntry(parentId).name;
+      dirIds_.emplace(key, parentId);
+    }
+    if (!slash) {
+      return parentId;
+    }
+    path = slash + 1;
+  }
+}
+
+int32_t PathArena::addEntryLocked(int32_t parentId, const char *name,
+                                  int64_t nameLength) {
+  WDT_CHECK_LT(numEntries_, std::numeric_limits<int32_t>::max())
+      << "Too many paths";
+  char *nameCopy = nullptr;
+  if (nameLength > 0) {
+    if (nameChunkUsed_ + nameLength > nameChunkSize_) {
+      // chunks double up to the max, a name longer than that gets a chunk of
+      // its own
+      nameChunkSize_ =
+          nameChunkSize_ == 0
+              ? kFirstNameChunkSize
+              : std::min<int64_t>(nameChunkSize_ * 2, kMaxNameChunkSize);
+      nameChunkSize_ = std::max<int64_t>(nameChunkSize_, nameLength);
+      nameChunks_.emplace_back(new char[nameChunkSize_]);
+      numNameBytes_ += nameChunkSize_;
+      nameChunkUsed_ = 0;
+    }
+    nameCopy = nameChunks_.back().get() + nameChunkUsed_;
+    memcpy(nameCopy, name, nameLength);
+    nameChunkUsed_ += nameLength;
+  }
+  const int64_t id = numEntries_;
+  const int chunkIndex = getChunkIndex(id);
+  std::unique_ptr<Entry[]> &chunk = entryChunks_[chunkIndex];
+  if (!chunk) {
+    chunk.reset(new Entry[kFirstChunkEntries << chunkIndex]);
+  }
+  const int64_t chunkStart = kFirstChunkEntries * ((1LL << chunkIndex) - 1);
+  Entry &entry = chunk[id - chunkStart];
+  entry.name = nameCopy;
+  entry.nameLength = (uint32_t)nameLength;
+  entry.parentId = parentId;
+  numEntries_++;
+  return id;
+}
+
+void PathArena::appendPath(int64_t pathId, std::string &path) const {
+  if (pathId < 0) {
+    return;
+  }
+  // the path is filled from its last component, once its length is known
+  int64_t length = -1;
+  for (int64_t id = pathId; id >= 0; id = getEntry(id).parentId) {
+    length += getEntry(id).nameLength + 1;
+  }
+  int64_t end = path.size() + length;
+  path.resize(end);
+  for (int64_t id = pathId; id >= 0;) {
+    const Entry &entry = getEntry(id);
+    end -= entry.nameLength;
+    if (entry.nameLength > 0) {
+      memcpy(&path[end], entry.name, entry.nameLength);
+    }
+    id = entry.parentId;
+    if (id >= 0) {
+      path[--end] = '/';
+    }
+  }
+}
+
+std::string PathArena::getRelPath(int64_t pathId) const {
+  std::string path;
+  appendPath(pathId, path);
+  return path;
+}
+
+std::string PathArena::getFullPath(int64_t pathId) const {
+  std::string path = rootDir_;
+  appendPath(pathId, path);
+  return path;
+}
+
+int64_t PathArena::getNumBytes() const {
+  std::lock_guard<std::mutex> lock(mutex_);
+  const int64_t numChunks =
+      numEntries_ == 0 ? 0 : getChunkIndex(numEntries_ - 1) + 1;
+  const int64_t numEntryBytes =
+      kFirstChunkEntries * ((1LL << numChunks) - 1) * sizeof(Entry);
+  return numEntryBytes + numNameBytes_;
+}
+}
+}
@@ -0,0 +1,139 @@
+/**
+ * Copyright (c) 2014-present, Facebook, Inc.
+ * All rights reserved.
+ *
+ * This source code is licensed under the BSD-style license found in the
+ * LICENSE file in the root directory of this source tree. An additional grant
+ * of patent rights can be found in the PATENTS file in the same directory.
+ */
+#pragma once
+
+#include <folly/lang/Bits.h>
+
+#include <cstring>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <unordered_map>
+#include <vector>
+
+namespace facebook {
+namespace wdt {
+
+/**
+ * Interned relative paths of the files of a transfer. A path is stored as its
+ * last component and the id of its parent directory, itself stored the same
+ * way, so the name of a directory is stored once however many files it holds
+ * instead of being repeated in the path of each of them. The entries and the
+ * names are copied back to back in chunks growing geometrically rather than
+ * allocated one by one, so that a small transfer only pays for a few
+ * kilobytes. Paths are never removed. Adding is thread safe, reading a path
+ * added before is lock free.
+ */
+class PathArena {
+ public:
+  /// @param rootDir    directory the paths are relative to, with a trailing /
+  explicit PathArena(const std::string &rootDir);
+
+  /**
+   * Interns a path
+   *
+   * @param relPath   path relative to the root directory
+   *
+   * @return          id of the path
+   */
+  int64_t add(const std::string &relPath);
+
+  /// @return   path of an id
+  std::string getRelPath(int64_t pathId) const;
+
+  /// @return   root directory followed by the path of an id
+  std::string getFullPath(int64_t pathId) const;
+
+  /// @return   root directory of the paths
+  const std::string &getRootDir() const {
+    return rootDir_;
+  }
+
+  /// @return   bytes used by the names and the entries
+  int64_t getNumBytes() const;
+
+ private:
+  /// a path, or a directory of a path
+  struct Entry {
+    /// last component, not null terminated
+    const char *name;
+    uint32_t nameLength;
+    /// entry of the parent directory, -1 for the root
+    int32_t parentId;
+  };
+
+  /// a directory, by its parent and its name
+  struct DirKey {
+    int32_t parentId;
+    const char *name;
+    uint32_t nameLength;
+
+    bool operator==(const DirKey &other) const {
+      return parentId == other.parentId && nameLength == other.nameLength &&
+             (nameLength == 0 || memcmp(name, other.name, nameLength) == 0);
+    }
+  };
+
+  struct DirKeyHash {
+    size_t operator()(const DirKey &key) const;
+  };
+
+  /// entries of the first chunk, each next chunk is twice as big
+  static const int64_t kFirstChunkEntries = 64;
+  /// enough chunks for any int32 id
+  static const int kMaxChunks = 26;
+  static const int64_t kFirstNameChunkSize = 4 * 1024;
+  static const int64_t kMaxNameChunkSize = 1 << 20;
+
+  /// @return   chunk of an id, chunk k holding kFirstChunkEntries << k entries
+  static int getChunkIndex(int64_t id) {
+    const uint64_t n = (uint64_t)id / kFirstChunkEntries + 1;
+    return folly::findLastSet(n) - 1;
+  }
+
+  /// @return   entry of an id
+  const Entry &getEntry(int64_t id) const {
+    const int chunkIndex = getChunkIndex(id);
+    const int64_t chunkStart = kFirstChunkEntries * ((1LL << chunkIndex) - 1);
+    return entryChunks_[chunkIndex][id - chunkStart];
+  }
+
+  /// appends the path of an id to path
+  void appendPath(int64_t pathId, std::string &path) const;
+
+  /**
+   * @param parentId    directory the path is relative to, -1 for the root
+   * @param path        directory path, relative to parentId
+   *
+   * @return            id of the directory, added if needed. mutex_ has to be
+   *                    held
+   */
+  int32_t addDirLocked(int32_t parentId, const char *path, int64_t length);
+
+  /// @return   id of a new entry. mutex_ has to be held
+  int32_t addEntryLocked(int32_t parentId, const char *name,
+                         int64_t nameLength);
+
+  const std::string rootDir_;
+  /// fixed array of chunks, so that readers never see it move
+  std::unique_ptr<Entry[]> entryChunks_[kMaxChunks];
+  int64_t numEntries_{0};
+  /// chunks holding the names, the last one is being filled
+  std::vector<std::unique_ptr<char[]>> nameChunks_;
+  int64_t nameChunkSize_{0};
+  int64_t nameChunkUsed_{0};
+  /// bytes allocated for the names
+  int64_t numNameBytes_{0};
+  /// ids of the directories, the names of the keys are the ones of the entries
+  std::unordered_map<DirKey, int32_t, DirKeyHash> dirIds_;
+  /// protects the fields above, except for reads of the entries added
+  mutable std::mutex mutex_;
+};
+}
+}
@@ -0,0 +1,155 @@
+/**
+ * Copyright (c) 2014-present, Facebook, Inc.
+ * All rights reserved.
+ *
+ * This source code is licensed under the BSD-style license found in the
+ * LICENSE file in the root directory of this source tree. An additional grant
+ * of patent rights can be found in the PATENTS file in the same directory.
+ */
+#include <wdt/util/Prefetcher.h>
+
+#include <wdt/Reporting.h>
+#include <wdt/WdtConfig.h>
+
+#include <fcntl.h>
+#include <unistd.h>
+#include <sstream>
+
+namespace facebook {
+namespace wdt {
+
+Prefetcher::Prefetcher(int64_t budgetBytes) : budgetBytes_(budgetBytes) {
+  prefetchThread_ = std::thread(&Prefetcher::prefetchLoop, this);
+}
+
+Prefetcher::~Prefetcher() {
+  {
+    std::lock_guard<std::mutex> lock(mutex_);
+    stop_ = true;
+    toPrefetch_.clear();
+  }
+  workCond_.notify_all();
+  prefetchThread_.join();
+}
+
+void Prefetcher::add(const SourceMetaData &metadata, int64_t offset,
+                     int64_t size) {
+  if (size <= 0 || metadata.directReads) {
+    // direct reads bypass the page cache
+    return;
+  }
+  const BlockKey key(&metadata, offset);
+  {
+    std::lock_guard<std::mutex> lock(mutex_);
+    if (blocks_.find(key) != blocks_.end()) {
+      return;
+    }
+    if (reservedBytes_ + size > budgetBytes_) {
+      stats_.numOverBudget++;
+      return;
+    }
+    reservedBytes_ += size;
+    blocks_[key].size = size;
+    toPrefetch_.push_back(key);
+  }
+  workCond_.notify_one();
+}
+
+void Prefetcher::markRead(const SourceMetaData &metadata, int64_t offset) {
+  std::lock_guard<std::mutex> lock(mutex_);
+  stats_.numReads++;
+  auto it = blocks_.find(BlockKey(&metadata, offset));
+  if (it == blocks_.end()) {
+    return;
+  }
+  if (it->second.done) {
+    stats_.numHits++;
+  } else {
+    // a block still queued is skipped by the prefetch thread
+    stats_.numLate++;
+  }
+  reservedBytes_ -= it->second.size;
+  blocks_.erase(it);
+}
+
+void Prefetcher::release(const SourceMetaData &metadata, int64_t offset) {
+  std::lock_guard<std::mutex> lock(mutex_);
+  auto it = blocks_.find(BlockKey(&metadata, offset));
+  if (it == blocks_.end()) {
+    return;
+  }
+  reservedBytes_ -= it->second.size;
+  blocks_.erase(it);
+}
+
+Prefetcher::Stats Prefetcher::getStats() const {
+  std::lock_guard<std::mutex> lock(mutex_);
+  return stats_;
+}
+
+std::string Prefetcher::getSummary() const {
+  const Stats stats = getStats();
+  std::ostringstream summary;
+  summary << "Prefetched " << stats.numPrefetched << " blocks ("
+          << stats.prefetchedBytes / kMbToB << " Mbytes), "
+          << stats.numHits << " of " << stats.numReads
+          << " blocks read were prefetched ("
+          << (stats.numReads > 0 ? 100.0 * stats.numHits / stats.numReads : 0)
+          << "%), " << stats.numLate << " read before their prefetch was done, "
+          << stats.numOverBudget << " over budget";
+  return summary.str();
+}
+
+void Prefetcher::prefetchLoop() {
+  std::unique_lock<std::mutex> lock(mutex_);
+  while (true) {
+    workCond_.wait(lock, [this] { return stop_ || !toPrefetch_.empty(); });
+    if (stop_) {
+      return;
+    }
+    const BlockKey key = toPrefetch_.front();
+    toPrefetch_.pop_front();
+    auto it = blocks_.find(key);
+    if (it == blocks_.end()) {
+      // already read
+      continue;
+    }
+    const int64_t size = it->second.size;
+    lock.unlock();
+    prefetchBlock(*key.first, key.second, size);
+    lock.lock();
+    stats_.numPrefetched++;
+    stats_.prefetchedBytes += size;
+    // the block may have been read meanwhile
+    it = blocks_.find(key);
+    if (it != blocks_.end()) {
+      it->second.done = true;
+    }
+  }
+}
+
+void Prefetcher::prefetchBlock(const SourceMetaData &metadata, int64_t offset,
+                               int64_t size) {
+#ifdef HAS_POSIX_FADVISE
+  // the fd of a file opened during discovery is shared, a new one is opened
+  // otherwise. The kernel keeps the pages once it is closed
+  int fd = metadata.fd;
+  if (fd < 0) {
+    fd = ::open(metadata.getFullPath().c_str(), O_RDONLY | O_CLOEXEC);
+    if (fd < 0) {
+      WPLOG(WARNING) << "Unable to open " << metadata.getFullPath()
+                     << " to prefetch it";
+      return;
+    }
+  }
+  if (posix_fadvise(fd, offset, size, POSIX_FADV_WILLNEED) != 0) {
+    WPLOG(WARNING) << "posix_fadvise failed for " << metadata.getFullPath()
+                   << " " << offset << " " << size;
+  }
+  if (fd != metadata.fd) {
+    ::close(fd);
+  }
+#endif
+}
+}
+}
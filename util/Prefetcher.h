@@ -0,0 +1,114 @@
+/**
+ * Copyright (c) 2014-present, Facebook, Inc.
+ * All rights reserved.
+ *
+ * This source code is licensed under the BSD-style license found in the
+ * LICENSE file in the root directory of this source tree. An additional grant
+ * of patent rights can be found in the PATENTS file in the same directory.
+ */
+#pragma once
+
+#include <wdt/ByteSource.h>
+
+#include <condition_variable>
+#include <deque>
+#include <map>
+#include <mutex>
+#include <thread>
+#include <utility>
+
+namespace facebook {
+namespace wdt {
+
+/**
+ * Brings the blocks the sender threads are going to read next into the page
+ * cache, so that a thread picking its next block from the queue does not
+ * start cold. The blocks are advised with POSIX_FADV_WILLNEED on a background
+ * thread, and the data prefetched and not read yet stays within a memory
+ * budget. All the methods are thread safe.
+ */
+class Prefetcher {
+ public:
+  /// counters of the prefetches
+  struct Stats {
+    /// number of blocks prefetched
+    int64_t numPrefetched{0};
+    /// bytes of the blocks prefetched
+    int64_t prefetchedBytes{0};
+    /// number of blocks read
+    int64_t numReads{0};
+    /// number of blocks read once their prefetch was done
+    int64_t numHits{0};
+    /// number of blocks read before their prefetch was done
+    int64_t numLate{0};
+    /// number of blocks not prefetched because of the budget
+    int64_t numOverBudget{0};
+  };
+
+  /// @param budgetBytes  max bytes prefetched and not read yet
+  explicit Prefetcher(int64_t budgetBytes);
+
+  /// cancels the prefetches not started and joins the thread
+  ~Prefetcher();
+
+  /**
+   * Queues the prefetch of a block which is going to be read soon, unless it
+   * is already queued or the budget is used up. The metadata must outlive the
+   * prefetcher
+   */
+  void add(const SourceMetaData &metadata, int64_t offset, int64_t size);
+
+  /**
+   * Called when a block starts being read. Releases the budget of the block,
+   * a prefetch not started yet is cancelled
+   */
+  void markRead(const SourceMetaData &metadata, int64_t offset);
+
+  /**
+   * Called when a block is not going to be read as queued, because it is
+   * returned to the queue or split. Releases its budget without counting a
+   * read, a prefetch not started yet is cancelled
+   */
+  void release(const SourceMetaData &metadata, int64_t offset);
+
+  /// @return   counters of the prefetches so far
+  Stats getStats() const;
+
+  /// @return   one line summary of the counters, for the logs
+  std::string getSummary() const;
+
+ private:
+  /// (file, offset) of a block
+  typedef std::pair<const SourceMetaData *, int64_t> BlockKey;
+
+  /// a block queued or being prefetched
+  struct BlockStatus {
+    int64_t size{0};
+    /// whether the prefetch is done
+    bool done{false};
+  };
+
+  /// main loop of the prefetch thread
+  void prefetchLoop();
+
+  /// advises the kernel to read the block
+  void prefetchBlock(const SourceMetaData &metadata, int64_t offset,
+                     int64_t size);
+
+  const int64_t budgetBytes_;
+  /// bytes of the blocks of blocks_
+  int64_t reservedBytes_{0};
+  /// blocks prefetched or to be prefetched, not read yet
+  std::map<BlockKey, BlockStatus> blocks_;
+  /// blocks waiting for the prefetch thread, in order
+  std::deque<BlockKey> toPrefetch_;
+  Stats stats_;
+  /// set when the prefetcher is destroyed
+  bool stop_{false};
+  mutable std::mutex mutex_;
+  /// notified when blocks are queued
+  std::condition_variable workCond_;
+  std::thread prefetchThread_;
+};
+}
+}
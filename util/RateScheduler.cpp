@@ -0,0 +1,113 @@
+/**
+ * Copyright (c) 2014-present, Facebook, Inc.
+ * All rights reserved.
+ *
+ * This source code is licensed under the BSD-style license found in the
+ * LICENSE file in the root directory of this source tree. An additional grant
+ * of patent rights can be found in the PATENTS file in the same directory.
+ */
+#include <wdt/util/RateScheduler.h>
+
+#include <wdt/Reporting.h>
+
+namespace facebook {
+namespace wdt {
+
+const int kMinutesPerDay = 24 * 60;
+
+int RateSchedule::findWindow(const struct tm &localTime) const {
+  const int minute = localTime.tm_hour * 60 + localTime.tm_min;
+  const int today = localTime.tm_wday;
+  const int yesterday = (today + 6) % 7;
+  for (int i = 0; i < (int)windows.size(); i++) {
+    const Window &window = windows[i];
+    if (window.startMinute <= window.endMinute) {
+      if ((window.days & (1 << today)) && minute >= window.startMinute &&
+          minute < window.endMinute) {
+        return i;
+      }
+      continue;
+    }
+    // over midnight, the part after it belongs to the day it started on
+    if (((window.days & (1 << today)) && minute >= window.startMinute) ||
+        ((window.days & (1 << yesterday)) && minute < window.endMinute)) {
+      return i;
+    }
+  }
+  return -1;
+}
+
+const ThrottlerOptions &RateSchedule::getRates(int window) const {
+  return window < 0 ? defaultRates : windows[window].rates;
+}
+
+RateScheduler::RateScheduler(std::shared_ptr<Throttler> throttler,
+                             int64_t checkIntervalMillis)
+    : throttler_(std::move(throttler)),
+      checkIntervalMillis_(checkIntervalMillis) {
+}
+
+RateScheduler::~RateScheduler() {
+  {
+    std::lock_guard<std::mutex> lock(mutex_);
+    stopped_ = true;
+    cond_.notify_all();
+  }
+  if (scheduleThread_.joinable()) {
+    scheduleThread_.join();
+  }
+}
+
+void RateScheduler::setSchedule(const RateSchedule &schedule) {
+  for (const auto &window : schedule.windows) {
+    if (window.startMinute < 0 || window.startMinute >= kMinutesPerDay ||
+        window.endMinute < 0 || window.endMinute > kMinutesPerDay) {
+      WLOG(ERROR) << "Ignoring the schedule, invalid window "
+                  << window.startMinute << "-" << window.endMinute;
+      return;
+    }
+  }
+  std::lock_guard<std::mutex> lock(mutex_);
+  schedule_ = schedule;
+  scheduled_ = !schedule_.windows.empty();
+  WLOG(INFO) << "Rate schedule of " << schedule_.windows.size()
+             << " windows set";
+  applyScheduleLocked(/* force */ true);
+  if (scheduled_ && !scheduleThread_.joinable()) {
+    scheduleThread_ = std::thread(&RateScheduler::scheduleLoop, this);
+  }
+  cond_.notify_all();
+}
+
+void RateScheduler::setRates(const ThrottlerOptions &rates) {
+  std::lock_guard<std::mutex> lock(mutex_);
+  throttler_->setThrottlerRates(rates);
+}
+
+void RateScheduler::applyScheduleLocked(bool force) {
+  const time_t now = time(nullptr);
+  struct tm localTime;
+  localtime_r(&now, &localTime);
+  const int window = schedule_.findWindow(localTime);
+  if (!force && window == curWindow_) {
+    return;
+  }
+  WLOG(INFO) << "Applying the rates of the schedule window " << window;
+  curWindow_ = window;
+  throttler_->setThrottlerRates(schedule_.getRates(window));
+}
+
+void RateScheduler::scheduleLoop() {
+  std::unique_lock<std::mutex> lock(mutex_);
+  while (!stopped_) {
+    cond_.wait_for(lock, std::chrono::milliseconds(checkIntervalMillis_));
+    if (stopped_) {
+      break;
+    }
+    if (scheduled_) {
+      applyScheduleLocked(/* force */ false);
+    }
+  }
+}
+}
+}
@@ -0,0 +1,120 @@
+/**
+ * Copyright (c) 2014-present, Facebook, Inc.
+ * All rights reserved.
+ *
+ * This source code is licensed under the BSD-style license found in the
+ * LICENSE file in the root directory of this source tree. An additional grant
+ * of patent rights can be found in the PATENTS file in the same directory.
+ */
+#pragma once
+
+#include <wdt/Throttler.h>
+
+#include <condition_variable>
+#include <ctime>
+#include <memory>
+#include <mutex>
+#include <thread>
+#include <vector>
+
+namespace facebook {
+namespace wdt {
+
+/**
+ * Rates of a throttler by time of the day, e.g. 30% of the link during
+ * business hours and all of it at night
+ */
+struct RateSchedule {
+  /// all the days of the week, bit i being day i of struct tm (0 is sunday)
+  static const int kAllDays = 0x7F;
+
+  /// rates for a part of the day
+  struct Window {
+    /// minutes since midnight (local time) the window starts at, included
+    int startMinute{0};
+    /// minutes since midnight the window ends at, excluded. A window ending
+    /// before it starts goes over midnight
+    int endMinute{0};
+    /// days the window starts on, bit mask of tm_wday
+    int days{kAllDays};
+    /// avg_rate_per_sec, max_rate_per_sec and throttler_bucket_limit apply
+    ThrottlerOptions rates;
+  };
+
+  /// windows in order of priority, the first one containing a time applies
+  std::vector<Window> windows;
+  /// rates outside of the windows, unlimited by default
+  ThrottlerOptions defaultRates;
+
+  /**
+   * @param localTime   time of the day
+   *
+   * @return            index of the window containing localTime, -1 if none
+   */
+  int findWindow(const struct tm &localTime) const;
+
+  /// @return   rates of the window index returned by findWindow()
+  const ThrottlerOptions &getRates(int window) const;
+};
+
+/**
+ * Applies a rate schedule to a throttler while transfers use it, from a
+ * thread of its own, so that long transfers follow the schedule without
+ * being restarted. The rates can also be changed live, till the next window
+ * of the schedule starts. The throttler starts again from an empty bucket
+ * after each change, the new rates take effect without a burst.
+ * Thread safe.
+ */
+class RateScheduler {
+ public:
+  /**
+   * @param throttler         throttler whose rates are scheduled
+   * @param checkIntervalMillis interval between the checks of the schedule
+   */
+  explicit RateScheduler(std::shared_ptr<Throttler> throttler,
+                         int64_t checkIntervalMillis = 1000);
+
+  /// stops the schedule thread
+  ~RateScheduler();
+
+  /**
+   * Sets the schedule, applied right away. The thread checking the schedule
+   * is started with the first schedule, a schedule without windows stops
+   * the scheduling after applying its default rates
+   */
+  void setSchedule(const RateSchedule &schedule);
+
+  /// sets the rates of the throttler till the next window of the schedule
+  void setRates(const ThrottlerOptions &rates);
+
+  /// @return   the throttler scheduled
+  std::shared_ptr<Throttler> getThrottler() const {
+    return throttler_;
+  }
+
+  RateScheduler(const RateScheduler &that) = delete;
+  RateScheduler &operator=(const RateScheduler &that) = delete;
+
+ private:
+  /// applies the rates of the window of now if it changed, or if forced.
+  /// Has to be called with mutex_ held
+  void applyScheduleLocked(bool force);
+
+  /// main loop of the schedule thread
+  void scheduleLoop();
+
+  const std::shared_ptr<Throttler> throttler_;
+  const int64_t checkIntervalMillis_;
+  std::mutex mutex_;
+  RateSchedule schedule_;
+  /// whether a schedule with windows is set
+  bool scheduled_{false};
+  /// window applied last, -1 for the default rates
+  int curWindow_{-1};
+  bool stopped_{false};
+  /// notified on a new schedule or to stop the thread
+  std::condition_variable cond_;
+  std::thread scheduleThread_;
+};
+}
+}
@@ -0,0 +1,745 @@
+/**
+ * Copyright (c) 2014-present, Facebook, Inc.
+ * All rights reserved.
+ *
+ * This source code is licensed under the BSD-style license found in the
+ * LICENSE file in the root directory of this source tree. An additional grant
+ * of patent rights can be found in the PATENTS file in the same directory.
+ */
+#include <wdt/util/RdmaTransport.h>
+
+#include <wdt/Reporting.h>
+#include <wdt/util/BufferPool.h>
+
+#include <arpa/inet.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <poll.h>
+#include <string.h>
+#include <sys/socket.h>
+#include <unistd.h>
+#include <algorithm>
+#include <random>
+
+#ifdef WDT_HAS_RDMA
+#include <infiniband/verbs.h>
+#endif
+
+namespace facebook {
+namespace wdt {
+
+/// magic starting an encoded endpoint, catches a peer not doing rdma setup
+static const char kEndpointMagic[] = "WDTRDMA1";
+/// byte of a side wanting rdma, not the first byte of any wdt command
+const char kRdmaCapability = 0x72;  // (r)dma
+/// answer of a reader not wanting rdma
+const char kNoRdmaCapability = 0x00;
+/// immediate data of the write ending the stream
+const uint32_t kEofImm = 0xFFFFFFFF;
+/// max number of sends not completed
+const int kMaxSendWrs = 64;
+/// number of receives kept posted
+const int kNumRecvs = 128;
+/// max size of a single rdma write
+const int64_t kMaxWriteSize = 1024 * 1024;
+/// max size of a ring, the credits being 32 bits
+const int64_t kMaxRingSize = 1024 * 1024 * 1024;
+/// port of the device used
+const int kPort = 1;
+/// wr_id of the sends and of the receives
+const uint64_t kSendWrId = 0;
+const uint64_t kRecvWrId = 1;
+
+static void encodeUInt(char *&buf, uint64_t value, int numBytes) {
+  for (int i = numBytes - 1; i >= 0; i--) {
+    *buf++ = (char)((value >> (8 * i)) & 0xFF);
+  }
+}
+
+static uint64_t decodeUInt(const char *&buf, int numBytes) {
+  uint64_t value = 0;
+  for (int i = 0; i < numBytes; i++) {
+    value = (value << 8) | (uint8_t)*buf++;
+  }
+  return value;
+}
+
+void RdmaTransport::encodeEndpoint(const Endpoint &endpoint, char *buf) {
+  memcpy(buf, kEndpointMagic, 8);
+  buf += 8;
+  *buf++ = endpoint.valid ? 1 : 0;
+  encodeUInt(buf, endpoint.lid, 4);
+  encodeUInt(buf, endpoint.qpn, 4);
+  encodeUInt(buf, endpoint.psn, 4);
+  encodeUInt(buf, endpoint.rkey, 4);
+  encodeUInt(buf, endpoint.ringSize, 8);
+  encodeUInt(buf, endpoint.ringAddr, 8);
+  memcpy(buf, endpoint.gid, sizeof(endpoint.gid));
+}
+
+bool RdmaTransport::decodeEndpoint(const char *buf, Endpoint &endpoint) {
+  if (memcmp(buf, kEndpointMagic, 8) != 0) {
+    return false;
+  }
+  buf += 8;
+  endpoint.valid = (*buf++ != 0);
+  endpoint.lid = decodeUInt(buf, 4);
+  endpoint.qpn = decodeUInt(buf, 4);
+  endpoint.psn = decodeUInt(buf, 4);
+  endpoint.rkey = decodeUInt(buf, 4);
+  endpoint.ringSize = decodeUInt(buf, 8);
+  endpoint.ringAddr = decodeUInt(buf, 8);
+  memcpy(endpoint.gid, buf, sizeof(endpoint.gid));
+  return true;
+}
+
+ErrorCode RdmaTransport::negotiate(ThreadCtx &threadCtx, int fd,
+                                   bool isWriter, bool &useRdma) {
+  const WdtOptions &options = threadCtx.getOptions();
+  const int timeoutMs = options.read_timeout_millis;
+  const bool wantRdma = options.rdma_transport;
+  useRdma = false;
+  if (isWriter) {
+    if (!wantRdma) {
+      return OK;
+    }
+    char peerCapability = kNoRdmaCapability;
+    if (!exchangeSetup(fd, &kRdmaCapability, &peerCapability, 1, timeoutMs)) {
+      return CONN_ERROR;
+    }
+    useRdma = (peerCapability == kRdmaCapability);
+  } else {
+    // a writer wanting rdma speaks first, its first byte tells it. Only a
+    // reader wanting rdma waits for that byte: a writer without rdma may be
+    // waiting for the local checkpoint of the reader before writing anything
+    // (no fast_reconnect, or an older version), so the other readers only
+    // look at what already arrived
+    int ret = 1;
+    if (wantRdma) {
+      struct pollfd pollFd = {fd, POLLIN, 0};
+      do {
+        ret = poll(&pollFd, 1, timeoutMs);
+      } while (ret < 0 && errno == EINTR);
+    }
+    char firstByte = 0;
+    if (ret > 0) {
+      do {
+        ret = recv(fd, &firstByte, 1, MSG_PEEK | MSG_DONTWAIT);
+      } while (ret < 0 && errno == EINTR);
+    }
+    if (ret <= 0 || firstByte != kRdmaCapability) {
+      // left to the reads of the protocol, which report any error
+      if (wantRdma) {
+        WLOG(WARNING) << "Peer did not ask for rdma, using tcp for " << fd;
+      }
+      return OK;
+    }
+    const char capability = wantRdma ? kRdmaCapability : kNoRdmaCapability;
+    char peerCapability;
+    if (!exchangeSetup(fd, &capability, &peerCapability, 1, timeoutMs)) {
+      return CONN_ERROR;
+    }
+    useRdma = wantRdma;
+  }
+  if (wantRdma && !useRdma) {
+    WLOG(WARNING) << "rdma_transport not set on the peer, using tcp for "
+                  << fd;
+  }
+  return OK;
+}
+
+ErrorCode RdmaTransport::connect(ThreadCtx &threadCtx, int fd, bool isWriter,
+                                 std::unique_ptr<Transport> &transport) {
+  const int timeoutMs = threadCtx.getOptions().read_timeout_millis;
+  std::unique_ptr<RdmaTransport> rdma(
+      new RdmaTransport(threadCtx, fd, isWriter));
+  Endpoint local;
+  local.valid = rdma->init(local);
+  char localBuf[kEndpointLen];
+  char peerBuf[kEndpointLen];
+  encodeEndpoint(local, localBuf);
+  if (!exchangeSetup(fd, localBuf, peerBuf, kEndpointLen, timeoutMs)) {
+    return CONN_ERROR;
+  }
+  Endpoint peer;
+  if (!decodeEndpoint(peerBuf, peer)) {
+    WLOG(ERROR) << "Peer did not send its rdma setup, rdma_transport has to be "
+                << "set on both sides " << fd;
+    return CONN_ERROR;
+  }
+  if (!local.valid || !peer.valid) {
+    WLOG(WARNING) << "No rdma on " << (local.valid ? "the peer" : "this side")
+                  << ", using tcp for " << fd;
+    transport = std::make_unique<TcpTransport>(fd);
+    return OK;
+  }
+  // both sides have to be ready before the data is written
+  char ready = rdma->connectQp(local, peer) ? 1 : 0;
+  char peerReady = 0;
+  if (!exchangeSetup(fd, &ready, &peerReady, 1, timeoutMs) || !ready ||
+      !peerReady) {
+    WLOG(ERROR) << "Failed to connect the rdma queue pair of " << fd << " "
+                << (int)ready << " " << (int)peerReady;
+    return CONN_ERROR;
+  }
+  WVLOG(1) << "rdma transport ready for " << fd << ", ring of "
+           << rdma->ringSize_ << " bytes";
+  transport = std::move(rdma);
+  return OK;
+}
+
+RdmaTransport::RdmaTransport(ThreadCtx &threadCtx, int fd, bool isWriter)
+    : threadCtx_(threadCtx), fd_(fd), isWriter_(isWriter) {
+}
+
+RdmaTransport::~RdmaTransport() {
+  destroy();
+}
+
+int64_t RdmaTransport::getUnackedBytes() const {
+  if (!isWriter_) {
+    return -1;
+  }
+  return written_ - credited_;
+}
+
+#ifdef WDT_HAS_RDMA
+
+bool RdmaTransport::isSupported() {
+  return true;
+}
+
+bool RdmaTransport::init(Endpoint &endpoint) {
+  const WdtOptions &options = threadCtx_.getOptions();
+  int numDevices = 0;
+  ibv_device **devices = ibv_get_device_list(&numDevices);
+  if (devices == nullptr) {
+    WPLOG(WARNING) << "Unable to list the rdma devices";
+    return false;
+  }
+  ibv_device *device = nullptr;
+  for (int i = 0; i < numDevices; i++) {
+    if (options.rdma_device.empty() ||
+        options.rdma_device == ibv_get_device_name(devices[i])) {
+      device = devices[i];
+      break;
+    }
+  }
+  if (device == nullptr) {
+    WLOG(WARNING) << "rdma device " << options.rdma_device << " not found, "
+                  << numDevices << " devices";
+    ibv_free_device_list(devices);
+    return false;
+  }
+  context_ = ibv_open_device(device);
+  ibv_free_device_list(devices);
+  if (context_ == nullptr) {
+    WPLOG(WARNING) << "Unable to open rdma device " << options.rdma_device;
+    return false;
+  }
+  ibv_port_attr portAttr;
+  if (ibv_query_port(context_, kPort, &portAttr) != 0) {
+    WPLOG(WARNING) << "Unable to query the rdma port";
+    return false;
+  }
+  pd_ = ibv_alloc_pd(context_);
+  channel_ = pd_ ? ibv_create_comp_channel(context_) : nullptr;
+  if (channel_ == nullptr) {
+    WPLOG(WARNING) << "Unable to allocate the rdma protection domain/channel";
+    return false;
+  }
+  // the events are read without blocking, poll() waits for them
+  const int flags = fcntl(channel_->fd, F_GETFL);
+  if (flags < 0 || fcntl(channel_->fd, F_SETFL, flags | O_NONBLOCK) < 0) {
+    WPLOG(WARNING) << "Unable to make the rdma channel non blocking";
+    return false;
+  }
+  cq_ = ibv_create_cq(context_, kMaxSendWrs + kNumRecvs, nullptr, channel_, 0);
+  if (cq_ == nullptr) {
+    WPLOG(WARNING) << "Unable to create the rdma completion queue";
+    return false;
+  }
+  ibv_qp_init_attr qpInitAttr;
+  memset(&qpInitAttr, 0, sizeof(qpInitAttr));
+  qpInitAttr.send_cq = cq_;
+  qpInitAttr.recv_cq = cq_;
+  qpInitAttr.qp_type = IBV_QPT_RC;
+  qpInitAttr.cap.max_send_wr = kMaxSendWrs;
+  qpInitAttr.cap.max_recv_wr = kNumRecvs;
+  qpInitAttr.cap.max_send_sge = 1;
+  qpInitAttr.cap.max_recv_sge = 1;
+  qp_ = ibv_create_qp(pd_, &qpInitAttr);
+  if (qp_ == nullptr) {
+    WPLOG(WARNING) << "Unable to create the rdma queue pair";
+    return false;
+  }
+  const int64_t ringSize = std::min<int64_t>(
+      std::max<int64_t>(options.rdma_buffer_mbytes, 1) * kMbToB, kMaxRingSize);
+  if (options.buffer_pool_max_mbytes > 0) {
+    ring_ = BufferPool::get().acquire(ringSize, -1, false,
+                                      options.buffer_pool_max_mbytes * kMbToB);
+  } else {
+    ring_ = std::make_unique<Buffer>(ringSize);
+  }
+  if (ring_->getData() == nullptr) {
+    WLOG(WARNING) << "Unable to allocate the rdma ring of " << ringSize;
+    return false;
+  }
+  // only the ring of the reader is written by the peer
+  int access = IBV_ACCESS_LOCAL_WRITE;
+  if (!isWriter_) {
+    access |= IBV_ACCESS_REMOTE_WRITE;
+  }
+  ringMr_ = ibv_reg_mr(pd_, ring_->getData(), ringSize, access);
+  if (ringMr_ == nullptr) {
+    WPLOG(WARNING) << "Unable to register the rdma ring of " << ringSize;
+    return false;
+  }
+  static thread_local std::minstd_rand generator(std::random_device{}());
+  endpoint.lid = portAttr.lid;
+  endpoint.qpn = qp_->qp_num;
+  endpoint.psn = generator() & 0xFFFFFF;
+  endpoint.rkey = ringMr_->rkey;
+  endpoint.ringSize = ringSize;
+  endpoint.ringAddr = (uintptr_t)ring_->getData();
+  ibv_gid gid;
+  if (ibv_query_gid(context_, kPort, options.rdma_gid_index, &gid) == 0) {
+    memcpy(endpoint.gid, gid.raw, sizeof(endpoint.gid));
+  }
+  return true;
+}
+
+bool RdmaTransport::connectQp(const Endpoint &local, const Endpoint &peer) {
+  ibv_port_attr portAttr;
+  if (ibv_query_port(context_, kPort, &portAttr) != 0) {
+    WPLOG(ERROR) << "Unable to query the rdma port";
+    return false;
+  }
+  ibv_qp_attr attr;
+  memset(&attr, 0, sizeof(attr));
+  attr.qp_state = IBV_QPS_INIT;
+  attr.pkey_index = 0;
+  attr.port_num = kPort;
+  attr.qp_access_flags = IBV_ACCESS_LOCAL_WRITE | IBV_ACCESS_REMOTE_WRITE;
+  if (ibv_modify_qp(qp_, &attr, IBV_QP_STATE | IBV_QP_PKEY_INDEX |
+                                    IBV_QP_PORT | IBV_QP_ACCESS_FLAGS) != 0) {
+    WPLOG(ERROR) << "Unable to move the rdma queue pair to INIT";
+    return false;
+  }
+  for (int i = 0; i < kNumRecvs; i++) {
+    if (!postRecv()) {
+      return false;
+    }
+  }
+  memset(&attr, 0, sizeof(attr));
+  attr.qp_state = IBV_QPS_RTR;
+  attr.path_mtu = portAttr.active_mtu;
+  attr.dest_qp_num = peer.qpn;
+  attr.rq_psn = peer.psn;
+  attr.max_dest_rd_atomic = 1;
+  attr.min_rnr_timer = 12;
+  attr.ah_attr.dlid = peer.lid;
+  attr.ah_attr.port_num = kPort;
+  if (portAttr.link_layer == IBV_LINK_LAYER_ETHERNET || peer.lid == 0) {
+    // RoCE is routed by gid
+    attr.ah_attr.is_global = 1;
+    memcpy(attr.ah_attr.grh.dgid.raw, peer.gid, sizeof(peer.gid));
+    attr.ah_attr.grh.sgid_index = threadCtx_.getOptions().rdma_gid_index;
+    attr.ah_attr.grh.hop_limit = 64;
+  }
+  if (ibv_modify_qp(qp_, &attr,
+                    IBV_QP_STATE | IBV_QP_AV | IBV_QP_PATH_MTU |
+                        IBV_QP_DEST_QPN | IBV_QP_RQ_PSN |
+                        IBV_QP_MAX_DEST_RD_ATOMIC | IBV_QP_MIN_RNR_TIMER) !=
+      0) {
+    WPLOG(ERROR) << "Unable to move the rdma queue pair to RTR";
+    return false;
+  }
+  memset(&attr, 0, sizeof(attr));
+  attr.qp_state = IBV_QPS_RTS;
+  attr.timeout = 14;
+  attr.retry_cnt = 7;
+  // the receives are posted again as the reader processes them
+  attr.rnr_retry = 7;
+  attr.sq_psn = local.psn;
+  attr.max_rd_atomic = 1;
+  if (ibv_modify_qp(qp_, &attr,
+                    IBV_QP_STATE | IBV_QP_TIMEOUT | IBV_QP_RETRY_CNT |
+                        IBV_QP_RNR_RETRY | IBV_QP_SQ_PSN |
+                        IBV_QP_MAX_QP_RD_ATOMIC) != 0) {
+    WPLOG(ERROR) << "Unable to move the rdma queue pair to RTS";
+    return false;
+  }
+  ringSize_ = std::min(local.ringSize, peer.ringSize);
+  peerRingAddr_ = peer.ringAddr;
+  peerRkey_ = peer.rkey;
+  return true;
+}
+
+bool RdmaTransport::postRecv() {
+  // writes with immediate data and credits carry no payload to receive
+  ibv_recv_wr wr;
+  memset(&wr, 0, sizeof(wr));
+  wr.wr_id = kRecvWrId;
+  ibv_recv_wr *badWr = nullptr;
+  if (ibv_post_recv(qp_, &wr, &badWr) != 0) {
+    WPLOG(ERROR) << "Unable to post an rdma receive " << fd_;
+    failed_ = true;
+    return false;
+  }
+  return true;
+}
+
+void RdmaTransport::pollCompletions() {
+  // acknowledges the notifications, a new one has to be requested after
+  ibv_cq *eventCq = nullptr;
+  void *eventContext = nullptr;
+  while (ibv_get_cq_event(channel_, &eventCq, &eventContext) == 0) {
+    ibv_ack_cq_events(eventCq, 1);
+    notifyArmed_ = false;
+  }
+  ibv_wc wcs[16];
+  int numWcs;
+  while ((numWcs = ibv_poll_cq(cq_, 16, wcs)) > 0) {
+    for (int i = 0; i < numWcs; i++) {
+      const ibv_wc &wc = wcs[i];
+      numCompletions_++;
+      if (wc.wr_id == kSendWrId) {
+        sendsInFlight_--;
+      }
+      if (wc.status != IBV_WC_SUCCESS) {
+        WLOG(ERROR) << "rdma completion failed for " << fd_ << ": "
+                    << ibv_wc_status_str(wc.status);
+        failed_ = true;
+        continue;
+      }
+      if (wc.wr_id != kRecvWrId) {
+        continue;
+      }
+      const uint32_t imm = ntohl(wc.imm_data);
+      if (wc.opcode == IBV_WC_RECV_RDMA_WITH_IMM) {
+        if (imm == kEofImm) {
+          eof_ = true;
+        } else {
+          received_ += imm;
+        }
+      } else {
+        credited_ += imm;
+      }
+      postRecv();
+    }
+  }
+  if (numWcs < 0) {
+    WLOG(ERROR) << "Unable to poll the rdma completions of " << fd_;
+    failed_ = true;
+  }
+  if (!isWriter_) {
+    sendCredits();
+  }
+}
+
+bool RdmaTransport::waitForCompletions(int timeoutMs) {
+  if (!notifyArmed_) {
+    if (ibv_req_notify_cq(cq_, 0) != 0) {
+      WLOG(ERROR) << "Unable to request rdma completion events " << fd_;
+      failed_ = true;
+      return true;
+    }
+    notifyArmed_ = true;
+    // completions which came before the request
+    const int64_t numCompletions = numCompletions_;
+    pollCompletions();
+    if (numCompletions_ != numCompletions) {
+      return true;
+    }
+  }
+  struct pollfd pfds[2];
+  pfds[0].fd = channel_->fd;
+  pfds[0].events = POLLIN;
+  pfds[0].revents = 0;
+  // the writer sends nothing over tcp, the reader only sees it closing
+  pfds[1].fd = fd_;
+  pfds[1].events = POLLIN;
+  pfds[1].revents = 0;
+  const int numFds = isWriter_ ? 1 : 2;
+  if (::poll(pfds, numFds, timeoutMs > 0 ? timeoutMs : -1) <= 0) {
+    return false;
+  }
+  pollCompletions();
+  if (numFds > 1 && pfds[1].revents != 0) {
+    WVLOG(1) << "tcp connection of the rdma transport closed " << fd_;
+    eof_ = true;
+  }
+  return true;
+}
+
+void RdmaTransport::sendCredits() {
+  const int64_t credits = consumed_ - creditsSent_;
+  if (credits == 0 || failed_ || sendsInFlight_ >= kMaxSendWrs) {
+    return;
+  }
+  // the writer only waits once the ring is full, a quarter of it is read by
+  // then
+  if (credits < ringSize_ / 4) {
+    return;
+  }
+  ibv_send_wr wr;
+  memset(&wr, 0, sizeof(wr));
+  wr.wr_id = kSendWrId;
+  wr.opcode = IBV_WR_SEND_WITH_IMM;
+  wr.send_flags = IBV_SEND_SIGNALED;
+  wr.imm_data = htonl((uint32_t)credits);
+  ibv_send_wr *badWr = nullptr;
+  if (ibv_post_send(qp_, &wr, &badWr) != 0) {
+    WPLOG(ERROR) << "Unable to post rdma credits " << fd_;
+    failed_ = true;
+    return;
+  }
+  sendsInFlight_++;
+  creditsSent_ += credits;
+}
+
+bool RdmaTransport::waitForSends(int maxInFlight, int timeoutMs) {
+  const auto startTime = Clock::now();
+  pollCompletions();
+  while (sendsInFlight_ > maxInFlight && !failed_) {
+    int remainingMs = -1;
+    if (timeoutMs > 0) {
+      remainingMs = timeoutMs - durationMillis(Clock::now() - startTime);
+      if (remainingMs <= 0) {
+        return false;
+      }
+    }
+    waitForCompletions(remainingMs);
+  }
+  return !failed_;
+}
+
+int64_t RdmaTransport::read(char *buf, int64_t nbyte, int timeoutMs) {
+  if (isWriter_) {
+    return ::read(fd_, buf, nbyte);
+  }
+  pollCompletions();
+  while (received_ == consumed_ && !eof_ && !failed_) {
+    if (!waitForCompletions(timeoutMs)) {
+      errno = EAGAIN;
+      return -1;
+    }
+  }
+  if (received_ == consumed_) {
+    if (failed_) {
+      errno = EIO;
+      return -1;
+    }
+    return 0;
+  }
+  const int64_t offset = consumed_ % ringSize_;
+  const int64_t count =
+      std::min({nbyte, received_ - consumed_, ringSize_ - offset});
+  memcpy(buf, ring_->getData() + offset, count);
+  consumed_ += count;
+  sendCredits();
+  return count;
+}
+
+int64_t RdmaTransport::write(const char *buf, int64_t nbyte, int timeoutMs) {
+  if (!isWriter_) {
+    return ::write(fd_, buf, nbyte);
+  }
+  pollCompletions();
+  while (!failed_ &&
+         (written_ - credited_ >= ringSize_ || sendsInFlight_ >= kMaxSendWrs)) {
+    if (!waitForCompletions(timeoutMs)) {
+      errno = EAGAIN;
+      return -1;
+    }
+  }
+  if (failed_) {
+    errno = EIO;
+    return -1;
+  }
+  // a write never wraps around the end of the ring
+  const int64_t offset = written_ % ringSize_;
+  const int64_t count =
+      std::min({nbyte, ringSize_ - (written_ - credited_),
+                ringSize_ - offset, kMaxWriteSize});
+  char *data = ring_->getData() + offset;
+  memcpy(data, buf, count);
+  ibv_sge sge;
+  sge.addr = (uintptr_t)data;
+  sge.length = count;
+  sge.lkey = ringMr_->lkey;
+  ibv_send_wr wr;
+  memset(&wr, 0, sizeof(wr));
+  wr.wr_id = kSendWrId;
+  wr.sg_list = &sge;
+  wr.num_sge = 1;
+  wr.opcode = IBV_WR_RDMA_WRITE_WITH_IMM;
+  wr.send_flags = IBV_SEND_SIGNALED;
+  wr.imm_data = htonl((uint32_t)count);
+  wr.wr.rdma.remote_addr = peerRingAddr_ + offset;
+  wr.wr.rdma.rkey = peerRkey_;
+  ibv_send_wr *badWr = nullptr;
+  if (ibv_post_send(qp_, &wr, &badWr) != 0) {
+    WPLOG(ERROR) << "Unable to post an rdma write " << fd_ << " " << count;
+    failed_ = true;
+    errno = EIO;
+    return -1;
+  }
+  sendsInFlight_++;
+  written_ += count;
+  return count;
+}
+
+bool RdmaTransport::isReadable() {
+  if (isWriter_) {
+    struct pollfd pfd;
+    pfd.fd = fd_;
+    pfd.events = POLLIN;
+    pfd.revents = 0;
+    return ::poll(&pfd, 1, 0) > 0;
+  }
+  pollCompletions();
+  if (received_ == consumed_ && !eof_ && !failed_ && !notifyArmed_) {
+    // the poll fd becomes readable with the next completion
+    if (ibv_req_notify_cq(cq_, 0) == 0) {
+      notifyArmed_ = true;
+      pollCompletions();
+    }
+  }
+  return received_ > consumed_ || eof_ || failed_;
+}
+
+int RdmaTransport::getPollFd() const {
+  return isWriter_ ? fd_ : channel_->fd;
+}
+
+int RdmaTransport::shutdownWrites() {
+  if (isWriter_) {
+    const int timeoutMs = threadCtx_.getOptions().write_timeout_millis;
+    if (!waitForSends(kMaxSendWrs - 1, timeoutMs)) {
+      errno = EIO;
+      return -1;
+    }
+    // zero length write, ordered after the data
+    ibv_send_wr wr;
+    memset(&wr, 0, sizeof(wr));
+    wr.wr_id = kSendWrId;
+    wr.opcode = IBV_WR_RDMA_WRITE_WITH_IMM;
+    wr.send_flags = IBV_SEND_SIGNALED;
+    wr.imm_data = htonl(kEofImm);
+    wr.wr.rdma.remote_addr = peerRingAddr_;
+    wr.wr.rdma.rkey = peerRkey_;
+    ibv_send_wr *badWr = nullptr;
+    if (ibv_post_send(qp_, &wr, &badWr) != 0) {
+      WPLOG(ERROR) << "Unable to post the rdma end of stream " << fd_;
+      failed_ = true;
+      return -1;
+    }
+    sendsInFlight_++;
+    // the data has to be received before the tcp connection closes
+    if (!waitForSends(0, timeoutMs)) {
+      errno = EIO;
+      return -1;
+    }
+  }
+  return ::shutdown(fd_, SHUT_WR);
+}
+
+void RdmaTransport::destroy() {
+  if (qp_ != nullptr) {
+    ibv_destroy_qp(qp_);
+    qp_ = nullptr;
+  }
+  if (ringMr_ != nullptr) {
+    ibv_dereg_mr(ringMr_);
+    ringMr_ = nullptr;
+  }
+  if (cq_ != nullptr) {
+    ibv_destroy_cq(cq_);
+    cq_ = nullptr;
+  }
+  if (channel_ != nullptr) {
+    ibv_destroy_comp_channel(channel_);
+    channel_ = nullptr;
+  }
+  if (pd_ != nullptr) {
+    ibv_dealloc_pd(pd_);
+    pd_ = nullptr;
+  }
+  if (context_ != nullptr) {
+    ibv_close_device(context_);
+    context_ = nullptr;
+  }
+  const WdtOptions &options = threadCtx_.getOptions();
+  if (ring_ != nullptr && options.buffer_pool_max_mbytes > 0) {
+    BufferPool::get().release(std::move(ring_),
+                              options.buffer_pool_max_mbytes * kMbToB);
+  }
+  ring_.reset();
+}
+
+#else
+
+bool RdmaTransport::isSupported() {
+  return false;
+}
+
+bool RdmaTransport::init(Endpoint & /* endpoint */) {
+  WLOG(WARNING) << "rdma transport not supported by this build";
+  return false;
+}
+
+bool RdmaTransport::connectQp(const Endpoint & /* local */,
+                              const Endpoint & /* peer */) {
+  return false;
+}
+
+bool RdmaTransport::postRecv() {
+  return false;
+}
+
+void RdmaTransport::pollCompletions() {
+}
+
+bool RdmaTransport::waitForCompletions(int /* timeoutMs */) {
+  return false;
+}
+
+void RdmaTransport::sendCredits() {
+}
+
+bool RdmaTransport::waitForSends(int /* maxInFlight */, int /* timeoutMs */) {
+  return false;
+}
+
+int64_t RdmaTransport::read(char * /* buf */, int64_t /* nbyte */,
+                            int /* timeoutMs */) {
+  errno = ENOSYS;
+  return -1;
+}
+
+int64_t RdmaTransport::write(const char * /* buf */, int64_t /* nbyte */,
+                             int /* timeoutMs */) {
+  errno = ENOSYS;
+  return -1;
+}
+
+bool RdmaTransport::isReadable() {
+  return false;
+}
+
+int RdmaTransport::getPollFd() const {
+  return fd_;
+}
+
+int RdmaTransport::shutdownWrites() {
+  return ::shutdown(fd_, SHUT_WR);
+}
+
+void RdmaTransport::destroy() {
+}
+
+#endif
+}
+}
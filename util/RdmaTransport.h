@@ -0,0 +1,197 @@
+/**
+ * Copyright (c) 2014-present, Facebook, Inc.
+ * All rights reserved.
+ *
+ * This source code is licensed under the BSD-style license found in the
+ * LICENSE file in the root directory of this source tree. An additional grant
+ * of patent rights can be found in the PATENTS file in the same directory.
+ */
+#pragma once
+
+#include <wdt/ErrorCodes.h>
+#include <wdt/WdtConfig.h>
+#include <wdt/util/CommonImpl.h>
+#include <wdt/util/Transport.h>
+
+#include <memory>
+
+struct ibv_context;
+struct ibv_pd;
+struct ibv_comp_channel;
+struct ibv_cq;
+struct ibv_qp;
+struct ibv_mr;
+
+namespace facebook {
+namespace wdt {
+
+/**
+ * Transport moving the data of one direction of a connection over rdma
+ * (reliable connected queue pair), the other direction staying on the tcp
+ * connection. The writer copies the data into its registered ring and writes
+ * it with one-sided rdma writes at the same offsets of the ring of the
+ * reader, the immediate data of each write telling its size. The reader
+ * gives back the space of the ring it has read with credits (sends with
+ * immediate data). The end of the stream is a zero length write.
+ * The rdma endpoints are exchanged over the tcp connection, once both sides
+ * agreed on rdma with negotiate(). If either side doesn't set rdma_transport
+ * or can't do rdma (no device, or a build without libibverbs), both keep tcp.
+ * Not thread safe, like the socket using it.
+ */
+class RdmaTransport : public Transport {
+ public:
+  /// rdma connection info exchanged over tcp
+  struct Endpoint {
+    /// whether the side can do rdma, the other fields are not set otherwise
+    bool valid{false};
+    uint32_t lid{0};
+    uint32_t qpn{0};
+    uint32_t psn{0};
+    uint32_t rkey{0};
+    int64_t ringSize{0};
+    uint64_t ringAddr{0};
+    uint8_t gid[16] = {0};
+  };
+
+  /// length of an encoded endpoint
+  static const int kEndpointLen = 8 + 1 + 4 * 4 + 8 + 8 + 16;
+
+  /**
+   * Agrees with the peer on using rdma, before anything else is exchanged on
+   * a connection just established. The writer (the client) announces it
+   * wants rdma with a capability byte no wdt command starts with, answered
+   * by the reader with the same byte or not. A reader with rdma_transport
+   * waits for that byte, the others only look for it in the data already
+   * received, without waiting nor consuming the data of a writer not sending
+   * it, so that rdma_transport set on one side only falls back to tcp
+   *
+   * @param threadCtx   context of the thread of the socket
+   * @param fd          connected socket
+   * @param isWriter    true on the side writing the data (the sender)
+   * @param useRdma     set to whether both sides want rdma
+   *
+   * @return            OK, CONN_ERROR if the exchange failed
+   */
+  static ErrorCode negotiate(ThreadCtx &threadCtx, int fd, bool isWriter,
+                             bool &useRdma);
+
+  /**
+   * Sets up the transport of a connection both sides agreed to use rdma on,
+   * exchanging the rdma endpoints with the peer over fd
+   *
+   * @param threadCtx   context of the thread of the socket
+   * @param fd          connected socket
+   * @param isWriter    true on the side writing the data (the sender)
+   * @param transport   set to the rdma transport, or to tcp if either side
+   *                    can't do rdma
+   *
+   * @return            OK, CONN_ERROR if the exchange failed
+   */
+  static ErrorCode connect(ThreadCtx &threadCtx, int fd, bool isWriter,
+                           std::unique_ptr<Transport> &transport);
+
+  /// @return   whether this build has rdma
+  static bool isSupported();
+
+  /// encodes/decodes an endpoint, decode returns false on a bad magic
+  static void encodeEndpoint(const Endpoint &endpoint, char *buf);
+  static bool decodeEndpoint(const char *buf, Endpoint &endpoint);
+
+  ~RdmaTransport() override;
+
+  int64_t read(char *buf, int64_t nbyte, int timeoutMs) override;
+
+  int64_t write(const char *buf, int64_t nbyte, int timeoutMs) override;
+
+  bool isReadable() override;
+
+  int getPollFd() const override;
+
+  int shutdownWrites() override;
+
+  bool isDataOnFd() const override {
+    return false;
+  }
+
+  int64_t getUnackedBytes() const override;
+
+  std::string getName() const override {
+    return "rdma";
+  }
+
+ private:
+  RdmaTransport(ThreadCtx &threadCtx, int fd, bool isWriter);
+
+  /**
+   * Opens the device and creates the queue pair and the ring
+   *
+   * @param endpoint    set to the endpoint of this side
+   *
+   * @return            whether rdma can be used on this side
+   */
+  bool init(Endpoint &endpoint);
+
+  /// connects the queue pair to the peer and posts the receives
+  bool connectQp(const Endpoint &local, const Endpoint &peer);
+
+  /// posts a receive for the next write/credit of the peer
+  bool postRecv();
+
+  /// processes the completions available, without waiting
+  void pollCompletions();
+
+  /**
+   * Waits for new completions and processes them
+   *
+   * @return    false if none came before the timeout
+   */
+  bool waitForCompletions(int timeoutMs);
+
+  /// sends the credits of the data read once there are enough of them
+  void sendCredits();
+
+  /// waits till at most maxInFlight sends are not completed
+  bool waitForSends(int maxInFlight, int timeoutMs);
+
+  /// releases the rdma resources and the ring
+  void destroy();
+
+  ThreadCtx &threadCtx_;
+  /// tcp connection, not owned
+  const int fd_;
+  const bool isWriter_;
+
+  ibv_context *context_{nullptr};
+  ibv_pd *pd_{nullptr};
+  ibv_comp_channel *channel_{nullptr};
+  ibv_cq *cq_{nullptr};
+  ibv_qp *qp_{nullptr};
+  ibv_mr *ringMr_{nullptr};
+  /// staging ring of the writer, ring written by the peer for the reader
+  std::unique_ptr<Buffer> ring_;
+  /// size of the ring used, the smallest of both sides
+  int64_t ringSize_{0};
+  /// ring of the reader, for the writer
+  uint64_t peerRingAddr_{0};
+  uint32_t peerRkey_{0};
+  /// whether the cq notification is requested
+  bool notifyArmed_{false};
+  /// whether a completion failed, the transport is unusable then
+  bool failed_{false};
+
+  /// writer: bytes written, bytes given back by the reader
+  int64_t written_{0};
+  int64_t credited_{0};
+  /// reader: bytes received, bytes read, bytes given back
+  int64_t received_{0};
+  int64_t consumed_{0};
+  int64_t creditsSent_{0};
+  /// reader: whether the end of the stream was received
+  bool eof_{false};
+  /// sends not completed yet
+  int sendsInFlight_{0};
+  /// number of completions processed
+  int64_t numCompletions_{0};
+};
+}
+}
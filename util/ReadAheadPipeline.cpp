@@ -0,0 +1,245 @@
+/**
+ * Copyright (c) 2014-present, Facebook, Inc.
+ * All rights reserved.
+ *
+ * This source code is licensed under the BSD-style license found in the
+ * LICENSE file in the root directory of this source tree. An additional grant
+ * of patent rights can be found in the PATENTS file in the same directory.
+ */
+#include <wdt/util/ReadAheadPipeline.h>
+
+#include <algorithm>
+
+namespace facebook {
+namespace wdt {
+
+ReadAheadPipeline::ReadAheadPipeline(ThreadCtx &threadCtx)
+    : threadCtx_(threadCtx),
+      readerCtx_(std::make_unique<ThreadCtx>(threadCtx.getOptions(), false,
+                                             threadCtx.getThreadIndex())) {
+  const int numBuffers = threadCtx_.getNumBuffers();
+  // buffer 0 stays with the owning thread for its own socket reads
+  WDT_CHECK_GE(numBuffers, 3);
+  for (int i = numBuffers - 1; i >= 1; i--) {
+    freeBuffers_.push_back(i);
+  }
+  readerThread_ = std::thread(&ReadAheadPipeline::readLoop, this);
+}
+
+ReadAheadPipeline::~ReadAheadPipeline() {
+  {
+    std::lock_guard<std::mutex> lock(mutex_);
+    stop_ = true;
+  }
+  cond_.notify_all();
+  readerThread_.join();
+  std::lock_guard<std::mutex> lock(mutex_);
+  mergeReaderStats();
+}
+
+void ReadAheadPipeline::addSource(ByteSource *source) {
+  {
+    std::lock_guard<std::mutex> lock(mutex_);
+    toRead_.push_back(source);
+  }
+  cond_.notify_all();
+}
+
+char *ReadAheadPipeline::read(ByteSource *source, int64_t &size) {
+  std::unique_lock<std::mutex> lock(mutex_);
+  if (consumedBuffer_ >= 0) {
+    freeBuffers_.push_back(consumedBuffer_);
+    consumedBuffer_ = -1;
+    cond_.notify_all();
+  }
+  WDT_CHECK(!readyChunks_.empty() || !toRead_.empty())
+      << "Reading " << source->getIdentifier() << " not in the pipeline";
+  cond_.wait(lock, [this] { return !readyChunks_.empty(); });
+  Chunk chunk = readyChunks_.front();
+  readyChunks_.pop_front();
+  WDT_CHECK(chunk.source == source)
+      << "Out of order read " << source->getIdentifier() << " "
+      << chunk.source->getIdentifier();
+  size = chunk.size;
+  consumedBuffer_ = chunk.bufferIndex;
+  consumedData_ = chunk.data;
+  return chunk.data;
+}
+
+const char *ReadAheadPipeline::holdBuffer() {
+  std::lock_guard<std::mutex> lock(mutex_);
+  WDT_CHECK_GE(consumedBuffer_, 0) << "No chunk to hold";
+  heldBuffers_.emplace_back(consumedBuffer_, consumedData_);
+  consumedBuffer_ = -1;
+  return consumedData_;
+}
+
+void ReadAheadPipeline::releaseBuffer(const char *data) {
+  {
+    std::lock_guard<std::mutex> lock(mutex_);
+    auto it = std::find_if(
+        heldBuffers_.begin(), heldBuffers_.end(),
+        [data](const std::pair<int, const char *> &held) {
+          return held.second == data;
+        });
+    WDT_CHECK(it != heldBuffers_.end()) << "Releasing a buffer not held";
+    freeBuffers_.push_back(it->first);
+    heldBuffers_.erase(it);
+  }
+  cond_.notify_all();
+}
+
+bool ReadAheadPipeline::isIdle() {
+  std::lock_guard<std::mutex> lock(mutex_);
+  return toRead_.empty();
+}
+
+void ReadAheadPipeline::cancel() {
+  std::unique_lock<std::mutex> lock(mutex_);
+  generation_++;
+  // an asynchronous read loop may be waiting for buffers
+  cond_.notify_all();
+  toRead_.clear();
+  for (const auto &chunk : readyChunks_) {
+    if (chunk.bufferIndex >= 0) {
+      freeBuffers_.push_back(chunk.bufferIndex);
+    }
+  }
+  readyChunks_.clear();
+  if (consumedBuffer_ >= 0) {
+    freeBuffers_.push_back(consumedBuffer_);
+    consumedBuffer_ = -1;
+  }
+  cond_.wait(lock, [this] { return !reading_; });
+  mergeReaderStats();
+}
+
+void ReadAheadPipeline::mergeReaderStats() {
+  threadCtx_.getPerfReport() += readerCtx_->getPerfReport();
+  readerCtx_ = std::make_unique<ThreadCtx>(
+      threadCtx_.getOptions(), false, threadCtx_.getThreadIndex());
+}
+
+void ReadAheadPipeline::readLoop() {
+  std::unique_lock<std::mutex> lock(mutex_);
+  while (true) {
+    cond_.wait(lock, [this] {
+      return stop_ || (!toRead_.empty() && !freeBuffers_.empty());
+    });
+    if (stop_) {
+      return;
+    }
+    ByteSource *source = toRead_.front();
+    if (source->supportsAsyncReads()) {
+      readAsyncSource(lock, source);
+      continue;
+    }
+    const int bufferIndex = freeBuffers_.back();
+    freeBuffers_.pop_back();
+    const int64_t generation = generation_;
+    ThreadCtx *readerCtx = readerCtx_.get();
+    reading_ = true;
+    lock.unlock();
+
+    Chunk chunk;
+    chunk.source = source;
+    source->setReadBuffer(threadCtx_.getBuffer(bufferIndex));
+    source->setReadThreadCtx(readerCtx);
+    chunk.data = source->read(chunk.size);
+    const bool sourceDone =
+        (chunk.data == nullptr || source->finished() || source->hasError());
+    source->setReadThreadCtx(nullptr);
+
+    lock.lock();
+    reading_ = false;
+    if (generation != generation_) {
+      // cancelled while reading, source is not ours anymore
+      freeBuffers_.push_back(bufferIndex);
+      cond_.notify_all();
+      continue;
+    }
+    if (chunk.data != nullptr) {
+      chunk.bufferIndex = bufferIndex;
+      readyChunks_.push_back(chunk);
+    } else {
+      freeBuffers_.push_back(bufferIndex);
+    }
+    if (sourceDone) {
+      // end of source marker
+      Chunk end;
+      end.source = source;
+      readyChunks_.push_back(end);
+      toRead_.pop_front();
+    }
+    cond_.notify_all();
+  }
+}
+
+void ReadAheadPipeline::readAsyncSource(std::unique_lock<std::mutex> &lock,
+                                        ByteSource *source) {
+  const int64_t generation = generation_;
+  // buffers of the reads in flight, in submission order
+  std::deque<int> pendingBuffers;
+  bool allSubmitted = false;
+  reading_ = true;
+  source->setReadThreadCtx(readerCtx_.get());
+  while (true) {
+    const bool cancelled = (stop_ || generation != generation_);
+    while (!allSubmitted && !cancelled && !freeBuffers_.empty()) {
+      const int bufferIndex = freeBuffers_.back();
+      freeBuffers_.pop_back();
+      const Buffer *buffer = threadCtx_.getBuffer(bufferIndex);
+      lock.unlock();
+      const int64_t submitted =
+          source->submitRead(buffer->getData(), buffer->getSize());
+      lock.lock();
+      if (submitted > 0) {
+        pendingBuffers.push_back(bufferIndex);
+        continue;
+      }
+      freeBuffers_.push_back(bufferIndex);
+      WLOG_IF(ERROR, submitted < 0) << "Unable to submit a read of "
+                                    << source->getIdentifier();
+      allSubmitted = true;
+    }
+    if (pendingBuffers.empty()) {
+      if (allSubmitted || cancelled) {
+        break;
+      }
+      // every buffer is held by the consumer
+      cond_.wait(lock, [&] {
+        return stop_ || generation != generation_ || !freeBuffers_.empty();
+      });
+      continue;
+    }
+    lock.unlock();
+    Chunk chunk;
+    chunk.source = source;
+    chunk.data = source->waitForRead(chunk.size);
+    lock.lock();
+    const int bufferIndex = pendingBuffers.front();
+    pendingBuffers.pop_front();
+    if (chunk.data == nullptr || stop_ || generation != generation_) {
+      // error or cancelled, the reads in flight are still waited for as they
+      // use the buffers
+      freeBuffers_.push_back(bufferIndex);
+      allSubmitted = true;
+    } else {
+      chunk.bufferIndex = bufferIndex;
+      readyChunks_.push_back(chunk);
+    }
+    cond_.notify_all();
+  }
+  source->setReadThreadCtx(nullptr);
+  reading_ = false;
+  if (!stop_ && generation == generation_) {
+    // end of source marker
+    Chunk end;
+    end.source = source;
+    readyChunks_.push_back(end);
+    toRead_.pop_front();
+  }
+  cond_.notify_all();
+}
+}
+}
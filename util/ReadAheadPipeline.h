@@ -0,0 +1,143 @@
+/**
+ * Copyright (c) 2014-present, Facebook, Inc.
+ * All rights reserved.
+ *
+ * This source code is licensed under the BSD-style license found in the
+ * LICENSE file in the root directory of this source tree. An additional grant
+ * of patent rights can be found in the PATENTS file in the same directory.
+ */
+#pragma once
+
+#include <wdt/ByteSource.h>
+#include <wdt/util/CommonImpl.h>
+
+#include <condition_variable>
+#include <deque>
+#include <memory>
+#include <mutex>
+#include <thread>
+#include <utility>
+#include <vector>
+
+namespace facebook {
+namespace wdt {
+
+/**
+ * Reads byte sources on a background thread so that disk reads of the next
+ * chunks overlap with the socket writes of the current one. Chunks are read
+ * into the extra buffers of the owning thread's ThreadCtx, in the order the
+ * sources were added. While a source is in the pipeline only the background
+ * thread calls read() on it, the owner must only consume chunks through
+ * read() below, till the end of the source is reached or cancel() returns.
+ * Sources supporting asynchronous reads get a read submitted into each free
+ * buffer instead, so that many reads are in flight. The reads are accounted in
+ * a context of the reader thread, merged into the owner's perf report by
+ * cancel() and on destruction.
+ */
+class ReadAheadPipeline {
+ public:
+  /**
+   * @param threadCtx     context of the owning thread, its extra buffers are
+   *                      used for reading. Must have at least 2
+   */
+  explicit ReadAheadPipeline(ThreadCtx &threadCtx);
+
+  /// stops and joins the reader thread, merges its perf stats
+  ~ReadAheadPipeline();
+
+  /**
+   * Queues an opened source for reading after the ones already added. The
+   * owner keeps ownership of the source.
+   */
+  void addSource(ByteSource *source);
+
+  /**
+   * Returns next chunk of the oldest source in the pipeline, blocking till it
+   * is read. Buffer of the chunk returned by the previous call can be reused
+   * by the reader after this call.
+   *
+   * @param source    source being consumed, must be the oldest added
+   * @param size      set to the size of the chunk, 0 at end of the source
+   *
+   * @return          pointer to the data, nullptr once the source is
+   *                  completely read or a read error happened. At that point
+   *                  the source has left the pipeline
+   */
+  char *read(ByteSource *source, int64_t &size);
+
+  /**
+   * Keeps the buffer of the chunk last returned by read() from being read
+   * into again till releaseBuffer(), e.g. while zero copy writes of it are in
+   * flight. Held buffers stay held across cancel().
+   *
+   * @return    data of the chunk
+   */
+  const char *holdBuffer();
+
+  /// makes the buffer of a chunk held by holdBuffer() available for reading
+  void releaseBuffer(const char *data);
+
+  /// @return   true if every source added has been completely read
+  bool isIdle();
+
+  /**
+   * Drops all the sources and chunks in the pipeline. When this returns the
+   * reader thread is not accessing any of the added sources anymore, and the
+   * perf stats of its reads are merged into the owner's report.
+   */
+  void cancel();
+
+ private:
+  /// main loop of the reader thread
+  void readLoop();
+
+  /**
+   * Adds the perf stats of the reader thread to the owner's report and resets
+   * them. Called with the lock held, while the reader thread is not reading
+   */
+  void mergeReaderStats();
+
+  /**
+   * Reads a source supporting asynchronous reads till its end or cancel(),
+   * with a read in flight in each free buffer. Called by the reader thread
+   * with the lock held
+   */
+  void readAsyncSource(std::unique_lock<std::mutex> &lock, ByteSource *source);
+
+  /// one chunk read from a source
+  struct Chunk {
+    ByteSource *source{nullptr};
+    char *data{nullptr};
+    int64_t size{0};
+    /// index of the ThreadCtx buffer holding data, -1 for end of source
+    int bufferIndex{-1};
+  };
+
+  ThreadCtx &threadCtx_;
+  /// context the reader thread accounts its reads in
+  std::unique_ptr<ThreadCtx> readerCtx_;
+  /// sources left to be read, the first one is being read
+  std::deque<ByteSource *> toRead_;
+  /// chunks read and not consumed yet
+  std::deque<Chunk> readyChunks_;
+  /// indices of buffers available for reading
+  std::vector<int> freeBuffers_;
+  /// buffer of the chunk last returned by read(), -1 if none
+  int consumedBuffer_{-1};
+  /// data of the chunk last returned by read()
+  const char *consumedData_{nullptr};
+  /// buffers held by the owner, with the data of their chunk
+  std::vector<std::pair<int, const char *>> heldBuffers_;
+  /// whether the reader thread is currently reading a chunk
+  bool reading_{false};
+  /// incremented by cancel(), to discard chunks read before it
+  int64_t generation_{0};
+  /// set when the pipeline is destroyed
+  bool stop_{false};
+  std::mutex mutex_;
+  /// notified when something changes in the pipeline
+  std::condition_variable cond_;
+  std::thread readerThread_;
+};
+}
+}
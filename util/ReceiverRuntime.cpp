@@ -0,0 +1,283 @@
+/**
+ * Copyright (c) 2014-present, Facebook, Inc.
+ * All rights reserved.
+ *
+ * This source code is licensed under the BSD-style license found in the
+ * LICENSE file in the root directory of this source tree. An additional grant
+ * of patent rights can be found in the PATENTS file in the same directory.
+ */
+#include <wdt/util/ReceiverRuntime.h>
+
+#include <wdt/ErrorCodes.h>
+
+#include <unistd.h>
+#include <algorithm>
+#ifdef __linux__
+#include <sys/epoll.h>
+#include <sys/eventfd.h>
+#endif
+
+namespace facebook {
+namespace wdt {
+
+ReceiverRuntime::ReceiverRuntime(int numThreads) {
+#ifdef __linux__
+  epollFd_ = epoll_create1(EPOLL_CLOEXEC);
+  if (epollFd_ < 0) {
+    WPLOG(ERROR) << "Failed to create the epoll set of the receiver runtime";
+    return;
+  }
+  eventFd_ = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+  struct epoll_event event;
+  event.events = EPOLLIN;
+  event.data.ptr = nullptr;
+  if (eventFd_ < 0 ||
+      epoll_ctl(epollFd_, EPOLL_CTL_ADD, eventFd_, &event) != 0) {
+    WPLOG(ERROR) << "Failed to create the eventfd of the receiver runtime";
+    if (eventFd_ >= 0) {
+      close(eventFd_);
+      eventFd_ = -1;
+    }
+    close(epollFd_);
+    epollFd_ = -1;
+    return;
+  }
+  numThreads = std::max(1, numThreads);
+  for (int i = 0; i < numThreads; i++) {
+    workers_.emplace_back(&ReceiverRuntime::runTasks, this);
+  }
+  poller_ = std::thread(&ReceiverRuntime::pollTasks, this);
+  WLOG(INFO) << "Receiver runtime started with " << numThreads << " threads";
+#else
+  WLOG(ERROR) << "Receiver runtime is only supported on linux";
+#endif
+}
+
+ReceiverRuntime::~ReceiverRuntime() {
+  if (!isValid()) {
+    return;
+  }
+  {
+    std::lock_guard<std::mutex> lock(mutex_);
+    if (!tasks_.empty()) {
+      WLOG(ERROR) << "Receiver runtime destroyed with " << tasks_.size()
+                  << " tasks";
+    }
+    stop_ = true;
+  }
+  readyCond_.notify_all();
+  notifyPoller();
+  for (auto &worker : workers_) {
+    worker.join();
+  }
+  poller_.join();
+  close(eventFd_);
+  close(epollFd_);
+}
+
+void ReceiverRuntime::start(RuntimeTask *task, const std::string &group) {
+  WDT_CHECK(isValid());
+  {
+    std::lock_guard<std::mutex> lock(mutex_);
+    auto res = tasks_.emplace(task, TaskState());
+    WDT_CHECK(res.second) << "task already started in the runtime";
+    res.first->second.group = &groups_[group];
+    readyTasks_.push_back(task);
+  }
+  readyCond_.notify_one();
+}
+
+void ReceiverRuntime::setGroupLimit(const std::string &group, int maxRunning) {
+  {
+    std::lock_guard<std::mutex> lock(mutex_);
+    groups_[group].maxRunning = std::max(0, maxRunning);
+  }
+  // tasks of the group may be runnable now
+  readyCond_.notify_all();
+}
+
+std::deque<RuntimeTask *>::iterator ReceiverRuntime::findRunnableLocked() {
+  return std::find_if(
+      readyTasks_.begin(), readyTasks_.end(), [this](RuntimeTask *task) {
+        const GroupState *group = tasks_[task].group;
+        return group->maxRunning == 0 || group->numRunning < group->maxRunning;
+      });
+}
+
+void ReceiverRuntime::waitForEnd(RuntimeTask *task) {
+  std::unique_lock<std::mutex> lock(mutex_);
+  auto it = tasks_.find(task);
+  WDT_CHECK(it != tasks_.end()) << "task not started in the runtime";
+  doneCond_.wait(lock, [&] { return it->second.status == DONE; });
+  tasks_.erase(it);
+}
+
+void ReceiverRuntime::wakeTimerWaits() {
+  bool wokeUp = false;
+  {
+    std::lock_guard<std::mutex> lock(mutex_);
+    for (auto &it : tasks_) {
+      if (it.second.status == WAITING && it.second.fds.empty()) {
+        wakeLocked(it.first, it.second);
+        wokeUp = true;
+      }
+    }
+  }
+  if (wokeUp) {
+    readyCond_.notify_all();
+  }
+}
+
+void ReceiverRuntime::runTasks() {
+  std::unique_lock<std::mutex> lock(mutex_);
+  while (true) {
+    auto it = readyTasks_.end();
+    readyCond_.wait(lock, [&] {
+      if (stop_) {
+        return true;
+      }
+      it = findRunnableLocked();
+      return it != readyTasks_.end();
+    });
+    if (stop_) {
+      return;
+    }
+    RuntimeTask *task = *it;
+    readyTasks_.erase(it);
+    GroupState *group = tasks_[task].group;
+    tasks_[task].status = RUNNING;
+    group->numRunning++;
+    lock.unlock();
+    RuntimeTask::Wait wait;
+    const bool done = task->runSlice(wait);
+    lock.lock();
+    if (group->numRunning-- == group->maxRunning) {
+      // a task of the group waiting for a thread can run
+      readyCond_.notify_one();
+    }
+    // the task can't be erased before it is done, the reference stays valid
+    TaskState &state = tasks_[task];
+    if (done) {
+      state.status = DONE;
+      doneCond_.notify_all();
+      continue;
+    }
+    state.status = WAITING;
+    state.fds = std::move(wait.fds);
+    const size_t numReadFds = state.fds.size();
+    state.fds.insert(state.fds.end(), wait.writeFds.begin(),
+                     wait.writeFds.end());
+    if (state.fds.empty() && wait.timeoutMillis <= 0) {
+      // yields, the tasks ready go first
+      wakeLocked(task, state);
+      readyCond_.notify_one();
+      continue;
+    }
+    state.deadline =
+        Clock::now() + std::chrono::milliseconds(wait.timeoutMillis);
+#ifdef __linux__
+    for (size_t i = 0; i < state.fds.size(); i++) {
+      const int fd = state.fds[i];
+      struct epoll_event event;
+      event.events = (i < numReadFds) ? EPOLLIN : EPOLLOUT;
+      event.data.ptr = task;
+      if (epoll_ctl(epollFd_, EPOLL_CTL_ADD, fd, &event) != 0) {
+        // the slice sees the error on the fd, run it again right away
+        WPLOG(ERROR) << "Failed to add fd " << fd << " to the epoll set";
+        wakeLocked(task, state);
+        break;
+      }
+    }
+#endif
+    // the deadline can be earlier than the one the poller waits for
+    notifyPoller();
+  }
+}
+
+void ReceiverRuntime::pollTasks() {
+#ifdef __linux__
+  const int kMaxEvents = 64;
+  struct epoll_event events[kMaxEvents];
+  while (true) {
+    int timeoutMillis = -1;
+    {
+      std::lock_guard<std::mutex> lock(mutex_);
+      if (stop_) {
+        return;
+      }
+      const auto now = Clock::now();
+      for (auto &it : tasks_) {
+        if (it.second.status != WAITING) {
+          continue;
+        }
+        // rounded up, so that a wakeup is not early
+        int remaining = std::max<int>(
+            0, durationMillis(it.second.deadline - now) + 1);
+        if (timeoutMillis < 0 || remaining < timeoutMillis) {
+          timeoutMillis = remaining;
+        }
+      }
+    }
+    int numEvents = epoll_wait(epollFd_, events, kMaxEvents, timeoutMillis);
+    if (numEvents < 0) {
+      if (errno != EINTR) {
+        WPLOG(ERROR) << "epoll_wait failed in the receiver runtime";
+      }
+      numEvents = 0;
+    }
+    bool wokeUp = false;
+    {
+      // held for the whole batch, so that an event can't be applied to a
+      // later wait of the same task
+      std::lock_guard<std::mutex> lock(mutex_);
+      for (int i = 0; i < numEvents; i++) {
+        RuntimeTask *task = static_cast<RuntimeTask *>(events[i].data.ptr);
+        if (task == nullptr) {
+          uint64_t value;
+          if (::read(eventFd_, &value, sizeof(value)) < 0 &&
+              errno != EAGAIN) {
+            WPLOG(ERROR) << "Failed to read the eventfd of the runtime";
+          }
+          continue;
+        }
+        auto it = tasks_.find(task);
+        if (it != tasks_.end() && it->second.status == WAITING) {
+          wakeLocked(task, it->second);
+          wokeUp = true;
+        }
+      }
+      const auto now = Clock::now();
+      for (auto &it : tasks_) {
+        if (it.second.status == WAITING && it.second.deadline <= now) {
+          wakeLocked(it.first, it.second);
+          wokeUp = true;
+        }
+      }
+    }
+    if (wokeUp) {
+      readyCond_.notify_all();
+    }
+  }
+#endif
+}
+
+void ReceiverRuntime::wakeLocked(RuntimeTask *task, TaskState &state) {
+#ifdef __linux__
+  for (int fd : state.fds) {
+    // fails for the fds which could not be added, nothing to do about it
+    epoll_ctl(epollFd_, EPOLL_CTL_DEL, fd, nullptr);
+  }
+#endif
+  state.fds.clear();
+  state.status = READY;
+  readyTasks_.push_back(task);
+}
+
+void ReceiverRuntime::notifyPoller() {
+  const uint64_t one = 1;
+  if (::write(eventFd_, &one, sizeof(one)) < 0 && errno != EAGAIN) {
+    WPLOG(ERROR) << "Failed to write to the eventfd of the runtime";
+  }
+}
+}
+}
@@ -0,0 +1,163 @@
+/**
+ * Copyright (c) 2014-present, Facebook, Inc.
+ * All rights reserved.
+ *
+ * This source code is licensed under the BSD-style license found in the
+ * LICENSE file in the root directory of this source tree. An additional grant
+ * of patent rights can be found in the PATENTS file in the same directory.
+ */
+#pragma once
+
+#include <wdt/Reporting.h>
+
+#include <condition_variable>
+#include <deque>
+#include <mutex>
+#include <string>
+#include <thread>
+#include <unordered_map>
+#include <vector>
+
+namespace facebook {
+namespace wdt {
+
+/**
+ * Unit of work run by the ReceiverRuntime. A task runs in slices: a slice
+ * runs till the task is done or till it would block waiting for a fd, in which
+ * case it returns what it waits for and is run again once that happens.
+ */
+class RuntimeTask {
+ public:
+  /// what a task waits for before its next slice. Without fds nor time, the
+  /// task yields: it runs again after the tasks already ready
+  struct Wait {
+    /// fds waited upon to be readable, can be empty to only wait for time
+    std::vector<int> fds;
+    /// fds waited upon to be writable, not in fds
+    std::vector<int> writeFds;
+    /// max time to wait before running the next slice anyway
+    int timeoutMillis{0};
+  };
+
+  /**
+   * Runs the task till it is done or has to wait
+   *
+   * @param wait    set to what the task waits for if it is not done
+   *
+   * @return        true if the task is done
+   */
+  virtual bool runSlice(Wait &wait) = 0;
+
+  virtual ~RuntimeTask() {
+  }
+};
+
+/**
+ * Event-driven runtime shared by many receivers: instead of a thread per port,
+ * blocked most of the time accepting or waiting for the next cmd of its
+ * sender, the tasks of all the ports run on a fixed pool of threads and park
+ * on a common epoll set when they have nothing to do. This bounds the number
+ * of threads of a process running many concurrent small transfers. Tasks can
+ * be put in groups (e.g. the namespace of their transfer) whose number of
+ * slices running at once is limited, the threads then run the ready tasks of
+ * the other groups instead, so that a group can't take all the threads.
+ * Senders run their ports on it the same way (@see Sender::setRuntime), parked
+ * while they connect or wait for their receiver.
+ */
+class ReceiverRuntime {
+ public:
+  /// @param numThreads   number of threads running the tasks
+  explicit ReceiverRuntime(int numThreads);
+
+  /// stops the threads, the tasks started must be done
+  ~ReceiverRuntime();
+
+  /// @return   whether the epoll set and the threads could be created
+  bool isValid() const {
+    return epollFd_ >= 0;
+  }
+
+  /**
+   * Schedules the first slice of a task, the task must outlive its run
+   *
+   * @param task      task to run
+   * @param group     group of the task, the default group has no limit
+   */
+  void start(RuntimeTask *task, const std::string &group = "");
+
+  /**
+   * Limits the number of slices of the tasks of a group running at once
+   *
+   * @param group         group of tasks
+   * @param maxRunning    max number of slices running at once, 0 for no
+   *                      limit
+   */
+  void setGroupLimit(const std::string &group, int maxRunning);
+
+  /// waits till a task started is done
+  void waitForEnd(RuntimeTask *task);
+
+  /// runs again the tasks which only wait for time, so that they see a change
+  /// of the state they poll
+  void wakeTimerWaits();
+
+  ReceiverRuntime(const ReceiverRuntime &) = delete;
+  ReceiverRuntime &operator=(const ReceiverRuntime &) = delete;
+
+ private:
+  enum TaskStatus { READY, RUNNING, WAITING, DONE };
+
+  /// tasks of a group
+  struct GroupState {
+    /// max number of slices running at once, 0 for no limit
+    int maxRunning{0};
+    /// number of slices running
+    int numRunning{0};
+  };
+
+  struct TaskState {
+    TaskStatus status{READY};
+    /// fds waited upon, readable or writable
+    std::vector<int> fds;
+    Clock::time_point deadline;
+    /// group of the task, never erased from groups_
+    GroupState *group{nullptr};
+  };
+
+  /**
+   * @return    the oldest ready task whose group can run one more slice,
+   *            readyTasks_.end() if none. mutex_ must be held
+   */
+  std::deque<RuntimeTask *>::iterator findRunnableLocked();
+
+  /// loop of the threads running task slices
+  void runTasks();
+
+  /// loop of the thread waiting for the fds and the deadlines of the tasks
+  void pollTasks();
+
+  /// moves a waiting task to the ready queue, mutex_ must be held
+  void wakeLocked(RuntimeTask *task, TaskState &state);
+
+  /// wakes up the poll thread
+  void notifyPoller();
+
+  int epollFd_{-1};
+  /// eventfd waking up the poll thread
+  int eventFd_{-1};
+  bool stop_{false};
+
+  std::mutex mutex_;
+  std::unordered_map<RuntimeTask *, TaskState> tasks_;
+  std::deque<RuntimeTask *> readyTasks_;
+  std::unordered_map<std::string, GroupState> groups_;
+  /// notified when a task is ready or the runtime has to stop
+  std::condition_variable readyCond_;
+  /// notified when a task is done
+  std::condition_variable doneCond_;
+
+  std::vector<std::thread> workers_;
+  std::thread poller_;
+};
+}
+}
@@ -0,0 +1,394 @@
+/**
+ * Copyright (c) 2014-present, Facebook, Inc.
+ * All rights reserved.
+ *
+ * This source code is licensed under the BSD-style license found in the
+ * LICENSE file in the root directory of this source tree. An additional grant
+ * of patent rights can be found in the PATENTS file in the same directory.
+ */
+#include <wdt/util/SenderJournal.h>
+
+#include <wdt/ErrorCodes.h>
+#include <wdt/util/SerializationUtil.h>
+
+#include <errno.h>
+#include <fcntl.h>
+#include <stdio.h>
+#include <unistd.h>
+#include <algorithm>
+
+namespace facebook {
+namespace wdt {
+
+namespace {
+
+const char kSnapshotMagic[] = "WDTSJNL1";
+const char kAckLogMagic[] = "WDTSACK1";
+const size_t kMagicLen = sizeof(kSnapshotMagic) - 1;
+const char kFileRecord = 'F';
+const char kAckRecord = 'A';
+// snapshot is written in chunks of this size
+const size_t kWriteChunkSize = 1024 * 1024;
+
+void encodeStr(std::string &buf, const std::string &str) {
+  encodeVarU64(buf, str.size());
+  buf.append(str);
+}
+
+bool decodeStr(const std::string &data, int64_t &pos, std::string &str) {
+  uint64_t len;
+  if (!decodeVarU64(data.data(), data.size(), pos, len) ||
+      len > data.size() - pos) {
+    return false;
+  }
+  str.assign(data.data() + pos, len);
+  pos += len;
+  return true;
+}
+
+bool decodeI64(const std::string &data, int64_t &pos, int64_t &value) {
+  return decodeVarI64(data.data(), data.size(), pos, value);
+}
+
+bool writeFully(int fd, const std::string &buf) {
+  size_t written = 0;
+  while (written < buf.size()) {
+    ssize_t ret = ::write(fd, buf.data() + written, buf.size() - written);
+    if (ret < 0) {
+      if (errno == EINTR) {
+        continue;
+      }
+      return false;
+    }
+    written += ret;
+  }
+  return true;
+}
+
+/// reads a whole file, false if it is missing or can't be read
+bool readFile(const std::string &path, std::string &data) {
+  int fd = ::open(path.c_str(), O_RDONLY | O_CLOEXEC);
+  if (fd < 0) {
+    if (errno != ENOENT) {
+      WPLOG(ERROR) << "Unable to open sender journal " << path;
+    }
+    return false;
+  }
+  char buf[64 * 1024];
+  while (true) {
+    ssize_t numRead = ::read(fd, buf, sizeof(buf));
+    if (numRead < 0) {
+      if (errno == EINTR) {
+        continue;
+      }
+      WPLOG(ERROR) << "Unable to read sender journal " << path;
+      ::close(fd);
+      return false;
+    }
+    if (numRead == 0) {
+      break;
+    }
+    data.append(buf, numRead);
+  }
+  ::close(fd);
+  return true;
+}
+
+/// @return   position after the magic and the signature, -1 if they differ
+int64_t decodeHeader(const std::string &data, const char *magic,
+                     const std::string &signature) {
+  if (data.compare(0, kMagicLen, magic) != 0) {
+    return -1;
+  }
+  int64_t pos = kMagicLen;
+  std::string fileSignature;
+  if (!decodeStr(data, pos, fileSignature) || fileSignature != signature) {
+    return -1;
+  }
+  return pos;
+}
+
+void encodeAck(std::string &buf, const std::string &relPath, int64_t offset,
+               int64_t size) {
+  buf.push_back(kAckRecord);
+  encodeStr(buf, relPath);
+  encodeVarI64(buf, offset);
+  encodeVarI64(buf, size);
+}
+}
+
+SenderJournal::SenderJournal(const std::string &journalPath,
+                             const std::string &signature)
+    : journalPath_(journalPath),
+      ackLogPath_(journalPath + ".acks"),
+      signature_(signature) {
+}
+
+SenderJournal::~SenderJournal() {
+  if (ackFd_ >= 0) {
+    ::close(ackFd_);
+  }
+}
+
+bool SenderJournal::open() {
+  int64_t numFiles;
+  {
+    std::lock_guard<std::mutex> lock(mutex_);
+    const bool loaded = loadSnapshot();
+    if (loaded) {
+      loadAcks();
+    }
+    if (!startAckLog(loaded)) {
+      // an ack log left behind would be taken for the one of the next
+      // snapshot
+      unlink(ackLogPath_.c_str());
+      files_.clear();
+      ackedRanges_.clear();
+      return false;
+    }
+    if (!loaded) {
+      return false;
+    }
+    numFiles = files_.size();
+  }
+  WLOG(INFO) << "Loaded sender journal " << journalPath_ << " with "
+             << numFiles << " files, " << getNumAckedFiles()
+             << " of them fully acked";
+  return true;
+}
+
+bool SenderJournal::loadSnapshot() {
+  std::string data;
+  if (!readFile(journalPath_, data)) {
+    WLOG(INFO) << "No sender journal at " << journalPath_;
+    return false;
+  }
+  int64_t pos = decodeHeader(data, kSnapshotMagic, signature_);
+  if (pos < 0) {
+    WLOG(WARNING) << "Ignoring sender journal " << journalPath_
+                  << " of a different transfer";
+    return false;
+  }
+  while (pos < (int64_t)data.size()) {
+    FileInfo info;
+    if (data[pos++] != kFileRecord || !decodeStr(data, pos, info.relPath) ||
+        !decodeI64(data, pos, info.size)) {
+      WLOG(ERROR) << "Unable to decode sender journal " << journalPath_
+                  << " at " << pos;
+      files_.clear();
+      return false;
+    }
+    files_.emplace_back(std::move(info));
+  }
+  return true;
+}
+
+void SenderJournal::loadAcks() {
+  std::string data;
+  if (!readFile(ackLogPath_, data)) {
+    return;
+  }
+  int64_t pos = decodeHeader(data, kAckLogMagic, signature_);
+  if (pos < 0) {
+    WLOG(WARNING) << "Ignoring ack log " << ackLogPath_
+                  << " of a different transfer";
+    return;
+  }
+  std::string relPath;
+  while (pos < (int64_t)data.size()) {
+    int64_t offset, size;
+    if (data[pos++] != kAckRecord || !decodeStr(data, pos, relPath) ||
+        !decodeI64(data, pos, offset) || !decodeI64(data, pos, size)) {
+      // the last append was cut by the crash, the acks before it are valid
+      WLOG(WARNING) << "Ack log " << ackLogPath_ << " truncated at " << pos;
+      return;
+    }
+    int64_t &rangeSize = ackedRanges_[relPath][offset];
+    rangeSize = std::max(rangeSize, size);
+  }
+}
+
+bool SenderJournal::isFullyAckedLocked(const FileInfo &info) const {
+  auto it = ackedRanges_.find(info.relPath);
+  if (it == ackedRanges_.end()) {
+    return false;
+  }
+  int64_t end = 0;
+  for (const auto &range : it->second) {
+    if (range.first > end) {
+      return false;
+    }
+    end = std::max(end, range.first + range.second);
+  }
+  return end >= info.size;
+}
+
+bool SenderJournal::startAckLog(bool keepAcked) {
+  std::string buf(kAckLogMagic, kMagicLen);
+  encodeStr(buf, signature_);
+  std::unordered_map<std::string, std::map<int64_t, int64_t>> ackedRanges;
+  if (keepAcked) {
+    // only the files fully acked are worth keeping, the others are sent again
+    for (const FileInfo &info : files_) {
+      if (isFullyAckedLocked(info)) {
+        encodeAck(buf, info.relPath, 0, info.size);
+        ackedRanges[info.relPath][0] = info.size;
+      }
+    }
+  }
+  ackedRanges_ = std::move(ackedRanges);
+  const std::string tmpPath = ackLogPath_ + ".tmp";
+  int fd = ::open(tmpPath.c_str(), O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC,
+                  0644);
+  if (fd < 0) {
+    WPLOG(ERROR) << "Unable to create ack log " << tmpPath;
+    return false;
+  }
+  bool success = writeFully(fd, buf);
+  if (!success) {
+    WPLOG(ERROR) << "Unable to write ack log " << tmpPath;
+  } else if (fsync(fd) != 0) {
+    WPLOG(ERROR) << "Unable to fsync ack log " << tmpPath;
+    success = false;
+  }
+  if (::close(fd) != 0) {
+    WPLOG(ERROR) << "Unable to close ack log " << tmpPath;
+    success = false;
+  }
+  if (success && rename(tmpPath.c_str(), ackLogPath_.c_str()) != 0) {
+    WPLOG(ERROR) << "Unable to rename " << tmpPath << " to " << ackLogPath_;
+    success = false;
+  }
+  if (!success) {
+    unlink(tmpPath.c_str());
+    return false;
+  }
+  ackFd_ = ::open(ackLogPath_.c_str(), O_WRONLY | O_APPEND | O_CLOEXEC);
+  if (ackFd_ < 0) {
+    WPLOG(ERROR) << "Unable to open ack log " << ackLogPath_;
+    return false;
+  }
+  return true;
+}
+
+std::vector<WdtFileInfo> SenderJournal::getRemainingFiles(
+    bool skipAcked, bool directReads) const {
+  std::lock_guard<std::mutex> lock(mutex_);
+  std::vector<WdtFileInfo> fileInfo;
+  fileInfo.reserve(files_.size());
+  for (const FileInfo &info : files_) {
+    if (skipAcked && isFullyAckedLocked(info)) {
+      continue;
+    }
+    fileInfo.emplace_back(info.relPath, info.size, directReads);
+  }
+  return fileInfo;
+}
+
+int64_t SenderJournal::getNumAckedFiles() const {
+  std::lock_guard<std::mutex> lock(mutex_);
+  int64_t numAcked = 0;
+  for (const FileInfo &info : files_) {
+    numAcked += isFullyAckedLocked(info);
+  }
+  return numAcked;
+}
+
+void SenderJournal::addDiscoveredFile(const std::string &relPath,
+                                      int64_t size) {
+  FileInfo info;
+  info.relPath = relPath;
+  info.size = size;
+  std::lock_guard<std::mutex> lock(mutex_);
+  files_.emplace_back(std::move(info));
+}
+
+bool SenderJournal::saveSnapshot() {
+  const std::string tmpPath = journalPath_ + ".tmp";
+  int fd = ::open(tmpPath.c_str(), O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC,
+                  0644);
+  if (fd < 0) {
+    WPLOG(ERROR) << "Unable to create sender journal " << tmpPath;
+    return false;
+  }
+  bool success = true;
+  std::string buf(kSnapshotMagic, kMagicLen);
+  encodeStr(buf, signature_);
+  int64_t numFiles;
+  {
+    std::lock_guard<std::mutex> lock(mutex_);
+    numFiles = files_.size();
+    for (const FileInfo &info : files_) {
+      buf.push_back(kFileRecord);
+      encodeStr(buf, info.relPath);
+      encodeVarI64(buf, info.size);
+      if (success && buf.size() >= kWriteChunkSize) {
+        success = writeFully(fd, buf);
+        buf.clear();
+      }
+    }
+  }
+  if (success) {
+    success = writeFully(fd, buf);
+  }
+  if (!success) {
+    WPLOG(ERROR) << "Unable to write sender journal " << tmpPath;
+  } else if (fsync(fd) != 0) {
+    WPLOG(ERROR) << "Unable to fsync sender journal " << tmpPath;
+    success = false;
+  }
+  if (::close(fd) != 0) {
+    WPLOG(ERROR) << "Unable to close sender journal " << tmpPath;
+    success = false;
+  }
+  if (success && rename(tmpPath.c_str(), journalPath_.c_str()) != 0) {
+    WPLOG(ERROR) << "Unable to rename " << tmpPath << " to " << journalPath_;
+    success = false;
+  }
+  if (!success) {
+    unlink(tmpPath.c_str());
+    return false;
+  }
+  WLOG(INFO) << "Saved sender journal " << journalPath_ << " with "
+             << numFiles << " files";
+  return true;
+}
+
+bool SenderJournal::addAckedBlocks(const std::vector<AckedBlock> &blocks) {
+  if (blocks.empty()) {
+    return true;
+  }
+  std::string buf;
+  for (const AckedBlock &block : blocks) {
+    encodeAck(buf, block.relPath, block.offset, block.size);
+  }
+  std::lock_guard<std::mutex> lock(mutex_);
+  if (ackFd_ < 0) {
+    return false;
+  }
+  if (!writeFully(ackFd_, buf) || fdatasync(ackFd_) != 0) {
+    WPLOG(ERROR) << "Unable to append to ack log " << ackLogPath_
+                 << ", no longer recording the acks";
+    ::close(ackFd_);
+    ackFd_ = -1;
+    return false;
+  }
+  return true;
+}
+
+void SenderJournal::remove() {
+  std::lock_guard<std::mutex> lock(mutex_);
+  if (ackFd_ >= 0) {
+    ::close(ackFd_);
+    ackFd_ = -1;
+  }
+  if (unlink(journalPath_.c_str()) != 0 && errno != ENOENT) {
+    WPLOG(ERROR) << "Unable to remove sender journal " << journalPath_;
+  }
+  if (unlink(ackLogPath_.c_str()) != 0 && errno != ENOENT) {
+    WPLOG(ERROR) << "Unable to remove ack log " << ackLogPath_;
+  }
+  WLOG(INFO) << "Removed sender journal " << journalPath_;
+}
+}
+}
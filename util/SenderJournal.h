@@ -0,0 +1,126 @@
+/**
+ * Copyright (c) 2014-present, Facebook, Inc.
+ * All rights reserved.
+ *
+ * This source code is licensed under the BSD-style license found in the
+ * LICENSE file in the root directory of this source tree. An additional grant
+ * of patent rights can be found in the PATENTS file in the same directory.
+ */
+#pragma once
+
+#include <wdt/WdtTransferRequest.h>
+
+#include <cstdint>
+#include <map>
+#include <mutex>
+#include <string>
+#include <unordered_map>
+#include <vector>
+
+namespace facebook {
+namespace wdt {
+
+/**
+ * Sender side on-disk journal of a transfer in progress, so that a sender
+ * restarted after a crash neither discovers the source directory again nor
+ * sends the files the receiver already acknowledged. It is made of a snapshot
+ * of the files discovered, written once the discovery is over, and of a log
+ * of the blocks acknowledged by the receiver, appended to and synced as the
+ * acks come. A file is skipped by the next run only if all its bytes were
+ * acknowledged, the files partially acknowledged are sent again entirely.
+ * All the methods are thread safe.
+ */
+class SenderJournal {
+ public:
+  /// a block acknowledged by the receiver
+  struct AckedBlock {
+    std::string relPath;
+    int64_t offset;
+    int64_t size;
+  };
+
+  /**
+   * @param journalPath   path of the snapshot, the ack log is next to it
+   * @param signature     describes what is sent (root dir, patterns etc), a
+   *                      journal with a different signature is ignored
+   */
+  SenderJournal(const std::string &journalPath, const std::string &signature);
+
+  ~SenderJournal();
+
+  /**
+   * Loads the journal of a previous run, if any, and opens the ack log. The
+   * ack log is compacted down to the files fully acknowledged, or started
+   * afresh if no snapshot was loaded
+   *
+   * @return    true if the snapshot of a previous run was loaded
+   */
+  bool open();
+
+  /**
+   * @param skipAcked     whether to leave out the files fully acknowledged
+   * @param directReads   whether the files are to be read with o_direct
+   *
+   * @return              files of the loaded snapshot, in discovery order
+   */
+  std::vector<WdtFileInfo> getRemainingFiles(bool skipAcked,
+                                             bool directReads) const;
+
+  /// records a file discovered by this run
+  void addDiscoveredFile(const std::string &relPath, int64_t size);
+
+  /**
+   * Atomically writes the snapshot of the files recorded by
+   * addDiscoveredFile()
+   *
+   * @return    true on success
+   */
+  bool saveSnapshot();
+
+  /**
+   * Appends blocks to the ack log and syncs it. The journal stops recording
+   * after an error
+   *
+   * @return    true on success
+   */
+  bool addAckedBlocks(const std::vector<AckedBlock> &blocks);
+
+  /// removes the journal, once the transfer succeeded
+  void remove();
+
+  /// @return   number of files of the snapshot fully acknowledged
+  int64_t getNumAckedFiles() const;
+
+ private:
+  /// a file of the snapshot
+  struct FileInfo {
+    std::string relPath;
+    int64_t size{0};
+  };
+
+  /// loads the snapshot into files_, false if missing or invalid
+  bool loadSnapshot();
+
+  /// loads the ack log into ackedRanges_, stops at the first torn record
+  void loadAcks();
+
+  /// rewrites the ack log with the files fully acked and opens it for append
+  bool startAckLog(bool keepAcked);
+
+  /// @return   whether all the bytes of a file were acknowledged
+  bool isFullyAckedLocked(const FileInfo &info) const;
+
+  const std::string journalPath_;
+  const std::string ackLogPath_;
+  const std::string signature_;
+  /// files of the snapshot loaded, or discovered by this run
+  std::vector<FileInfo> files_;
+  /// acked ranges (offset to size) of each file
+  std::unordered_map<std::string, std::map<int64_t, int64_t>> ackedRanges_;
+  /// ack log opened for append, -1 if not recording
+  int ackFd_{-1};
+  /// protects the fields above
+  mutable std::mutex mutex_;
+};
+}
+}
@@ -9,6 +9,7 @@
 #pragma once
 
 #include <folly/Range.h>
+#include <folly/lang/Bits.h>
 #include <wdt/ErrorCodes.h>
 #include <string>
 
@@ -182,6 +183,27 @@ inline bool decodeVarU64(const char *data, size_t datalen, int64_t &pos,
 #endif
   const char *p = data + pos;
   const char *const end = data + datalen;
+  // when 8 bytes can be read, as for all but the last values of a buffer,
+  // the end of the value is found from the continuation bits of the 8 bytes
+  // at once and its 7 bit groups are packed without a loop or branch. Values
+  // of 9 bytes (>= 2^56) and the end of the buffer take the byte loop
+  if (end - p >= 8) {
+    const uint64_t word =
+        folly::Endian::little(folly::loadUnaligned<uint64_t>(p));
+    const uint64_t lastBytes = ~word & 0x8080808080808080ULL;
+    if (lastBytes != 0) {
+      // bits of the bytes up to and including the first one without
+      // continuation bit
+      const uint64_t mask = ((lastBytes & (0 - lastBytes)) << 1) - 1;
+      uint64_t v = word & mask & 0x7f7f7f7f7f7f7f7fULL;
+      v = ((v & 0x7f007f007f007f00ULL) >> 1) | (v & 0x007f007f007f007fULL);
+      v = ((v & 0x3fff00003fff0000ULL) >> 2) | (v & 0x00003fff00003fffULL);
+      v = ((v & 0x0fffffff00000000ULL) >> 4) | (v & 0x000000000fffffffULL);
+      res = v;
+      pos += folly::findFirstSet(lastBytes) / 8;
+      return true;
+    }
+  }
   uint64_t val = 0;
   int shift = 0;
   int count = 0;
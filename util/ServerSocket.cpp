@@ -7,6 +7,7 @@
  * of patent rights can be found in the PATENTS file in the same directory.
  */
 #include <wdt/util/ServerSocket.h>
+#include <wdt/util/ListenSocketPool.h>
 #include <fcntl.h>
 #include <folly/Conv.h>
 #include <glog/logging.h>
@@ -47,9 +48,32 @@ void ServerSocket::closeAllNoCheck() {
 }
 
 ServerSocket::~ServerSocket() {
+  const int poolSize = threadCtx_.getOptions().listen_socket_pool_size;
+  if (poolSize > 0 && !listeningFds_.empty()) {
+    // keep listening for the next receivers of the process
+    closeNoCheck();
+    ListenSocketPool::get().release(getPoolConfig(), port_,
+                                    std::move(listeningFds_), poolSize);
+    listeningFds_.clear();
+  }
   closeAllNoCheck();
 }
 
+ListenSocketPool::Config ServerSocket::getPoolConfig() const {
+  const WdtOptions &options = threadCtx_.getOptions();
+  ListenSocketPool::Config config;
+  config.family = AF_UNSPEC;
+  if (options.ipv6) {
+    config.family = AF_INET6;
+  }
+  if (options.ipv4) {
+    config.family = AF_INET;
+  }
+  config.backlog = backlog_;
+  config.receiveBufferSize = options.receive_buffer_size;
+  return config;
+}
+
 int ServerSocket::listenInternal(struct addrinfo *info,
                                  const std::string &host) {
   WVLOG(1) << "Will listen on " << host << " " << port_ << " "
@@ -136,6 +160,15 @@ ErrorCode ServerSocket::listen() {
     WVLOG(1) << "Not using static_ports, changing port " << port_ << " to 0";
     port_ = 0;
   }
+  if (options.listen_socket_pool_size > 0) {
+    int port = port_;
+    listeningFds_ = ListenSocketPool::get().lease(getPoolConfig(), port);
+    if (!listeningFds_.empty()) {
+      port_ = port;
+      WVLOG(1) << "Listening on pooled port " << port_;
+      return OK;
+    }
+  }
   // Lookup
   addrInfoList infoList = nullptr;
   std::string portStr = folly::to<std::string>(port_);
@@ -281,6 +314,11 @@ ErrorCode ServerSocket::acceptNextConnection(int timeoutMillis,
                << peerPort_;
       setSocketTimeouts();
       setDscp(options.dscp);
+      setCongestionControl();
+      if (setupTransport(false) != OK) {
+        closeNoCheck();
+        return CONN_ERROR;
+      }
       return OK;
     }
     lastCheckedPollIndex_ = (lastCheckedPollIndex_ + 1) % numFds;
@@ -9,6 +9,7 @@
 #pragma once
 
 #include <wdt/ErrorCodes.h>
+#include <wdt/util/ListenSocketPool.h>
 #include <wdt/util/WdtSocket.h>
 
 #include <netdb.h>
@@ -39,6 +40,10 @@ class ServerSocket : public WdtSocket {
   /// @return       peer port
   std::string getPeerPort() const;
   int getBackLog() const;
+  /// @return       fds listened on, empty if not listening
+  const std::vector<int> &getListeningFds() const {
+    return listeningFds_;
+  }
   /// Destroy the active connection and the listening fd
   /// if done by the same thread who owned the socket
   /// This call should be avoided. correct end should be using closeConnetion()
@@ -50,6 +55,9 @@ class ServerSocket : public WdtSocket {
   /// sets the receive buffer size for this socket
   void setReceiveBufferSize(int fd);
 
+  /// @return   config of the listening sockets shared in the pool
+  ListenSocketPool::Config getPoolConfig() const;
+
   const int backlog_;
   std::vector<int> listeningFds_;
   /// index of the poll-fd last checked. This is used to not try the same fd
@@ -0,0 +1,122 @@
+/**
+ * Copyright (c) 2014-present, Facebook, Inc.
+ * All rights reserved.
+ *
+ * This source code is licensed under the BSD-style license found in the
+ * LICENSE file in the root directory of this source tree. An additional grant
+ * of patent rights can be found in the PATENTS file in the same directory.
+ */
+#pragma once
+
+#include <functional>
+#include <mutex>
+#include <shared_mutex>
+#include <string>
+#include <unordered_map>
+#include <utility>
+#include <vector>
+
+namespace facebook {
+namespace wdt {
+
+/**
+ * Map by string split in shards, each with a reader-writer lock of its own.
+ * Lookups of a key only take the shared lock of its shard, and changes only
+ * the exclusive lock of its shard, so that operations on keys of different
+ * shards don't wait for each other. Iterating over the map locks one shard at
+ * a time: it sees a consistent view of each shard, not of the whole map.
+ */
+template <typename Value>
+class ShardedMap {
+ public:
+  using Map = std::unordered_map<std::string, Value>;
+
+  /// number of shards of the maps made without one
+  static const size_t kDefaultNumShards = 16;
+
+  explicit ShardedMap(size_t numShards = kDefaultNumShards)
+      : shards_(numShards > 0 ? numShards : 1) {
+  }
+
+  ShardedMap(const ShardedMap &that) = delete;
+  ShardedMap &operator=(const ShardedMap &that) = delete;
+
+  /**
+   * Calls fn(value) with the shared lock of the shard of key held
+   *
+   * @return    whether key was found
+   */
+  template <typename Fn>
+  bool find(const std::string &key, Fn fn) const {
+    const Shard &shard = getShard(key);
+    ReadLock lock(shard.mutex);
+    auto it = shard.map.find(key);
+    if (it == shard.map.end()) {
+      return false;
+    }
+    fn(it->second);
+    return true;
+  }
+
+  /// Calls fn(map of the shard of key) with the exclusive lock of the shard
+  /// held, and returns what it returns
+  template <typename Fn>
+  auto update(const std::string &key, Fn fn)
+      -> decltype(fn(std::declval<Map &>())) {
+    Shard &shard = getShard(key);
+    WriteLock lock(shard.mutex);
+    return fn(shard.map);
+  }
+
+  /// Calls fn(key, value) for every entry, one shard at a time with its
+  /// shared lock held
+  template <typename Fn>
+  void forEach(Fn fn) const {
+    for (const Shard &shard : shards_) {
+      ReadLock lock(shard.mutex);
+      for (const auto &it : shard.map) {
+        fn(it.first, it.second);
+      }
+    }
+  }
+
+  /// Calls fn(map of the shard) for every shard, with its exclusive lock held
+  template <typename Fn>
+  void updateEachShard(Fn fn) {
+    for (Shard &shard : shards_) {
+      WriteLock lock(shard.mutex);
+      fn(shard.map);
+    }
+  }
+
+  /// @return   number of entries, summed over the shards one at a time
+  size_t size() const {
+    size_t numEntries = 0;
+    for (const Shard &shard : shards_) {
+      ReadLock lock(shard.mutex);
+      numEntries += shard.map.size();
+    }
+    return numEntries;
+  }
+
+ private:
+  using ReadLock = std::shared_lock<std::shared_timed_mutex>;
+  using WriteLock = std::unique_lock<std::shared_timed_mutex>;
+
+  struct Shard {
+    mutable std::shared_timed_mutex mutex;
+    Map map;
+  };
+
+  Shard &getShard(const std::string &key) {
+    return shards_[std::hash<std::string>()(key) % shards_.size()];
+  }
+
+  const Shard &getShard(const std::string &key) const {
+    return shards_[std::hash<std::string>()(key) % shards_.size()];
+  }
+
+  std::vector<Shard> shards_;
+};
+}
+}
@@ -0,0 +1,285 @@
+/**
+ * Copyright (c) 2014-present, Facebook, Inc.
+ * All rights reserved.
+ *
+ * This source code is licensed under the BSD-style license found in the
+ * LICENSE file in the root directory of this source tree. An additional grant
+ * of patent rights can be found in the PATENTS file in the same directory.
+ */
+#include <wdt/util/ShmRing.h>
+
+#include <wdt/util/CallbackWriter.h>
+#include <wdt/util/CommonImpl.h>
+
+#include <fcntl.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#include <algorithm>
+#include <chrono>
+#include <thread>
+
+namespace facebook {
+namespace wdt {
+
+static_assert(ATOMIC_LLONG_LOCK_FREE == 2,
+              "positions of the ring must be lock free to be shared");
+
+/// identifies a ring file
+const uint64_t kShmRingMagic = 0x5744545348524e47ULL;
+/// size of the control block, the data of the ring follows it
+const int64_t kShmRingControlSize = 256;
+/// max time to sleep between two polls of the other side
+const int64_t kShmRingMaxPollMicros = 1000;
+
+/// header of a record in the ring, followed by the file name and the data
+struct ShmRecordHeader {
+  int64_t seqId;
+  int64_t fileSize;
+  int64_t offset;
+  int64_t nameLength;
+  int64_t dataSize;
+};
+
+/// @return   size of a record in the ring, aligned to 8 bytes
+static int64_t recordSize(int64_t nameLength, int64_t dataSize) {
+  const int64_t size = sizeof(ShmRecordHeader) + nameLength + dataSize;
+  return (size + 7) & ~7LL;
+}
+
+/**
+ * Polls condition() till it is true, sleeping longer and longer in between
+ *
+ * @return    false if it is still false after timeoutMillis
+ */
+template <typename Condition>
+static bool pollFor(Condition condition, int timeoutMillis) {
+  const auto deadline =
+      Clock::now() + std::chrono::milliseconds(timeoutMillis);
+  int64_t sleepMicros = 1;
+  while (!condition()) {
+    if (Clock::now() >= deadline) {
+      return false;
+    }
+    /* sleep override */
+    std::this_thread::sleep_for(std::chrono::microseconds(sleepMicros));
+    sleepMicros = std::min(sleepMicros * 2, kShmRingMaxPollMicros);
+  }
+  return true;
+}
+
+std::unique_ptr<ShmRing> ShmRing::create(const std::string &path,
+                                         int64_t capacity) {
+  capacity = (capacity + 7) & ~7LL;
+  if (capacity < 2 * recordSize(0, 1)) {
+    WLOG(ERROR) << "Ring capacity too small " << capacity;
+    return nullptr;
+  }
+  const int fd = ::open(path.c_str(), O_RDWR | O_CREAT | O_TRUNC | O_CLOEXEC,
+                        0600);
+  if (fd < 0) {
+    WPLOG(ERROR) << "Unable to create ring " << path;
+    return nullptr;
+  }
+  const int64_t mapSize = kShmRingControlSize + capacity;
+  if (::ftruncate(fd, mapSize) != 0) {
+    WPLOG(ERROR) << "Unable to size ring " << path;
+    ::close(fd);
+    ::unlink(path.c_str());
+    return nullptr;
+  }
+  void *memory =
+      ::mmap(nullptr, mapSize, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+  if (memory == MAP_FAILED) {
+    WPLOG(ERROR) << "Unable to map ring " << path;
+    ::close(fd);
+    ::unlink(path.c_str());
+    return nullptr;
+  }
+  Control *control = new (memory) Control();
+  control->capacity = capacity;
+  control->head = 0;
+  control->tail = 0;
+  control->closed = 0;
+  // the ring is only valid for the consumer once its magic is written
+  std::atomic_thread_fence(std::memory_order_release);
+  control->magic = kShmRingMagic;
+  WLOG(INFO) << "Created ring " << path << " of " << capacity << " bytes";
+  return std::unique_ptr<ShmRing>(
+      new ShmRing(path, true, fd, static_cast<char *>(memory), mapSize));
+}
+
+std::unique_ptr<ShmRing> ShmRing::attach(const std::string &path) {
+  const int fd = ::open(path.c_str(), O_RDWR | O_CLOEXEC);
+  if (fd < 0) {
+    WPLOG(ERROR) << "Unable to open ring " << path;
+    return nullptr;
+  }
+  struct stat fileStat;
+  if (::fstat(fd, &fileStat) != 0 || fileStat.st_size <= kShmRingControlSize) {
+    WLOG(ERROR) << "Invalid ring " << path;
+    ::close(fd);
+    return nullptr;
+  }
+  const int64_t mapSize = fileStat.st_size;
+  void *memory =
+      ::mmap(nullptr, mapSize, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+  if (memory == MAP_FAILED) {
+    WPLOG(ERROR) << "Unable to map ring " << path;
+    ::close(fd);
+    return nullptr;
+  }
+  const Control *control = static_cast<const Control *>(memory);
+  if (control->magic != kShmRingMagic ||
+      control->capacity != mapSize - kShmRingControlSize) {
+    WLOG(ERROR) << "Invalid ring " << path;
+    ::munmap(memory, mapSize);
+    ::close(fd);
+    return nullptr;
+  }
+  std::atomic_thread_fence(std::memory_order_acquire);
+  return std::unique_ptr<ShmRing>(
+      new ShmRing(path, false, fd, static_cast<char *>(memory), mapSize));
+}
+
+WriterFactory ShmRing::makeWriterFactory(std::shared_ptr<ShmRing> ring,
+                                         int timeoutMillis) {
+  return CallbackWriter::makeFactory(
+      [ring, timeoutMillis](const BlockDetails &blockDetails, int64_t offset,
+                            const char *data, int64_t size) {
+        return ring->append(blockDetails, offset, data, size, timeoutMillis);
+      });
+}
+
+ShmRing::ShmRing(const std::string &path, bool owner, int fd, char *memory,
+                 int64_t mapSize)
+    : path_(path),
+      owner_(owner),
+      fd_(fd),
+      memory_(memory),
+      mapSize_(mapSize),
+      control_(reinterpret_cast<Control *>(memory)),
+      data_(memory + kShmRingControlSize) {
+  static_assert(sizeof(Control) <= kShmRingControlSize,
+                "control block of the ring too large");
+}
+
+ShmRing::~ShmRing() {
+  ::munmap(memory_, mapSize_);
+  ::close(fd_);
+  if (owner_) {
+    // a consumer attached keeps its mapping
+    ::unlink(path_.c_str());
+  }
+}
+
+void ShmRing::copyIn(int64_t pos, const void *src, int64_t size) {
+  const int64_t capacity = control_->capacity;
+  const int64_t start = pos % capacity;
+  const int64_t first = std::min(size, capacity - start);
+  memcpy(data_ + start, src, first);
+  memcpy(data_, static_cast<const char *>(src) + first, size - first);
+}
+
+void ShmRing::copyOut(int64_t pos, void *dest, int64_t size) const {
+  const int64_t capacity = control_->capacity;
+  const int64_t start = pos % capacity;
+  const int64_t first = std::min(size, capacity - start);
+  memcpy(dest, data_ + start, first);
+  memcpy(static_cast<char *>(dest) + first, data_, size - first);
+}
+
+ErrorCode ShmRing::append(const BlockDetails &blockDetails, int64_t offset,
+                          const char *data, int64_t size, int timeoutMillis) {
+  const int64_t capacity = control_->capacity;
+  const int64_t nameLength = blockDetails.fileName.size();
+  // a record never takes more than half the ring, to not wait for the
+  // consumer to read everything
+  const int64_t maxData = capacity / 2 - recordSize(nameLength, 0);
+  if (maxData <= 0) {
+    WLOG(ERROR) << "Name of " << blockDetails.fileName
+                << " does not fit in ring " << path_;
+    return ERROR;
+  }
+  std::lock_guard<std::mutex> lock(appendMutex_);
+  int64_t numAppended = 0;
+  do {
+    if (control_->closed.load(std::memory_order_acquire)) {
+      WLOG(ERROR) << "Appending to closed ring " << path_;
+      return ERROR;
+    }
+    const int64_t dataSize = std::min(size - numAppended, maxData);
+    const int64_t length = recordSize(nameLength, dataSize);
+    const int64_t head = control_->head.load(std::memory_order_relaxed);
+    if (!pollFor(
+            [&] {
+              return head + length -
+                         control_->tail.load(std::memory_order_acquire) <=
+                     capacity;
+            },
+            timeoutMillis)) {
+      WLOG(ERROR) << "Ring " << path_ << " still full after "
+                  << timeoutMillis << " ms";
+      return WDT_TIMEOUT;
+    }
+    ShmRecordHeader header;
+    header.seqId = blockDetails.seqId;
+    header.fileSize = blockDetails.fileSize;
+    header.offset = offset + numAppended;
+    header.nameLength = nameLength;
+    header.dataSize = dataSize;
+    copyIn(head, &header, sizeof(header));
+    copyIn(head + sizeof(header), blockDetails.fileName.data(), nameLength);
+    copyIn(head + sizeof(header) + nameLength, data + numAppended, dataSize);
+    control_->head.store(head + length, std::memory_order_release);
+    numAppended += dataSize;
+  } while (numAppended < size);
+  return OK;
+}
+
+void ShmRing::close() {
+  std::lock_guard<std::mutex> lock(appendMutex_);
+  control_->closed.store(1, std::memory_order_release);
+}
+
+bool ShmRing::isDone() const {
+  return control_->closed.load(std::memory_order_acquire) &&
+         control_->head.load(std::memory_order_acquire) ==
+             control_->tail.load(std::memory_order_relaxed);
+}
+
+bool ShmRing::read(Record &record, int timeoutMillis) {
+  const int64_t tail = control_->tail.load(std::memory_order_relaxed);
+  const bool available = pollFor(
+      [&] {
+        return control_->head.load(std::memory_order_acquire) > tail ||
+               control_->closed.load(std::memory_order_acquire);
+      },
+      timeoutMillis);
+  // closed is set after the last record, which is then visible
+  if (!available || control_->head.load(std::memory_order_acquire) == tail) {
+    return false;
+  }
+  ShmRecordHeader header;
+  copyOut(tail, &header, sizeof(header));
+  const int64_t capacity = control_->capacity;
+  if (header.nameLength < 0 || header.dataSize < 0 ||
+      recordSize(header.nameLength, header.dataSize) > capacity) {
+    WLOG(ERROR) << "Corrupted record in ring " << path_ << " at " << tail;
+    return false;
+  }
+  record.seqId = header.seqId;
+  record.fileSize = header.fileSize;
+  record.offset = header.offset;
+  record.fileName.resize(header.nameLength);
+  copyOut(tail + sizeof(header), &record.fileName[0], header.nameLength);
+  record.data.resize(header.dataSize);
+  copyOut(tail + sizeof(header) + header.nameLength, record.data.data(),
+          header.dataSize);
+  control_->tail.store(tail + recordSize(header.nameLength, header.dataSize),
+                       std::memory_order_release);
+  return true;
+}
+}
+}
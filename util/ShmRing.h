@@ -0,0 +1,153 @@
+/**
+ * Copyright (c) 2014-present, Facebook, Inc.
+ * All rights reserved.
+ *
+ * This source code is licensed under the BSD-style license found in the
+ * LICENSE file in the root directory of this source tree. An additional grant
+ * of patent rights can be found in the PATENTS file in the same directory.
+ */
+#pragma once
+
+#include <wdt/Protocol.h>
+#include <wdt/Writer.h>
+
+#include <atomic>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <vector>
+
+namespace facebook {
+namespace wdt {
+
+/**
+ * Ring buffer in a shared memory file (e.g. in /dev/shm), through which a
+ * receiver hands the blocks it receives to a consumer process of the same
+ * host instead of writing them to disk. The receiver threads append records
+ * naming the file and holding a part of a block, a single consumer reads
+ * them in order. The positions are atomics in the shared memory, both sides
+ * poll them while waiting for each other.
+ */
+class ShmRing {
+ public:
+  /// record read by the consumer
+  struct Record {
+    /// relative path of the file
+    std::string fileName;
+    /// seq-id of the file
+    int64_t seqId{0};
+    /// size of the file
+    int64_t fileSize{0};
+    /// offset of the data in the file
+    int64_t offset{0};
+    /// data of the part of the block
+    std::vector<char> data;
+  };
+
+  /**
+   * Creates the ring, removing the file once destroyed
+   *
+   * @param path        path of the file, e.g. in /dev/shm
+   * @param capacity    number of bytes of the ring
+   *
+   * @return            the ring, nullptr on error
+   */
+  static std::unique_ptr<ShmRing> create(const std::string &path,
+                                         int64_t capacity);
+
+  /**
+   * Attaches to a ring created by another process, to consume its records
+   *
+   * @param path        path the ring was created with
+   *
+   * @return            the ring, nullptr on error
+   */
+  static std::unique_ptr<ShmRing> attach(const std::string &path);
+
+  /**
+   * @param ring            ring the blocks are appended to
+   * @param timeoutMillis   max time to wait for the consumer when the ring
+   *                        is full
+   *
+   * @return                factory of writers appending the blocks to ring,
+   *                        for Receiver::setWriterFactory
+   */
+  static WriterFactory makeWriterFactory(std::shared_ptr<ShmRing> ring,
+                                         int timeoutMillis);
+
+  ~ShmRing();
+
+  /**
+   * Appends data of a block, in several records if it does not fit in half
+   * the ring. Thread safe.
+   *
+   * @param blockDetails    header of the block
+   * @param offset          offset of the data in the file
+   * @param data            data to append
+   * @param size            number of bytes of data
+   * @param timeoutMillis   max time to wait for the consumer
+   *
+   * @return                OK, WDT_TIMEOUT if the ring stayed full, ERROR if
+   *                        the file name does not fit or the ring is closed
+   */
+  ErrorCode append(const BlockDetails &blockDetails, int64_t offset,
+                   const char *data, int64_t size, int timeoutMillis);
+
+  /// marks the end of the records, once the transfer is done
+  void close();
+
+  /**
+   * Reads the next record, called by the consumer
+   *
+   * @param record          set to the record
+   * @param timeoutMillis   max time to wait for a record
+   *
+   * @return                false if there is no record within the timeout
+   *                        or the ring is done
+   */
+  bool read(Record &record, int timeoutMillis);
+
+  /// @return   whether the ring is closed and all its records read
+  bool isDone() const;
+
+ private:
+  /// state of the ring at the start of the shared memory
+  struct Control {
+    uint64_t magic;
+    int64_t capacity;
+    /// number of bytes appended
+    alignas(64) std::atomic<int64_t> head;
+    /// number of bytes read by the consumer
+    alignas(64) std::atomic<int64_t> tail;
+    /// set once no record is appended anymore
+    std::atomic<int32_t> closed;
+  };
+
+  ShmRing(const std::string &path, bool owner, int fd, char *memory,
+          int64_t mapSize);
+
+  /// copies size bytes to the ring at position pos, wrapping around
+  void copyIn(int64_t pos, const void *src, int64_t size);
+
+  /// copies size bytes from the ring at position pos, wrapping around
+  void copyOut(int64_t pos, void *dest, int64_t size) const;
+
+  /// path of the file
+  const std::string path_;
+  /// whether this process created the ring
+  const bool owner_;
+  /// fd of the file
+  const int fd_;
+  /// shared memory
+  char *const memory_;
+  /// size of memory_
+  const int64_t mapSize_;
+  /// control block in memory_
+  Control *const control_;
+  /// data of the ring, after the control block
+  char *const data_;
+  /// serializes the appends of the receiver threads
+  std::mutex appendMutex_;
+};
+}
+}
@@ -0,0 +1,455 @@
+/**
+ * Copyright (c) 2014-present, Facebook, Inc.
+ * All rights reserved.
+ *
+ * This source code is licensed under the BSD-style license found in the
+ * LICENSE file in the root directory of this source tree. An additional grant
+ * of patent rights can be found in the PATENTS file in the same directory.
+ */
+#include <wdt/util/ShmTransport.h>
+
+#include <wdt/Reporting.h>
+
+#include <errno.h>
+#include <fcntl.h>
+#include <limits.h>
+#include <poll.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <sys/socket.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <random>
+#include <thread>
+
+#ifdef __linux__
+#include <linux/futex.h>
+#include <sys/syscall.h>
+#endif
+
+namespace facebook {
+namespace wdt {
+
+/// magic starting the setup, catches a peer not doing shm setup
+static const char kSetupMagic[] = "WDTSHM01";
+/// identifies a ring
+const uint64_t kShmTransportMagic = 0x5744545348545250ULL;
+/// size of the control block, the data of the ring follows it
+const int64_t kControlSize = 4096;
+/// max length of the path of the ring, NUL included
+const int kMaxPathLen = 256;
+/// number of checks of the other side before waiting on the futex
+const int kSpinCount = 200;
+
+struct ShmTransport::Control {
+  uint64_t magic;
+  uint64_t token;
+  int64_t capacity;
+  /// number of bytes written
+  alignas(64) std::atomic<int64_t> head;
+  /// futex word bumped when head or closed change
+  std::atomic<uint32_t> headSeq;
+  /// whether the reader waits on headSeq
+  std::atomic<int32_t> readerWaiting;
+  /// whether the reader waits for its poll fd, to send a doorbell byte to
+  std::atomic<int32_t> readerPolling;
+  /// set once the writer wrote everything
+  std::atomic<int32_t> closed;
+  /// number of bytes read
+  alignas(64) std::atomic<int64_t> tail;
+  /// futex word bumped when tail changes
+  std::atomic<uint32_t> tailSeq;
+  /// whether the writer waits on tailSeq
+  std::atomic<int32_t> writerWaiting;
+};
+
+static_assert(sizeof(std::atomic<uint32_t>) == sizeof(uint32_t),
+              "futex words must be plain 32 bits");
+static_assert(ATOMIC_LLONG_LOCK_FREE == 2,
+              "positions of the ring must be lock free to be shared");
+
+static void futexWait(std::atomic<uint32_t> &word, uint32_t expected,
+                      int timeoutMs) {
+#ifdef __linux__
+  struct timespec timeout;
+  timeout.tv_sec = timeoutMs / 1000;
+  timeout.tv_nsec = (timeoutMs % 1000) * 1000000L;
+  // not FUTEX_PRIVATE_FLAG, the word is shared with another process
+  ::syscall(SYS_futex, reinterpret_cast<uint32_t *>(&word), FUTEX_WAIT,
+            expected, timeoutMs > 0 ? &timeout : nullptr, nullptr, 0);
+#else
+  (void)word;
+  (void)expected;
+  (void)timeoutMs;
+  /* sleep override */
+  std::this_thread::sleep_for(std::chrono::milliseconds(1));
+#endif
+}
+
+static void futexWake(std::atomic<uint32_t> &word) {
+#ifdef __linux__
+  ::syscall(SYS_futex, reinterpret_cast<uint32_t *>(&word), FUTEX_WAKE,
+            INT_MAX, nullptr, nullptr, 0);
+#else
+  (void)word;
+#endif
+}
+
+/// bumps the futex word of a change, waking up the other side if it waits
+static void notifyChange(std::atomic<uint32_t> &seq,
+                         std::atomic<int32_t> &waiting) {
+  seq.fetch_add(1);
+  if (waiting.load()) {
+    futexWake(seq);
+  }
+}
+
+/**
+ * Waits till condition() is true, spinning a bit first
+ *
+ * @return    false if it is still false after timeoutMs (<= 0 for no timeout)
+ */
+template <typename Condition>
+static bool waitFor(std::atomic<uint32_t> &seq, std::atomic<int32_t> &waiting,
+                    Condition condition, int timeoutMs) {
+  for (int i = 0; i < kSpinCount; i++) {
+    if (condition()) {
+      return true;
+    }
+  }
+  const auto startTime = Clock::now();
+  while (true) {
+    const uint32_t seen = seq.load();
+    waiting.store(1);
+    // a change made before waiting was set is seen here, one made after
+    // wakes up the futex
+    if (condition()) {
+      waiting.store(0);
+      return true;
+    }
+    int waitMs = timeoutMs;
+    if (timeoutMs > 0) {
+      waitMs = timeoutMs - durationMillis(Clock::now() - startTime);
+      if (waitMs <= 0) {
+        waiting.store(0);
+        return false;
+      }
+    }
+    futexWait(seq, seen, waitMs);
+    waiting.store(0);
+    if (condition()) {
+      return true;
+    }
+  }
+}
+
+ErrorCode ShmTransport::connect(ThreadCtx &threadCtx, int fd, bool isWriter,
+                                std::unique_ptr<Transport> &transport) {
+  const WdtOptions &options = threadCtx.getOptions();
+  const int timeoutMs = options.read_timeout_millis;
+  std::unique_ptr<ShmTransport> shm(new ShmTransport(threadCtx, fd, isWriter));
+  // the values are only used on the same host, they are sent as they are
+  // in memory
+  bool valid = true;
+  uint64_t token = 0;
+  int64_t capacity = 0;
+  std::string path;
+  if (!isWriter) {
+    capacity = std::max<int64_t>(options.shm_buffer_mbytes, 1) * kMbToB;
+    valid = shm->create(capacity, path, token);
+  }
+  char localBuf[kSetupLen];
+  char peerBuf[kSetupLen];
+  memset(localBuf, 0, kSetupLen);
+  memcpy(localBuf, kSetupMagic, 8);
+  localBuf[8] = valid ? 1 : 0;
+  memcpy(localBuf + 9, &token, 8);
+  memcpy(localBuf + 17, &capacity, 8);
+  memcpy(localBuf + 25, path.data(), path.size());
+  if (!exchangeSetup(fd, localBuf, peerBuf, kSetupLen, timeoutMs)) {
+    return CONN_ERROR;
+  }
+  if (memcmp(peerBuf, kSetupMagic, 8) != 0) {
+    WLOG(ERROR) << "Peer did not send its shm setup, shm_transport has to be "
+                << "set on both sides " << fd;
+    return CONN_ERROR;
+  }
+  if (isWriter) {
+    valid = (peerBuf[8] != 0);
+    memcpy(&token, peerBuf + 9, 8);
+    memcpy(&capacity, peerBuf + 17, 8);
+    path.assign(peerBuf + 25, strnlen(peerBuf + 25, kMaxPathLen - 1));
+  }
+  if (!valid) {
+    WLOG(WARNING) << "The receiver could not create its shm ring, using tcp "
+                  << "for " << fd;
+    transport = std::make_unique<TcpTransport>(fd);
+    return OK;
+  }
+  // the writer only maps the ring if it is on the same host
+  char ready = isWriter ? (shm->attach(path, token, capacity) ? 1 : 0) : 1;
+  char peerReady = 0;
+  if (!exchangeSetup(fd, &ready, &peerReady, 1, timeoutMs)) {
+    return CONN_ERROR;
+  }
+  if (!ready || !peerReady) {
+    WLOG(INFO) << "Peer on another host, using tcp for " << fd;
+    transport = std::make_unique<TcpTransport>(fd);
+    return OK;
+  }
+  if (!shm->ringFile_.empty()) {
+    // mapped by both sides, nothing left to open it
+    ::unlink(shm->ringFile_.c_str());
+    shm->ringFile_.clear();
+  }
+  WVLOG(1) << "shm transport ready for " << fd << ", ring of " << capacity
+           << " bytes";
+  transport = std::move(shm);
+  return OK;
+}
+
+ShmTransport::ShmTransport(ThreadCtx &threadCtx, int fd, bool isWriter)
+    : threadCtx_(threadCtx), fd_(fd), isWriter_(isWriter) {
+}
+
+ShmTransport::~ShmTransport() {
+  if (memory_ != nullptr) {
+    ::munmap(memory_, mapSize_);
+  }
+  if (ringFd_ >= 0) {
+    ::close(ringFd_);
+  }
+  if (!ringFile_.empty()) {
+    ::unlink(ringFile_.c_str());
+  }
+}
+
+bool ShmTransport::create(int64_t capacity, std::string &path,
+                          uint64_t &token) {
+  const WdtOptions &options = threadCtx_.getOptions();
+  std::random_device randomDevice;
+  token = ((uint64_t)randomDevice() << 32) | randomDevice();
+  if (options.shm_transport_dir.empty()) {
+#ifdef MFD_CLOEXEC
+    ringFd_ = ::memfd_create("wdt_shm_transport", MFD_CLOEXEC);
+    if (ringFd_ < 0) {
+      WPLOG(WARNING) << "Unable to create the shm ring";
+      return false;
+    }
+    // the writer opens the memfd through the fds of this process
+    path = "/proc/" + std::to_string(::getpid()) + "/fd/" +
+           std::to_string(ringFd_);
+#else
+    WLOG(WARNING) << "No memfd on this platform, shm_transport_dir has to be "
+                  << "set";
+    return false;
+#endif
+  } else {
+    ringFile_ = options.shm_transport_dir + "/wdt_shm_" +
+                std::to_string(::getpid()) + "_" + std::to_string(fd_) + "_" +
+                std::to_string(token);
+    if ((int)ringFile_.size() >= kMaxPathLen) {
+      WLOG(ERROR) << "shm_transport_dir too long " << ringFile_;
+      ringFile_.clear();
+      return false;
+    }
+    ringFd_ = ::open(ringFile_.c_str(), O_RDWR | O_CREAT | O_EXCL | O_CLOEXEC,
+                     0600);
+    if (ringFd_ < 0) {
+      WPLOG(WARNING) << "Unable to create the shm ring " << ringFile_;
+      ringFile_.clear();
+      return false;
+    }
+    path = ringFile_;
+  }
+  if (::ftruncate(ringFd_, kControlSize + capacity) != 0) {
+    WPLOG(WARNING) << "Unable to size the shm ring " << path;
+    return false;
+  }
+  if (!map(capacity)) {
+    return false;
+  }
+  Control *control = new (memory_) Control();
+  control->token = token;
+  control->capacity = capacity;
+  control->head = 0;
+  control->headSeq = 0;
+  control->readerWaiting = 0;
+  control->readerPolling = 0;
+  control->closed = 0;
+  control->tail = 0;
+  control->tailSeq = 0;
+  control->writerWaiting = 0;
+  // the ring is only valid for the writer once its magic is written
+  std::atomic_thread_fence(std::memory_order_release);
+  control->magic = kShmTransportMagic;
+  return true;
+}
+
+bool ShmTransport::attach(const std::string &path, uint64_t token,
+                          int64_t capacity) {
+  // another host may have an unrelated file there, which must not block
+  ringFd_ = ::open(path.c_str(), O_RDWR | O_NONBLOCK | O_CLOEXEC);
+  if (ringFd_ < 0) {
+    WPLOG(INFO) << "Unable to open the shm ring of the peer " << path;
+    return false;
+  }
+  struct stat ringStat;
+  if (::fstat(ringFd_, &ringStat) != 0 || !S_ISREG(ringStat.st_mode) ||
+      ringStat.st_size != kControlSize + capacity) {
+    WLOG(INFO) << "Not the shm ring of the peer " << path;
+    return false;
+  }
+  if (!map(capacity)) {
+    return false;
+  }
+  std::atomic_thread_fence(std::memory_order_acquire);
+  if (control_->magic != kShmTransportMagic || control_->token != token ||
+      control_->capacity != capacity) {
+    WLOG(INFO) << "Not the shm ring of the peer " << path;
+    return false;
+  }
+  return true;
+}
+
+bool ShmTransport::map(int64_t capacity) {
+  const int64_t mapSize = kControlSize + capacity;
+  void *memory =
+      ::mmap(nullptr, mapSize, PROT_READ | PROT_WRITE, MAP_SHARED, ringFd_, 0);
+  if (memory == MAP_FAILED) {
+    WPLOG(WARNING) << "Unable to map the shm ring of " << capacity << " bytes";
+    return false;
+  }
+  memory_ = static_cast<char *>(memory);
+  mapSize_ = mapSize;
+  control_ = reinterpret_cast<Control *>(memory_);
+  data_ = memory_ + kControlSize;
+  capacity_ = capacity;
+  return true;
+}
+
+void ShmTransport::drainDoorbell() {
+  char buf[64];
+  while (true) {
+    const int64_t ret = ::recv(fd_, buf, sizeof(buf), MSG_DONTWAIT);
+    if (ret > 0) {
+      continue;
+    }
+    if (ret == 0) {
+      WVLOG(1) << "tcp connection of the shm transport closed " << fd_;
+      eof_ = true;
+    }
+    break;
+  }
+  doorbellArmed_ = false;
+}
+
+bool ShmTransport::hasDataOrEnd() const {
+  return control_->head.load(std::memory_order_acquire) >
+             control_->tail.load(std::memory_order_relaxed) ||
+         control_->closed.load() || eof_;
+}
+
+int64_t ShmTransport::read(char *buf, int64_t nbyte, int timeoutMs) {
+  if (isWriter_) {
+    return ::read(fd_, buf, nbyte);
+  }
+  if (doorbellArmed_) {
+    drainDoorbell();
+  }
+  Control &control = *control_;
+  if (!waitFor(control.headSeq, control.readerWaiting,
+               [this]() { return hasDataOrEnd(); }, timeoutMs)) {
+    // the writer may be gone
+    drainDoorbell();
+    if (!hasDataOrEnd()) {
+      errno = EAGAIN;
+      return -1;
+    }
+  }
+  const int64_t head = control.head.load(std::memory_order_acquire);
+  const int64_t tail = control.tail.load(std::memory_order_relaxed);
+  if (head == tail) {
+    return 0;
+  }
+  const int64_t count = std::min(nbyte, head - tail);
+  const int64_t offset = tail % capacity_;
+  const int64_t firstPart = std::min(count, capacity_ - offset);
+  memcpy(buf, data_ + offset, firstPart);
+  memcpy(buf + firstPart, data_, count - firstPart);
+  control.tail.store(tail + count, std::memory_order_release);
+  notifyChange(control.tailSeq, control.writerWaiting);
+  return count;
+}
+
+int64_t ShmTransport::write(const char *buf, int64_t nbyte, int timeoutMs) {
+  if (!isWriter_) {
+    return ::write(fd_, buf, nbyte);
+  }
+  Control &control = *control_;
+  auto hasSpace = [this, &control]() {
+    return control.head.load(std::memory_order_relaxed) -
+               control.tail.load(std::memory_order_acquire) <
+           capacity_;
+  };
+  if (!waitFor(control.tailSeq, control.writerWaiting, hasSpace, timeoutMs)) {
+    errno = EAGAIN;
+    return -1;
+  }
+  const int64_t head = control.head.load(std::memory_order_relaxed);
+  const int64_t tail = control.tail.load(std::memory_order_acquire);
+  const int64_t count = std::min(nbyte, capacity_ - (head - tail));
+  const int64_t offset = head % capacity_;
+  const int64_t firstPart = std::min(count, capacity_ - offset);
+  memcpy(data_ + offset, buf, firstPart);
+  memcpy(data_, buf + firstPart, count - firstPart);
+  control.head.store(head + count, std::memory_order_release);
+  notifyChange(control.headSeq, control.readerWaiting);
+  if (control.readerPolling.load() && control.readerPolling.exchange(0)) {
+    const char doorbell = 0;
+    ::send(fd_, &doorbell, 1, MSG_DONTWAIT | MSG_NOSIGNAL);
+  }
+  return count;
+}
+
+bool ShmTransport::isReadable() {
+  if (isWriter_) {
+    struct pollfd pfd;
+    pfd.fd = fd_;
+    pfd.events = POLLIN;
+    pfd.revents = 0;
+    return ::poll(&pfd, 1, 0) > 0;
+  }
+  if (hasDataOrEnd()) {
+    return true;
+  }
+  // the writer sends a byte over tcp with its next data
+  control_->readerPolling.store(1);
+  doorbellArmed_ = true;
+  return hasDataOrEnd();
+}
+
+int ShmTransport::shutdownWrites() {
+  if (isWriter_) {
+    control_->closed.store(1);
+    notifyChange(control_->headSeq, control_->readerWaiting);
+    if (control_->readerPolling.exchange(0)) {
+      const char doorbell = 0;
+      ::send(fd_, &doorbell, 1, MSG_DONTWAIT | MSG_NOSIGNAL);
+    }
+  }
+  return ::shutdown(fd_, SHUT_WR);
+}
+
+int64_t ShmTransport::getUnackedBytes() const {
+  if (!isWriter_) {
+    return -1;
+  }
+  return control_->head.load(std::memory_order_relaxed) -
+         control_->tail.load(std::memory_order_acquire);
+}
+}
+}
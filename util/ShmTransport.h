@@ -0,0 +1,124 @@
+/**
+ * Copyright (c) 2014-present, Facebook, Inc.
+ * All rights reserved.
+ *
+ * This source code is licensed under the BSD-style license found in the
+ * LICENSE file in the root directory of this source tree. An additional grant
+ * of patent rights can be found in the PATENTS file in the same directory.
+ */
+#pragma once
+
+#include <wdt/ErrorCodes.h>
+#include <wdt/util/CommonImpl.h>
+#include <wdt/util/Transport.h>
+
+#include <memory>
+#include <string>
+
+namespace facebook {
+namespace wdt {
+
+/**
+ * Transport moving the data of one direction of a connection through a ring
+ * in shared memory, for a sender and a receiver on the same host. The other
+ * direction stays on the tcp connection. The reader creates the ring in a
+ * memfd (or in a file of shm_transport_dir, for containers not seeing each
+ * other's /proc) and sends its path over tcp, the writer maps it. A writer
+ * which can't map the ring is on another host: both sides then keep tcp.
+ * The sides wait for each other with futexes on the shared memory. The
+ * reader parked on its poll fd is woken up with a byte sent over tcp.
+ * Not thread safe, like the socket using it.
+ */
+class ShmTransport : public Transport {
+ public:
+  /// length of the encoded setup exchanged over tcp
+  static const int kSetupLen = 8 + 1 + 8 + 8 + 256;
+
+  /**
+   * Sets up the transport of a connection just established
+   *
+   * @param threadCtx   context of the thread of the socket
+   * @param fd          connected socket
+   * @param isWriter    true on the side writing the data (the sender)
+   * @param transport   set to the shared memory transport, or to tcp if the
+   *                    writer can't map the ring of the reader
+   *
+   * @return            OK, CONN_ERROR if the exchange failed
+   */
+  static ErrorCode connect(ThreadCtx &threadCtx, int fd, bool isWriter,
+                           std::unique_ptr<Transport> &transport);
+
+  ~ShmTransport() override;
+
+  int64_t read(char *buf, int64_t nbyte, int timeoutMs) override;
+
+  int64_t write(const char *buf, int64_t nbyte, int timeoutMs) override;
+
+  bool isReadable() override;
+
+  int getPollFd() const override {
+    return fd_;
+  }
+
+  int shutdownWrites() override;
+
+  bool isDataOnFd() const override {
+    return false;
+  }
+
+  int64_t getUnackedBytes() const override;
+
+  std::string getName() const override {
+    return "shm";
+  }
+
+ private:
+  /// state of the ring at the start of the shared memory
+  struct Control;
+
+  ShmTransport(ThreadCtx &threadCtx, int fd, bool isWriter);
+
+  /**
+   * Reader: creates the ring
+   *
+   * @param capacity    bytes of the ring
+   * @param path        set to the path the writer opens
+   * @param token       set to the token the writer checks
+   */
+  bool create(int64_t capacity, std::string &path, uint64_t &token);
+
+  /// writer: maps the ring created by the reader
+  bool attach(const std::string &path, uint64_t token, int64_t capacity);
+
+  /// maps the ring file of ringFd_
+  bool map(int64_t capacity);
+
+  /// reads the doorbell bytes sent by the writer, sets eof_ if tcp is closed
+  void drainDoorbell();
+
+  /// @return   whether read() would not wait
+  bool hasDataOrEnd() const;
+
+  ThreadCtx &threadCtx_;
+  /// tcp connection, not owned
+  const int fd_;
+  const bool isWriter_;
+
+  /// fd of the ring
+  int ringFd_{-1};
+  /// reader: file of the ring to remove, if not a memfd
+  std::string ringFile_;
+  /// mapping of the ring
+  char *memory_{nullptr};
+  int64_t mapSize_{0};
+  Control *control_{nullptr};
+  /// data of the ring, after the control block
+  char *data_{nullptr};
+  int64_t capacity_{0};
+  /// reader: whether the tcp connection was closed by the writer
+  bool eof_{false};
+  /// reader: whether the writer may have sent doorbell bytes
+  bool doorbellArmed_{false};
+};
+}
+}
@@ -0,0 +1,143 @@
+/**
+ * Copyright (c) 2014-present, Facebook, Inc.
+ * All rights reserved.
+ *
+ * This source code is licensed under the BSD-style license found in the
+ * LICENSE file in the root directory of this source tree. An additional grant
+ * of patent rights can be found in the PATENTS file in the same directory.
+ */
+#include <wdt/util/StreamOutput.h>
+
+#include <wdt/util/CommonImpl.h>
+
+#include <fcntl.h>
+#include <unistd.h>
+#include <algorithm>
+#include <vector>
+
+namespace facebook {
+namespace wdt {
+
+/// size of the reads of the file copied
+const int64_t kStreamCopyBytes = 1024 * 1024;
+
+StreamOutput::StreamOutput(const std::string &relPath,
+                           const std::string &fullPath, int outputFd)
+    : relPath_(relPath), fullPath_(fullPath), outputFd_(outputFd) {
+}
+
+StreamOutput::~StreamOutput() {
+  finish();
+  if (fileFd_ >= 0) {
+    ::close(fileFd_);
+  }
+}
+
+const std::string &StreamOutput::getRelPath() const {
+  return relPath_;
+}
+
+void StreamOutput::start() {
+  WDT_CHECK(!copyThread_.joinable());
+  copyThread_ = std::thread(&StreamOutput::copyLoop, this);
+}
+
+void StreamOutput::addBlock(int64_t offset, int64_t size) {
+  if (size <= 0) {
+    return;
+  }
+  std::lock_guard<std::mutex> lock(mutex_);
+  // a block can be received again after a connection error
+  int64_t &end = pendingBlocks_[offset];
+  end = std::max(end, offset + size);
+  conditionBlockAdded_.notify_one();
+}
+
+ErrorCode StreamOutput::finish() {
+  {
+    std::lock_guard<std::mutex> lock(mutex_);
+    finished_ = true;
+    conditionBlockAdded_.notify_one();
+  }
+  if (copyThread_.joinable()) {
+    copyThread_.join();
+  }
+  std::lock_guard<std::mutex> lock(mutex_);
+  return errorCode_;
+}
+
+void StreamOutput::copyLoop() {
+  std::unique_lock<std::mutex> lock(mutex_);
+  while (true) {
+    // the blocks following the bytes already copied
+    int64_t end = numCopied_;
+    while (!pendingBlocks_.empty() && pendingBlocks_.begin()->first <= end) {
+      end = std::max(end, pendingBlocks_.begin()->second);
+      pendingBlocks_.erase(pendingBlocks_.begin());
+    }
+    if (end > numCopied_) {
+      const int64_t start = numCopied_;
+      lock.unlock();
+      const bool success = copyRange(start, end);
+      lock.lock();
+      if (!success) {
+        errorCode_ = FILE_WRITE_ERROR;
+        return;
+      }
+      numCopied_ = end;
+      continue;
+    }
+    if (finished_) {
+      if (!pendingBlocks_.empty()) {
+        WLOG(ERROR) << "Bytes of " << relPath_ << " missing at " << numCopied_
+                    << ", next block received at "
+                    << pendingBlocks_.begin()->first;
+        errorCode_ = ERROR;
+      }
+      WLOG(INFO) << "Copied " << numCopied_ << " bytes of " << relPath_
+                 << " to fd " << outputFd_;
+      return;
+    }
+    conditionBlockAdded_.wait(lock);
+  }
+}
+
+bool StreamOutput::copyRange(int64_t start, int64_t end) {
+  if (fileFd_ < 0) {
+    fileFd_ = ::open(fullPath_.c_str(), O_RDONLY);
+    if (fileFd_ < 0) {
+      WPLOG(ERROR) << "Unable to open " << fullPath_ << " to copy it";
+      return false;
+    }
+  }
+  std::vector<char> buffer(std::min(kStreamCopyBytes, end - start));
+  for (int64_t offset = start; offset < end;) {
+    const int64_t numRead =
+        ::pread(fileFd_, buffer.data(),
+                std::min<int64_t>(buffer.size(), end - offset), offset);
+    if (numRead < 0 && errno == EINTR) {
+      continue;
+    }
+    if (numRead <= 0) {
+      WPLOG(ERROR) << "Unable to read " << fullPath_ << " at " << offset;
+      return false;
+    }
+    for (int64_t written = 0; written < numRead;) {
+      const int64_t numWritten =
+          ::write(outputFd_, buffer.data() + written, numRead - written);
+      if (numWritten < 0 && errno == EINTR) {
+        continue;
+      }
+      if (numWritten <= 0) {
+        WPLOG(ERROR) << "Unable to copy " << relPath_ << " to fd "
+                     << outputFd_;
+        return false;
+      }
+      written += numWritten;
+    }
+    offset += numRead;
+  }
+  return true;
+}
+}
+}
@@ -0,0 +1,98 @@
+/**
+ * Copyright (c) 2014-present, Facebook, Inc.
+ * All rights reserved.
+ *
+ * This source code is licensed under the BSD-style license found in the
+ * LICENSE file in the root directory of this source tree. An additional grant
+ * of patent rights can be found in the PATENTS file in the same directory.
+ */
+#pragma once
+
+#include <wdt/ErrorCodes.h>
+
+#include <condition_variable>
+#include <map>
+#include <mutex>
+#include <string>
+#include <thread>
+
+namespace facebook {
+namespace wdt {
+
+/**
+ * Copies a file received in blocks of any order to an output fd (e.g. a
+ * pipe) in order. The blocks are written to the file by the receiver threads
+ * as usual, a background thread copies the data to the output as soon as the
+ * bytes before it are all written. All the methods are thread safe.
+ */
+class StreamOutput {
+ public:
+  /**
+   * @param relPath     relative path of the file received
+   * @param fullPath    path of the file in the destination directory
+   * @param outputFd    fd the data is copied to, not closed
+   */
+  StreamOutput(const std::string &relPath, const std::string &fullPath,
+               int outputFd);
+
+  /// stops the copy thread if finish() was not called
+  ~StreamOutput();
+
+  /// @return   relative path of the file received
+  const std::string &getRelPath() const;
+
+  /// starts the copy thread
+  void start();
+
+  /**
+   * Called once a block of the file is written
+   *
+   * @param offset    offset of the block in the file
+   * @param size      size of the block
+   */
+  void addBlock(int64_t offset, int64_t size);
+
+  /**
+   * Copies the rest of the blocks written and joins the copy thread. Has to
+   * be called once all the blocks are written
+   *
+   * @return    OK, or an error if a block is missing or the copy failed
+   */
+  ErrorCode finish();
+
+ private:
+  /// main loop of the copy thread
+  void copyLoop();
+
+  /**
+   * Copies a range of the file to the output
+   *
+   * @return    false on error
+   */
+  bool copyRange(int64_t start, int64_t end);
+
+  /// relative path of the file received
+  const std::string relPath_;
+  /// path of the file in the destination directory
+  const std::string fullPath_;
+  /// fd the data is copied to
+  const int outputFd_;
+  /// fd of the file, opened with the first copy
+  int fileFd_{-1};
+  /// blocks written and not copied yet, end by start offset
+  std::map<int64_t, int64_t> pendingBlocks_;
+  /// number of bytes copied to the output
+  int64_t numCopied_{0};
+  /// set once all the blocks are written
+  bool finished_{false};
+  /// error of the copy
+  ErrorCode errorCode_{OK};
+  /// protects the members above
+  std::mutex mutex_;
+  /// notified when a block is added or finish() is called
+  std::condition_variable conditionBlockAdded_;
+  /// thread copying the data
+  std::thread copyThread_;
+};
+}
+}
@@ -0,0 +1,221 @@
+/**
+ * Copyright (c) 2014-present, Facebook, Inc.
+ * All rights reserved.
+ *
+ * This source code is licensed under the BSD-style license found in the
+ * LICENSE file in the root directory of this source tree. An additional grant
+ * of patent rights can be found in the PATENTS file in the same directory.
+ */
+#include <wdt/util/ThreadAffinity.h>
+
+#include <wdt/ErrorCodes.h>
+
+#include <dirent.h>
+#include <errno.h>
+#include <sched.h>
+#include <sys/syscall.h>
+#include <unistd.h>
+#include <algorithm>
+#include <fstream>
+#include <sstream>
+#ifdef WDT_HAS_MEMPOLICY
+#include <linux/mempolicy.h>
+#endif
+
+namespace facebook {
+namespace wdt {
+
+const char *const ThreadAffinity::kAutoCpuList = "auto";
+
+/// reads the first line of a (sysfs) file, false if it can't be read
+static bool readFirstLine(const std::string &path, std::string &line) {
+  std::ifstream file(path);
+  return file.good() && std::getline(file, line);
+}
+
+ThreadAffinity::ThreadAffinity(const WdtOptions &options) {
+  const std::string &cpuList = options.thread_cpu_list;
+  if (cpuList.empty()) {
+    return;
+  }
+  if (cpuList == kAutoCpuList) {
+    const int node = getInterfaceNumaNode(options.numa_interface);
+    if (node < 0) {
+      WLOG(WARNING) << "Unable to find the numa node of network interface '"
+                    << options.numa_interface << "', threads are not pinned";
+      return;
+    }
+    if (!getNumaNodeCpus(node, cpus_)) {
+      WLOG(WARNING) << "Unable to read the cpus of numa node " << node
+                    << ", threads are not pinned";
+      return;
+    }
+    numaNode_ = node;
+  } else {
+    if (!parseCpuList(cpuList, cpus_)) {
+      WLOG(ERROR) << "Invalid thread cpu list " << cpuList
+                  << ", threads are not pinned";
+      cpus_.clear();
+      return;
+    }
+    numaNode_ = getCpusNumaNode(cpus_);
+  }
+  WLOG(INFO) << "Pinning threads to " << cpus_.size() << " cpus from "
+             << cpus_.front() << " to " << cpus_.back() << ", numa node "
+             << numaNode_;
+}
+
+bool ThreadAffinity::pinCurrentThread() const {
+  if (cpus_.empty()) {
+    return true;
+  }
+#ifdef HAS_SCHED_SETAFFINITY
+  cpu_set_t cpuSet;
+  CPU_ZERO(&cpuSet);
+  for (int cpu : cpus_) {
+    if (cpu < CPU_SETSIZE) {
+      CPU_SET(cpu, &cpuSet);
+    }
+  }
+  // pid 0 is the calling thread
+  if (sched_setaffinity(0, sizeof(cpuSet), &cpuSet) != 0) {
+    WPLOG(ERROR) << "sched_setaffinity failed";
+    return false;
+  }
+  return true;
+#else
+  WLOG(WARNING) << "Thread pinning not supported by this build";
+  return false;
+#endif
+}
+
+bool ThreadAffinity::parseCpuList(const std::string &list,
+                                  std::vector<int> &cpus) {
+  cpus.clear();
+  std::stringstream ss(list);
+  std::string range;
+  while (std::getline(ss, range, ',')) {
+    if (range.empty()) {
+      continue;
+    }
+    const size_t dash = range.find('-');
+    int first, last;
+    try {
+      size_t end;
+      first = std::stoi(range, &end);
+      if (dash == std::string::npos) {
+        last = first;
+      } else {
+        if (end != dash) {
+          return false;
+        }
+        last = std::stoi(range.substr(dash + 1), &end);
+        end += dash + 1;
+      }
+      if (end != range.size()) {
+        return false;
+      }
+    } catch (const std::exception &e) {
+      return false;
+    }
+    if (first < 0 || last < first) {
+      return false;
+    }
+    for (int cpu = first; cpu <= last; cpu++) {
+      cpus.push_back(cpu);
+    }
+  }
+  std::sort(cpus.begin(), cpus.end());
+  cpus.erase(std::unique(cpus.begin(), cpus.end()), cpus.end());
+  return !cpus.empty();
+}
+
+int ThreadAffinity::getInterfaceNumaNode(const std::string &interfaceName) {
+  const std::string kNetDir = "/sys/class/net/";
+  std::vector<std::string> interfaces;
+  if (!interfaceName.empty()) {
+    interfaces.push_back(interfaceName);
+  } else {
+    DIR *dir = opendir(kNetDir.c_str());
+    if (dir == nullptr) {
+      WPLOG(WARNING) << "Unable to list " << kNetDir;
+      return -1;
+    }
+    struct dirent *entry;
+    while ((entry = readdir(dir)) != nullptr) {
+      if (entry->d_name[0] != '.') {
+        interfaces.emplace_back(entry->d_name);
+      }
+    }
+    closedir(dir);
+    std::sort(interfaces.begin(), interfaces.end());
+  }
+  for (const auto &name : interfaces) {
+    std::string line;
+    // virtual interfaces have no device
+    if (!readFirstLine(kNetDir + name + "/device/numa_node", line)) {
+      continue;
+    }
+    const int node = atoi(line.c_str());
+    if (node >= 0) {
+      WVLOG(1) << "Network interface " << name << " is on numa node " << node;
+      return node;
+    }
+  }
+  return -1;
+}
+
+bool ThreadAffinity::getNumaNodeCpus(int node, std::vector<int> &cpus) {
+  std::string line;
+  if (!readFirstLine("/sys/devices/system/node/node" + std::to_string(node) +
+                         "/cpulist",
+                     line)) {
+    return false;
+  }
+  return parseCpuList(line, cpus);
+}
+
+int ThreadAffinity::getCpusNumaNode(const std::vector<int> &cpus) {
+  std::string line;
+  std::vector<int> nodes;
+  if (!readFirstLine("/sys/devices/system/node/possible", line) ||
+      !parseCpuList(line, nodes)) {
+    return -1;
+  }
+  for (int node : nodes) {
+    std::vector<int> nodeCpus;
+    if (!getNumaNodeCpus(node, nodeCpus)) {
+      continue;
+    }
+    if (std::includes(nodeCpus.begin(), nodeCpus.end(), cpus.begin(),
+                      cpus.end())) {
+      return node;
+    }
+    if (std::find_first_of(cpus.begin(), cpus.end(), nodeCpus.begin(),
+                           nodeCpus.end()) != cpus.end()) {
+      // cpus span several nodes
+      return -1;
+    }
+  }
+  return -1;
+}
+
+bool ThreadAffinity::bindToNumaNode(void *data, int64_t size, int node) {
+#if defined(WDT_HAS_MEMPOLICY) && defined(__NR_mbind)
+  const int kBitsPerLong = 8 * sizeof(unsigned long);
+  std::vector<unsigned long> nodeMask(node / kBitsPerLong + 1, 0);
+  nodeMask[node / kBitsPerLong] |= 1UL << (node % kBitsPerLong);
+  // preferred rather than bind, so that allocation does not fail if the node
+  // is out of memory
+  if (syscall(__NR_mbind, data, size, MPOL_PREFERRED, nodeMask.data(),
+              nodeMask.size() * kBitsPerLong, MPOL_MF_MOVE) != 0) {
+    WPLOG(WARNING) << "mbind failed for numa node " << node;
+    return false;
+  }
+  return true;
+#else
+  return false;
+#endif
+}
+}
+}
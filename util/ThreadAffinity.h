@@ -0,0 +1,105 @@
+/**
+ * Copyright (c) 2014-present, Facebook, Inc.
+ * All rights reserved.
+ *
+ * This source code is licensed under the BSD-style license found in the
+ * LICENSE file in the root directory of this source tree. An additional grant
+ * of patent rights can be found in the PATENTS file in the same directory.
+ */
+#pragma once
+
+#include <wdt/WdtConfig.h>
+#include <wdt/WdtOptions.h>
+
+#include <cstdint>
+#include <string>
+#include <vector>
+
+namespace facebook {
+namespace wdt {
+
+/**
+ * Placement of the transfer threads on cpus and numa nodes, computed once per
+ * transfer from the thread_cpu_list and numa_interface options. Information
+ * about the machine is read from sysfs, so that no extra library is needed.
+ */
+class ThreadAffinity {
+ public:
+  /// value of thread_cpu_list for placement derived from the nic
+  static const char *const kAutoCpuList;
+
+  /// @param options    options of the transfer
+  explicit ThreadAffinity(const WdtOptions &options);
+
+  /// @return   whether threads are pinned
+  bool isEnabled() const {
+    return !cpus_.empty();
+  }
+
+  /// @return   cpus the threads are pinned to
+  const std::vector<int> &getCpus() const {
+    return cpus_;
+  }
+
+  /// @return   numa node buffers are allocated on, -1 if unknown or if the
+  ///           cpus span several nodes
+  int getNumaNode() const {
+    return numaNode_;
+  }
+
+  /**
+   * Pins the calling thread to the cpus. Does nothing if pinning is disabled
+   *
+   * @return    false if pinning failed
+   */
+  bool pinCurrentThread() const;
+
+  /**
+   * Parses a list in the sysfs cpulist format, e.g "0-3,8,10-11"
+   *
+   * @param list    list to parse
+   * @param cpus    set to the sorted cpus of the list
+   *
+   * @return        false if the list is malformed
+   */
+  static bool parseCpuList(const std::string &list, std::vector<int> &cpus);
+
+  /**
+   * @param interfaceName   network interface, the first one attached to a
+   *                        numa node if empty
+   *
+   * @return                numa node of the interface, -1 if unknown
+   */
+  static int getInterfaceNumaNode(const std::string &interfaceName);
+
+  /**
+   * @param node    numa node
+   * @param cpus    set to the cpus of the node
+   *
+   * @return        false if the cpus of the node could not be read
+   */
+  static bool getNumaNodeCpus(int node, std::vector<int> &cpus);
+
+  /// @return   numa node all the cpus belong to, -1 if unknown or several
+  static int getCpusNumaNode(const std::vector<int> &cpus);
+
+  /**
+   * Asks the kernel to place the pages of a buffer on a numa node, moving the
+   * ones already allocated elsewhere
+   *
+   * @param data    start of the buffer, must be page aligned
+   * @param size    size of the buffer
+   * @param node    numa node
+   *
+   * @return        false if not supported or failed
+   */
+  static bool bindToNumaNode(void *data, int64_t size, int node);
+
+ private:
+  /// cpus the threads are pinned to, empty if pinning is disabled
+  std::vector<int> cpus_;
+  /// numa node of cpus_
+  int numaNode_{-1};
+};
+}
+}
@@ -9,22 +9,29 @@
 #include <wdt/util/ThreadTransferHistory.h>
 #include <wdt/Sender.h>
 
+#include <algorithm>
+
 namespace facebook {
 namespace wdt {
 
 ThreadTransferHistory::ThreadTransferHistory(DirectorySourceQueue &queue,
                                              TransferStats &threadStats,
-                                             int32_t port)
-    : queue_(queue), threadStats_(threadStats), port_(port) {
+                                             int32_t port,
+                                             SenderJournal *journal,
+                                             bool keepSourceStats)
+    : queue_(queue),
+      threadStats_(threadStats),
+      journal_(journal),
+      keepSourceStats_(keepSourceStats),
+      port_(port) {
   WVLOG(1) << "Making thread history for port " << port_;
 }
 
 std::string ThreadTransferHistory::getSourceId(int64_t index) {
-  std::lock_guard<std::mutex> lock(mutex_);
   std::string sourceId;
-  const int64_t historySize = history_.size();
-  if (index >= 0 && index < historySize) {
-    sourceId = history_[index]->getIdentifier();
+  const int64_t historySize = numAckedProcessed_ + history_.size();
+  if (index >= numAckedProcessed_ && index < historySize) {
+    sourceId = history_[index - numAckedProcessed_]->getIdentifier();
   } else {
     WLOG(WARNING) << "Trying to read out of bounds data " << index << " "
                   << history_.size();
@@ -33,17 +40,14 @@ std::string ThreadTransferHistory::getSourceId(int64_t index) {
 }
 
 bool ThreadTransferHistory::addSource(std::unique_ptr<ByteSource> &source) {
-  std::lock_guard<std::mutex> lock(mutex_);
-  if (globalCheckpoint_) {
-    // already received an error for this thread
-    WVLOG(1) << "adding source after global checkpoint is received. returning "
-                "the source to the queue";
-    markSourceAsFailed(source, lastCheckpoint_.get());
-    lastCheckpoint_.reset();
-    queue_.returnToQueue(source);
+  // no other thread changes the history while it is in use. If a global
+  // checkpoint came, the source is returned with the unacked ones
+  history_.emplace_back(std::move(source));
+  if (isGlobalCheckpointReceived()) {
+    WVLOG(1) << "added source after global checkpoint is received, it will "
+                "be returned to the queue";
     return false;
   }
-  history_.emplace_back(std::move(source));
   return true;
 }
 
@@ -56,31 +60,40 @@ ErrorCode ThreadTransferHistory::setLocalCheckpoint(
 ErrorCode ThreadTransferHistory::setGlobalCheckpoint(
     const Checkpoint &checkpoint) {
   std::unique_lock<std::mutex> lock(mutex_);
-  ErrorCode status = setCheckpointAndReturnToQueue(checkpoint, true);
+  globalCheckpoint_.store(true, std::memory_order_release);
   while (inUse_) {
     // have to wait, error thread signalled through globalCheckpoint_ flag
     WLOG(INFO) << "Transfer history still in use, waiting, checkpoint "
                << checkpoint;
     conditionInUse_.wait(lock);
   }
-  return status;
+  // the history now includes the block the error thread was sending
+  return setCheckpointAndReturnToQueue(checkpoint, true);
 }
 ErrorCode ThreadTransferHistory::setCheckpointAndReturnToQueue(
     const Checkpoint &checkpoint, bool globalCheckpoint) {
-  const int64_t historySize = history_.size();
+  const int64_t historySize = numAckedProcessed_ + history_.size();
   int64_t numReceivedSources = checkpoint.numBlocks;
   int64_t lastBlockReceivedBytes = checkpoint.lastBlockReceivedBytes;
   if (numReceivedSources > historySize) {
     WLOG(ERROR)
         << "checkpoint is greater than total number of sources transferred "
-        << history_.size() << " " << numReceivedSources;
+        << historySize << " " << numReceivedSources;
+    return INVALID_CHECKPOINT;
+  }
+  if (numReceivedSources < numAckedProcessed_) {
+    WLOG(ERROR) << "checkpoint is lower than the number of sources already "
+                   "acked "
+                << numAckedProcessed_ << " " << numReceivedSources;
     return INVALID_CHECKPOINT;
   }
   ErrorCode errCode = validateCheckpoint(checkpoint, globalCheckpoint);
   if (errCode == INVALID_CHECKPOINT) {
     return INVALID_CHECKPOINT;
   }
-  globalCheckpoint_ |= globalCheckpoint;
+  if (globalCheckpoint) {
+    globalCheckpoint_.store(true, std::memory_order_release);
+  }
   lastCheckpoint_ = std::make_unique<Checkpoint>(checkpoint);
   int64_t numFailedSources = historySize - numReceivedSources;
   if (numFailedSources == 0 && lastBlockReceivedBytes > 0) {
@@ -92,16 +105,25 @@ ErrorCode ThreadTransferHistory::setCheckpointAndReturnToQueue(
              "there are no unacked blocks in the history. Ignoring.";
     }
   }
-  numAcknowledged_ = numReceivedSources;
+  numAcknowledged_.store(numReceivedSources, std::memory_order_release);
   std::vector<std::unique_ptr<ByteSource>> sourcesToReturn;
+  SenderJournal::AckedBlock partialBlock;
+  partialBlock.size = 0;
   for (int64_t i = 0; i < numFailedSources; i++) {
     std::unique_ptr<ByteSource> source = std::move(history_.back());
     history_.pop_back();
     const Checkpoint *checkpointPtr =
         (i == numFailedSources - 1 ? &checkpoint : nullptr);
+    const int64_t offset = source->getOffset();
     markSourceAsFailed(source, checkpointPtr);
+    if (source->getOffset() > offset) {
+      partialBlock.relPath = source->getIdentifier();
+      partialBlock.offset = offset;
+      partialBlock.size = source->getOffset() - offset;
+    }
     sourcesToReturn.emplace_back(std::move(source));
   }
+  processAcked(partialBlock.size > 0 ? &partialBlock : nullptr);
   queue_.returnToQueue(sourcesToReturn);
   WLOG(INFO) << numFailedSources
              << " number of sources returned to queue, checkpoint: "
@@ -109,28 +131,58 @@ ErrorCode ThreadTransferHistory::setCheckpointAndReturnToQueue(
   return errCode;
 }
 
-std::vector<TransferStats> ThreadTransferHistory::popAckedSourceStats() {
-  std::unique_lock<std::mutex> lock(mutex_);
-  const int64_t historySize = history_.size();
-  WDT_CHECK(numAcknowledged_ == historySize);
+void ThreadTransferHistory::popAckedSourceStats(
+    SourceStatsTable &sourceStats) {
   // no locking needed, as this should be called after transfer has finished
-  std::vector<TransferStats> sourceStats;
-  while (!history_.empty()) {
-    sourceStats.emplace_back(std::move(history_.back()->getTransferStats()));
-    history_.pop_back();
-  }
-  return sourceStats;
+  WDT_CHECK(keepSourceStats_);
+  WDT_CHECK(history_.empty());
+  sourceStats.merge(ackedSourceStats_);
+  ackedSourceStats_ = SourceStatsTable();
 }
 
 void ThreadTransferHistory::markAllAcknowledged() {
-  std::unique_lock<std::mutex> lock(mutex_);
-  numAcknowledged_ = history_.size();
+  // called by the owner thread or once the transfer has finished
+  numAcknowledged_.store(numAckedProcessed_ + history_.size(),
+                         std::memory_order_release);
+  processAcked(nullptr);
+}
+
+void ThreadTransferHistory::processAcked(
+    const SenderJournal::AckedBlock *partialBlock) {
+  const int64_t numAcked = getNumAcked();
+  std::vector<SenderJournal::AckedBlock> blocks;
+  for (; numAckedProcessed_ < numAcked; numAckedProcessed_++) {
+    // acked sources are never sent again, freed once accounted for
+    std::unique_ptr<ByteSource> source = std::move(history_.front());
+    history_.pop_front();
+    queue_.addAckedBytes(source->getMetaData(), source->getOffset(),
+                         source->getSize());
+    if (keepSourceStats_) {
+      ackedSourceStats_.add(source->getMetaData().seqId,
+                            source->getTransferStats());
+    }
+    if (journal_ == nullptr) {
+      continue;
+    }
+    SenderJournal::AckedBlock block;
+    block.relPath = source->getIdentifier();
+    block.offset = source->getOffset();
+    block.size = source->getSize();
+    blocks.emplace_back(std::move(block));
+  }
+  if (journal_ == nullptr) {
+    return;
+  }
+  if (partialBlock != nullptr) {
+    blocks.push_back(*partialBlock);
+  }
+  journal_->addAckedBlocks(blocks);
 }
 
 void ThreadTransferHistory::returnUnackedSourcesToQueue() {
   std::unique_lock<std::mutex> lock(mutex_);
   Checkpoint checkpoint;
-  checkpoint.numBlocks = numAcknowledged_;
+  checkpoint.numBlocks = getNumAcked();
   setCheckpointAndReturnToQueue(checkpoint, false);
 }
 
@@ -223,14 +275,11 @@ void ThreadTransferHistory::markSourceAsFailed(
     threadStats_.decrNumBlocks();
     threadStats_.incrFailedAttempts();
   }
+  // the part received is acked, the rest is sent again
+  queue_.addAckedBytes(metadata, source->getOffset(), receivedBytes);
   source->advanceOffset(receivedBytes);
 }
 
-bool ThreadTransferHistory::isGlobalCheckpointReceived() {
-  std::lock_guard<std::mutex> lock(mutex_);
-  return globalCheckpoint_;
-}
-
 void ThreadTransferHistory::markNotInUse() {
   std::lock_guard<std::mutex> lock(mutex_);
   inUse_ = false;
@@ -238,8 +287,9 @@ void ThreadTransferHistory::markNotInUse() {
 }
 
 TransferHistoryController::TransferHistoryController(
-    DirectorySourceQueue &dirQueue)
-    : dirQueue_(dirQueue) {
+    DirectorySourceQueue &dirQueue, SenderJournal *journal,
+    bool keepSourceStats)
+    : dirQueue_(dirQueue), journal_(journal), keepSourceStats_(keepSourceStats) {
 }
 
 ThreadTransferHistory &TransferHistoryController::getTransferHistory(
@@ -252,8 +302,9 @@ ThreadTransferHistory &TransferHistoryController::getTransferHistory(
 void TransferHistoryController::addThreadHistory(int32_t port,
                                                  TransferStats &threadStats) {
   WVLOG(1) << "Adding the history for " << port;
-  threadHistoriesMap_.emplace(port, std::make_unique<ThreadTransferHistory>(
-                                        dirQueue_, threadStats, port));
+  auto history = std::make_unique<ThreadTransferHistory>(
+      dirQueue_, threadStats, port, journal_, keepSourceStats_);
+  threadHistoriesMap_.emplace(port, std::move(history));
 }
 
 ErrorCode TransferHistoryController::handleVersionMismatch() {
@@ -11,35 +11,48 @@
 #include <wdt/Protocol.h>
 #include <wdt/Reporting.h>
 #include <wdt/util/DirectorySourceQueue.h>
+#include <wdt/util/SenderJournal.h>
+#include <atomic>
+#include <deque>
 #include <vector>
 
 namespace facebook {
 namespace wdt {
 
-/// Transfer history of a sender thread
+/**
+ * Transfer history of a sender thread. Only the owner thread changes the
+ * history while it is in use, so the calls it makes once per block take no
+ * lock. Global checkpoints received by other threads are applied once the
+ * owner marks the history not in use
+ */
 class ThreadTransferHistory {
  public:
   /**
-   * @param queue        directory queue
-   * @param threadStats  stat object of the thread
+   * @param queue            directory queue
+   * @param threadStats      stat object of the thread
+   * @param journal          journal of the acked blocks, can be nullptr
+   * @param keepSourceStats  whether the stats of the acked sources are kept
+   *                         for popAckedSourceStats()
    */
   ThreadTransferHistory(DirectorySourceQueue &queue, TransferStats &threadStats,
-                        int32_t port);
+                        int32_t port, SenderJournal *journal = nullptr,
+                        bool keepSourceStats = false);
 
   /**
    * @param             index of the source
    * @return            if index is in bounds, returns the identifier for the
-   *                    source, else returns empty string
+   *                    source, else returns empty string. Empty as well for
+   *                    the sources acked, which are freed
    */
   std::string getSourceId(int64_t index);
 
   /**
    * Adds the source to the history. If global checkpoint has already been
-   * received, then the source is returned to the queue.
+   * received, the source is returned to the queue along with the unacked
+   * ones once the history is not in use anymore.
    *
    * @param source      source to be added to history
-   * @return            true if added to history, false if not added due to a
-   *                    global checkpoint
+   * @return            false if a global checkpoint has been received
    */
   bool addSource(std::unique_ptr<ByteSource> &source);
 
@@ -52,10 +65,12 @@ class ThreadTransferHistory {
   ErrorCode setLocalCheckpoint(const Checkpoint &checkpoint);
 
   /**
-   * @return            stats for acked sources, must be called after all the
-   *                    unacked sources are returned to the queue
+   * Adds the stats of the acked sources to a table, must be called after all
+   * the sources are acked or returned to the queue. Only with keepSourceStats
+   *
+   * @param sourceStats   table of the stats of the sources
    */
-  std::vector<TransferStats> popAckedSourceStats();
+  void popAckedSourceStats(SourceStatsTable &sourceStats);
 
   /// marks all the sources as acked
   void markAllAcknowledged();
@@ -69,11 +84,13 @@ class ThreadTransferHistory {
    * @return    number of sources acked by the receiver
    */
   int64_t getNumAcked() const {
-    return numAcknowledged_;
+    return numAcknowledged_.load(std::memory_order_acquire);
   }
 
   /// @return   whether global checkpoint has been received or not
-  bool isGlobalCheckpointReceived();
+  bool isGlobalCheckpointReceived() const {
+    return globalCheckpoint_.load(std::memory_order_acquire);
+  }
 
   /// Clears the inUse_ flag and notifies other waiting threads
   void markNotInUse();
@@ -91,7 +108,7 @@ class ThreadTransferHistory {
                                bool globalCheckpoint);
   /**
    * Sets global checkpoint. If the history is still in use, waits for the
-   * error thread to add current block to the history.
+   * error thread to stop using it before returning the sources to the queue.
    *
    * @param checkpoint             checkpoint received
    *
@@ -111,23 +128,42 @@ class ThreadTransferHistory {
   ErrorCode setCheckpointAndReturnToQueue(const Checkpoint &checkpoint,
                                           bool globalCheckpoint);
 
+  /**
+   * Accounts for the sources acked since the last call in the queue, records
+   * them in the journal, if any, and frees them
+   *
+   * @param partialBlock    bytes of a failed source received by the
+   *                        receiver, can be nullptr
+   */
+  void processAcked(const SenderJournal::AckedBlock *partialBlock);
+
   /// reference to global queue
   DirectorySourceQueue &queue_;
   /// reference to thread stats
   TransferStats &threadStats_;
-  /// history of the thread
-  std::vector<std::unique_ptr<ByteSource>> history_;
+  /// sources of the thread not acked yet, or acked but not processed yet,
+  /// only changed by the owner thread while in use
+  std::deque<std::unique_ptr<ByteSource>> history_;
   /// whether a global error checkpoint has been received or not
-  bool globalCheckpoint_{false};
+  std::atomic<bool> globalCheckpoint_{false};
   /// number of sources acked by the receiver thread
-  int64_t numAcknowledged_{0};
+  std::atomic<int64_t> numAcknowledged_{0};
+  /// journal of the acked blocks, nullptr if none
+  SenderJournal *journal_;
+  /// number of acked sources accounted for and freed by processAcked(),
+  /// history_ starts after them
+  int64_t numAckedProcessed_{0};
+  /// whether the stats of the acked sources are kept
+  const bool keepSourceStats_;
+  /// stats of the acked sources freed, only with keepSourceStats_
+  SourceStatsTable ackedSourceStats_;
   /// last received checkpoint
   std::unique_ptr<Checkpoint> lastCheckpoint_{nullptr};
   /// Port assosciated with the history
   int32_t port_;
   /// whether the owner thread is still using this
   bool inUse_{true};
-  /// Mutex used by history internally for synchronization
+  /// Guards inUse_ and the global checkpoints applied by other threads
   std::mutex mutex_;
   /// Condition variable to signify the history being in use
   std::condition_variable conditionInUse_;
@@ -139,8 +175,13 @@ class TransferHistoryController {
   /**
    * Constructor for the history controller
    * @param dirQueue      Directory queue used by the sender
+   * @param journal       Journal of the acked blocks, can be nullptr
+   * @param keepSourceStats   whether the histories keep the stats of the
+   *                          acked sources
    */
-  explicit TransferHistoryController(DirectorySourceQueue &dirQueue);
+  TransferHistoryController(DirectorySourceQueue &dirQueue,
+                            SenderJournal *journal = nullptr,
+                            bool keepSourceStats = false);
 
   /**
    * Add transfer history for a thread
@@ -162,6 +203,12 @@ class TransferHistoryController {
   /// Reference to the directory queue being used by the sender
   DirectorySourceQueue &dirQueue_;
 
+  /// Journal the histories record the acked blocks in, can be nullptr
+  SenderJournal *journal_;
+
+  /// Whether the histories keep the stats of the acked sources
+  const bool keepSourceStats_;
+
   /// Map of port (used by sender threads) and transfer history
   std::unordered_map<int32_t, std::unique_ptr<ThreadTransferHistory>>
       threadHistoriesMap_;
@@ -127,6 +127,18 @@ void Barrier::execute() {
   }
 }
 
+bool Barrier::hit() {
+  unique_lock<mutex> lock(mutex_);
+  WDT_CHECK(!isComplete_) << "Hitting the barrier after completion";
+  ++numHits_;
+  return checkForFinish();
+}
+
+bool Barrier::isComplete() {
+  unique_lock<mutex> lock(mutex_);
+  return isComplete_;
+}
+
 void Barrier::deRegister() {
   unique_lock<mutex> lock(mutex_);
   if (isComplete_) {
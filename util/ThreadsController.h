@@ -170,6 +170,17 @@ class Barrier {
   /// Executes the main functionality of the barrier
   void execute();
 
+  /**
+   * Hits the barrier without waiting for it to clear, for the threads which
+   * can't block (@see isComplete)
+   *
+   * @return    whether the barrier cleared
+   */
+  bool hit();
+
+  /// @return   whether all the threads hit the barrier
+  bool isComplete();
+
   /**
    * Thread controller should call this method when one thread
    * has been finished, since that thread will no longer be
@@ -16,10 +16,16 @@
 #include <folly/Range.h>
 
 #include <sys/file.h>
+#include <sys/mman.h>
 #include <sys/stat.h>
+#include <unistd.h>
 #include <wdt/Reporting.h>
+#include <algorithm>
+#include <cstring>
 #include <ctime>
+#include <functional>
 #include <iomanip>
+#include <queue>
 
 using folly::ByteRange;
 using std::string;
@@ -29,7 +35,12 @@ namespace wdt {
 
 // TODO consider revamping this log format
 
-const int TransferLogManager::WLOG_VERSION = 2;
+const int TransferLogManager::WLOG_VERSION = 3;
+const int TransferLogManager::WLOG_MIN_VERSION = 2;
+const int TransferLogManager::WLOG_BLOCK_CHECKSUM_VERSION = 3;
+
+/// entries of the log the files of which are stat-ed by a thread at a time
+static const int64_t kEntriesPerStatSegment = 16 * 1024;
 
 int64_t LogEncoderDecoder::timestampInMicroseconds() const {
   auto timestamp = Clock::now();
@@ -118,7 +129,9 @@ bool LogEncoderDecoder::decodeFileCreationEntry(char *buf, int16_t size,
 int64_t LogEncoderDecoder::encodeBlockWriteEntry(char *dest, int64_t max,
                                                  const int64_t seqId,
                                                  const int64_t offset,
-                                                 const int64_t blockSize) {
+                                                 const int64_t blockSize,
+                                                 ChecksumType checksumType,
+                                                 int64_t checksum) {
   int64_t size = sizeof(int16_t);
   WDT_CHECK_GE(max, size + 1);
   dest[size++] = TransferLogManager::BLOCK_WRITE;
@@ -126,6 +139,11 @@ int64_t LogEncoderDecoder::encodeBlockWriteEntry(char *dest, int64_t max,
             encodeVarI64C(dest, max, size, seqId) &&
             encodeVarI64C(dest, max, size, offset) &&
             encodeVarI64C(dest, max, size, blockSize);
+  if (ok && checksumType != NUM_CHECKSUM_TYPES) {
+    // optional, entries of older versions end here
+    ok = encodeVarI64C(dest, max, size, checksumType) &&
+         encodeVarI64C(dest, max, size, checksum);
+  }
   if (!ok) {
     WLOG(ERROR) << "Failed to encode blockwrite entry into " << max;
     return -1;
@@ -137,10 +155,20 @@ int64_t LogEncoderDecoder::encodeBlockWriteEntry(char *dest, int64_t max,
 bool LogEncoderDecoder::decodeBlockWriteEntry(char *buf, int16_t size,
                                               int64_t &timestamp,
                                               int64_t &seqId, int64_t &offset,
-                                              int64_t &blockSize) {
+                                              int64_t &blockSize,
+                                              ChecksumType &checksumType,
+                                              int64_t &checksum) {
   ByteRange br = makeByteRange(buf, size);
   bool ok = decodeInt64C(br, timestamp) && decodeInt64C(br, seqId) &&
             decodeInt64C(br, offset) && decodeInt64C(br, blockSize);
+  checksumType = NUM_CHECKSUM_TYPES;
+  checksum = 0;
+  if (ok && !br.empty()) {
+    int64_t type;
+    ok = decodeInt64C(br, type) && decodeInt64C(br, checksum) && type >= 0 &&
+         type < NUM_CHECKSUM_TYPES;
+    checksumType = static_cast<ChecksumType>(type);
+  }
   if (!ok || (br.size() != 0)) {
     WLOG(ERROR) << "Did not decode properly block write entry " << size
                 << " ok " << ok << " left over " << br.size();
@@ -235,6 +263,122 @@ bool LogEncoderDecoder::decodeDirectoryInvalidationEntry(char *buf,
   return true;
 }
 
+/**
+ * Single producer, single consumer ring of the entries added by one thread.
+ * Each record is the sequence number of the entry, its size and the entry.
+ * The writer thread pops the records in bulk and consumes them one at a time,
+ * in the sequence order they were pushed in.
+ */
+class TransferLogManager::StagingBuffer {
+ public:
+  explicit StagingBuffer(std::thread::id owner)
+      : owner_(owner), data_(kBufferSize) {
+  }
+
+  /**
+   * Called by the owner thread only
+   *
+   * @param halfFull  set to whether this push filled half of the buffer
+   *
+   * @return          false if the buffer is full
+   */
+  bool push(int64_t seq, const char *entry, int16_t size, bool &halfFull) {
+    const int64_t tail = tail_.load(std::memory_order_relaxed);
+    const int64_t used = tail - head_.load(std::memory_order_acquire);
+    const int64_t recordSize = kRecordHeaderSize + size;
+    if (used + recordSize > kBufferSize) {
+      return false;
+    }
+    char header[kRecordHeaderSize];
+    folly::storeUnaligned<int64_t>(header, seq);
+    folly::storeUnaligned<int16_t>(header + sizeof(int64_t), size);
+    copyIn(tail, header, kRecordHeaderSize);
+    copyIn(tail + kRecordHeaderSize, entry, size);
+    tail_.store(tail + recordSize, std::memory_order_release);
+    halfFull = (used < kBufferSize / 2 && used + recordSize >= kBufferSize / 2);
+    return true;
+  }
+
+  /// called by the writer thread only, moves the records pushed to the ones
+  /// to consume
+  void popAll() {
+    const int64_t tail = tail_.load(std::memory_order_acquire);
+    const int64_t head = head_.load(std::memory_order_relaxed);
+    if (head == tail) {
+      return;
+    }
+    popped_.erase(0, consumed_);
+    consumed_ = 0;
+    const int64_t poppedSize = popped_.size();
+    popped_.resize(poppedSize + tail - head);
+    copyOut(head, &popped_[poppedSize], tail - head);
+    head_.store(tail, std::memory_order_release);
+  }
+
+  /// called by the writer thread only. returns whether a record is left
+  bool hasRecord() const {
+    return consumed_ < (int64_t)popped_.size();
+  }
+
+  /// sequence number of the next record, there must be one
+  int64_t nextSeq() const {
+    return folly::loadUnaligned<int64_t>(popped_.data() + consumed_);
+  }
+
+  /// appends the entry of the next record to dest and consumes it
+  void consume(string &dest) {
+    const int16_t size = folly::loadUnaligned<int16_t>(
+        popped_.data() + consumed_ + sizeof(int64_t));
+    dest.append(popped_.data() + consumed_ + kRecordHeaderSize, size);
+    consumed_ += kRecordHeaderSize + size;
+  }
+
+  /// thread adding to the buffer
+  const std::thread::id owner_;
+
+ private:
+  static const int64_t kBufferSize = 1024 * 1024;
+  static const int64_t kRecordHeaderSize = sizeof(int64_t) + sizeof(int16_t);
+
+  void copyIn(int64_t pos, const char *src, int64_t len) {
+    const int64_t offset = pos % kBufferSize;
+    const int64_t first = std::min(len, kBufferSize - offset);
+    memcpy(data_.data() + offset, src, first);
+    memcpy(data_.data(), src + first, len - first);
+  }
+
+  void copyOut(int64_t pos, char *dest, int64_t len) const {
+    const int64_t offset = pos % kBufferSize;
+    const int64_t first = std::min(len, kBufferSize - offset);
+    memcpy(dest, data_.data() + offset, first);
+    memcpy(dest + first, data_.data(), len - first);
+  }
+
+  std::vector<char> data_;
+  /// bytes consumed so far
+  std::atomic<int64_t> head_{0};
+  /// bytes produced so far
+  std::atomic<int64_t> tail_{0};
+  /// records popped by the writer thread
+  string popped_;
+  /// bytes of popped_ already consumed
+  int64_t consumed_{0};
+};
+
+TransferLogManager::TransferLogManager(const WdtOptions &options,
+                                       const string &rootDir)
+    : options_(options) {
+  rootDir_ = rootDir;
+  if (rootDir_.back() != '/') {
+    rootDir_.push_back('/');
+  }
+}
+
+int64_t TransferLogManager::nextId() {
+  static std::atomic<int64_t> nextId{0};
+  return nextId++;
+}
+
 string TransferLogManager::getFullPath(const string &relPath) {
   WDT_CHECK(!rootDir_.empty()) << "Root directory not set";
   string fullPath = rootDir_;
@@ -290,6 +434,24 @@ ErrorCode TransferLogManager::startThread() {
     if (resumptionStatus_ != OK) {
       return resumptionStatus_;
     }
+    if (options_.transfer_log_mmap) {
+      bool mapped;
+      {
+        std::lock_guard<std::mutex> lock(logMutex_);
+        logEnd_ = ::lseek(fd_, 0, SEEK_CUR);
+        syncedEnd_ = logEnd_;
+        mapped = logEnd_ >= 0 && mapLogLocked(0);
+      }
+      if (mapped) {
+        const int64_t nextSeq = nextEntrySeq_.load();
+        staging_.store(true);
+        writerThread_ = std::thread(
+            &TransferLogManager::threadProcCommitMappedEntries, this, nextSeq);
+        WLOG(INFO) << "Mapped log writer thread started";
+        return OK;
+      }
+      WLOG(WARNING) << "Unable to map the transfer log, writing it instead";
+    }
     writerThread_ =
         std::thread(&TransferLogManager::threadProcWriteEntriesToDisk, this);
     WLOG(INFO) << "Log writer thread started";
@@ -298,6 +460,14 @@ ErrorCode TransferLogManager::startThread() {
 }
 
 void TransferLogManager::shutdownThread() {
+  {
+    // entries added from now on are buffered for a direct write
+    std::unique_lock<std::mutex> lock(mutex_);
+    staging_.store(false);
+    // an adder which saw staging_ set before is still pushing, its entry has
+    // to be visible to the last drain of the writer
+    stagingAddsDone_.wait(lock, [this] { return numStagingAdds_.load() == 0; });
+  }
   if (writerThread_.joinable()) {
     // stop writer thread
     {
@@ -307,6 +477,7 @@ void TransferLogManager::shutdownThread() {
     conditionFinished_.notify_one();
     writerThread_.join();
   }
+  unmapLog();
 }
 
 ErrorCode TransferLogManager::checkLog() {
@@ -414,10 +585,401 @@ void TransferLogManager::threadProcWriteEntriesToDisk() {
     if (!writeEntriesToDiskNoLock(entries)) {
       return;
     }
+    if (!finished) {
+      compactLogOnline();
+    }
   }
   WLOG(INFO) << "Transfer log writer thread finished";
 }
 
+TransferLogManager::StagingBuffer *TransferLogManager::getStagingBuffer() {
+  struct CachedBuffer {
+    int64_t managerId{-1};
+    StagingBuffer *buffer{nullptr};
+  };
+  static thread_local CachedBuffer cached;
+  if (cached.managerId == id_) {
+    return cached.buffer;
+  }
+  const std::thread::id threadId = std::this_thread::get_id();
+  StagingBuffer *buffer = nullptr;
+  {
+    std::lock_guard<std::mutex> lock(mutex_);
+    for (const auto &stagingBuffer : stagingBuffers_) {
+      if (stagingBuffer->owner_ == threadId) {
+        buffer = stagingBuffer.get();
+        break;
+      }
+    }
+    if (buffer == nullptr) {
+      stagingBuffers_.emplace_back(new StagingBuffer(threadId));
+      buffer = stagingBuffers_.back().get();
+    }
+  }
+  cached.managerId = id_;
+  cached.buffer = buffer;
+  return buffer;
+}
+
+void TransferLogManager::addEntry(const char *buf, int64_t size) {
+  // registered before looking at staging_, so that shutdownThread() either
+  // sees this add in flight or this add sees staging_ cleared
+  numStagingAdds_++;
+  if (staging_.load()) {
+    const int64_t seq = nextEntrySeq_++;
+    bool halfFull = false;
+    if (getStagingBuffer()->push(seq, buf, size, halfFull)) {
+      if (--numStagingAdds_ == 0 && !staging_.load()) {
+        // last add in flight, shutdownThread() waits for it
+        std::lock_guard<std::mutex> lock(mutex_);
+        stagingAddsDone_.notify_all();
+      }
+      if (halfFull) {
+        // drains the buffer before it overflows
+        conditionFinished_.notify_one();
+      }
+      return;
+    }
+    std::lock_guard<std::mutex> lock(mutex_);
+    overflowEntries_.emplace(seq, string(buf, size));
+    if (--numStagingAdds_ == 0) {
+      stagingAddsDone_.notify_all();
+    }
+    return;
+  }
+  std::lock_guard<std::mutex> lock(mutex_);
+  entries_.emplace_back(buf, size);
+  if (--numStagingAdds_ == 0) {
+    stagingAddsDone_.notify_all();
+  }
+}
+
+void TransferLogManager::threadProcCommitMappedEntries(int64_t nextSeq) {
+  WDT_CHECK(fd_ >= 0) << "Writer thread started before the log is opened";
+  WLOG(INFO) << "Mapped transfer log writer thread started";
+  WDT_CHECK(options_.transfer_log_write_interval_ms >= 0);
+
+  auto waitingTime =
+      std::chrono::milliseconds(options_.transfer_log_write_interval_ms);
+  std::vector<StagingBuffer *> buffers;
+  std::vector<string> entries;
+  // overflowed entries, waiting for the entries before them
+  std::map<int64_t, string> overflow;
+  // (next sequence number, buffer index) of the buffers with records
+  typedef std::pair<int64_t, int64_t> Head;
+  std::priority_queue<Head, std::vector<Head>, std::greater<Head>> heads;
+  string batch;
+  bool finished = false;
+  while (!finished) {
+    {
+      std::unique_lock<std::mutex> lock(mutex_);
+      conditionFinished_.wait_for(lock, waitingTime);
+      finished = finished_;
+      entries.swap(entries_);
+      for (auto &entry : overflowEntries_) {
+        overflow.emplace(entry.first, std::move(entry.second));
+      }
+      overflowEntries_.clear();
+      for (int64_t i = buffers.size(); i < (int64_t)stagingBuffers_.size();
+           i++) {
+        buffers.push_back(stagingBuffers_[i].get());
+      }
+    }
+    // entries added before the log was mapped go first
+    batch.clear();
+    for (const auto &entry : entries) {
+      batch.append(entry);
+    }
+    entries.clear();
+    heads = decltype(heads)();
+    for (int64_t i = 0; i < (int64_t)buffers.size(); i++) {
+      buffers[i]->popAll();
+      if (buffers[i]->hasRecord()) {
+        heads.emplace(buffers[i]->nextSeq(), i);
+      }
+    }
+    // merges the buffers in sequence order. An entry can't be committed
+    // before all the entries staged before it, which may not be visible yet,
+    // except for the last batch
+    while (true) {
+      const bool fromOverflow =
+          !overflow.empty() &&
+          (heads.empty() || overflow.begin()->first < heads.top().first);
+      if (!fromOverflow && heads.empty()) {
+        break;
+      }
+      const int64_t seq =
+          fromOverflow ? overflow.begin()->first : heads.top().first;
+      if (!finished && seq != nextSeq) {
+        break;
+      }
+      nextSeq = seq + 1;
+      if (fromOverflow) {
+        batch.append(overflow.begin()->second);
+        overflow.erase(overflow.begin());
+        continue;
+      }
+      StagingBuffer *buffer = buffers[heads.top().second];
+      const int64_t index = heads.top().second;
+      heads.pop();
+      buffer->consume(batch);
+      if (buffer->hasRecord()) {
+        heads.emplace(buffer->nextSeq(), index);
+      }
+    }
+    if (batch.empty()) {
+      continue;
+    }
+    {
+      std::lock_guard<std::mutex> lock(logMutex_);
+      if (!appendToMappedLogLocked(batch.data(), batch.size())) {
+        WLOG(ERROR) << "Disk write error while committing transfer log "
+                    << batch.size();
+        return;
+      }
+      // group commit, a single msync for all the entries of the batch
+      syncMappedLogLocked();
+    }
+    if (!finished) {
+      compactLogOnline();
+    }
+  }
+  WLOG(INFO) << "Mapped transfer log writer thread finished";
+}
+
+bool TransferLogManager::writeToLog(const char *buf, int64_t size) {
+  // the log can be swapped by an online compaction
+  std::lock_guard<std::mutex> lock(logMutex_);
+  if (map_ != nullptr) {
+    return appendToMappedLogLocked(buf, size);
+  }
+  int64_t written = ::write(fd_, buf, size);
+  if (written != size) {
+    WPLOG(ERROR) << "Disk write error while writing transfer log " << written
+                 << " " << size;
+    return false;
+  }
+  return true;
+}
+
+bool TransferLogManager::mapLogLocked(int64_t minSize) {
+  if (map_ != nullptr) {
+    syncMappedLogLocked();
+    if (::munmap(map_, mapSize_) != 0) {
+      WPLOG(ERROR) << "munmap failed for transfer log " << fd_;
+    }
+    map_ = nullptr;
+  }
+  const int64_t pageSize = sysconf(_SC_PAGESIZE);
+  const int64_t offset = logEnd_ / pageSize * pageSize;
+  int64_t size = std::max(options_.transfer_log_preallocation_size,
+                          logEnd_ - offset + minSize);
+  size = (size + pageSize - 1) / pageSize * pageSize;
+#ifdef HAS_POSIX_FALLOCATE
+  int status = posix_fallocate(fd_, offset, size);
+  if (status != 0) {
+    WLOG(ERROR) << "fallocate() failed for transfer log "
+                << strerrorStr(status);
+    return false;
+  }
+#else
+  if (::ftruncate(fd_, offset + size) != 0) {
+    WPLOG(ERROR) << "ftruncate failed for transfer log " << fd_;
+    return false;
+  }
+#endif
+  // the size of the log has to be durable for the entries msynced to be
+  if (::fsync(fd_) != 0) {
+    WPLOG(ERROR) << "fsync failed for transfer log " << fd_;
+  }
+  void *ptr =
+      ::mmap(nullptr, size, PROT_READ | PROT_WRITE, MAP_SHARED, fd_, offset);
+  if (ptr == MAP_FAILED) {
+    WPLOG(ERROR) << "mmap failed for transfer log " << fd_ << " offset "
+                 << offset << " size " << size;
+    return false;
+  }
+  map_ = static_cast<char *>(ptr);
+  mapOffset_ = offset;
+  mapSize_ = size;
+  WVLOG(1) << "Mapped transfer log offset " << offset << " size " << size;
+  return true;
+}
+
+bool TransferLogManager::appendToMappedLogLocked(const char *buf,
+                                                 int64_t size) {
+  if (map_ == nullptr) {
+    return false;
+  }
+  if (logEnd_ + size > mapOffset_ + mapSize_ && !mapLogLocked(size)) {
+    return false;
+  }
+  memcpy(map_ + (logEnd_ - mapOffset_), buf, size);
+  logEnd_ += size;
+  return true;
+}
+
+void TransferLogManager::syncMappedLogLocked() {
+  if (map_ == nullptr || syncedEnd_ >= logEnd_) {
+    return;
+  }
+  const int64_t pageSize = sysconf(_SC_PAGESIZE);
+  const int64_t start = std::max(mapOffset_, syncedEnd_ / pageSize * pageSize);
+  if (::msync(map_ + (start - mapOffset_), logEnd_ - start, MS_SYNC) != 0) {
+    WPLOG(ERROR) << "msync failed for transfer log " << fd_;
+    return;
+  }
+  syncedEnd_ = logEnd_;
+}
+
+void TransferLogManager::compactLogOnline() {
+  if (options_.transfer_log_compaction_interval_ms <= 0 ||
+      durationMillis(Clock::now() - lastCompactionCheck_) <
+          options_.transfer_log_compaction_interval_ms) {
+    return;
+  }
+  lastCompactionCheck_ = Clock::now();
+  // don't compact small logs, nor logs which did not double
+  const int64_t kMinCompactionSize = 64 * 1024;
+  std::lock_guard<std::mutex> lock(logMutex_);
+  const int64_t logSize =
+      (map_ != nullptr) ? logEnd_ : ::lseek(fd_, 0, SEEK_CUR);
+  if (logSize < std::max(2 * compactedSize_, kMinCompactionSize)) {
+    return;
+  }
+  auto startTime = Clock::now();
+  LogParser parser(options_, encoderDecoder_, rootDir_, recoveryId_, config_,
+                   false);
+  string senderIp;
+  std::vector<FileChunksInfo> fileChunksInfo;
+  std::map<int64_t, int64_t> fileSizes;
+  if (parser.parseForCompaction(fd_, logSize, senderIp, fileChunksInfo,
+                                fileSizes) != OK) {
+    WLOG(WARNING) << "Not compacting transfer log of size " << logSize;
+    compactedSize_ = logSize;
+    return;
+  }
+  // blocks of each file folded into an entry per chunk, a single one for a
+  // complete file
+  string compacted;
+  char buf[kMaxEntryLength];
+  int64_t size = encoderDecoder_.encodeLogHeader(buf, sizeof(buf), recoveryId_,
+                                                 senderIp, config_);
+  if (size < 0) {
+    return;
+  }
+  compacted.append(buf, size);
+  for (const auto &fileInfo : fileChunksInfo) {
+    const int64_t seqId = fileInfo.getSeqId();
+    size = encoderDecoder_.encodeFileCreationEntry(
+        buf, sizeof(buf), fileInfo.getFileName(), seqId, fileSizes[seqId]);
+    if (size < 0) {
+      return;
+    }
+    compacted.append(buf, size);
+    for (const auto &chunk : fileInfo.getChunks()) {
+      size = encoderDecoder_.encodeBlockWriteEntry(buf, sizeof(buf), seqId,
+                                                   chunk.start_, chunk.size());
+      compacted.append(buf, size);
+    }
+  }
+  if (!swapInCompactedLogLocked(compacted)) {
+    compactedSize_ = logSize;
+    return;
+  }
+  compactedSize_ = compacted.size();
+  WLOG(INFO) << "Compacted transfer log from " << logSize << " to "
+             << compactedSize_ << " bytes, " << fileChunksInfo.size()
+             << " files, in " << durationMillis(Clock::now() - startTime)
+             << " ms";
+}
+
+bool TransferLogManager::swapInCompactedLogLocked(const string &compacted) {
+  const string compactedPath = getFullPath(kWdtCompactedLogName);
+  int fd = ::open(compactedPath.c_str(), O_CREAT | O_TRUNC | O_RDWR, 0644);
+  if (fd < 0) {
+    WPLOG(ERROR) << "Could not create compacted log " << compactedPath;
+    return false;
+  }
+  // locked before it is visible as the log
+  bool ok = ::flock(fd, LOCK_EX | LOCK_NB) == 0;
+  if (!ok) {
+    WPLOG(ERROR) << "Failed to lock compacted log " << compactedPath;
+  } else if (::write(fd, compacted.data(), compacted.size()) !=
+             (int64_t)compacted.size()) {
+    WPLOG(ERROR) << "Disk write error while writing compacted log";
+    ok = false;
+  } else if (::fsync(fd) != 0) {
+    WPLOG(ERROR) << "fsync failed for compacted log " << fd;
+    ok = false;
+  }
+  if (!ok) {
+    ::close(fd);
+    ::unlink(compactedPath.c_str());
+    return false;
+  }
+  const bool mapped = (map_ != nullptr);
+  if (mapped) {
+    syncMappedLogLocked();
+    if (::munmap(map_, mapSize_) != 0) {
+      WPLOG(ERROR) << "munmap failed for transfer log " << fd_;
+    }
+    map_ = nullptr;
+  }
+  if (::rename(compactedPath.c_str(), getFullPath(kWdtLogName).c_str()) != 0) {
+    WPLOG(ERROR) << "Could not rename compacted log " << compactedPath;
+    ::close(fd);
+    ::unlink(compactedPath.c_str());
+    if (mapped && !mapLogLocked(0)) {
+      WLOG(ERROR) << "Unable to map the transfer log again";
+    }
+    return false;
+  }
+  // makes the rename durable
+  int dirFd = ::open(rootDir_.c_str(), O_RDONLY);
+  if (dirFd < 0 || ::fsync(dirFd) != 0) {
+    WPLOG(ERROR) << "fsync failed for directory " << rootDir_;
+  }
+  if (dirFd >= 0) {
+    ::close(dirFd);
+  }
+  if (::close(fd_) != 0) {
+    WPLOG(ERROR) << "Failed to close the log before compaction " << fd_;
+  }
+  fd_ = fd;
+  if (mapped) {
+    logEnd_ = compacted.size();
+    syncedEnd_ = logEnd_;
+    if (!mapLogLocked(0)) {
+      WLOG(ERROR) << "Unable to map the compacted transfer log";
+    }
+  }
+  return true;
+}
+
+void TransferLogManager::unmapLog() {
+  std::lock_guard<std::mutex> lock(logMutex_);
+  if (map_ == nullptr) {
+    return;
+  }
+  syncMappedLogLocked();
+  if (::munmap(map_, mapSize_) != 0) {
+    WPLOG(ERROR) << "munmap failed for transfer log " << fd_;
+  }
+  map_ = nullptr;
+  // removes the space preallocated and not used
+  if (::ftruncate(fd_, logEnd_) != 0) {
+    WPLOG(ERROR) << "ftruncate failed for fd " << fd_;
+  }
+  if (::lseek(fd_, logEnd_, SEEK_SET) < 0) {
+    WPLOG(ERROR) << "lseek failed for fd " << fd_;
+  }
+  if (::fsync(fd_) != 0) {
+    WPLOG(ERROR) << "fsync failed for transfer log " << fd_;
+  }
+  WLOG(INFO) << "Unmapped transfer log, size " << logEnd_;
+}
+
 bool TransferLogManager::verifySenderIp(const string &curSenderIp) {
   if (fd_ < 0) {
     return false;
@@ -445,6 +1007,11 @@ bool TransferLogManager::verifySenderIp(const string &curSenderIp) {
 
 void TransferLogManager::fsyncLog() {
   WDT_CHECK(fd_ >= 0);
+  std::lock_guard<std::mutex> lock(logMutex_);
+  if (map_ != nullptr) {
+    syncMappedLogLocked();
+    return;
+  }
   if (::fsync(fd_) != 0) {
     WPLOG(ERROR) << "fsync failed for transfer log " << fd_;
   }
@@ -459,12 +1026,12 @@ void TransferLogManager::invalidateDirectory() {
   char buf[kMaxEntryLength];
   int64_t size =
       encoderDecoder_.encodeDirectoryInvalidationEntry(buf, sizeof(buf));
-  int64_t written = ::write(fd_, buf, size);
-  if (written != size) {
-    WPLOG(ERROR)
-        << "Disk write error while writing directory invalidation entry "
-        << written << " " << size;
+  if (!writeToLog(buf, size)) {
+    WLOG(ERROR) << "Disk write error while writing directory invalidation "
+                   "entry "
+                << size;
     closeLog();
+    return;
   }
   fsyncLog();
   return;
@@ -480,10 +1047,8 @@ void TransferLogManager::writeLogHeader() {
   char buf[kMaxEntryLength];
   int64_t size = encoderDecoder_.encodeLogHeader(
       buf, kMaxEntryLength, recoveryId_, senderIp_, config_);
-  int64_t written = ::write(fd_, buf, size);
-  if (written != size) {
-    WPLOG(ERROR) << "Disk write error while writing log header " << written
-                 << " " << size;
+  if (!writeToLog(buf, size)) {
+    WLOG(ERROR) << "Disk write error while writing log header " << size;
     closeLog();
     return;
   }
@@ -503,24 +1068,22 @@ void TransferLogManager::addFileCreationEntry(const string &fileName,
   char buf[kMaxEntryLength];
   int64_t size = encoderDecoder_.encodeFileCreationEntry(
       buf, sizeof(buf), fileName, seqId, fileSize);
-
-  std::lock_guard<std::mutex> lock(mutex_);
-  entries_.emplace_back(buf, size);
+  addEntry(buf, size);
 }
 
 void TransferLogManager::addBlockWriteEntry(int64_t seqId, int64_t offset,
-                                            int64_t blockSize) {
+                                            int64_t blockSize,
+                                            ChecksumType checksumType,
+                                            int64_t checksum) {
   if (fd_ < 0 || !headerWritten_) {
     return;
   }
   WVLOG(1) << "Adding block entry to log " << seqId << " " << offset << " "
            << blockSize;
   char buf[kMaxEntryLength];
-  int64_t size = encoderDecoder_.encodeBlockWriteEntry(buf, sizeof(buf), seqId,
-                                                       offset, blockSize);
-
-  std::lock_guard<std::mutex> lock(mutex_);
-  entries_.emplace_back(buf, size);
+  int64_t size = encoderDecoder_.encodeBlockWriteEntry(
+      buf, sizeof(buf), seqId, offset, blockSize, checksumType, checksum);
+  addEntry(buf, size);
 }
 
 void TransferLogManager::addFileResizeEntry(int64_t seqId, int64_t fileSize) {
@@ -531,9 +1094,7 @@ void TransferLogManager::addFileResizeEntry(int64_t seqId, int64_t fileSize) {
   char buf[kMaxEntryLength];
   int64_t size =
       encoderDecoder_.encodeFileResizeEntry(buf, sizeof(buf), seqId, fileSize);
-
-  std::lock_guard<std::mutex> lock(mutex_);
-  entries_.emplace_back(buf, size);
+  addEntry(buf, size);
 }
 
 void TransferLogManager::addFileInvalidationEntry(int64_t seqId) {
@@ -544,8 +1105,7 @@ void TransferLogManager::addFileInvalidationEntry(int64_t seqId) {
   char buf[kMaxEntryLength];
   int64_t size =
       encoderDecoder_.encodeFileInvalidationEntry(buf, kMaxEntryLength, seqId);
-  std::lock_guard<std::mutex> lock(mutex_);
-  entries_.emplace_back(buf, size);
+  addEntry(buf, size);
 }
 
 void TransferLogManager::unlink() {
@@ -749,6 +1309,36 @@ void LogParser::clearParsedData() {
   invalidSeqIds_.clear();
 }
 
+void LogParser::printFileChecksums() {
+  for (const auto &fileBlocks : blockChecksums_) {
+    const int64_t seqId = fileBlocks.first;
+    auto sizeIt = printedFileSizes_.find(seqId);
+    if (sizeIt == printedFileSizes_.end()) {
+      continue;
+    }
+    const ChecksumType checksumType =
+        fileBlocks.second.begin()->second.checksumType;
+    int64_t covered = 0;
+    int64_t checksum = 0;
+    for (const auto &block : fileBlocks.second) {
+      const BlockChecksumEntry &entry = block.second;
+      if (block.first != covered || entry.checksumType != checksumType) {
+        // missing or overlapping blocks
+        break;
+      }
+      checksum = BlockChecksum::combine(checksumType, checksum,
+                                        entry.checksum, entry.blockSize);
+      covered += entry.blockSize;
+    }
+    if (covered != sizeIt->second) {
+      continue;
+    }
+    std::cout << "File checksum, seq-id " << seqId << " "
+              << checksumTypeToStr(checksumType) << " " << checksum
+              << std::endl;
+  }
+}
+
 string LogParser::getFormattedTimestamp(int64_t timestampMicros) {
   // This assumes Clock's epoch is Posix's epoch (1970/1/1)
   // to_time_t is unfortunately only on the system_clock and not
@@ -780,11 +1370,13 @@ ErrorCode LogParser::processHeaderEntry(char *buf, int64_t max, int64_t size,
     WLOG(ERROR) << "Couldn't decode the log header";
     return INVALID_LOG;
   }
-  if (logVersion != TransferLogManager::WLOG_VERSION) {
+  if (logVersion < TransferLogManager::WLOG_MIN_VERSION ||
+      logVersion > TransferLogManager::WLOG_VERSION) {
     WLOG(ERROR) << "Can not parse log version " << logVersion
                 << ", parser version " << TransferLogManager::WLOG_VERSION;
     return INVALID_LOG;
   }
+  logVersion_ = logVersion;
   if (senderIp.empty()) {
     WLOG(ERROR) << "Log header has empty sender ip";
     return INVALID_LOG;
@@ -812,7 +1404,8 @@ ErrorCode LogParser::processHeaderEntry(char *buf, int64_t max, int64_t size,
   return OK;
 }
 
-ErrorCode LogParser::processFileCreationEntry(char *buf, int64_t size) {
+ErrorCode LogParser::processFileCreationEntry(char *buf, int64_t size,
+                                              int64_t index) {
   if (!headerParsed_) {
     WLOG(ERROR)
         << "Invalid log: File creation entry found before transfer log header";
@@ -828,6 +1421,8 @@ ErrorCode LogParser::processFileCreationEntry(char *buf, int64_t size) {
     std::cout << getFormattedTimestamp(timestamp) << " File created "
               << fileName << " seq-id " << seqId << " file-size " << fileSize
               << std::endl;
+    printedFileSizes_[seqId] = fileSize;
+    blockChecksums_.erase(seqId);
     return OK;
   }
   if (options_.resume_using_dir_tree) {
@@ -844,14 +1439,15 @@ ErrorCode LogParser::processFileCreationEntry(char *buf, int64_t size) {
   }
   // verify size
   bool sizeVerificationSuccess = false;
-  struct stat buffer;
-  string fullPath;
-  folly::toAppend(rootDir_, fileName, &fullPath);
-  if (stat(fullPath.c_str(), &buffer) != 0) {
-    WPLOG(ERROR) << "stat failed for " << fileName;
+  FileStat fileStat;
+  if (index < (int64_t)fileStats_.size() && fileStats_[index].done) {
+    fileStat = fileStats_[index];
   } else {
+    statFile(fileName, fileStat);
+  }
+  if (fileStat.exists) {
     if (options_.shouldPreallocateFiles()) {
-      sizeVerificationSuccess = (buffer.st_size >= fileSize);
+      sizeVerificationSuccess = (fileStat.size >= fileSize);
     } else {
       sizeVerificationSuccess = true;
     }
@@ -859,7 +1455,7 @@ ErrorCode LogParser::processFileCreationEntry(char *buf, int64_t size) {
 
   if (sizeVerificationSuccess) {
     fileInfoMap_.emplace(seqId,
-                         FileChunksInfo(seqId, fileName, buffer.st_size));
+                         FileChunksInfo(seqId, fileName, fileStat.size));
     seqIdToSizeMap_.emplace(seqId, fileSize);
   } else {
     WLOG(INFO) << "Sanity check failed for " << fileName << " seq-id " << seqId
@@ -884,6 +1480,7 @@ ErrorCode LogParser::processFileResizeEntry(char *buf, int64_t size) {
     std::cout << getFormattedTimestamp(timestamp) << " File resized,"
               << " seq-id " << seqId << " new file-size " << fileSize
               << std::endl;
+    printedFileSizes_[seqId] = fileSize;
     return OK;
   }
   if (options_.resume_using_dir_tree) {
@@ -925,15 +1522,28 @@ ErrorCode LogParser::processBlockWriteEntry(char *buf, int64_t size) {
         << "Invalid log: Block write entry found before transfer log header";
     return INVALID_LOG;
   }
-  int64_t timestamp, seqId, offset, blockSize;
+  int64_t timestamp, seqId, offset, blockSize, checksum;
+  ChecksumType checksumType;
   if (!encoderDecoder_.decodeBlockWriteEntry(buf, size, timestamp, seqId,
-                                             offset, blockSize)) {
+                                             offset, blockSize, checksumType,
+                                             checksum)) {
+    return INVALID_LOG;
+  }
+  if (checksumType != NUM_CHECKSUM_TYPES &&
+      logVersion_ < TransferLogManager::WLOG_BLOCK_CHECKSUM_VERSION) {
+    WLOG(ERROR) << "Block write entry with a checksum in a log of version "
+                << logVersion_ << " " << seqId << " " << offset;
     return INVALID_LOG;
   }
   if (parseOnly_) {
     std::cout << getFormattedTimestamp(timestamp) << " Block written,"
               << " seq-id " << seqId << " offset " << offset << " block-size "
-              << blockSize << std::endl;
+              << blockSize;
+    if (checksumType != NUM_CHECKSUM_TYPES) {
+      std::cout << " " << checksumTypeToStr(checksumType) << " " << checksum;
+      blockChecksums_[seqId][offset] = {blockSize, checksumType, checksum};
+    }
+    std::cout << std::endl;
     return OK;
   }
   if (options_.resume_using_dir_tree) {
@@ -980,6 +1590,8 @@ ErrorCode LogParser::processFileInvalidationEntry(char *buf, int64_t size) {
   if (parseOnly_) {
     std::cout << getFormattedTimestamp(timestamp)
               << " Invalidation entry for seq-id " << seqId << std::endl;
+    printedFileSizes_.erase(seqId);
+    blockChecksums_.erase(seqId);
     return OK;
   }
   if (options_.resume_using_dir_tree) {
@@ -1013,57 +1625,116 @@ ErrorCode LogParser::processDirectoryInvalidationEntry(char *buf,
   return INCONSISTENT_DIRECTORY;
 }
 
-ErrorCode LogParser::parseLog(int fd, string &senderIp,
-                              std::vector<FileChunksInfo> &fileChunksInfo) {
-  char entry[TransferLogManager::kMaxEntryLength];
-  // empty log is valid
-  ErrorCode status = OK;
-  while (true) {
-    int16_t entrySize;
-    int64_t toRead = sizeof(int16_t);
-    int64_t numRead = ::read(fd, &entrySize, toRead);
-    if (numRead < 0) {
-      WPLOG(ERROR) << "Error while reading transfer log " << numRead << " "
-                   << toRead;
-      return INVALID_LOG;
+void LogParser::statFile(const string &fileName, FileStat &fileStat) {
+  struct stat buffer;
+  string fullPath;
+  folly::toAppend(rootDir_, fileName, &fullPath);
+  fileStat.done = true;
+  if (stat(fullPath.c_str(), &buffer) != 0) {
+    WPLOG(ERROR) << "stat failed for " << fileName;
+    fileStat.exists = false;
+    return;
+  }
+  fileStat.exists = true;
+  fileStat.size = buffer.st_size;
+}
+
+void LogParser::statFiles(char *log, const std::vector<Segment> &segments) {
+  std::atomic<int64_t> nextSegment{0};
+  auto statSegments = [&] {
+    while (true) {
+      const int64_t segmentIndex = nextSegment++;
+      if (segmentIndex >= (int64_t)segments.size()) {
+        return;
+      }
+      const Segment &segment = segments[segmentIndex];
+      int64_t index = segment.firstFileCreation;
+      for (int64_t pos = segment.offset; pos < segment.end;) {
+        const int16_t entrySize = folly::loadUnaligned<int16_t>(log + pos);
+        char *entry = log + pos + sizeof(int16_t);
+        pos += sizeof(int16_t) + entrySize;
+        if (entry[0] != TransferLogManager::FILE_CREATION) {
+          continue;
+        }
+        int64_t timestamp, seqId, fileSize;
+        string fileName;
+        // entries which do not decode are reported when they are applied
+        if (encoderDecoder_.decodeFileCreationEntry(entry + 1, entrySize - 1,
+                                                    timestamp, fileName,
+                                                    seqId, fileSize)) {
+          statFile(fileName, fileStats_[index]);
+        }
+        index++;
+      }
     }
-    if (numRead == 0) {
-      WVLOG(1) << "got EOF, toRead " << toRead;
+  };
+  const int64_t numThreads =
+      std::min<int64_t>(options_.transfer_log_parse_threads, segments.size());
+  std::vector<std::thread> threads;
+  for (int64_t i = 1; i < numThreads; i++) {
+    threads.emplace_back(statSegments);
+  }
+  statSegments();
+  for (auto &thread : threads) {
+    thread.join();
+  }
+  WVLOG(1) << "Stat-ed " << fileStats_.size() << " files of the log with "
+           << std::max<int64_t>(numThreads, 1) << " threads";
+}
+
+ErrorCode LogParser::parseEntries(char *log, int64_t startOffset,
+                                  int64_t logSize, int64_t &validEnd,
+                                  string &senderIp) {
+  // first pass, finds the entries and the end of the last complete one
+  bool badEntrySize = false;
+  int64_t numEntries = 0;
+  int64_t numFileCreations = 0;
+  std::vector<Segment> segments;
+  int64_t pos = startOffset;
+  while (pos < logSize) {
+    if (logSize - pos < (int64_t)sizeof(int16_t)) {
+      // most likely part of the previous write succeeded partially
       break;
     }
-    if (numRead != toRead) {
-      // extra bytes at the end, most likely part of the previous write
-      // succeeded partially
-      if (parseOnly_) {
-        WLOG(INFO) << "Extra " << numRead << " bytes at the end of the log";
-      } else if (!truncateExtraBytesAtEnd(fd, numRead)) {
-        return INVALID_LOG;
-      }
+    const int16_t entrySize = folly::loadUnaligned<int16_t>(log + pos);
+    if (entrySize == 0) {
+      // space preallocated for a mapped log, left behind by a crash
       break;
     }
-    if (entrySize <= 0 || entrySize > TransferLogManager::kMaxEntryLength) {
-      WLOG(ERROR) << "Transfer log parse error, invalid entry length "
-                  << entrySize;
-      return INVALID_LOG;
-    }
-    numRead = ::read(fd, entry, entrySize);
-    if (numRead < 0) {
-      WPLOG(ERROR) << "Error while reading transfer log " << numRead << " "
-                   << entrySize;
-      return INVALID_LOG;
+    if (entrySize < 0 || entrySize > TransferLogManager::kMaxEntryLength) {
+      badEntrySize = true;
+      break;
     }
-    if (numRead != entrySize) {
-      // extra bytes also includes the size entry
-      int64_t extraBytes = numRead + sizeof(int16_t);
-      if (parseOnly_) {
-        WLOG(INFO) << "Extra " << extraBytes << " bytes at the end of the log";
-      } else if (!truncateExtraBytesAtEnd(fd, extraBytes)) {
-        return INVALID_LOG;
-      }
+    if (pos + (int64_t)sizeof(int16_t) + entrySize > logSize) {
       break;
     }
+    if (numEntries % kEntriesPerStatSegment == 0) {
+      segments.push_back({pos, pos, numFileCreations});
+    }
+    if (log[pos + sizeof(int16_t)] == TransferLogManager::FILE_CREATION) {
+      numFileCreations++;
+    }
+    pos += sizeof(int16_t) + entrySize;
+    segments.back().end = pos;
+    numEntries++;
+  }
+  validEnd = pos;
+  if (!parseOnly_ && !options_.resume_using_dir_tree && numFileCreations > 0) {
+    fileStats_.assign(numFileCreations, FileStat());
+    statFiles(log, segments);
+  }
+
+  // second pass, applies the entries in order
+  ErrorCode status = OK;
+  int64_t fileCreationIndex = 0;
+  for (pos = startOffset; pos < validEnd;) {
+    const int16_t entrySize = folly::loadUnaligned<int16_t>(log + pos);
+    char *entry = log + pos + sizeof(int16_t);
+    pos += sizeof(int16_t) + entrySize;
     TransferLogManager::EntryType type =
         (TransferLogManager::EntryType)entry[0];
+    const int64_t index =
+        (type == TransferLogManager::FILE_CREATION) ? fileCreationIndex++ : -1;
     if (status == INCONSISTENT_DIRECTORY &&
         type != TransferLogManager::HEADER) {
       // If the directory is invalid, no need to process any entry other than
@@ -1071,14 +1742,14 @@ ErrorCode LogParser::parseLog(int fd, string &senderIp,
       continue;
     }
     char *buf = entry + 1;
-    const int64_t bufSize = sizeof(entry) - 1;
+    const int64_t bufSize = TransferLogManager::kMaxEntryLength - 1;
     const int64_t entryLen = entrySize - 1;
     switch (type) {
       case TransferLogManager::HEADER:
         status = processHeaderEntry(buf, bufSize, entryLen, senderIp);
         break;
       case TransferLogManager::FILE_CREATION:
-        status = processFileCreationEntry(buf, entryLen);
+        status = processFileCreationEntry(buf, entryLen, index);
         break;
       case TransferLogManager::BLOCK_WRITE:
         status = processBlockWriteEntry(buf, entryLen);
@@ -1104,6 +1775,93 @@ ErrorCode LogParser::parseLog(int fd, string &senderIp,
       clearParsedData();
     }
   }
+  if (badEntrySize) {
+    WLOG(ERROR) << "Transfer log parse error, invalid entry length "
+                << folly::loadUnaligned<int16_t>(log + validEnd);
+    return INVALID_LOG;
+  }
+  return status;
+}
+
+ErrorCode LogParser::mapAndParseEntries(int fd, int64_t startOffset,
+                                        int64_t logSize, int64_t &validEnd,
+                                        string &senderIp) {
+  // empty log is valid
+  char *log = nullptr;
+  if (logSize > startOffset) {
+    void *ptr = ::mmap(nullptr, logSize, PROT_READ | PROT_WRITE, MAP_PRIVATE,
+                       fd, 0);
+    if (ptr == MAP_FAILED) {
+      WPLOG(ERROR) << "Error while reading transfer log " << fd << " size "
+                   << logSize;
+      return INVALID_LOG;
+    }
+    log = static_cast<char *>(ptr);
+  }
+  ErrorCode status =
+      parseEntries(log, startOffset, logSize, validEnd, senderIp);
+  if (log != nullptr && ::munmap(log, logSize) != 0) {
+    WPLOG(ERROR) << "munmap failed for transfer log " << fd;
+  }
+  return status;
+}
+
+ErrorCode LogParser::parseForCompaction(
+    int fd, int64_t logSize, string &senderIp,
+    std::vector<FileChunksInfo> &fileChunksInfo,
+    std::map<int64_t, int64_t> &fileSizes) {
+  int64_t validEnd = 0;
+  ErrorCode status = mapAndParseEntries(fd, 0, logSize, validEnd, senderIp);
+  if (status != OK) {
+    return status;
+  }
+  if (validEnd != logSize || !invalidSeqIds_.empty()) {
+    // an entry written later could refer to a file which would be dropped
+    WLOG(WARNING) << "Can not compact the log, " << invalidSeqIds_.size()
+                  << " invalid files, " << logSize - validEnd
+                  << " bytes of partial entries";
+    return ERROR;
+  }
+  for (auto &pair : fileInfoMap_) {
+    FileChunksInfo &fileInfo = pair.second;
+    fileInfo.mergeChunks();
+    fileChunksInfo.emplace_back(std::move(fileInfo));
+  }
+  fileSizes = seqIdToSizeMap_;
+  return OK;
+}
+
+ErrorCode LogParser::parseLog(int fd, string &senderIp,
+                              std::vector<FileChunksInfo> &fileChunksInfo) {
+  const int64_t startOffset = ::lseek(fd, 0, SEEK_CUR);
+  struct stat statBuffer;
+  if (startOffset < 0 || fstat(fd, &statBuffer) != 0) {
+    WPLOG(ERROR) << "Error while reading transfer log " << fd;
+    return INVALID_LOG;
+  }
+  const int64_t logSize = statBuffer.st_size;
+  int64_t validEnd = startOffset;
+  ErrorCode status =
+      mapAndParseEntries(fd, startOffset, logSize, validEnd, senderIp);
+  if (status == INVALID_LOG) {
+    return status;
+  }
+  if (parseOnly_) {
+    printFileChecksums();
+  }
+  if (validEnd < logSize) {
+    // extra bytes at the end, most likely part of the previous write
+    // succeeded partially
+    const int64_t extraBytes = logSize - validEnd;
+    if (parseOnly_) {
+      WLOG(INFO) << "Extra " << extraBytes << " bytes at the end of the log";
+    } else if (!truncateExtraBytesAtEnd(fd, extraBytes)) {
+      return INVALID_LOG;
+    }
+  } else if (::lseek(fd, logSize, SEEK_SET) < 0) {
+    WPLOG(ERROR) << "lseek failed for fd " << fd;
+    return INVALID_LOG;
+  }
   if (status == OK) {
     for (auto &pair : fileInfoMap_) {
       FileChunksInfo &fileInfo = pair.second;
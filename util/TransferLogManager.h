@@ -9,15 +9,19 @@
 #pragma once
 
 #include <wdt/Protocol.h>
+#include <wdt/Reporting.h>
 #include <wdt/WdtOptions.h>
 
+#include <atomic>
 #include <condition_variable>
 #include <iostream>
 #include <map>
+#include <memory>
 #include <mutex>
 #include <set>
 #include <string>
 #include <thread>
+#include <vector>
 
 namespace facebook {
 namespace wdt {
@@ -43,6 +47,8 @@ namespace wdt {
 
 constexpr char kWdtLogName[] = ".wdt.log";
 constexpr char kWdtBuggyLogName[] = ".wdt.log.bug";
+/// compacted log, renamed to .wdt.log once complete
+constexpr char kWdtCompactedLogName[] = ".wdt.log.compact";
 /**
  * class responsible for encoding and decoding transfer log entries
  */
@@ -68,14 +74,19 @@ class LogEncoderDecoder {
                                std::string &fileName, int64_t &seqId,
                                int64_t &fileSize);
 
-  /// encodes block write entry
+  /// encodes block write entry, the checksum is only encoded if its type is
+  /// not NUM_CHECKSUM_TYPES
   int64_t encodeBlockWriteEntry(char *dest, int64_t max, const int64_t seqId,
-                                const int64_t offset, const int64_t blockSize);
+                                const int64_t offset, const int64_t blockSize,
+                                ChecksumType checksumType = NUM_CHECKSUM_TYPES,
+                                int64_t checksum = 0);
 
-  /// decodes block write entry
+  /// decodes block write entry, checksumType is set to NUM_CHECKSUM_TYPES if
+  /// the entry has no checksum
   bool decodeBlockWriteEntry(char *buf, int16_t size, int64_t &timestamp,
                              int64_t &seqId, int64_t &offset,
-                             int64_t &blockSize);
+                             int64_t &blockSize, ChecksumType &checksumType,
+                             int64_t &checksum);
 
   /// encodes file resize entry
   int64_t encodeFileResizeEntry(char *dest, int64_t max, const int64_t seqId,
@@ -110,10 +121,21 @@ class LogEncoderDecoder {
  * class buffers writes to transfer log and starts a writer thread to
  * periodically write log entries to the disk. This also has a function to read
  * all the entries and correct the log if needed.
+ *
+ * With transfer_log_mmap, the threads adding entries stage them in a lock free
+ * buffer of their own, tagged with a global sequence number. The writer thread
+ * merges the buffers back in sequence order, appends each batch to a
+ * preallocated memory mapped region of the log and commits it with a single
+ * msync. The space preallocated and not used is truncated when the log is
+ * closed, and skipped by the parser if a crash left it behind.
  */
 class TransferLogManager {
  public:
   const static int WLOG_VERSION;
+  /// oldest log version which can still be parsed
+  const static int WLOG_MIN_VERSION;
+  /// version from which block write entries can carry a checksum
+  const static int WLOG_BLOCK_CHECKSUM_VERSION;
 
   enum EntryType {
     HEADER,                  // log header
@@ -128,13 +150,7 @@ class TransferLogManager {
   /// bytes for seq-id, 10 bytes for file-size, 10 bytes for timestamp
   static const int64_t kMaxEntryLength = 2 + 1 + 10 + PATH_MAX + 2 * 10;
 
-  TransferLogManager(const WdtOptions &options, const std::string &rootDir)
-      : options_(options) {
-    rootDir_ = rootDir;
-    if (rootDir_.back() != '/') {
-      rootDir_.push_back('/');
-    }
-  }
+  TransferLogManager(const WdtOptions &options, const std::string &rootDir);
 
   /**
    * Opens the log for reading and writing. In case of log based
@@ -180,11 +196,16 @@ class TransferLogManager {
   /**
    * Adds a block write entry to the log buffer
    *
-   * @param seqId     seq-id of the file
-   * @param offset    block offset
-   * @param blockSize size of the block
+   * @param seqId         seq-id of the file
+   * @param offset        block offset
+   * @param blockSize     size of the block
+   * @param checksumType  type of the checksum of the block, NUM_CHECKSUM_TYPES
+   *                      if it has none
+   * @param checksum      checksum of the data of the block
    */
-  void addBlockWriteEntry(int64_t seqId, int64_t offset, int64_t blockSize);
+  void addBlockWriteEntry(int64_t seqId, int64_t offset, int64_t blockSize,
+                          ChecksumType checksumType = NUM_CHECKSUM_TYPES,
+                          int64_t checksum = 0);
 
   /**
    * Adds a file resize entry to the log buffer
@@ -243,9 +264,22 @@ class TransferLogManager {
   ~TransferLogManager();
 
  private:
+  /// lock free buffer of the entries added by one thread
+  class StagingBuffer;
+
+  /// @return   unique id of a new log manager
+  static int64_t nextId();
+
   /// Shutdown the log writer thread
   void shutdownThread();
 
+  /// adds an encoded entry to the staging buffer of the calling thread, or to
+  /// the entry buffer if entries are not staged
+  void addEntry(const char *buf, int64_t size);
+
+  /// @return   staging buffer of the calling thread, created if needed
+  StagingBuffer *getStagingBuffer();
+
   std::string getFullPath(const std::string &relPath);
 
   /**
@@ -254,6 +288,42 @@ class TransferLogManager {
    */
   void threadProcWriteEntriesToDisk();
 
+  /**
+   * entry point for the writer thread of the memory mapped log. This thread
+   * periodically merges the staged entries and commits them to disk
+   *
+   * @param nextSeq   sequence number of the first entry staged
+   */
+  void threadProcCommitMappedEntries(int64_t nextSeq);
+
+  /// Writes an entry outside of the writer thread, to the mapped region if
+  /// the log is mapped. return true if the entry is written successfully
+  bool writeToLog(const char *buf, int64_t size);
+
+  /// Maps the log from its current end. logMutex_ must be held.
+  /// return true if the log is mapped
+  bool mapLogLocked(int64_t minSize);
+
+  /// Appends to the mapped log, growing it if needed. logMutex_ must be held
+  bool appendToMappedLogLocked(const char *buf, int64_t size);
+
+  /// msyncs the mapped log. logMutex_ must be held
+  void syncMappedLogLocked();
+
+  /// Syncs and unmaps the log, truncating the space preallocated and not used
+  void unmapLog();
+
+  /**
+   * Called by the writer thread between batches. If the log has doubled since
+   * its last compaction, rewrites it with an entry per file and per chunk of
+   * the file and swaps it in atomically
+   */
+  void compactLogOnline();
+
+  /// Writes the compacted log and renames it over the log. logMutex_ must be
+  /// held. return true if the log was swapped
+  bool swapInCompactedLogLocked(const std::string &compacted);
+
   /// Write 'entries' to disk synchronously
   /// return true if entries are written successfully, otherwise false.
   bool writeEntriesToDiskNoLock(const std::vector<std::string> &entries);
@@ -316,9 +386,50 @@ class TransferLogManager {
   std::thread writerThread_;
   std::mutex mutex_;
   std::condition_variable conditionFinished_;
+
+  /// id of the manager, for the staging buffer cache of the threads
+  const int64_t id_{nextId()};
+  /// whether entries are staged for the writer of the mapped log, cleared
+  /// under mutex_
+  std::atomic<bool> staging_{false};
+  /// adders which saw staging_ set and may still be pushing, the last drain
+  /// waits for them
+  std::atomic<int64_t> numStagingAdds_{0};
+  /// signalled under mutex_ by the last add in flight once staging_ is
+  /// cleared
+  std::condition_variable stagingAddsDone_;
+  /// sequence number of the next entry staged
+  std::atomic<int64_t> nextEntrySeq_{0};
+  /// staging buffers of the threads which added entries, guarded by mutex_
+  std::vector<std::unique_ptr<StagingBuffer>> stagingBuffers_;
+  /// staged entries which did not fit in their buffer, guarded by mutex_
+  std::map<int64_t, std::string> overflowEntries_;
+
+  /// guards the mapping of the log
+  std::mutex logMutex_;
+  /// mapped region of the log, nullptr if the log is not mapped
+  char *map_{nullptr};
+  /// offset of the mapped region in the log
+  int64_t mapOffset_{0};
+  /// size of the mapped region
+  int64_t mapSize_{0};
+  /// end of the entries in the mapped log
+  int64_t logEnd_{0};
+  /// end of the entries msynced
+  int64_t syncedEnd_{0};
+
+  /// when the writer thread last checked whether to compact the log
+  Clock::time_point lastCompactionCheck_{Clock::now()};
+  /// size of the log after its last compaction
+  int64_t compactedSize_{0};
 };
 
-/// class responsible for parsing and fixing transfer log
+/**
+ * class responsible for parsing and fixing transfer log. The log is mapped in
+ * memory and its entries found in a first pass. The files of the file creation
+ * entries are then stat-ed in parallel, by segments of the log, before the
+ * entries are applied in order.
+ */
 class LogParser {
  public:
   LogParser(const WdtOptions &options, LogEncoderDecoder &encoderDecoder,
@@ -328,11 +439,79 @@ class LogParser {
   ErrorCode parseLog(int fd, std::string &senderIp,
                      std::vector<FileChunksInfo> &fileChunksInfo);
 
+  /**
+   * Parses the start of a log without fixing it, for its compaction. Fails
+   * unless all the entries and the files are valid
+   *
+   * @param fd              file descriptor of the log
+   * @param logSize         size of the log to parse
+   * @param senderIp        set to the sender ip of the log
+   * @param fileChunksInfo  populated with the chunks of the files
+   * @param fileSizes       populated with the size logged for each file
+   *
+   * @return                OK if the log can be compacted
+   */
+  ErrorCode parseForCompaction(int fd, int64_t logSize, std::string &senderIp,
+                               std::vector<FileChunksInfo> &fileChunksInfo,
+                               std::map<int64_t, int64_t> &fileSizes);
+
  private:
+  /// size on the disk of the file of a file creation entry
+  struct FileStat {
+    /// whether the file was stat-ed
+    bool done{false};
+    /// whether it exists
+    bool exists{false};
+    /// size on the disk
+    int64_t size{0};
+  };
+
+  /// part of the log, the files of which are stat-ed by one thread
+  struct Segment {
+    /// offset of the first entry
+    int64_t offset;
+    /// offset past the last entry
+    int64_t end;
+    /// index of the first file creation entry of the segment
+    int64_t firstFileCreation;
+  };
+
   std::string getFormattedTimestamp(int64_t timestamp);
 
   void clearParsedData();
 
+  /**
+   * Prints the checksum of the whole files, combined from the checksums of
+   * their blocks, for the files the logged blocks entirely cover
+   */
+  void printFileChecksums();
+
+  /**
+   * Applies the entries of the mapped log in order
+   *
+   * @param log           mapped log
+   * @param startOffset   offset of the first entry
+   * @param logSize       size of the log
+   * @param validEnd      set to the end of the last complete entry
+   * @param senderIp      set to the sender ip of the last header
+   *
+   * @return              status of the parsing
+   */
+  ErrorCode parseEntries(char *log, int64_t startOffset, int64_t logSize,
+                         int64_t &validEnd, std::string &senderIp);
+
+  /// maps the first logSize bytes of the log and applies their entries, see
+  /// parseEntries
+  ErrorCode mapAndParseEntries(int fd, int64_t startOffset, int64_t logSize,
+                               int64_t &validEnd, std::string &senderIp);
+
+  /// stats the files of the file creation entries of the segments, in
+  /// parallel, into fileStats_
+  void statFiles(char *log, const std::vector<Segment> &segments);
+
+  /// stats a file of the log
+  void statFile(const std::string &fileName, FileStat &fileStat);
+
   /**
    * Truncates the log
    *
@@ -354,7 +533,8 @@ class LogParser {
                                std::string &senderIp);
 
   // TODO: switch to ByteRange
-  ErrorCode processFileCreationEntry(char *buf, int64_t size);
+  /// @param index  index of the entry among the file creation entries
+  ErrorCode processFileCreationEntry(char *buf, int64_t size, int64_t index);
 
   ErrorCode processBlockWriteEntry(char *buf, int64_t size);
 
@@ -372,6 +552,8 @@ class LogParser {
   bool parseOnly_;
   /// whether header is parsed or not
   bool headerParsed_{false};
+  /// version of the last header parsed, each run appends its own header
+  int logVersion_{0};
 
   /// seq-id to chunks map
   std::map<int64_t, FileChunksInfo> fileInfoMap_;
@@ -379,6 +561,19 @@ class LogParser {
   std::map<int64_t, int64_t> seqIdToSizeMap_;
   /// set of invalid seq-ids
   std::set<int64_t> invalidSeqIds_;
+  /// files of the file creation entries, stat-ed ahead of the parsing
+  std::vector<FileStat> fileStats_;
+
+  /// checksum logged with a block
+  struct BlockChecksumEntry {
+    int64_t blockSize;
+    ChecksumType checksumType;
+    int64_t checksum;
+  };
+  /// parse only mode: seq-id to the checksums of its blocks by offset
+  std::map<int64_t, std::map<int64_t, BlockChecksumEntry>> blockChecksums_;
+  /// parse only mode: seq-id to the last logged size of the file
+  std::map<int64_t, int64_t> printedFileSizes_;
 };
 }
 }
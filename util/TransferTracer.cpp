@@ -0,0 +1,231 @@
+/**
+ * Copyright (c) 2014-present, Facebook, Inc.
+ * All rights reserved.
+ *
+ * This source code is licensed under the BSD-style license found in the
+ * LICENSE file in the root directory of this source tree. An additional grant
+ * of patent rights can be found in the PATENTS file in the same directory.
+ */
+#include <wdt/util/TransferTracer.h>
+
+#include <fcntl.h>
+#include <unistd.h>
+#include <algorithm>
+
+namespace facebook {
+namespace wdt {
+
+namespace {
+/// trace is written in chunks of this size
+const size_t kWriteChunkSize = 1024 * 1024;
+
+/// buffer of the calling thread, released when the thread exits
+struct CachedBuffer {
+  void *buffer{nullptr};
+  std::atomic<bool> *released{nullptr};
+
+  ~CachedBuffer() {
+    if (released != nullptr) {
+      released->store(true, std::memory_order_release);
+    }
+  }
+};
+
+thread_local CachedBuffer cachedBuffer;
+
+bool writeFully(int fd, const std::string &buf) {
+  size_t written = 0;
+  while (written < buf.size()) {
+    ssize_t ret = ::write(fd, buf.data() + written, buf.size() - written);
+    if (ret < 0) {
+      if (errno == EINTR) {
+        continue;
+      }
+      return false;
+    }
+    written += ret;
+  }
+  return true;
+}
+}
+
+TransferTracer &TransferTracer::get() {
+  // never destroyed: threads can record spans during static destruction
+  static TransferTracer *tracer = new TransferTracer();
+  return *tracer;
+}
+
+void TransferTracer::start(int32_t bufferEvents) {
+  if (bufferEvents <= 0) {
+    return;
+  }
+  std::lock_guard<std::mutex> lock(mutex_);
+  if (enabled_.load(std::memory_order_relaxed)) {
+    return;
+  }
+  bufferEvents_ = bufferEvents;
+  startTime_ = Clock::now();
+  enabled_.store(true, std::memory_order_release);
+  WLOG(INFO) << "Tracing the transfers, " << bufferEvents
+             << " spans kept per thread";
+}
+
+TransferTracer::ThreadBuffer *TransferTracer::getThreadBuffer() {
+  if (cachedBuffer.buffer != nullptr) {
+    return static_cast<ThreadBuffer *>(cachedBuffer.buffer);
+  }
+  ThreadBuffer *buffer = nullptr;
+  {
+    std::lock_guard<std::mutex> lock(mutex_);
+    for (const auto &threadBuffer : buffers_) {
+      if (threadBuffer->reusable) {
+        buffer = threadBuffer.get();
+        break;
+      }
+    }
+    if (buffer == nullptr) {
+      buffers_.emplace_back(new ThreadBuffer());
+      buffer = buffers_.back().get();
+      buffer->events.resize(bufferEvents_);
+    }
+    buffer->tid = nextTid_++;
+    buffer->threadName.clear();
+    buffer->numRecorded = 0;
+    buffer->reusable = false;
+    buffer->released.store(false, std::memory_order_relaxed);
+  }
+  cachedBuffer.buffer = buffer;
+  cachedBuffer.released = &buffer->released;
+  return buffer;
+}
+
+void TransferTracer::record(const char *name, Clock::time_point startTime,
+                            Clock::time_point endTime) {
+  ThreadBuffer *buffer = getThreadBuffer();
+  Event &event = buffer->events[buffer->numRecorded % buffer->events.size()];
+  event.name = name;
+  event.startMicros = durationMicros(startTime - startTime_);
+  event.durationMicros = durationMicros(endTime - startTime);
+  ++buffer->numRecorded;
+}
+
+void TransferTracer::setThreadName(const std::string &name) {
+  getThreadBuffer()->threadName = name;
+}
+
+bool TransferTracer::isDumpable(const ThreadBuffer &buffer) const {
+  if (buffer.reusable) {
+    return false;
+  }
+  return buffer.released.load(std::memory_order_acquire) ||
+         cachedBuffer.buffer == &buffer;
+}
+
+ErrorCode TransferTracer::dump(const std::string &path) {
+  if (!isEnabled()) {
+    return OK;
+  }
+  {
+    // a transfer finishing after the spans of its threads were dumped by
+    // another one of the process should not overwrite that trace
+    std::lock_guard<std::mutex> lock(mutex_);
+    bool hasSpans = false;
+    for (const auto &threadBuffer : buffers_) {
+      if (isDumpable(*threadBuffer) && threadBuffer->numRecorded > 0) {
+        hasSpans = true;
+        break;
+      }
+    }
+    if (!hasSpans) {
+      WVLOG(1) << "No new spans to write to trace file " << path;
+      return OK;
+    }
+  }
+  const std::string tmpPath = path + ".tmp";
+  int fd = ::open(tmpPath.c_str(), O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC,
+                  0644);
+  if (fd < 0) {
+    WPLOG(ERROR) << "Unable to create trace file " << tmpPath;
+    return ERROR;
+  }
+  const int pid = getpid();
+  bool success = true;
+  std::string buf("{\"displayTimeUnit\":\"ms\",\"traceEvents\":[");
+  bool first = true;
+  auto flush = [&](bool force) {
+    if (success && (force || buf.size() >= kWriteChunkSize)) {
+      success = writeFully(fd, buf);
+      buf.clear();
+    }
+  };
+  auto startEvent = [&]() {
+    if (!first) {
+      buf.push_back(',');
+    }
+    first = false;
+  };
+  int64_t numEvents = 0;
+  int64_t numLost = 0;
+  {
+    std::lock_guard<std::mutex> lock(mutex_);
+    for (const auto &threadBuffer : buffers_) {
+      ThreadBuffer &buffer = *threadBuffer;
+      if (!isDumpable(buffer)) {
+        continue;
+      }
+      const int64_t capacity = buffer.events.size();
+      const int64_t count = std::min(buffer.numRecorded, capacity);
+      numLost += buffer.numRecorded - count;
+      if (!buffer.threadName.empty()) {
+        startEvent();
+        buf.append("{\"name\":\"thread_name\",\"ph\":\"M\",\"pid\":");
+        buf.append(std::to_string(pid));
+        buf.append(",\"tid\":");
+        buf.append(std::to_string(buffer.tid));
+        buf.append(",\"args\":{\"name\":\"");
+        buf.append(buffer.threadName);
+        buf.append("\"}}");
+      }
+      for (int64_t i = buffer.numRecorded - count; i < buffer.numRecorded;
+           ++i) {
+        const Event &event = buffer.events[i % capacity];
+        startEvent();
+        buf.append("{\"name\":\"");
+        buf.append(event.name);
+        buf.append("\",\"ph\":\"X\",\"pid\":");
+        buf.append(std::to_string(pid));
+        buf.append(",\"tid\":");
+        buf.append(std::to_string(buffer.tid));
+        buf.append(",\"ts\":");
+        buf.append(std::to_string(event.startMicros));
+        buf.append(",\"dur\":");
+        buf.append(std::to_string(event.durationMicros));
+        buf.push_back('}');
+        flush(false);
+      }
+      numEvents += count;
+      buffer.numRecorded = 0;
+      buffer.reusable = buffer.released.load(std::memory_order_acquire);
+    }
+  }
+  buf.append("]}\n");
+  flush(true);
+  if (::close(fd) != 0) {
+    WPLOG(ERROR) << "Error closing trace file " << tmpPath;
+    success = false;
+  }
+  if (success && rename(tmpPath.c_str(), path.c_str()) != 0) {
+    WPLOG(ERROR) << "Unable to rename " << tmpPath << " to " << path;
+    success = false;
+  }
+  if (!success) {
+    WPLOG(ERROR) << "Unable to write trace file " << path;
+    ::unlink(tmpPath.c_str());
+    return ERROR;
+  }
+  WLOG(INFO) << "Wrote " << numEvents << " spans to trace file " << path
+             << ", " << numLost << " older spans were overwritten";
+  return OK;
+}
+}
+}
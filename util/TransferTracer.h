@@ -0,0 +1,138 @@
+/**
+ * Copyright (c) 2014-present, Facebook, Inc.
+ * All rights reserved.
+ *
+ * This source code is licensed under the BSD-style license found in the
+ * LICENSE file in the root directory of this source tree. An additional grant
+ * of patent rights can be found in the PATENTS file in the same directory.
+ */
+#pragma once
+
+#include <wdt/ErrorCodes.h>
+#include <wdt/Reporting.h>
+
+#include <atomic>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <vector>
+
+namespace facebook {
+namespace wdt {
+
+/**
+ * Process wide tracer of the timeline of the transfers, off unless a transfer
+ * has a trace_file. Each thread records its spans (states of the state
+ * machines, block sends, disk and socket operations, throttler sleeps) into
+ * its own fixed size ring buffer, without any lock or atomic read-modify-write
+ * on the hot path, and the buffers are dumped as a Chrome trace-event JSON,
+ * viewable in chrome://tracing or Perfetto, once the transfer threads are
+ * done. When a buffer wraps around, the oldest spans of its thread are lost.
+ */
+class TransferTracer {
+ public:
+  /// @return   the tracer of the process
+  static TransferTracer &get();
+
+  /// @return   whether spans are being recorded
+  bool isEnabled() const {
+    return enabled_.load(std::memory_order_relaxed);
+  }
+
+  /**
+   * Starts recording the spans, the first call of the process sets the
+   * number of spans kept per thread
+   */
+  void start(int32_t bufferEvents);
+
+  /**
+   * Records a span of the calling thread
+   *
+   * @param name        name of the span, has to outlive the tracer
+   * @param startTime   when the span started
+   * @param endTime     when the span ended
+   */
+  void record(const char *name, Clock::time_point startTime,
+              Clock::time_point endTime);
+
+  /// names the calling thread in the trace
+  void setThreadName(const std::string &name);
+
+  /**
+   * Writes the spans recorded since the last dump by the calling thread and
+   * the threads that have exited in the Chrome trace-event format, and
+   * forgets them. The spans of the threads still running are left for a
+   * later dump, as their buffers can't be read while being written. Nothing
+   * is written if there are no such spans.
+   *
+   * @param path    file to write the trace to
+   *
+   * @return        OK on success, error code otherwise
+   */
+  ErrorCode dump(const std::string &path);
+
+ private:
+  struct Event {
+    const char *name{nullptr};
+    int64_t startMicros{0};
+    int64_t durationMicros{0};
+  };
+
+  /// ring buffer of the spans of one thread, only written by that thread
+  struct ThreadBuffer {
+    /// id of the thread in the trace
+    int32_t tid{0};
+    std::string threadName;
+    std::vector<Event> events;
+    /// number of spans recorded since the last dump
+    int64_t numRecorded{0};
+    /// true once the thread has exited
+    std::atomic<bool> released{false};
+    /// true once the spans of an exited thread have been dumped, the buffer
+    /// can then be given to a new thread
+    bool reusable{false};
+  };
+
+  TransferTracer() = default;
+
+  /// @return   buffer of the calling thread, made the first time
+  ThreadBuffer *getThreadBuffer();
+
+  /// @return   whether the spans of a buffer can be read by the calling thread
+  bool isDumpable(const ThreadBuffer &buffer) const;
+
+  std::atomic<bool> enabled_{false};
+  /// spans kept per thread, set by the first start
+  int32_t bufferEvents_{0};
+  /// id of the next thread given a buffer
+  int32_t nextTid_{1};
+  /// time the spans are relative to
+  Clock::time_point startTime_;
+  /// guards the list of the buffers, not their content
+  std::mutex mutex_;
+  std::vector<std::unique_ptr<ThreadBuffer>> buffers_;
+};
+
+/// records the time spent in its scope as a span, if tracing is enabled
+class TraceSpan {
+ public:
+  explicit TraceSpan(const char *name) : name_(name) {
+    if (TransferTracer::get().isEnabled()) {
+      startTime_ = Clock::now();
+      enabled_ = true;
+    }
+  }
+
+  ~TraceSpan() {
+    if (enabled_) {
+      TransferTracer::get().record(name_, startTime_, Clock::now());
+    }
+  }
+
+ private:
+  const char *const name_;
+  bool enabled_{false};
+  Clock::time_point startTime_;
+};
+}
+}
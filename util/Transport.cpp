@@ -0,0 +1,80 @@
+/**
+ * Copyright (c) 2014-present, Facebook, Inc.
+ * All rights reserved.
+ *
+ * This source code is licensed under the BSD-style license found in the
+ * LICENSE file in the root directory of this source tree. An additional grant
+ * of patent rights can be found in the PATENTS file in the same directory.
+ */
+#include <wdt/util/Transport.h>
+
+#include <wdt/ErrorCodes.h>
+#include <wdt/Reporting.h>
+
+#include <errno.h>
+#include <poll.h>
+#include <sys/socket.h>
+#include <unistd.h>
+
+namespace facebook {
+namespace wdt {
+
+bool Transport::exchangeSetup(int fd, const char *out, char *in, int len,
+                              int timeoutMs) {
+  const auto startTime = Clock::now();
+  auto timedOut = [&]() {
+    return timeoutMs > 0 &&
+           durationMillis(Clock::now() - startTime) >= timeoutMs;
+  };
+  int done = 0;
+  while (done < len) {
+    const int64_t ret = ::write(fd, out + done, len - done);
+    if (ret > 0) {
+      done += ret;
+      continue;
+    }
+    if (ret < 0 && (errno == EINTR || errno == EAGAIN) && !timedOut()) {
+      continue;
+    }
+    WPLOG(ERROR) << "Failed to write the transport setup " << fd;
+    return false;
+  }
+  done = 0;
+  while (done < len) {
+    const int64_t ret = ::read(fd, in + done, len - done);
+    if (ret > 0) {
+      done += ret;
+      continue;
+    }
+    if (ret < 0 && (errno == EINTR || errno == EAGAIN) && !timedOut()) {
+      continue;
+    }
+    WPLOG(ERROR) << "Failed to read the transport setup of the peer " << fd
+                 << " " << ret;
+    return false;
+  }
+  return true;
+}
+
+int64_t TcpTransport::read(char *buf, int64_t nbyte, int /* timeoutMs */) {
+  return ::read(fd_, buf, nbyte);
+}
+
+int64_t TcpTransport::write(const char *buf, int64_t nbyte,
+                            int /* timeoutMs */) {
+  return ::write(fd_, buf, nbyte);
+}
+
+bool TcpTransport::isReadable() {
+  struct pollfd pfd;
+  pfd.fd = fd_;
+  pfd.events = POLLIN;
+  pfd.revents = 0;
+  return ::poll(&pfd, 1, 0) > 0;
+}
+
+int TcpTransport::shutdownWrites() {
+  return ::shutdown(fd_, SHUT_WR);
+}
+}
+}
@@ -0,0 +1,120 @@
+/**
+ * Copyright (c) 2014-present, Facebook, Inc.
+ * All rights reserved.
+ *
+ * This source code is licensed under the BSD-style license found in the
+ * LICENSE file in the root directory of this source tree. An additional grant
+ * of patent rights can be found in the PATENTS file in the same directory.
+ */
+#pragma once
+
+#include <cstdint>
+#include <string>
+
+namespace facebook {
+namespace wdt {
+
+/**
+ * Moves the bytes of a connected WdtSocket. The socket keeps the encryption,
+ * the tags and the abort checks and retries of ioWithAbortCheck on top of it,
+ * a transport only moves the bytes. The tcp connection of the socket is
+ * always there: it is used to set up the other transports and carries what
+ * they do not.
+ * read() and write() follow the conventions of ::read and ::write: number of
+ * bytes moved, 0 at the end of the stream for read(), -1 with errno set in
+ * case of error, EAGAIN once the timeout elapsed without progress.
+ */
+class Transport {
+ public:
+  virtual ~Transport() {
+  }
+
+  /**
+   * @param buf         destination
+   * @param nbyte       max number of bytes to read
+   * @param timeoutMs   max time to wait for some data, <= 0 to wait as long
+   *                    as the socket timeouts allow
+   */
+  virtual int64_t read(char *buf, int64_t nbyte, int timeoutMs) = 0;
+
+  /// same as read(), writing up to nbyte bytes of buf
+  virtual int64_t write(const char *buf, int64_t nbyte, int timeoutMs) = 0;
+
+  /// @return   whether read() would return without waiting
+  virtual bool isReadable() = 0;
+
+  /**
+   * @return    fd to poll for the readability of read(), once isReadable()
+   *            returned false
+   */
+  virtual int getPollFd() const = 0;
+
+  /**
+   * Ends the writes, the peer reads the end of the stream once it has read
+   * all the data written
+   *
+   * @return    0 on success, -1 with errno set otherwise
+   */
+  virtual int shutdownWrites() = 0;
+
+  /**
+   * @return    whether the data goes through the tcp connection, so that the
+   *            features writing to it directly (sendfile, MSG_ZEROCOPY,
+   *            writev, kernel tls) can be used
+   */
+  virtual bool isDataOnFd() const = 0;
+
+  /**
+   * @return    bytes written and not yet consumed by the peer, -1 if the send
+   *            queue of the tcp connection tells it
+   */
+  virtual int64_t getUnackedBytes() const {
+    return -1;
+  }
+
+  /// @return   name of the transport, for the logs
+  virtual std::string getName() const = 0;
+
+  /**
+   * Exchanges the setup of a transport with the peer over the tcp
+   * connection: writes len bytes of out, then reads len bytes into in
+   *
+   * @return    false on error or once timeoutMs elapsed
+   */
+  static bool exchangeSetup(int fd, const char *out, char *in, int len,
+                            int timeoutMs);
+};
+
+/// Transport over the tcp connection itself, the default one
+class TcpTransport : public Transport {
+ public:
+  /// @param fd   connected socket, not owned
+  explicit TcpTransport(int fd) : fd_(fd) {
+  }
+
+  /// timeoutMs is ignored, the read/write timeouts of the socket apply
+  int64_t read(char *buf, int64_t nbyte, int timeoutMs) override;
+
+  int64_t write(const char *buf, int64_t nbyte, int timeoutMs) override;
+
+  bool isReadable() override;
+
+  int getPollFd() const override {
+    return fd_;
+  }
+
+  int shutdownWrites() override;
+
+  bool isDataOnFd() const override {
+    return true;
+  }
+
+  std::string getName() const override {
+    return "tcp";
+  }
+
+ private:
+  const int fd_;
+};
+}
+}
@@ -2,16 +2,45 @@
 #include <folly/lang/Bits.h>
 #include <folly/String.h>  // for humanify
 #include <netdb.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <poll.h>
 #include <sys/ioctl.h>
+#include <sys/uio.h>
+#include <fstream>
+#ifdef __linux__
+#include <linux/errqueue.h>
+#include <sys/sendfile.h>
+#endif
 #include <unistd.h>
 #include <wdt/Protocol.h>
+#include <wdt/util/RdmaTransport.h>
+#include <wdt/util/ShmTransport.h>
 #ifdef WDT_HAS_SOCKIOS_H
 #include <linux/sockios.h>
 #endif
+#ifdef WDT_HAS_KTLS
+#include <linux/tls.h>
+#endif
+
+#if defined(SO_ZEROCOPY) && defined(MSG_ZEROCOPY) && \
+    defined(SO_EE_ORIGIN_ZEROCOPY)
+#define WDT_ZEROCOPY_SUPPORTED 1
+#endif
+
+#if defined(WDT_HAS_KTLS) && defined(TCP_ULP) && defined(TLS_CIPHER_AES_GCM_128)
+#define WDT_KTLS_SUPPORTED 1
+#ifndef SOL_TLS
+#define SOL_TLS 282
+#endif
+#endif
 
 namespace facebook {
 namespace wdt {
 
+/// smaller writes are always copied, pinning pages is not worth it for them
+static const int kMinZeroCopyWriteSize = 64 * 1024;
+
 WdtSocket::WdtSocket(ThreadCtx &threadCtx, const int port,
                      const EncryptionParams &encryptionParams,
                      const int64_t ivChangeInterval,
@@ -74,6 +103,19 @@ void WdtSocket::readEncryptionSettingsOnce(int timeoutMs) {
     readErrorCode_ = PROTOCOL_ERROR;
     return;
   }
+  if (readTagInterval_ == Protocol::kKtlsTagInterval) {
+    // the rest of the stream is made of tls records, tagged by the kernel
+    readTagInterval_ = 0;
+    if (encryptionType != ENC_AES128_GCM || !setupTlsUlp() ||
+        !enableKtls(false, iv)) {
+      WLOG(ERROR) << "Peer uses kernel tls, unable to decrypt its records "
+                  << port_;
+      readErrorCode_ = ENCRYPTION_ERROR;
+      return;
+    }
+    encryptionSettingsRead_ = true;
+    return;
+  }
   if (readTagInterval_ < 0) {
     WLOG(ERROR) << "Encryption tag verification interval can't be negative "
                 << readTagInterval_;
@@ -108,17 +150,30 @@ void WdtSocket::writeEncryptionSettingsOnce() {
     writeErrorCode_ = ENCRYPTION_ERROR;
     return;
   }
+  // kernel tls only does gcm, and falls back to user space crypto if the
+  // kernel has no tls support. It only applies to data going over the fd
+  const bool useKtls = threadCtx_.getOptions().ktls && ktlsAllowed_ &&
+                       encryptionParams_.getType() == ENC_AES128_GCM &&
+                       transport_->isDataOnFd() && setupTlsUlp();
   int64_t off = 0;
   buf_[off++] = Protocol::ENCRYPTION_CMD;
   Protocol::encodeEncryptionSettings(
       buf_, off, off + Protocol::kEncryptionCmdLen, encryptionParams_.getType(),
-      iv, writeTagInterval_);
+      iv, useKtls ? Protocol::kKtlsTagInterval : writeTagInterval_);
   int written = writeInternal(buf_, off, timeoutMs, false);
   if (written != off) {
     WLOG(ERROR) << "Failed to write encryption settings " << written << " "
                 << port_;
     return;
   }
+  if (useKtls) {
+    // the kernel encrypts and tags from now on
+    resetEncryptor();
+    if (!enableKtls(true, iv)) {
+      writeErrorCode_ = ENCRYPTION_ERROR;
+      return;
+    }
+  }
   encryptionSettingsWritten_ = true;
 }
 
@@ -131,6 +186,9 @@ int WdtSocket::readInternal(char *buf, int nbyte, int timeoutMs, bool tryFull) {
   if (numRead < 0) {
     if (errno == EAGAIN || errno == EINTR) {
       readErrorCode_ = WDT_TIMEOUT;
+    } else if (ktlsRx_ && errno == EBADMSG) {
+      WLOG(ERROR) << "Kernel tls record failed authentication " << port_;
+      readErrorCode_ = ENCRYPTION_ERROR;
     } else {
       readErrorCode_ = SOCKET_READ_ERROR;
     }
@@ -145,9 +203,15 @@ int WdtSocket::writeInternal(const char *buf, int nbyte, int timeoutMs,
                              bool retry) {
   int count = 0;
   int written = 0;
+  // tls sockets do not take MSG_ZEROCOPY
+  const bool zeroCopy = (nbyte >= kMinZeroCopyWriteSize) && !ktlsTx_ &&
+                        transport_->isDataOnFd() && setupZeroCopy();
   while (written < nbyte) {
-    int w = writeWithAbortCheck(buf + written, nbyte - written, timeoutMs,
-                                /* always try to write everything */ true);
+    int w = zeroCopy
+                ? zeroCopyWriteWithAbortCheck(buf + written, nbyte - written,
+                                              timeoutMs)
+                : writeWithAbortCheck(buf + written, nbyte - written, timeoutMs,
+                                      /* always try to write everything */ true);
     if (w <= 0) {
       break;
     }
@@ -200,7 +264,9 @@ bool WdtSocket::checkAndChangeDecryptionIv(const std::string &tag) {
 
 std::string WdtSocket::readEncryptionTag() {
   std::string tag;
-  const int toRead = encryptionTypeToTagLen(encryptionParams_.getType());
+  // the kernel verified every tls record already
+  const int toRead =
+      ktlsRx_ ? 0 : encryptionTypeToTagLen(encryptionParams_.getType());
   tag.resize(toRead);
   int read = readInternal(&(tag.front()), tag.size(),
                           threadCtx_.getOptions().read_timeout_millis, true);
@@ -242,8 +308,47 @@ int WdtSocket::readAndDecrypt(char *buf, int nbyte, int timeoutMs,
   if (numRead <= 0) {
     return numRead;
   }
+  CryptoWorker *cryptoWorker = getCryptoWorker(nbyte);
+  if (cryptoWorker != nullptr) {
+    cryptoWorker->begin([this](char *data, int len) {
+      return decryptor_->decrypt(data, len, data);
+    });
+    cryptoWorker->submit(buf, numRead);
+    // read whatever else is already there while the worker decrypts
+    while (numRead < nbyte) {
+      int64_t ret;
+      {
+        PerfStatCollector statCollector(threadCtx_, PerfStatReport::SOCKET_READ,
+                                        SOCKET_READ);
+        if (transport_->isDataOnFd()) {
+          ret = ::recv(fd_, buf + numRead, nbyte - numRead, MSG_DONTWAIT);
+        } else {
+          ret = transport_->isReadable()
+                    ? transport_->read(buf + numRead, nbyte - numRead, 0)
+                    : -1;
+        }
+      }
+      if (ret <= 0) {
+        // errors and end of stream are seen by the next read
+        break;
+      }
+      cryptoWorker->submit(buf + numRead, ret);
+      numRead += ret;
+    }
+    if (!cryptoWorker->end()) {
+      readErrorCode_ = ENCRYPTION_ERROR;
+      return -1;
+    }
+    return numRead;
+  }
   // have to decrypt data
-  if (!decryptor_->decrypt(buf, numRead, buf)) {
+  bool decrypted;
+  {
+    LatencyRecorder latencyRecorder(threadCtx_.getOptions(), ENCRYPT,
+                                    &threadCtx_.getTimeBreakdown());
+    decrypted = decryptor_->decrypt(buf, numRead, buf);
+  }
+  if (!decrypted) {
     readErrorCode_ = ENCRYPTION_ERROR;
     return -1;
   }
@@ -288,6 +393,7 @@ int WdtSocket::readAndDecryptWithTag(char *buf, int nbyte, int timeoutMs,
       return -1;
     }
     // tag verification successful, inform higher layer
+    verifiedRead_ = totalRead_;
     if (tagVerificationSuccessCallback_ != nullptr) {
       tagVerificationSuccessCallback_();
     }
@@ -334,9 +440,9 @@ int WdtSocket::readWithTimeout(char *buf, int nbyte, int timeoutMs,
     return -1;
   }
 
-  const bool encrypt = encryptionParams_.isSet();
+  const bool encrypt = encryptionParams_.isSet() && !ktlsRx_;
   if (!encrypt) {
-    // handle the non-encryption case
+    // handle the non-encryption case, or the kernel decrypting
     int ret = readInternal(buf + numRead, nbyte - numRead, timeoutMs, tryFull);
     if (ret >= 0) {
       return numRead + ret;
@@ -375,13 +481,95 @@ int WdtSocket::read(char *buf, int nbyte, bool tryFull) {
                          threadCtx_.getOptions().read_timeout_millis, tryFull);
 }
 
+int WdtSocket::readv(char *buf, int nbyte, char *extraBuf, int extraNbyte) {
+  if (extraNbyte <= 0 || (encryptionParams_.isSet() && !ktlsRx_) ||
+      !transport_->isDataOnFd()) {
+    return read(buf, nbyte, false);
+  }
+  WDT_CHECK_GT(nbyte, 0);
+  if (readErrorCode_ != OK && readErrorCode_ != WDT_TIMEOUT) {
+    WLOG(ERROR) << "Socket read failed before, not trying to read again "
+                << port_;
+    return -1;
+  }
+  struct iovec iov[2];
+  iov[0].iov_base = buf;
+  iov[0].iov_len = nbyte;
+  iov[1].iov_base = extraBuf;
+  iov[1].iov_len = extraNbyte;
+  // without tryFull, readv is only retried while nothing was read
+  auto readvChunk = [&iov](int sockFd, int64_t /* doneBytes */,
+                           int64_t /* count */) {
+    return (int64_t)::readv(sockFd, iov, 2);
+  };
+  int numRead;
+  {
+    PerfStatCollector statCollector(threadCtx_, PerfStatReport::SOCKET_READ,
+                                    SOCKET_READ);
+    numRead = ioWithAbortCheck(readvChunk, (int64_t)0, nbyte + extraNbyte,
+                               threadCtx_.getOptions().read_timeout_millis,
+                               false);
+  }
+  if (numRead == 0) {
+    readErrorCode_ = SOCKET_READ_ERROR;
+    return 0;
+  }
+  if (numRead < 0) {
+    if (errno == EAGAIN || errno == EINTR) {
+      readErrorCode_ = WDT_TIMEOUT;
+    } else {
+      readErrorCode_ = SOCKET_READ_ERROR;
+    }
+    return -1;
+  }
+  readErrorCode_ = OK;
+  return numRead;
+}
+
 int WdtSocket::encryptAndWrite(char *buf, int nbyte, int timeoutMs,
                                bool retry) {
   WDT_CHECK_GT(nbyte, 0);
   const bool encrypt = encryptionParams_.isSet();
   WDT_CHECK(encrypt);
 
-  if (!encryptor_->encrypt(buf, nbyte, buf)) {
+  CryptoWorker *cryptoWorker = getCryptoWorker(nbyte);
+  if (cryptoWorker != nullptr) {
+    cryptoWorker->begin([this](char *data, int len) {
+      LatencyRecorder latencyRecorder(threadCtx_.getOptions(), ENCRYPT);
+      return encryptor_->encrypt(data, len, data);
+    });
+    cryptoWorker->submit(buf, nbyte);
+    // write each chunk as soon as it is encrypted
+    const int chunkSize = cryptoWorker->getChunkSize();
+    int written = 0;
+    while (written < nbyte) {
+      const int ready =
+          cryptoWorker->waitFor(std::min(nbyte, written + chunkSize));
+      if (ready < 0) {
+        writeErrorCode_ = ENCRYPTION_ERROR;
+        break;
+      }
+      const int toWrite = ready - written;
+      if (writeInternal(buf + written, toWrite, timeoutMs, retry) != toWrite) {
+        WLOG(ERROR) << "Socket write failure " << written << " " << nbyte;
+        writeErrorCode_ = SOCKET_WRITE_ERROR;
+        break;
+      }
+      written = ready;
+    }
+    if (!cryptoWorker->end()) {
+      writeErrorCode_ = ENCRYPTION_ERROR;
+      return -1;
+    }
+    return (written == nbyte ? nbyte : -1);
+  }
+  bool encrypted;
+  {
+    LatencyRecorder latencyRecorder(threadCtx_.getOptions(), ENCRYPT,
+                                    &threadCtx_.getTimeBreakdown());
+    encrypted = encryptor_->encrypt(buf, nbyte, buf);
+  }
+  if (!encrypted) {
     writeErrorCode_ = ENCRYPTION_ERROR;
     return -1;
   }
@@ -496,8 +684,8 @@ int WdtSocket::write(char *buf, int nbyte, bool retry) {
   }
 
   const int timeoutMs = threadCtx_.getOptions().write_timeout_millis;
-  const bool encrypt = encryptionParams_.isSet();
-  // handle no-encryption case
+  const bool encrypt = encryptionParams_.isSet() && !ktlsTx_;
+  // handle no-encryption case, or the kernel encrypting
   if (!encrypt) {
     return writeInternal(buf, nbyte, timeoutMs, retry);
   }
@@ -521,16 +709,350 @@ int WdtSocket::write(char *buf, int nbyte, bool retry) {
   return written;
 }
 
+int WdtSocket::writev(const struct iovec *iov, int iovcnt, bool retry) {
+  WDT_CHECK_LE(iovcnt, kMaxWritevBuffers);
+  int nbyte = 0;
+  for (int i = 0; i < iovcnt; i++) {
+    nbyte += iov[i].iov_len;
+  }
+  WDT_CHECK_GT(nbyte, 0);
+  if (writeErrorCode_ != OK) {
+    WLOG(ERROR) << "Socket write failed before, not trying to write again "
+                << port_;
+    return -1;
+  }
+  writeEncryptionSettingsOnce();
+  if (writeErrorCode_ != OK) {
+    return -1;
+  }
+  const bool encrypt = encryptionParams_.isSet() && !ktlsTx_;
+  if (!transport_->isDataOnFd() ||
+      (encrypt && ((writeTagInterval_ > 0 &&
+                    computeNextTagOffset(totalWritten_, writeTagInterval_) <
+                        nbyte) ||
+                   getCryptoWorker(nbyte) != nullptr))) {
+    // the tag goes in the middle, the encryption is pipelined or the data
+    // does not go over the fd, let write() handle each buffer
+    int written = 0;
+    for (int i = 0; i < iovcnt; i++) {
+      const int len = iov[i].iov_len;
+      if (len == 0) {
+        continue;
+      }
+      if (write((char *)iov[i].iov_base, len, retry) != len) {
+        return -1;
+      }
+      written += len;
+    }
+    return written;
+  }
+  if (encrypt) {
+    LatencyRecorder latencyRecorder(threadCtx_.getOptions(), ENCRYPT,
+                                    &threadCtx_.getTimeBreakdown());
+    for (int i = 0; i < iovcnt; i++) {
+      char *data = (char *)iov[i].iov_base;
+      if (iov[i].iov_len > 0 &&
+          !encryptor_->encrypt(data, iov[i].iov_len, data)) {
+        writeErrorCode_ = ENCRYPTION_ERROR;
+        return -1;
+      }
+    }
+  }
+  // doneBytes is the offset in the concatenation of the buffers
+  auto writevChunk = [iov, iovcnt](int sockFd, int64_t doneBytes,
+                                   int64_t /* count */) {
+    struct iovec remaining[kMaxWritevBuffers];
+    int numRemaining = 0;
+    for (int i = 0; i < iovcnt; i++) {
+      const int64_t len = iov[i].iov_len;
+      if (doneBytes >= len) {
+        doneBytes -= len;
+        continue;
+      }
+      remaining[numRemaining].iov_base = (char *)iov[i].iov_base + doneBytes;
+      remaining[numRemaining].iov_len = len - doneBytes;
+      numRemaining++;
+      doneBytes = 0;
+    }
+    return (int64_t)::writev(sockFd, remaining, numRemaining);
+  };
+  const int timeoutMs = threadCtx_.getOptions().write_timeout_millis;
+  int written = 0;
+  while (written < nbyte) {
+    int64_t w;
+    {
+      PerfStatCollector statCollector(threadCtx_, PerfStatReport::SOCKET_WRITE,
+                                      SOCKET_WRITE);
+      w = ioWithAbortCheck(writevChunk, (int64_t)written, nbyte - written,
+                           timeoutMs, /* always try to write everything */ true);
+    }
+    if (w <= 0) {
+      break;
+    }
+    written += w;
+    if (!retry) {
+      break;
+    }
+  }
+  if (written != nbyte) {
+    WLOG(ERROR) << "Socket writev failure " << written << " " << nbyte;
+    writeErrorCode_ = SOCKET_WRITE_ERROR;
+    return -1;
+  }
+  if (encrypt && writeTagInterval_ > 0) {
+    totalWritten_ += written;
+  }
+  return written;
+}
+
+bool WdtSocket::setupZeroCopy() {
+  if (!threadCtx_.getOptions().zero_copy_writes) {
+    return false;
+  }
+  if (zeroCopyFd_ != fd_) {
+    zeroCopyFd_ = fd_;
+    zeroCopyEnabled_ = false;
+    resetZeroCopySends();
+#ifdef WDT_ZEROCOPY_SUPPORTED
+    int one = 1;
+    if (::setsockopt(fd_, SOL_SOCKET, SO_ZEROCOPY, &one, sizeof(one)) != 0) {
+      WPLOG(WARNING) << "Unable to set SO_ZEROCOPY on fd " << fd_ << " port "
+                     << port_ << ", writes will be copied";
+    } else {
+      zeroCopyEnabled_ = true;
+    }
+#else
+    WLOG(WARNING) << "MSG_ZEROCOPY not supported by this build, writes will "
+                  << "be copied " << port_;
+#endif
+  }
+  if (!zeroCopyEnabled_) {
+    numZeroCopyFallbacks_++;
+  }
+  return zeroCopyEnabled_;
+}
+
+void WdtSocket::resetZeroCopySends() {
+  zeroCopyMarkBase_ += zeroCopySendsIssued_;
+  zeroCopySendsIssued_ = 0;
+  zeroCopySendsCompleted_ = 0;
+  zeroCopyCompletedRanges_.clear();
+}
+
+bool WdtSocket::readZeroCopyCompletions() {
+#ifdef WDT_ZEROCOPY_SUPPORTED
+  while (true) {
+    char control[128];
+    struct msghdr msg;
+    memset(&msg, 0, sizeof(msg));
+    msg.msg_control = control;
+    msg.msg_controllen = sizeof(control);
+    if (::recvmsg(fd_, &msg, MSG_ERRQUEUE | MSG_DONTWAIT) < 0) {
+      if (errno == EINTR) {
+        continue;
+      }
+      if (errno == EAGAIN || errno == EWOULDBLOCK) {
+        return true;
+      }
+      WPLOG(ERROR) << "Unable to read zero copy completions " << fd_ << " "
+                   << port_;
+      return false;
+    }
+    for (struct cmsghdr *cmsg = CMSG_FIRSTHDR(&msg); cmsg != nullptr;
+         cmsg = CMSG_NXTHDR(&msg, cmsg)) {
+      const bool isRecvErr =
+          (cmsg->cmsg_level == SOL_IP && cmsg->cmsg_type == IP_RECVERR) ||
+          (cmsg->cmsg_level == SOL_IPV6 && cmsg->cmsg_type == IPV6_RECVERR);
+      if (!isRecvErr) {
+        continue;
+      }
+      const struct sock_extended_err *err =
+          reinterpret_cast<const struct sock_extended_err *>(CMSG_DATA(cmsg));
+      if (err->ee_errno != 0 || err->ee_origin != SO_EE_ORIGIN_ZEROCOPY) {
+        WLOG(WARNING) << "Unexpected socket error queue entry " << fd_
+                      << " errno " << err->ee_errno << " origin "
+                      << (int)err->ee_origin;
+        continue;
+      }
+      // completions of consecutive sends are coalesced in [ee_info, ee_data]
+      const uint32_t numSends = err->ee_data - err->ee_info + 1;
+      zeroCopyCompletedRanges_[err->ee_info] = err->ee_data;
+      while (!zeroCopyCompletedRanges_.empty() &&
+             zeroCopyCompletedRanges_.begin()->first <=
+                 zeroCopySendsCompleted_) {
+        auto it = zeroCopyCompletedRanges_.begin();
+        zeroCopySendsCompleted_ =
+            std::max(zeroCopySendsCompleted_, it->second + 1);
+        zeroCopyCompletedRanges_.erase(it);
+      }
+      if (err->ee_code & SO_EE_CODE_ZEROCOPY_COPIED) {
+        numZeroCopyCopiedWrites_ += numSends;
+      } else {
+        numZeroCopyWrites_ += numSends;
+      }
+    }
+  }
+#else
+  return true;
+#endif
+}
+
+bool WdtSocket::isZeroCopyWriteComplete(int64_t mark) {
+  if (mark <= zeroCopyMarkBase_ + zeroCopySendsCompleted_) {
+    return true;
+  }
+  readZeroCopyCompletions();
+  return mark <= zeroCopyMarkBase_ + zeroCopySendsCompleted_;
+}
+
+bool WdtSocket::waitForZeroCopyCompletions(int64_t mark) {
+  auto isComplete = [&] {
+    return mark <= zeroCopyMarkBase_ + zeroCopySendsCompleted_;
+  };
+  if (isComplete()) {
+    return true;
+  }
+  const int timeoutMs = threadCtx_.getOptions().write_timeout_millis;
+  int pollTimeoutMs = getEffectiveTimeout(timeoutMs);
+  if (pollTimeoutMs <= 0) {
+    pollTimeoutMs = -1;
+  }
+  PerfStatCollector statCollector(threadCtx_, PerfStatReport::SOCKET_WRITE,
+                                  SOCKET_WRITE);
+  auto startTime = Clock::now();
+  while (readZeroCopyCompletions()) {
+    if (isComplete()) {
+      return true;
+    }
+    if (threadCtx_.getAbortChecker()->shouldAbort()) {
+      WLOG(ERROR) << "transfer aborted while waiting for zero copy "
+                  << "completions " << fd_ << " " << port_;
+      break;
+    }
+    if (timeoutMs > 0 && durationMillis(Clock::now() - startTime) >= timeoutMs) {
+      WLOG(ERROR) << "Timed out waiting for zero copy completions " << fd_
+                  << " " << port_ << " pending "
+                  << (mark - zeroCopyMarkBase_ - zeroCopySendsCompleted_);
+      break;
+    }
+    // completions are signaled as POLLERR, which does not need to be asked
+    struct pollfd pfd;
+    pfd.fd = fd_;
+    pfd.events = 0;
+    pfd.revents = 0;
+    const uint32_t completedBefore = zeroCopySendsCompleted_;
+    if (::poll(&pfd, 1, pollTimeoutMs) > 0 && !(pfd.revents & POLLERR) &&
+        (pfd.revents & (POLLHUP | POLLNVAL))) {
+      readZeroCopyCompletions();
+      if (zeroCopySendsCompleted_ == completedBefore) {
+        WLOG(ERROR) << "Connection closed with zero copy writes pending "
+                    << fd_ << " " << port_;
+        break;
+      }
+    }
+  }
+  writeErrorCode_ = SOCKET_WRITE_ERROR;
+  return false;
+}
+
+int WdtSocket::sendFile(int fileFd, int64_t fileOffset, int nbyte) {
+  WDT_CHECK_GT(nbyte, 0);
+  WDT_CHECK(!encryptionParams_.isSet() || ktlsTx_)
+      << "sendfile on user space encrypted socket";
+  WDT_CHECK(transport_->isDataOnFd())
+      << "sendfile with the " << transport_->getName() << " transport";
+  if (writeErrorCode_ != OK) {
+    WLOG(ERROR) << "Socket write failed before, not trying to write again "
+                << port_;
+    return -1;
+  }
+  const int timeoutMs = threadCtx_.getOptions().write_timeout_millis;
+  const int64_t written =
+      sendFileWithAbortCheck(fileFd, fileOffset, nbyte, timeoutMs);
+  if (written != nbyte) {
+    WLOG(ERROR) << "Socket sendfile failure " << written << " " << nbyte
+                << " file offset " << fileOffset;
+    writeErrorCode_ = SOCKET_WRITE_ERROR;
+    return -1;
+  }
+  return written;
+}
+
+bool WdtSocket::isSendFileSupported() {
+#ifdef __linux__
+  return true;
+#else
+  return false;
+#endif
+}
+
 int64_t WdtSocket::readWithAbortCheck(char *buf, int64_t nbyte, int timeoutMs,
                                       bool tryFull) {
-  PerfStatCollector statCollector(threadCtx_, PerfStatReport::SOCKET_READ);
-  return ioWithAbortCheck(::read, buf, nbyte, timeoutMs, tryFull);
+  PerfStatCollector statCollector(threadCtx_, PerfStatReport::SOCKET_READ,
+                                  SOCKET_READ);
+  // waits at most as long as a socket read
+  const int waitMs = getEffectiveTimeout(timeoutMs);
+  auto transportRead = [this, waitMs](int /* sockFd */, char *readBuf,
+                                      int64_t count) {
+    return transport_->read(readBuf, count, waitMs);
+  };
+  return ioWithAbortCheck(transportRead, buf, nbyte, timeoutMs, tryFull);
 }
 
 int64_t WdtSocket::writeWithAbortCheck(const char *buf, int64_t nbyte,
                                        int timeoutMs, bool tryFull) {
-  PerfStatCollector statCollector(threadCtx_, PerfStatReport::SOCKET_WRITE);
-  return ioWithAbortCheck(::write, buf, nbyte, timeoutMs, tryFull);
+  PerfStatCollector statCollector(threadCtx_, PerfStatReport::SOCKET_WRITE,
+                                  SOCKET_WRITE);
+  const int waitMs = getEffectiveTimeout(timeoutMs);
+  auto transportWrite = [this, waitMs](int /* sockFd */, const char *writeBuf,
+                                       int64_t count) {
+    return transport_->write(writeBuf, count, waitMs);
+  };
+  return ioWithAbortCheck(transportWrite, buf, nbyte, timeoutMs, tryFull);
+}
+
+int64_t WdtSocket::zeroCopyWriteWithAbortCheck(const char *buf, int64_t nbyte,
+                                               int timeoutMs) {
+  PerfStatCollector statCollector(threadCtx_, PerfStatReport::SOCKET_WRITE,
+                                  SOCKET_WRITE);
+#ifdef WDT_ZEROCOPY_SUPPORTED
+  auto zeroCopySend = [this](int sockFd, const char *sendBuf, int64_t count) {
+    int64_t ret = ::send(sockFd, sendBuf, count, MSG_ZEROCOPY);
+    if (ret > 0) {
+      // the kernel numbers the completions of each successful send
+      zeroCopySendsIssued_++;
+    } else if (ret < 0 && errno == ENOBUFS) {
+      // not enough optmem to pin the pages, copy this one
+      numZeroCopyFallbacks_++;
+      ret = ::write(sockFd, sendBuf, count);
+    }
+    return ret;
+  };
+  return ioWithAbortCheck(zeroCopySend, buf, nbyte, timeoutMs,
+                          /* always try to write everything */ true);
+#else
+  return ioWithAbortCheck(::write, buf, nbyte, timeoutMs, true);
+#endif
+}
+
+int64_t WdtSocket::sendFileWithAbortCheck(int fileFd, int64_t fileOffset,
+                                          int64_t nbyte, int timeoutMs) {
+  // also accounts for the page cache reads done by the kernel
+  PerfStatCollector statCollector(threadCtx_, PerfStatReport::SOCKET_WRITE,
+                                  SOCKET_WRITE);
+#ifdef __linux__
+  auto sendFileChunk = [fileFd](int sockFd, int64_t offset, int64_t count) {
+    off_t fileOff = offset;
+    return (int64_t)::sendfile(sockFd, fileFd, &fileOff, count);
+  };
+  return ioWithAbortCheck(sendFileChunk, fileOffset, nbyte, timeoutMs,
+                          /* always try to write everything */ true);
+#else
+  WLOG(ERROR) << "sendfile not supported on this platform " << fileFd << " "
+              << fileOffset << " " << nbyte << " " << timeoutMs;
+  errno = ENOSYS;
+  return -1;
+#endif
 }
 
 template <typename F, typename T>
@@ -589,7 +1111,7 @@ int64_t WdtSocket::ioWithAbortCheck(F readOrWrite, T tbuf, int64_t numBytes,
 
 ErrorCode WdtSocket::shutdownWrites() {
   ErrorCode code = finalizeWrites(true);
-  if (::shutdown(fd_, SHUT_WR) < 0) {
+  if (transport_->shutdownWrites() < 0) {
     if (code == OK) {
       WPLOG(WARNING) << "Socket shutdown failed for fd " << fd_;
       code = ERROR;
@@ -663,6 +1185,28 @@ ErrorCode WdtSocket::closeConnectionInternal(bool doTagIOs) {
   if (!readsFinalized_) {
     errorCode = getMoreInterestingError(errorCode, finalizeReads(doTagIOs));
   }
+  if (zeroCopySendsCompleted_ != zeroCopySendsIssued_ &&
+      (!doTagIOs || !waitForZeroCopyCompletions())) {
+    // the buffers may be modified once closed, reset the connection instead
+    // of letting the kernel send whatever they contain by then
+    WLOG(WARNING) << "Resetting connection with pending zero copy writes "
+                  << fd_ << " " << port_;
+    struct linger noLinger;
+    noLinger.l_onoff = 1;
+    noLinger.l_linger = 0;
+    ::setsockopt(fd_, SOL_SOCKET, SO_LINGER, &noLinger, sizeof(noLinger));
+  }
+  if (zeroCopyFd_ >= 0) {
+    WLOG(INFO) << "Zero copy writes for port " << port_ << ": "
+               << numZeroCopyWrites_ << " zero copy, "
+               << numZeroCopyCopiedWrites_ << " copied by the kernel, "
+               << numZeroCopyFallbacks_ << " not zero copy";
+  }
+  zeroCopyFd_ = -1;
+  zeroCopyEnabled_ = false;
+  resetZeroCopySends();
+  // the transport may still use the fd
+  transport_.reset();
   if (::close(fd_) != 0) {
     WPLOG(ERROR) << "Failed to close socket " << fd_ << " " << port_;
     errorCode = getMoreInterestingError(ERROR, errorCode);
@@ -673,9 +1217,13 @@ ErrorCode WdtSocket::closeConnectionInternal(bool doTagIOs) {
   writeErrorCode_ = OK;
   encryptionSettingsRead_ = false;
   encryptionSettingsWritten_ = false;
+  tlsUlpSet_ = false;
+  ktlsTx_ = false;
+  ktlsRx_ = false;
   writesFinalized_ = false;
   readsFinalized_ = false;
   totalRead_ = 0;
+  verifiedRead_ = 0;
   totalWritten_ = 0;
   resetEncryptor();
   resetDecryptor();
@@ -687,6 +1235,34 @@ int WdtSocket::getFd() const {
   return fd_;
 }
 
+int WdtSocket::getPollFd() const {
+  return transport_ ? transport_->getPollFd() : fd_;
+}
+
+ErrorCode WdtSocket::setupTransport(bool isWriter) {
+  const WdtOptions &options = threadCtx_.getOptions();
+  // also run without rdma_transport, without waiting then, to answer a peer
+  // asking for rdma
+  bool useRdma = false;
+  ErrorCode code = RdmaTransport::negotiate(threadCtx_, fd_, isWriter, useRdma);
+  if (code != OK) {
+    return code;
+  }
+  if (useRdma) {
+    code = RdmaTransport::connect(threadCtx_, fd_, isWriter, transport_);
+  } else if (options.shm_transport && !options.rdma_transport) {
+    code = ShmTransport::connect(threadCtx_, fd_, isWriter, transport_);
+  } else {
+    transport_ = std::make_unique<TcpTransport>(fd_);
+    return OK;
+  }
+  if (code == OK) {
+    WVLOG(1) << "Using the " << transport_->getName() << " transport for "
+             << port_ << " " << fd_;
+  }
+  return code;
+}
+
 int WdtSocket::getPort() const {
   return port_;
 }
@@ -772,6 +1348,84 @@ void WdtSocket::setDscp(int dscp) {
   }
 }
 
+bool WdtSocket::setupTlsUlp() {
+  if (tlsUlpSet_) {
+    return true;
+  }
+#ifdef WDT_KTLS_SUPPORTED
+  if (::setsockopt(fd_, IPPROTO_TCP, TCP_ULP, "tls", sizeof("tls")) != 0) {
+    WPLOG(WARNING) << "Kernel tls not available for " << port_ << " " << fd_
+                   << ", is the tls module loaded?";
+    return false;
+  }
+  tlsUlpSet_ = true;
+  return true;
+#else
+  WLOG(WARNING) << "Kernel tls not supported by this build " << port_;
+  return false;
+#endif
+}
+
+bool WdtSocket::enableKtls(bool tx, const std::string &iv) {
+#ifdef WDT_KTLS_SUPPORTED
+  struct tls12_crypto_info_aes_gcm_128 info;
+  memset(&info, 0, sizeof(info));
+  const std::string &key = encryptionParams_.getSecret();
+  if (key.size() != sizeof(info.key) ||
+      iv.size() < sizeof(info.salt) + sizeof(info.iv)) {
+    WLOG(ERROR) << "Unexpected key/iv sizes for kernel tls " << key.size()
+                << " " << iv.size();
+    return false;
+  }
+  info.info.version = TLS_1_2_VERSION;
+  info.info.cipher_type = TLS_CIPHER_AES_GCM_128;
+  memcpy(info.salt, iv.data(), sizeof(info.salt));
+  memcpy(info.iv, iv.data() + sizeof(info.salt), sizeof(info.iv));
+  memcpy(info.key, key.data(), sizeof(info.key));
+  const int ret =
+      ::setsockopt(fd_, SOL_TLS, tx ? TLS_TX : TLS_RX, &info, sizeof(info));
+  OPENSSL_cleanse(&info, sizeof(info));
+  if (ret != 0) {
+    WPLOG(ERROR) << "Unable to set kernel tls " << (tx ? "tx" : "rx")
+                 << " key for " << port_ << " " << fd_;
+    return false;
+  }
+  (tx ? ktlsTx_ : ktlsRx_) = true;
+  WLOG(INFO) << "Kernel tls " << (tx ? "encrypts writes" : "decrypts reads")
+             << " for " << port_;
+  return true;
+#else
+  return false;
+#endif
+}
+
+CryptoWorker *WdtSocket::getCryptoWorker(int nbyte) {
+  CryptoWorker *cryptoWorker = threadCtx_.getCryptoWorker();
+  if (cryptoWorker == nullptr || nbyte < 2 * cryptoWorker->getChunkSize()) {
+    // not worth a hand off
+    return nullptr;
+  }
+  return cryptoWorker;
+}
+
+void WdtSocket::setCongestionControl() {
+  const std::string &algo = threadCtx_.getOptions().tcp_congestion_control;
+  if (algo.empty()) {
+    return;
+  }
+#ifdef TCP_CONGESTION
+  if (setsockopt(fd_, IPPROTO_TCP, TCP_CONGESTION, algo.c_str(),
+                 algo.size()) != 0) {
+    WPLOG(ERROR) << "Unable to set congestion control " << algo << " for "
+                 << port_ << " " << fd_;
+    return;
+  }
+  WVLOG(1) << "Congestion control set to " << algo << " port " << port_;
+#else
+  WLOG(WARNING) << "Wdt has no way to set congestion control " << algo;
+#endif
+}
+
 /* static */
 bool WdtSocket::getNameInfo(const struct sockaddr *sa, socklen_t salen,
                             std::string &host, std::string &port) {
@@ -809,7 +1463,14 @@ void WdtSocket::resetDecryptor() {
   decryptor_ = std::make_unique<AESDecryptor>();
 }
 
+bool WdtSocket::isReadable() const {
+  return transport_ != nullptr && transport_->isReadable();
+}
+
 int WdtSocket::getUnackedBytes() const {
+  if (transport_ != nullptr && transport_->getUnackedBytes() >= 0) {
+    return transport_->getUnackedBytes();
+  }
 #ifdef WDT_HAS_SOCKIOS_H
   int numUnackedBytes;
   int ret;
@@ -827,6 +1488,172 @@ int WdtSocket::getUnackedBytes() const {
   return -1;
 #endif
 }
+int WdtSocket::getRttMicros() const {
+#ifdef TCP_INFO
+  struct tcp_info info;
+  socklen_t len = sizeof(info);
+  if (::getsockopt(fd_, IPPROTO_TCP, TCP_INFO, &info, &len) != 0) {
+    WPLOG(ERROR) << "Failed to get tcp info for socket " << fd_;
+    return -1;
+  }
+  return info.tcpi_rtt;
+#else
+  return -1;
+#endif
+}
+
+#ifdef TCP_INFO
+namespace {
+/// tcp_info of the kernel, of which the libc one is only a prefix
+struct KernelTcpInfo {
+  struct tcp_info base;
+  uint64_t tcpi_pacing_rate;
+  uint64_t tcpi_max_pacing_rate;
+  uint64_t tcpi_bytes_acked;
+  uint64_t tcpi_bytes_received;
+  uint32_t tcpi_segs_out;
+  uint32_t tcpi_segs_in;
+  uint32_t tcpi_notsent_bytes;
+  uint32_t tcpi_min_rtt;
+  uint32_t tcpi_data_segs_in;
+  uint32_t tcpi_data_segs_out;
+  uint64_t tcpi_delivery_rate;
+};
+
+/// @return   whether the kernel filled the given field
+#define WDT_TCP_INFO_HAS(len, field)  \
+  ((len) >= offsetof(KernelTcpInfo, field) + sizeof(KernelTcpInfo::field))
+}
+#endif
+
+bool WdtSocket::getTcpInfo(TcpInfoSample &sample) const {
+#ifdef TCP_INFO
+  KernelTcpInfo info;
+  memset(&info, 0, sizeof(info));
+  socklen_t len = sizeof(info);
+  if (::getsockopt(fd_, IPPROTO_TCP, TCP_INFO, &info, &len) != 0) {
+    WPLOG(ERROR) << "Failed to get tcp info for socket " << fd_;
+    return false;
+  }
+  sample = TcpInfoSample();
+  sample.numConnections = 1;
+  sample.rttMicros = info.base.tcpi_rtt;
+  sample.cwndBytes = (int64_t)info.base.tcpi_snd_cwnd * info.base.tcpi_snd_mss;
+  sample.totalRetransmits = info.base.tcpi_total_retrans;
+  // ~0 when the connection is not paced
+  if (WDT_TCP_INFO_HAS(len, tcpi_pacing_rate) &&
+      info.tcpi_pacing_rate != ~0ULL) {
+    sample.pacingRateBytesPerSec = info.tcpi_pacing_rate;
+  }
+  if (WDT_TCP_INFO_HAS(len, tcpi_delivery_rate)) {
+    sample.deliveryRateBytesPerSec = info.tcpi_delivery_rate;
+  }
+  return true;
+#else
+  return false;
+#endif
+}
+
+void WdtSocket::recordBlockedWrite() {
+#ifdef TCP_INFO
+  struct tcp_info info;
+  socklen_t len = sizeof(info);
+  if (::getsockopt(fd_, IPPROTO_TCP, TCP_INFO, &info, &len) != 0) {
+    WPLOG(ERROR) << "Failed to get tcp info for socket " << fd_;
+    return;
+  }
+  // sent and not acked as well as not sent yet
+  const int queuedBytes = getUnackedBytes();
+  if (queuedBytes < 0) {
+    return;
+  }
+  const int64_t inFlightBytes = (int64_t)info.tcpi_unacked * info.tcpi_snd_mss;
+  const bool cwndLimited = (info.tcpi_unacked >= info.tcpi_snd_cwnd);
+  // room in the congestion window but data not sent: the receive window of
+  // the peer is full
+  const bool peerLimited = (!cwndLimited && queuedBytes > inFlightBytes);
+  threadCtx_.getTimeBreakdown().addBlockedWrite(cwndLimited, peerLimited);
+#endif
+}
+
+bool WdtSocket::setCork(bool cork) {
+#ifdef TCP_CORK
+  const int value = cork ? 1 : 0;
+  if (::setsockopt(fd_, IPPROTO_TCP, TCP_CORK, &value, sizeof(value)) != 0) {
+    WPLOG(WARNING) << "Unable to " << (cork ? "cork" : "uncork") << " port "
+                   << port_ << " " << fd_;
+    return false;
+  }
+  return true;
+#else
+  return false;
+#endif
+}
+
+/// @return   the number in the given proc file, -1 if it can not be read
+static int64_t readProcNumber(const char *path) {
+  std::ifstream file(path);
+  int64_t value = -1;
+  if (!(file >> value)) {
+    return -1;
+  }
+  return value;
+}
+
+void WdtSocket::autoSizeBuffers() {
+  const WdtOptions &options = threadCtx_.getOptions();
+  if (!options.auto_buffer_size) {
+    return;
+  }
+  const int rttMicros = getRttMicros();
+  if (rttMicros <= 0) {
+    WLOG(WARNING) << "No rtt available, not sizing buffers " << port_;
+    return;
+  }
+  const double bdp = options.auto_buffer_target_mbytes_per_sec * kMbToB *
+                     rttMicros / kMicroToSec;
+  const int64_t maxSize = options.auto_buffer_max_size;
+  const int bufSize = (int)std::min<int64_t>(maxSize > 0 ? maxSize : bdp, bdp);
+  // setting a size disables the kernel autotuning, which may grow the buffers
+  // up to tcp_wmem/tcp_rmem, while a set size is clamped to wmem_max/rmem_max
+  static const int64_t wmemMax = readProcNumber("/proc/sys/net/core/wmem_max");
+  static const int64_t rmemMax = readProcNumber("/proc/sys/net/core/rmem_max");
+  struct BufferOpt {
+    int opt;
+    int configured;
+    int current;
+    int64_t max;
+    const char *maxName;
+  };
+  const BufferOpt bufferOpts[] = {
+      {SO_SNDBUF, options.send_buffer_size, getSendBufferSize(), wmemMax,
+       "net.core.wmem_max"},
+      {SO_RCVBUF, options.receive_buffer_size, getReceiveBufferSize(),
+       rmemMax, "net.core.rmem_max"}};
+  for (const auto &bufferOpt : bufferOpts) {
+    // the kernel reports twice the size set, to account for its overhead
+    if (bufferOpt.configured > 0 || bufferOpt.current / 2 >= bufSize) {
+      continue;
+    }
+    if (bufferOpt.max > 0 && bufSize > bufferOpt.max) {
+      // the clamped size would be smaller than what autotuning can reach
+      WLOG(INFO) << "Buffer size " << bufSize << " for " << port_
+                 << " is clamped by " << bufferOpt.maxName << " "
+                 << bufferOpt.max << ", leaving it to the kernel autotuning";
+      continue;
+    }
+    if (setsockopt(fd_, SOL_SOCKET, bufferOpt.opt, &bufSize,
+                   sizeof(bufSize)) != 0) {
+      WPLOG(ERROR) << "Failed to set buffer size " << bufSize << " for "
+                   << port_ << " " << fd_;
+      continue;
+    }
+  }
+  WVLOG(1) << "Buffers auto sized for rtt " << rttMicros << " us, size "
+           << bufSize << " send " << getSendBufferSize() << " receive "
+           << getReceiveBufferSize() << " port " << port_;
+}
+
 WdtSocket::~WdtSocket() {
   WVLOG(1) << "~WdtSocket " << port_ << " " << fd_;
   closeNoCheck();
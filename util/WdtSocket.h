@@ -1,10 +1,13 @@
 #pragma once
 
 #include <sys/socket.h>
+#include <sys/uio.h>
 #include <wdt/ErrorCodes.h>
 #include <wdt/Protocol.h>
 #include <wdt/util/CommonImpl.h>
 #include <wdt/util/EncryptionUtils.h>
+#include <wdt/util/Transport.h>
+#include <map>
 #include <memory>
 
 namespace facebook {
@@ -34,11 +37,100 @@ class WdtSocket {
   /// tries to read nbyte data with a specific and periodically checks for abort
   int readWithTimeout(char *buf, int nbyte, int timeoutMs, bool tryFull = true);
 
+  /**
+   * Reads the data available into buf, and once it is full into extraBuf,
+   * using a single readv. Like read() with tryFull set to false, returns as
+   * soon as some data is read. Encrypted sockets only read into buf, as data
+   * is decrypted in place.
+   *
+   * @return    number of bytes read in both buffers, else -1
+   */
+  int readv(char *buf, int nbyte, char *extraBuf, int extraNbyte);
+
   /// tries to write nbyte data and periodically checks for abort, if retry is
   /// true, socket tries to write as long as it makes some progress within a
   /// write timeout
   int write(char *buf, int nbyte, bool retry = false);
 
+  /// max number of buffers passed to writev()
+  static const int kMaxWritevBuffers = 4;
+
+  /**
+   * Writes several buffers with a single writev when possible, same semantics
+   * as write() for their concatenation. When encrypted, the buffers are
+   * encrypted in place; they are written one by one if an encryption tag has
+   * to be inserted. MSG_ZEROCOPY is not used.
+   *
+   * @param iov       buffers to write, empty ones are allowed
+   * @param iovcnt    number of buffers, at most kMaxWritevBuffers
+   * @param retry     same as for write()
+   *
+   * @return          total number of bytes written, else -1
+   */
+  int writev(const struct iovec *iov, int iovcnt, bool retry = false);
+
+  /**
+   * Sends nbyte bytes of a file directly from the page cache (sendfile),
+   * periodically checking for abort. Only valid for unencrypted sockets, or
+   * once kernel tls encrypts the writes (see isKtlsWriteEnabled()), and not
+   * when the data goes over rdma.
+   *
+   * @param fileFd      file to send from
+   * @param fileOffset  offset in the file of the first byte to send
+   * @param nbyte       number of bytes to send
+   *
+   * @return            nbyte in case of success, else -1
+   */
+  int sendFile(int fileFd, int64_t fileOffset, int nbyte);
+
+  /// @return   whether sendFile() is supported on this platform
+  static bool isSendFileSupported();
+
+  /**
+   * With zero_copy_writes, write() of large buffers only pins the pages and
+   * the kernel reads them till the data is acked, so a buffer must not be
+   * modified before the writes made from it are complete.
+   *
+   * @return    mark of the writes made so far, for the methods below
+   */
+  int64_t getZeroCopyWriteMark() const {
+    return zeroCopyMarkBase_ + zeroCopySendsIssued_;
+  }
+
+  /**
+   * Reads the completions available without blocking
+   *
+   * @return    whether the writes made before mark are complete
+   */
+  bool isZeroCopyWriteComplete(int64_t mark);
+
+  /**
+   * Blocks till the writes made before mark are complete
+   *
+   * @return    false in case of error or abort
+   */
+  bool waitForZeroCopyCompletions(int64_t mark);
+
+  /// blocks till all the writes made so far are complete
+  bool waitForZeroCopyCompletions() {
+    return waitForZeroCopyCompletions(getZeroCopyWriteMark());
+  }
+
+  /// @return   number of MSG_ZEROCOPY writes the kernel sent without copying
+  int64_t getNumZeroCopyWrites() const {
+    return numZeroCopyWrites_;
+  }
+
+  /// @return   number of MSG_ZEROCOPY writes the kernel ended up copying
+  int64_t getNumZeroCopyCopiedWrites() const {
+    return numZeroCopyCopiedWrites_;
+  }
+
+  /// @return   number of large writes that could not use MSG_ZEROCOPY
+  int64_t getNumZeroCopyFallbacks() const {
+    return numZeroCopyFallbacks_;
+  }
+
   /// writes the tag/mac (for gcm) and shuts down the write half of the
   /// underlying socket
   virtual ErrorCode shutdownWrites();
@@ -61,12 +153,27 @@ class WdtSocket {
   /// @return     current fd
   int getFd() const;
 
+  /// @return     fd to poll to wait for the socket to be readable, the
+  ///             current fd unless the data comes over another transport
+  int getPollFd() const;
+
   /// @return     port
   int getPort() const;
 
   /// @return     current encryption type
   EncryptionType getEncryptionType() const;
 
+  /// @return     whether the kernel encrypts the writes of the connection
+  bool isKtlsWriteEnabled() const {
+    return ktlsTx_;
+  }
+
+  /// @return     whether the kernel decrypts and authenticates the reads of
+  ///             the connection, in which case all the data read is verified
+  bool isKtlsReadEnabled() const {
+    return ktlsRx_;
+  }
+
   /// @return     possible non-retryable error
   ErrorCode getNonRetryableErrCode() const;
 
@@ -86,10 +193,58 @@ class WdtSocket {
   ///           fails to get unacked bytes for this socket
   int getUnackedBytes() const;
 
+  /// @return   whether a read would not block, without waiting
+  bool isReadable() const;
+
+  /// @return   smoothed rtt of the connection in microseconds measured by tcp,
+  ///           -1 if not available
+  int getRttMicros() const;
+
+  /**
+   * Samples TCP_INFO of the connection
+   *
+   * @param sample    filled with the sample of this connection, fields the
+   *                  kernel does not report are left 0
+   *
+   * @return          false if TCP_INFO is not available
+   */
+  bool getTcpInfo(TcpInfoSample &sample) const;
+
+  /**
+   * Records in the time breakdown of the thread whether the network or the
+   * receiver held back a write that blocked, from the congestion window and
+   * the bytes queued on the connection
+   */
+  void recordBlockedWrite();
+
+  /**
+   * If auto_buffer_size is set, grows the tcp send and receive buffers of
+   * the connection to the bandwidth delay product of the current rtt and
+   * auto_buffer_target_mbytes_per_sec. Buffers set explicitly through
+   * send_buffer_size/receive_buffer_size are left alone. Meant to be called
+   * once the settings exchange gave tcp an rtt sample.
+   */
+  void autoSizeBuffers();
+
+  /**
+   * Corks the connection: the kernel holds the partial segments written till
+   * it is uncorked (at most 200ms), so that small writes go out along with the
+   * next ones. Uncorking sends what is held right away
+   *
+   * @return    whether the cork could be changed
+   */
+  bool setCork(bool cork);
+
   int64_t getNumRead() const {
     return totalRead_;
   }
 
+  /// @return   number of bytes read which are covered by a verified encryption
+  ///           tag, always 0 without intermediate tags
+  int64_t getNumVerifiedRead() const {
+    return verifiedRead_;
+  }
+
   int64_t getNumWritten() const {
     return totalWritten_;
   }
@@ -99,6 +254,12 @@ class WdtSocket {
     ivChangeInterval_ = 0;
   }
 
+  /// the writes are encrypted in user space even with the ktls option, for
+  /// peers older than Protocol::KTLS_VERSION
+  void disableKtls() {
+    ktlsAllowed_ = false;
+  }
+
   virtual ~WdtSocket();
 
  protected:
@@ -142,6 +303,25 @@ class WdtSocket {
   // also sends the new iv
   bool checkAndChangeEncryptionIv();
 
+  /// attaches the tls ulp to the connection, once. @return false if the
+  /// kernel has no tls support
+  bool setupTlsUlp();
+
+  /**
+   * Hands the crypto of one direction of the connection to the kernel
+   *
+   * @param tx    true for writes, false for reads
+   * @param iv    iv exchanged in the encryption settings, split in salt and
+   *              explicit nonce of the tls records
+   *
+   * @return      whether the kernel accepted the key
+   */
+  bool enableKtls(bool tx, const std::string &iv);
+
+  /// @return   crypto worker to encrypt/decrypt nbyte bytes with, nullptr if
+  ///           they should be processed inline
+  CryptoWorker *getCryptoWorker(int nbyte);
+
   // writes to socket. Does not understand encryption
   int writeInternal(const char *buf, int nbyte, int timeoutMs, bool retry);
 
@@ -162,6 +342,18 @@ class WdtSocket {
   // manipulates DSCP Bits
   void setDscp(int dscp);
 
+  /// sets the tcp congestion control algorithm, if tcp_congestion_control is
+  /// set
+  void setCongestionControl();
+
+  /**
+   * Sets up the transport of the data of the connection just established,
+   * tcp unless rdma_transport or shm_transport is set
+   *
+   * @param isWriter    true on the side writing the data (the sender)
+   */
+  ErrorCode setupTransport(bool isWriter);
+
   /**
    * Returns ip and port for a socket address
    *
@@ -187,6 +379,13 @@ class WdtSocket {
 
   bool encryptionSettingsWritten_{false};
   bool encryptionSettingsRead_{false};
+  /// whether the writes can be encrypted by the kernel, see disableKtls()
+  bool ktlsAllowed_{true};
+  /// ktls: the tls ulp is attached to fd_
+  bool tlsUlpSet_{false};
+  /// ktls: the kernel encrypts the writes / decrypts the reads of fd_
+  bool ktlsTx_{false};
+  bool ktlsRx_{false};
   std::unique_ptr<AESEncryptor> encryptor_;
   std::unique_ptr<AESDecryptor> decryptor_;
   /// buffer used to encrypt/decrypt
@@ -196,6 +395,8 @@ class WdtSocket {
   int32_t writeTagInterval_{0};
 
   int64_t totalRead_{0};
+  /// value of totalRead_ when the last encryption tag was verified
+  int64_t verifiedRead_{0};
   int64_t totalWritten_{0};
 
   /// If this is true, then if we get a cmd other than encryption cmd from the
@@ -212,6 +413,28 @@ class WdtSocket {
   /// Have we already read the tag and completed decryption
   bool readsFinalized_{false};
 
+  /// fd SO_ZEROCOPY was setup for, -1 if none
+  int zeroCopyFd_{-1};
+  /// whether MSG_ZEROCOPY can be used on zeroCopyFd_
+  bool zeroCopyEnabled_{false};
+  /// mark of the first send on the current fd, the sends on the previous
+  /// fds are complete
+  int64_t zeroCopyMarkBase_{0};
+  /// number of MSG_ZEROCOPY sends accepted by the kernel on the current fd
+  uint32_t zeroCopySendsIssued_{0};
+  /// number of those sends, from the first one, whose completion has been
+  /// received
+  uint32_t zeroCopySendsCompleted_{0};
+  /// completions received ahead of older sends, first to last send id
+  std::map<uint32_t, uint32_t> zeroCopyCompletedRanges_;
+
+  int64_t numZeroCopyWrites_{0};
+  int64_t numZeroCopyCopiedWrites_{0};
+  int64_t numZeroCopyFallbacks_{0};
+
+  /// moves the bytes of the connection, set once connected
+  std::unique_ptr<Transport> transport_;
+
  private:
   void resetEncryptor();
 
@@ -227,6 +450,26 @@ class WdtSocket {
   /// @see ioWithAbortCheck
   int64_t writeWithAbortCheck(const char *buf, int64_t nbyte, int timeoutMs,
                               bool tryFull);
+  /// @see ioWithAbortCheck, uses MSG_ZEROCOPY when possible
+  int64_t zeroCopyWriteWithAbortCheck(const char *buf, int64_t nbyte,
+                                      int timeoutMs);
+
+  /// enables SO_ZEROCOPY on the current fd if not already done
+  bool setupZeroCopy();
+
+  /// forgets the sends of the current fd, once complete or reset
+  void resetZeroCopySends();
+
+  /**
+   * Reads the available zero copy completions from the socket error queue
+   *
+   * @return    false in case of an error other than an empty queue
+   */
+  bool readZeroCopyCompletions();
+
+  /// @see ioWithAbortCheck, the file offset is passed in place of the buffer
+  int64_t sendFileWithAbortCheck(int fileFd, int64_t fileOffset,
+                                 int64_t nbyte, int timeoutMs);
 
   /**
    * Tries to read/write numBytes amount of data from fd. Also, checks for abort
@@ -0,0 +1,258 @@
+/**
+ * Copyright (c) 2014-present, Facebook, Inc.
+ * All rights reserved.
+ *
+ * This source code is licensed under the BSD-style license found in the
+ * LICENSE file in the root directory of this source tree. An additional grant
+ * of patent rights can be found in the PATENTS file in the same directory.
+ */
+#include <wdt/util/WriteBehindController.h>
+
+#include <fcntl.h>
+#include <algorithm>
+#include <fstream>
+#include <string>
+
+namespace facebook {
+namespace wdt {
+
+const int64_t WriteBehindController::kMinWindow = 256 * 1024;
+
+/// weight of a new throughput measurement
+static const double kThroughputWeight = 0.3;
+
+/// dirty pressure from which the window shrinks, down to kMinWindow at 1
+static const double kPressureThreshold = 0.5;
+
+/// @return   value of a "key: value kB" line of /proc/meminfo in bytes, -1
+///           if not found
+static int64_t readMeminfoBytes(const std::string &contents,
+                                const std::string &key) {
+  const size_t pos = contents.find("\n" + key + ":");
+  if (pos == std::string::npos) {
+    return -1;
+  }
+  return std::strtoll(contents.c_str() + pos + key.size() + 2, nullptr, 10) *
+         1024;
+}
+
+/// @return   the number in a /proc/sys file, -1 if it can't be read
+static int64_t readProcNumber(const char *path) {
+  std::ifstream file(path);
+  int64_t value = -1;
+  if (!(file >> value)) {
+    return -1;
+  }
+  return value;
+}
+
+WriteBehindController::WriteBehindController(const WdtOptions &options)
+    : targetMillis_(std::max(1, options.write_behind_target_millis)),
+      maxWindow_(std::max<int64_t>(
+          kMinWindow, options.write_behind_max_window_mb * kMbToB)),
+      // till the disk is measured, the fixed interval is the best guess
+      initialWindow_(std::min<int64_t>(
+          maxWindow_, std::max<int64_t>(
+                          kMinWindow, options.disk_sync_interval_mb * kMbToB))),
+      window_(initialWindow_) {
+  flushThread_ = std::thread(&WriteBehindController::flushLoop, this);
+}
+
+WriteBehindController::~WriteBehindController() {
+  {
+    std::lock_guard<std::mutex> lock(mutex_);
+    stop_ = true;
+  }
+  workCond_.notify_all();
+  flushThread_.join();
+}
+
+int64_t WriteBehindController::addFile(int fd, int64_t offset) {
+  std::lock_guard<std::mutex> lock(mutex_);
+  const int64_t fileId = nextFileId_++;
+  File &file = files_[fileId];
+  file.fd = fd;
+  file.flushOffset = offset;
+  file.writtenOffset = offset;
+  file.lastWrite = Clock::now();
+  return fileId;
+}
+
+void WriteBehindController::recordWrite(int64_t fileId, int64_t size) {
+  bool notify = false;
+  {
+    std::lock_guard<std::mutex> lock(mutex_);
+    auto it = files_.find(fileId);
+    if (it == files_.end()) {
+      return;
+    }
+    File &file = it->second;
+    file.writtenOffset += size;
+    file.lastWrite = Clock::now();
+    notify = !file.busy && file.writtenOffset - file.flushOffset >= window_;
+  }
+  if (notify) {
+    workCond_.notify_one();
+  }
+}
+
+bool WriteBehindController::removeFile(int64_t fileId) {
+  File file;
+  {
+    std::unique_lock<std::mutex> lock(mutex_);
+    auto it = files_.find(fileId);
+    if (it == files_.end()) {
+      return true;
+    }
+    doneCond_.wait(lock, [&it] { return !it->second.busy; });
+    file = it->second;
+    files_.erase(it);
+  }
+  bool ok = !file.failed;
+#ifdef HAS_SYNC_FILE_RANGE
+  const int64_t size = file.writtenOffset - file.flushOffset;
+  if (ok && size > 0 &&
+      sync_file_range(file.fd, file.flushOffset, size,
+                      SYNC_FILE_RANGE_WRITE) != 0) {
+    WPLOG(ERROR) << "sync_file_range() failed for fd " << file.fd;
+    ok = false;
+  }
+#endif
+  return ok;
+}
+
+int64_t WriteBehindController::getWindowSize() const {
+  std::lock_guard<std::mutex> lock(mutex_);
+  return window_;
+}
+
+bool WriteBehindController::flushFile(File &file, int64_t offset,
+                                      int64_t size, int64_t &waitedMicros) {
+  waitedMicros = 0;
+#ifdef HAS_SYNC_FILE_RANGE
+  if (file.inFlightSize > 0) {
+    // returns once the previous window is on the disk
+    if (sync_file_range(file.fd, file.inFlightOffset, file.inFlightSize,
+                        SYNC_FILE_RANGE_WAIT_BEFORE | SYNC_FILE_RANGE_WRITE |
+                            SYNC_FILE_RANGE_WAIT_AFTER) != 0) {
+      WPLOG(ERROR) << "sync_file_range() wait failed for fd " << file.fd;
+      return false;
+    }
+    waitedMicros =
+        std::max<int64_t>(1, durationMicros(Clock::now() - file.inFlightStart));
+  }
+  if (sync_file_range(file.fd, offset, size, SYNC_FILE_RANGE_WRITE) != 0) {
+    WPLOG(ERROR) << "sync_file_range() failed for fd " << file.fd;
+    return false;
+  }
+  WVLOG(2) << "Writeback of [" << offset << " " << size << "] started for fd "
+           << file.fd;
+  file.inFlightOffset = offset;
+  file.inFlightSize = size;
+  file.inFlightStart = Clock::now();
+#endif
+  return true;
+}
+
+double WriteBehindController::getDirtyPressure() {
+  const auto now = Clock::now();
+  if (durationMillis(now - lastPressureCheck_) < 1000) {
+    return dirtyPressure_;
+  }
+  lastPressureCheck_ = now;
+  dirtyPressure_ = 0;
+  std::ifstream meminfo("/proc/meminfo");
+  if (!meminfo) {
+    return dirtyPressure_;
+  }
+  const std::string contents(
+      "\n" + std::string(std::istreambuf_iterator<char>(meminfo),
+                         std::istreambuf_iterator<char>()));
+  const int64_t dirty = readMeminfoBytes(contents, "Dirty");
+  const int64_t writeback = readMeminfoBytes(contents, "Writeback");
+  if (dirty < 0 || writeback < 0) {
+    return dirtyPressure_;
+  }
+  int64_t threshold = readProcNumber("/proc/sys/vm/dirty_background_bytes");
+  if (threshold <= 0) {
+    // the ratio applies to the memory available for the page cache
+    const int64_t ratio =
+        readProcNumber("/proc/sys/vm/dirty_background_ratio");
+    const int64_t available = readMeminfoBytes(contents, "MemAvailable");
+    if (ratio <= 0 || available <= 0) {
+      return dirtyPressure_;
+    }
+    threshold = available / 100 * ratio;
+  }
+  dirtyPressure_ = (double)(dirty + writeback) / threshold;
+  WVLOG(1) << "Dirty pressure " << dirtyPressure_ << ", " << dirty
+           << " dirty and " << writeback << " writeback bytes for a threshold "
+           << "of " << threshold;
+  return dirtyPressure_;
+}
+
+void WriteBehindController::updateWindowLocked(double dirtyPressure) {
+  double window = initialWindow_;
+  if (throughput_ > 0) {
+    window = throughput_ * targetMillis_ / 1000;
+  }
+  if (dirtyPressure >= 1) {
+    window = kMinWindow;
+  } else if (dirtyPressure > kPressureThreshold) {
+    window *= (1 - dirtyPressure) / (1 - kPressureThreshold);
+  }
+  window_ = std::min<int64_t>(maxWindow_,
+                              std::max<int64_t>(kMinWindow, (int64_t)window));
+}
+
+void WriteBehindController::flushLoop() {
+  std::unique_lock<std::mutex> lock(mutex_);
+  while (!stop_) {
+    workCond_.wait_for(lock, std::chrono::milliseconds(targetMillis_));
+    if (stop_) {
+      break;
+    }
+    lock.unlock();
+    const double dirtyPressure = getDirtyPressure();
+    lock.lock();
+    updateWindowLocked(dirtyPressure);
+    const auto now = Clock::now();
+    for (auto it = files_.begin(); it != files_.end() && !stop_; ++it) {
+      File &file = it->second;
+      const int64_t size = file.writtenOffset - file.flushOffset;
+      // a file no longer written to is flushed even below the window
+      if (file.failed || size <= 0 ||
+          (size < window_ &&
+           durationMillis(now - file.lastWrite) < targetMillis_)) {
+        continue;
+      }
+      const int64_t offset = file.flushOffset;
+      const int64_t inFlightSize = file.inFlightSize;
+      // the previous window of a file written to slowly took longer to
+      // complete than the disk needed, it is not a measurement
+      const bool measure = size >= window_;
+      file.busy = true;
+      lock.unlock();
+      int64_t waitedMicros;
+      const bool ok = flushFile(file, offset, size, waitedMicros);
+      lock.lock();
+      file.busy = false;
+      if (!ok) {
+        file.failed = true;
+      } else {
+        file.flushOffset += size;
+      }
+      if (measure && waitedMicros > 0) {
+        const double throughput = inFlightSize * 1e6 / waitedMicros;
+        throughput_ = throughput_ > 0
+                          ? (1 - kThroughputWeight) * throughput_ +
+                                kThroughputWeight * throughput
+                          : throughput;
+        updateWindowLocked(dirtyPressure);
+      }
+      doneCond_.notify_all();
+    }
+  }
+}
+}
+}
@@ -0,0 +1,137 @@
+/**
+ * Copyright (c) 2014-present, Facebook, Inc.
+ * All rights reserved.
+ *
+ * This source code is licensed under the BSD-style license found in the
+ * LICENSE file in the root directory of this source tree. An additional grant
+ * of patent rights can be found in the PATENTS file in the same directory.
+ */
+#pragma once
+
+#include <wdt/Reporting.h>
+#include <wdt/WdtOptions.h>
+
+#include <condition_variable>
+#include <map>
+#include <mutex>
+#include <thread>
+
+namespace facebook {
+namespace wdt {
+
+/**
+ * Starts the writeback of the data written by the receiver threads from a
+ * background thread, instead of each thread calling sync_file_range every
+ * disk_sync_interval_mb. The flush window adapts to the disk: the time the
+ * previous window of a file took to reach the disk gives the rate the disk
+ * keeps up with (the disk throughput when it is the bottleneck, else the rate
+ * data comes in at), and the window is sized to write_behind_target_millis
+ * of it, between kMinWindow and write_behind_max_window_mb. The window
+ * shrinks when the dirty pages of the system get close to the background
+ * writeback threshold, so that the kernel never has to flush a large backlog
+ * at once. At most one window per file is being written back at any time,
+ * which also bounds the data in flight. All the methods are thread safe.
+ */
+class WriteBehindController {
+ public:
+  /// smallest flush window
+  static const int64_t kMinWindow;
+
+  explicit WriteBehindController(const WdtOptions &options);
+
+  /// stops the flush thread, the data not flushed is left to the kernel
+  ~WriteBehindController();
+
+  /**
+   * Registers a file being written sequentially from offset
+   *
+   * @return    id of the file for the other calls
+   */
+  int64_t addFile(int fd, int64_t offset);
+
+  /// records that size more bytes were written at the end of the file
+  void recordWrite(int64_t fileId, int64_t size);
+
+  /**
+   * Starts the writeback of what was written and not flushed yet, and
+   * forgets the file. Waits for the flush thread to be done with the file,
+   * so that the fd can be closed after this
+   *
+   * @return    false if sync_file_range failed for the file
+   */
+  bool removeFile(int64_t fileId);
+
+  /// @return   current flush window in bytes
+  int64_t getWindowSize() const;
+
+ private:
+  /// a file registered
+  struct File {
+    int fd{-1};
+    /// start of the data not flushed yet
+    int64_t flushOffset{0};
+    /// end of the data written
+    int64_t writtenOffset{0};
+    /// range whose writeback was started last and not waited for
+    int64_t inFlightOffset{0};
+    int64_t inFlightSize{0};
+    /// when the writeback of the in flight range was started
+    Clock::time_point inFlightStart;
+    /// last write recorded
+    Clock::time_point lastWrite;
+    /// set while the flush thread uses the fd
+    bool busy{false};
+    bool failed{false};
+  };
+
+  /// main loop of the flush thread
+  void flushLoop();
+
+  /**
+   * Waits for the writeback of the window of the file in flight, if any,
+   * and starts the one of size bytes from offset. Called without mutex_
+   * held, with the file busy
+   *
+   * @param waitedMicros    set to the time the window in flight took to be
+   *                        written back, 0 if there was none
+   *
+   * @return                false if sync_file_range failed
+   */
+  bool flushFile(File &file, int64_t offset, int64_t size,
+                 int64_t &waitedMicros);
+
+  /**
+   * @return    dirty and writeback memory of the system as a fraction of the
+   *            background writeback threshold, refreshed at most once per
+   *            second. 0 if unknown. Called by the flush thread only
+   */
+  double getDirtyPressure();
+
+  /// recomputes window_ from the throughput and the dirty pressure, mutex_
+  /// has to be held
+  void updateWindowLocked(double dirtyPressure);
+
+  const int64_t targetMillis_;
+  const int64_t maxWindow_;
+  /// window till the writeback is measured
+  const int64_t initialWindow_;
+
+  mutable std::mutex mutex_;
+  std::map<int64_t, File> files_;
+  int64_t nextFileId_{0};
+  /// rate the writeback keeps up with, bytes/sec, 0 till measured
+  double throughput_{0};
+  /// last dirty pressure read, and when
+  double dirtyPressure_{0};
+  Clock::time_point lastPressureCheck_;
+  /// flush window, recomputed after each flush
+  int64_t window_;
+  bool stop_{false};
+  /// notified when a file has a window to flush, or to stop
+  std::condition_variable workCond_;
+  /// notified when the flush thread is done with a file
+  std::condition_variable doneCond_;
+  std::thread flushThread_;
+};
+}
+}
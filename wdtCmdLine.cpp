@@ -40,13 +40,46 @@ DEFINE_bool(run_as_daemon, false,
 DEFINE_string(directory, ".", "Source/Destination directory");
 DEFINE_string(manifest, "",
               "If specified, then we will read a list of files and optional "
-              "sizes from this file, use - for stdin");
+              "sizes, odirect flags and priorities from this file (tab "
+              "separated), use - for stdin");
 DEFINE_string(
     destination, "",
     "empty is server (destination) mode, non empty is destination host");
 
 DEFINE_string(hostname, "", "override hostname in transfe request");
 
+DEFINE_string(copy_to, "",
+              "If set, copies the source directory into this directory of the "
+              "same host, in the kernel (reflinks where the filesystem allows "
+              "it) instead of through a receiver");
+
+DEFINE_string(forward_url, "",
+              "Receiver only: connection url of another receiver, to which "
+              "each block received is forwarded once written. Receivers can "
+              "be chained this way to distribute the same directory. Several "
+              "space separated urls forward each block to all of them");
+
+DEFINE_string(stream_name, "",
+              "Sender only: if set, stdin is read till its end and sent as a "
+              "file of this relative path, e.g. tar c dir | wdt -stream_name "
+              "dir.tar -connection_url ... The url can not be read from stdin "
+              "then");
+
+DEFINE_string(stream_output, "",
+              "Receiver only: relative path of a file streamed by the sender, "
+              "also copied to stdout in order as it is received, e.g. wdt "
+              "-stream_output dir.tar | tar x. The connection url is then "
+              "printed to stderr");
+
+DEFINE_string(receiver_addresses, "",
+              "Comma separated other addresses of the receiver (e.g one per "
+              "NIC), added to the transfer request. Sender connections are "
+              "spread across them");
+
+DEFINE_string(local_addresses, "",
+              "Comma separated local addresses the sender connections are "
+              "bound to, connections are spread across them");
+
 DEFINE_bool(parse_transfer_log, false,
             "If true, transfer log is parsed and fixed");
 
@@ -90,6 +123,13 @@ DEFINE_string(namespace, "", "WDT namespace (e.g shard)");
 DEFINE_string(dest_id, "",
               "Unique destination identifier (will default to hostname)");
 
+DEFINE_string(metrics_file, "",
+              "If set, the receiver writes its metrics to this file in the "
+              "Prometheus text format, e.g. for a textfile collector");
+
+DEFINE_int32(metrics_interval_seconds, 10,
+             "Interval in seconds between the writes of metrics_file");
+
 DECLARE_bool(help);
 
 using namespace facebook::wdt;
@@ -143,21 +183,102 @@ void cancelAbort() {
   std::this_thread::yield();
 }
 
+/// Periodically writes the metrics of a receiver to FLAGS_metrics_file
+class MetricsFileWriter {
+ public:
+  explicit MetricsFileWriter(Receiver &receiver) : receiver_(receiver) {
+    if (!FLAGS_metrics_file.empty()) {
+      thread_ = std::thread(&MetricsFileWriter::run, this);
+    }
+  }
+
+  ~MetricsFileWriter() {
+    {
+      std::lock_guard<std::mutex> lock(mutex_);
+      stop_ = true;
+    }
+    cond_.notify_one();
+    if (thread_.joinable()) {
+      thread_.join();
+    }
+  }
+
+ private:
+  void run() {
+    std::unique_lock<std::mutex> lock(mutex_);
+    while (!stop_) {
+      writeMetrics();
+      cond_.wait_for(lock,
+                     std::chrono::seconds(FLAGS_metrics_interval_seconds),
+                     [this] { return stop_; });
+    }
+  }
+
+  void writeMetrics() {
+    NamespaceMetrics namespaceMetrics;
+    namespaceMetrics.wdtNamespace = FLAGS_namespace;
+    namespaceMetrics.numReceivers = 1;
+    namespaceMetrics.received = receiver_.getMetrics();
+    WdtMetrics metrics;
+    metrics.namespaces.push_back(namespaceMetrics);
+    // renamed once complete, so that readers never see a partial file
+    const std::string tmpPath = FLAGS_metrics_file + ".tmp";
+    {
+      std::ofstream out(tmpPath);
+      out << metrics.toPrometheus();
+      if (!out) {
+        WPLOG(ERROR) << "Unable to write metrics to " << tmpPath;
+        return;
+      }
+    }
+    if (rename(tmpPath.c_str(), FLAGS_metrics_file.c_str()) != 0) {
+      WPLOG(ERROR) << "Unable to rename " << tmpPath << " to "
+                   << FLAGS_metrics_file;
+    }
+  }
+
+  Receiver &receiver_;
+  std::mutex mutex_;
+  std::condition_variable cond_;
+  bool stop_{false};
+  std::thread thread_;
+};
+
 void readManifest(std::istream &fin, WdtTransferRequest &req, bool dfltDirect) {
   std::string line;
   while (std::getline(fin, line)) {
     std::vector<std::string> fields;
     folly::split('\t', line, fields, true);
-    if (fields.empty() || fields.size() > 3) {
+    if (fields.empty() || fields.size() > 4) {
       WLOG(FATAL) << "Invalid input manifest: " << line;
     }
     int64_t filesize = fields.size() > 1 ? folly::to<int64_t>(fields[1]) : -1;
     bool odirect = fields.size() > 2 ? folly::to<bool>(fields[2]) : dfltDirect;
     req.fileInfo.emplace_back(fields[0], filesize, odirect);
+    if (fields.size() > 3) {
+      req.fileInfo.back().priority = folly::to<int>(fields[3]);
+    }
   }
   req.disableDirectoryTraversal = true;
 }
 
+/// reads the files of FLAGS_manifest into the request, if set
+void readManifestFlag(WdtTransferRequest &req, bool dfltDirect) {
+  if (FLAGS_manifest.empty()) {
+    return;
+  }
+  // Each line should have the filename and optionally the filesize, the
+  // odirect flag and the priority, separated by tabs
+  if (FLAGS_manifest == "-") {
+    readManifest(std::cin, req, dfltDirect);
+  } else {
+    std::ifstream fin(FLAGS_manifest);
+    readManifest(fin, req, dfltDirect);
+    fin.close();
+  }
+  WLOG(INFO) << "Using files lists, number of files " << req.fileInfo.size();
+}
+
 namespace GFLAGS_NAMESPACE {
 extern GFLAGS_DLL_DECL void (*gflags_exitfunc)(int);
 }
@@ -196,6 +317,9 @@ int main(int argc, char *argv[]) {
   usage.append(
       "\nconnection URL produced by the receiver, including encryption"
       " key, from stdin.");
+  usage.append("\nTo copy between directories of the same host:\n\t");
+  usage.append(GFLAGS_NAMESPACE::ProgramInvocationShortName());
+  usage.append(" -directory srcdir -copy_to destdir");
   usage.append("\nUse --help to see all the options.");
   GFLAGS_NAMESPACE::SetUsageMessage(usage);
   GFLAGS_NAMESPACE::gflags_exitfunc = [](int code) {
@@ -230,6 +354,11 @@ int main(int argc, char *argv[]) {
   signal(SIGUSR1, sigUSR1Handler);
 
   std::string connectUrl;
+  if (!badGflagFound && argc == 2 && !FLAGS_stream_name.empty()) {
+    WLOG(ERROR) << "Sender can not read the url from the stdin it streams, "
+                << "use -connection_url";
+    return URI_PARSE_ERROR;
+  }
   if (!badGflagFound && argc == 2) {
     std::getline(std::cin, connectUrl);
     if (connectUrl.empty()) {
@@ -297,7 +426,19 @@ int main(int argc, char *argv[]) {
   if (!FLAGS_hostname.empty()) {
     reqPtr->hostName = FLAGS_hostname;
   }
-  if (FLAGS_destination.empty() && connectUrl.empty()) {
+  if (!FLAGS_receiver_addresses.empty()) {
+    req.receiverAddresses =
+        WdtTransferRequest::parseAddressList(FLAGS_receiver_addresses);
+  }
+  if (!FLAGS_local_addresses.empty()) {
+    req.localAddresses =
+        WdtTransferRequest::parseAddressList(FLAGS_local_addresses);
+  }
+  if (!FLAGS_copy_to.empty()) {
+    // Local copy mode, no receiver
+    readManifestFlag(req, options.odirect_reads);
+    retCode = wdt.wdtCopyLocal(req, FLAGS_copy_to, setupAbortChecker());
+  } else if (FLAGS_destination.empty() && connectUrl.empty()) {
     Receiver receiver(req);
     WdtOptions &recOptions = receiver.getWdtOptions();
     if (FLAGS_run_as_daemon) {
@@ -310,6 +451,27 @@ int main(int argc, char *argv[]) {
       recOptions.enable_download_resumption = true;
       receiver.setRecoveryId(FLAGS_recovery_id);
     }
+    std::vector<std::string> forwardUrls;
+    folly::split(' ', FLAGS_forward_url, forwardUrls, true);
+    for (const std::string &forwardUrl : forwardUrls) {
+      WdtTransferRequest forwardReq(forwardUrl);
+      if (forwardReq.errorCode != OK) {
+        WLOG(ERROR) << "Invalid forward url \"" << forwardUrl
+                    << "\" : " << errorCodeToStr(forwardReq.errorCode);
+        return ERROR;
+      }
+      receiver.addForwardRequest(forwardReq);
+    }
+    if (!FLAGS_stream_output.empty()) {
+      receiver.setStreamOutput(FLAGS_stream_output, STDOUT_FILENO);
+    }
+    if (recOptions.receiver_runtime_threads > 0) {
+      auto runtime = std::make_shared<ReceiverRuntime>(
+          recOptions.receiver_runtime_threads);
+      if (runtime->isValid()) {
+        receiver.setRuntime(std::move(runtime));
+      }
+    }
     WdtTransferRequest augmentedReq = receiver.init();
     retCode = augmentedReq.errorCode;
     if (retCode == FEWER_PORTS) {
@@ -325,9 +487,10 @@ int main(int argc, char *argv[]) {
     // In the log:
     WLOG(INFO) << "Starting receiver with connection url "
                << augmentedReq.getLogSafeString();  // The url without secret
-    // on stdout: the one with secret:
-    std::cout << augmentedReq.genWdtUrlWithSecret() << std::endl;
-    std::cout.flush();
+    // on stdout: the one with secret, unless stdout gets the stream output
+    std::ostream &urlOut = FLAGS_stream_output.empty() ? std::cout : std::cerr;
+    urlOut << augmentedReq.genWdtUrlWithSecret() << std::endl;
+    urlOut.flush();
     if (FLAGS_fork) {
       pid_t cpid = fork();
       if (cpid == -1) {
@@ -342,6 +505,7 @@ int main(int argc, char *argv[]) {
       close(1);
     }
     setAbortChecker(receiver);
+    MetricsFileWriter metricsFileWriter(receiver);
     if (!FLAGS_run_as_daemon) {
       retCode = receiver.transferAsync();
       if (retCode == OK) {
@@ -354,18 +518,10 @@ int main(int argc, char *argv[]) {
     }
   } else {
     // Sender mode
-    if (!FLAGS_manifest.empty()) {
-      // Each line should have the filename and optionally
-      // the filesize separated by a single space
-      if (FLAGS_manifest == "-") {
-        readManifest(std::cin, req, options.odirect_reads);
-      } else {
-        std::ifstream fin(FLAGS_manifest);
-        readManifest(fin, req, options.odirect_reads);
-        fin.close();
-      }
-      WLOG(INFO) << "Using files lists, number of files "
-                 << req.fileInfo.size();
+    readManifestFlag(req, options.odirect_reads);
+    if (!FLAGS_stream_name.empty()) {
+      req.fileInfo.emplace_back(STDIN_FILENO, -1, FLAGS_stream_name);
+      req.disableDirectoryTraversal = true;
     }
     WLOG(INFO) << "Making Sender with encryption set = "
                << req.encryptionData.isSet();